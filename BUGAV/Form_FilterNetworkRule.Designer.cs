@@ -121,7 +121,8 @@
             this.FilterNetworkRule_comboBox_Action.Items.AddRange(new object[] {
             "Alert",
             "Drop",
-            "Ignore"});
+            "Ignore",
+            "RateLimit"});
             this.FilterNetworkRule_comboBox_Action.Location = new System.Drawing.Point(112, 24);
             this.FilterNetworkRule_comboBox_Action.Name = "FilterNetworkRule_comboBox_Action";
             this.FilterNetworkRule_comboBox_Action.Size = new System.Drawing.Size(162, 21);
@@ -133,6 +134,7 @@
             this.FilterNetworkRule_comboBox_EtherType.FormattingEnabled = true;
             this.FilterNetworkRule_comboBox_EtherType.Items.AddRange(new object[] {
             "IP",
+            "IPv6",
             "ARP",
             "Ignore"});
             this.FilterNetworkRule_comboBox_EtherType.Location = new System.Drawing.Point(112, 103);
@@ -60,6 +60,8 @@ namespace BUGAV {
         RuleComponentType type;
         public string fieldStr;
         public IEnumerable<byte> fieldBytes;
+        public IEnumerable<byte> extentBytes;   // prefix length ("a.b.c.d/len") or last port ("first-last")
+        public IEnumerable<byte> ip6Bytes;      // IPv6 address ("x:y::z/len"), zero for IPv4
 
         public RuleComponent(RuleComponentType _type, string _fieldStr) {
             type = _type;
@@ -68,13 +70,17 @@ namespace BUGAV {
         }
         public void ToBytes() {
             byte[] arr = null;
+            byte[] extent = new byte[] { };
+            byte[] ip6 = new byte[16];
             IPAddress address = null;
             ushort port;
+            string[] parts;
             switch (type) {
                 case RuleComponentType.action:
                     if(fieldStr == "Alert") { arr = new byte[] { 0x01 }; } 
                     else if(fieldStr == "Drop") { arr = new byte[] { 0x02 }; }
                     else if(fieldStr == "Ignore") { arr = new byte[] { 0x00 }; }
+                    else if(fieldStr == "RateLimit") { arr = new byte[] { 0x03 }; }
                     break;
                 //case RuleComponentType.direction: 
                 //    if(fieldStr == "From") { arr = new byte[] { 0x01 }; } 
@@ -83,6 +89,7 @@ namespace BUGAV {
                 //    break;
                 case RuleComponentType.ether_type:
                     if(fieldStr == "IP") { arr = new byte[] { 0x08, 0x00 }; } 
+                    else if(fieldStr == "IPv6") { arr = new byte[] { 0x86, 0xDD }; }
                     else if(fieldStr == "ARP") { arr = new byte[] { 0x08, 0x06 }; }
                     else if(fieldStr == "Ignore") { arr = new byte[] { 0x00,0x00 }; }
                     break;
@@ -94,36 +101,68 @@ namespace BUGAV {
                     else if(fieldStr == "Ignore") { arr = new byte[] { 0x00 }; }
                     break;
                 case RuleComponentType.source_ip:
+                    extent = new byte[] { 0x00 };
                     if (fieldStr == "Ignore") { arr = new byte[] { 0x00, 0x00, 0x00, 0x00 }; }
-                    else{
-                        address = IPAddress.Parse(fieldStr);
+                    else {
+                        parts = fieldStr.Split('/');
+                        address = IPAddress.Parse(parts[0]);
                         arr = address.GetAddressBytes();
+                        if (arr.Length == 16) {
+                            // IPv6 goes to its own field, the IPv4 one stays "Ignore"
+                            ip6 = arr;
+                            arr = new byte[] { 0x00, 0x00, 0x00, 0x00 };
+                        }
+                        if (parts.Length > 1) { extent = new byte[] { byte.Parse(parts[1]) }; }
                     }
                     break;
                 case RuleComponentType.destination_ip:
-                    if (fieldStr == "Ignore") { arr = new byte[] { 0x00, 0x00, 0x00, 0x00 }; } 
+                    extent = new byte[] { 0x00 };
+                    if (fieldStr == "Ignore") { arr = new byte[] { 0x00, 0x00, 0x00, 0x00 }; }
                     else {
-                        address = IPAddress.Parse(fieldStr);
+                        parts = fieldStr.Split('/');
+                        address = IPAddress.Parse(parts[0]);
                         arr = address.GetAddressBytes();
+                        if (arr.Length == 16) {
+                            // IPv6 goes to its own field, the IPv4 one stays "Ignore"
+                            ip6 = arr;
+                            arr = new byte[] { 0x00, 0x00, 0x00, 0x00 };
+                        }
+                        if (parts.Length > 1) { extent = new byte[] { byte.Parse(parts[1]) }; }
                     }
                     break;
                 case RuleComponentType.source_port:
-                    if (fieldStr == "Ignore") { arr = new byte[] { 0x00, 0x00 }; } 
+                    extent = new byte[] { 0x00, 0x00 };
+                    if (fieldStr == "Ignore") { arr = new byte[] { 0x00, 0x00 }; }
                     else {
-                        port = ushort.Parse(fieldStr);
-                        arr = BitConverter.GetBytes(port);
+                        // Network byte order, as compared against the header
+                        parts = fieldStr.Split('-');
+                        port = ushort.Parse(parts[0]);
+                        arr = new byte[] { (byte)(port >> 8), (byte)port };
+                        if (parts.Length > 1) {
+                            port = ushort.Parse(parts[1]);
+                            extent = new byte[] { (byte)(port >> 8), (byte)port };
+                        }
                     }
                     break;
                 case RuleComponentType.destination_port:
-                    if (fieldStr == "Ignore") { arr = new byte[] { 0x00, 0x00 }; } 
+                    extent = new byte[] { 0x00, 0x00 };
+                    if (fieldStr == "Ignore") { arr = new byte[] { 0x00, 0x00 }; }
                     else {
-                        port = ushort.Parse(fieldStr);
-                        arr = BitConverter.GetBytes(port);
+                        // Network byte order, as compared against the header
+                        parts = fieldStr.Split('-');
+                        port = ushort.Parse(parts[0]);
+                        arr = new byte[] { (byte)(port >> 8), (byte)port };
+                        if (parts.Length > 1) {
+                            port = ushort.Parse(parts[1]);
+                            extent = new byte[] { (byte)(port >> 8), (byte)port };
+                        }
                     }
                     break;
             }
             Console.WriteLine(BitConverter.ToString(arr));
             fieldBytes = arr.Cast<byte>();
+            extentBytes = extent.Cast<byte>();
+            ip6Bytes = ip6.Cast<byte>();
         }
 
 
@@ -170,7 +209,13 @@ namespace BUGAV {
                 Concat(compSourceIp.fieldBytes).
                 Concat(compDestinationIp.fieldBytes).
                 Concat(compSourcePort.fieldBytes).
-                Concat(compDestinationPort.fieldBytes);
+                Concat(compDestinationPort.fieldBytes).
+                Concat(compSourceIp.extentBytes).
+                Concat(compDestinationIp.extentBytes).
+                Concat(compSourcePort.extentBytes).
+                Concat(compDestinationPort.extentBytes).
+                Concat(compSourceIp.ip6Bytes).
+                Concat(compDestinationIp.ip6Bytes);
 
             Console.WriteLine(BitConverter.ToString(ruleBytes.ToArray()));
         }
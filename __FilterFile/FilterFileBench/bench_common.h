@@ -0,0 +1,56 @@
+#pragma once
+//
+// Shared helpers for the user-mode benchmarks. Build everything in this
+// directory with -DFILEFLT_USER_MODE -I../FilterFileDrv (see README.md).
+//
+
+#include <stdio.h>
+#include <time.h>
+#include "portable.h"
+
+static inline ULONG64 bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONG64)ts.tv_sec * 1000000000ULL + (ULONG64)ts.tv_nsec;
+}
+
+static inline ULONG bench_rand(ULONG64* state) {
+    // xorshift64*
+    ULONG64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (ULONG)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// Keeps the optimizer from discarding benchmark results
+static volatile ULONG bench_sink;
+
+// Appends an ASCII string to a UTF-16 name
+static inline VOID bench_append(PUNICODE_STRING name, const char* s) {
+    while (*s != '\0' && name->Length + sizeof(WCHAR) <= name->MaximumLength) {
+        name->Buffer[name->Length / sizeof(WCHAR)] = (WCHAR)(UCHAR)*s++;
+        name->Length += sizeof(WCHAR);
+    }
+}
+
+// Randomly changes the case of the letters of a name, Latin-1 included
+static inline VOID bench_mix_case(PUNICODE_STRING name, ULONG64* rng) {
+    for (ULONG i = 0; i < name->Length / sizeof(WCHAR); i++) {
+        WCHAR c = name->Buffer[i];
+        if ((bench_rand(rng) & 1) == 0) { continue; }
+        if ((c >= 'a' && c <= 'z') || (c >= 0xE0 && c <= 0xFE && c != 0xF7)) { name->Buffer[i] = (WCHAR)(c - 0x20); }
+        else if ((c >= 'A' && c <= 'Z') || (c >= 0xC0 && c <= 0xDE && c != 0xD7)) { name->Buffer[i] = (WCHAR)(c + 0x20); }
+    }
+}
+
+// The system's case-insensitive compare, which the old list walk called
+// for every protected entry: lengths first, then an upcase per character.
+static inline BOOLEAN bench_equal_nocase(PCUNICODE_STRING a, PCUNICODE_STRING b) {
+    if (a->Length != b->Length) { return FALSE; }
+    for (ULONG i = 0; i < a->Length / sizeof(WCHAR); i++) {
+        if (RtlUpcaseUnicodeChar(a->Buffer[i]) != RtlUpcaseUnicodeChar(b->Buffer[i])) { return FALSE; }
+    }
+    return TRUE;
+}
@@ -0,0 +1,400 @@
+//
+// Correctness and match cost of the wildcard rule trie (pathtrie.c). A
+// table of hand-written cases runs first; then 1k, 10k and 100k generated
+// rules are built and matched against generated names, and every match on
+// a sample of names is checked against a rule-by-rule reference matcher.
+// Generated rules carry random operation masks, so the check covers the
+// union the trie returns as well as the match.
+//
+//   gcc -O2 -DFILEFLT_USER_MODE -I../FilterFileDrv bench_pathtrie.c
+//       ../FilterFileDrv/pathtrie.c ../FilterFileDrv/nameset.c -o bench_pathtrie
+//
+
+#include "bench_common.h"
+#include "pathtrie.h"
+
+#define MAX_NAME        256
+#define MAX_PARTS       80
+#define QUERIES         (1 << 16)
+#define PASSES          16
+#define CHECK_BUDGET    (1 << 26)       // reference rule visits per rule count
+
+//
+// Reference: split both sides into upcased components and test each rule
+// in turn, following the grammar in pathtrie.h.
+//
+typedef struct _PARTS {
+    ULONG   count;
+    ULONG   start[MAX_PARTS];
+    ULONG   length[MAX_PARTS];
+    WCHAR   text[MAX_NAME];
+} PARTS;
+
+static BOOLEAN split(PCUNICODE_STRING name, PARTS* parts) {
+    ULONG n = name->Length / sizeof(WCHAR);
+    parts->count = 0;
+    for (ULONG i = 0; i < n; i++) { parts->text[i] = RtlUpcaseUnicodeChar(name->Buffer[i]); }
+    for (ULONG i = 0; i < n;) {
+        ULONG j = i;
+        while (j < n && parts->text[j] != '\\') { j++; }
+        if (j > i) {
+            if (parts->count == MAX_PARTS) { return FALSE; }
+            parts->start[parts->count] = i;
+            parts->length[parts->count] = j - i;
+            parts->count++;
+        }
+        i = j + 1;
+    }
+    return TRUE;
+}
+
+static BOOLEAN part_is(const PARTS* p, ULONG k, const char* s) {
+    ULONG n = (ULONG)strlen(s);
+    if (p->length[k] != n) { return FALSE; }
+    for (ULONG i = 0; i < n; i++) {
+        if (p->text[p->start[k] + i] != (WCHAR)s[i]) { return FALSE; }
+    }
+    return TRUE;
+}
+
+static BOOLEAN part_equal(const PARTS* a, ULONG i, const PARTS* b, ULONG j) {
+    return a->length[i] == b->length[j] &&
+        memcmp(a->text + a->start[i], b->text + b->start[j], a->length[i] * sizeof(WCHAR)) == 0;
+}
+
+typedef struct _REF_RULE {
+    PARTS   parts;
+    ULONG   key;                // components of the key
+    ULONG   kind;               // 0 exact, 1 *, 2 **, 3 *.ext, 4 **\*.ext, -1 invalid
+    ULONG   ext;                // component holding "*.ext"
+    USHORT  mask;
+} REF_RULE;
+
+static VOID ref_parse(PCUNICODE_STRING rule, REF_RULE* r) {
+    PARTS* p = &r->parts;
+    ULONG last;
+
+    r->kind = (ULONG)-1;
+    if (!split(rule, p) || p->count == 0) { return; }
+    last = p->count - 1;
+    r->ext = last;
+    if (part_is(p, last, "*")) { r->kind = 1; r->key = last; }
+    else if (part_is(p, last, "**")) { r->kind = 2; r->key = last; }
+    else if (p->length[last] > 2 && p->text[p->start[last]] == '*' && p->text[p->start[last] + 1] == '.') {
+        for (ULONG i = 2; i < p->length[last]; i++) {
+            WCHAR c = p->text[p->start[last] + i];
+            if (c == '*' || c == '.') { return; }
+        }
+        if (last > 0 && part_is(p, last - 1, "**")) { r->kind = 4; r->key = last - 1; }
+        else { r->kind = 3; r->key = last; }
+    } else { r->kind = 0; r->key = p->count; }
+
+    for (ULONG k = 0; k < r->key; k++) {
+        for (ULONG i = 0; i < p->length[k]; i++) {
+            if (p->text[p->start[k] + i] == '*') { r->kind = (ULONG)-1; return; }
+        }
+    }
+    if (r->key > PT_PATH_TRIE_MAX_DEPTH) { r->kind = (ULONG)-1; }
+}
+
+// Extension of the last component, without the '.'
+static BOOLEAN ext_equal(const PARTS* name, const REF_RULE* r) {
+    ULONG last = name->count - 1, s = name->start[last], n = name->length[last], dot = n;
+    for (ULONG i = n; i > 0; i--) {
+        if (name->text[s + i - 1] == '.') { dot = i; break; }
+    }
+    if (dot == n) { return FALSE; }
+    ULONG rl = r->parts.length[r->ext] - 2;
+    return n - dot == rl && memcmp(name->text + s + dot, r->parts.text + r->parts.start[r->ext] + 2, rl * sizeof(WCHAR)) == 0;
+}
+
+static USHORT ref_match(const REF_RULE* rules, ULONG count, const PARTS* name) {
+    USHORT mask = 0;
+    for (ULONG i = 0; i < count; i++) {
+        const REF_RULE* r = &rules[i];
+        ULONG k;
+        if (r->kind == (ULONG)-1 || name->count < r->key) { continue; }
+        for (k = 0; k < r->key && part_equal(&r->parts, k, name, k); k++) { }
+        if (k < r->key) { continue; }
+        switch (r->kind) {
+        case 0: if (name->count == r->key) { mask |= r->mask; } break;
+        case 1: if (name->count == r->key + 1) { mask |= r->mask; } break;
+        case 2: if (name->count > r->key) { mask |= r->mask; } break;
+        case 3: if (name->count == r->key + 1 && ext_equal(name, r)) { mask |= r->mask; } break;
+        case 4: if (name->count > r->key && ext_equal(name, r)) { mask |= r->mask; } break;
+        }
+    }
+    return mask;
+}
+
+static VOID set_name(PUNICODE_STRING name, PWCH buffer, const char* s) {
+    name->Buffer = buffer;
+    name->Length = 0;
+    name->MaximumLength = MAX_NAME * sizeof(WCHAR);
+    bench_append(name, s);
+}
+
+static int run_cases(void) {
+    static const char* const rules[] = {
+        "\\Device\\HarddiskVolume2\\a\\*",
+        "\\Device\\HarddiskVolume2\\b\\**",
+        "\\Device\\HarddiskVolume2\\c\\*.txt",
+        "\\Device\\HarddiskVolume2\\d\\**\\*.Db",
+        "\\Device\\HarddiskVolume2\\x\\y\\z\\**",
+        "\\Device\\HarddiskVolume2\\x\\y",
+        "\\Device\\HarddiskVolume2\\x\\y\\w\\*",
+        "\\Device\\HarddiskVolume3\\\\e\\\\f\\",
+        "\\Device\\HarddiskVolume4\\**",
+        "\\Device\\HarddiskVolume2\\bad*name\\*",
+        "\\Device\\HarddiskVolume2\\mid\\**\\tail",
+        "\\Device\\HarddiskVolume2\\ext\\*.t*t",
+        "\\Device\\HarddiskVolume2\\ext\\*.tar.gz",
+    };
+    static const struct { const char* name; BOOLEAN match; } cases[] = {
+        { "\\Device\\HarddiskVolume2\\a", FALSE },
+        { "\\Device\\HarddiskVolume2\\a\\f", TRUE },
+        { "\\DEVICE\\harddiskvolume2\\A\\F.TXT", TRUE },
+        { "\\Device\\HarddiskVolume2\\a\\f\\g", FALSE },
+        { "\\Device\\HarddiskVolume2\\ab\\f", FALSE },
+        { "\\Device\\HarddiskVolume2\\b", FALSE },
+        { "\\Device\\HarddiskVolume2\\b\\f", TRUE },
+        { "\\Device\\HarddiskVolume2\\b\\f\\g\\h", TRUE },
+        { "\\Device\\HarddiskVolume2\\c\\f.txt", TRUE },
+        { "\\Device\\HarddiskVolume2\\c\\f.TxT", TRUE },
+        { "\\Device\\HarddiskVolume2\\c\\f.txt.bak", FALSE },
+        { "\\Device\\HarddiskVolume2\\c\\g\\f.txt", FALSE },
+        { "\\Device\\HarddiskVolume2\\c\\txt", FALSE },
+        { "\\Device\\HarddiskVolume2\\d\\f.db", TRUE },
+        { "\\Device\\HarddiskVolume2\\d\\1\\2\\3\\f.db", TRUE },
+        { "\\Device\\HarddiskVolume2\\d\\1\\2\\3\\f.dbx", FALSE },
+        { "\\Device\\HarddiskVolume2\\d.db", FALSE },
+        { "\\Device\\HarddiskVolume2\\x\\y", TRUE },
+        { "\\Device\\HarddiskVolume2\\x\\y\\", TRUE },
+        { "\\Device\\HarddiskVolume2\\x", FALSE },
+        { "\\Device\\HarddiskVolume2\\x\\y\\q", FALSE },
+        { "\\Device\\HarddiskVolume2\\x\\y\\z", FALSE },
+        { "\\Device\\HarddiskVolume2\\x\\y\\z\\q", TRUE },
+        { "\\Device\\HarddiskVolume2\\x\\y\\zz\\q", FALSE },
+        { "\\Device\\HarddiskVolume2\\x\\y\\w\\q", TRUE },
+        { "\\Device\\HarddiskVolume2\\x\\y\\w\\q\\r", FALSE },
+        { "\\Device\\HarddiskVolume3\\e\\f", TRUE },
+        { "\\Device\\HarddiskVolume3\\e", FALSE },
+        { "\\Device\\HarddiskVolume4", FALSE },
+        { "\\Device\\HarddiskVolume4\\anything\\at\\all", TRUE },
+        { "\\Device\\HarddiskVolume2\\bad*name\\f", FALSE },
+        { "\\Device\\HarddiskVolume2\\mid\\q\\tail", FALSE },
+        { "\\Device\\HarddiskVolume2\\ext\\f.txt", FALSE },
+        { "\\Device\\HarddiskVolume2\\ext\\f.tar.gz", FALSE },
+    };
+    const ULONG count = sizeof(rules) / sizeof(rules[0]);
+    static WCHAR buffers[sizeof(rules) / sizeof(rules[0])][MAX_NAME];
+    UNICODE_STRING names[sizeof(rules) / sizeof(rules[0])];
+    REF_RULE* ref = (REF_RULE*)malloc(count * sizeof(REF_RULE));
+    PPT_PATH_TRIE trie;
+    ULONG rejected, failures = 0;
+
+    for (ULONG i = 0; i < count; i++) {
+        set_name(&names[i], buffers[i], rules[i]);
+        ref_parse(&names[i], &ref[i]);
+        ref[i].mask = 1;
+    }
+    if (!NT_SUCCESS(PtPathTrieBuild(names, NULL, count, &trie, &rejected)) || trie == NULL) {
+        printf("build failed\n");
+        return 1;
+    }
+    if (rejected != 4) {
+        printf("MISMATCH: %u rules rejected, expected 4\n", rejected);
+        failures++;
+    }
+
+    for (ULONG i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        WCHAR buffer[MAX_NAME];
+        UNICODE_STRING name;
+        PARTS parts;
+        set_name(&name, buffer, cases[i].name);
+        split(&name, &parts);
+        BOOLEAN expect = ref_match(ref, count, &parts);
+        PtNameFold(&name);
+        BOOLEAN got = PtPathTrieMatch(trie, &name) != 0;
+        if (got != cases[i].match || expect != cases[i].match) {
+            printf("MISMATCH: %s: trie %u, reference %u, expected %u\n", cases[i].name, got, expect, cases[i].match);
+            failures++;
+        }
+    }
+
+    printf("%u cases, %u rules: %s\n", (ULONG)(sizeof(cases) / sizeof(cases[0])), count, failures ? "FAILED" : "ok");
+    PtPathTrieFree(trie);
+    free(ref);
+    return failures != 0;
+}
+
+//
+// Generated rules hang off a tree of directories; names are drawn from the
+// same tree, so most of them walk several levels before they fall off or
+// match.
+//
+static const char* const words[] = {
+    "Users", "Program Files", "Windows", "System32", "ProgramData", "bugav",
+    "AppData", "Local", "Roaming", "Temp", "Documents", "src", "build", "obj",
+    "Google", "Chrome", "User Data", "Default", "Microsoft", "Config",
+};
+static const char* const exts[] = { "txt", "dll", "exe", "db", "json", "sys", "log", "ini" };
+
+static VOID make_dir(PUNICODE_STRING name, ULONG depth, ULONG64* rng) {
+    char part[32];
+    name->Length = 0;
+    bench_append(name, "\\Device\\HarddiskVolume2");
+    for (ULONG i = 0; i < depth; i++) {
+        // Few choices near the root and more further down, like a real tree
+        ULONG fan = 8u << (i < 6 ? i : 6);
+        ULONG pick = bench_rand(rng) % fan;
+        if (pick < sizeof(words) / sizeof(words[0])) { snprintf(part, sizeof(part), "\\%s", words[pick]); }
+        else { snprintf(part, sizeof(part), "\\dir%u", pick); }
+        bench_append(name, part);
+    }
+}
+
+static VOID make_rule(PUNICODE_STRING rule, ULONG64* rng) {
+    char tail[32];
+    ULONG kind = bench_rand(rng) % 10;
+    make_dir(rule, 4 + bench_rand(rng) % 6, rng);
+    if (kind < 3) { bench_append(rule, "\\*"); }
+    else if (kind < 6) { bench_append(rule, "\\**"); }
+    else if (kind < 8) {
+        snprintf(tail, sizeof(tail), "\\*.%s", exts[bench_rand(rng) % 8]);
+        bench_append(rule, tail);
+    } else if (kind < 9) {
+        snprintf(tail, sizeof(tail), "\\**\\*.%s", exts[bench_rand(rng) % 8]);
+        bench_append(rule, tail);
+    } else {
+        snprintf(tail, sizeof(tail), "\\file%u.%s", bench_rand(rng) % 64, exts[bench_rand(rng) % 8]);
+        bench_append(rule, tail);
+    }
+}
+
+// Half the names start in the directory of a rule, the rest anywhere
+static VOID make_query(PUNICODE_STRING name, const UNICODE_STRING* rules, ULONG count, ULONG64* rng) {
+    char tail[32];
+    if (bench_rand(rng) & 1) {
+        const UNICODE_STRING* rule = &rules[bench_rand(rng) % count];
+        ULONG keep = 0, end = rule->Length / sizeof(WCHAR), extra = bench_rand(rng) % 3;
+        for (ULONG c = 0; c < end && rule->Buffer[c] != '*'; c++) {
+            if (rule->Buffer[c] == '\\') { keep = c; }
+        }
+        RtlCopyMemory(name->Buffer, rule->Buffer, keep * sizeof(WCHAR));
+        name->Length = (USHORT)(keep * sizeof(WCHAR));
+        for (ULONG i = 0; i < extra; i++) {
+            snprintf(tail, sizeof(tail), "\\%s", words[bench_rand(rng) % (sizeof(words) / sizeof(words[0]))]);
+            bench_append(name, tail);
+        }
+    } else {
+        make_dir(name, 1 + bench_rand(rng) % 12, rng);
+    }
+    snprintf(tail, sizeof(tail), "\\file%u.%s", bench_rand(rng) % 64, exts[bench_rand(rng) % 8]);
+    bench_append(name, tail);
+    bench_mix_case(name, rng);
+}
+
+static int run(ULONG count) {
+    ULONG64 rng = 0x2545F4914F6CDD1DULL ^ count;
+    PUNICODE_STRING rules = (PUNICODE_STRING)malloc(count * sizeof(UNICODE_STRING));
+    PUSHORT masks = (PUSHORT)malloc(count * sizeof(USHORT));
+    PWCH ruleText = (PWCH)malloc((SIZE_T)count * MAX_NAME * sizeof(WCHAR));
+    PUNICODE_STRING queries = (PUNICODE_STRING)malloc(QUERIES * sizeof(UNICODE_STRING));
+    PWCH queryText = (PWCH)malloc((SIZE_T)QUERIES * MAX_NAME * sizeof(WCHAR));
+    REF_RULE* ref = (REF_RULE*)malloc(count * sizeof(REF_RULE));
+    ULONG checks = CHECK_BUDGET / count < QUERIES ? CHECK_BUDGET / count : QUERIES;
+    ULONG depthHits[16] = { 0 };
+    ULONG64 depthNs[16] = { 0 };
+    PPT_PATH_TRIE trie;
+    ULONG rejected, hits = 0;
+    ULONG64 t0, build_ns, match_ns = 0;
+
+    for (ULONG i = 0; i < count; i++) {
+        rules[i].Buffer = ruleText + (SIZE_T)i * MAX_NAME;
+        rules[i].MaximumLength = MAX_NAME * sizeof(WCHAR);
+        make_rule(&rules[i], &rng);
+        masks[i] = (USHORT)(1u << (bench_rand(&rng) % 4));
+    }
+    for (ULONG i = 0; i < QUERIES; i++) {
+        queries[i].Buffer = queryText + (SIZE_T)i * MAX_NAME;
+        queries[i].MaximumLength = MAX_NAME * sizeof(WCHAR);
+        make_query(&queries[i], rules, count, &rng);
+    }
+
+    t0 = bench_now_ns();
+    if (!NT_SUCCESS(PtPathTrieBuild(rules, masks, count, &trie, &rejected)) || trie == NULL) {
+        printf("%7u  build failed\n", count);
+        return 1;
+    }
+    build_ns = bench_now_ns() - t0;
+    if (!PtPathTrieValidate(trie, trie->Size)) {
+        printf("%7u  trie fails validation\n", count);
+        return 1;
+    }
+
+    for (ULONG i = 0; i < count; i++) {
+        ref_parse(&rules[i], &ref[i]);
+        ref[i].mask = masks[i];
+    }
+    for (ULONG i = 0; i < checks; i++) {
+        PARTS parts;
+        split(&queries[i], &parts);
+        USHORT expect = ref_match(ref, count, &parts);
+        PtNameFold(&queries[i]);
+        USHORT got = PtPathTrieMatch(trie, &queries[i]);
+        if (got != expect) {
+            printf("MISMATCH: %u rules, query %u: trie %x, reference %x\n", count, i, got, expect);
+            return 1;
+        }
+    }
+    for (ULONG i = checks; i < QUERIES; i++) { PtNameFold(&queries[i]); }
+
+    for (ULONG pass = 0; pass < PASSES; pass++) {
+        hits = 0;
+        t0 = bench_now_ns();
+        for (ULONG i = 0; i < QUERIES; i++) { hits += PtPathTrieMatch(trie, &queries[i]) != 0; }
+        match_ns += bench_now_ns() - t0;
+    }
+
+    // Cost by the depth of the name, one at a time
+    for (ULONG i = 0; i < QUERIES; i++) {
+        ULONG depth = 0;
+        for (ULONG c = 0; c < queries[i].Length / sizeof(WCHAR); c++) { depth += (queries[i].Buffer[c] == '\\'); }
+        if (depth >= 16) { depth = 15; }
+        t0 = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) { bench_sink += PtPathTrieMatch(trie, &queries[i]); }
+        depthNs[depth] += bench_now_ns() - t0;
+        depthHits[depth]++;
+    }
+
+    printf("%7u  %7u  %7u  %8.2f  %7zu  %8.1f  %5.1f%%  %7u ",
+        trie->RuleCount, trie->NodeCount, trie->EdgeCount, build_ns / 1e6,
+        (SIZE_T)trie->Size / 1024,
+        (double)match_ns / PASSES / QUERIES, 100.0 * hits / QUERIES, checks);
+    for (ULONG d = 4; d < 14; d += 3) {
+        printf(" %6.1f", depthHits[d] ? (double)depthNs[d] / PASSES / depthHits[d] : 0.0);
+    }
+    printf("\n");
+
+    PtPathTrieFree(trie);
+    free(rules);
+    free(masks);
+    free(ruleText);
+    free(queries);
+    free(queryText);
+    free(ref);
+    return 0;
+}
+
+int main(void) {
+    static const ULONG counts[] = { 1000, 10000, 100000 };
+
+    if (run_cases() != 0) { return 1; }
+
+    printf("\n  rules    nodes    edges  build ms  trie KiB  match ns   hits   checked  ns at depth 4/7/10/13\n");
+    for (ULONG i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        if (run(counts[i]) != 0) { return 1; }
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+//
+// Offline compiler for FilterFileDrv policy images (see policy.h). Reads a
+// configuration in the format of E:\bugav_filefilter.txt, in UTF-8, one
+// entry per line:
+//
+//   \Device\HarddiskVolume2\Users\me\secret.txt    every operation
+//   wd \Device\HarddiskVolume2\bugav\**             write and delete
+//   r \Device\HarddiskVolume2\keys\*.pem            read
+//
+// and compiles it with the driver's own nameset.c and pathtrie.c into an
+// image the driver publishes as it is. -c checks an existing image the way
+// the driver will.
+//
+//   gcc -O2 -DFILEFLT_USER_MODE -I../FilterFileDrv filepolc.c
+//       ../FilterFileDrv/policy.c ../FilterFileDrv/nameset.c
+//       ../FilterFileDrv/pathtrie.c -o filepolc
+//
+
+#include <stdio.h>
+#include "portable.h"
+#include "nameset.h"
+#include "pathtrie.h"
+#include "policy.h"
+
+// FilterFileDrv.h pulls in the kernel headers; these have to match it
+#define PT_OP_READ      0x0001
+#define PT_OP_WRITE     0x0002
+#define PT_OP_DELETE    0x0004
+#define PT_OP_RENAME    0x0008
+#define PT_OP_ALL       0x000F
+
+static UCHAR* read_file(const char* path, ULONG* length) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) { perror(path); return NULL; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0 || (unsigned long)size > PT_POLICY_IMAGE_MAX_SIZE) {
+        fprintf(stderr, "%s: too large\n", path);
+        fclose(f);
+        return NULL;
+    }
+    // 8-byte aligned, as the driver's copy is
+    UCHAR* data = (UCHAR*)malloc((size_t)size + 1);
+    if (data != NULL && fread(data, 1, (size_t)size, f) != (size_t)size) {
+        perror(path);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *length = (ULONG)size;
+    return data;
+}
+
+// UTF-8 to UTF-16, a leading byte order mark dropped; NULL for a malformed
+// sequence
+static PWCH decode_utf8(const UCHAR* in, ULONG length, ULONG* chars) {
+    PWCH out = (PWCH)malloc(((size_t)length + 1) * sizeof(WCHAR));
+    ULONG n = 0, i = 0;
+
+    if (out == NULL) { return NULL; }
+    if (length >= 3 && in[0] == 0xEF && in[1] == 0xBB && in[2] == 0xBF) { i = 3; }
+    while (i < length) {
+        ULONG c = in[i], extra = 0, least = 0;
+        if (c >= 0xF0 && c < 0xF5) { c &= 0x07; extra = 3; least = 0x10000; }
+        else if (c >= 0xE0 && c < 0xF0) { c &= 0x0F; extra = 2; least = 0x800; }
+        else if (c >= 0xC2 && c < 0xE0) { c &= 0x1F; extra = 1; least = 0x80; }
+        else if (c >= 0x80) { break; }
+        if (extra != 0 && i + extra >= length) { break; }
+        for (ULONG k = 1; k <= extra; k++) {
+            if ((in[i + k] & 0xC0) != 0x80) { c = 0xFFFFFFFF; break; }
+            c = (c << 6) | (in[i + k] & 0x3F);
+        }
+        if (c == 0xFFFFFFFF || c < least || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) { break; }
+        i += extra + 1;
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            out[n++] = (WCHAR)(0xD800 + (c >> 10));
+            out[n++] = (WCHAR)(0xDC00 + (c & 0x3FF));
+        } else {
+            out[n++] = (WCHAR)c;
+        }
+    }
+    if (i < length) {
+        fprintf(stderr, "malformed UTF-8 at byte %u\n", i);
+        free(out);
+        return NULL;
+    }
+    *chars = n;
+    return out;
+}
+
+// "[rwdn]* <path>", as PassParseOps reads it; 0 for a malformed line
+static USHORT parse_ops(PCWCH* line, ULONG* length) {
+    PCWCH p = *line;
+    ULONG n = *length;
+    USHORT ops = 0;
+
+    if (n > 0 && p[0] == '\\') { return PT_OP_ALL; }
+    for (; n > 0 && p[0] != ' ' && p[0] != '\t'; p++, n--) {
+        switch (p[0]) {
+        case 'r': case 'R': ops |= PT_OP_READ; break;
+        case 'w': case 'W': ops |= PT_OP_WRITE; break;
+        case 'd': case 'D': ops |= PT_OP_DELETE; break;
+        case 'n': case 'N': ops |= PT_OP_RENAME; break;
+        default: return 0;
+        }
+    }
+    for (; n > 0 && (p[0] == ' ' || p[0] == '\t'); p++, n--) { }
+
+    *line = p;
+    *length = n;
+    return n > 0 ? ops : 0;
+}
+
+// The driver upcases with the system table; here only the part of Latin-1
+// where portable.h agrees with it can be folded. U+00B5 upcases to U+039C.
+static int foldable(PCWCH p, ULONG n) {
+    for (ULONG i = 0; i < n; i++) {
+        if (p[i] > 0xFF || p[i] == 0xB5) { return 0; }
+    }
+    return 1;
+}
+
+static int check_image(const char* path) {
+    ULONG length;
+    UCHAR* data = read_file(path, &length);
+    if (data == NULL) { return 1; }
+    const PT_POLICY_IMAGE* image = (const PT_POLICY_IMAGE*)data;
+    if (!PtPolicyImageValidate(image, length)) {
+        fprintf(stderr, "%s: not a valid version %d policy image\n", path, PT_POLICY_IMAGE_VERSION);
+        free(data);
+        return 1;
+    }
+    const PT_NAME_SET* names = PtPolicyImageNames(image);
+    const PT_PATH_TRIE* patterns = PtPolicyImagePatterns(image);
+    const PT_NAME_SET* directories = PtPolicyImageDirectories(image);
+    printf("%s: %u bytes, operations %x, checksum %08X\n", path, image->Size, image->Ops, image->Checksum);
+    if (names != NULL) {
+        printf("%s: %u names, %u slots, %u bytes\n", path, names->Count, names->Mask + 1, names->Size);
+    }
+    if (patterns != NULL) {
+        printf("%s: %u wildcard rules, %u nodes, %u edges, %u extensions, %u bytes\n", path,
+            patterns->RuleCount, patterns->NodeCount, patterns->EdgeCount, patterns->ExtCount, patterns->Size);
+    }
+    if (directories != NULL) {
+        printf("%s: %u directories, %u slots, %u bytes\n", path, directories->Count, directories->Mask + 1, directories->Size);
+    }
+    free(data);
+    return 0;
+}
+
+static int usage(void) {
+    fprintf(stderr,
+        "usage: filepolc <config> <image>   compile a configuration\n"
+        "       filepolc -c <image>         check an image\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) { return check_image(argv[2]); }
+    if (argc != 3) { return usage(); }
+
+    ULONG length, chars = 0;
+    UCHAR* data = read_file(argv[1], &length);
+    if (data == NULL) { return 1; }
+    PWCH text = decode_utf8(data, length, &chars);
+    free(data);
+    if (text == NULL) {
+        fprintf(stderr, "%s: not UTF-8\n", argv[1]);
+        return 1;
+    }
+
+    ULONG maxlines = 1;
+    for (ULONG i = 0; i < chars; i++) { maxlines += (text[i] == '\n'); }
+    PUNICODE_STRING entries = (PUNICODE_STRING)malloc(maxlines * sizeof(UNICODE_STRING));
+    PUSHORT masks = (PUSHORT)malloc(maxlines * sizeof(USHORT));
+    if (entries == NULL || masks == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // Same lines as PassParseCfg; what it would skip is reported instead,
+    // and an entry the driver would fold differently fails the build
+    ULONG count = 0, skipped = 0, start = 0, number = 0;
+    int failed = 0;
+    for (ULONG i = 0; i <= chars; i++) {
+        if (i < chars && text[i] != '\n') { continue; }
+
+        PCWCH line = text + start;
+        ULONG n = i - start;
+        number++;
+        start = i + 1;
+        if (n > 0 && line[n - 1] == '\r') { n--; }
+        if (n == 0) { continue; }
+
+        USHORT mask = parse_ops(&line, &n);
+        if (mask == 0 || n > 0xFFFF / sizeof(WCHAR)) {
+            fprintf(stderr, "%s:%u: malformed line skipped\n", argv[1], number);
+            skipped++;
+        } else if (!foldable(line, n)) {
+            fprintf(stderr, "%s:%u: characters outside Latin-1 cannot be upcased here; load this entry as text\n", argv[1], number);
+            failed = 1;
+        } else {
+            entries[count].Buffer = (PWCH)line;
+            entries[count].Length = entries[count].MaximumLength = (USHORT)(n * sizeof(WCHAR));
+            masks[count++] = mask;
+        }
+    }
+    if (failed) { return 1; }
+
+    PPT_POLICY_IMAGE image;
+    ULONG rejected = 0;
+    if (!NT_SUCCESS(PtPolicyImageBuild(entries, masks, count, &image, &rejected))) {
+        fprintf(stderr, "%s: cannot build an image of %u entries\n", argv[1], count);
+        return 1;
+    }
+    if (rejected != 0) { fprintf(stderr, "%s: %u invalid wildcard rules skipped\n", argv[1], rejected); }
+
+    FILE* f = fopen(argv[2], "wb");
+    if (f == NULL || fwrite(image, 1, image->Size, f) != image->Size || fclose(f) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    const PT_NAME_SET* names = PtPolicyImageNames(image);
+    const PT_PATH_TRIE* patterns = PtPolicyImagePatterns(image);
+    printf("%s: %u names, %u wildcard rules, %u lines skipped, %u bytes, operations %x\n", argv[2],
+        names ? names->Count : 0, patterns ? patterns->RuleCount : 0, skipped + rejected, image->Size, image->Ops);
+
+    PtPolicyImageFree(image);
+    free(entries);
+    free(masks);
+    free(text);
+    return 0;
+}
@@ -42,6 +42,46 @@ BOOL FilterFileCtrl::FilterFileDrv_UpdateConfig() {
     return Result;
 }
 
+BOOL FilterFileCtrl::FilterFileDrv_LoadPolicyImage(LPCWSTR ImagePath) {
+    // Sends a policy image built by filepolc (or a configuration in text)
+    // to the driver, which swaps it in without reading its configuration file
+    DWORD BytesReturned = 0;
+    LARGE_INTEGER FileSize;
+
+    HANDLE hFile = CreateFileW(ImagePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        ErrorPrint("LoadPolicyImage: cannot open policy image. Error %d", GetLastError());
+        return FALSE;
+    }
+    if (!GetFileSizeEx(hFile, &FileSize) || FileSize.QuadPart == 0 || FileSize.QuadPart > PASSFLT_POLICY_MAX_SIZE) {
+        ErrorPrint("LoadPolicyImage: bad policy image size");
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    DWORD ImageSize = (DWORD)FileSize.QuadPart;
+    DWORD MessageSize = FIELD_OFFSET(PASSFLT_POLICY_MESSAGE, Data) + ImageSize;
+    PPASSFLT_POLICY_MESSAGE Message = (PPASSFLT_POLICY_MESSAGE)HeapAlloc(GetProcessHeap(), 0, MessageSize);
+    DWORD BytesRead = 0;
+    BOOL Result = (Message != NULL) && ReadFile(hFile, Message->Data, ImageSize, &BytesRead, NULL) && BytesRead == ImageSize;
+    CloseHandle(hFile);
+
+    if (Result == TRUE) {
+        Message->Command = PASSFLT_CMD_LOAD_POLICY;
+        Message->Reserved = 0;
+        HRESULT hResult = FilterSendMessage(hPort, Message, MessageSize, NULL, 0, &BytesReturned);
+        if (hResult != S_OK) {
+            ErrorPrint("LoadPolicyImage failed: 0x%08x", hResult);
+            DisplayError(hResult);
+            Result = FALSE;
+        }
+    } else {
+        ErrorPrint("LoadPolicyImage: cannot read policy image. Error %d", GetLastError());
+    }
+    if (Message != NULL) { HeapFree(GetProcessHeap(), 0, Message); }
+    return Result;
+}
+
 BOOL FilterFileCtrl::FilterFileDrv_ConnectCommunicationPort() {
     BOOL Result = TRUE;
     HRESULT hResult = S_OK;
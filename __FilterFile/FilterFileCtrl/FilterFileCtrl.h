@@ -20,6 +20,17 @@
 
 #define PASSFLT_UPD_CFG_MSG         "updfcfg"
 
+// A COMMAND_MESSAGE (FilterFileDrv.h) carrying a policy image built by
+// filepolc, or a configuration in the text format of the configuration file
+#define PASSFLT_CMD_LOAD_POLICY     1
+#define PASSFLT_POLICY_MAX_SIZE     (256u << 20)
+
+typedef struct _PASSFLT_POLICY_MESSAGE {
+    ULONG Command;
+    ULONG Reserved;
+    UCHAR Data[1];
+} PASSFLT_POLICY_MESSAGE, * PPASSFLT_POLICY_MESSAGE;
+
 class FilterFileCtrl {
     HANDLE hDriver;
     HANDLE hPort;
@@ -32,6 +43,7 @@ public:
     BOOL FilterFileDrv_UnloadDriver();
     BOOL FilterFileDrv_OpenDevice();
     BOOL FilterFileDrv_UpdateConfig();
+    BOOL FilterFileDrv_LoadPolicyImage(LPCWSTR ImagePath);
     BOOL FilterFileDrv_ConnectCommunicationPort();
     BOOL FilterFileDrv_SendMessage(PCHAR msg);
 };
@@ -3,22 +3,47 @@
 #include <suppress.h>
 
 #include "FilterFileDrv.h"
+#include "nameset.h"
+#include "pathtrie.h"
+#include "policy.h"
+#include "epoch.h"
 
 #define SIOCTL_KDPRINT(_x_) \
                 DbgPrint("FilterFileDrv.sys: ");\
                 DbgPrint _x_;
 
 #define PASSFLT_PORT_NAME                   L"\\FilterFilePort"
+#define PASSFLT_CFG_PATH                    L"\\DosDevices\\E:\\bugav_filefilter.txt"
+#define PASSFLT_UPD_CFG_MSG                 "updfcfg"
 
 #pragma prefast(disable:__WARNING_ENCODE_MEMBER_FUNCTION_POINTER, "Not valid for kernel mode drivers")
 
 
 PASSTHROUGH_DATA PassThroughData;
 ULONG_PTR OperationStatusCtx = 1;
-PPROTECTED_FILES FltProtectedFiles = NULL;
+
+//  The published protection policy, NULL when nothing is protected. I/O
+//  callbacks read it inside an epoch section (epoch.h); PassPublishPolicy
+//  swaps it and frees the old one once no section can still see it.
+PPT_POLICY_IMAGE volatile PassPolicy = NULL;
+
+//  Serializes configuration loads. A KMUTEX keeps us at PASSIVE_LEVEL for
+//  ZwReadFile and the epoch wait.
+KMUTEX PassCfgLock;
+
+//  Bumped after every configuration load; stream contexts whose verdict was
+//  computed against an older generation recompute it from their cached name.
+//  Starts at 1 so that a zeroed verdict is never current.
+volatile LONG PassCfgGeneration = 1;
+
+//  Union of the operations the loaded configuration denies on any entry.
+//  A callback whose operations are not in it returns before it looks at the
+//  stream, so the filter costs next to nothing on I/O nothing protects.
+volatile LONG PassCfgOps = 0;
 
 #define PTDBG_TRACE_ROUTINES            0x00000001
 #define PTDBG_TRACE_OPERATION_STATUS    0x00000002
+#define PTDBG_TRACE_DENIED              0x00000004
 
 ULONG gTraceFlags = 0;
 
@@ -59,12 +84,68 @@ PassConnect(
 );
 
 VOID PassDisconnect(_In_opt_ PVOID ConnectionCookie);
-VOID PassReadCfg();
-VOID PassParseCfg(CHAR* cfg_buff);
-VOID PassPushProtectedFileCfg(UNICODE_STRING newstr);
-VOID PassDumpProtectedFileCfg();
+NTSTATUS PassReadCfg(_Outptr_ PUCHAR* Buffer, _Out_ PULONG Length);
+USHORT PassParseOps(PCWCH* Line, PULONG Length);
+NTSTATUS PassParseCfg(const CHAR* Text, ULONG Length, _Outptr_ PPT_POLICY_IMAGE* Policy);
+NTSTATUS PassLoadCfg(PUCHAR Buffer, ULONG Length, _Outptr_ PPT_POLICY_IMAGE* Policy);
+VOID PassDumpProtectedFileCfg(const PT_POLICY_IMAGE* Policy);
+VOID PassPublishPolicy(PPT_POLICY_IMAGE Policy);
 VOID PassDestroyProtectedFileCfg();
-VOID PassUpdateCfg();
+NTSTATUS PassUpdateCfg(PUCHAR Buffer, ULONG Length);
+
+NTSTATUS
+PtAllocateStreamContext(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _Outptr_ PPT_STREAM_CONTEXT* StreamContext
+);
+
+USHORT
+PtStreamProtectedOps(
+    _In_ PPT_STREAM_CONTEXT StreamContext
+);
+
+USHORT
+PtProtectedOps(
+    _In_ PCUNICODE_STRING Name,
+    _In_ ULONG Hash
+);
+
+USHORT
+PtDirectoryOps(
+    _In_ PCUNICODE_STRING Name,
+    _In_ ULONG Hash
+);
+
+USHORT
+PtTargetProtectedOps(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ HANDLE RootDirectory,
+    _In_reads_bytes_(FileNameLength) PWSTR FileName,
+    _In_ ULONG FileNameLength
+);
+
+USHORT
+PtCreateOps(
+    _In_ PFLT_CALLBACK_DATA Data
+);
+
+NTSTATUS
+PtGetStreamContext(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Outptr_ PPT_STREAM_CONTEXT* StreamContext
+);
+
+BOOLEAN
+PtSkipOperation(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ USHORT Ops
+);
+
+FLT_PREOP_CALLBACK_STATUS
+PtDenyOperation(
+    _Inout_ PFLT_CALLBACK_DATA Data
+);
 
 NTSTATUS
 PtInstanceSetup(
@@ -98,12 +179,42 @@ PtInstanceQueryTeardown(
 );
 
 FLT_PREOP_CALLBACK_STATUS
-PtPreOperationPassThrough(
+PtPreCreate(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+);
+
+FLT_PREOP_CALLBACK_STATUS
+PtPreReadWrite(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+);
+
+FLT_PREOP_CALLBACK_STATUS
+PtPreSetInformation(
     _Inout_ PFLT_CALLBACK_DATA Data,
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
     _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
 );
 
+FLT_POSTOP_CALLBACK_STATUS
+PtPostSetInformation(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+);
+
+FLT_POSTOP_CALLBACK_STATUS
+PtPostSetInformationWhenSafe(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+);
+
 VOID
 PtOperationStatusCallback(
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
@@ -142,62 +253,43 @@ PtDoRequestOperationStatus(
 #pragma alloc_text(PAGE, PtInstanceTeardownComplete)
 #endif
 
-//  operation registration
-CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
-    { IRP_MJ_CREATE,
+//  context registration
+CONST FLT_CONTEXT_REGISTRATION ContextRegistration[] = {
+    { FLT_STREAM_CONTEXT,
       0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
+      NULL,
+      FLT_VARIABLE_SIZED_CONTEXTS,
+      PT_STREAM_CONTEXT_TAG },
 
-    { IRP_MJ_CREATE_NAMED_PIPE,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
+    { FLT_CONTEXT_END }
+};
 
-    { IRP_MJ_CLOSE,
+//  operation registration. Only the operations a configuration entry can
+//  deny are registered (see PT_OP_READ in FilterFileDrv.h). The filter
+//  manager fixes the set when the filter registers, so the configuration
+//  steers them at run time instead: each callback returns at once when the
+//  loaded entries deny none of its operations (PassCfgOps). Paging I/O
+//  never reaches them.
+CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
+    { IRP_MJ_CREATE,
       0,
-      PtPreOperationPassThrough,
+      PtPreCreate,
       PtPostOperationPassThrough },
 
     { IRP_MJ_READ,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
+      FLTFL_OPERATION_REGISTRATION_SKIP_PAGING_IO,
+      PtPreReadWrite,
+      NULL },
 
     { IRP_MJ_WRITE,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
-
-    { IRP_MJ_QUERY_INFORMATION,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
+      FLTFL_OPERATION_REGISTRATION_SKIP_PAGING_IO,
+      PtPreReadWrite,
+      NULL },
 
     { IRP_MJ_SET_INFORMATION,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
-
-    { IRP_MJ_QUERY_VOLUME_INFORMATION,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
-
-    { IRP_MJ_SET_VOLUME_INFORMATION,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
-
-    { IRP_MJ_DIRECTORY_CONTROL,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
-
-    { IRP_MJ_FILE_SYSTEM_CONTROL,
-      0,
-      PtPreOperationPassThrough,
-      PtPostOperationPassThrough },
+      FLTFL_OPERATION_REGISTRATION_SKIP_PAGING_IO,
+      PtPreSetInformation,
+      PtPostSetInformation },
 
     { IRP_MJ_OPERATION_END }
 };
@@ -209,7 +301,7 @@ CONST FLT_REGISTRATION FilterRegistration = {
     FLT_REGISTRATION_VERSION,           //  Version
     0,                                  //  Flags
 
-    NULL,                               //  Context
+    ContextRegistration,                //  Context
     Callbacks,                          //  Operation callbacks
 
     PtUnload,                           //  MiniFilterUnload
@@ -243,7 +335,15 @@ DriverEntry(
 
     DbgPrint("############################### FilterFileDrv!DriverEntry: Entered ###############################\n");
 
-    PassReadCfg();
+    KeInitializeMutex(&PassCfgLock, 0);
+    if (!PtEpochInit()) {
+        DbgPrint("### FilterFileDrv!DriverEntry: PtEpochInit failed\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //  A missing or bad configuration leaves the filter running with
+    //  nothing protected
+    PassUpdateCfg(NULL, 0);
 
     PassThroughData.DriverObject = DriverObject;
 
@@ -293,7 +393,11 @@ DriverEntry(
     status = FltStartFiltering(PassThroughData.Filter);
     FLT_ASSERT(NT_SUCCESS(status));
 
-    if (!NT_SUCCESS(status)) { FltUnregisterFilter(PassThroughData.Filter); }
+    if (!NT_SUCCESS(status)) {
+        FltUnregisterFilter(PassThroughData.Filter);
+        PassDestroyProtectedFileCfg();
+        PtEpochCleanup();
+    }
 
     return status;
 }
@@ -310,6 +414,10 @@ NTSTATUS PtUnload(_In_ FLT_FILTER_UNLOAD_FLAGS Flags) {
     FltUnregisterFilter(PassThroughData.Filter);
     DbgPrint("### FilterFileDrv!FltUnregisterFilter\n");
 
+    //  No callback runs any more; free the last policy and the epoch slots
+    PassDestroyProtectedFileCfg();
+    PtEpochCleanup();
+
     return STATUS_SUCCESS;
 }
 
@@ -319,8 +427,248 @@ NTSTATUS PtUnload(_In_ FLT_FILTER_UNLOAD_FLAGS Flags) {
 
 DECLARE_GLOBAL_CONST_UNICODE_STRING(gcookie_str, L"\\Device\\HarddiskVolume2\\google_cookies.txt");
 
+NTSTATUS
+PtAllocateStreamContext(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _Outptr_ PPT_STREAM_CONTEXT* StreamContext
+)
+/*++
+    Queries the normalized name of the target of Data once and returns a new
+    stream context holding a copy of it and its verdict against the current
+    configuration. The caller owns the reference on the context.
+--*/
+{
+    NTSTATUS status;
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    PPT_STREAM_CONTEXT ctx = NULL;
+    LONG generation;
+
+    *StreamContext = NULL;
+
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo);
+    if (!NT_SUCCESS(status)) { return status; }
+
+    status = FltAllocateContext(PassThroughData.Filter,
+        FLT_STREAM_CONTEXT,
+        sizeof(PT_STREAM_CONTEXT) + nameInfo->Name.Length,
+        NonPagedPool,
+        (PFLT_CONTEXT*)&ctx);
+
+    if (NT_SUCCESS(status)) {
+        ctx->Name.Buffer = (PWCH)(ctx + 1);
+        ctx->Name.Length = ctx->Name.MaximumLength = nameInfo->Name.Length;
+        RtlCopyMemory(ctx->Name.Buffer, nameInfo->Name.Buffer, nameInfo->Name.Length);
+        ctx->Hash = PtNameFold(&ctx->Name);
+
+        //  Read the generation before walking the configuration, so a verdict
+        //  computed while a reload is in progress is tagged as already stale.
+        generation = PassCfgGeneration;
+        ctx->Verdict = PT_VERDICT(generation, PtProtectedOps(&ctx->Name, ctx->Hash));
+
+        *StreamContext = ctx;
+    }
+
+    FltReleaseFileNameInformation(nameInfo);
+    return status;
+}
+
+USHORT
+PtProtectedOps(
+    _In_ PCUNICODE_STRING Name,
+    _In_ ULONG Hash
+)
+/*++
+    Name is upcased and Hash is what PtNameFold returned for it. Returns the
+    operations denied on Name: the mask of its exact entry, if it has one,
+    together with those of every wildcard rule it matches. The policy is
+    read inside an epoch section, so a reload can swap it meanwhile but not
+    free it; Name has to be nonpaged. Callers read PassCfgGeneration before
+    this, so a verdict that straddles a reload is tagged as stale.
+--*/
+{
+    PT_EPOCH_READER reader;
+    PPT_POLICY_IMAGE policy;
+    USHORT ops = 0;
+
+    PtEpochEnter(&reader);
+    policy = PassPolicy;
+    if (policy != NULL) {
+        ops = (USHORT)((PtNameSetLookup(PtPolicyImageNames(policy), Name, Hash) |
+            PtPathTrieMatch(PtPolicyImagePatterns(policy), Name)) & PT_OP_ALL);
+    }
+    PtEpochLeave(&reader);
+    return ops;
+}
+
+USHORT
+PtDirectoryOps(
+    _In_ PCUNICODE_STRING Name,
+    _In_ ULONG Hash
+)
+/*++
+    Name is upcased and Hash is what PtNameFold returned for it. Returns the
+    union of the operations denied on the entries below Name, 0 if no entry
+    lies below it, read like PtProtectedOps.
+--*/
+{
+    PT_EPOCH_READER reader;
+    PPT_POLICY_IMAGE policy;
+    USHORT ops = 0;
+
+    PtEpochEnter(&reader);
+    policy = PassPolicy;
+    if (policy != NULL) {
+        ops = (USHORT)(PtNameSetLookup(PtPolicyImageDirectories(policy), Name, Hash) & PT_OP_ALL);
+    }
+    PtEpochLeave(&reader);
+    return ops;
+}
+
+USHORT
+PtTargetProtectedOps(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ HANDLE RootDirectory,
+    _In_reads_bytes_(FileNameLength) PWSTR FileName,
+    _In_ ULONG FileNameLength
+)
+/*++
+    Operations denied on the name a rename or hard link of the stream
+    FltObjects targets gives it, as FltGetDestinationFileNameInformation
+    resolves it. 0 when the name cannot be had.
+--*/
+{
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    UNICODE_STRING name;
+    USHORT ops;
+
+    if (KeGetCurrentIrql() > APC_LEVEL) { return 0; }
+    if (!NT_SUCCESS(FltGetDestinationFileNameInformation(FltObjects->Instance, FltObjects->FileObject, RootDirectory,
+            FileName, FileNameLength, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo))) {
+        return 0;
+    }
+
+    //  Folded in a copy: the name information belongs to the filter manager
+    name.Length = name.MaximumLength = nameInfo->Name.Length;
+    name.Buffer = (PWCH)ExAllocatePoolWithTag(NonPagedPool, name.Length, PT_NAME_TAG);
+    if (name.Buffer == NULL) {
+        FltReleaseFileNameInformation(nameInfo);
+        return 0;
+    }
+    RtlCopyMemory(name.Buffer, nameInfo->Name.Buffer, name.Length);
+    FltReleaseFileNameInformation(nameInfo);
+
+    ops = PtProtectedOps(&name, PtNameFold(&name));
+    ExFreePoolWithTag(name.Buffer, PT_NAME_TAG);
+    return ops;
+}
+
+USHORT
+PtStreamProtectedOps(
+    _In_ PPT_STREAM_CONTEXT StreamContext
+)
+/*++
+    Returns the cached operations denied on a stream, recomputing them from
+    the cached folded name and hash if the configuration was reloaded since
+    they were last computed.
+--*/
+{
+    LONG generation = PassCfgGeneration;
+    LONG verdict = StreamContext->Verdict;
+    USHORT ops;
+
+    if ((verdict & ~PT_OP_ALL) == PT_VERDICT(generation, 0)) {
+        return (USHORT)(verdict & PT_OP_ALL);
+    }
+
+    ops = PtProtectedOps(&StreamContext->Name, StreamContext->Hash);
+    InterlockedExchange(&StreamContext->Verdict, PT_VERDICT(generation, ops));
+    return ops;
+}
+
+USHORT
+PtCreateOps(
+    _In_ PFLT_CALLBACK_DATA Data
+)
+/*++
+    Operations an open asks for, from its desired access, disposition and
+    options. Generic rights are already mapped to specific ones by the time
+    a filter sees the create; MAXIMUM_ALLOWED may end up granting anything,
+    so it counts as both read and write. An open with DELETE access alone
+    is let through: what it is used for is checked in
+    PtPreSetInformation.
+--*/
+{
+    ACCESS_MASK access = Data->Iopb->Parameters.Create.SecurityContext->DesiredAccess;
+    ULONG options = Data->Iopb->Parameters.Create.Options;
+    ULONG disposition = options >> 24;
+    USHORT ops = 0;
+
+    if (FlagOn(access, FILE_READ_DATA | FILE_EXECUTE | MAXIMUM_ALLOWED)) { ops |= PT_OP_READ; }
+    if (FlagOn(access, FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA |
+                       WRITE_DAC | WRITE_OWNER | MAXIMUM_ALLOWED) ||
+        disposition == FILE_SUPERSEDE || disposition == FILE_OVERWRITE || disposition == FILE_OVERWRITE_IF) {
+        ops |= PT_OP_WRITE;
+    }
+    if (FlagOn(options, FILE_DELETE_ON_CLOSE)) { ops |= PT_OP_DELETE; }
+    return ops;
+}
+
+NTSTATUS
+PtGetStreamContext(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Outptr_ PPT_STREAM_CONTEXT* StreamContext
+)
+/*++
+    Returns the context of the stream Data targets. A stream opened before
+    this instance attached, or while nothing was protected, has none yet and
+    is named once here. The caller owns the reference on the context.
+--*/
+{
+    NTSTATUS status;
+
+    *StreamContext = NULL;
+    if (FltObjects->FileObject == NULL) { return STATUS_NOT_FOUND; }
+
+    status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, (PFLT_CONTEXT*)StreamContext);
+    if (status == STATUS_NOT_FOUND && KeGetCurrentIrql() <= APC_LEVEL) {
+        status = PtAllocateStreamContext(Data, StreamContext);
+        if (NT_SUCCESS(status)) {
+            FltSetStreamContext(FltObjects->Instance, FltObjects->FileObject, FLT_SET_CONTEXT_KEEP_IF_EXISTS, *StreamContext, NULL);
+        }
+    }
+    return status;
+}
+
+BOOLEAN
+PtSkipOperation(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ USHORT Ops
+)
+/*++
+    The fast path of every callback but create: nothing loaded denies Ops,
+    or the operation is fast I/O or paging I/O. Access is checked when a
+    stream is opened, so these callbacks only matter for handles opened
+    before a reload; the cached and paging paths that serve such a handle's
+    I/O are not worth taxing every unprotected read and write for.
+--*/
+{
+    return (BOOLEAN)((PassCfgOps & Ops) == 0 ||
+        FLT_IS_FASTIO_OPERATION(Data) ||
+        FlagOn(Data->Iopb->IrpFlags, IRP_PAGING_IO));
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PtDenyOperation(
+    _Inout_ PFLT_CALLBACK_DATA Data
+) {
+    Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+    Data->IoStatus.Information = 0;
+    return FLT_PREOP_COMPLETE;
+}
+
 FLT_PREOP_CALLBACK_STATUS
-PtPreOperationPassThrough(
+PtPreCreate(
     _Inout_ PFLT_CALLBACK_DATA Data,
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
     _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
@@ -331,30 +679,162 @@ PtPreOperationPassThrough(
         opaque handles to this filter, instance, its associated volume and
         file object.
     CompletionContext - The context for the completion routine for this operation.
+
+    Creates are where the name is queried: the denied operations are
+    computed here and the stream context that carries them to later
+    operations is handed to PtPostOperationPassThrough to attach. An open
+    that asks for nothing the loaded configuration denies, such as one for
+    attributes only, is not even named; PtGetStreamContext names its stream
+    if a later callback needs it.
 --*/
 {
+    NTSTATUS status;
+    PPT_STREAM_CONTEXT ctx = NULL;
+    USHORT asked;
+    USHORT ops;
+
     UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
 
-    NTSTATUS status;
+    *CompletionContext = NULL;
 
-    PPROTECTED_FILES flist_ptr = FltProtectedFiles;
-    while (flist_ptr != NULL) {
-        PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
-        status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED, &nameInfo);
-        if (status == STATUS_SUCCESS) {
-            BOOLEAN comp_res = RtlEqualUnicodeString(&nameInfo->Name, &flist_ptr->f_name, TRUE);
-            if (comp_res == TRUE) {
+    asked = PtCreateOps(Data);
+    if ((asked & PassCfgOps) == 0) { return FLT_PREOP_SUCCESS_NO_CALLBACK; }
 
-                DbgPrint("### Fname %wZ, volume %wZ\n", nameInfo->Name, nameInfo->Volume);
+    status = PtAllocateStreamContext(Data, &ctx);
+    if (!NT_SUCCESS(status)) { return FLT_PREOP_SUCCESS_NO_CALLBACK; }
 
-                Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-                return FLT_PREOP_COMPLETE;
-            }
+    ops = (USHORT)(ctx->Verdict & PT_OP_ALL) & asked;
+    if (ops != 0) {
+        PT_DBG_PRINT(PTDBG_TRACE_DENIED, ("### Fname %wZ ops %x\n", &ctx->Name, ops));
+        FltReleaseContext(ctx);
+        return PtDenyOperation(Data);
+    }
+
+    *CompletionContext = ctx;
+    return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PtPreReadWrite(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+)
+/*++
+    Reads and writes through a handle opened before the stream became
+    protected against them.
+--*/
+{
+    PPT_STREAM_CONTEXT ctx;
+    USHORT op = Data->Iopb->MajorFunction == IRP_MJ_READ ? PT_OP_READ : PT_OP_WRITE;
+    USHORT ops;
+
+    *CompletionContext = NULL;
+
+    if (PtSkipOperation(Data, op)) { return FLT_PREOP_SUCCESS_NO_CALLBACK; }
+    if (!NT_SUCCESS(PtGetStreamContext(Data, FltObjects, &ctx))) { return FLT_PREOP_SUCCESS_NO_CALLBACK; }
+
+    ops = PtStreamProtectedOps(ctx);
+    FltReleaseContext(ctx);
+
+    return FlagOn(ops, op) ? PtDenyOperation(Data) : FLT_PREOP_SUCCESS_NO_CALLBACK;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+PtPreSetInformation(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
+)
+/*++
+    Writes, deletes and renames of an open stream. Setting its size or
+    allocation truncates it like a WRITE IRP, and setting its attributes
+    is a write as FILE_WRITE_ATTRIBUTES is in PtCreateOps. A hard link
+    gives the file a name no rule covers, so it counts as a rename.
+    Renaming a directory is a rename of every entry below it as well, and
+    a rename or link that replaces an existing entry deletes and overwrites
+    that one. Every other information class returns before the stream is
+    looked at.
+
+    On a rename or link the stream's context goes to PtPostSetInformation,
+    whether anything is protected or not: the context holds the old name,
+    and a later reload may protect the new one.
+--*/
+{
+    PPT_STREAM_CONTEXT ctx;
+    PPT_STREAM_CONTEXT renamed = NULL;
+    PVOID info = Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
+    FILE_INFORMATION_CLASS infoClass = Data->Iopb->Parameters.SetFileInformation.FileInformationClass;
+    PFILE_RENAME_INFORMATION rename = NULL;
+    PFILE_LINK_INFORMATION link = NULL;
+    USHORT op = 0;
+    USHORT replaced = 0;        //  asked of the entry a rename or link replaces
+    USHORT ops;
+    BOOLEAN deny = FALSE;
+
+    *CompletionContext = NULL;
+
+    switch (infoClass) {
+    case FileEndOfFileInformation:
+    case FileAllocationInformation:
+    case FileBasicInformation:
+        op = PT_OP_WRITE;
+        break;
+    case FileDispositionInformation:
+        if (((PFILE_DISPOSITION_INFORMATION)info)->DeleteFile) { op = PT_OP_DELETE; }
+        break;
+    case FileDispositionInformationEx:
+        if (FlagOn(((PFILE_DISPOSITION_INFORMATION_EX)info)->Flags, FILE_DISPOSITION_DELETE)) { op = PT_OP_DELETE; }
+        break;
+    case FileRenameInformation:
+    case FileRenameInformationEx:
+        rename = (PFILE_RENAME_INFORMATION)info;
+        op = PT_OP_RENAME;
+        if (infoClass == FileRenameInformationEx ? FlagOn(rename->Flags, FILE_RENAME_REPLACE_IF_EXISTS) : rename->ReplaceIfExists) {
+            replaced = PT_OP_DELETE | PT_OP_WRITE;
+        }
+        break;
+    case FileLinkInformation:
+    case FileLinkInformationEx:
+        link = (PFILE_LINK_INFORMATION)info;
+        op = PT_OP_RENAME;
+        if (infoClass == FileLinkInformationEx ? FlagOn(link->Flags, FILE_LINK_REPLACE_IF_EXISTS) : link->ReplaceIfExists) {
+            replaced = PT_OP_DELETE | PT_OP_WRITE;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (op == PT_OP_RENAME && FltObjects->FileObject != NULL && KeGetCurrentIrql() <= APC_LEVEL &&
+        !NT_SUCCESS(FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, (PFLT_CONTEXT*)&renamed))) {
+        renamed = NULL;
+    }
+
+    if (!PtSkipOperation(Data, op | replaced)) {
+        //  The stream itself, and for a directory the entries it would move
+        if (FlagOn(PassCfgOps, op) && NT_SUCCESS(PtGetStreamContext(Data, FltObjects, &ctx))) {
+            ops = PtStreamProtectedOps(ctx);
+            if (op == PT_OP_RENAME) { ops |= PtDirectoryOps(&ctx->Name, ctx->Hash); }
+            FltReleaseContext(ctx);
+            deny = (BOOLEAN)(FlagOn(ops, op) != 0);
+        }
+
+        //  The entry it would replace
+        if (!deny && FlagOn(PassCfgOps, replaced)) {
+            ops = rename != NULL ?
+                PtTargetProtectedOps(FltObjects, rename->RootDirectory, rename->FileName, rename->FileNameLength) :
+                PtTargetProtectedOps(FltObjects, link->RootDirectory, link->FileName, link->FileNameLength);
+            deny = (BOOLEAN)(FlagOn(ops, replaced) != 0);
         }
-        flist_ptr = flist_ptr->f_next;
     }
 
+    if (deny) {
+        if (renamed != NULL) { FltReleaseContext(renamed); }
+        return PtDenyOperation(Data);
+    }
+    if (renamed == NULL) { return FLT_PREOP_SUCCESS_NO_CALLBACK; }
+    *CompletionContext = renamed;
     return FLT_PREOP_SUCCESS_WITH_CALLBACK;
 }
 
@@ -401,8 +881,6 @@ VOID PassDisconnect(_In_opt_ PVOID ConnectionCookie){
     }
 }
 
-DECLARE_GLOBAL_CONST_UNICODE_STRING(cmdupd_str, L"updfcfg");
-
 NTSTATUS
 PassMessage(
     _In_ PVOID ConnectionCookie,
@@ -412,51 +890,84 @@ PassMessage(
     _In_ ULONG OutputBufferSize,
     _Out_ PULONG ReturnOutputBufferLength
 )
+/*++
+    Either the bare PASSFLT_UPD_CFG_MSG string, which reloads the
+    configuration file, or a COMMAND_MESSAGE. A LoadPolicy message is copied
+    out of the caller's buffer and published; on failure the current policy
+    stays and the status says why.
+--*/
 {
+    PCOMMAND_MESSAGE message = (PCOMMAND_MESSAGE)InputBuffer;
     NTSTATUS status = STATUS_SUCCESS;
+    PUCHAR buffer = NULL;
+    ULONG length = 0;
 
     PAGED_CODE();
 
     UNREFERENCED_PARAMETER(ConnectionCookie);
-    UNREFERENCED_PARAMETER(ReturnOutputBufferLength);
     UNREFERENCED_PARAMETER(OutputBufferSize);
     UNREFERENCED_PARAMETER(OutputBuffer);
-    UNREFERENCED_PARAMETER(InputBufferSize);
 
-    DbgPrint("### FilterFileDrv!PassMessage: Entered\n");
-
-    DbgPrint("### FilterFileDrv!PassMessage: %s\n", (PCHAR)InputBuffer);
-    ANSI_STRING AS;
-    UNICODE_STRING US;
-    RtlInitAnsiString(&AS, InputBuffer);
-    RtlAnsiStringToUnicodeString(&US, &AS, TRUE);
-
-    BOOLEAN comp_res = RtlEqualUnicodeString(&cmdupd_str, &US, TRUE);
-    if (comp_res == TRUE) {
-        DbgPrint("### UpdateConfig cmd\n");
-        PassUpdateCfg();
+    DbgPrint("### FilterFileDrv!PassMessage: %u bytes\n", InputBufferSize);
+
+    *ReturnOutputBufferLength = 0;
+    if (InputBuffer == NULL) { return STATUS_INVALID_PARAMETER; }
+
+    //  InputBuffer is raw user mode memory. The filter manager has probed
+    //  it, but its pages can go away at any time: it is only touched under
+    //  an exception handler, and a policy is copied out before it is looked
+    //  at.
+    __try {
+        if (InputBufferSize >= sizeof(PASSFLT_UPD_CFG_MSG) - 1 && InputBufferSize <= sizeof(PASSFLT_UPD_CFG_MSG) &&
+            RtlEqualMemory(InputBuffer, PASSFLT_UPD_CFG_MSG, sizeof(PASSFLT_UPD_CFG_MSG) - 1)) {
+            DbgPrint("### UpdateConfig cmd\n");
+        } else if (InputBufferSize < FIELD_OFFSET(COMMAND_MESSAGE, Data)) {
+            status = STATUS_INVALID_PARAMETER;
+        } else if (message->Command == LoadPolicy) {
+            length = InputBufferSize - FIELD_OFFSET(COMMAND_MESSAGE, Data);
+            if (length == 0 || length > PT_POLICY_IMAGE_MAX_SIZE) {
+                status = STATUS_INVALID_PARAMETER;
+            } else {
+                buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, length, PT_POLICY_IMAGE_TAG);
+                if (buffer == NULL) {
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                } else {
+                    RtlCopyMemory(buffer, message->Data, length);
+                }
+            }
+        } else if (message->Command != UpdateConfig) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
     }
 
-    return status;
+    if (!NT_SUCCESS(status)) {
+        if (buffer != NULL) { ExFreePoolWithTag(buffer, PT_POLICY_IMAGE_TAG); }
+        DbgPrint("### FilterFileDrv!PassMessage: bad message %x\n", status);
+        return status;
+    }
+    return PassUpdateCfg(buffer, length);
 }
 
-VOID PassReadCfg() {
+NTSTATUS PassReadCfg(_Outptr_ PUCHAR* Buffer, _Out_ PULONG Length) {
+    //  Reads the whole of PASSFLT_CFG_PATH, up to PT_POLICY_IMAGE_MAX_SIZE,
+    //  into a buffer for PassLoadCfg
     UNICODE_STRING     uniName;
     OBJECT_ATTRIBUTES  objAttr;
 
-    RtlInitUnicodeString(&uniName, L"\\DosDevices\\E:\\bugav_filefilter.txt");  // or L"\\SystemRoot\\example.txt"
+    RtlInitUnicodeString(&uniName, PASSFLT_CFG_PATH);
     InitializeObjectAttributes(&objAttr, &uniName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
 
     HANDLE   handle;
     NTSTATUS ntstatus;
     IO_STATUS_BLOCK    ioStatusBlock;
-
-#define  BUFF_SIZE 512
-    CHAR     buffer[BUFF_SIZE];
-    RtlZeroMemory(buffer, BUFF_SIZE);
-    //size_t  cb;
-
+    FILE_STANDARD_INFORMATION info;
     LARGE_INTEGER      byteOffset;
+    PUCHAR   buffer;
+
+    *Buffer = NULL;
+    *Length = 0;
 
     ntstatus = ZwCreateFile(&handle,
         GENERIC_READ,
@@ -467,93 +978,206 @@ VOID PassReadCfg() {
         FILE_OPEN,
         FILE_SYNCHRONOUS_IO_NONALERT,
         NULL, 0);
+    if (!NT_SUCCESS(ntstatus)) { return ntstatus; }
+
+    ntstatus = ZwQueryInformationFile(handle, &ioStatusBlock, &info, sizeof(info), FileStandardInformation);
+    if (NT_SUCCESS(ntstatus) && info.EndOfFile.QuadPart > PT_POLICY_IMAGE_MAX_SIZE) { ntstatus = STATUS_FILE_TOO_LARGE; }
 
     if (NT_SUCCESS(ntstatus)) {
-        byteOffset.LowPart = byteOffset.HighPart = 0;
-        ntstatus = ZwReadFile(handle, NULL, NULL, NULL, &ioStatusBlock,
-            buffer, BUFF_SIZE, &byteOffset, NULL);
-        if (NT_SUCCESS(ntstatus)) {
-            buffer[BUFF_SIZE - 1] = '\0';
-            PassParseCfg(buffer);
+        //  An empty file is an empty configuration; it still gets a buffer
+        buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, info.EndOfFile.LowPart + 1, PT_POLICY_IMAGE_TAG);
+        if (buffer == NULL) {
+            ntstatus = STATUS_INSUFFICIENT_RESOURCES;
+        } else {
+            ioStatusBlock.Information = 0;
+            if (info.EndOfFile.LowPart != 0) {
+                byteOffset.QuadPart = 0;
+                ntstatus = ZwReadFile(handle, NULL, NULL, NULL, &ioStatusBlock,
+                    buffer, info.EndOfFile.LowPart, &byteOffset, NULL);
+            }
+            if (NT_SUCCESS(ntstatus)) {
+                *Buffer = buffer;
+                *Length = (ULONG)ioStatusBlock.Information;
+            } else {
+                ExFreePoolWithTag(buffer, PT_POLICY_IMAGE_TAG);
+            }
+        }
+    }
+    ZwClose(handle);
+    return ntstatus;
+}
 
+USHORT PassParseOps(PCWCH* Line, PULONG Length) {
+    //  "[rwdn]* <path>": the letters name the operations to deny, and a line
+    //  that starts with the path denies them all. 0 for a malformed line.
+    PCWCH p = *Line;
+    ULONG n = *Length;
+    USHORT ops = 0;
+
+    if (n > 0 && p[0] == '\\') { return PT_OP_ALL; }
+
+    for (; n > 0 && p[0] != ' ' && p[0] != '\t'; p++, n--) {
+        switch (p[0]) {
+        case 'r': case 'R': ops |= PT_OP_READ; break;
+        case 'w': case 'W': ops |= PT_OP_WRITE; break;
+        case 'd': case 'D': ops |= PT_OP_DELETE; break;
+        case 'n': case 'N': ops |= PT_OP_RENAME; break;
+        default: return 0;
         }
-        ZwClose(handle);
     }
+    for (; n > 0 && (p[0] == ' ' || p[0] == '\t'); p++, n--) { }
+
+    *Line = p;
+    *Length = n;
+    return n > 0 ? ops : 0;
 }
 
-VOID PassParseCfg(CHAR* cfg_buff) {
+NTSTATUS PassParseCfg(const CHAR* Text, ULONG Length, _Outptr_ PPT_POLICY_IMAGE* Policy) {
+    //  One entry per line; '\r' before the '\n' and empty lines are ignored.
+    //  The text is converted from the ANSI code page in one go and every
+    //  entry is a view of the converted buffer, so nothing is allocated per
+    //  line; both buffers only live until the policy image has copied the
+    //  entries.
     DbgPrint("### PassParseCfg\n");
-    if (cfg_buff[0] == '\0') { return; }
-    CHAR     line[BUFF_SIZE];
-    RtlZeroMemory(line, BUFF_SIZE);
-    size_t bptr = 0;
-    ANSI_STRING AS;
-    UNICODE_STRING US;
-    for (size_t i = 0; i < BUFF_SIZE; i++) {
-        if (cfg_buff[i] == '\n') {
-            size_t linesz = i - bptr - 1;
-            RtlCopyMemory(line, cfg_buff + bptr, linesz);
-
-            RtlInitAnsiString(&AS, line);
-            RtlAnsiStringToUnicodeString(&US, &AS, TRUE);
-            PassPushProtectedFileCfg(US);
-            bptr = i + 1;
+    NTSTATUS status = STATUS_SUCCESS;
+    PWCH text = NULL;
+    ULONG bytes = 0;
+
+    *Policy = NULL;
+    if (Length != 0) {
+        status = RtlMultiByteToUnicodeSize(&bytes, Text, Length);
+        if (!NT_SUCCESS(status)) { return status; }
+        text = (PWCH)ExAllocatePoolWithTag(PagedPool, bytes, '1liF');
+        if (text == NULL) { return STATUS_INSUFFICIENT_RESOURCES; }
+        status = RtlMultiByteToUnicodeN(text, bytes, &bytes, Text, Length);
+        if (!NT_SUCCESS(status)) {
+            ExFreePoolWithTag(text, '1liF');
+            return status;
         }
     }
 
-    PassDumpProtectedFileCfg();
-}
+    ULONG chars = bytes / sizeof(WCHAR);
+    ULONG maxlines = 1;
+    for (ULONG i = 0; i < chars; i++) { maxlines += (text[i] == '\n'); }
 
-VOID PassPushProtectedFileCfg(UNICODE_STRING newstr) {
-    DbgPrint("### PassPushProtectedFileCfg\n");
-    PPROTECTED_FILES flist_ptr = FltProtectedFiles;
-    if (FltProtectedFiles == NULL) {
-        FltProtectedFiles = (PPROTECTED_FILES)ExAllocatePoolWithTag(NonPagedPool, sizeof(PROTECTED_FILES), '1liF');
-        if (FltProtectedFiles != NULL) {
-            FltProtectedFiles->f_next = NULL;
-            FltProtectedFiles->f_prev = NULL;
-            FltProtectedFiles->f_name = newstr;
-            return;
+    PUNICODE_STRING names = (PUNICODE_STRING)ExAllocatePoolWithTag(PagedPool, maxlines * (sizeof(UNICODE_STRING) + sizeof(USHORT)), '1liF');
+    if (names == NULL) {
+        if (text != NULL) { ExFreePoolWithTag(text, '1liF'); }
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    PUSHORT masks = (PUSHORT)(names + maxlines);
+
+    ULONG count = 0, rejected = 0;
+    ULONG bptr = 0;
+    for (ULONG i = 0; i <= chars; i++) {
+        if (i < chars && text[i] != '\n') { continue; }
+
+        PCWCH line = text + bptr;
+        ULONG linesz = i - bptr;
+        if (linesz > 0 && line[linesz - 1] == '\r') { linesz--; }
+        if (linesz > 0) {
+            USHORT mask = PassParseOps(&line, &linesz);
+            if (mask == 0 || linesz > MAXUSHORT / sizeof(WCHAR)) {
+                DbgPrint("### PassParseCfg: skipped malformed line %.*ws\n", (int)min(linesz, 256), line);
+            } else {
+                names[count].Buffer = (PWCH)line;
+                names[count].Length = names[count].MaximumLength = (USHORT)(linesz * sizeof(WCHAR));
+                masks[count++] = mask;
+            }
         }
+        bptr = i + 1;
     }
-    while (flist_ptr->f_next != NULL) { flist_ptr = flist_ptr->f_next; }
-    flist_ptr->f_next = (PPROTECTED_FILES)ExAllocatePoolWithTag(NonPagedPool, sizeof(PROTECTED_FILES), '1liF');
-    if (flist_ptr->f_next != NULL) {
-        flist_ptr->f_next->f_next = NULL;
-        flist_ptr->f_next->f_prev = flist_ptr;
-        flist_ptr->f_next->f_name = newstr;
-        return;
+
+    status = PtPolicyImageBuild(names, masks, count, Policy, &rejected);
+    if (rejected != 0) { DbgPrint("### PassParseCfg: %u invalid wildcard rules skipped\n", rejected); }
+
+    ExFreePoolWithTag(names, '1liF');
+    if (text != NULL) { ExFreePoolWithTag(text, '1liF'); }
+    return status;
+}
+
+NTSTATUS PassLoadCfg(PUCHAR Buffer, ULONG Length, _Outptr_ PPT_POLICY_IMAGE* Policy) {
+    //  Buffer is a NonPagedPool PT_POLICY_IMAGE_TAG allocation this call
+    //  takes over. A policy image is validated and used where it lies;
+    //  anything else is a text configuration compiled into a new image.
+    NTSTATUS status;
+
+    *Policy = NULL;
+    if (Length >= sizeof(PT_POLICY_IMAGE) && ((PPT_POLICY_IMAGE)Buffer)->Magic == PT_POLICY_IMAGE_MAGIC) {
+        if (!PtPolicyImageValidate((PPT_POLICY_IMAGE)Buffer, Length)) {
+            DbgPrint("### PassLoadCfg: invalid policy image\n");
+            ExFreePoolWithTag(Buffer, PT_POLICY_IMAGE_TAG);
+            return STATUS_INVALID_PARAMETER;
+        }
+        *Policy = (PPT_POLICY_IMAGE)Buffer;
+        return STATUS_SUCCESS;
     }
+
+    status = PassParseCfg((const CHAR*)Buffer, Length, Policy);
+    ExFreePoolWithTag(Buffer, PT_POLICY_IMAGE_TAG);
+    return status;
 }
 
-VOID PassDumpProtectedFileCfg() {
-    DbgPrint("### PassDumpProtectedFileCfg\n");
-    PPROTECTED_FILES flist_ptr = FltProtectedFiles;
-    while (flist_ptr != NULL) {
-        DbgPrint("===== %wZ\n", flist_ptr->f_name);
-        flist_ptr = flist_ptr->f_next;
+VOID PassDumpProtectedFileCfg(const PT_POLICY_IMAGE* Policy) {
+    const PT_NAME_SET* set = PtPolicyImageNames(Policy);
+    const PT_PATH_TRIE* trie = PtPolicyImagePatterns(Policy);
+    const PT_NAME_SET* directories = PtPolicyImageDirectories(Policy);
+
+    DbgPrint("### PassDumpProtectedFileCfg: %u bytes, ops %x\n", Policy->Size, Policy->Ops);
+    if (set != NULL) {
+        const PT_NAME_SLOT* slots = PtNameSetSlots(set);
+        for (ULONG i = 0; i <= set->Mask; i++) {
+            if (slots[i].Length == 0) { continue; }
+            DbgPrint("===== %x %.*ws\n", slots[i].Mask, slots[i].Length / sizeof(WCHAR), PtNameSetNames(set) + slots[i].Name);
+        }
+    }
+    if (trie != NULL) {
+        DbgPrint("===== %u wildcard rules, %u trie nodes\n", trie->RuleCount, trie->NodeCount);
     }
+    if (directories != NULL) {
+        DbgPrint("===== %u directories above them\n", directories->Count);
+    }
+}
+
+VOID PassPublishPolicy(PPT_POLICY_IMAGE Policy) {
+    //  Swaps Policy (NULL - nothing protected) in and frees the one it
+    //  replaces once no I/O callback can still be reading it. Runs at
+    //  PASSIVE_LEVEL with PassCfgLock held. The generation moves after the
+    //  exchange, so a stream verdict tagged with the new generation was
+    //  computed against the new policy.
+    PPT_POLICY_IMAGE old = (PPT_POLICY_IMAGE)InterlockedExchangePointer((PVOID volatile*)&PassPolicy, Policy);
+    InterlockedIncrement(&PassCfgGeneration);
+    InterlockedExchange(&PassCfgOps, Policy != NULL ? (LONG)(Policy->Ops & PT_OP_ALL) : 0);
+
+    if (Policy != NULL) { PassDumpProtectedFileCfg(Policy); }
+    if (old == NULL) { return; }
+
+    PtEpochSynchronize();
+    PtPolicyImageFree(old);
 }
 
 VOID PassDestroyProtectedFileCfg() {
     DbgPrint("### PassDestroyProtectedFileCfg\n");
-    PPROTECTED_FILES flist_ptr = FltProtectedFiles;
-
-    if (flist_ptr == NULL) { return; }
+    KeWaitForSingleObject(&PassCfgLock, Executive, KernelMode, FALSE, NULL);
+    PassPublishPolicy(NULL);
+    KeReleaseMutex(&PassCfgLock, FALSE);
+}
 
-    while (flist_ptr->f_next != NULL) { flist_ptr = flist_ptr->f_next; }
+NTSTATUS PassUpdateCfg(PUCHAR Buffer, ULONG Length) {
+    //  Buffer holds a policy image or a text configuration and is taken
+    //  over as by PassLoadCfg; NULL - read PASSFLT_CFG_PATH. On failure the
+    //  current policy stays.
+    PPT_POLICY_IMAGE policy = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
 
-    while (flist_ptr->f_prev != NULL) {
-        flist_ptr = flist_ptr->f_prev;
-        ExFreePoolWithTag(flist_ptr->f_next, '1liF');
-    }
-    ExFreePoolWithTag(flist_ptr, '1liF');
-    FltProtectedFiles = NULL;
-}
+    KeWaitForSingleObject(&PassCfgLock, Executive, KernelMode, FALSE, NULL);
+    if (Buffer == NULL) { status = PassReadCfg(&Buffer, &Length); }
+    if (NT_SUCCESS(status)) { status = PassLoadCfg(Buffer, Length, &policy); }
+    if (NT_SUCCESS(status)) { PassPublishPolicy(policy); }
+    KeReleaseMutex(&PassCfgLock, FALSE);
 
-VOID PassUpdateCfg() {
-    PassDestroyProtectedFileCfg();
-    PassReadCfg();
+    DbgPrint("### PassUpdateCfg: %x\n", status);
+    return status;
 }
 
 #pragma region kernel_other
@@ -584,12 +1208,73 @@ PtPostOperationPassThrough(
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
     _In_opt_ PVOID CompletionContext,
     _In_ FLT_POST_OPERATION_FLAGS Flags
+) {
+    PPT_STREAM_CONTEXT ctx = (PPT_STREAM_CONTEXT)CompletionContext;
+    PPT_STREAM_CONTEXT old = NULL;
+
+    //  Attach the context the pre-operation of a create built if the open
+    //  produced a stream. If the stream already has one from an earlier
+    //  open, that one is kept unless it holds another name: the stream was
+    //  renamed or linked while this instance did not see it, or is opened
+    //  through another of its links.
+    if (ctx == NULL) { return FLT_POSTOP_FINISHED_PROCESSING; }
+
+    if (!FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING) &&
+        NT_SUCCESS(Data->IoStatus.Status) &&
+        Data->IoStatus.Status != STATUS_REPARSE &&
+        FltSupportsStreamContexts(FltObjects->FileObject) &&
+        FltSetStreamContext(FltObjects->Instance, FltObjects->FileObject, FLT_SET_CONTEXT_KEEP_IF_EXISTS, ctx, (PFLT_CONTEXT*)&old) ==
+            STATUS_FLT_CONTEXT_ALREADY_DEFINED) {
+        if (old->Hash != ctx->Hash || !RtlEqualUnicodeString(&old->Name, &ctx->Name, FALSE)) {
+            FltSetStreamContext(FltObjects->Instance, FltObjects->FileObject, FLT_SET_CONTEXT_REPLACE_IF_EXISTS, ctx, NULL);
+        }
+        FltReleaseContext(old);
+    }
+
+    FltReleaseContext(ctx);
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
+
+FLT_POSTOP_CALLBACK_STATUS
+PtPostSetInformation(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+)
+/*++
+    Only renames and links of a stream with a context ask for a post
+    callback. Once they succeed the context, named before them, is deleted;
+    the next callback that needs the name queries it again. Deleting a
+    context takes APC_LEVEL or below, so it is done when safe.
+--*/
+{
+    FLT_POSTOP_CALLBACK_STATUS status = FLT_POSTOP_FINISHED_PROCESSING;
+
+    if (CompletionContext == NULL) { return FLT_POSTOP_FINISHED_PROCESSING; }
+
+    if (FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING) || !NT_SUCCESS(Data->IoStatus.Status) ||
+        !FltDoCompletionProcessingWhenSafe(Data, FltObjects, CompletionContext, Flags, PtPostSetInformationWhenSafe, &status)) {
+        FltReleaseContext(CompletionContext);
+    }
+    return status;
+}
+
+
+FLT_POSTOP_CALLBACK_STATUS
+PtPostSetInformationWhenSafe(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
 ) {
     UNREFERENCED_PARAMETER(Data);
     UNREFERENCED_PARAMETER(FltObjects);
-    UNREFERENCED_PARAMETER(CompletionContext);
     UNREFERENCED_PARAMETER(Flags);
 
+    FltDeleteContext(CompletionContext);
+    FltReleaseContext(CompletionContext);
     return FLT_POSTOP_FINISHED_PROCESSING;
 }
 
@@ -16,15 +16,54 @@ typedef struct _PASSTHROUGH_DATA {
 } PASSTHROUGH_DATA, * PPASSTHROUGH_DATA;
 
 
+//
+//  UpdateConfig reloads the configuration file; LoadPolicy carries a policy
+//  image (policy.h), or a configuration in the text format of that file, in
+//  COMMAND_MESSAGE.Data and publishes it in place of the current one.
 typedef enum _PASSTHROUGH_COMMAND {
-    UpdateConfig
+    UpdateConfig,
+    LoadPolicy
 } PASSTHROUGH_COMMAND;
 
-typedef struct _PROTECTED_FILES {
-    UNICODE_STRING f_name;
-    struct _PROTECTED_FILES* f_next;
-    struct _PROTECTED_FILES* f_prev;
-} PROTECTED_FILES, *PPROTECTED_FILES;
+//
+//  Operations a protected entry can deny; a configuration line names them
+//  with the letters r, w, d and n before the path ("wd \Device\..."), and a
+//  line with none denies them all. Read and write are decided when the
+//  stream is opened, from the access it asks for; delete is also a
+//  delete-on-close open, and delete and rename are checked again when they
+//  are issued through IRP_MJ_SET_INFORMATION, as are writes that set the
+//  size, allocation or basic attributes of a file. Renaming a directory above an
+//  entry renames the entry too, and a rename or link that replaces an entry
+//  both deletes and writes it.
+#define PT_OP_READ                      0x0001
+#define PT_OP_WRITE                     0x0002
+#define PT_OP_DELETE                    0x0004
+#define PT_OP_RENAME                    0x0008
+#define PT_OP_ALL                       0x000F
+
+//
+//  Stream context: the normalized name of the stream, captured at
+//  IRP_MJ_CREATE or by the first callback that needs it, and the operations
+//  denied on it. A successful rename or hard link deletes it, and a create
+//  under another name replaces it, so the name is never one the stream has
+//  lost. Verdict packs that mask
+//  in its low PT_VERDICT_SHIFT bits and the configuration generation it was
+//  computed against above them, so one read tells whether it is still valid
+//  and a reload only costs a lookup of the cached name, never another name
+//  query. The name is kept upcased with its hash (PtNameFold), so it is
+//  folded exactly once in the life of the stream. Its buffer follows the
+//  structure in the same allocation.
+#define PT_VERDICT_SHIFT                4
+#define PT_VERDICT(_gen, _ops)          ((LONG)(((ULONG)(_gen) << PT_VERDICT_SHIFT) | (_ops)))
+
+typedef struct _PT_STREAM_CONTEXT {
+    volatile LONG Verdict;
+    ULONG Hash;
+    UNICODE_STRING Name;
+} PT_STREAM_CONTEXT, * PPT_STREAM_CONTEXT;
+
+#define PT_STREAM_CONTEXT_TAG           'cSlF'
+#define PT_NAME_TAG                     'mNlF'      //  folded copy of a rename or link target
 
 
 //
@@ -0,0 +1,73 @@
+//
+// Epoch-based reclamation (see epoch.h).
+//
+
+#include <fltKernel.h>
+
+#include "epoch.h"
+
+static volatile LONG64  PtEpochGlobal = 1;
+static PPT_EPOCH_CPU    PtEpochCpus = NULL;
+static PVOID            PtEpochCpusRaw = NULL;
+static ULONG            PtEpochCpuCount = 0;
+
+BOOLEAN PtEpochInit() {
+    ULONG count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    SIZE_T size = count * sizeof(PT_EPOCH_CPU) + PT_EPOCH_CACHE_LINE;
+
+    PtEpochCpusRaw = ExAllocatePoolWithTag(NonPagedPool, size, PT_EPOCH_TAG);
+    if (PtEpochCpusRaw == NULL) { return FALSE; }
+    RtlZeroMemory(PtEpochCpusRaw, size);
+
+    // Pool blocks are only 16-byte aligned; give every slot its own line
+    PtEpochCpus = (PPT_EPOCH_CPU)(((ULONG_PTR)PtEpochCpusRaw + PT_EPOCH_CACHE_LINE - 1) & ~(ULONG_PTR)(PT_EPOCH_CACHE_LINE - 1));
+    PtEpochCpuCount = count;
+    return TRUE;
+}
+
+VOID PtEpochCleanup() {
+    if (PtEpochCpusRaw != NULL) { ExFreePoolWithTag(PtEpochCpusRaw, PT_EPOCH_TAG); }
+    PtEpochCpusRaw = NULL;
+    PtEpochCpus = NULL;
+    PtEpochCpuCount = 0;
+}
+
+VOID PtEpochEnter(_Out_ PPT_EPOCH_READER Reader) {
+    PPT_EPOCH_CPU slot;
+
+    // Stay on this processor until PtEpochLeave
+    KeRaiseIrql(DISPATCH_LEVEL, &Reader->OldIrql);
+    Reader->Cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    slot = &PtEpochCpus[Reader->Cpu];
+    if (slot->Nesting++ == 0) {
+        // Full barrier: the pin must be visible before the policy pointer is read
+        InterlockedExchange64(&slot->Active, PtEpochGlobal);
+    }
+}
+
+VOID PtEpochLeave(_In_ PPT_EPOCH_READER Reader) {
+    PPT_EPOCH_CPU slot = &PtEpochCpus[Reader->Cpu];
+
+    if (--slot->Nesting == 0) {
+        InterlockedExchange64(&slot->Active, 0);
+    }
+    KeLowerIrql(Reader->OldIrql);
+}
+
+VOID PtEpochSynchronize() {
+    // Called at PASSIVE_LEVEL after the old policy has been unpublished.
+    // Readers that pin an epoch >= target started after the exchange and
+    // cannot see it.
+    LONG64 target = InterlockedIncrement64(&PtEpochGlobal);
+    LARGE_INTEGER interval;
+
+    interval.QuadPart = -10 * 1000;     // 1 ms
+    for (ULONG cpu = 0; cpu < PtEpochCpuCount; cpu++) {
+        for (;;) {
+            LONG64 active = PtEpochCpus[cpu].Active;
+            if (active == 0 || active >= target) { break; }
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+        }
+    }
+}
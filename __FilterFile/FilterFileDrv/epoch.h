@@ -0,0 +1,31 @@
+#pragma once
+//
+// Epoch-based reclamation of the published protection policy.
+//
+// Readers pin the current epoch in their processor's slot around a lookup.
+// PassPublishPolicy swaps a new policy in with an atomic pointer exchange,
+// advances the global epoch and then waits until every processor is either
+// idle or inside a section that started after the exchange; only then is
+// the old policy freed. The read side costs two interlocked stores to a
+// processor-local cache line and takes no locks, and runs at DISPATCH_LEVEL
+// so a section never outlives its processor.
+//
+
+#define PT_EPOCH_TAG            'ePlF'
+#define PT_EPOCH_CACHE_LINE     64
+
+typedef struct DECLSPEC_CACHEALIGN _PT_EPOCH_CPU {
+    volatile LONG64 Active;     // epoch pinned by this processor, 0 - idle
+    ULONG           Nesting;
+} PT_EPOCH_CPU, *PPT_EPOCH_CPU;
+
+typedef struct _PT_EPOCH_READER {
+    ULONG   Cpu;
+    KIRQL   OldIrql;
+} PT_EPOCH_READER, *PPT_EPOCH_READER;
+
+BOOLEAN PtEpochInit();
+VOID PtEpochCleanup();
+VOID PtEpochEnter(_Out_ PPT_EPOCH_READER Reader);
+VOID PtEpochLeave(_In_ PPT_EPOCH_READER Reader);
+VOID PtEpochSynchronize();
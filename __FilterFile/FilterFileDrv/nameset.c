@@ -0,0 +1,143 @@
+//
+// Immutable open-addressing set of protected names (see nameset.h).
+//
+
+#include "nameset.h"
+
+static FORCEINLINE ULONG64 ptNameLoad(const UCHAR* p, ULONG bytes) {
+    ULONG64 w = 0;
+    RtlCopyMemory(&w, p, bytes);
+    return w;
+}
+
+ULONG PtNameHash(PCUNICODE_STRING Name) {
+    const UCHAR* p = (const UCHAR*)Name->Buffer;
+    ULONG left = Name->Length;
+    ULONG64 h = 0x9E3779B97F4A7C15ULL ^ left;
+
+    // Eight bytes (four characters) per multiply; the tail is zero padded,
+    // which the length mixed in above keeps apart from real zeros.
+    for (; left >= 8; left -= 8, p += 8) {
+        h = (h ^ ptNameLoad(p, 8)) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    if (left != 0) {
+        h = (h ^ ptNameLoad(p, left)) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 32;
+    return (ULONG)h;
+}
+
+ULONG PtNameFold(PUNICODE_STRING Name) {
+    ULONG count = Name->Length / sizeof(WCHAR);
+    PWCH p = Name->Buffer;
+
+    // A branch on the case of each letter mispredicts on mixed-case paths;
+    // ASCII is folded without one and only the rest goes through the upcase
+    // table.
+    for (ULONG i = 0; i < count; i++) {
+        WCHAR c = p[i];
+        if (c < 0x80) {
+            p[i] = (WCHAR)(c - ((ULONG)((WCHAR)(c - 'a') < 26) << 5));
+        } else {
+            p[i] = RtlUpcaseUnicodeChar(c);
+        }
+    }
+    return PtNameHash(Name);
+}
+
+NTSTATUS PtNameSetBuild(const UNICODE_STRING* Names, const USHORT* Masks, ULONG Count, PPT_NAME_SET* Set) {
+    PPT_NAME_SET set;
+    PT_NAME_SLOT* table;
+    SIZE_T bytes = 0;
+    SIZE_T size;
+    ULONG slots = 16;
+    PWCH names;
+    ULONG cursor = 0;
+
+    *Set = NULL;
+
+    for (ULONG i = 0; i < Count; i++) { bytes += Names[i].Length & ~(SIZE_T)1; }
+    if (Count > 0x10000000 || bytes > 0x40000000) { return STATUS_INVALID_PARAMETER; }
+    while (slots < Count * 2) { slots <<= 1; }
+
+    // Header, slots and names in one allocation
+    size = sizeof(PT_NAME_SET) + (SIZE_T)slots * sizeof(PT_NAME_SLOT) + bytes;
+    if (size > MAXULONG) { return STATUS_INVALID_PARAMETER; }
+    set = (PPT_NAME_SET)FILEFLT_ALLOC(size, PT_NAME_SET_TAG);
+    if (set == NULL) { return STATUS_INSUFFICIENT_RESOURCES; }
+    RtlZeroMemory(set, sizeof(PT_NAME_SET) + (SIZE_T)slots * sizeof(PT_NAME_SLOT));
+
+    set->Mask = slots - 1;
+    table = (PT_NAME_SLOT*)(set + 1);
+    names = (PWCH)(table + slots);
+
+    for (ULONG i = 0; i < Count; i++) {
+        UNICODE_STRING name;
+        USHORT mask = Masks != NULL ? Masks[i] : (USHORT)~0;
+        ULONG hash, j;
+
+        name.Length = name.MaximumLength = Names[i].Length & ~(USHORT)1;
+        name.Buffer = names + cursor;
+        if (name.Length == 0 || mask == 0) { continue; }
+
+        RtlCopyMemory(name.Buffer, Names[i].Buffer, name.Length);
+        hash = PtNameFold(&name);
+
+        for (j = hash & set->Mask; table[j].Length != 0; j = (j + 1) & set->Mask) {
+            if (table[j].Hash == hash && table[j].Length == name.Length &&
+                RtlEqualMemory(names + table[j].Name, name.Buffer, name.Length)) {
+                break;
+            }
+        }
+        if (table[j].Length != 0) {
+            table[j].Mask |= mask;
+            continue;
+        }
+
+        table[j].Hash = hash;
+        table[j].Length = name.Length;
+        table[j].Mask = mask;
+        table[j].Name = cursor;
+        set->Count++;
+        cursor += name.Length / sizeof(WCHAR);
+    }
+
+    // Duplicates leave the tail of the allocation unused; Size stops at the
+    // last name
+    set->NameChars = cursor;
+    set->Size = (ULONG)(sizeof(PT_NAME_SET) + (SIZE_T)slots * sizeof(PT_NAME_SLOT) + (SIZE_T)cursor * sizeof(WCHAR));
+    *Set = set;
+    return STATUS_SUCCESS;
+}
+
+VOID PtNameSetFree(PPT_NAME_SET Set) {
+    if (Set != NULL) { FILEFLT_FREE(Set, PT_NAME_SET_TAG); }
+}
+
+BOOLEAN PtNameSetValidate(const PT_NAME_SET* Set, ULONG Size) {
+    const PT_NAME_SLOT* slots;
+    ULONG64 slotCount, used = 0;
+
+    if (Size < sizeof(PT_NAME_SET) || Set->Size > Size) { return FALSE; }
+
+    // A probe stops at an empty slot, so there has to be one
+    slotCount = (ULONG64)Set->Mask + 1;
+    if ((slotCount & Set->Mask) != 0 || Set->Count >= slotCount) { return FALSE; }
+    if (sizeof(PT_NAME_SET) + slotCount * sizeof(PT_NAME_SLOT) + (ULONG64)Set->NameChars * sizeof(WCHAR) != Set->Size) { return FALSE; }
+
+    slots = PtNameSetSlots(Set);
+    for (ULONG64 i = 0; i < slotCount; i++) {
+        if (slots[i].Length == 0) { continue; }
+        if ((slots[i].Length & 1) != 0 ||
+            (ULONG64)slots[i].Name + slots[i].Length / sizeof(WCHAR) > Set->NameChars) {
+            return FALSE;
+        }
+        used++;
+    }
+    return used == Set->Count;
+}
@@ -0,0 +1,101 @@
+#pragma once
+//
+// Immutable set of protected names.
+//
+// The set is built once per configuration load and never changed after
+// that. Names are stored upcased, back to back in one buffer, and found
+// through an open-addressing table of (hash, length, name) slots with
+// linear probing, sized to a power of two at least twice the name count.
+// A lookup therefore costs one hash probe and, on a hash hit, one memory
+// compare: the candidate is folded and hashed once by PtNameFold, which
+// the stream context does when it captures the name (FilterFileDrv.c), so
+// re-checking a stream after a reload folds nothing at all.
+//
+// Each name carries a mask of the operations it is protected against; the
+// set does not interpret it (FilterFileDrv.h defines the bits).
+//
+// The set holds no pointers: the header is followed by the slots and the
+// slots by the names, which they refer to by offset. A set can therefore
+// be copied as it is into a policy image (policy.h) and used where it lies
+// once PtNameSetValidate has passed it.
+//
+
+#include "portable.h"
+
+#define PT_NAME_SET_TAG     'sNlF'
+
+typedef struct _PT_NAME_SLOT {
+    ULONG   Hash;
+    USHORT  Length;             // bytes; 0 marks an empty slot
+    USHORT  Mask;
+    ULONG   Name;               // offset into the names, in characters
+} PT_NAME_SLOT, *PPT_NAME_SLOT;
+
+typedef struct _PT_NAME_SET {
+    ULONG   Size;               // bytes, header, slots and names
+    ULONG   Mask;               // slot count - 1
+    ULONG   Count;              // distinct names
+    ULONG   NameChars;          // upcased names, back to back, after the slots
+} PT_NAME_SET, *PPT_NAME_SET;
+
+C_ASSERT(sizeof(PT_NAME_SLOT) == 12);
+C_ASSERT(sizeof(PT_NAME_SET) == 16);
+
+static FORCEINLINE const PT_NAME_SLOT* PtNameSetSlots(const PT_NAME_SET* Set) {
+    return (const PT_NAME_SLOT*)(Set + 1);
+}
+
+static FORCEINLINE PCWCH PtNameSetNames(const PT_NAME_SET* Set) {
+    return (PCWCH)(PtNameSetSlots(Set) + Set->Mask + 1);
+}
+
+//
+// Upcases Name in place and returns its hash.
+//
+ULONG PtNameFold(PUNICODE_STRING Name);
+
+//
+// Hash of a name that is already upcased.
+//
+ULONG PtNameHash(PCUNICODE_STRING Name);
+
+//
+// Builds a set of Count names with their masks, or with every mask bit set
+// if Masks is NULL. The names are copied and folded; empty names and
+// names with an empty mask are dropped, and the masks of duplicates
+// merged. *Set is NULL on failure.
+//
+NTSTATUS PtNameSetBuild(const UNICODE_STRING* Names, const USHORT* Masks, ULONG Count, PPT_NAME_SET* Set);
+
+VOID PtNameSetFree(PPT_NAME_SET Set);
+
+//
+// TRUE if the Size bytes at Set hold a set every lookup stays inside of:
+// sizes that add up, a power-of-two table with at least one empty slot and
+// every name within the name buffer.
+//
+BOOLEAN PtNameSetValidate(const PT_NAME_SET* Set, ULONG Size);
+
+//
+// Mask of an upcased name with the hash PtNameFold returned for it, 0 if
+// the set does not hold it. A NULL set is empty.
+//
+static FORCEINLINE USHORT PtNameSetLookup(const PT_NAME_SET* Set, PCUNICODE_STRING Name, ULONG Hash) {
+    ULONG i;
+    const PT_NAME_SLOT* slot;
+
+    if (Set == NULL || Set->Count == 0) { return 0; }
+
+    for (i = Hash & Set->Mask;; i = (i + 1) & Set->Mask) {
+        slot = &PtNameSetSlots(Set)[i];
+        if (slot->Length == 0) { return 0; }
+        if (slot->Hash == Hash && slot->Length == Name->Length &&
+            RtlEqualMemory(PtNameSetNames(Set) + slot->Name, Name->Buffer, Name->Length)) {
+            return slot->Mask;
+        }
+    }
+}
+
+static FORCEINLINE BOOLEAN PtNameSetContains(const PT_NAME_SET* Set, PCUNICODE_STRING Name, ULONG Hash) {
+    return PtNameSetLookup(Set, Name, Hash) != 0;
+}
@@ -0,0 +1,517 @@
+//
+// Compressed trie of wildcard protection rules (see pathtrie.h).
+//
+
+#include "pathtrie.h"
+
+#define PT_TRIE_CHILD_EXT       0x0100      // key\*.ext, build time only
+#define PT_TRIE_DESCENDANT_EXT  0x0200      // key\**\*.ext, build time only
+
+typedef struct _PT_TRIE_RULE {
+    ULONG   Key;                // offset into Labels, in characters
+    ULONG   KeyLength;          // characters
+    ULONG   Ext;
+    ULONG   ExtLength;
+    ULONG   Kind;
+    USHORT  Mask;
+} PT_TRIE_RULE, *PPT_TRIE_RULE;
+
+//
+// The tables are filled at their worst-case capacity and moved together
+// once the counts are known.
+//
+typedef struct _PT_TRIE_BUILD {
+    PPT_PATH_TRIE   Trie;
+    PT_TRIE_NODE*   Nodes;
+    PT_TRIE_EDGE*   Edges;
+    PT_TRIE_EXT*    Exts;
+    PT_TRIE_RULE*   Rules;
+    PCWCH           Text;
+} PT_TRIE_BUILD, *PPT_TRIE_BUILD;
+
+typedef int (*PT_COMPARE)(const VOID* a, const VOID* b, const VOID* context);
+
+//
+// Heap sort: the kernel has no qsort, and the tables can be large enough
+// that an insertion sort would show on a reload.
+//
+static VOID ptSwap(UCHAR* a, UCHAR* b, ULONG size) {
+    for (ULONG i = 0; i < size; i++) {
+        UCHAR t = a[i];
+        a[i] = b[i];
+        b[i] = t;
+    }
+}
+
+static VOID ptSiftDown(UCHAR* base, ULONG root, ULONG count, ULONG size, PT_COMPARE compare, const VOID* context) {
+    for (;;) {
+        ULONG child = 2 * root + 1;
+        if (child >= count) { return; }
+        if (child + 1 < count && compare(base + (SIZE_T)child * size, base + (SIZE_T)(child + 1) * size, context) < 0) { child++; }
+        if (compare(base + (SIZE_T)root * size, base + (SIZE_T)child * size, context) >= 0) { return; }
+        ptSwap(base + (SIZE_T)root * size, base + (SIZE_T)child * size, size);
+        root = child;
+    }
+}
+
+static VOID ptHeapSort(VOID* base, ULONG count, ULONG size, PT_COMPARE compare, const VOID* context) {
+    UCHAR* b = (UCHAR*)base;
+    if (count < 2) { return; }
+    for (ULONG i = count / 2; i-- > 0;) { ptSiftDown(b, i, count, size, compare, context); }
+    for (ULONG end = count - 1; end > 0; end--) {
+        ptSwap(b, b + (SIZE_T)end * size, size);
+        ptSiftDown(b, 0, end, size, compare, context);
+    }
+}
+
+//
+// Keys compare with '\' below every other character and a key below its
+// extensions, so all keys sharing a first component are contiguous and
+// the ones that end at a node come first.
+//
+static int ptCompareRules(const VOID* a, const VOID* b, const VOID* context) {
+    const PT_TRIE_RULE* x = (const PT_TRIE_RULE*)a;
+    const PT_TRIE_RULE* y = (const PT_TRIE_RULE*)b;
+    PCWCH text = (PCWCH)context;
+    ULONG n = x->KeyLength < y->KeyLength ? x->KeyLength : y->KeyLength;
+    ULONG i = 0;
+
+    // Rules share long prefixes; skip the equal part four characters at a time
+    while (i + 4 <= n && RtlEqualMemory(text + x->Key + i, text + y->Key + i, 4 * sizeof(WCHAR))) { i += 4; }
+    for (; i < n; i++) {
+        ULONG cx = text[x->Key + i], cy = text[y->Key + i];
+        if (cx == '\\') { cx = 0; }
+        if (cy == '\\') { cy = 0; }
+        if (cx != cy) { return cx < cy ? -1 : 1; }
+    }
+    return x->KeyLength < y->KeyLength ? -1 : x->KeyLength > y->KeyLength;
+}
+
+//
+// Bottom-up merge sort of the rules through a scratch array of the same
+// size: half the comparisons of the heap sort, and the rule text they read
+// is the expensive part.
+//
+static VOID ptMergeSortRules(PT_TRIE_RULE* rules, PT_TRIE_RULE* scratch, ULONG count, PCWCH text) {
+    PT_TRIE_RULE* from = rules;
+    PT_TRIE_RULE* to = scratch;
+
+    for (ULONG width = 1; width < count; width *= 2) {
+        for (ULONG lo = 0; lo < count; lo += 2 * width) {
+            ULONG mid = lo + width < count ? lo + width : count;
+            ULONG hi = lo + 2 * width < count ? lo + 2 * width : count;
+            ULONG a = lo, b = mid, k = lo;
+            while (a < mid && b < hi) { to[k++] = ptCompareRules(&from[b], &from[a], text) < 0 ? from[b++] : from[a++]; }
+            while (a < mid) { to[k++] = from[a++]; }
+            while (b < hi) { to[k++] = from[b++]; }
+        }
+        PT_TRIE_RULE* t = from;
+        from = to;
+        to = t;
+    }
+    if (from != rules) { RtlCopyMemory(rules, from, (SIZE_T)count * sizeof(PT_TRIE_RULE)); }
+}
+
+static int ptCompareEdges(const VOID* a, const VOID* b, const VOID* context) {
+    ULONG x = ((const PT_TRIE_EDGE*)a)->Hash, y = ((const PT_TRIE_EDGE*)b)->Hash;
+    UNREFERENCED_PARAMETER(context);
+    return x < y ? -1 : x > y;
+}
+
+static int ptCompareExts(const VOID* a, const VOID* b, const VOID* context) {
+    ULONG x = ((const PT_TRIE_EXT*)a)->Hash, y = ((const PT_TRIE_EXT*)b)->Hash;
+    UNREFERENCED_PARAMETER(context);
+    return x < y ? -1 : x > y;
+}
+
+static ULONG ptHashRange(PCWCH text, ULONG length) {
+    UNICODE_STRING view;
+    view.Buffer = (PWCH)text;
+    view.Length = view.MaximumLength = (USHORT)(length * sizeof(WCHAR));
+    return PtNameHash(&view);
+}
+
+BOOLEAN PtPathIsPattern(PCUNICODE_STRING Name) {
+    for (ULONG i = 0; i < Name->Length / sizeof(WCHAR); i++) {
+        if (Name->Buffer[i] == '*') { return TRUE; }
+    }
+    return FALSE;
+}
+
+//
+// Splits a folded rule, already stripped of empty components, into its key
+// and wildcard. Returns FALSE for rules the trie cannot hold.
+//
+static BOOLEAN ptParseRule(PCWCH text, ULONG start, ULONG length, PPT_TRIE_RULE rule) {
+    PCWCH p = text + start;
+    ULONG last = length, depth = 0;
+    ULONG keyEnd;
+
+    // Last component: [last, length)
+    while (last > 0 && p[last - 1] != '\\') { last--; }
+    keyEnd = last > 0 ? last - 1 : 0;
+
+    rule->Key = start;
+    rule->Ext = 0;
+    rule->ExtLength = 0;
+
+    if (length - last == 1 && p[last] == '*') {
+        rule->Kind = PT_TRIE_ANY_CHILD;
+    } else if (length - last == 2 && p[last] == '*' && p[last + 1] == '*') {
+        rule->Kind = PT_TRIE_ANY_DESCENDANT;
+    } else if (length - last > 2 && p[last] == '*' && p[last + 1] == '.') {
+        rule->Kind = PT_TRIE_CHILD_EXT;
+        rule->Ext = start + last + 2;
+        rule->ExtLength = length - last - 2;
+        for (ULONG i = 0; i < rule->ExtLength; i++) {
+            if (text[rule->Ext + i] == '*' || text[rule->Ext + i] == '.') { return FALSE; }
+        }
+
+        // dir\**\*.ext
+        if (keyEnd >= 2 && p[keyEnd - 1] == '*' && p[keyEnd - 2] == '*' && (keyEnd == 2 || p[keyEnd - 3] == '\\')) {
+            rule->Kind = PT_TRIE_DESCENDANT_EXT;
+            keyEnd = keyEnd > 2 ? keyEnd - 3 : 0;
+        }
+    } else {
+        rule->Kind = PT_TRIE_EXACT;
+        keyEnd = length;
+    }
+
+    rule->KeyLength = keyEnd;
+    for (ULONG i = 0; i < keyEnd; i++) {
+        if (p[i] == '*') { return FALSE; }
+        depth += (p[i] == '\\');
+    }
+    if (keyEnd != 0 && depth + 1 > PT_PATH_TRIE_MAX_DEPTH) { return FALSE; }
+    return rule->Kind != PT_TRIE_EXACT || keyEnd != 0;
+}
+
+static ULONG ptComponentEnd(PCWCH key, ULONG start, ULONG length) {
+    while (start < length && key[start] != '\\') { start++; }
+    return start;
+}
+
+//
+// Builds the node for rules [lo, hi), which all share their first Offset
+// characters; Offset is 0 at the root and otherwise sits on a '\' or at the
+// end of a key. Recursion is bounded by PT_PATH_TRIE_MAX_DEPTH.
+//
+static ULONG ptBuildNode(PPT_TRIE_BUILD build, ULONG lo, ULONG hi, ULONG offset) {
+    PPT_PATH_TRIE trie = build->Trie;
+    PT_TRIE_RULE* rules = build->Rules;
+    ULONG index = trie->NodeCount++;
+    ULONG start = offset == 0 ? 0 : offset + 1;
+    ULONG i, groups = 0, childExts = 0, descendantExts = 0;
+    ULONG firstEdge, firstExt, child, descendant;
+    USHORT exact = 0, anyChild = 0, anyDescendant = 0;
+
+    // Rules ending here
+    for (i = lo; i < hi && rules[i].KeyLength == offset; i++) {
+        switch (rules[i].Kind) {
+        case PT_TRIE_CHILD_EXT: childExts++; break;
+        case PT_TRIE_DESCENDANT_EXT: descendantExts++; break;
+        case PT_TRIE_EXACT: exact |= rules[i].Mask; break;
+        case PT_TRIE_ANY_CHILD: anyChild |= rules[i].Mask; break;
+        default: anyDescendant |= rules[i].Mask; break;
+        }
+    }
+
+    firstExt = trie->ExtCount;
+    child = firstExt;
+    descendant = firstExt + childExts;
+    for (ULONG r = lo; r < i; r++) {
+        PT_TRIE_EXT* ext;
+        if (rules[r].Kind == PT_TRIE_CHILD_EXT) { ext = &build->Exts[child++]; }
+        else if (rules[r].Kind == PT_TRIE_DESCENDANT_EXT) { ext = &build->Exts[descendant++]; }
+        else { continue; }
+        ext->Hash = ptHashRange(build->Text + rules[r].Ext, rules[r].ExtLength);
+        ext->Label = rules[r].Ext;
+        ext->Length = rules[r].ExtLength * sizeof(WCHAR);
+        ext->Mask = rules[r].Mask;
+    }
+    trie->ExtCount += childExts + descendantExts;
+    ptHeapSort(&build->Exts[firstExt], childExts, sizeof(PT_TRIE_EXT), ptCompareExts, NULL);
+    ptHeapSort(&build->Exts[firstExt + childExts], descendantExts, sizeof(PT_TRIE_EXT), ptCompareExts, NULL);
+
+    // One edge per distinct next component; reserve them before recursing
+    for (ULONG g = i; g < hi;) {
+        PCWCH key = build->Text + rules[g].Key;
+        ULONG end = ptComponentEnd(key, start, rules[g].KeyLength);
+        ULONG h = g + 1;
+        while (h < hi && ptComponentEnd(build->Text + rules[h].Key, start, rules[h].KeyLength) == end &&
+            RtlEqualMemory(build->Text + rules[h].Key + start, key + start, (end - start) * sizeof(WCHAR))) {
+            h++;
+        }
+        groups++;
+        g = h;
+    }
+    firstEdge = trie->EdgeCount;
+    trie->EdgeCount += groups;
+
+    for (ULONG g = i, e = firstEdge; g < hi; e++) {
+        PCWCH key = build->Text + rules[g].Key;
+        ULONG end = ptComponentEnd(key, start, rules[g].KeyLength);
+        ULONG h = g + 1;
+        while (h < hi && ptComponentEnd(build->Text + rules[h].Key, start, rules[h].KeyLength) == end &&
+            RtlEqualMemory(build->Text + rules[h].Key + start, key + start, (end - start) * sizeof(WCHAR))) {
+            h++;
+        }
+
+        // Extend the edge over every further component the whole group
+        // shares, as long as no rule of the group ends inside it. The keys
+        // are sorted, so the first and last of the group decide.
+        const PT_TRIE_RULE* first = &rules[g];
+        const PT_TRIE_RULE* last = &rules[h - 1];
+        PCWCH lastKey = build->Text + last->Key;
+        ULONG common = start;
+        ULONG limit = first->KeyLength < last->KeyLength ? first->KeyLength : last->KeyLength;
+        while (common < limit && key[common] == lastKey[common]) { common++; }
+        if (!((common == first->KeyLength || key[common] == '\\') &&
+              (common == last->KeyLength || lastKey[common] == '\\'))) {
+            while (key[common - 1] != '\\') { common--; }
+            common--;
+        }
+
+        build->Edges[e].Hash = ptHashRange(key + start, end - start);
+        build->Edges[e].Label = first->Key + start;
+        build->Edges[e].Length = (common - start) * sizeof(WCHAR);
+        build->Edges[e].Node = ptBuildNode(build, g, h, common);
+        g = h;
+    }
+    ptHeapSort(&build->Edges[firstEdge], groups, sizeof(PT_TRIE_EDGE), ptCompareEdges, NULL);
+
+    build->Nodes[index].FirstEdge = firstEdge;
+    build->Nodes[index].EdgeCount = groups;
+    build->Nodes[index].FirstExt = firstExt;
+    build->Nodes[index].ChildExtCount = childExts;
+    build->Nodes[index].DescendantExtCount = descendantExts;
+    build->Nodes[index].Exact = exact;
+    build->Nodes[index].AnyChild = anyChild;
+    build->Nodes[index].AnyDescendant = anyDescendant;
+    return index;
+}
+
+NTSTATUS PtPathTrieBuild(const UNICODE_STRING* Rules, const USHORT* Masks, ULONG Count, PPT_PATH_TRIE* Trie, PULONG Rejected) {
+    PPT_PATH_TRIE trie;
+    PT_TRIE_BUILD build;
+    PT_TRIE_RULE* rules;
+    SIZE_T chars = 0, components = 1, size;
+    ULONG valid = 0, cursor = 0;
+    PWCH labels;
+
+    *Trie = NULL;
+    *Rejected = 0;
+
+    for (ULONG i = 0; i < Count; i++) {
+        chars += Rules[i].Length / sizeof(WCHAR);
+        for (ULONG c = 0; c < Rules[i].Length / sizeof(WCHAR); c++) { components += (Rules[i].Buffer[c] == '\\'); }
+        components++;
+    }
+    if (Count == 0 || Count > 0x10000000 || chars > 0x40000000) { return Count == 0 ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER; }
+
+    // Header, nodes, edges, extensions and the rule text in one allocation;
+    // a node per component is more than enough.
+    size = sizeof(PT_PATH_TRIE) + components * sizeof(PT_TRIE_NODE) + components * sizeof(PT_TRIE_EDGE) +
+        (SIZE_T)Count * sizeof(PT_TRIE_EXT) + chars * sizeof(WCHAR);
+    if (size > MAXULONG) { return STATUS_INVALID_PARAMETER; }
+    trie = (PPT_PATH_TRIE)FILEFLT_ALLOC(size, PT_PATH_TRIE_TAG);
+    if (trie == NULL) { return STATUS_INSUFFICIENT_RESOURCES; }
+    rules = (PT_TRIE_RULE*)FILEFLT_ALLOC((SIZE_T)Count * 2 * sizeof(PT_TRIE_RULE), PT_PATH_TRIE_TAG);
+    if (rules == NULL) {
+        FILEFLT_FREE(trie, PT_PATH_TRIE_TAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(trie, sizeof(PT_PATH_TRIE));
+    build.Trie = trie;
+    build.Nodes = (PT_TRIE_NODE*)(trie + 1);
+    build.Edges = (PT_TRIE_EDGE*)(build.Nodes + components);
+    build.Exts = (PT_TRIE_EXT*)(build.Edges + components);
+    labels = (PWCH)(build.Exts + Count);
+
+    // Copy each rule without its leading, doubled and trailing '\', fold it
+    // and split it
+    for (ULONG i = 0; i < Count; i++) {
+        PCWCH src = Rules[i].Buffer;
+        ULONG start = cursor;
+        UNICODE_STRING view;
+
+        for (ULONG c = 0; c < Rules[i].Length / sizeof(WCHAR); c++) {
+            if (src[c] == '\\' && (cursor == start || labels[cursor - 1] == '\\')) { continue; }
+            labels[cursor++] = src[c];
+        }
+        if (cursor > start && labels[cursor - 1] == '\\') { cursor--; }
+
+        view.Buffer = labels + start;
+        view.Length = view.MaximumLength = (USHORT)((cursor - start) * sizeof(WCHAR));
+        PtNameFold(&view);
+
+        if (cursor > start && ptParseRule(labels, start, cursor - start, &rules[valid])) {
+            rules[valid++].Mask = Masks != NULL ? Masks[i] : (USHORT)~0;
+        } else {
+            (*Rejected)++;
+            cursor = start;
+        }
+    }
+
+    if (valid == 0) {
+        FILEFLT_FREE(rules, PT_PATH_TRIE_TAG);
+        FILEFLT_FREE(trie, PT_PATH_TRIE_TAG);
+        return STATUS_SUCCESS;
+    }
+
+    ptMergeSortRules(rules, rules + valid, valid, labels);
+
+    build.Rules = rules;
+    build.Text = labels;
+    trie->RuleCount = valid;
+    ptBuildNode(&build, 0, valid, 0);
+    FILEFLT_FREE(rules, PT_PATH_TRIE_TAG);
+
+    // Close the gaps the capacity estimate left; every table moves down
+    trie->LabelChars = cursor;
+    RtlMoveMemory((PVOID)PtPathTrieEdges(trie), build.Edges, (SIZE_T)trie->EdgeCount * sizeof(PT_TRIE_EDGE));
+    RtlMoveMemory((PVOID)PtPathTrieExts(trie), build.Exts, (SIZE_T)trie->ExtCount * sizeof(PT_TRIE_EXT));
+    RtlMoveMemory((PVOID)PtPathTrieLabels(trie), labels, (SIZE_T)cursor * sizeof(WCHAR));
+    trie->Size = (ULONG)((const UCHAR*)(PtPathTrieLabels(trie) + cursor) - (const UCHAR*)trie);
+
+    *Trie = trie;
+    return STATUS_SUCCESS;
+}
+
+VOID PtPathTrieFree(PPT_PATH_TRIE Trie) {
+    if (Trie != NULL) { FILEFLT_FREE(Trie, PT_PATH_TRIE_TAG); }
+}
+
+BOOLEAN PtPathTrieValidate(const PT_PATH_TRIE* Trie, ULONG Size) {
+    const PT_TRIE_NODE* nodes;
+    const PT_TRIE_EDGE* edges;
+    const PT_TRIE_EXT* exts;
+    ULONG64 edge = 0, ext = 0;
+
+    if (Size < sizeof(PT_PATH_TRIE) || Trie->Size > Size || Trie->NodeCount == 0) { return FALSE; }
+    if (sizeof(PT_PATH_TRIE) + (ULONG64)Trie->NodeCount * sizeof(PT_TRIE_NODE) + (ULONG64)Trie->EdgeCount * sizeof(PT_TRIE_EDGE) +
+        (ULONG64)Trie->ExtCount * sizeof(PT_TRIE_EXT) + (ULONG64)Trie->LabelChars * sizeof(WCHAR) != Trie->Size) {
+        return FALSE;
+    }
+
+    nodes = PtPathTrieNodes(Trie);
+    edges = PtPathTrieEdges(Trie);
+    exts = PtPathTrieExts(Trie);
+
+    // The build reserves each node's edges and extensions right after the
+    // previous node's, so the ranges are running sums
+    for (ULONG i = 0; i < Trie->NodeCount; i++) {
+        if (nodes[i].FirstEdge != edge || nodes[i].FirstExt != ext) { return FALSE; }
+        edge += nodes[i].EdgeCount;
+        ext += (ULONG64)nodes[i].ChildExtCount + nodes[i].DescendantExtCount;
+        if (edge > Trie->EdgeCount || ext > Trie->ExtCount) { return FALSE; }
+
+        for (ULONG e = nodes[i].FirstEdge; e < nodes[i].FirstEdge + nodes[i].EdgeCount; e++) {
+            if (edges[e].Node <= i || edges[e].Node >= Trie->NodeCount ||
+                (edges[e].Length & 1) != 0 || (ULONG64)edges[e].Label + edges[e].Length / sizeof(WCHAR) > Trie->LabelChars) {
+                return FALSE;
+            }
+        }
+    }
+    if (edge != Trie->EdgeCount || ext != Trie->ExtCount) { return FALSE; }
+
+    for (ULONG x = 0; x < Trie->ExtCount; x++) {
+        if ((exts[x].Length & 1) != 0 || (ULONG64)exts[x].Label + exts[x].Length / sizeof(WCHAR) > Trie->LabelChars) { return FALSE; }
+    }
+    return TRUE;
+}
+
+//
+// Union of the masks of the extensions in [first, first + count) equal to
+// ext; the same extension can appear once per rule that names it.
+//
+static USHORT ptFindExt(const PT_TRIE_EXT* exts, PCWCH labels, ULONG first, ULONG count, PCWCH ext, ULONG length, ULONG hash) {
+    ULONG lo = first, hi = first + count;
+    USHORT mask = 0;
+    while (lo < hi) {
+        ULONG mid = lo + (hi - lo) / 2;
+        if (exts[mid].Hash < hash) { lo = mid + 1; } else { hi = mid; }
+    }
+    for (; lo < first + count && exts[lo].Hash == hash; lo++) {
+        if (exts[lo].Length == length && RtlEqualMemory(labels + exts[lo].Label, ext, length)) { mask |= exts[lo].Mask; }
+    }
+    return mask;
+}
+
+USHORT PtPathTrieMatch(const PT_PATH_TRIE* Trie, PCUNICODE_STRING Name) {
+    PCWCH p = Name->Buffer;
+    ULONG length = Name->Length / sizeof(WCHAR);
+    ULONG pos = 0, ext = 0, extHash = 0;
+    BOOLEAN extHashed = FALSE;
+    USHORT mask = 0;
+    const PT_TRIE_NODE* nodes;
+    const PT_TRIE_EDGE* edges;
+    const PT_TRIE_EXT* exts;
+    PCWCH labels;
+    const PT_TRIE_NODE* node;
+
+    if (Trie == NULL) { return 0; }
+    nodes = PtPathTrieNodes(Trie);
+    edges = PtPathTrieEdges(Trie);
+    exts = PtPathTrieExts(Trie);
+    labels = PtPathTrieLabels(Trie);
+
+    while (pos < length && p[pos] == '\\') { pos++; }
+    while (length > pos && p[length - 1] == '\\') { length--; }
+
+    // Extension of the last component, if it has one
+    for (ULONG i = length; i > pos && p[i - 1] != '\\'; i--) {
+        if (p[i - 1] == '.') {
+            ext = i;
+            break;
+        }
+    }
+
+    // Rules with different masks can match at several depths, so the walk
+    // goes on past the first match and collects them all
+    node = &nodes[0];
+    for (;;) {
+        const PT_TRIE_EDGE* edge = NULL;
+        ULONG end, hash, lo, hi;
+
+        if (pos >= length) { return mask | node->Exact; }
+        mask |= node->AnyDescendant;
+
+        end = ptComponentEnd(p, pos, length);
+        if (end == length) { mask |= node->AnyChild; }
+
+        if ((node->ChildExtCount | node->DescendantExtCount) != 0 && ext != 0 && ext < length) {
+            if (!extHashed) {
+                extHash = ptHashRange(p + ext, length - ext);
+                extHashed = TRUE;
+            }
+            mask |= ptFindExt(exts, labels, node->FirstExt + node->ChildExtCount, node->DescendantExtCount, p + ext, (length - ext) * sizeof(WCHAR), extHash);
+            if (end == length) { mask |= ptFindExt(exts, labels, node->FirstExt, node->ChildExtCount, p + ext, (length - ext) * sizeof(WCHAR), extHash); }
+        }
+
+        // Edge for the next component; the whole label has to match, and end
+        // on a component boundary of the name
+        hash = ptHashRange(p + pos, end - pos);
+        lo = node->FirstEdge;
+        hi = node->FirstEdge + node->EdgeCount;
+        while (lo < hi) {
+            ULONG mid = lo + (hi - lo) / 2;
+            if (edges[mid].Hash < hash) { lo = mid + 1; } else { hi = mid; }
+        }
+        for (; lo < node->FirstEdge + node->EdgeCount && edges[lo].Hash == hash; lo++) {
+            const PT_TRIE_EDGE* e = &edges[lo];
+            ULONG chars = e->Length / sizeof(WCHAR);
+            if (pos + chars <= length && (pos + chars == length || p[pos + chars] == '\\') &&
+                RtlEqualMemory(labels + e->Label, p + pos, e->Length)) {
+                edge = e;
+                break;
+            }
+        }
+        if (edge == NULL) { return mask; }
+
+        node = &nodes[edge->Node];
+        pos += edge->Length / sizeof(WCHAR);
+        if (pos < length) { pos++; }
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+//
+// Compressed trie over path components, for protection rules that name
+// more than one file.
+//
+// A rule is a normalized path whose last component may be a wildcard:
+//   \Device\HarddiskVolume2\dir\*          every entry directly in dir
+//   \Device\HarddiskVolume2\dir\**         everything below dir, any depth
+//   \Device\HarddiskVolume2\dir\*.ext      entries directly in dir ending in .ext
+//   \Device\HarddiskVolume2\dir\**\*.ext   entries below dir ending in .ext
+// Without a wildcard it names one path exactly; the driver keeps those in
+// the name set (nameset.h) instead, but the trie takes them too. A '*'
+// anywhere else, an extension with a '*' in it, or more than
+// PT_PATH_TRIE_MAX_DEPTH components make a rule invalid.
+//
+// The trie is keyed by the directory part of each rule, split at '\'. A
+// node that has a single child and no rule of its own is merged into its
+// parent's edge, so one edge can span several components and a lookup
+// compares them in one go. Each node carries flags for the rules ending at
+// it and two sorted tables of extensions; its edges are sorted by the hash
+// of their first component. Matching walks the upcased name one component
+// at a time, hashing each component once and binary searching the edges of
+// the current node, so it costs O(depth * log(fanout)) whatever the number
+// of rules.
+//
+// Like the name set, the trie is built once per configuration load into a
+// single allocation and never changed after that, and each rule carries an
+// operation mask it does not interpret. A name matched by several rules
+// gets the union of their masks. It holds no pointers either: the nodes,
+// edges, extensions and labels follow the header in that order and refer
+// to each other by index, so a trie can travel inside a policy image.
+//
+
+#include "nameset.h"
+
+#define PT_PATH_TRIE_TAG        'tPlF'
+#define PT_PATH_TRIE_MAX_DEPTH  64
+
+#define PT_TRIE_EXACT           0x0001      // the key itself
+#define PT_TRIE_ANY_CHILD       0x0002      // key\*
+#define PT_TRIE_ANY_DESCENDANT  0x0004      // key\**
+
+typedef struct _PT_TRIE_NODE {
+    ULONG   FirstEdge;
+    ULONG   EdgeCount;
+    ULONG   FirstExt;           // child extensions, then descendant ones
+    ULONG   ChildExtCount;
+    ULONG   DescendantExtCount;
+    USHORT  Exact;              // masks of the rules ending here, by kind
+    USHORT  AnyChild;
+    USHORT  AnyDescendant;
+} PT_TRIE_NODE, *PPT_TRIE_NODE;
+
+typedef struct _PT_TRIE_EDGE {
+    ULONG   Hash;               // PtNameHash of the first component
+    ULONG   Node;
+    ULONG   Label;              // offset into Labels, in characters
+    ULONG   Length;             // bytes; several components joined by '\'
+} PT_TRIE_EDGE, *PPT_TRIE_EDGE;
+
+typedef struct _PT_TRIE_EXT {
+    ULONG   Hash;               // PtNameHash of the extension, without '.'
+    ULONG   Label;
+    ULONG   Length;
+    USHORT  Mask;
+} PT_TRIE_EXT, *PPT_TRIE_EXT;
+
+typedef struct _PT_PATH_TRIE {
+    ULONG   Size;               // bytes, header to the end of the labels
+    ULONG   NodeCount;          // node 0 is the root
+    ULONG   EdgeCount;
+    ULONG   ExtCount;
+    ULONG   RuleCount;          // valid rules
+    ULONG   LabelChars;         // the upcased rules
+} PT_PATH_TRIE, *PPT_PATH_TRIE;
+
+C_ASSERT(sizeof(PT_TRIE_NODE) == 28);
+C_ASSERT(sizeof(PT_TRIE_EDGE) == 16);
+C_ASSERT(sizeof(PT_TRIE_EXT) == 16);
+C_ASSERT(sizeof(PT_PATH_TRIE) == 24);
+
+static FORCEINLINE const PT_TRIE_NODE* PtPathTrieNodes(const PT_PATH_TRIE* Trie) {
+    return (const PT_TRIE_NODE*)(Trie + 1);
+}
+
+static FORCEINLINE const PT_TRIE_EDGE* PtPathTrieEdges(const PT_PATH_TRIE* Trie) {
+    return (const PT_TRIE_EDGE*)(PtPathTrieNodes(Trie) + Trie->NodeCount);
+}
+
+static FORCEINLINE const PT_TRIE_EXT* PtPathTrieExts(const PT_PATH_TRIE* Trie) {
+    return (const PT_TRIE_EXT*)(PtPathTrieEdges(Trie) + Trie->EdgeCount);
+}
+
+static FORCEINLINE PCWCH PtPathTrieLabels(const PT_PATH_TRIE* Trie) {
+    return (PCWCH)(PtPathTrieExts(Trie) + Trie->ExtCount);
+}
+
+//
+// TRUE if Name has a '*' in it and so is a rule for the trie rather than
+// for the name set.
+//
+BOOLEAN PtPathIsPattern(PCUNICODE_STRING Name);
+
+//
+// Builds a trie of Count rules with their masks, or with every mask bit set
+// if Masks is NULL. The rules are copied and folded; invalid ones are
+// skipped and counted in *Rejected. *Trie is NULL on failure or when no
+// rule is valid.
+//
+NTSTATUS PtPathTrieBuild(const UNICODE_STRING* Rules, const USHORT* Masks, ULONG Count, PPT_PATH_TRIE* Trie, PULONG Rejected);
+
+VOID PtPathTrieFree(PPT_PATH_TRIE Trie);
+
+//
+// TRUE if the Size bytes at Trie hold a trie every match stays inside of:
+// sizes that add up, edge and extension ranges that tile their tables in
+// node order, labels within the label buffer and edges that only lead to
+// later nodes, so a walk cannot loop.
+//
+BOOLEAN PtPathTrieValidate(const PT_PATH_TRIE* Trie, ULONG Size);
+
+//
+// Union of the masks of the rules an upcased, normalized name (see
+// PtNameFold) matches, 0 if it matches none. Leading and trailing '\' are
+// ignored; a doubled one inside the name is not, as normalized names have
+// none. A NULL trie matches nothing.
+//
+USHORT PtPathTrieMatch(const PT_PATH_TRIE* Trie, PCUNICODE_STRING Name);
@@ -0,0 +1,249 @@
+//
+// Flat protection policy images (see policy.h).
+//
+
+#include "policy.h"
+
+#define PT_POLICY_CHECKSUM_START    FIELD_OFFSET(PT_POLICY_IMAGE, Ops)
+
+static ULONG ptPolicyAlign(ULONG64 Offset) {
+    return (ULONG)((Offset + PT_POLICY_IMAGE_ALIGN - 1) & ~(ULONG64)(PT_POLICY_IMAGE_ALIGN - 1));
+}
+
+//
+// Union of every mask the set and the trie hold; the driver skips the
+// callbacks of operations outside it, so it has to be exact.
+//
+static ULONG ptPolicyOps(const PT_NAME_SET* Names, const PT_PATH_TRIE* Patterns) {
+    ULONG ops = 0;
+
+    if (Names != NULL) {
+        const PT_NAME_SLOT* slots = PtNameSetSlots(Names);
+        for (ULONG i = 0; i <= Names->Mask; i++) {
+            if (slots[i].Length != 0) { ops |= slots[i].Mask; }
+        }
+    }
+    if (Patterns != NULL) {
+        const PT_TRIE_NODE* nodes = PtPathTrieNodes(Patterns);
+        const PT_TRIE_EXT* exts = PtPathTrieExts(Patterns);
+        for (ULONG i = 0; i < Patterns->NodeCount; i++) { ops |= nodes[i].Exact | nodes[i].AnyChild | nodes[i].AnyDescendant; }
+        for (ULONG i = 0; i < Patterns->ExtCount; i++) { ops |= exts[i].Mask; }
+    }
+    return ops;
+}
+
+ULONG PtPolicyImageChecksum(const UCHAR* Data, ULONG Length) {
+    // CRC-32 (IEEE 802.3, reflected). The table is rebuilt on the stack for
+    // every call: 1 KiB of stack and 2K shifts against images of megabytes.
+    ULONG table[256];
+    ULONG crc = 0xFFFFFFFF;
+
+    for (ULONG i = 0; i < 256; i++) {
+        ULONG c = i;
+        for (ULONG k = 0; k < 8; k++) { c = (c >> 1) ^ ((c & 1) ? 0xEDB88320 : 0); }
+        table[i] = c;
+    }
+    for (ULONG i = 0; i < Length; i++) { crc = (crc >> 8) ^ table[(crc ^ Data[i]) & 0xFF]; }
+    return ~crc;
+}
+
+ULONG PtPolicyImageSize(const PT_NAME_SET* Names, const PT_PATH_TRIE* Patterns, const PT_NAME_SET* Directories) {
+    ULONG64 size = sizeof(PT_POLICY_IMAGE);
+
+    if (Names != NULL) { size = ptPolicyAlign(size) + (ULONG64)Names->Size; }
+    if (size > PT_POLICY_IMAGE_MAX_SIZE) { return 0; }
+    if (Patterns != NULL) { size = ptPolicyAlign(size) + (ULONG64)Patterns->Size; }
+    if (size > PT_POLICY_IMAGE_MAX_SIZE) { return 0; }
+    if (Directories != NULL) { size = ptPolicyAlign(size) + (ULONG64)Directories->Size; }
+    return size > PT_POLICY_IMAGE_MAX_SIZE ? 0 : (ULONG)size;
+}
+
+VOID PtPolicyImageWrite(PPT_POLICY_IMAGE Image, ULONG Size, const PT_NAME_SET* Names, const PT_PATH_TRIE* Patterns,
+    const PT_NAME_SET* Directories) {
+    ULONG offset = sizeof(PT_POLICY_IMAGE);
+
+    RtlZeroMemory(Image, Size);
+    Image->Magic = PT_POLICY_IMAGE_MAGIC;
+    Image->Version = PT_POLICY_IMAGE_VERSION;
+    Image->HeaderSize = sizeof(PT_POLICY_IMAGE);
+    Image->Size = Size;
+    Image->Ops = ptPolicyOps(Names, Patterns);
+
+    if (Names != NULL) {
+        Image->NamesOffset = ptPolicyAlign(offset);
+        RtlCopyMemory((PUCHAR)Image + Image->NamesOffset, Names, Names->Size);
+        offset = Image->NamesOffset + Names->Size;
+    }
+    if (Patterns != NULL) {
+        Image->PatternsOffset = ptPolicyAlign(offset);
+        RtlCopyMemory((PUCHAR)Image + Image->PatternsOffset, Patterns, Patterns->Size);
+        offset = Image->PatternsOffset + Patterns->Size;
+    }
+    if (Directories != NULL) {
+        Image->DirectoriesOffset = ptPolicyAlign(offset);
+        RtlCopyMemory((PUCHAR)Image + Image->DirectoriesOffset, Directories, Directories->Size);
+    }
+    Image->Checksum = PtPolicyImageChecksum((const UCHAR*)Image + PT_POLICY_CHECKSUM_START, Size - PT_POLICY_CHECKSUM_START);
+}
+
+//
+// Number of directories of Entry (see PtPolicyImageBuild), and their views
+// into it at Directories when that is not NULL.
+//
+static ULONG ptPolicyDirectories(PCUNICODE_STRING Entry, PUNICODE_STRING Directories) {
+    ULONG length = Entry->Length / sizeof(WCHAR);
+    ULONG count = 0;
+
+    while (length > 0 && Entry->Buffer[length - 1] == '\\') { length--; }
+    for (ULONG i = 1; i < length && Entry->Buffer[i] != '*'; i++) {
+        if (Entry->Buffer[i] != '\\' || Entry->Buffer[i - 1] == '\\') { continue; }
+        if (Directories != NULL) {
+            Directories[count].Buffer = Entry->Buffer;
+            Directories[count].Length = Directories[count].MaximumLength = (USHORT)(i * sizeof(WCHAR));
+        }
+        count++;
+    }
+    return count;
+}
+
+//
+// Name set of the directories of Count entries, each with the union of
+// the masks of the entries below it; NULL when there are none.
+//
+static NTSTATUS ptPolicyBuildDirectories(const UNICODE_STRING* Entries, const USHORT* Masks, ULONG Count, PPT_NAME_SET* Directories) {
+    PUNICODE_STRING views;
+    PUSHORT masks;
+    SIZE_T total = 0;
+    ULONG count = 0;
+    NTSTATUS status;
+
+    *Directories = NULL;
+    for (ULONG i = 0; i < Count; i++) { total += ptPolicyDirectories(&Entries[i], NULL); }
+    if (total == 0) { return STATUS_SUCCESS; }
+    if (total > 0x10000000) { return STATUS_INVALID_PARAMETER; }
+
+    views = (PUNICODE_STRING)FILEFLT_ALLOC(total * (sizeof(UNICODE_STRING) + sizeof(USHORT)), PT_POLICY_IMAGE_TAG);
+    if (views == NULL) { return STATUS_INSUFFICIENT_RESOURCES; }
+    masks = (PUSHORT)(views + total);
+
+    for (ULONG i = 0; i < Count; i++) {
+        ULONG n = ptPolicyDirectories(&Entries[i], &views[count]);
+        for (ULONG d = 0; d < n; d++) { masks[count + d] = Masks[i]; }
+        count += n;
+    }
+
+    status = PtNameSetBuild(views, masks, count, Directories);
+    FILEFLT_FREE(views, PT_POLICY_IMAGE_TAG);
+    return status;
+}
+
+NTSTATUS PtPolicyImageBuild(const UNICODE_STRING* Entries, const USHORT* Masks, ULONG Count, PPT_POLICY_IMAGE* Image, PULONG Rejected) {
+    PUNICODE_STRING entries;
+    PUSHORT masks;
+    PPT_NAME_SET names = NULL;
+    PPT_PATH_TRIE patterns = NULL;
+    PPT_NAME_SET directories = NULL;
+    ULONG exact = 0, wild = 0, size;
+    NTSTATUS status;
+
+    *Image = NULL;
+    *Rejected = 0;
+    if (Count > 0x10000000) { return STATUS_INVALID_PARAMETER; }
+
+    // Exact names from the front, wildcard rules from the back; the arrays
+    // only hold views of the caller's strings
+    entries = (PUNICODE_STRING)FILEFLT_ALLOC((SIZE_T)(Count + 1) * (sizeof(UNICODE_STRING) + sizeof(USHORT)), PT_POLICY_IMAGE_TAG);
+    if (entries == NULL) { return STATUS_INSUFFICIENT_RESOURCES; }
+    masks = (PUSHORT)(entries + Count + 1);
+
+    for (ULONG i = 0; i < Count; i++) {
+        USHORT mask = Masks != NULL ? Masks[i] : (USHORT)~0;
+        ULONG slot;
+        if (mask == 0 || Entries[i].Length == 0) { continue; }
+        slot = PtPathIsPattern(&Entries[i]) ? Count - ++wild : exact++;
+        entries[slot] = Entries[i];
+        masks[slot] = mask;
+    }
+
+    status = PtNameSetBuild(entries, masks, exact, &names);
+    if (NT_SUCCESS(status)) { status = PtPathTrieBuild(&entries[Count - wild], &masks[Count - wild], wild, &patterns, Rejected); }
+
+    // Then the directories of both, with the rules moved up behind the names
+    if (NT_SUCCESS(status)) {
+        RtlMoveMemory(&entries[exact], &entries[Count - wild], (SIZE_T)wild * sizeof(UNICODE_STRING));
+        RtlMoveMemory(&masks[exact], &masks[Count - wild], (SIZE_T)wild * sizeof(USHORT));
+        status = ptPolicyBuildDirectories(entries, masks, exact + wild, &directories);
+    }
+    FILEFLT_FREE(entries, PT_POLICY_IMAGE_TAG);
+
+    if (NT_SUCCESS(status)) {
+        // An empty set costs a table for nothing
+        if (names != NULL && names->Count == 0) {
+            PtNameSetFree(names);
+            names = NULL;
+        }
+        size = PtPolicyImageSize(names, patterns, directories);
+        if (size == 0) {
+            status = STATUS_INVALID_PARAMETER;
+        } else {
+            *Image = (PPT_POLICY_IMAGE)FILEFLT_ALLOC(size, PT_POLICY_IMAGE_TAG);
+            if (*Image == NULL) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+            } else {
+                PtPolicyImageWrite(*Image, size, names, patterns, directories);
+            }
+        }
+    }
+
+    PtNameSetFree(names);
+    PtPathTrieFree(patterns);
+    PtNameSetFree(directories);
+    return status;
+}
+
+VOID PtPolicyImageFree(PPT_POLICY_IMAGE Image) {
+    if (Image != NULL) { FILEFLT_FREE(Image, PT_POLICY_IMAGE_TAG); }
+}
+
+BOOLEAN PtPolicyImageValidate(const PT_POLICY_IMAGE* Image, ULONG Size) {
+    ULONG end = sizeof(PT_POLICY_IMAGE);
+
+    // Header first: nothing past it is trusted before the checksum matches
+    if (((ULONG_PTR)Image & (PT_POLICY_IMAGE_ALIGN - 1)) != 0 || Size < sizeof(PT_POLICY_IMAGE) ||
+        Size > PT_POLICY_IMAGE_MAX_SIZE) {
+        return FALSE;
+    }
+    if (Image->Magic != PT_POLICY_IMAGE_MAGIC || Image->Version != PT_POLICY_IMAGE_VERSION ||
+        Image->HeaderSize != sizeof(PT_POLICY_IMAGE) || Image->Size != Size) {
+        return FALSE;
+    }
+    if (Image->Checksum != PtPolicyImageChecksum((const UCHAR*)Image + PT_POLICY_CHECKSUM_START, Size - PT_POLICY_CHECKSUM_START)) {
+        return FALSE;
+    }
+
+    // Sections in order, aligned and inside the image
+    if (Image->NamesOffset != 0) {
+        if (Image->NamesOffset < end || (Image->NamesOffset & (PT_POLICY_IMAGE_ALIGN - 1)) != 0 ||
+            (ULONG64)Image->NamesOffset + sizeof(PT_NAME_SET) > Size ||
+            !PtNameSetValidate(PtPolicyImageNames(Image), Size - Image->NamesOffset)) {
+            return FALSE;
+        }
+        end = Image->NamesOffset + PtPolicyImageNames(Image)->Size;
+    }
+    if (Image->PatternsOffset != 0) {
+        if (Image->PatternsOffset < end || (Image->PatternsOffset & (PT_POLICY_IMAGE_ALIGN - 1)) != 0 ||
+            (ULONG64)Image->PatternsOffset + sizeof(PT_PATH_TRIE) > Size ||
+            !PtPathTrieValidate(PtPolicyImagePatterns(Image), Size - Image->PatternsOffset)) {
+            return FALSE;
+        }
+        end = Image->PatternsOffset + PtPolicyImagePatterns(Image)->Size;
+    }
+    if (Image->DirectoriesOffset != 0) {
+        if (Image->DirectoriesOffset < end || (Image->DirectoriesOffset & (PT_POLICY_IMAGE_ALIGN - 1)) != 0 ||
+            (ULONG64)Image->DirectoriesOffset + sizeof(PT_NAME_SET) > Size ||
+            !PtNameSetValidate(PtPolicyImageDirectories(Image), Size - Image->DirectoriesOffset)) {
+            return FALSE;
+        }
+    }
+    return (BOOLEAN)(Image->Ops == ptPolicyOps(PtPolicyImageNames(Image), PtPolicyImagePatterns(Image)));
+}
@@ -0,0 +1,94 @@
+#pragma once
+//
+// Binary protection policy: the name set (nameset.h) and the path trie
+// (pathtrie.h) of one configuration in a single flat little-endian blob.
+// A second name set holds every directory an entry lies below, each with
+// the union of the masks of those entries: renaming one of them would move
+// the entries out of the names they are protected under.
+//
+// No section holds a pointer, so an image is used where it lies:
+// loading one costs a copy and a validation pass, and publishing it is a
+// pointer exchange. Images come from ..\FilterFileCompiler, which links the
+// same nameset.c and pathtrie.c as the driver, or from the driver itself
+// when it is handed a text configuration. Any change to PT_NAME_SET,
+// PT_NAME_SLOT or the PT_TRIE_* and PT_PATH_TRIE layouts has to bump
+// PT_POLICY_IMAGE_VERSION; the C_ASSERTs in the two headers catch them
+// drifting between compilers.
+//
+//      PT_POLICY_IMAGE     header
+//      PT_NAME_SET         at NamesOffset, 8-byte aligned, if any
+//      PT_PATH_TRIE        at PatternsOffset, 8-byte aligned, if any
+//      PT_NAME_SET         at DirectoriesOffset, 8-byte aligned, if any
+//
+// The checksum is a CRC-32 of every byte from Ops on. It catches truncated
+// and damaged files; PtPolicyImageValidate also checks every index a
+// lookup follows, so a well-formed but hostile image cannot make the
+// driver read outside it.
+//
+
+#include "nameset.h"
+#include "pathtrie.h"
+
+#define PT_POLICY_IMAGE_TAG         'iPlF'
+#define PT_POLICY_IMAGE_MAGIC       0x49504646      // "FFPI"
+#define PT_POLICY_IMAGE_VERSION     2
+#define PT_POLICY_IMAGE_ALIGN       8
+#define PT_POLICY_IMAGE_MAX_SIZE    (256u << 20)
+
+typedef struct _PT_POLICY_IMAGE {
+    ULONG   Magic;
+    USHORT  Version;
+    USHORT  HeaderSize;         // sizeof(PT_POLICY_IMAGE)
+    ULONG   Size;               // whole image, header included
+    ULONG   Checksum;           // CRC-32 of bytes [FIELD_OFFSET(Ops), Size)
+    ULONG   Ops;                // union of every mask in the image
+    ULONG   NamesOffset;        // 0 - no exact names
+    ULONG   PatternsOffset;     // 0 - no wildcard rules
+    ULONG   DirectoriesOffset;  // 0 - no entry below a directory
+} PT_POLICY_IMAGE, *PPT_POLICY_IMAGE;
+
+C_ASSERT(sizeof(PT_POLICY_IMAGE) == 32);
+
+ULONG PtPolicyImageChecksum(const UCHAR* Data, ULONG Length);
+
+//
+// Bytes needed for an image of Names, Patterns and Directories (any of them
+// NULL when there are none), 0 if that is over PT_POLICY_IMAGE_MAX_SIZE.
+//
+ULONG PtPolicyImageSize(const PT_NAME_SET* Names, const PT_PATH_TRIE* Patterns, const PT_NAME_SET* Directories);
+
+//
+// Fills Size bytes at Image (PT_POLICY_IMAGE_ALIGN aligned) from Names,
+// Patterns and Directories and seals it with the checksum.
+//
+VOID PtPolicyImageWrite(PPT_POLICY_IMAGE Image, ULONG Size, const PT_NAME_SET* Names, const PT_PATH_TRIE* Patterns,
+    const PT_NAME_SET* Directories);
+
+//
+// Builds an image of Count entries, each an exact name or a wildcard rule
+// (PtPathIsPattern), with their masks. Entries with mask 0 are dropped and
+// invalid rules are counted in *Rejected. The directories of an entry are
+// its prefixes that end at a '\' before its last component and before its
+// first wildcard. The image is one FILEFLT_ALLOC allocation; free it with
+// PtPolicyImageFree.
+//
+NTSTATUS PtPolicyImageBuild(const UNICODE_STRING* Entries, const USHORT* Masks, ULONG Count, PPT_POLICY_IMAGE* Image, PULONG Rejected);
+
+VOID PtPolicyImageFree(PPT_POLICY_IMAGE Image);
+
+//
+// Image must be PT_POLICY_IMAGE_ALIGN aligned and hold Size readable bytes.
+//
+BOOLEAN PtPolicyImageValidate(const PT_POLICY_IMAGE* Image, ULONG Size);
+
+static FORCEINLINE const PT_NAME_SET* PtPolicyImageNames(const PT_POLICY_IMAGE* Image) {
+    return Image->NamesOffset != 0 ? (const PT_NAME_SET*)((const UCHAR*)Image + Image->NamesOffset) : NULL;
+}
+
+static FORCEINLINE const PT_PATH_TRIE* PtPolicyImagePatterns(const PT_POLICY_IMAGE* Image) {
+    return Image->PatternsOffset != 0 ? (const PT_PATH_TRIE*)((const UCHAR*)Image + Image->PatternsOffset) : NULL;
+}
+
+static FORCEINLINE const PT_NAME_SET* PtPolicyImageDirectories(const PT_POLICY_IMAGE* Image) {
+    return Image->DirectoriesOffset != 0 ? (const PT_NAME_SET*)((const UCHAR*)Image + Image->DirectoriesOffset) : NULL;
+}
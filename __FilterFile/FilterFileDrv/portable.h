@@ -0,0 +1,79 @@
+#pragma once
+//
+// Types and allocation helpers for the name-matching modules that are also
+// built in user mode (see ..\FilterFileBench). Kernel builds get the real
+// definitions from <fltKernel.h>; FILEFLT_USER_MODE builds get plain C
+// stand-ins.
+//
+
+#ifdef FILEFLT_USER_MODE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef VOID
+#define VOID void
+#endif
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+typedef uint8_t         UCHAR, *PUCHAR;
+typedef uint8_t         BOOLEAN, *PBOOLEAN;
+typedef char            CHAR, *PCHAR;
+typedef uint16_t        USHORT, *PUSHORT;
+typedef uint16_t        WCHAR, *PWCH, *PWCHAR;
+typedef const uint16_t  *PCWCH;
+typedef uint32_t        ULONG, *PULONG;
+typedef int32_t         LONG, NTSTATUS;
+typedef uint64_t        ULONG64, ULONGLONG;
+typedef size_t          SIZE_T;
+typedef uintptr_t       ULONG_PTR;
+typedef void*           PVOID;
+
+#define MAXULONG        0xFFFFFFFFUL
+
+typedef struct _UNICODE_STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PWCH    Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+
+#define FORCEINLINE                 inline __attribute__((always_inline))
+#define UNREFERENCED_PARAMETER(P)   ((void)(P))
+#define C_ASSERT(e)                 _Static_assert(e, #e)
+#define FIELD_OFFSET(type, field)   ((LONG)offsetof(type, field))
+
+#define FILEFLT_ALLOC(_Size, _Tag)  malloc(_Size)
+#define FILEFLT_FREE(_Ptr, _Tag)    free(_Ptr)
+
+#define RtlZeroMemory(_Dst, _Len)           memset((_Dst), 0, (_Len))
+#define RtlCopyMemory(_Dst, _Src, _Len)     memcpy((_Dst), (_Src), (_Len))
+#define RtlMoveMemory(_Dst, _Src, _Len)     memmove((_Dst), (_Src), (_Len))
+#define RtlEqualMemory(_A, _B, _Len)        (memcmp((_A), (_B), (_Len)) == 0)
+
+// Only the Latin-1 range is folded in user mode, which is all the benchmarks
+// generate; the kernel uses the system upcase table.
+static inline WCHAR RtlUpcaseUnicodeChar(WCHAR c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 0xE0 && c <= 0xFE && c != 0xF7)) { return (WCHAR)(c - 0x20); }
+    if (c == 0xFF) { return 0x178; }
+    return c;
+}
+
+#else
+
+#include <fltKernel.h>
+
+#define FILEFLT_ALLOC(_Size, _Tag)  ExAllocatePoolWithTag(NonPagedPool, (_Size), (_Tag))
+#define FILEFLT_FREE(_Ptr, _Tag)    ExFreePoolWithTag((_Ptr), (_Tag))
+
+#endif // FILEFLT_USER_MODE
@@ -0,0 +1,235 @@
+//
+// ns/packet of ndisClassifyBatch at the batch sizes the receive and send
+// handlers see. Frames sit in NIC-sized buffers spread over a pool much
+// larger than the last level cache and are visited in random order, so
+// header reads miss the cache the way freshly DMA'd frames do. The frames
+// belong to FLOWS long-lived flows, a quarter of them IPv6 (half of those
+// behind a Hop-by-Hop header) and some IPv4 ones VLAN tagged or carrying
+// options, and every batch size is run with and without the flow cache.
+// Before timing, every flow header is parsed again at every truncated
+// length to check the parser stays within the bytes it is given.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv bench_batch.c
+//       ../FilterNetworkDrv/batch.c ../FilterNetworkDrv/classifier.c
+//       ../FilterNetworkDrv/flowcache.c ../FilterNetworkDrv/lpm.c -o bench_batch
+//
+
+#include "bench_common.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+
+#define FRAMES          (1 << 15)
+#define FLOWS           1024
+#define FLOW_HDR_LEN    (NET_BATCH_ETH_LEN + NET_BATCH_IPV6_LEN + 8 + 4)
+#define FRAME_STRIDE    2048            // one receive buffer per frame
+#define RULES           4096
+#define PASSES          8
+
+static VOID put16(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 8); dst[1] = (UCHAR)v; }
+static VOID put32(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 24); dst[1] = (UCHAR)(v >> 16); dst[2] = (UCHAR)(v >> 8); dst[3] = (UCHAR)v; }
+
+static UINT32 pick_ip(UINT64* rng) { return 0x0A000000 | (bench_rand(rng) % 512); }
+static UINT32 pick_port(UINT64* rng) { return 1 + bench_rand(rng) % 1024; }
+// 2001:db8::N, N < 512
+static VOID pick_ip6(UCHAR* ip6, UINT64* rng) {
+    memset(ip6, 0, 16);
+    put32(ip6, 0x20010DB8);
+    put16(ip6 + 14, bench_rand(rng) % 512);
+}
+
+static PNET_RULES make_rules(ULONG count, UINT64* rng) {
+    PNET_RULES rules = (PNET_RULES)calloc(count, sizeof(NET_RULES));
+    for (ULONG i = 0; i < count; i++) {
+        PNET_RULES r = &rules[i];
+        r->action = 1;
+        r->ether_type[0] = 0x08;
+        switch (bench_rand(rng) % 4) {
+        case 0:     // tcp service on a host
+            r->ip_next_protocol[0] = 0x06;
+            put32(r->destination_ip, pick_ip(rng)); put16(r->destination_port, pick_port(rng));
+            break;
+        case 1:     // everything from a host
+            put32(r->source_ip, pick_ip(rng));
+            break;
+        case 2:     // tcp service on an IPv6 host
+            r->ether_type[0] = 0x86; r->ether_type[1] = 0xDD; r->ip_next_protocol[0] = 0x06;
+            pick_ip6(r->destination_ip6, rng); put16(r->destination_port, pick_port(rng));
+            break;
+        default:    // full 5-tuple
+            r->ip_next_protocol[0] = 0x11;
+            put32(r->source_ip, pick_ip(rng)); put32(r->destination_ip, pick_ip(rng));
+            put16(r->source_port, pick_port(rng)); put16(r->destination_port, pick_port(rng));
+            break;
+        }
+        r->_next = (i + 1 < count) ? &rules[i + 1] : NULL;
+        r->_prev = (i > 0) ? &rules[i - 1] : NULL;
+    }
+    return rules;
+}
+
+static VOID make_frame6(UCHAR* frame, UINT64* rng) {
+    frame[12] = 0x86;
+    frame[13] = 0xDD;
+    UCHAR* ip6 = frame + NET_BATCH_ETH_LEN;
+    UCHAR* l4 = ip6 + NET_BATCH_IPV6_LEN;
+    UCHAR protocol = (bench_rand(rng) & 1) ? 0x06 : 0x11;
+    ip6[0] = 0x60;
+    pick_ip6(ip6 + 8, rng);
+    pick_ip6(ip6 + 24, rng);
+    if (bench_rand(rng) & 1) {
+        ip6[6] = 0;                     // Hop-by-Hop, 8 bytes
+        l4[0] = protocol;
+        l4 += 8;
+    } else {
+        ip6[6] = protocol;
+    }
+    put16(l4, pick_port(rng));
+    put16(l4 + 2, pick_port(rng));
+}
+
+static VOID make_frame(UCHAR* frame, UINT64* rng) {
+    if (bench_rand(rng) % 4 == 0) {
+        make_frame6(frame, rng);
+        return;
+    }
+    UCHAR* ip = frame + NET_BATCH_ETH_LEN;
+    if (bench_rand(rng) % 8 == 0) {
+        put16(frame + 12, 0x8100);      // 802.1Q tag, VLAN 1..4094
+        put16(ip, 1 + bench_rand(rng) % 4094);
+        ip += NET_BATCH_VLAN_LEN;
+    }
+    put16(ip - 2, 0x0800);
+    ip[0] = (bench_rand(rng) % 8 == 0) ? 0x46 : 0x45;   // a few with 4 bytes of options
+    ip[9] = (bench_rand(rng) & 1) ? 0x06 : 0x11;
+    put32(ip + 12, pick_ip(rng));
+    put32(ip + 16, pick_ip(rng));
+    UCHAR* l4 = ip + (ip[0] & 0x0F) * 4;
+    put16(l4, pick_port(rng));
+    put16(l4 + 2, pick_port(rng));
+}
+
+int main(int argc, char** argv) {
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    static const ULONG batch_sizes[] = { 1, 8, 32, 64 };
+    UINT64 rng = 0x0123456789ABCDEFULL;
+
+    UCHAR* pool = (UCHAR*)calloc(FRAMES, FRAME_STRIDE);
+    PNET_BATCH_FRAME frames = (PNET_BATCH_FRAME)malloc(FRAMES * sizeof(NET_BATCH_FRAME));
+    ULONG* expect = (ULONG*)malloc(FRAMES * sizeof(ULONG));
+    UCHAR* flows = (UCHAR*)calloc(FLOWS, FLOW_HDR_LEN);
+    for (ULONG f = 0; f < FLOWS; f++) {
+        make_frame(flows + f * (FLOW_HDR_LEN), &rng);
+    }
+    for (ULONG i = 0; i < FRAMES; i++) {
+        ULONG f = bench_rand(&rng) % FLOWS;
+        memcpy(pool + (SIZE_T)i * FRAME_STRIDE, flows + f * (FLOW_HDR_LEN),
+            FLOW_HDR_LEN);
+        frames[i].data = pool + (SIZE_T)i * FRAME_STRIDE;
+        frames[i].length = NET_BATCH_HDR_MAX;
+    }
+    for (ULONG i = FRAMES - 1; i > 0; i--) {
+        ULONG j = bench_rand(&rng) % (i + 1);
+        NET_BATCH_FRAME t = frames[i]; frames[i] = frames[j]; frames[j] = t;
+    }
+
+    // Cut short anywhere, a header either parses to the full key or says
+    // how many more bytes it needs. Each cut goes in an exact-size buffer
+    // so that a sanitizer build catches any read past it.
+    for (ULONG f = 0; f < FLOWS; f++) {
+        const UCHAR* flow = flows + f * FLOW_HDR_LEN;
+        NET_CLS_KEY full, key;
+        NET_LPM6_ADDRESS full6[2], addresses[2];
+        ULONG end = ndisFrameToKey(flow, FLOW_HDR_LEN, &full, full6);
+        for (ULONG length = 0; length < end; length++) {
+            UCHAR* cut = (UCHAR*)malloc(length);
+            memcpy(cut, flow, length);
+            ULONG needed = ndisFrameToKey(cut, length, &key, addresses);
+            free(cut);
+            if (needed <= length || needed > end) {
+                printf("TRUNCATION flow=%u length=%u needed=%u end=%u\n", f, length, needed, end);
+                return 1;
+            }
+        }
+        if (end > FLOW_HDR_LEN || !(full.shape & NET_CLS_SHAPE_L4)) {
+            printf("TRUNCATION flow=%u end=%u shape=%u\n", f, end, full.shape);
+            return 1;
+        }
+    }
+
+    PNET_RULES rules = make_rules(RULES, &rng);
+    PNET_CLASSIFIER cls = ndisCompileNetRules(rules);
+    if (!ndisFlowCacheInit()) { return 1; }
+
+    // Reference verdicts, one frame at a time through ndisFrameToKey
+    ULONG matched = 0;
+    for (ULONG i = 0; i < FRAMES; i++) {
+        NET_CLS_KEY key;
+        NET_LPM6_ADDRESS addresses[2];
+        ndisFrameToKey(frames[i].data, frames[i].length, &key, addresses);
+        if (key.shape & NET_CLS_SHAPE_IP6) { ndisClsResolve6(cls, &key, addresses); }
+        expect[i] = ndisClassify(cls, &key);
+        matched += (expect[i] != NET_CLS_NO_MATCH);
+    }
+
+    // Sweeping a buffer larger than the cache between runs keeps the headers cold
+    SIZE_T flush_size = 64u << 20;
+    UCHAR* flush = (UCHAR*)malloc(flush_size);
+
+    printf("%d rules, %d frames, %d flows, %.1f%% matched\n", RULES, FRAMES, FLOWS, 100.0 * matched / FRAMES);
+    printf("%8s %12s %12s %10s\n", "batch", "ns/packet", "cached ns", "hit rate");
+    for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+        ULONG batch = batch_sizes[b];
+        ULONG verdicts[NET_BATCH_MAX];
+        UINT64 total[2] = { 0, 0 };
+        ULONG generation = (ULONG)b + 1;       // a fresh generation starts every run cold
+        NET_FLOW_CACHE_STAT stat;
+
+        ndisFlowCacheClearStat();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (int cached = 0; cached < 2; cached++) {
+                PNET_FLOW_CACHE cache = cached ? ndisFlowCacheCurrent() : NULL;
+                memset(flush, (int)pass, flush_size);
+                UINT64 t0 = bench_now_ns();
+                for (ULONG i = 0; i < FRAMES; i += batch) {
+                    ndisClassifyBatch(cls, cache, generation, frames + i, batch, verdicts);
+                    bench_sink += verdicts[0];
+                }
+                total[cached] += bench_now_ns() - t0;
+            }
+        }
+        ndisFlowCacheQueryStat(&stat);
+
+        for (int cached = 0; cached < 2; cached++) {
+            PNET_FLOW_CACHE cache = cached ? ndisFlowCacheCurrent() : NULL;
+            for (ULONG i = 0; i < FRAMES; i += batch) {
+                ndisClassifyBatch(cls, cache, generation, frames + i, batch, verdicts);
+                for (ULONG k = 0; k < batch; k++) {
+                    if (verdicts[k] != expect[i + k]) {
+                        printf("MISMATCH batch=%u cached=%d frame=%u single=%u batch=%u\n", batch, cached, i + k, expect[i + k], verdicts[k]);
+                        return 1;
+                    }
+                }
+            }
+        }
+
+        printf("%8u %12.1f %12.1f %9.1f%%\n", batch,
+            (double)total[0] / ((double)PASSES * FRAMES), (double)total[1] / ((double)PASSES * FRAMES),
+            100.0 * stat.hits / (stat.hits + stat.misses));
+    }
+
+    free(flush);
+    ndisFlowCacheCleanup();
+    ndisFreeNetClassifier(cls);
+    free(rules);
+    free(expect);
+    free(frames);
+    free(flows);
+    free(pool);
+    return 0;
+}
@@ -0,0 +1,322 @@
+//
+// Compares the compiled tuple-space classifier with the original linear
+// NET_RULES walk: checks that both pick the same first matching rule and
+// reports ns/lookup as the rule count grows. Part of the rules use CIDR
+// prefixes and port ranges, and part of the traffic and rules is IPv6.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv bench_classifier.c
+//       ../FilterNetworkDrv/classifier.c ../FilterNetworkDrv/lpm.c
+//       -o bench_classifier
+//
+
+#include "bench_common.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+
+#define PACKETS     (1 << 16)
+#define WIDE_LIMIT  16          // wide rules allowed at any rule count
+#define TUPLE_LIMIT 40          // tuples one lookup may probe at any rule count
+
+typedef struct _BENCH_PACKET {
+    UCHAR   ether_type[2];
+    UCHAR   protocol[1];
+    UCHAR   source_ip[4];
+    UCHAR   destination_ip[4];
+    UCHAR   source_ip6[16];
+    UCHAR   destination_ip6[16];
+    UCHAR   source_port[2];
+    UCHAR   destination_port[2];
+    BOOLEAN has_ip;
+    BOOLEAN has_ip6;
+    BOOLEAN has_l4;
+} BENCH_PACKET;
+
+static const UCHAR ether_ip[2] = { 0x08, 0x00 };
+static const UCHAR ether_arp[2] = { 0x08, 0x06 };
+static const UCHAR ether_ip6[2] = { 0x86, 0xDD };
+
+static VOID put16(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 8); dst[1] = (UCHAR)v; }
+static VOID put32(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 24); dst[1] = (UCHAR)(v >> 16); dst[2] = (UCHAR)(v >> 8); dst[3] = (UCHAR)v; }
+
+// Small value pools so that rules overlap and first-match order matters
+static UINT32 pick_ip(UINT64* rng) { return 0x0A000000 | (bench_rand(rng) % 512); }
+static UINT32 pick_port(UINT64* rng) { return 1 + bench_rand(rng) % 1024; }
+static UCHAR pick_length(UINT64* rng) { return (UCHAR)(26 + bench_rand(rng) % 6); }
+// 2001:db8:X:Y::M, X < 4, Y < 16, M < 64
+static VOID pick_ip6(UCHAR* ip6, UINT64* rng) {
+    static const UCHAR base[4] = { 0x20, 0x01, 0x0D, 0xB8 };
+    memset(ip6, 0, 16);
+    memcpy(ip6, base, 4);
+    ip6[5] = (UCHAR)(bench_rand(rng) % 4);
+    ip6[7] = (UCHAR)(bench_rand(rng) % 16);
+    ip6[15] = (UCHAR)(bench_rand(rng) % 64);
+}
+static UCHAR pick_length6(UINT64* rng) {
+    static const UCHAR lengths[] = { 48, 60, 64, 64, 122, 128, 128 };
+    return lengths[bench_rand(rng) % (sizeof(lengths) / sizeof(lengths[0]))];
+}
+// One range in eight is wide, so that it expands over most of the others
+static VOID pick_range(UCHAR* first, UCHAR* last, UINT64* rng) {
+    UINT32 port = pick_port(rng);
+    put16(first, port);
+    put16(last, port + bench_rand(rng) % ((bench_rand(rng) % 8 == 0) ? 16384 : 32));
+}
+
+static PNET_RULES make_rules(ULONG count, UINT64* rng) {
+    PNET_RULES rules = (PNET_RULES)calloc(count, sizeof(NET_RULES));
+    for (ULONG i = 0; i < count; i++) {
+        PNET_RULES r = &rules[i];
+        r->action = 1;
+        switch (bench_rand(rng) % 10) {
+        case 0:     // tcp service on a host
+            memcpy(r->ether_type, ether_ip, 2); r->ip_next_protocol[0] = 0x06;
+            put32(r->destination_ip, pick_ip(rng)); put16(r->destination_port, pick_port(rng));
+            break;
+        case 1:     // everything from a host
+            memcpy(r->ether_type, ether_ip, 2); put32(r->source_ip, pick_ip(rng));
+            break;
+        case 2:     // udp port
+            memcpy(r->ether_type, ether_ip, 2); r->ip_next_protocol[0] = 0x11;
+            put16(r->destination_port, pick_port(rng));
+            break;
+        case 3:     // host pair
+            put32(r->source_ip, pick_ip(rng)); put32(r->destination_ip, pick_ip(rng));
+            break;
+        case 4:     // full 5-tuple
+            memcpy(r->ether_type, ether_ip, 2); r->ip_next_protocol[0] = 0x06;
+            put32(r->source_ip, pick_ip(rng)); put32(r->destination_ip, pick_ip(rng));
+            put16(r->source_port, pick_port(rng)); put16(r->destination_port, pick_port(rng));
+            break;
+        case 5:     // tcp port range into a subnet
+            memcpy(r->ether_type, ether_ip, 2); r->ip_next_protocol[0] = 0x06;
+            put32(r->destination_ip, pick_ip(rng)); r->destination_prefix_len[0] = pick_length(rng);
+            pick_range(r->destination_port, r->destination_port_last, rng);
+            break;
+        case 6:     // subnet pair, any source port in a range
+            put32(r->source_ip, pick_ip(rng)); r->source_prefix_len[0] = pick_length(rng);
+            put32(r->destination_ip, pick_ip(rng)); r->destination_prefix_len[0] = pick_length(rng);
+            pick_range(r->source_port, r->source_port_last, rng);
+            break;
+        case 7:     // tcp service on an IPv6 host or subnet
+            r->ip_next_protocol[0] = 0x06;
+            pick_ip6(r->destination_ip6, rng); r->destination_prefix_len[0] = pick_length6(rng);
+            put16(r->destination_port, pick_port(rng));
+            break;
+        case 8:     // IPv6 subnet pair
+            memcpy(r->ether_type, ether_ip6, 2);
+            pick_ip6(r->source_ip6, rng); r->source_prefix_len[0] = pick_length6(rng);
+            pick_ip6(r->destination_ip6, rng); r->destination_prefix_len[0] = pick_length6(rng);
+            break;
+        default:    // arp
+            memcpy(r->ether_type, ether_arp, 2);
+            break;
+        }
+        r->_next = (i + 1 < count) ? &rules[i + 1] : NULL;
+        r->_prev = (i > 0) ? &rules[i - 1] : NULL;
+    }
+    return rules;
+}
+
+static VOID make_packet(BENCH_PACKET* p, UINT64* rng) {
+    memset(p, 0, sizeof(*p));
+    UINT32 kind = bench_rand(rng) % 16;
+    if (kind == 0) {
+        memcpy(p->ether_type, ether_arp, 2);
+        return;
+    }
+    p->has_l4 = TRUE;
+    p->protocol[0] = (kind & 1) ? 0x06 : 0x11;
+    if (kind < 5) {
+        memcpy(p->ether_type, ether_ip6, 2);
+        p->has_ip6 = TRUE;
+        pick_ip6(p->source_ip6, rng);
+        pick_ip6(p->destination_ip6, rng);
+        put16(p->source_port, pick_port(rng));
+        put16(p->destination_port, pick_port(rng));
+        if (kind == 4) { p->has_l4 = FALSE; p->protocol[0] = 0x3A; }     // ICMPv6
+        return;
+    }
+    memcpy(p->ether_type, ether_ip, 2);
+    p->has_ip = TRUE;
+    put32(p->source_ip, pick_ip(rng));
+    put32(p->destination_ip, pick_ip(rng));
+    put16(p->source_port, pick_port(rng));
+    put16(p->destination_port, pick_port(rng));
+}
+
+static VOID load_ip6(const UCHAR* ip6, PNET_LPM6_ADDRESS address) {
+    address->hi = 0;
+    address->lo = 0;
+    for (int i = 0; i < 8; i++) { address->hi = (address->hi << 8) | ip6[i]; address->lo = (address->lo << 8) | ip6[8 + i]; }
+}
+
+// IPv6 keys still need ndisClsResolve6 against the classifier they are used with
+static VOID packet_to_key(const BENCH_PACKET* p, PNET_CLS_KEY key, PNET_LPM6_ADDRESS addresses) {
+    memset(key, 0, sizeof(*key));
+    key->ether_type = (UINT16)((p->ether_type[0] << 8) | p->ether_type[1]);
+    if (p->has_ip) {
+        key->shape |= NET_CLS_SHAPE_IP;
+        key->protocol = p->protocol[0];
+        key->source_ip = ((UINT32)p->source_ip[0] << 24) | ((UINT32)p->source_ip[1] << 16) | ((UINT32)p->source_ip[2] << 8) | p->source_ip[3];
+        key->destination_ip = ((UINT32)p->destination_ip[0] << 24) | ((UINT32)p->destination_ip[1] << 16) | ((UINT32)p->destination_ip[2] << 8) | p->destination_ip[3];
+    }
+    if (p->has_ip6) {
+        key->shape |= NET_CLS_SHAPE_IP6;
+        key->protocol = p->protocol[0];
+        load_ip6(p->source_ip6, &addresses[0]);
+        load_ip6(p->destination_ip6, &addresses[1]);
+    }
+    if (p->has_l4) {
+        key->shape |= NET_CLS_SHAPE_L4;
+        key->source_port = (UINT16)((p->source_port[0] << 8) | p->source_port[1]);
+        key->destination_port = (UINT16)((p->destination_port[0] << 8) | p->destination_port[1]);
+    }
+}
+
+static BOOLEAN is_zero(const UCHAR* v, int len) {
+    for (int i = 0; i < len; i++) { if (v[i] != 0) { return FALSE; } }
+    return TRUE;
+}
+
+static BOOLEAN is_zero16(const UCHAR* v) {
+    UINT64 a, b;
+    memcpy(&a, v, 8);
+    memcpy(&b, v + 8, 8);
+    return (a | b) == 0;
+}
+
+static UINT32 get32(const UCHAR* v) { return ((UINT32)v[0] << 24) | ((UINT32)v[1] << 16) | ((UINT32)v[2] << 8) | v[3]; }
+static UINT32 get16(const UCHAR* v) { return ((UINT32)v[0] << 8) | v[1]; }
+
+static BOOLEAN ip_matches(const UCHAR* ip, const UCHAR* rule_ip, UCHAR length) {
+    if (length >= 1 && length <= 31) {
+        UINT32 mask = 0xFFFFFFFFu << (32 - length);
+        return (get32(ip) & mask) == (get32(rule_ip) & mask);
+    }
+    return (length == 0 && is_zero(rule_ip, 4)) || memcmp(ip, rule_ip, 4) == 0;
+}
+
+static BOOLEAN ip6_matches(const UCHAR* ip6, const UCHAR* rule_ip6, UCHAR length) {
+    if (is_zero16(rule_ip6)) { return length == 0; }
+    if (length == 0 || length > 128) { length = 128; }
+    ULONG bytes = length / 8, bits = length % 8;
+    if (memcmp(ip6, rule_ip6, bytes) != 0) { return FALSE; }
+    return bits == 0 || ((ip6[bytes] ^ rule_ip6[bytes]) & (0xFF00 >> bits)) == 0;
+}
+
+static BOOLEAN port_matches(const UCHAR* port, const UCHAR* rule_port, const UCHAR* rule_last) {
+    UINT32 first = get16(rule_port), last = get16(rule_last), value = get16(port);
+    if (last == 0) { return first == 0 || value == first; }
+    if (first > last) { UINT32 t = first; first = last; last = t; }
+    return value >= first && value <= last;
+}
+
+// The pre-classifier inspect_packet loop extended with prefixes, ranges and
+// IPv6, returning the rule index. A rule only matches packets that carry
+// every field it tests.
+static ULONG linear_match(PNET_RULES rules, const BENCH_PACKET* p) {
+    ULONG index = 0;
+    for (PNET_RULES r = rules; r != NULL; r = r->_next, index++) {
+        BOOLEAN rule_ip6 = !is_zero16(r->source_ip6) || !is_zero16(r->destination_ip6);
+        BOOLEAN rule_ip = !rule_ip6 && (!is_zero(r->source_ip, 4) || !is_zero(r->destination_ip, 4) ||
+            r->source_prefix_len[0] != 0 || r->destination_prefix_len[0] != 0);
+        BOOLEAN rule_l4 = !is_zero(r->source_port, 2) || !is_zero(r->destination_port, 2) ||
+            !is_zero(r->source_port_last, 2) || !is_zero(r->destination_port_last, 2);
+
+        if (!is_zero(r->ether_type, 2) && memcmp(p->ether_type, r->ether_type, 2) != 0) { continue; }
+        if (!is_zero(r->ip_next_protocol, 1) &&
+            (!(p->has_ip || p->has_ip6) || memcmp(p->protocol, r->ip_next_protocol, 1) != 0)) { continue; }
+        if (rule_ip6) {
+            if (!p->has_ip6) { continue; }
+            if (!ip6_matches(p->source_ip6, r->source_ip6, r->source_prefix_len[0])) { continue; }
+            if (!ip6_matches(p->destination_ip6, r->destination_ip6, r->destination_prefix_len[0])) { continue; }
+        }
+        if (rule_ip) {
+            if (!p->has_ip) { continue; }
+            if (!ip_matches(p->source_ip, r->source_ip, r->source_prefix_len[0])) { continue; }
+            if (!ip_matches(p->destination_ip, r->destination_ip, r->destination_prefix_len[0])) { continue; }
+        }
+        if (rule_l4) {
+            if (!p->has_l4) { continue; }
+            if (!port_matches(p->source_port, r->source_port, r->source_port_last)) { continue; }
+            if (!port_matches(p->destination_port, r->destination_port, r->destination_port_last)) { continue; }
+        }
+        return index;
+    }
+    return NET_CLS_NO_MATCH;
+}
+
+int main(int argc, char** argv) {
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    static const ULONG rule_counts[] = { 16, 256, 4096, 65536 };
+    UINT64 rng = 0x1234567887654321ULL;
+
+    BENCH_PACKET* packets = (BENCH_PACKET*)malloc(PACKETS * sizeof(BENCH_PACKET));
+    NET_CLS_KEY* keys = (NET_CLS_KEY*)malloc(PACKETS * sizeof(NET_CLS_KEY));
+    PNET_LPM6_ADDRESS addresses = (PNET_LPM6_ADDRESS)malloc(2 * PACKETS * sizeof(NET_LPM6_ADDRESS));
+    for (ULONG i = 0; i < PACKETS; i++) {
+        make_packet(&packets[i], &rng);
+        packet_to_key(&packets[i], &keys[i], &addresses[2 * i]);
+    }
+
+    printf("%8s %8s %8s %8s %8s %12s %12s %10s\n", "rules", "tuples", "probed", "wide", "KiB", "linear ns", "tuple ns", "matched");
+    for (size_t c = 0; c < sizeof(rule_counts) / sizeof(rule_counts[0]); c++) {
+        ULONG count = rule_counts[c];
+        PNET_RULES rules = make_rules(count, &rng);
+        PNET_CLASSIFIER cls = ndisCompileNetRules(rules);
+        for (ULONG i = 0; i < PACKETS; i++) {
+            if (keys[i].shape & NET_CLS_SHAPE_IP6) { ndisClsResolve6(cls, &keys[i], &addresses[2 * i]); }
+        }
+
+        ULONG matched = 0;
+        for (ULONG i = 0; i < PACKETS; i++) {
+            ULONG expect = linear_match(rules, &packets[i]);
+            ULONG got = ndisClassify(cls, &keys[i]);
+            if (expect != got) {
+                printf("MISMATCH rules=%u packet=%u linear=%u classifier=%u\n", count, i, expect, got);
+                return 1;
+            }
+            matched += (got != NET_CLS_NO_MATCH);
+        }
+
+        ULONG linear_iters = count > 4096 ? PACKETS / 16 : PACKETS;
+        UINT64 t0 = bench_now_ns();
+        for (ULONG i = 0; i < linear_iters; i++) { bench_sink += linear_match(rules, &packets[i]); }
+        UINT64 t1 = bench_now_ns();
+        for (ULONG rep = 0; rep < 16; rep++) {
+            for (ULONG i = 0; i < PACKETS; i++) { bench_sink += ndisClassify(cls, &keys[i]); }
+        }
+        UINT64 t2 = bench_now_ns();
+
+        // A frame is never both IPv4 and IPv6, so those shapes are not probed
+        ULONG probed = 0;
+        for (ULONG shape = 0; shape < NET_CLS_SHAPES; shape++) {
+            if ((shape & NET_CLS_SHAPE_IP) && (shape & NET_CLS_SHAPE_IP6)) { continue; }
+            if (cls->shape_count[shape] > probed) { probed = cls->shape_count[shape]; }
+        }
+
+        printf("%8u %8u %8u %8u %8u %12.1f %12.1f %9.1f%%\n", count, cls->tuple_count, probed, cls->wide_count, cls->size / 1024,
+            (double)(t1 - t0) / linear_iters, (double)(t2 - t1) / (16.0 * PACKETS),
+            100.0 * matched / PACKETS);
+        if (cls->wide_count > WIDE_LIMIT) {
+            printf("WIDE rules=%u wide=%u limit=%u\n", count, cls->wide_count, WIDE_LIMIT);
+            return 1;
+        }
+        if (probed > TUPLE_LIMIT) {
+            printf("TUPLES rules=%u probed=%u limit=%u\n", count, probed, TUPLE_LIMIT);
+            return 1;
+        }
+
+        ndisFreeNetClassifier(cls);
+        free(rules);
+    }
+
+    free(addresses);
+    free(keys);
+    free(packets);
+    return 0;
+}
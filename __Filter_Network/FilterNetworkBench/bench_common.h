@@ -0,0 +1,106 @@
+#pragma once
+//
+// Shared helpers for the user-mode benchmarks. Build everything in this
+// directory with -DNETFLT_USER_MODE -I../FilterNetworkDrv (see README.md).
+//
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "portable.h"
+
+static inline UINT64 bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * 1000000000ULL + (UINT64)ts.tv_nsec;
+}
+
+static inline UINT32 bench_rand(UINT64* state) {
+    // xorshift64*
+    UINT64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (UINT32)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// Keeps the optimizer from discarding benchmark results
+static volatile ULONG bench_sink;
+
+// Cheap enough to bracket a single packet: the TSC where there is one,
+// otherwise the monotonic clock. bench_ticks_per_ns calibrates it.
+static inline UINT64 bench_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    UINT32 lo, hi;
+    __asm__ volatile("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((UINT64)hi << 32) | lo;
+#else
+    return bench_now_ns();
+#endif
+}
+
+static inline double bench_ticks_per_ns(void) {
+    UINT64 t0 = bench_now_ns(), k0 = bench_ticks();
+    while (bench_now_ns() - t0 < 50000000ULL) { }
+    return (double)(bench_ticks() - k0) / (double)(bench_now_ns() - t0);
+}
+
+// Hardware counters through perf_event_open. Counters the kernel or the
+// container refuses read as BENCH_PERF_NA.
+#define BENCH_PERF_CYCLES           0
+#define BENCH_PERF_INSTRUCTIONS     1
+#define BENCH_PERF_L1D_MISSES       2
+#define BENCH_PERF_LLC_MISSES       3
+#define BENCH_PERF_EVENTS           4
+#define BENCH_PERF_NA               ((UINT64)-1)
+
+typedef struct _BENCH_PERF {
+    int     fd[BENCH_PERF_EVENTS];
+} BENCH_PERF;
+
+static inline VOID bench_perf_open(BENCH_PERF* perf) {
+    static const UINT32 types[BENCH_PERF_EVENTS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+    static const UINT64 configs[BENCH_PERF_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES };
+    for (int i = 0; i < BENCH_PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static inline VOID bench_perf_start(BENCH_PERF* perf) {
+    for (int i = 0; i < BENCH_PERF_EVENTS; i++) {
+        if (perf->fd[i] < 0) { continue; }
+        ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static inline VOID bench_perf_stop(BENCH_PERF* perf, UINT64* counts) {
+    for (int i = 0; i < BENCH_PERF_EVENTS; i++) {
+        counts[i] = BENCH_PERF_NA;
+        if (perf->fd[i] < 0) { continue; }
+        ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf->fd[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) { counts[i] = BENCH_PERF_NA; }
+    }
+}
+
+static inline VOID bench_perf_close(BENCH_PERF* perf) {
+    for (int i = 0; i < BENCH_PERF_EVENTS; i++) {
+        if (perf->fd[i] >= 0) { close(perf->fd[i]); }
+    }
+}
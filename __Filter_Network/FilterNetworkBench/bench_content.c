@@ -0,0 +1,219 @@
+//
+// ns/byte of the content stage (content.c) for 10 to 10000 patterns over
+// text and binary payloads: the automaton alone on every byte, and behind
+// the scalar and the SSSE3 prefilter. Timed payloads hold no pattern, so
+// every byte is scanned. Before timing, payloads with planted patterns are
+// scanned whole and cut into pieces, with both prefilters, and checked
+// against a naive search.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv bench_content.c
+//       ../FilterNetworkDrv/content.c ../FilterNetworkDrv/lpm.c -o bench_content
+//
+
+#include "bench_common.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "content.h"
+
+#define PAYLOADS        2048
+#define PAYLOAD_LEN     1460
+#define CHECKS          512
+#define PASSES          8
+#define MAX_PATTERNS    10000
+
+typedef struct _REFERENCE {
+    ULONG*  by_last[256];           // rule indexes by last pattern byte, ascending
+    ULONG   count[256];
+} REFERENCE;
+
+static VOID make_payload(UCHAR* data, ULONG length, int text, UINT64* rng) {
+    // Text is lower case words; binary is uniform random bytes
+    for (ULONG i = 0; i < length; i++) {
+        if (!text) { data[i] = (UCHAR)bench_rand(rng); continue; }
+        data[i] = (bench_rand(rng) % 6 == 0) ? ' ' : (UCHAR)('a' + bench_rand(rng) % 26);
+    }
+}
+
+static ULONG make_rules(ULONG count, UINT64* rng, PNET_CONTENT_RULE rules, UCHAR* patterns) {
+    // Half printable signatures ("/cgi-bin/x.pl", "User-Agent: ..."), half
+    // binary; a third limited to destination port 443
+    ULONG offset = 0;
+    for (ULONG r = 0; r < count; r++) {
+        ULONG length = 6 + bench_rand(rng) % 11;
+        memset(&rules[r], 0, sizeof(NET_CONTENT_RULE));
+        rules[r].pattern_offset = offset;
+        rules[r].pattern_length = (USHORT)length;
+        rules[r].source_port_last = 0xFFFF;
+        rules[r].destination_port_last = 0xFFFF;
+        if (r % 3 == 0) { rules[r].destination_port_first = rules[r].destination_port_last = 443; }
+        for (ULONG i = 0; i < length; i++) {
+            patterns[offset + i] = (r & 1) ? (UCHAR)bench_rand(rng) : (UCHAR)(0x21 + bench_rand(rng) % 94);
+        }
+        offset += length;
+    }
+    return offset;
+}
+
+static BOOLEAN rule_applies(const NET_CONTENT_RULE* rule, const NET_CLS_KEY* key) {
+    return (BOOLEAN)(key->destination_port >= rule->destination_port_first && key->destination_port <= rule->destination_port_last);
+}
+
+static VOID make_reference(REFERENCE* ref, const NET_CONTENT_RULE* rules, ULONG count, const UCHAR* patterns) {
+    memset(ref, 0, sizeof(*ref));
+    for (ULONG b = 0; b < 256; b++) { ref->by_last[b] = (ULONG*)malloc(count * sizeof(ULONG)); }
+    for (ULONG r = 0; r < count; r++) {
+        UCHAR last = patterns[rules[r].pattern_offset + rules[r].pattern_length - 1];
+        ref->by_last[last][ref->count[last]++] = r;
+    }
+}
+
+// First match by end position, lowest rule among those ending there, as
+// ndisContentScan reports it
+static ULONG reference_scan(const REFERENCE* ref, const NET_CONTENT_RULE* rules, const UCHAR* patterns, const NET_CLS_KEY* key, const UCHAR* data, ULONG length) {
+    for (ULONG end = 0; end < length; end++) {
+        for (ULONG n = 0; n < ref->count[data[end]]; n++) {
+            const NET_CONTENT_RULE* rule = &rules[ref->by_last[data[end]][n]];
+            if (rule->pattern_length <= end + 1 && rule_applies(rule, key) &&
+                memcmp(data + end + 1 - rule->pattern_length, patterns + rule->pattern_offset, rule->pattern_length) == 0) {
+                return ref->by_last[data[end]][n];
+            }
+        }
+    }
+    return NET_CLS_NO_MATCH;
+}
+
+// The automaton with no prefilter, for comparison
+static ULONG automaton_only(const NET_CONTENT* content, const UCHAR* data, ULONG length) {
+    const ULONG* transitions = (const ULONG*)((const UCHAR*)content + content->transitions_offset);
+    ULONG row = 0, seen = 0;
+    for (ULONG i = 0; i < length; i++) {
+        ULONG next = transitions[row + content->classes[data[i]]];
+        row = next & NET_CONTENT_ROW;
+        seen |= next;
+    }
+    return seen & NET_CONTENT_OUTPUT;
+}
+
+static double time_scan(const NET_CONTENT* content, const UCHAR* payloads, int mode) {
+    NET_CLS_KEY key;
+    memset(&key, 0, sizeof(key));
+    key.destination_port = 80;
+    if (mode != 0) { ndisContentInit((BOOLEAN)(mode == 2)); }
+
+    UINT64 t0 = bench_now_ns();
+    for (ULONG pass = 0; pass < PASSES; pass++) {
+        for (ULONG p = 0; p < PAYLOADS; p++) {
+            const UCHAR* data = payloads + (SIZE_T)p * PAYLOAD_LEN;
+            ULONG state = 0;
+            bench_sink += (mode == 0) ? automaton_only(content, data, PAYLOAD_LEN) :
+                ndisContentScan(content, &state, &key, data, PAYLOAD_LEN);
+        }
+    }
+    return (double)(bench_now_ns() - t0) / ((double)PASSES * PAYLOADS * PAYLOAD_LEN);
+}
+
+static int check(const NET_CONTENT* content, const REFERENCE* ref, const NET_CONTENT_RULE* rules, const UCHAR* patterns, ULONG count, int text, UINT64* rng) {
+    UCHAR data[PAYLOAD_LEN];
+    ULONG matched = 0;
+
+    for (ULONG n = 0; n < CHECKS; n++) {
+        NET_CLS_KEY key;
+        memset(&key, 0, sizeof(key));
+        key.destination_port = (n & 1) ? 443 : 80;
+        make_payload(data, PAYLOAD_LEN, text, rng);
+        if (n % 2 == 0) {
+            const NET_CONTENT_RULE* rule = &rules[bench_rand(rng) % count];
+            ULONG at = bench_rand(rng) % (PAYLOAD_LEN - rule->pattern_length + 1);
+            memcpy(data + at, patterns + rule->pattern_offset, rule->pattern_length);
+        }
+        ULONG expected = reference_scan(ref, rules, patterns, &key, data, PAYLOAD_LEN);
+        matched += (expected != NET_CLS_NO_MATCH);
+
+        for (int simd = 0; simd < 2; simd++) {
+            ndisContentInit((BOOLEAN)simd);
+            ULONG state = 0;
+            ULONG whole = ndisContentScan(content, &state, &key, data, PAYLOAD_LEN);
+
+            // Two random cuts, as a payload spread over three MDLs
+            ULONG a = bench_rand(rng) % PAYLOAD_LEN, b = bench_rand(rng) % PAYLOAD_LEN;
+            ULONG cut[4] = { 0, a < b ? a : b, a < b ? b : a, PAYLOAD_LEN };
+            ULONG pieces = NET_CLS_NO_MATCH;
+            state = 0;
+            for (int k = 0; k < 3 && pieces == NET_CLS_NO_MATCH; k++) {
+                pieces = ndisContentScan(content, &state, &key, data + cut[k], cut[k + 1] - cut[k]);
+            }
+            if (whole != expected || pieces != expected) {
+                printf("MISMATCH: %u patterns, payload %u, %s: expected %d, whole %d, pieces %d\n",
+                    count, n, simd ? "ssse3" : "scalar", (int)expected, (int)whole, (int)pieces);
+                return 0;
+            }
+        }
+    }
+    return (matched != 0);
+}
+
+int main(int argc, char** argv) {
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    static const ULONG pattern_counts[] = { 10, 100, 1000, 10000 };
+    UINT64 rng = 0x5DEECE66D1234567ULL;
+    PNET_CONTENT_RULE rules = (PNET_CONTENT_RULE)malloc(MAX_PATTERNS * sizeof(NET_CONTENT_RULE));
+    UCHAR* patterns = (UCHAR*)malloc(MAX_PATTERNS * 16);
+    UCHAR* payloads = (UCHAR*)malloc((SIZE_T)PAYLOADS * PAYLOAD_LEN);
+    if (rules == NULL || patterns == NULL || payloads == NULL) { return 1; }
+
+    ndisContentInit(TRUE);
+    printf("ssse3 prefilter %s\n", NETFLT_HAS_SSSE3() ? "available" : "not available");
+    printf("%8s %7s %8s %8s %8s %7s %10s %10s %10s %8s\n", "patterns", "payload", "states", "classes",
+        "KiB", "teddy", "dfa ns/B", "scalar", "ssse3", "GB/s");
+    for (size_t c = 0; c < sizeof(pattern_counts) / sizeof(pattern_counts[0]); c++) {
+        ULONG count = pattern_counts[c];
+        make_rules(count, &rng, rules, patterns);
+        PNET_CONTENT content = ndisCompileContent(rules, count, patterns, 0);
+        if (content == NULL || !ndisValidateContent(content, content->size)) {
+            printf("cannot compile %u patterns\n", count);
+            return 1;
+        }
+        REFERENCE ref;
+        make_reference(&ref, rules, count, patterns);
+
+        for (int text = 1; text >= 0; text--) {
+            if (!check(content, &ref, rules, patterns, count, text, &rng)) {
+                printf("MISMATCH: no planted pattern found\n");
+                return 1;
+            }
+
+            // Payloads without a match, so every byte is scanned
+            NET_CLS_KEY key;
+            memset(&key, 0, sizeof(key));
+            key.destination_port = 80;
+            ndisContentInit(FALSE);
+            for (ULONG p = 0; p < PAYLOADS; p++) {
+                UCHAR* data = payloads + (SIZE_T)p * PAYLOAD_LEN;
+                ULONG state;
+                do {
+                    make_payload(data, PAYLOAD_LEN, text, &rng);
+                    state = 0;
+                } while (ndisContentScan(content, &state, &key, data, PAYLOAD_LEN) != NET_CLS_NO_MATCH);
+            }
+
+            double dfa = time_scan(content, payloads, 0);
+            double scalar = time_scan(content, payloads, 1);
+            double ssse3 = NETFLT_HAS_SSSE3() ? time_scan(content, payloads, 2) : 0;
+            double best = (ssse3 != 0 && ssse3 < scalar) ? ssse3 : scalar;
+            printf("%8u %7s %8u %8u %8u %7s %10.3f %10.3f %10.3f %8.2f\n", count, text ? "text" : "binary",
+                content->state_count, content->class_count, content->size / 1024, (content->flags & NET_CONTENT_F_TEDDY) ? "yes" : "no",
+                dfa, scalar, ssse3, 1.0 / best);
+        }
+
+        for (ULONG b = 0; b < 256; b++) { free(ref.by_last[b]); }
+        ndisFreeContent(content);
+    }
+    free(rules);
+    free(patterns);
+    free(payloads);
+    return 0;
+}
@@ -0,0 +1,299 @@
+//
+// Build time, size and ns/lookup of the DIR-16-8-8 LPM table (lpm.c) for
+// 1k, 10k and 100k random prefixes with a routing-table-like length mix,
+// checked against a per-length binary search. The same again for NET_LPM6
+// with /32../64 prefixes and /128 hosts.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv bench_lpm.c
+//       ../FilterNetworkDrv/lpm.c -o bench_lpm
+//
+
+#include "bench_common.h"
+#include "lpm.h"
+
+#define LOOKUPS     (1 << 20)
+#define PASSES      8
+
+typedef struct _REFERENCE {
+    UINT64* sorted[33];             // (address << 32) | label, by length
+    ULONG   count[33];
+} REFERENCE;
+
+static UCHAR pick_length(UINT64* rng) {
+    // Mostly /24, then /16../23, a few host routes and short aggregates
+    UINT32 r = bench_rand(rng) % 100;
+    if (r < 55) { return 24; }
+    if (r < 85) { return (UCHAR)(16 + bench_rand(rng) % 8); }
+    if (r < 95) { return (UCHAR)(25 + bench_rand(rng) % 8); }
+    return (UCHAR)(8 + bench_rand(rng) % 8);
+}
+
+static UINT32 mask(ULONG length) { return length == 0 ? 0 : 0xFFFFFFFFu << (32 - length); }
+
+static ULONG make_prefixes(ULONG count, UINT64* rng, PNET_LPM_PREFIX prefixes, UINT64* scratch) {
+    for (ULONG i = 0; i < count; i++) {
+        UCHAR length = pick_length(rng);
+        scratch[i] = ((UINT64)(bench_rand(rng) & mask(length)) << 8) | length;
+    }
+    ndisSortUint64(scratch, count);
+    ULONG distinct = 0;
+    for (ULONG i = 0; i < count; i++) {
+        if (distinct == 0 || scratch[i] != scratch[distinct - 1]) { scratch[distinct++] = scratch[i]; }
+    }
+
+    // ndisLpmBuild wants ascending length
+    ULONG n = 0;
+    for (ULONG length = 0; length <= 32; length++) {
+        for (ULONG i = 0; i < distinct; i++) {
+            if ((scratch[i] & 0xFF) != length) { continue; }
+            prefixes[n].address = (UINT32)(scratch[i] >> 8);
+            prefixes[n].length = (UCHAR)length;
+            prefixes[n].label = i + 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+static VOID make_reference(REFERENCE* ref, const NET_LPM_PREFIX* prefixes, ULONG count) {
+    for (ULONG length = 0; length <= 32; length++) {
+        ref->sorted[length] = (UINT64*)malloc((count + 1) * sizeof(UINT64));
+        ref->count[length] = 0;
+    }
+    for (ULONG i = 0; i < count; i++) {
+        ULONG length = prefixes[i].length;
+        ref->sorted[length][ref->count[length]++] = ((UINT64)prefixes[i].address << 32) | prefixes[i].label;
+    }
+    for (ULONG length = 0; length <= 32; length++) { ndisSortUint64(ref->sorted[length], ref->count[length]); }
+}
+
+static ULONG reference_lookup(const REFERENCE* ref, UINT32 address) {
+    for (LONG length = 32; length >= 0; length--) {
+        UINT64 target = (UINT64)(address & mask((ULONG)length)) << 32;
+        ULONG lo = 0, hi = ref->count[length];
+        while (lo < hi) {
+            ULONG mid = (lo + hi) / 2;
+            if (ref->sorted[length][mid] < target) { lo = mid + 1; } else { hi = mid; }
+        }
+        if (lo < ref->count[length] && (ref->sorted[length][lo] >> 32) == (target >> 32)) {
+            return (ULONG)ref->sorted[length][lo];
+        }
+    }
+    return 0;
+}
+
+typedef struct _REFERENCE6 {
+    PNET_LPM6_PREFIX sorted[129];   // by address
+    ULONG   count[129];
+} REFERENCE6;
+
+static UCHAR pick_length6(UINT64* rng) {
+    // Mostly /48 site prefixes, then /32../47 allocations, /56../64 subnets
+    // and hosts
+    UINT32 r = bench_rand(rng) % 100;
+    if (r < 40) { return 48; }
+    if (r < 65) { return (UCHAR)(32 + bench_rand(rng) % 16); }
+    if (r < 85) { return (UCHAR)(56 + bench_rand(rng) % 9); }
+    return 128;
+}
+
+static VOID mask6(PNET_LPM6_ADDRESS address, ULONG length) {
+    if (length <= 64) {
+        address->hi &= length == 0 ? 0 : ~0ULL << (64 - length);
+        address->lo = 0;
+    } else if (length < 128) {
+        address->lo &= ~0ULL << (128 - length);
+    }
+}
+
+static UINT64 rand64(UINT64* rng) { return ((UINT64)bench_rand(rng) << 32) | bench_rand(rng); }
+
+static ULONG make_prefixes6(ULONG count, UINT64* rng, PNET_LPM6_PREFIX prefixes, UINT64* scratch) {
+    // Prefixes are carved out of 1024 random /32 allocations under 2000::/4,
+    // the way real address plans cluster, so they nest now and then
+    UINT64 allocations[1024];
+    for (ULONG i = 0; i < 1024; i++) { allocations[i] = (0x2000000000000000ULL | (rand64(rng) >> 4)) & ~0ULL << 32; }
+    PNET_LPM6_PREFIX all = (PNET_LPM6_PREFIX)malloc(count * sizeof(NET_LPM6_PREFIX));
+    for (ULONG i = 0; i < count; i++) {
+        all[i].address.hi = allocations[bench_rand(rng) % 1024] | (rand64(rng) >> 32);
+        all[i].address.lo = rand64(rng);
+        all[i].length = pick_length6(rng);
+        mask6(&all[i].address, all[i].length);
+    }
+    ndisLpm6Sort(all, count);
+    ULONG distinct = 0;
+    for (ULONG i = 0; i < count; i++) {
+        if (distinct == 0 || !ndisLpm6Equal(&all[i].address, &all[distinct - 1].address) ||
+            all[i].length != all[distinct - 1].length) {
+            all[distinct] = all[i];
+            all[distinct].label = distinct + 1;
+            distinct++;
+        }
+    }
+
+    // ndisLpm6Build wants ascending length
+    for (ULONG i = 0; i < distinct; i++) { scratch[i] = ((UINT64)all[i].length << 32) | i; }
+    ndisSortUint64(scratch, distinct);
+    for (ULONG i = 0; i < distinct; i++) { prefixes[i] = all[(ULONG)scratch[i]]; }
+    free(all);
+    return distinct;
+}
+
+static VOID make_reference6(REFERENCE6* ref, const NET_LPM6_PREFIX* prefixes, ULONG count) {
+    for (ULONG length = 0; length <= 128; length++) {
+        ref->sorted[length] = (PNET_LPM6_PREFIX)malloc((count + 1) * sizeof(NET_LPM6_PREFIX));
+        ref->count[length] = 0;
+    }
+    for (ULONG i = 0; i < count; i++) {
+        ULONG length = prefixes[i].length;
+        ref->sorted[length][ref->count[length]++] = prefixes[i];
+    }
+    for (ULONG length = 0; length <= 128; length++) { ndisLpm6Sort(ref->sorted[length], ref->count[length]); }
+}
+
+static ULONG reference_lookup6(const REFERENCE6* ref, const NET_LPM6_ADDRESS* address) {
+    for (LONG length = 128; length >= 0; length--) {
+        NET_LPM6_ADDRESS target = *address;
+        mask6(&target, (ULONG)length);
+        ULONG lo = 0, hi = ref->count[length];
+        while (lo < hi) {
+            ULONG mid = (lo + hi) / 2;
+            const NET_LPM6_ADDRESS* a = &ref->sorted[length][mid].address;
+            if (a->hi < target.hi || (a->hi == target.hi && a->lo < target.lo)) { lo = mid + 1; } else { hi = mid; }
+        }
+        if (lo < ref->count[length] && ndisLpm6Equal(&ref->sorted[length][lo].address, &target)) {
+            return ref->sorted[length][lo].label;
+        }
+    }
+    return 0;
+}
+
+static VOID bench_lpm6(const ULONG* prefix_counts, size_t cases, UINT64* rng) {
+    PNET_LPM6_ADDRESS addresses = (PNET_LPM6_ADDRESS)malloc(LOOKUPS * sizeof(NET_LPM6_ADDRESS));
+
+    printf("\nIPv6\n%8s %8s %8s %10s %12s %10s\n", "prefixes", "chunks", "KiB", "build ms", "ns/lookup", "matched");
+    for (size_t c = 0; c < cases; c++) {
+        ULONG count = prefix_counts[c];
+        PNET_LPM6_PREFIX prefixes = (PNET_LPM6_PREFIX)malloc(count * sizeof(NET_LPM6_PREFIX));
+        PNET_LPM6_PREFIX scratch6 = (PNET_LPM6_PREFIX)malloc(count * sizeof(NET_LPM6_PREFIX));
+        UINT64* scratch = (UINT64*)malloc(count * sizeof(UINT64));
+        count = make_prefixes6(count, rng, prefixes, scratch);
+
+        UINT64 t0 = bench_now_ns();
+        ULONG size = ndisLpm6Size(prefixes, count, scratch6);
+        PNET_LPM6 lpm = (PNET_LPM6)malloc(size);
+        ndisLpm6Build(lpm, prefixes, count);
+        UINT64 t1 = bench_now_ns();
+
+        // Half the lookups fall inside a prefix, half anywhere under the
+        // /32 of one
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            const NET_LPM6_PREFIX* p = &prefixes[bench_rand(rng) % count];
+            NET_LPM6_ADDRESS random = { rand64(rng), rand64(rng) };
+            ULONG keep = (i & 1) ? 32 : p->length;
+            addresses[i] = p->address;
+            mask6(&addresses[i], keep);
+            NET_LPM6_ADDRESS host = random;
+            if (keep < 64) {
+                host.hi &= ~0ULL >> keep;
+            } else {
+                host.hi = 0;
+                host.lo &= keep >= 128 ? 0 : ~0ULL >> (keep - 64);
+            }
+            addresses[i].hi |= host.hi;
+            addresses[i].lo |= host.lo;
+        }
+
+        REFERENCE6 ref;
+        make_reference6(&ref, prefixes, count);
+        ULONG matched = 0;
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            ULONG expect = reference_lookup6(&ref, &addresses[i]);
+            ULONG got = ndisLpm6Lookup(lpm, &addresses[i]);
+            if (expect != got) {
+                printf("MISMATCH prefixes=%u address=%016llx%016llx reference=%u lpm=%u\n", count,
+                    (unsigned long long)addresses[i].hi, (unsigned long long)addresses[i].lo, expect, got);
+                exit(1);
+            }
+            matched += (got != 0);
+        }
+
+        UINT64 t2 = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += ndisLpm6Lookup(lpm, &addresses[i]); }
+        }
+        UINT64 t3 = bench_now_ns();
+
+        printf("%8u %8u %8u %10.2f %12.1f %9.1f%%\n", count, lpm->chunk_count, size / 1024,
+            (double)(t1 - t0) / 1e6, (double)(t3 - t2) / ((double)PASSES * LOOKUPS), 100.0 * matched / LOOKUPS);
+
+        for (ULONG length = 0; length <= 128; length++) { free(ref.sorted[length]); }
+        free(lpm);
+        free(scratch);
+        free(scratch6);
+        free(prefixes);
+    }
+
+    free(addresses);
+}
+
+int main(int argc, char** argv) {
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    static const ULONG prefix_counts[] = { 1000, 10000, 100000 };
+    UINT64 rng = 0x0F1E2D3C4B5A6978ULL;
+    UINT32* addresses = (UINT32*)malloc(LOOKUPS * sizeof(UINT32));
+
+    printf("%8s %8s %8s %10s %12s %10s\n", "prefixes", "chunks", "KiB", "build ms", "ns/lookup", "matched");
+    for (size_t c = 0; c < sizeof(prefix_counts) / sizeof(prefix_counts[0]); c++) {
+        ULONG count = prefix_counts[c];
+        PNET_LPM_PREFIX prefixes = (PNET_LPM_PREFIX)malloc(count * sizeof(NET_LPM_PREFIX));
+        UINT64* scratch = (UINT64*)malloc(count * sizeof(UINT64));
+        count = make_prefixes(count, &rng, prefixes, scratch);
+
+        UINT64 t0 = bench_now_ns();
+        ULONG size = ndisLpmSize(prefixes, count, scratch);
+        PNET_LPM lpm = (PNET_LPM)malloc(size);
+        ndisLpmBuild(lpm, prefixes, count);
+        UINT64 t1 = bench_now_ns();
+
+        // Half the lookups fall inside a prefix, half anywhere
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            const NET_LPM_PREFIX* p = &prefixes[bench_rand(&rng) % count];
+            addresses[i] = (i & 1) ? bench_rand(&rng) : (p->address | (bench_rand(&rng) & ~mask(p->length)));
+        }
+
+        REFERENCE ref;
+        make_reference(&ref, prefixes, count);
+        ULONG matched = 0;
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            ULONG expect = reference_lookup(&ref, addresses[i]);
+            ULONG got = ndisLpmLookup(lpm, addresses[i]);
+            if (expect != got) {
+                printf("MISMATCH prefixes=%u address=%08x reference=%u lpm=%u\n", count, addresses[i], expect, got);
+                return 1;
+            }
+            matched += (got != 0);
+        }
+
+        UINT64 t2 = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += ndisLpmLookup(lpm, addresses[i]); }
+        }
+        UINT64 t3 = bench_now_ns();
+
+        printf("%8u %8u %8u %10.2f %12.1f %9.1f%%\n", count, lpm->chunk_count, size / 1024,
+            (double)(t1 - t0) / 1e6, (double)(t3 - t2) / ((double)PASSES * LOOKUPS), 100.0 * matched / LOOKUPS);
+
+        for (ULONG length = 0; length <= 32; length++) { free(ref.sorted[length]); }
+        free(lpm);
+        free(scratch);
+        free(prefixes);
+    }
+
+    free(addresses);
+
+    bench_lpm6(prefix_counts, sizeof(prefix_counts) / sizeof(prefix_counts[0]), &rng);
+    return 0;
+}
@@ -0,0 +1,1044 @@
+//
+// Replays pcap traces through the driver's packet path. tcp_ip.c is built
+// unchanged against ndis_shim.h, so the numbers cover the same code the
+// driver runs: parse_frame + inspect_packet one frame at a time, and
+// inspect_chain over NBL chains the size of a receive indication, with the
+// per-processor flow cache in front of the classifier, the content rules of
+// an image over the payloads and matches written to the alert ring, which
+// is drained between chains.
+//
+// For each path it prints Mpps over whole passes, ns/packet percentiles
+// from timing every packet (every chain for inspect_chain, divided by its
+// length) and, where perf_event_open is allowed, L1D and last level cache
+// misses and instructions per packet. Both paths have to agree on every
+// verdict. When the image tracks TCP streams (netrulec -t), every pass
+// starts with empty stream tables, since it replays the same segments.
+//
+// Every IP frame is also counted against its source (ratelimit.h). The
+// clock the packet path reads is the trace's own, taken at the first frame
+// of each chain on both paths, so rate limit rules give the same verdicts
+// however fast the replay runs; every pass starts with empty sketches.
+// The cost of the sketch update alone is measured over the trace's
+// sources, and the heaviest sources of the last pass are listed.
+//
+// An image with a reputation set (netrulec -r) has it checked against the
+// addresses of every IP frame ahead of the rules, as in the driver. One
+// with a domain set (netrulec -n) has the DNS responses of the trace parsed
+// and the addresses of blocked names dropped; every pass starts with an
+// empty block cache. Filter programs (netrulec -p) run last, on the frames
+// nothing else matched.
+//
+// -o runs a second image as the overlay of an adapter: each frame goes
+// through all of it first and through the rules above only when nothing in
+// it matched, as for a filter instance given rules of its own. Overlay
+// matches are flagged NET_ALERT_F_OVERLAY and are not counted by -h.
+//
+// -h writes the hits of every header rule over one pass, tallied from the
+// alert records as a reader of the driver's alerts would, in the form
+// netrulec -h reads to order the rules by.
+//
+// The chains are then split the way deferred inspection splits them
+// (defer.h): the header stages on the receive path, timed per frame, and
+// the payload stages over the frames deferred to a worker, timed per
+// deferred frame. Their verdicts have to be those of inspect_chain.
+//
+// The header stages also meter every IP frame into the flow table
+// (meter.h), so the rows above include it. The meter is then timed on its
+// own over the trace's clock, exporting the records every second of the
+// trace as the driver's sweep would, and the records and IPFIX bytes it
+// exports are set against the frames and against one alert record per
+// frame. -x writes the IPFIX messages of one pass, for
+// ..\FilterNetworkCollector.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I. -I../FilterNetworkDrv bench_pcap.c
+//       ../FilterNetworkDrv/tcp_ip.c ../FilterNetworkDrv/batch.c
+//       ../FilterNetworkDrv/classifier.c ../FilterNetworkDrv/flowcache.c
+//       ../FilterNetworkDrv/lpm.c ../FilterNetworkDrv/ruleimage.c
+//       ../FilterNetworkDrv/alert.c ../FilterNetworkDrv/content.c
+//       ../FilterNetworkDrv/stream.c ../FilterNetworkDrv/ratelimit.c
+//       ../FilterNetworkDrv/reputation.c ../FilterNetworkDrv/dns.c
+//       ../FilterNetworkDrv/vm.c ../FilterNetworkDrv/meter.c -o bench_pcap
+//
+//   ./bench_pcap -g trace.pcap [-f frames]      write a synthetic trace
+//   ./bench_pcap [-r rules.img | -n rules] [-b batch] [-s split] [-p passes] [-h hits] [-o overlay.img] [-x flows.ipfix] trace.pcap...
+//
+
+#include <arpa/inet.h>
+#include "bench_common.h"
+#include "precomp.h"
+
+#define PCAP_MAGIC_US       0xA1B2C3D4
+#define PCAP_MAGIC_NS       0xA1B23C4D
+#define PCAP_LINKTYPE_ETHERNET  1
+#define PCAP_SNAPLEN        65535
+#define FRAME_ALIGN         64          // frames start on their own cache line, like receive buffers
+#define GEN_FLOWS           4096
+#define GEN_REQUEST         64
+#define GEN_DNS             256         // one frame in this many is a DNS response
+#define TOP_SHOWN           5
+
+typedef struct _TRACE {
+    ULONG               count;
+    ULONG               capacity;
+    PUCHAR*             data;
+    PULONG              length;
+    ULONG64*            time;       // 100 ns units since the first frame
+    ULONG64             origin;     // time of the first frame, 100 ns units since 1970
+    // NDIS view, two MDLs per frame when split
+    PMDL                mdls;
+    PNET_BUFFER         nbs;
+    PNET_BUFFER_LIST    nbls;
+} TRACE, * PTRACE;
+
+static VOID put16(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 8); dst[1] = (UCHAR)v; }
+static VOID put32(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 24); dst[1] = (UCHAR)(v >> 16); dst[2] = (UCHAR)(v >> 8); dst[3] = (UCHAR)v; }
+
+static UINT32 pcap32(const UCHAR* p, int swap) {
+    UINT32 v;
+    memcpy(&v, p, 4);
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+ULONG64 ShimInterruptTime = 0;
+
+static int trace_add(PTRACE trace, const UCHAR* frame, ULONG length, ULONG64 time) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? 2 * trace->capacity : 65536;
+        trace->data = (PUCHAR*)realloc(trace->data, trace->capacity * sizeof(PUCHAR));
+        trace->length = (PULONG)realloc(trace->length, trace->capacity * sizeof(ULONG));
+        trace->time = (ULONG64*)realloc(trace->time, trace->capacity * sizeof(ULONG64));
+        if (trace->data == NULL || trace->length == NULL || trace->time == NULL) { return 0; }
+    }
+    PUCHAR copy = (PUCHAR)aligned_alloc(FRAME_ALIGN, (length + FRAME_ALIGN) & ~(FRAME_ALIGN - 1));
+    if (copy == NULL) { return 0; }
+    memcpy(copy, frame, length);
+    trace->data[trace->count] = copy;
+    trace->length[trace->count] = length;
+    trace->time[trace->count] = time;
+    trace->count++;
+    return 1;
+}
+
+static int trace_load(PTRACE trace, const char* path) {
+    FILE* f = fopen(path, "rb");
+    UCHAR header[24], record[16];
+    static UCHAR frame[PCAP_SNAPLEN];
+    ULONG64 start = 0;
+    int first = 1;
+    if (f == NULL) { perror(path); return 0; }
+    if (fread(header, 1, sizeof(header), f) != sizeof(header)) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        fclose(f);
+        return 0;
+    }
+    int swap = 0;
+    UINT32 magic = pcap32(header, 0);
+    if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+        swap = 1;
+        magic = pcap32(header, 1);
+    }
+    if ((magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) || pcap32(header + 20, swap) != PCAP_LINKTYPE_ETHERNET) {
+        fprintf(stderr, "%s: only classic pcap with Ethernet framing is supported\n", path);
+        fclose(f);
+        return 0;
+    }
+    while (fread(record, 1, sizeof(record), f) == sizeof(record)) {
+        ULONG caplen = pcap32(record + 8, swap);
+        if (caplen > sizeof(frame) || fread(frame, 1, caplen, f) != caplen) {
+            fprintf(stderr, "%s: truncated record\n", path);
+            break;
+        }
+        // Times of later files go on from the last frame of the one before
+        ULONG64 fraction = pcap32(record + 4, swap);
+        ULONG64 time = pcap32(record, swap) * 10000000ULL + ((magic == PCAP_MAGIC_NS) ? fraction / 100 : fraction * 10);
+        if (first) {
+            start = time - (trace->count ? trace->time[trace->count - 1] + 1 : 0);
+            if (trace->count == 0) { trace->origin = time; }
+            first = 0;
+        }
+        if (!trace_add(trace, frame, caplen, time - start)) { fclose(f); return 0; }
+    }
+    fclose(f);
+    return 1;
+}
+
+// Every frame becomes a one-NB NBL. split != 0 ends the first MDL after
+// that many bytes, so headers cross into a second one.
+static int trace_build_nbls(PTRACE trace, ULONG split) {
+    trace->mdls = (PMDL)calloc(2 * (SIZE_T)trace->count, sizeof(MDL));
+    trace->nbs = (PNET_BUFFER)calloc(trace->count, sizeof(NET_BUFFER));
+    trace->nbls = (PNET_BUFFER_LIST)calloc(trace->count, sizeof(NET_BUFFER_LIST));
+    if (trace->mdls == NULL || trace->nbs == NULL || trace->nbls == NULL) { return 0; }
+    for (ULONG i = 0; i < trace->count; i++) {
+        PMDL first = &trace->mdls[2 * i], second = &trace->mdls[2 * i + 1];
+        ULONG length = trace->length[i];
+        first->MappedSystemVa = trace->data[i];
+        first->ByteCount = length;
+        if (split != 0 && length > split) {
+            first->ByteCount = split;
+            first->Next = second;
+            second->MappedSystemVa = trace->data[i] + split;
+            second->ByteCount = length - split;
+        }
+        trace->nbs[i].CurrentMdl = first;
+        trace->nbs[i].DataLength = length;
+        trace->nbls[i].FirstNetBuffer = &trace->nbs[i];
+    }
+    return 1;
+}
+
+static VOID rule_address(PNET_RULES rule, int destination, const NET_CLS_KEY* key, const NET_LPM6_ADDRESS* address6, UCHAR length) {
+    if (key->shape & NET_CLS_SHAPE_IP6) {
+        PUCHAR ip6 = destination ? rule->destination_ip6 : rule->source_ip6;
+        for (int b = 0; b < 8; b++) {
+            ip6[b] = (UCHAR)(address6->hi >> (56 - 8 * b));
+            ip6[8 + b] = (UCHAR)(address6->lo >> (56 - 8 * b));
+        }
+        if (length != 0) {
+            length = (UCHAR)(length + 16);      // /24 -> /40, /32 -> /48
+            for (int b = length / 8; b < 16; b++) { ip6[b] = 0; }
+        }
+        *(destination ? rule->destination_prefix_len : rule->source_prefix_len) = length;
+    } else {
+        UINT32 address = destination ? key->destination_ip : key->source_ip;
+        if (length != 0) { address &= ~0u << (32 - length); }
+        put32(destination ? rule->destination_ip : rule->source_ip, address);
+        *(destination ? rule->destination_prefix_len : rule->source_prefix_len) = length;
+    }
+}
+
+// Rules shaped like a real policy, taken from headers found in the trace
+// so that some of them match: 5-tuples, services on a host, source
+// subnets and port ranges. One rule in two is shifted off the trace (a
+// port that does not occur) so it never matches.
+static PNET_RULES make_rules(const TRACE* trace, ULONG count, UINT64* rng) {
+    PNET_RULES rules = (PNET_RULES)calloc(count, sizeof(NET_RULES));
+    ULONG made = 0;
+    for (ULONG attempt = 0; made < count && attempt < 64 * count; attempt++) {
+        ULONG i = bench_rand(rng) % trace->count;
+        NET_CLS_KEY key;
+        NET_LPM6_ADDRESS addresses[2];
+        ndisFrameToKey(trace->data[i], trace->length[i], &key, addresses);
+        if (!(key.shape & (NET_CLS_SHAPE_IP | NET_CLS_SHAPE_IP6))) { continue; }
+
+        PNET_RULES r = &rules[made++];
+        BOOLEAN l4 = (BOOLEAN)((key.shape & NET_CLS_SHAPE_L4) != 0);
+        UINT16 miss = (bench_rand(rng) & 1) ? 0x8000 : 0;
+        r->action = 2;
+        put16(r->ether_type, key.ether_type);
+        switch (bench_rand(rng) % 4) {
+        case 0:     // the whole 5-tuple
+            r->ip_next_protocol[0] = key.protocol;
+            rule_address(r, 0, &key, &addresses[0], 0);
+            rule_address(r, 1, &key, &addresses[1], 0);
+            if (l4) {
+                put16(r->source_port, key.source_port ^ miss);
+                put16(r->destination_port, key.destination_port);
+            }
+            break;
+        case 1:     // a service on a host
+            r->ip_next_protocol[0] = key.protocol;
+            rule_address(r, 1, &key, &addresses[1], 0);
+            if (l4) { put16(r->destination_port, key.destination_port ^ miss); }
+            break;
+        case 2:     // a source subnet to a port
+            rule_address(r, 0, &key, &addresses[0], 24);
+            if (l4) { r->ip_next_protocol[0] = key.protocol; put16(r->destination_port, key.destination_port ^ miss); }
+            break;
+        default:    // a port range to a host
+            r->ip_next_protocol[0] = key.protocol;
+            rule_address(r, 1, &key, &addresses[1], 0);
+            if (l4) {
+                UINT16 first = (UINT16)((key.destination_port ^ miss) & ~63);
+                put16(r->destination_port, first ? first : 1);
+                put16(r->destination_port_last, first + 63);
+            }
+            break;
+        }
+    }
+    for (ULONG i = 0; i < made; i++) {
+        rules[i]._next = (i + 1 < made) ? &rules[i + 1] : NULL;
+        rules[i]._prev = (i > 0) ? &rules[i - 1] : NULL;
+    }
+    return made ? rules : NULL;
+}
+
+static PNET_RULE_IMAGE load_image(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) { perror(path); return NULL; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    PNET_RULE_IMAGE image = (PNET_RULE_IMAGE)malloc(size > 0 ? (SIZE_T)size : 1);
+    if (image == NULL || fread(image, 1, (SIZE_T)size, f) != (SIZE_T)size ||
+        !ndisRuleImageValidate(image, (ULONG)size)) {
+        fprintf(stderr, "%s: not a valid rule image\n", path);
+        free(image);
+        image = NULL;
+    }
+    fclose(f);
+    return image;
+}
+
+// Dotted name as DNS labels; returns the bytes written
+static ULONG put_name(UCHAR* dst, const char* name) {
+    ULONG length = 0;
+    while (*name != '\0') {
+        ULONG label = (ULONG)strcspn(name, ".");
+        dst[length] = (UCHAR)label;
+        memcpy(dst + length + 1, name, label);
+        length += 1 + label;
+        name += label + (name[label] == '.');
+    }
+    dst[length++] = 0;
+    return length;
+}
+
+// A resolver's answer naming flow's source address, after a CNAME for one
+// in four; a quarter of the flows are under ads.example and a quarter go
+// through a CNAME to tracker.example, for a domain set to block
+static ULONG write_dns(UCHAR* frame, ULONG flow, const UCHAR* header, ULONG ip_offset, UINT64* rng) {
+    char name[64], target[64];
+    UCHAR* ip = frame + 14;
+    UCHAR* udp = ip + 20;
+    UCHAR* dns = udp + 8;
+    ULONG at = 12;
+
+    memset(frame, 0, 14 + 20 + 8 + 12);
+    for (int b = 0; b < 12; b++) { frame[b] = (UCHAR)bench_rand(rng); }
+    put16(frame + 12, 0x0800);
+    ip[0] = 0x45;
+    ip[8] = 64;
+    ip[9] = 0x11;
+    put32(ip + 12, 0x0AFF0035);
+    put32(ip + 16, 0xC0A80000 | (bench_rand(rng) % 4096));
+    put16(udp, 53);
+    put16(udp + 2, 1024 + bench_rand(rng) % 60000);
+    put16(dns, bench_rand(rng));
+    put16(dns + 2, 0x8180);
+    put16(dns + 4, 1);
+
+    int ipv6 = (ip_offset != 0 && header[ip_offset] == 0x60);
+    snprintf(name, sizeof(name), (flow % 4 == 0) ? "s%u.ads.example" : "s%u.cdn.example.net", flow);
+    at += put_name(dns + at, name);
+    put16(dns + at, ipv6 ? 28 : 1);
+    put16(dns + at + 2, 1);
+    at += 4;
+
+    ULONG owner = 0xC00C;
+    if (flow % 4 == 1) {
+        snprintf(target, sizeof(target), "e%u.tracker.example", flow);
+        put16(dns + at, 0xC00C);
+        put16(dns + at + 2, 5);
+        put16(dns + at + 4, 1);
+        put32(dns + at + 6, 3600);
+        ULONG length = put_name(dns + at + 12, target);
+        put16(dns + at + 10, length);
+        owner = 0xC000 | (at + 12);
+        at += 12 + length;
+    }
+    if (ip_offset != 0) {
+        put16(dns + at, owner);
+        put16(dns + at + 2, ipv6 ? 28 : 1);
+        put16(dns + at + 4, 1);
+        put32(dns + at + 6, 60);
+        put16(dns + at + 10, ipv6 ? 16 : 4);
+        memcpy(dns + at + 12, header + ip_offset + (ipv6 ? 8 : 12), ipv6 ? 16 : 4);
+        at += 12 + (ipv6 ? 16 : 4);
+    }
+    put16(dns + 6, (flow % 4 == 1) + (ip_offset != 0));
+
+    put16(udp + 4, 8 + at);
+    put16(ip + 2, 20 + 8 + at);
+    return 14 + 20 + 8 + at;
+}
+
+static int write_trace(const char* path, ULONG frames, UINT64* rng) {
+    // IMIX-like sizes over GEN_FLOWS flows with a skewed popularity; the
+    // same header mix as bench_batch plus a little ARP. Payloads are lower
+    // case text, one in GEN_REQUEST carrying an HTTP request line, for
+    // content rules to look at. TCP flows number their bytes, and half of
+    // their requests end one segment and go on in the next one of the flow.
+    // One frame in GEN_DNS is a DNS response resolving a flow's source.
+    static const ULONG sizes[] = { 64, 64, 64, 64, 64, 64, 64, 576, 576, 576, 576, 1514 };
+    static const char request[] = "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n";
+    static UCHAR flows[GEN_FLOWS][128];
+    static ULONG flow_hdr[GEN_FLOWS];
+    static ULONG flow_ip[GEN_FLOWS];        // network header offset, 0 - ARP
+    static ULONG flow_sequence[GEN_FLOWS];
+    static ULONG flow_pending[GEN_FLOWS];    // request bytes still to send, TCP only
+    UCHAR frame[1514];
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) { perror(path); return 0; }
+
+    for (ULONG i = 0; i < GEN_FLOWS; i++) {
+        UCHAR* h = flows[i];
+        for (int b = 0; b < 12; b++) { h[b] = (UCHAR)bench_rand(rng); }
+        ULONG kind = bench_rand(rng) % 100;
+        if (kind < 1) {
+            put16(h + 12, 0x0806);
+            flow_hdr[i] = 14 + 28;
+            continue;
+        }
+        if (kind < 26) {
+            UCHAR* ip6 = h + 14;
+            UCHAR* l4 = ip6 + 40;
+            UCHAR protocol = (bench_rand(rng) & 1) ? 0x06 : 0x11;
+            put16(h + 12, 0x86DD);
+            ip6[0] = 0x60;
+            flow_ip[i] = 14;
+            put32(ip6 + 8, 0x20010DB8); put32(ip6 + 12, bench_rand(rng) % 64); put32(ip6 + 20, bench_rand(rng));
+            put32(ip6 + 24, 0x20010DB8); put32(ip6 + 28, bench_rand(rng) % 64); put32(ip6 + 36, bench_rand(rng));
+            if (bench_rand(rng) & 1) { ip6[6] = 0; l4[0] = protocol; l4 += 8; } else { ip6[6] = protocol; }
+            if (protocol == 0x06) { l4[12] = 0x50; }
+            put16(l4, 1024 + bench_rand(rng) % 60000);
+            put16(l4 + 2, (bench_rand(rng) & 1) ? 443 : 1 + bench_rand(rng) % 1024);
+            flow_hdr[i] = (ULONG)(l4 + 20 - h);
+            continue;
+        }
+        UCHAR* ip = h + 14;
+        if (bench_rand(rng) % 8 == 0) {
+            put16(h + 12, 0x8100);
+            put16(ip, 1 + bench_rand(rng) % 4094);
+            ip += 4;
+        }
+        put16(ip - 2, 0x0800);
+        flow_ip[i] = (ULONG)(ip - h);
+        ip[0] = (bench_rand(rng) % 8 == 0) ? 0x46 : 0x45;
+        ip[8] = 64;
+        ip[9] = (bench_rand(rng) & 1) ? 0x06 : 0x11;
+        put32(ip + 12, 0x0A000000 | (bench_rand(rng) % 65536));
+        put32(ip + 16, 0xC0A80000 | (bench_rand(rng) % 4096));
+        UCHAR* l4 = ip + (ip[0] & 0x0F) * 4;
+        if (ip[9] == 0x06) { l4[12] = 0x50; }
+        put16(l4, 1024 + bench_rand(rng) % 60000);
+        put16(l4 + 2, (bench_rand(rng) & 1) ? 80 : 1 + bench_rand(rng) % 1024);
+        flow_hdr[i] = (ULONG)(l4 + 20 - h);
+    }
+
+    UINT32 header[6] = { PCAP_MAGIC_US, 2 | (4u << 16), 0, 0, PCAP_SNAPLEN, PCAP_LINKTYPE_ETHERNET };
+    fwrite(header, sizeof(header), 1, f);
+    for (ULONG i = 0; i < frames; i++) {
+        ULONG a = bench_rand(rng) % GEN_FLOWS, b = bench_rand(rng) % GEN_FLOWS;
+        ULONG flow = (ULONG)(((UINT64)a * b) / GEN_FLOWS);  // low flows are much busier
+        if (bench_rand(rng) % GEN_DNS == 0) {
+            ULONG length = write_dns(frame, flow, flows[flow], flow_ip[flow], rng);
+            UINT32 record[4] = { i / 1000000, i % 1000000, length, length };
+            fwrite(record, sizeof(record), 1, f);
+            fwrite(frame, 1, length, f);
+            continue;
+        }
+        ULONG length = sizes[bench_rand(rng) % (sizeof(sizes) / sizeof(sizes[0]))];
+        if (length < flow_hdr[flow]) { length = flow_hdr[flow]; }
+        ULONG hdr = flow_hdr[flow];
+        UCHAR* ip = frame + flow_ip[flow];
+        memcpy(frame, flows[flow], hdr);
+        for (ULONG b = hdr; b < length; b++) { frame[b] = (UCHAR)('a' + bench_rand(rng) % 26); }
+
+        int tcp = 0;
+        if (flow_ip[flow] != 0) {
+            // Length fields, then the sequence number of TCP flows
+            if (ip[0] == 0x60) {
+                put16(ip + 4, (UINT16)(length - flow_ip[flow] - 40));
+                tcp = (ip[6] == 0x06 || (ip[6] == 0 && ip[40] == 0x06));
+            } else {
+                put16(ip + 2, (UINT16)(length - flow_ip[flow]));
+                tcp = (ip[9] == 0x06);
+            }
+        }
+        if (tcp) {
+            put32(frame + hdr - 16, flow_sequence[flow]);
+            flow_sequence[flow] += length - hdr;
+        }
+
+        ULONG at = hdr;
+        if (flow_pending[flow] != 0) {
+            ULONG rest = min(flow_pending[flow], length - hdr);
+            memcpy(frame + hdr, request + sizeof(request) - 1 - flow_pending[flow], rest);
+            flow_pending[flow] -= rest;
+            at += rest;
+        }
+        if (bench_rand(rng) % GEN_REQUEST == 0 && length - at >= sizeof(request) - 1) {
+            if (tcp && (bench_rand(rng) & 1)) {
+                // The last cut bytes of this segment, the rest in the next one
+                ULONG cut = 1 + bench_rand(rng) % (sizeof(request) - 2);
+                memcpy(frame + length - cut, request, cut);
+                flow_pending[flow] = sizeof(request) - 1 - cut;
+            } else {
+                memcpy(frame + at, request, sizeof(request) - 1);
+            }
+        }
+        UINT32 record[4] = { i / 1000000, i % 1000000, length, length };
+        fwrite(record, sizeof(record), 1, f);
+        fwrite(frame, 1, length, f);
+    }
+    int ok = (fclose(f) == 0);
+    if (ok) { printf("%s: %u frames from %d flows\n", path, frames, GEN_FLOWS); }
+    return ok;
+}
+
+// Every pass replays the same segments, which a stream that remembers the
+// previous pass would take for retransmissions, at the same times, which
+// the rate sketches would take for a clock going backwards and the block
+// cache for answers still fresh
+static VOID restart_state(void) {
+    ndisStreamCleanup();
+    ndisStreamInit();
+    ndisRateCleanup();
+    ndisRateInit();
+    ndisDnsCleanup();
+    ndisDnsInit();
+    ndisMeterCleanup();
+    ndisMeterInit();
+}
+
+// The clock both paths read for frame i: that of the first frame of its chain
+static VOID replay_clock(const TRACE* trace, ULONG i, ULONG batch) {
+    ShimInterruptTime = trace->time[i - i % batch];
+}
+
+// The sketch update on its own, over the sources of the trace's IP frames
+static VOID time_sketch(const TRACE* trace, ULONG passes, BENCH_PERF* perf) {
+    PNET_LPM6_ADDRESS sources = (PNET_LPM6_ADDRESS)malloc(trace->count * sizeof(NET_LPM6_ADDRESS));
+    ULONG64* times = (ULONG64*)malloc(trace->count * sizeof(ULONG64));
+    UINT64 counts[BENCH_PERF_EVENTS];
+    ULONG count = 0;
+    if (sources == NULL || times == NULL) { free(sources); free(times); return; }
+    for (ULONG i = 0; i < trace->count; i++) {
+        if (ndisRateSource(trace->data[i], trace->length[i], &sources[count])) { times[count++] = trace->time[i]; }
+    }
+
+    UINT64 total = 0;
+    bench_perf_start(perf);
+    for (ULONG pass = 0; pass < passes; pass++) {
+        restart_state();
+        PNET_RATE_TABLE table = ndisRateCurrent();
+        UINT64 t0 = bench_now_ns();
+        for (ULONG i = 0; i < count; i++) { ndisRateCount(table, &sources[i], times[i]); }
+        total += bench_now_ns() - t0;
+    }
+    bench_perf_stop(perf, counts);
+    double packets = (double)count * passes + (count == 0);
+    static const int events[] = { BENCH_PERF_L1D_MISSES, BENCH_PERF_LLC_MISSES, BENCH_PERF_INSTRUCTIONS };
+    static const char* const names[] = { "L1D", "LLC", "instr" };
+    printf("source sketch: %.1f ns/pkt", total / packets);
+    for (int e = 0; e < 3; e++) {
+        if (counts[events[e]] != BENCH_PERF_NA) { printf(", %.2f %s/pkt", counts[events[e]] / packets, names[e]); }
+    }
+    printf(" over %u IP frames\n", count);
+    free(sources);
+    free(times);
+}
+
+// Exports what the rings hold as IPFIX messages at trace time now, into f
+// when given; returns the records exported
+static ULONG64 drain_meter(const TRACE* trace, ULONG64 now, PUCHAR message, FILE* f, ULONG64* bytes) {
+    ULONG64 records = 0;
+    ULONG length;
+    while ((length = ndisMeterExport(message, NET_METER_MESSAGE_MAX, 116444736000000000ULL + trace->origin + now, now)) != 0) {
+        records += (length - (NET_METER_HEADER_LEN + NET_METER_TEMPLATE_LEN + NET_METER_SET_LEN)) / NET_METER_RECORD_LEN;
+        *bytes += length;
+        if (f != NULL) { fwrite(message, 1, length, f); }
+    }
+    return records;
+}
+
+// The flow meter on its own over the trace's IP frames, with the records
+// exported every NET_METER_SWEEP of trace time and every flow expired at
+// the end of a pass
+static int time_meter(const TRACE* trace, ULONG passes, ULONG batch, const char* ipfix_path, BENCH_PERF* perf) {
+    PUCHAR message = (PUCHAR)malloc(NET_METER_MESSAGE_MAX);
+    UINT64 counts[BENCH_PERF_EVENTS];
+    ULONG64 records = 0, bytes = 0;
+    FILE* f = NULL;
+    if (message == NULL) { return 0; }
+    if (ipfix_path != NULL && (f = fopen(ipfix_path, "wb")) == NULL) { perror(ipfix_path); free(message); return 0; }
+
+    UINT64 total = 0;
+    bench_perf_start(perf);
+    for (ULONG pass = 0; pass < passes; pass++) {
+        restart_state();
+        PNET_METER_TABLE table = ndisMeterCurrent();
+        FILE* out = (pass == 0) ? f : NULL;
+        ULONG64 sweep = NET_METER_SWEEP;
+        records = 0;
+        bytes = 0;
+        UINT64 t0 = bench_now_ns();
+        for (ULONG i = 0; i < trace->count; i++) {
+            ULONG64 now = trace->time[i];
+            if (now >= sweep) {
+                ndisMeterExpire(table, now, table->capacity);
+                records += drain_meter(trace, now, message, out, &bytes);
+                sweep = now + NET_METER_SWEEP;
+            }
+            if (i % batch == 0) { ndisMeterExpire(table, now, NET_METER_EXPIRE_BATCH); }
+            // On the packet path the classifier has just read the headers
+            if (i + NET_BATCH_PREFETCH < trace->count) { NETFLT_PREFETCH(trace->data[i + NET_BATCH_PREFETCH]); }
+            ndisMeterFrame(table, trace->data[i], trace->length[i], trace->length[i], now);
+        }
+        ULONG64 end = trace->time[trace->count - 1];
+        records += drain_meter(trace, end, message, out, &bytes);
+        while (table->active != 0) {
+            ndisMeterExpire(table, ~0ULL - NET_METER_IDLE, table->capacity);
+            records += drain_meter(trace, end, message, out, &bytes);
+        }
+        total += bench_now_ns() - t0;
+    }
+    bench_perf_stop(perf, counts);
+    if (f != NULL && fclose(f) != 0) { perror(ipfix_path); free(message); return 0; }
+
+    NET_METER_STAT stat;
+    ndisMeterQueryStat(&stat);
+    double packets = (double)stat.packets * passes + (stat.packets == 0);
+    static const int events[] = { BENCH_PERF_L1D_MISSES, BENCH_PERF_LLC_MISSES, BENCH_PERF_INSTRUCTIONS };
+    static const char* const names[] = { "L1D", "LLC", "instr" };
+    printf("flow meter: %.1f ns/pkt", total / packets);
+    for (int e = 0; e < 3; e++) {
+        if (counts[events[e]] != BENCH_PERF_NA) { printf(", %.2f %s/pkt", counts[events[e]] / packets, names[e]); }
+    }
+    printf(" over %llu IP frames, %u entries\n", (unsigned long long)stat.packets, stat.entries);
+    printf("flows: %llu started, %llu records (1 per %.0f frames), %llu lost; %llu IPFIX bytes, %.1f%% of an alert per frame\n",
+        (unsigned long long)stat.started, (unsigned long long)records, (double)stat.packets / (records + (records == 0)),
+        (unsigned long long)stat.lost, (unsigned long long)bytes,
+        100.0 * bytes / ((double)stat.packets * sizeof(NET_ALERT_RECORD) + (stat.packets == 0)));
+    if (ipfix_path != NULL) { printf("%s: IPFIX messages of one pass\n", ipfix_path); }
+    free(message);
+    return 1;
+}
+
+static VOID print_top(void) {
+    NET_RATE_SOURCE top[TOP_SHOWN];
+    ULONG count = ndisRateQueryTop(top, TOP_SHOWN);
+    for (ULONG i = 0; i < count; i++) {
+        char text[64];
+        UCHAR bytes[16];
+        for (int b = 0; b < 8; b++) {
+            bytes[b] = (UCHAR)(top[i].address.hi >> (56 - 8 * b));
+            bytes[8 + b] = (UCHAR)(top[i].address.lo >> (56 - 8 * b));
+        }
+        if (top[i].address.hi == 0 && (top[i].address.lo >> 32) == 0xFFFF) {
+            snprintf(text, sizeof(text), "%u.%u.%u.%u", bytes[12], bytes[13], bytes[14], bytes[15]);
+        } else {
+            inet_ntop(AF_INET6, bytes, text, sizeof(text));
+        }
+        printf("  %-40s %10llu packets\n", text, (unsigned long long)top[i].packets);
+    }
+}
+
+static int compare_ticks(const void* a, const void* b) {
+    UINT64 x = *(const UINT64*)a, y = *(const UINT64*)b;
+    return (x > y) - (x < y);
+}
+
+static VOID print_counter(UINT64 count, ULONG packets) {
+    if (count == BENCH_PERF_NA) { printf(" %9s", "n/a"); } else { printf(" %9.2f", (double)count / packets); }
+}
+
+// samples hold per-packet ticks (already less the timer overhead)
+static VOID report(const char* name, UINT64 total_ns, ULONG packets, UINT64* samples, ULONG sample_count,
+    double ticks_per_ns, const UINT64* counts) {
+    qsort(samples, sample_count, sizeof(UINT64), compare_ticks);
+    static const double points[] = { 0.50, 0.90, 0.99, 0.999 };
+    printf("%-12s %7.2f %8.1f", name, packets / (total_ns / 1000.0), (double)total_ns / packets);
+    for (int p = 0; p < 4; p++) {
+        printf(" %7.1f", samples[(ULONG)(points[p] * (sample_count - 1))] / ticks_per_ns);
+    }
+    printf(" %8.1f", samples[sample_count - 1] / ticks_per_ns);
+    print_counter(counts[BENCH_PERF_L1D_MISSES], packets);
+    print_counter(counts[BENCH_PERF_LLC_MISSES], packets);
+    print_counter(counts[BENCH_PERF_INSTRUCTIONS], packets);
+    printf("\n");
+}
+
+// "<rule> <count>" for every header rule that matched, for netrulec -h
+static int write_hits(const char* path, const ULONG64* hits, ULONG rule_count) {
+    FILE* f = fopen(path, "w");
+    ULONG listed = 0;
+    if (f == NULL) { perror(path); return 0; }
+    for (ULONG i = 0; i < rule_count; i++) {
+        if (hits[i] != 0) {
+            fprintf(f, "%u %llu\n", i, (unsigned long long)hits[i]);
+            listed++;
+        }
+    }
+    if (fclose(f) != 0) { perror(path); return 0; }
+    printf("%s: hits of %u of %u rules\n", path, listed, rule_count);
+    return 1;
+}
+
+static int usage(void) {
+    fprintf(stderr,
+        "usage: bench_pcap [-r rules.img | -n rules] [-b batch] [-s split] [-p passes] [-h hits] [-o overlay.img]\n"
+        "                  [-x flows.ipfix] trace.pcap...\n"
+        "       bench_pcap -g trace.pcap [-f frames]\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    const char* image_path = NULL;
+    const char* generate = NULL;
+    const char* hit_path = NULL;
+    const char* overlay_path = NULL;
+    const char* ipfix_path = NULL;
+    ULONG rule_count = 4096, batch = 32, split = 0, passes = 5, frames = 1u << 20;
+    UINT64 rng = 0x0123456789ABCDEFULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:b:s:p:g:f:h:o:x:")) != -1) {
+        switch (opt) {
+        case 'r': image_path = optarg; break;
+        case 'n': rule_count = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'b': batch = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 's': split = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'p': passes = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'g': generate = optarg; break;
+        case 'f': frames = (ULONG)strtoul(optarg, NULL, 0); break;
+        case 'h': hit_path = optarg; break;
+        case 'o': overlay_path = optarg; break;
+        case 'x': ipfix_path = optarg; break;
+        default: return usage();
+        }
+    }
+    if (generate != NULL) { return write_trace(generate, frames, &rng) ? 0 : 1; }
+    if (optind == argc || batch == 0 || passes == 0 || rule_count == 0) { return usage(); }
+
+    TRACE trace;
+    memset(&trace, 0, sizeof(trace));
+    UINT64 bytes = 0;
+    for (int i = optind; i < argc; i++) {
+        if (!trace_load(&trace, argv[i])) { return 1; }
+    }
+    if (trace.count == 0 || !trace_build_nbls(&trace, split)) {
+        fprintf(stderr, "no frames\n");
+        return 1;
+    }
+    for (ULONG i = 0; i < trace.count; i++) { bytes += trace.length[i]; }
+
+    // The rule set as the driver publishes it
+    NET_RULE_SET rule_set;
+    PNET_RULE_IMAGE image = NULL;
+    PNET_CLASSIFIER compiled = NULL;
+    PNET_RULES rules = NULL;
+    memset(&rule_set, 0, sizeof(rule_set));
+    rule_set.generation = 1;
+    if (image_path != NULL) {
+        image = load_image(image_path);
+        if (image == NULL) { return 1; }
+        rule_set.image = image;
+        rule_set.classifier = ndisRuleImageClassifier(image);
+        rule_set.content = ndisRuleImageContent(image);
+        rule_set.reputation = ndisRuleImageReputation(image);
+        rule_set.domains = ndisRuleImageDomains(image);
+        rule_set.programs = ndisRuleImageVmPrograms(image);
+        rule_count = image->rule_count;
+    } else {
+        rules = make_rules(&trace, rule_count, &rng);
+        compiled = rules ? ndisCompileNetRules(rules) : NULL;
+        if (compiled == NULL) {
+            fprintf(stderr, "no IP frames to derive rules from\n");
+            return 1;
+        }
+        rule_set.classifier = compiled;
+    }
+    // An adapter's overlay runs ahead of the rules above, as its base
+    NET_RULE_SET overlay;
+    PNET_RULE_IMAGE overlay_image = NULL;
+    PNET_RULE_SET active = &rule_set;
+    memset(&overlay, 0, sizeof(overlay));
+    if (overlay_path != NULL) {
+        overlay_image = load_image(overlay_path);
+        if (overlay_image == NULL) { return 1; }
+        if (ndisRuleImageDomains(overlay_image) != NULL) {
+            fprintf(stderr, "%s: an overlay cannot carry a domain set\n", overlay_path);
+            return 1;
+        }
+        overlay.generation = 2;
+        overlay.image = overlay_image;
+        overlay.classifier = ndisRuleImageClassifier(overlay_image);
+        overlay.content = ndisRuleImageContent(overlay_image);
+        overlay.reputation = ndisRuleImageReputation(overlay_image);
+        overlay.programs = ndisRuleImageVmPrograms(overlay_image);
+        overlay.base = &rule_set;
+        active = &overlay;
+    }
+    if (!ndisFlowCacheInit() || !ndisAlertInit() || !inspect_init() || !ndisStreamInit() || !ndisRateInit() || !ndisDnsInit() ||
+        !ndisMeterInit()) {
+        return 1;
+    }
+    ndisContentInit(TRUE);
+
+    BOOLEAN* verdicts = (BOOLEAN*)calloc(trace.count, sizeof(BOOLEAN));
+    PNET_ALERT_RECORD alerts = (PNET_ALERT_RECORD)malloc(NET_ALERT_RING_SIZE * sizeof(NET_ALERT_RECORD));
+    UINT64* samples = (UINT64*)malloc(((SIZE_T)trace.count * passes) * sizeof(UINT64));
+    UINT64* payload_samples = (UINT64*)malloc(((SIZE_T)trace.count * passes) * sizeof(UINT64));
+    ULONG64* hits = (ULONG64*)calloc(rule_count, sizeof(ULONG64));
+    if (verdicts == NULL || alerts == NULL || samples == NULL || payload_samples == NULL || hits == NULL) { return 1; }
+
+    double ticks_per_ns = bench_ticks_per_ns();
+    UINT64 overhead = ~0ULL;
+    for (int i = 0; i < 1000; i++) {
+        UINT64 t0 = bench_ticks();
+        UINT64 t1 = bench_ticks();
+        if (t1 - t0 < overhead) { overhead = t1 - t0; }
+    }
+
+    BENCH_PERF perf;
+    UINT64 counts[BENCH_PERF_EVENTS];
+    bench_perf_open(&perf);
+
+    ULONG matched = 0;
+    restart_state();
+    for (ULONG i = 0; i < trace.count; i++) {
+        replay_clock(&trace, i, batch);
+        FLT_NETWORK_DATA packet = parse_frame(trace.data[i], trace.length[i]);
+        verdicts[i] = inspect_packet(active, &packet);
+        matched += verdicts[i];
+    }
+
+    printf("%u frames, %.0f bytes average, %u rules%s%s, %u passes\n", trace.count, (double)bytes / trace.count,
+        rule_count, image_path ? " from " : " derived from the trace", image_path ? image_path : "", passes);
+    if (split) {
+        printf("%.1f%% matched, first MDL ends after %u bytes\n", 100.0 * matched / trace.count, split);
+    } else {
+        printf("%.1f%% matched, one MDL per frame\n", 100.0 * matched / trace.count);
+    }
+    if (overlay_path != NULL) {
+        printf("overlay %s: %u rules, run ahead of the rules above\n", overlay_path, overlay_image->rule_count);
+    }
+    if (rule_set.reputation != NULL) {
+        ULONG listed = 0;
+        for (ULONG i = 0; i < trace.count; i++) {
+            listed += (ndisReputationFrame(rule_set.reputation, trace.data[i], trace.length[i]) != NET_CLS_NO_MATCH);
+        }
+        printf("reputation set: %u IPv4 and %u IPv6 addresses in %u bytes, %.1f%% of frames listed\n",
+            rule_set.reputation->count4, rule_set.reputation->count6, rule_set.reputation->size, 100.0 * listed / trace.count);
+    }
+    if (rule_set.programs != NULL) {
+        ULONG hits = 0;
+        for (ULONG i = 0; i < trace.count; i++) {
+            hits += (ndisVmFrame(rule_set.programs, trace.data[i], trace.length[i], trace.length[i]) != NET_CLS_NO_MATCH);
+        }
+        printf("filter programs: %u programs, %u instructions, cost %u, %.1f%% of frames matched by one\n",
+            rule_set.programs->program_count, rule_set.programs->insn_count, rule_set.programs->cost, 100.0 * hits / trace.count);
+    }
+    printf("%-12s %7s %8s %7s %7s %7s %7s %8s %9s %9s %9s\n", "path", "Mpps", "ns/pkt", "p50", "p90", "p99", "p99.9",
+        "max", "L1D/pkt", "LLC/pkt", "instr/pkt");
+
+    // parse_frame + inspect_packet, one frame at a time. Throughput first
+    // with no per-packet timer in the way, then every packet timed.
+    ULONG packets = trace.count * passes;
+    UINT64 total = 0;
+    bench_perf_start(&perf);
+    for (ULONG pass = 0; pass < passes; pass++) {
+        restart_state();
+        UINT64 t0 = bench_now_ns();
+        for (ULONG i = 0; i < trace.count; i++) {
+            replay_clock(&trace, i, batch);
+            FLT_NETWORK_DATA packet = parse_frame(trace.data[i], trace.length[i]);
+            bench_sink += inspect_packet(active, &packet);
+        }
+        total += bench_now_ns() - t0;
+    }
+    bench_perf_stop(&perf, counts);
+    for (ULONG pass = 0, s = 0; pass < passes; pass++) {
+        restart_state();
+        for (ULONG i = 0; i < trace.count; i++, s++) {
+            replay_clock(&trace, i, batch);
+            UINT64 k0 = bench_ticks();
+            FLT_NETWORK_DATA packet = parse_frame(trace.data[i], trace.length[i]);
+            bench_sink += inspect_packet(active, &packet);
+            UINT64 k = bench_ticks() - k0;
+            samples[s] = k > overhead ? k - overhead : 0;
+        }
+    }
+    report("packet", total, packets, samples, packets, ticks_per_ns, counts);
+
+    // inspect_chain over receive indications of batch NBLs. The chain is
+    // relinked and the alert ring drained after every call, outside the
+    // timed section but inside the counters.
+    char name[32];
+    ULONG chains = 0;
+    total = 0;
+    bench_perf_start(&perf);
+    for (ULONG pass = 0; pass < passes; pass++) {
+        restart_state();
+        for (ULONG first = 0; first < trace.count; first += batch) {
+            ULONG count = min(batch, trace.count - first);
+            for (ULONG i = first; i < first + count; i++) {
+                trace.nbls[i].Next = (i + 1 < first + count) ? &trace.nbls[i + 1] : NULL;
+            }
+            PNET_BUFFER_LIST chain[INSPECT_VERDICTS];
+            ULONG chain_count[INSPECT_VERDICTS];
+            replay_clock(&trace, first, batch);
+            UINT64 k0 = bench_ticks();
+            inspect_chain(active, INSPECT_ALL, &trace.nbls[first], chain, chain_count);
+            UINT64 k = bench_ticks() - k0;
+            k = k > overhead ? k - overhead : 0;
+            total += k;
+            samples[chains++] = k / count;
+            PNET_BUFFER_LIST drop_chain = chain[INSPECT_DROP];
+            ULONG drop_count = chain_count[INSPECT_DROP];
+
+            // One NB per NBL, so one alert per dropped NBL
+            ULONG alert_count = ndisAlertDrain(alerts, NET_ALERT_RING_SIZE);
+            if (alert_count != drop_count) {
+                printf("ALERTS frame=%u dropped=%u alerts=%u\n", first, drop_count, alert_count);
+                return 1;
+            }
+
+            if (pass == 0) {
+                for (ULONG a = 0; a < alert_count; a++) {
+                    if ((alerts[a].flags & ~NET_ALERT_F_RATE) == 0 && alerts[a].rule < rule_count) { hits[alerts[a].rule]++; }
+                }
+                for (PNET_BUFFER_LIST nbl = drop_chain; nbl != NULL; nbl = nbl->Next) {
+                    ULONG i = (ULONG)(nbl - trace.nbls);
+                    if (!verdicts[i]) {
+                        printf("MISMATCH frame=%u packet=pass chain=drop\n", i);
+                        return 1;
+                    }
+                    verdicts[i] = 2;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (ULONG i = 0; i < trace.count; i++) {
+                if (verdicts[i] == 1) {
+                    printf("MISMATCH frame=%u packet=drop chain=pass\n", i);
+                    return 1;
+                }
+            }
+        }
+    }
+    bench_perf_stop(&perf, counts);
+    snprintf(name, sizeof(name), "chain/%u", batch);
+    report(name, (UINT64)(total / ticks_per_ns), packets, samples, chains, ticks_per_ns, counts);
+
+    // The same chains through the two tiers of deferred inspection (defer.h):
+    // the header stages as the receive path runs them, timed per frame of the
+    // chain, then the payload stages over the frames they deferred, timed per
+    // deferred frame. Together they have to drop what inspect_chain dropped.
+    // The cache counters are not split between the tiers.
+    ULONG deferred = 0, payload_chains = 0;
+    UINT64 payload_total = 0;
+    for (int e = 0; e < BENCH_PERF_EVENTS; e++) { counts[e] = BENCH_PERF_NA; }
+    chains = 0;
+    total = 0;
+    for (ULONG pass = 0; pass < passes; pass++) {
+        restart_state();
+        for (ULONG first = 0; first < trace.count; first += batch) {
+            ULONG count = min(batch, trace.count - first);
+            for (ULONG i = first; i < first + count; i++) {
+                trace.nbls[i].Next = (i + 1 < first + count) ? &trace.nbls[i + 1] : NULL;
+            }
+            PNET_BUFFER_LIST chain[INSPECT_VERDICTS], payload_chain[INSPECT_VERDICTS];
+            ULONG chain_count[INSPECT_VERDICTS], payload_count[INSPECT_VERDICTS];
+            replay_clock(&trace, first, batch);
+            UINT64 k0 = bench_ticks();
+            inspect_chain(active, INSPECT_HEADERS, &trace.nbls[first], chain, chain_count);
+            UINT64 k = bench_ticks() - k0;
+            k = k > overhead ? k - overhead : 0;
+            total += k;
+            samples[chains++] = k / count;
+
+            payload_chain[INSPECT_DROP] = NULL;
+            payload_count[INSPECT_DROP] = 0;
+            if (chain[INSPECT_DEFER] != NULL) {
+                k0 = bench_ticks();
+                inspect_chain(active, INSPECT_PAYLOAD, chain[INSPECT_DEFER], payload_chain, payload_count);
+                k = bench_ticks() - k0;
+                k = k > overhead ? k - overhead : 0;
+                payload_total += k;
+                payload_samples[payload_chains++] = k / chain_count[INSPECT_DEFER];
+                deferred += chain_count[INSPECT_DEFER];
+            }
+
+            ULONG drop_count = chain_count[INSPECT_DROP] + payload_count[INSPECT_DROP];
+            ULONG alert_count = ndisAlertDrain(alerts, NET_ALERT_RING_SIZE);
+            if (alert_count != drop_count) {
+                printf("ALERTS frame=%u dropped=%u alerts=%u deferred\n", first, drop_count, alert_count);
+                return 1;
+            }
+            if (pass == 0) {
+                for (int tier = 0; tier < 2; tier++) {
+                    for (PNET_BUFFER_LIST nbl = tier ? payload_chain[INSPECT_DROP] : chain[INSPECT_DROP]; nbl != NULL; nbl = nbl->Next) {
+                        ULONG i = (ULONG)(nbl - trace.nbls);
+                        if (verdicts[i] != 2) {
+                            printf("MISMATCH frame=%u chain=pass deferred=drop\n", i);
+                            return 1;
+                        }
+                        verdicts[i] = 3;
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            for (ULONG i = 0; i < trace.count; i++) {
+                if (verdicts[i] == 2) {
+                    printf("MISMATCH frame=%u chain=drop deferred=pass\n", i);
+                    return 1;
+                }
+            }
+        }
+    }
+    snprintf(name, sizeof(name), "headers/%u", batch);
+    report(name, (UINT64)(total / ticks_per_ns), packets, samples, chains, ticks_per_ns, counts);
+    if (deferred != 0) {
+        snprintf(name, sizeof(name), "payload/%u", batch);
+        report(name, (UINT64)(payload_total / ticks_per_ns), deferred, payload_samples, payload_chains, ticks_per_ns, counts);
+    }
+    printf("%.1f%% of frames deferred to the payload stages\n", 100.0 * deferred / packets);
+
+    NET_FLOW_CACHE_STAT stat;
+    ndisFlowCacheQueryStat(&stat);
+    printf("flow cache hit rate %.1f%%\n", 100.0 * stat.hits / (stat.hits + stat.misses + (stat.hits + stat.misses == 0)));
+    if (rule_set.content != NULL && (rule_set.content->flags & NET_CONTENT_F_STREAM)) {
+        NET_STREAM_STAT streams;
+        ndisStreamQueryStat(&streams);
+        printf("tcp streams: %u entries, last pass %llu segments continued, %llu started, %llu gaps, %llu evictions\n",
+            streams.entries, (unsigned long long)streams.hits, (unsigned long long)streams.misses,
+            (unsigned long long)streams.gaps, (unsigned long long)streams.evictions);
+    }
+
+    if (rule_set.domains != NULL) {
+        NET_DNS_STAT dns;
+        ndisDnsQueryStat(&dns);
+        printf("domain set: %u domains, last pass %llu responses, %llu blocked, %llu addresses cached, %llu frames dropped\n",
+            rule_set.domains->count, (unsigned long long)dns.responses, (unsigned long long)dns.blocked,
+            (unsigned long long)dns.cached, (unsigned long long)dns.dropped);
+    }
+
+    NET_RATE_STAT rates;
+    ndisRateQueryStat(&rates);
+    printf("sources: last pass %llu frames counted, %llu rate limited admitted, %llu dropped; heaviest:\n",
+        (unsigned long long)rates.packets, (unsigned long long)rates.admitted, (unsigned long long)rates.limited);
+    print_top();
+    time_sketch(&trace, passes, &perf);
+    if (!time_meter(&trace, passes, batch, ipfix_path, &perf)) { return 1; }
+    if (hit_path != NULL && !write_hits(hit_path, hits, rule_count)) { return 1; }
+
+    bench_perf_close(&perf);
+    ndisMeterCleanup();
+    ndisDnsCleanup();
+    ndisRateCleanup();
+    ndisStreamCleanup();
+    inspect_cleanup();
+    ndisAlertCleanup();
+    ndisFlowCacheCleanup();
+    ndisFreeNetClassifier(compiled);
+    free(image);
+    free(overlay_image);
+    free(rules);
+    free(hits);
+    free(samples);
+    free(payload_samples);
+    free(alerts);
+    free(verdicts);
+    for (ULONG i = 0; i < trace.count; i++) { free(trace.data[i]); }
+    free(trace.data);
+    free(trace.length);
+    free(trace.time);
+    free(trace.mdls);
+    free(trace.nbs);
+    free(trace.nbls);
+    return 0;
+}
@@ -0,0 +1,198 @@
+//
+// Build time, bytes per address and ns/lookup of the IP reputation set
+// (reputation.c) for 100k, 1M and 5M random IPv4 addresses and 100k and 1M
+// IPv6 ones, for addresses in the set and addresses not in it, checked
+// against and compared with a binary search over the sorted addresses.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv bench_reputation.c
+//       ../FilterNetworkDrv/reputation.c ../FilterNetworkDrv/lpm.c
+//       ../FilterNetworkDrv/batch.c ../FilterNetworkDrv/flowcache.c
+//       ../FilterNetworkDrv/classifier.c -o bench_reputation
+//
+
+#include "bench_common.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "reputation.h"
+
+#define LOOKUPS     (1 << 20)
+#define PASSES      8
+
+static UINT64 rand64(UINT64* rng) { return ((UINT64)bench_rand(rng) << 32) | bench_rand(rng); }
+
+static BOOLEAN reference_contains(const UINT64* sorted, ULONG count, UINT64 value) {
+    ULONG lo = 0, hi = count;
+    while (lo < hi) {
+        ULONG mid = (lo + hi) / 2;
+        if (sorted[mid] < value) { lo = mid + 1; } else { hi = mid; }
+    }
+    return (BOOLEAN)(lo < count && sorted[lo] == value);
+}
+
+static BOOLEAN reference_contains6(const NET_LPM6_ADDRESS* sorted, ULONG count, const NET_LPM6_ADDRESS* value) {
+    ULONG lo = 0, hi = count;
+    while (lo < hi) {
+        ULONG mid = (lo + hi) / 2;
+        if (sorted[mid].hi < value->hi || (sorted[mid].hi == value->hi && sorted[mid].lo < value->lo)) { lo = mid + 1; } else { hi = mid; }
+    }
+    return (BOOLEAN)(lo < count && sorted[lo].hi == value->hi && sorted[lo].lo == value->lo);
+}
+
+static int compare6(const void* a, const void* b) {
+    const NET_LPM6_ADDRESS* x = (const NET_LPM6_ADDRESS*)a;
+    const NET_LPM6_ADDRESS* y = (const NET_LPM6_ADDRESS*)b;
+    if (x->hi != y->hi) { return (x->hi < y->hi) ? -1 : 1; }
+    return (x->lo < y->lo) ? -1 : (x->lo > y->lo);
+}
+
+static double ns_per(UINT64 t0, UINT64 t1) { return (double)(t1 - t0) / ((double)PASSES * LOOKUPS); }
+
+static int bench_ipv4(const ULONG* counts, size_t cases, UINT64* rng) {
+    UINT32* hits = (UINT32*)malloc(LOOKUPS * sizeof(UINT32));
+    UINT32* misses = (UINT32*)malloc(LOOKUPS * sizeof(UINT32));
+
+    printf("%8s %8s %8s %10s %10s %10s %12s %12s\n", "IPv4", "KiB", "B/addr", "build ms", "hit ns", "miss ns",
+        "bsearch hit", "bsearch miss");
+    for (size_t c = 0; c < cases; c++) {
+        ULONG count = counts[c];
+        UINT32* addresses = (UINT32*)malloc(count * sizeof(UINT32));
+        UINT64* sorted = (UINT64*)malloc(count * sizeof(UINT64));
+        for (ULONG i = 0; i < count; i++) { addresses[i] = bench_rand(rng); }
+
+        UINT64 t0 = bench_now_ns();
+        PNET_REPUTATION reputation = ndisBuildReputation(addresses, count, NULL, 0);
+        UINT64 t1 = bench_now_ns();
+        if (reputation == NULL || !ndisValidateReputation(reputation, reputation->size)) {
+            printf("BUILD FAILED addresses=%u\n", count);
+            return 1;
+        }
+        count = reputation->count4;
+        for (ULONG i = 0; i < count; i++) { sorted[i] = addresses[i]; }
+
+        // Misses are random addresses, checked to be out of the set
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            hits[i] = addresses[bench_rand(rng) % count];
+            do { misses[i] = bench_rand(rng); } while (reference_contains(sorted, count, misses[i]));
+        }
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            if (!ndisReputationContains4(reputation, hits[i]) || ndisReputationContains4(reputation, misses[i])) {
+                printf("MISMATCH addresses=%u hit=%08x miss=%08x\n", count, hits[i], misses[i]);
+                return 1;
+            }
+        }
+
+        UINT64 t[5];
+        t[0] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += ndisReputationContains4(reputation, hits[i]); }
+        }
+        t[1] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += ndisReputationContains4(reputation, misses[i]); }
+        }
+        t[2] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += reference_contains(sorted, count, hits[i]); }
+        }
+        t[3] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += reference_contains(sorted, count, misses[i]); }
+        }
+        t[4] = bench_now_ns();
+
+        printf("%8u %8u %8.2f %10.1f %10.1f %10.1f %12.1f %12.1f\n", count, reputation->size / 1024,
+            (double)reputation->size / count, (double)(t1 - t0) / 1e6, ns_per(t[0], t[1]), ns_per(t[1], t[2]),
+            ns_per(t[2], t[3]), ns_per(t[3], t[4]));
+
+        ndisFreeReputation(reputation);
+        free(sorted);
+        free(addresses);
+    }
+    free(hits);
+    free(misses);
+    return 0;
+}
+
+static int bench_ipv6(const ULONG* counts, size_t cases, UINT64* rng) {
+    PNET_LPM6_ADDRESS hits = (PNET_LPM6_ADDRESS)malloc(LOOKUPS * sizeof(NET_LPM6_ADDRESS));
+    PNET_LPM6_ADDRESS misses = (PNET_LPM6_ADDRESS)malloc(LOOKUPS * sizeof(NET_LPM6_ADDRESS));
+
+    printf("\n%8s %8s %8s %10s %10s %10s %12s %12s\n", "IPv6", "KiB", "B/addr", "build ms", "hit ns", "miss ns",
+        "bsearch hit", "bsearch miss");
+    for (size_t c = 0; c < cases; c++) {
+        ULONG count = counts[c];
+        PNET_LPM6_ADDRESS addresses = (PNET_LPM6_ADDRESS)malloc(count * sizeof(NET_LPM6_ADDRESS));
+        PNET_LPM6_ADDRESS sorted = (PNET_LPM6_ADDRESS)malloc(count * sizeof(NET_LPM6_ADDRESS));
+        // Hosts under a few thousand /48s, as feeds list them
+        for (ULONG i = 0; i < count; i++) {
+            addresses[i].hi = 0x2001000000000000ULL | ((UINT64)(bench_rand(rng) % 4096) << 16) | (bench_rand(rng) & 0xFFFF);
+            addresses[i].lo = rand64(rng);
+        }
+        memcpy(sorted, addresses, count * sizeof(NET_LPM6_ADDRESS));
+        qsort(sorted, count, sizeof(NET_LPM6_ADDRESS), compare6);
+
+        UINT64 t0 = bench_now_ns();
+        PNET_REPUTATION reputation = ndisBuildReputation(NULL, 0, addresses, count);
+        UINT64 t1 = bench_now_ns();
+        if (reputation == NULL || !ndisValidateReputation(reputation, reputation->size) || reputation->count6 != count) {
+            printf("BUILD FAILED addresses=%u\n", count);
+            return 1;
+        }
+
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            hits[i] = addresses[bench_rand(rng) % count];
+            misses[i] = hits[i];
+            do { misses[i].lo = rand64(rng); } while (reference_contains6(sorted, count, &misses[i]));
+        }
+        for (ULONG i = 0; i < LOOKUPS; i++) {
+            if (!ndisReputationContains6(reputation, &hits[i]) || ndisReputationContains6(reputation, &misses[i])) {
+                printf("MISMATCH addresses=%u hit=%016llx%016llx\n", count,
+                    (unsigned long long)hits[i].hi, (unsigned long long)hits[i].lo);
+                return 1;
+            }
+        }
+
+        UINT64 t[5];
+        t[0] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += ndisReputationContains6(reputation, &hits[i]); }
+        }
+        t[1] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += ndisReputationContains6(reputation, &misses[i]); }
+        }
+        t[2] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += reference_contains6(sorted, count, &hits[i]); }
+        }
+        t[3] = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (ULONG i = 0; i < LOOKUPS; i++) { bench_sink += reference_contains6(sorted, count, &misses[i]); }
+        }
+        t[4] = bench_now_ns();
+
+        printf("%8u %8u %8.2f %10.1f %10.1f %10.1f %12.1f %12.1f\n", count, reputation->size / 1024,
+            (double)reputation->size / count, (double)(t1 - t0) / 1e6, ns_per(t[0], t[1]), ns_per(t[1], t[2]),
+            ns_per(t[2], t[3]), ns_per(t[3], t[4]));
+
+        ndisFreeReputation(reputation);
+        free(sorted);
+        free(addresses);
+    }
+    free(hits);
+    free(misses);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    static const ULONG counts4[] = { 100000, 1000000, 5000000 };
+    static const ULONG counts6[] = { 100000, 1000000 };
+    UINT64 rng = 0x2F1E3D4C5B6A7988ULL;
+
+    if (bench_ipv4(counts4, sizeof(counts4) / sizeof(counts4[0]), &rng) != 0) { return 1; }
+    return bench_ipv6(counts6, sizeof(counts6) / sizeof(counts6[0]), &rng);
+}
@@ -0,0 +1,281 @@
+//
+// Differential check and payoff of the rule set optimizer (netrulec -o,
+// ..\FilterNetworkCompiler\ruleopt.c). Rule sets are drawn from small value
+// pools with all four actions, and a third of the rules are made from an
+// earlier one: a copy, a narrower or wider prefix, its sibling prefix or a
+// port range next to its own, so that there is something to drop and
+// merge. Half the packets are drawn from the same pools, half from inside a
+// random rule. The hits of each rule over the packets are counted with the
+// original set, the set is optimized with them, and every packet has to
+// get the same action, or no match, from both compiled sets.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv -I../FilterNetworkCompiler
+//       bench_ruleopt.c ../FilterNetworkCompiler/ruleopt.c
+//       ../FilterNetworkDrv/classifier.c ../FilterNetworkDrv/lpm.c
+//       -o bench_ruleopt
+//
+
+#include "bench_common.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "ruleopt.h"
+
+#define PACKETS     (1 << 16)
+#define REPEATS     16
+
+static VOID put16(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 8); dst[1] = (UCHAR)v; }
+static VOID put32(UCHAR* dst, UINT32 v) { dst[0] = (UCHAR)(v >> 24); dst[1] = (UCHAR)(v >> 16); dst[2] = (UCHAR)(v >> 8); dst[3] = (UCHAR)v; }
+static UINT32 get16(const UCHAR* v) { return ((UINT32)v[0] << 8) | v[1]; }
+static UINT32 get32(const UCHAR* v) { return ((UINT32)v[0] << 24) | ((UINT32)v[1] << 16) | ((UINT32)v[2] << 8) | v[3]; }
+
+static const UCHAR actions[] = { NET_RULE_ACTION_DROP, NET_RULE_ACTION_DROP, NET_RULE_ACTION_ALERT,
+    NET_RULE_ACTION_IGNORE, NET_RULE_ACTION_RATE_LIMIT };
+
+// 10.0.0.0/23 and 2001:db8:0:X::/64 with X < 16: small, so that rules overlap
+static UINT32 pick_ip(UINT64* rng) { return 0x0A000000 | (bench_rand(rng) % 512); }
+static UINT32 pick_port(UINT64* rng) { return 1 + bench_rand(rng) % 256; }
+static UCHAR pick_length(UINT64* rng) { return (UCHAR)(27 + bench_rand(rng) % 6); }
+static UCHAR pick_length6(UINT64* rng) { return (UCHAR)(124 + bench_rand(rng) % 5); }
+static VOID pick_ip6(UCHAR* ip6, UINT64* rng) {
+    static const UCHAR base[4] = { 0x20, 0x01, 0x0D, 0xB8 };
+    memset(ip6, 0, 16);
+    memcpy(ip6, base, 4);
+    ip6[7] = (UCHAR)(bench_rand(rng) % 16);
+    ip6[15] = (UCHAR)(bench_rand(rng) % 64);
+}
+
+static VOID fresh_rule(PNET_RULES r, UINT64* rng) {
+    static const UCHAR protocols[] = { 0, 6, 6, 17, 1 };
+    memset(r, 0, sizeof(*r));
+    r->action = actions[bench_rand(rng) % sizeof(actions)];
+    r->ip_next_protocol[0] = protocols[bench_rand(rng) % sizeof(protocols)];
+    switch (bench_rand(rng) % 16) {
+    case 0:     // IPv6 destination
+        if (bench_rand(rng) & 1) { put16(r->ether_type, 0x86DD); }
+        pick_ip6(r->destination_ip6, rng);
+        r->destination_prefix_len[0] = pick_length6(rng);
+        break;
+    case 1:     // ARP, now and then with a field no ARP frame has
+        put16(r->ether_type, 0x0806);
+        if (bench_rand(rng) % 8 != 0) { r->ip_next_protocol[0] = 0; }
+        return;
+    default:
+        if (bench_rand(rng) & 1) { put16(r->ether_type, 0x0800); }
+        if (bench_rand(rng) % 3 != 0) {
+            put32(r->source_ip, pick_ip(rng));
+            r->source_prefix_len[0] = pick_length(rng);
+        }
+        if (bench_rand(rng) % 3 == 0) {
+            put32(r->destination_ip, pick_ip(rng));
+            r->destination_prefix_len[0] = pick_length(rng);
+        }
+        break;
+    }
+    if (bench_rand(rng) % 3 != 0) {
+        UINT32 port = pick_port(rng);
+        put16(r->destination_port, port);
+        if (bench_rand(rng) & 1) { put16(r->destination_port_last, port + bench_rand(rng) % 8); }
+    }
+    if (bench_rand(rng) % 8 == 0) { put16(r->source_port, pick_port(rng)); }
+    if (get32(r->source_ip) == 0 && get32(r->destination_ip) == 0 && r->destination_prefix_len[0] == 0 && get16(r->destination_port) == 0) {
+        put32(r->source_ip, pick_ip(rng));
+    }
+}
+
+// A rule made from an earlier one, for the optimizer to find
+static VOID derived_rule(PNET_RULES r, const NET_RULES* from, UINT64* rng) {
+    *r = *from;
+    UINT32 kind = bench_rand(rng) % 6;
+    if (kind == 0 || kind == 1) { r->action = actions[bench_rand(rng) % sizeof(actions)]; }
+    UCHAR length = r->source_prefix_len[0];
+    UINT32 address = get32(r->source_ip);
+    UINT32 first = get16(r->destination_port), last = get16(r->destination_port_last);
+    switch (kind) {
+    case 2:     // sibling prefix
+        if (length >= 2 && length <= 32) { put32(r->source_ip, address ^ (1u << (32 - length))); }
+        break;
+    case 3:     // narrower or wider prefix
+        if (address != 0 && length >= 2 && length <= 31) { r->source_prefix_len[0] = (UCHAR)(length + ((bench_rand(rng) & 1) ? 1 : -1)); }
+        break;
+    case 4:     // the ports right after
+        if (first != 0) {
+            UINT32 width = (last > first) ? last - first : 0;
+            UINT32 next = ((last > first) ? last : first) + 1;
+            put16(r->destination_port, next);
+            put16(r->destination_port_last, (width != 0) ? next + width : 0);
+        }
+        break;
+    default:    // a copy
+        break;
+    }
+}
+
+static PNET_RULES make_rules(ULONG count, UINT64* rng) {
+    PNET_RULES rules = (PNET_RULES)calloc(count, sizeof(NET_RULES));
+    for (ULONG i = 0; rules != NULL && i < count; i++) {
+        if (i != 0 && bench_rand(rng) % 3 == 0) {
+            derived_rule(&rules[i], &rules[bench_rand(rng) % i], rng);
+        } else {
+            fresh_rule(&rules[i], rng);
+        }
+    }
+    return rules;
+}
+
+static VOID link_rules(PNET_RULES rules, ULONG count) {
+    for (ULONG i = 0; i < count; i++) {
+        rules[i]._next = (i + 1 < count) ? &rules[i + 1] : NULL;
+        rules[i]._prev = (i > 0) ? &rules[i - 1] : NULL;
+    }
+}
+
+static UINT32 inside(UINT32 address, UCHAR length, UINT64* rng) {
+    if (length == 0 || length >= 32) { return (address == 0 && length == 0) ? pick_ip(rng) : address; }
+    UINT32 mask = 0xFFFFFFFFu << (32 - length);
+    return (address & mask) | (bench_rand(rng) & ~mask);
+}
+
+static UINT32 port_inside(const UCHAR* port, const UCHAR* port_last, UINT64* rng) {
+    UINT32 first = get16(port), last = get16(port_last);
+    if (first == 0 && last == 0) { return pick_port(rng); }
+    if (last <= first) { return first; }
+    return first + bench_rand(rng) % (last - first + 1);
+}
+
+// A key from the pools, or one inside rule (when not NULL)
+static VOID make_key(PNET_CLS_KEY key, PNET_LPM6_ADDRESS addresses, const NET_RULES* rule, UINT64* rng) {
+    static const UCHAR zero[16] = { 0 };
+    memset(key, 0, sizeof(*key));
+    memset(addresses, 0, 2 * sizeof(NET_LPM6_ADDRESS));
+    UINT32 ether_type = rule ? get16(rule->ether_type) : 0;
+    UCHAR protocol = rule ? rule->ip_next_protocol[0] : 0;
+    int ip6 = rule ? (memcmp(rule->source_ip6, zero, 16) != 0 || memcmp(rule->destination_ip6, zero, 16) != 0) : 0;
+    if (rule == NULL) {
+        UINT32 kind = bench_rand(rng) % 8;
+        ether_type = (kind == 0) ? 0x0806 : (kind == 1) ? 0x86DD : 0x0800;
+    }
+    if (ether_type == 0) { ether_type = ip6 ? 0x86DD : 0x0800; }
+    if (protocol == 0) { protocol = (bench_rand(rng) & 1) ? 6 : 17; }
+    key->ether_type = (UINT16)ether_type;
+    if (ether_type != 0x0800 && ether_type != 0x86DD) { return; }
+
+    key->protocol = protocol;
+    if (ether_type == 0x86DD) {
+        UCHAR bytes[2][16];
+        key->shape = NET_CLS_SHAPE_IP6;
+        pick_ip6(bytes[0], rng);
+        pick_ip6(bytes[1], rng);
+        if (rule != NULL && memcmp(rule->destination_ip6, zero, 16) != 0) {
+            memcpy(bytes[1], rule->destination_ip6, 16);
+            bytes[1][15] ^= (UCHAR)(bench_rand(rng) & ((1u << (128 - rule->destination_prefix_len[0] % 129)) - 1) & 0xFF);
+        }
+        for (int d = 0; d < 2; d++) {
+            for (int i = 0; i < 8; i++) {
+                addresses[d].hi = (addresses[d].hi << 8) | bytes[d][i];
+                addresses[d].lo = (addresses[d].lo << 8) | bytes[d][8 + i];
+            }
+        }
+    } else {
+        key->shape = NET_CLS_SHAPE_IP;
+        key->source_ip = rule ? inside(get32(rule->source_ip), rule->source_prefix_len[0], rng) : pick_ip(rng);
+        key->destination_ip = rule ? inside(get32(rule->destination_ip), rule->destination_prefix_len[0], rng) : pick_ip(rng);
+    }
+    if (protocol == 6 || protocol == 17) {
+        key->shape |= NET_CLS_SHAPE_L4;
+        key->source_port = (UINT16)(rule ? port_inside(rule->source_port, rule->source_port_last, rng) : pick_port(rng));
+        key->destination_port = (UINT16)(rule ? port_inside(rule->destination_port, rule->destination_port_last, rng) : pick_port(rng));
+    }
+}
+
+static VOID resolve(const NET_CLASSIFIER* cls, PNET_CLS_KEY keys, const NET_LPM6_ADDRESS* addresses) {
+    for (ULONG i = 0; i < PACKETS; i++) {
+        if (keys[i].shape & NET_CLS_SHAPE_IP6) { ndisClsResolve6(cls, &keys[i], &addresses[2 * i]); }
+    }
+}
+
+static double time_lookups(const NET_CLASSIFIER* cls, const NET_CLS_KEY* keys) {
+    UINT64 t0 = bench_now_ns();
+    for (ULONG rep = 0; rep < REPEATS; rep++) {
+        for (ULONG i = 0; i < PACKETS; i++) { bench_sink += ndisClassify(cls, &keys[i]); }
+    }
+    return (double)(bench_now_ns() - t0) / ((double)REPEATS * PACKETS);
+}
+
+int main(int argc, char** argv) {
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    static const ULONG rule_counts[] = { 64, 1024, 16384, 65536 };
+    UINT64 rng = 0x5EED0F0F1234ABCDULL;
+
+    NET_CLS_KEY* keys = (NET_CLS_KEY*)malloc(PACKETS * sizeof(NET_CLS_KEY));
+    NET_CLS_KEY* opt_keys = (NET_CLS_KEY*)malloc(PACKETS * sizeof(NET_CLS_KEY));
+    PNET_LPM6_ADDRESS addresses = (PNET_LPM6_ADDRESS)malloc(2 * PACKETS * sizeof(NET_LPM6_ADDRESS));
+    if (keys == NULL || opt_keys == NULL || addresses == NULL) { return 1; }
+
+    printf("%7s %7s %6s %8s %10s %8s %6s %8s %8s %9s %9s %8s\n", "rules", "left", "dead", "shadowed", "redundant",
+        "merged", "moved", "tuples", "opt ms", "ns before", "ns after", "matched");
+    for (size_t c = 0; c < sizeof(rule_counts) / sizeof(rule_counts[0]); c++) {
+        ULONG count = rule_counts[c];
+        PNET_RULES rules = make_rules(count, &rng);
+        PNET_RULES optimized = (PNET_RULES)malloc(count * sizeof(NET_RULES));
+        ULONG64* hits = (ULONG64*)calloc(count, sizeof(ULONG64));
+        PULONG origin = (PULONG)malloc(count * sizeof(ULONG));
+        if (rules == NULL || optimized == NULL || hits == NULL || origin == NULL) { return 1; }
+        link_rules(rules, count);
+        for (ULONG i = 0; i < PACKETS; i++) {
+            make_key(&keys[i], &addresses[2 * i], (i & 1) ? &rules[bench_rand(&rng) % count] : NULL, &rng);
+        }
+        memcpy(opt_keys, keys, PACKETS * sizeof(NET_CLS_KEY));
+
+        PNET_CLASSIFIER cls = ndisCompileNetRules(rules);
+        if (cls == NULL) { return 1; }
+        resolve(cls, keys, addresses);
+        ULONG matched = 0;
+        for (ULONG i = 0; i < PACKETS; i++) {
+            ULONG rule = ndisClassify(cls, &keys[i]);
+            if (rule != NET_CLS_NO_MATCH) { hits[rule]++; matched++; }
+        }
+
+        memcpy(optimized, rules, count * sizeof(NET_RULES));
+        RULE_OPT_STAT stat;
+        UINT64 t0 = bench_now_ns();
+        ULONG left = rule_optimize(optimized, count, hits, origin, &stat);
+        UINT64 t1 = bench_now_ns();
+        link_rules(optimized, left);
+        PNET_CLASSIFIER opt_cls = (left != 0) ? ndisCompileNetRules(optimized) : NULL;
+        if (left != 0 && opt_cls == NULL) { return 1; }
+        if (opt_cls != NULL) { resolve(opt_cls, opt_keys, addresses); }
+
+        for (ULONG i = 0; i < PACKETS; i++) {
+            ULONG before = ndisClassify(cls, &keys[i]);
+            ULONG after = (opt_cls != NULL) ? ndisClassify(opt_cls, &opt_keys[i]) : NET_CLS_NO_MATCH;
+            if ((before == NET_CLS_NO_MATCH) != (after == NET_CLS_NO_MATCH) ||
+                (before != NET_CLS_NO_MATCH && rules[before].action != optimized[after].action)) {
+                printf("MISMATCH rules=%u packet=%u before=%u after=%u (rule %u)\n", count, i, before, after,
+                    (after != NET_CLS_NO_MATCH) ? origin[after] : 0);
+                return 1;
+            }
+        }
+
+        double ns_before = time_lookups(cls, keys);
+        double ns_after = (opt_cls != NULL) ? time_lookups(opt_cls, opt_keys) : 0;
+        printf("%7u %7u %6u %8u %10u %8u %6u %3u->%-4u %8.1f %9.1f %9.1f %7.1f%%\n", count, left, stat.dead, stat.shadowed,
+            stat.redundant, stat.merged, stat.moved, cls->tuple_count, opt_cls ? opt_cls->tuple_count : 0,
+            (t1 - t0) / 1e6, ns_before, ns_after, 100.0 * matched / PACKETS);
+
+        ndisFreeNetClassifier(opt_cls);
+        ndisFreeNetClassifier(cls);
+        free(origin);
+        free(hits);
+        free(optimized);
+        free(rules);
+    }
+
+    free(addresses);
+    free(opt_keys);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,426 @@
+//
+// Differential check and ns/frame of the filter program interpreter
+// (vm.c) against the same matches written in C: a SYN to a high port, an
+// HTTP request at the start of the payload, a count of NUL bytes in a loop,
+// an IPv4 header checksum in a loop and some arithmetic on the ports. The
+// frames are IPv4 and IPv6 TCP and UDP with payloads of up to 1200 bytes
+// and a few ARP frames. The references parse the frames on their own, so
+// the context the interpreter builds (ndisVmFrameContext) is checked too.
+// Then programs the verifier has to reject are fed to it.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv bench_vm.c
+//       ../FilterNetworkDrv/vm.c ../FilterNetworkDrv/batch.c
+//       ../FilterNetworkDrv/classifier.c ../FilterNetworkDrv/flowcache.c
+//       ../FilterNetworkDrv/lpm.c -o bench_vm
+//
+
+#include "bench_common.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+#include "vm.h"
+
+#define FRAMES          4096
+#define FRAME_MAX       1514
+#define PASSES          64
+#define PROGRAMS        5
+
+#define X               NET_VM_X
+#define NONE            NET_VM_NONE
+
+typedef ULONG (*REFERENCE)(const UCHAR* frame, ULONG length);
+
+// Programs, as netrulec -p would assemble them
+static const NET_VM_INSN syn_high[] = {
+    { NET_VM_META, 0, 0, 0, NET_VM_META_PROTOCOL },
+    { NET_VM_JNE, 0, 0, 6, 6 },
+    { NET_VM_LDB, 1, NONE, NET_VM_BASE_TRANSPORT, 13 },
+    { NET_VM_AND, 1, 0, 0, 0x12 },
+    { NET_VM_JNE, 1, 0, 3, 0x02 },
+    { NET_VM_META, 2, 0, 0, NET_VM_META_DEST_PORT },
+    { NET_VM_JLT, 2, 0, 1, 1024 },
+    { NET_VM_RET, 0, 0, 0, 1 },
+    { NET_VM_RET, 0, 0, 0, 0 },
+};
+
+static const NET_VM_INSN http_get[] = {
+    { NET_VM_LDW, 0, NONE, NET_VM_BASE_PAYLOAD, 0 },
+    { NET_VM_JEQ, 0, 0, 1, 0x47455420 },       // "GET "
+    { NET_VM_RET, 0, 0, 0, 0 },
+    { NET_VM_RET, 0, 0, 0, 1 },
+};
+
+// More than 8 NUL bytes in the first 64 payload bytes of the window
+static const NET_VM_INSN nul_bytes[] = {
+    { NET_VM_LEN, 3, 0, NET_VM_BASE_PAYLOAD, 0 },
+    { NET_VM_MOV, 1, 0, 0, 0 },
+    { NET_VM_MOV, 2, 0, 0, 0 },
+    { NET_VM_JGE | X, 1, 3, 4, 0 },             // loop:
+    { NET_VM_LDB, 0, 1, NET_VM_BASE_PAYLOAD, 0 },
+    { NET_VM_JNE, 0, 0, 1, 0 },
+    { NET_VM_ADD, 2, 0, 0, 1 },
+    { NET_VM_NEXT, 1, 0, 4, 64 },               // back to loop
+    { NET_VM_JGT, 2, 0, 1, 8 },
+    { NET_VM_RET, 0, 0, 0, 0 },
+    { NET_VM_RET, 0, 0, 0, 1 },
+};
+
+// IPv4 frames whose header checksum is wrong
+static const NET_VM_INSN bad_checksum[] = {
+    { NET_VM_META, 0, 0, 0, NET_VM_META_ETHER_TYPE },
+    { NET_VM_JNE, 0, 0, 20, 0x0800 },
+    { NET_VM_LDB, 1, NONE, NET_VM_BASE_NETWORK, 0 },
+    { NET_VM_AND, 1, 0, 0, 15 },
+    { NET_VM_LSH, 1, 0, 0, 1 },                 // 16-bit words
+    { NET_VM_MOV, 2, 0, 0, 0 },
+    { NET_VM_MOV, 3, 0, 0, 0 },
+    { NET_VM_MOV, 4, 0, 0, 0 },
+    { NET_VM_JGE | X, 3, 1, 4, 0 },             // loop:
+    { NET_VM_LDH, 5, 4, NET_VM_BASE_NETWORK, 0 },
+    { NET_VM_ADD | X, 2, 5, 0, 0 },
+    { NET_VM_ADD, 4, 0, 0, 2 },
+    { NET_VM_NEXT, 3, 0, 4, 30 },               // back to loop
+    { NET_VM_MOV | X, 5, 2, 0, 0 },
+    { NET_VM_RSH, 5, 0, 0, 16 },
+    { NET_VM_AND, 2, 0, 0, 0xFFFF },
+    { NET_VM_ADD | X, 2, 5, 0, 0 },
+    { NET_VM_MOV | X, 5, 2, 0, 0 },
+    { NET_VM_RSH, 5, 0, 0, 16 },
+    { NET_VM_ADD | X, 2, 5, 0, 0 },
+    { NET_VM_AND, 2, 0, 0, 0xFFFF },
+    { NET_VM_JNE, 2, 0, 1, 0xFFFF },
+    { NET_VM_RET, 0, 0, 0, 0 },
+    { NET_VM_RET, 0, 0, 0, 1 },
+};
+
+static const NET_VM_INSN port_hash[] = {
+    { NET_VM_META, 0, 0, 0, NET_VM_META_SOURCE_PORT },
+    { NET_VM_META, 1, 0, 0, NET_VM_META_DEST_PORT },
+    { NET_VM_META, 3, 0, 0, NET_VM_META_PROTOCOL },
+    { NET_VM_MUL, 0, 0, 0, 31 },
+    { NET_VM_XOR | X, 0, 1, 0, 0 },
+    { NET_VM_MOV | X, 2, 0, 0, 0 },
+    { NET_VM_DIV, 2, 0, 0, 5 },
+    { NET_VM_ADD | X, 0, 2, 0, 0 },
+    { NET_VM_NEG, 0, 0, 0, 0 },
+    { NET_VM_MOD | X, 0, 3, 0, 0 },             // by 0 for frames without IP
+    { NET_VM_MOD, 0, 0, 0, 13 },
+    { NET_VM_JSET, 0, 0, 1, 8 },
+    { NET_VM_RET, 0, 0, 0, 0 },
+    { NET_VM_RET | X, 0, 0, 0, 0 },
+};
+
+// What the references know of a frame: no VLAN tags, no IPv6 extension
+// headers, as the generator writes them
+typedef struct _REF_FRAME {
+    ULONG   ether_type;
+    ULONG   ip;             // 0 - not IP
+    ULONG   protocol;
+    ULONG   l4;             // 0 - no TCP/UDP
+    ULONG   payload;
+} REF_FRAME;
+
+static VOID ref_parse(const UCHAR* f, ULONG length, REF_FRAME* r) {
+    memset(r, 0, sizeof(*r));
+    r->ether_type = ((ULONG)f[12] << 8) | f[13];
+    if (r->ether_type == 0x0800) {
+        r->ip = 14;
+        r->protocol = f[14 + 9];
+        r->l4 = 14 + (f[14] & 15) * 4;
+    } else if (r->ether_type == 0x86DD) {
+        r->ip = 14;
+        r->protocol = f[14 + 6];
+        r->l4 = 14 + 40;
+    } else {
+        return;
+    }
+    if (r->protocol == 6) {
+        r->payload = r->l4 + (f[r->l4 + 12] >> 4) * 4;
+    } else if (r->protocol == 17) {
+        r->payload = r->l4 + 8;
+    } else {
+        r->l4 = 0;
+    }
+    UNREFERENCED_PARAMETER(length);
+}
+
+static ULONG ref_syn_high(const UCHAR* f, ULONG length) {
+    REF_FRAME r;
+    ref_parse(f, length, &r);
+    if (r.protocol != 6 || r.l4 == 0) { return 0; }
+    return (ULONG)((f[r.l4 + 13] & 0x12) == 0x02 && (((ULONG)f[r.l4 + 2] << 8) | f[r.l4 + 3]) >= 1024);
+}
+
+static ULONG ref_http_get(const UCHAR* f, ULONG length) {
+    REF_FRAME r;
+    ref_parse(f, length, &r);
+    if (r.l4 == 0 || r.payload + 4 > length || r.payload + 4 > NET_VM_WINDOW) { return 0; }
+    return (ULONG)(memcmp(f + r.payload, "GET ", 4) == 0);
+}
+
+static ULONG ref_nul_bytes(const UCHAR* f, ULONG length) {
+    REF_FRAME r;
+    ULONG window = (length < NET_VM_WINDOW) ? length : NET_VM_WINDOW;
+    ULONG nul = 0;
+    ref_parse(f, length, &r);
+    if (r.l4 == 0 || r.payload > window) { return 0; }
+    for (ULONG i = r.payload; i < window && i < r.payload + 64; i++) { nul += (f[i] == 0); }
+    return (ULONG)(nul > 8);
+}
+
+static ULONG ref_bad_checksum(const UCHAR* f, ULONG length) {
+    REF_FRAME r;
+    ULONG sum = 0;
+    ref_parse(f, length, &r);
+    if (r.ether_type != 0x0800) { return 0; }
+    for (ULONG i = 0; i < (ULONG)(f[14] & 15) * 4; i += 2) { sum += ((ULONG)f[14 + i] << 8) | f[15 + i]; }
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum + (sum >> 16)) & 0xFFFF;
+    return (ULONG)(sum != 0xFFFF);
+}
+
+static ULONG ref_port_hash(const UCHAR* f, ULONG length) {
+    REF_FRAME r;
+    ULONG sport = 0, dport = 0;
+    ref_parse(f, length, &r);
+    if (r.l4 != 0) {
+        sport = ((ULONG)f[r.l4] << 8) | f[r.l4 + 1];
+        dport = ((ULONG)f[r.l4 + 2] << 8) | f[r.l4 + 3];
+    }
+    ULONG x = (sport * 31) ^ dport;
+    x += x / 5;
+    x = 0 - x;
+    if (r.ip == 0) { return 0; }
+    x = (x % r.protocol) % 13;
+    return (x & 8) ? x : 0;
+}
+
+static const struct {
+    const char*         name;
+    const NET_VM_INSN*  code;
+    ULONG               count;
+    REFERENCE           reference;
+} programs[PROGRAMS] = {
+    { "syn to high port", syn_high, sizeof(syn_high) / sizeof(NET_VM_INSN), ref_syn_high },
+    { "http get", http_get, sizeof(http_get) / sizeof(NET_VM_INSN), ref_http_get },
+    { "nul bytes (loop)", nul_bytes, sizeof(nul_bytes) / sizeof(NET_VM_INSN), ref_nul_bytes },
+    { "ipv4 checksum (loop)", bad_checksum, sizeof(bad_checksum) / sizeof(NET_VM_INSN), ref_bad_checksum },
+    { "port hash", port_hash, sizeof(port_hash) / sizeof(NET_VM_INSN), ref_port_hash },
+};
+
+static ULONG make_frame(UCHAR* f, UINT64* rng) {
+    static const UINT16 ports[] = { 80, 443, 8080, 53 };
+    static const UCHAR flags[] = { 0x02, 0x12, 0x10, 0x18 };
+    ULONG kind = bench_rand(rng) % 20;
+    ULONG payload = (bench_rand(rng) % 4 == 0) ? 0 : bench_rand(rng) % 1201;
+    ULONG at;
+
+    memset(f, 0, FRAME_MAX);
+    memset(f, 0x02, 12);
+    if (kind == 19) {
+        // ARP
+        f[12] = 0x08; f[13] = 0x06;
+        for (at = 14; at < 42; at++) { f[at] = (UCHAR)bench_rand(rng); }
+        return 42;
+    }
+    ULONG tcp = (kind < 9 || (kind >= 14 && kind < 18));
+    ULONG l4_len = tcp ? 20 + 4 * (bench_rand(rng) % 3) : 8;
+    if (kind < 14) {
+        // IPv4, sometimes with options
+        ULONG ihl = (bench_rand(rng) % 8 == 0) ? 6 + bench_rand(rng) % 10 : 5;
+        ULONG total = ihl * 4 + l4_len + payload;
+        ULONG sum = 0;
+        f[12] = 0x08; f[13] = 0x00;
+        f[14] = (UCHAR)(0x40 | ihl);
+        f[16] = (UCHAR)(total >> 8); f[17] = (UCHAR)total;
+        f[22] = 64;
+        f[23] = tcp ? 6 : 17;
+        for (at = 26; at < 34; at++) { f[at] = (UCHAR)bench_rand(rng); }
+        for (at = 34; at < 14 + ihl * 4; at++) { f[at] = 1; }
+        for (at = 0; at < ihl * 4; at += 2) { sum += ((ULONG)f[14 + at] << 8) | f[15 + at]; }
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        sum = ~(sum + (sum >> 16)) & 0xFFFF;
+        if (bench_rand(rng) % 16 == 0) { sum ^= 0x0100; }
+        f[24] = (UCHAR)(sum >> 8); f[25] = (UCHAR)sum;
+        at = 14 + ihl * 4;
+    } else {
+        ULONG total = l4_len + payload;
+        f[12] = 0x86; f[13] = 0xDD;
+        f[14] = 0x60;
+        f[18] = (UCHAR)(total >> 8); f[19] = (UCHAR)total;
+        f[20] = tcp ? 6 : 17;
+        f[21] = 64;
+        for (at = 22; at < 54; at++) { f[at] = (UCHAR)bench_rand(rng); }
+        at = 54;
+    }
+
+    UINT16 sport = (UINT16)(1024 + bench_rand(rng) % 60000);
+    UINT16 dport = (bench_rand(rng) % 2) ? ports[bench_rand(rng) % 4] : (UINT16)(1024 + bench_rand(rng) % 60000);
+    f[at] = (UCHAR)(sport >> 8); f[at + 1] = (UCHAR)sport;
+    f[at + 2] = (UCHAR)(dport >> 8); f[at + 3] = (UCHAR)dport;
+    if (tcp) {
+        f[at + 12] = (UCHAR)((l4_len / 4) << 4);
+        f[at + 13] = flags[bench_rand(rng) % 4];
+    } else {
+        f[at + 4] = (UCHAR)((8 + payload) >> 8); f[at + 5] = (UCHAR)(8 + payload);
+    }
+    at += l4_len;
+
+    // Text or sparse binary, a quarter of it an HTTP request
+    ULONG zeros = 1 + bench_rand(rng) % 16;
+    for (ULONG i = 0; i < payload; i++) {
+        f[at + i] = (bench_rand(rng) % zeros == 0) ? 0 : (UCHAR)(' ' + bench_rand(rng) % 95);
+    }
+    if (payload >= 4 && bench_rand(rng) % 4 == 0) { memcpy(f + at, "GET ", 4); }
+    return at + payload;
+}
+
+// Instructions that break one rule each, and the error they must get
+static int check_rejects(void) {
+    static const NET_VM_INSN loop_write[] = {
+        { NET_VM_MOV, 1, 0, 0, 0 }, { NET_VM_ADD, 1, 0, 0, 1 }, { NET_VM_NEXT, 1, 0, 1, 10 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN jump_out[] = { { NET_VM_JEQ, 0, 0, 1, 0 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN ja_out[] = { { NET_VM_JA, 0, 0, 0, 0xFFFFFFFF }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN divide[] = { { NET_VM_DIV, 0, 0, 0, 0 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN costly[] = {
+        { NET_VM_MOV, 3, 0, 0, 0 }, { NET_VM_NEXT, 2, 0, 1, 1024 }, { NET_VM_NEXT, 1, 0, 2, 1024 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN overlap[] = {
+        { NET_VM_MOV, 3, 0, 0, 0 }, { NET_VM_MOV, 4, 0, 0, 0 }, { NET_VM_NEXT, 1, 0, 2, 4 }, { NET_VM_NEXT, 2, 0, 2, 4 },
+        { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN no_ret[] = { { NET_VM_MOV, 0, 0, 0, 0 } };
+    static const NET_VM_INSN bad_register[] = { { NET_VM_MOV, NET_VM_REGISTERS, 0, 0, 0 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN bad_load[] = { { NET_VM_LDB, 0, NONE, 0, NET_VM_WINDOW + 1 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN bad_base[] = { { NET_VM_LDB, 0, NONE, NET_VM_BASES, 0 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN bad_x[] = { { NET_VM_NEG | X, 0, 1, 0, 0 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const NET_VM_INSN back_past_start[] = { { NET_VM_NEXT, 1, 0, 1, 4 }, { NET_VM_RET, 0, 0, 0, 1 } };
+    static const struct {
+        const char*         name;
+        const NET_VM_INSN*  code;
+        ULONG               count;
+        ULONG               error;
+    } rejects[] = {
+        { "loop register written", loop_write, 4, NET_VM_E_LOOP_REGISTER },
+        { "jump past the end", jump_out, 2, NET_VM_E_JUMP },
+        { "ja past the end", ja_out, 2, NET_VM_E_JUMP },
+        { "divide by 0", divide, 2, NET_VM_E_DIVIDE },
+        { "1024 x 1024 loops", costly, 4, NET_VM_E_COST },
+        { "overlapping loops", overlap, 5, NET_VM_E_LOOP },
+        { "no ret", no_ret, 1, NET_VM_E_END },
+        { "register 8", bad_register, 2, NET_VM_E_REGISTER },
+        { "load past the window", bad_load, 2, NET_VM_E_OPERAND },
+        { "base 4", bad_base, 2, NET_VM_E_OPERAND },
+        { "neg with a register operand", bad_x, 2, NET_VM_E_OPCODE },
+        { "loop before the start", back_past_start, 2, NET_VM_E_LOOP },
+        { "empty", no_ret, 0, NET_VM_E_LENGTH },
+    };
+
+    for (ULONG i = 0; i < sizeof(rejects) / sizeof(rejects[0]); i++) {
+        ULONG cost, error_pc;
+        ULONG error = ndisVmVerify(rejects[i].code, rejects[i].count, &cost, &error_pc);
+        NET_VM_PROGRAM program = { NET_RULE_ACTION_DROP, { 0 }, 0, rejects[i].count, 0 };
+        PNET_VM_PROGRAMS built = ndisBuildVmPrograms(&program, 1, rejects[i].code, rejects[i].count);
+        if (error != rejects[i].error || built != NULL) {
+            printf("MISMATCH verifier: %s gave error %u at %u, %s\n", rejects[i].name, error, error_pc,
+                built ? "built" : "not built");
+            return 1;
+        }
+    }
+    printf("verifier: %u bad programs rejected\n", (ULONG)(sizeof(rejects) / sizeof(rejects[0])));
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    UCHAR* data = (UCHAR*)malloc((size_t)FRAMES * FRAME_MAX);
+    ULONG* lengths = (ULONG*)malloc(FRAMES * sizeof(ULONG));
+    PNET_VM_CONTEXT contexts = (PNET_VM_CONTEXT)malloc(FRAMES * sizeof(NET_VM_CONTEXT));
+    NET_VM_PROGRAM list[PROGRAMS];
+    NET_VM_INSN code[256];
+    ULONG insn_count = 0;
+    UINT64 rng = 0x6A09E667F3BCC908ULL;
+    ULONG i, p;
+
+    for (i = 0; i < FRAMES; i++) { lengths[i] = make_frame(data + (size_t)i * FRAME_MAX, &rng); }
+    for (p = 0; p < PROGRAMS; p++) {
+        list[p].action = NET_RULE_ACTION_DROP;
+        list[p].first = insn_count;
+        list[p].count = programs[p].count;
+        memcpy(code + insn_count, programs[p].code, programs[p].count * sizeof(NET_VM_INSN));
+        insn_count += programs[p].count;
+    }
+    PNET_VM_PROGRAMS set = ndisBuildVmPrograms(list, PROGRAMS, code, insn_count);
+    if (set == NULL || !ndisValidateVmPrograms(set, set->size)) {
+        printf("BUILD FAILED\n");
+        return 1;
+    }
+
+    // Every program against its reference, then the whole set first match
+    // against the references in order
+    for (i = 0; i < FRAMES; i++) {
+        const UCHAR* frame = data + (size_t)i * FRAME_MAX;
+        ULONG expected = NET_CLS_NO_MATCH;
+        ndisVmFrameContext(frame, lengths[i], lengths[i], &contexts[i]);
+        for (p = 0; p < PROGRAMS; p++) {
+            ULONG got = ndisVmRun(programs[p].code, &contexts[i]);
+            ULONG want = programs[p].reference(frame, lengths[i]);
+            if (got != want) {
+                printf("MISMATCH %s frame %u (%u bytes): vm %u, reference %u\n", programs[p].name, i, lengths[i], got, want);
+                return 1;
+            }
+            if (want != 0 && expected == NET_CLS_NO_MATCH) { expected = p; }
+        }
+        if (ndisVmFrame(set, frame, lengths[i], lengths[i]) != expected) {
+            printf("MISMATCH program set frame %u\n", i);
+            return 1;
+        }
+    }
+
+    printf("%u frames, %u programs, %u instructions, cost %u\n", FRAMES, PROGRAMS, set->insn_count, set->cost);
+    printf("%-22s %6s %6s %8s %8s %8s\n", "program", "insns", "cost", "match %", "vm ns", "C ns");
+    UINT64 t0 = bench_now_ns();
+    for (ULONG pass = 0; pass < PASSES; pass++) {
+        for (i = 0; i < FRAMES; i++) {
+            ndisVmFrameContext(data + (size_t)i * FRAME_MAX, lengths[i], lengths[i], &contexts[i]);
+            bench_sink += contexts[i].meta[NET_VM_META_PAYLOAD];
+        }
+    }
+    UINT64 t1 = bench_now_ns();
+    printf("%-22s %6s %6s %8s %8.1f %8s\n", "context", "", "", "", (double)(t1 - t0) / ((double)PASSES * FRAMES), "");
+
+    for (p = 0; p < PROGRAMS; p++) {
+        ULONG matched = 0;
+        for (i = 0; i < FRAMES; i++) { matched += (ndisVmRun(programs[p].code, &contexts[i]) != 0); }
+        t0 = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (i = 0; i < FRAMES; i++) { bench_sink += ndisVmRun(programs[p].code, &contexts[i]); }
+        }
+        t1 = bench_now_ns();
+        for (ULONG pass = 0; pass < PASSES; pass++) {
+            for (i = 0; i < FRAMES; i++) { bench_sink += programs[p].reference(data + (size_t)i * FRAME_MAX, lengths[i]); }
+        }
+        UINT64 t2 = bench_now_ns();
+        printf("%-22s %6u %6u %8.1f %8.1f %8.1f\n", programs[p].name, programs[p].count, ndisVmProgram(set, p)->cost,
+            100.0 * matched / FRAMES, (double)(t1 - t0) / ((double)PASSES * FRAMES),
+            (double)(t2 - t1) / ((double)PASSES * FRAMES));
+    }
+
+    t0 = bench_now_ns();
+    for (ULONG pass = 0; pass < PASSES; pass++) {
+        for (i = 0; i < FRAMES; i++) { bench_sink += ndisVmFrame(set, data + (size_t)i * FRAME_MAX, lengths[i], lengths[i]); }
+    }
+    t1 = bench_now_ns();
+    printf("%-22s %6u %6u %8s %8.1f %8s\n", "ndisVmFrame, all", set->insn_count, set->cost, "",
+        (double)(t1 - t0) / ((double)PASSES * FRAMES), "");
+
+    int status = check_rejects();
+    ndisFreeVmPrograms(set);
+    free(contexts);
+    free(lengths);
+    free(data);
+    return status;
+}
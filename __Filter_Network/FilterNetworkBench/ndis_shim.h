@@ -0,0 +1,76 @@
+#pragma once
+//
+// Just enough of NDIS for tcp_ip.c to build in user mode (see precomp.h).
+// A NET_BUFFER is a chain of MDLs that are already mapped; the harness
+// builds them over frames read from a pcap file, optionally split so that
+// headers straddle two MDLs the way they do behind header-data split NICs.
+//
+
+// Trace output would swamp the numbers being measured
+static inline void DbgPrint(const char* format, ...) { UNREFERENCED_PARAMETER(format); }
+
+// Replay time in 100 ns units, set by the harness from the trace so that
+// rate limiting sees the trace's packet rate rather than the replay's
+extern ULONG64 ShimInterruptTime;
+#define KeQueryInterruptTime()      (ShimInterruptTime)
+
+#ifndef min
+#define min(_a, _b)                 (((_a) < (_b)) ? (_a) : (_b))
+#endif
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+typedef struct _MDL {
+    struct _MDL*    Next;
+    PVOID           MappedSystemVa;
+    ULONG           ByteCount;
+} MDL, * PMDL;
+
+typedef struct _NET_BUFFER {
+    struct _NET_BUFFER* Next;
+    PMDL            CurrentMdl;
+    ULONG           CurrentMdlOffset;
+    ULONG           DataLength;
+} NET_BUFFER, * PNET_BUFFER;
+
+typedef struct _NET_BUFFER_LIST {
+    struct _NET_BUFFER_LIST* Next;
+    PNET_BUFFER     FirstNetBuffer;
+} NET_BUFFER_LIST, * PNET_BUFFER_LIST;
+
+#define NET_BUFFER_LIST_NEXT_NBL(_NBL)          ((_NBL)->Next)
+#define NET_BUFFER_LIST_FIRST_NB(_NBL)          ((_NBL)->FirstNetBuffer)
+#define NET_BUFFER_NEXT_NB(_NB)                 ((_NB)->Next)
+#define NET_BUFFER_CURRENT_MDL(_NB)             ((_NB)->CurrentMdl)
+#define NET_BUFFER_CURRENT_MDL_OFFSET(_NB)      ((_NB)->CurrentMdlOffset)
+#define NET_BUFFER_DATA_LENGTH(_NB)             ((_NB)->DataLength)
+#define NDIS_MDL_LINKAGE(_Mdl)                  ((_Mdl)->Next)
+
+#define MmGetSystemAddressForMdlSafe(_Mdl, _Priority)   ((_Mdl)->MappedSystemVa)
+#define MmGetMdlByteCount(_Mdl)                         ((_Mdl)->ByteCount)
+
+// As NDIS: a pointer into the current MDL when the bytes are contiguous
+// there, else a copy into Storage, or NULL without Storage. Alignment is
+// not emulated.
+static inline PVOID NdisGetDataBuffer(PNET_BUFFER NetBuffer, ULONG BytesNeeded, PVOID Storage,
+    ULONG AlignMultiple, ULONG AlignOffset) {
+    UNREFERENCED_PARAMETER(AlignMultiple);
+    UNREFERENCED_PARAMETER(AlignOffset);
+    PMDL mdl = NetBuffer->CurrentMdl;
+    ULONG offset = NetBuffer->CurrentMdlOffset;
+
+    if (BytesNeeded > NetBuffer->DataLength) { return NULL; }
+    if (mdl->ByteCount - offset >= BytesNeeded) { return (PUCHAR)mdl->MappedSystemVa + offset; }
+    if (Storage == NULL) { return NULL; }
+
+    for (ULONG copied = 0; copied < BytesNeeded; mdl = mdl->Next, offset = 0) {
+        ULONG chunk = min(mdl->ByteCount - offset, BytesNeeded - copied);
+        memcpy((PUCHAR)Storage + copied, (PUCHAR)mdl->MappedSystemVa + offset, chunk);
+        copied += chunk;
+    }
+    return Storage;
+}
@@ -0,0 +1,591 @@
+//
+// Flow record collector for FilterNetworkDrv (see ..\FilterNetworkDrv\meter.h).
+// Reads the IPFIX messages the driver exports, from the driver itself
+// (IOCTL_FILTER_READ_FLOWS, Windows only) or from a file of concatenated
+// messages such as bench_pcap -x writes, and stores the flow records in a
+// columnar file:
+//
+//   "FLOWCOL1"
+//   block*: "FBLK" rows(4) base(8) then FLOWCOL_COLUMNS times length(4) bytes
+//
+// in little-endian order. A block holds up to FLOWCOL_BLOCK_ROWS records,
+// sorted by start time, and decodes on its own. Each column is encoded for
+// what it holds:
+//
+//   start       varint of the zigzag difference to the row before (base first)
+//   duration    varint, end - start in ms
+//   octets      varint
+//   packets     varint
+//   source      varint index into the block's address dictionary
+//   destination varint index
+//   addresses   varint count, then per address 4 and the IPv4 address, or 16
+//               and the IPv6 one (IPv4 is ::ffff:a.b.c.d in the records)
+//   ports       varint, source and destination each a column
+//   protocol    runs: value byte, varint length
+//   tcp flags   runs: varint value, varint length
+//   end reason  runs: value byte, varint length
+//
+// Flows of one block share few addresses and start close together, so the
+// columns come to a fraction of the 72-byte records; no general purpose
+// codec is needed on top. -r prints a columnar file back as CSV.
+//
+//   gcc -O2 flowcol.c -o flowcol
+//   cl /O2 flowcol.c
+//
+//   ./flowcol -i flows.ipfix flows.col      from a file
+//   flowcol flows.col                       from the driver, until Ctrl-C
+//   ./flowcol -r flows.col                  as CSV
+//
+
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#include <windows.h>
+#include <winioctl.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Must match NET_METER_* in FilterNetworkDrv\meter.h and
+// IOCTL_FILTER_READ_FLOWS in FilterNetworkDrv\filteruser.h
+#define FLOWCOL_IPFIX_VERSION   10
+#define FLOWCOL_HEADER_LEN      16
+#define FLOWCOL_MESSAGE_MAX     65535
+#define FLOWCOL_DEVICE          L"\\\\.\\FilterNetworkDrv"
+#define FLOWCOL_IOCTL           ((0x17 << 16) | (18 << 2))
+
+#define FLOWCOL_MAGIC           "FLOWCOL1"
+#define FLOWCOL_BLOCK_MAGIC     "FBLK"
+#define FLOWCOL_BLOCK_ROWS      65536
+#define FLOWCOL_COLUMNS         12
+#define FLOWCOL_TEMPLATES       16
+#define FLOWCOL_FIELDS          11
+
+typedef struct _FLOW {
+    uint64_t    start;              // ms since 1970
+    uint64_t    end;
+    uint64_t    octets;
+    uint64_t    packets;
+    uint8_t     source[16];
+    uint8_t     destination[16];
+    uint16_t    source_port;
+    uint16_t    destination_port;
+    uint16_t    tcp_flags;
+    uint8_t     protocol;
+    uint8_t     end_reason;
+} FLOW;
+
+// The information elements a record is read from, in FLOW order
+static const uint16_t flowcol_elements[FLOWCOL_FIELDS] = { 152, 153, 1, 2, 27, 28, 7, 11, 6, 4, 136 };
+
+// Where the fields of a template's records are; offset ~0 - not in it
+typedef struct _TEMPLATE {
+    uint16_t    id;
+    uint32_t    length;             // of a record
+    uint32_t    offset[FLOWCOL_FIELDS];
+    uint16_t    size[FLOWCOL_FIELDS];
+} TEMPLATE;
+
+typedef struct _BUFFER {
+    uint8_t*    data;
+    size_t      length;
+    size_t      capacity;
+} BUFFER;
+
+typedef struct _COLLECTOR {
+    FILE*       out;
+    FLOW*       rows;
+    uint32_t    row_count;
+    TEMPLATE    templates[FLOWCOL_TEMPLATES];
+    uint32_t    template_count;
+    BUFFER      columns[FLOWCOL_COLUMNS];
+    uint64_t    messages;
+    uint64_t    records;
+    uint64_t    skipped;            // records of templates without the fields
+    uint64_t    written;            // bytes of the columnar file
+} COLLECTOR;
+
+static volatile int flowcol_stop = 0;
+
+static uint32_t get16(const uint8_t* p) { return ((uint32_t)p[0] << 8) | p[1]; }
+
+static uint64_t get_field(const uint8_t* p, uint16_t size) {
+    uint64_t v = 0;
+    for (uint16_t i = 0; i < size && i < 8; i++) { v = (v << 8) | p[i]; }
+    return v;
+}
+
+static int put_bytes(BUFFER* b, const void* data, size_t length) {
+    if (b->length + length > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->length + length) { capacity *= 2; }
+        uint8_t* grown = (uint8_t*)realloc(b->data, capacity);
+        if (grown == NULL) { return 0; }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+    return 1;
+}
+
+static int put_varint(BUFFER* b, uint64_t v) {
+    uint8_t bytes[10];
+    size_t n = 0;
+    while (v >= 0x80) { bytes[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+    bytes[n++] = (uint8_t)v;
+    return put_bytes(b, bytes, n);
+}
+
+static int get_varint(const uint8_t** p, const uint8_t* end, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) { return 1; }
+    }
+    return 0;
+}
+
+static void put_le(uint8_t* dst, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) { dst[i] = (uint8_t)(v >> (8 * i)); }
+}
+
+static uint64_t get_le(const uint8_t* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) { v = (v << 8) | p[i]; }
+    return v;
+}
+
+// Open addressing over the block's addresses; returns the dictionary index
+typedef struct _DICTIONARY {
+    uint32_t*   slots;              // index + 1, 0 - empty
+    uint32_t    mask;
+    uint32_t    count;
+    uint8_t     (*addresses)[16];
+} DICTIONARY;
+
+static uint32_t dictionary_add(DICTIONARY* d, const uint8_t* address) {
+    uint64_t h = 0;
+    for (int i = 0; i < 16; i++) { h = (h ^ address[i]) * 0x100000001B3ULL; }
+    for (uint32_t slot = (uint32_t)(h >> 32) & d->mask;; slot = (slot + 1) & d->mask) {
+        if (d->slots[slot] == 0) {
+            memcpy(d->addresses[d->count], address, 16);
+            d->slots[slot] = ++d->count;
+            return d->count - 1;
+        }
+        if (memcmp(d->addresses[d->slots[slot] - 1], address, 16) == 0) { return d->slots[slot] - 1; }
+    }
+}
+
+static const uint8_t flowcol_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+
+static int compare_start(const void* a, const void* b) {
+    uint64_t x = ((const FLOW*)a)->start, y = ((const FLOW*)b)->start;
+    return (x > y) - (x < y);
+}
+
+// Runs of equal values: value, then how many rows have it
+static int put_runs(BUFFER* b, const FLOW* rows, uint32_t count, uint64_t (*value)(const FLOW*), int byte) {
+    for (uint32_t i = 0; i < count;) {
+        uint64_t v = value(&rows[i]);
+        uint32_t run = 1;
+        while (i + run < count && value(&rows[i + run]) == v) { run++; }
+        if (byte) {
+            uint8_t value_byte = (uint8_t)v;
+            if (!put_bytes(b, &value_byte, 1)) { return 0; }
+        } else if (!put_varint(b, v)) {
+            return 0;
+        }
+        if (!put_varint(b, run)) { return 0; }
+        i += run;
+    }
+    return 1;
+}
+
+static uint64_t flow_protocol(const FLOW* f) { return f->protocol; }
+static uint64_t flow_tcp_flags(const FLOW* f) { return f->tcp_flags; }
+static uint64_t flow_end_reason(const FLOW* f) { return f->end_reason; }
+
+static int write_block(COLLECTOR* c) {
+    FLOW* rows = c->rows;
+    uint32_t count = c->row_count;
+    DICTIONARY d;
+    uint8_t header[16];
+    int ok = 1;
+
+    if (count == 0) { return 1; }
+    qsort(rows, count, sizeof(FLOW), compare_start);
+    for (int i = 0; i < FLOWCOL_COLUMNS; i++) { c->columns[i].length = 0; }
+
+    d.mask = 1;
+    while (d.mask < 4 * count) { d.mask <<= 1; }
+    d.slots = (uint32_t*)calloc(d.mask, sizeof(uint32_t));
+    d.addresses = (uint8_t(*)[16])malloc(2 * (size_t)count * 16);
+    d.mask--;
+    d.count = 0;
+    if (d.slots == NULL || d.addresses == NULL) { free(d.slots); free(d.addresses); return 0; }
+
+    uint64_t previous = rows[0].start;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        const FLOW* f = &rows[i];
+        int64_t delta = (int64_t)(f->start - previous);
+        previous = f->start;
+        ok = put_varint(&c->columns[0], ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)) &&
+            put_varint(&c->columns[1], f->end >= f->start ? f->end - f->start : 0) &&
+            put_varint(&c->columns[2], f->octets) &&
+            put_varint(&c->columns[3], f->packets) &&
+            put_varint(&c->columns[4], dictionary_add(&d, f->source)) &&
+            put_varint(&c->columns[5], dictionary_add(&d, f->destination)) &&
+            put_varint(&c->columns[7], f->source_port) &&
+            put_varint(&c->columns[8], f->destination_port);
+    }
+    ok = ok && put_varint(&c->columns[6], d.count);
+    for (uint32_t i = 0; i < d.count && ok; i++) {
+        uint8_t size = (memcmp(d.addresses[i], flowcol_mapped, 12) == 0) ? 4 : 16;
+        ok = put_bytes(&c->columns[6], &size, 1) && put_bytes(&c->columns[6], d.addresses[i] + 16 - size, size);
+    }
+    ok = ok && put_runs(&c->columns[9], rows, count, flow_protocol, 1) &&
+        put_runs(&c->columns[10], rows, count, flow_tcp_flags, 0) &&
+        put_runs(&c->columns[11], rows, count, flow_end_reason, 1);
+    free(d.slots);
+    free(d.addresses);
+    if (!ok) { return 0; }
+
+    memcpy(header, FLOWCOL_BLOCK_MAGIC, 4);
+    put_le(header + 4, count, 4);
+    put_le(header + 8, rows[0].start, 8);
+    ok = (fwrite(header, 1, 16, c->out) == 16);
+    c->written += 16;
+    for (int i = 0; i < FLOWCOL_COLUMNS && ok; i++) {
+        uint8_t length[4];
+        put_le(length, c->columns[i].length, 4);
+        ok = (fwrite(length, 1, 4, c->out) == 4) &&
+            (c->columns[i].length == 0 || fwrite(c->columns[i].data, 1, c->columns[i].length, c->out) == c->columns[i].length);
+        c->written += 4 + c->columns[i].length;
+    }
+    c->row_count = 0;
+    return ok;
+}
+
+static TEMPLATE* find_template(COLLECTOR* c, uint16_t id) {
+    for (uint32_t i = 0; i < c->template_count; i++) {
+        if (c->templates[i].id == id) { return &c->templates[i]; }
+    }
+    return NULL;
+}
+
+// A template set: every template it holds replaces one of the same ID
+static int read_templates(COLLECTOR* c, const uint8_t* set, uint32_t length) {
+    uint32_t at = 0;
+    while (at + 4 <= length) {
+        uint16_t id = (uint16_t)get16(set + at), field_count = (uint16_t)get16(set + at + 2);
+        TEMPLATE t;
+        at += 4;
+        if (id < 256) { return 0; }
+        memset(&t, 0, sizeof(t));
+        t.id = id;
+        for (int k = 0; k < FLOWCOL_FIELDS; k++) { t.offset[k] = ~0u; }
+        for (uint16_t i = 0; i < field_count; i++) {
+            if (at + 4 > length) { return 0; }
+            uint16_t element = (uint16_t)get16(set + at), size = (uint16_t)get16(set + at + 2);
+            at += 4;
+            if (element & 0x8000) { at += 4; }     // enterprise number
+            if (size == 0xFFFF) { return 0; }      // variable length is not produced by the driver
+            for (int k = 0; k < FLOWCOL_FIELDS; k++) {
+                if (!(element & 0x8000) && element == flowcol_elements[k]) { t.offset[k] = t.length; t.size[k] = size; }
+            }
+            t.length += size;
+        }
+        TEMPLATE* slot = find_template(c, id);
+        if (slot == NULL) {
+            if (c->template_count == FLOWCOL_TEMPLATES) { return 0; }
+            slot = &c->templates[c->template_count++];
+        }
+        *slot = t;
+    }
+    return 1;
+}
+
+static int add_record(COLLECTOR* c, const TEMPLATE* t, const uint8_t* record) {
+    FLOW* f = &c->rows[c->row_count];
+    memset(f, 0, sizeof(FLOW));
+    for (int k = 0; k < FLOWCOL_FIELDS; k++) {
+        if (t->offset[k] == ~0u) {
+            // Timestamps, addresses and counters are required
+            if (k < 6) { c->skipped++; return 1; }
+            continue;
+        }
+        const uint8_t* p = record + t->offset[k];
+        uint16_t size = t->size[k];
+        switch (k) {
+        case 0: f->start = get_field(p, size); break;
+        case 1: f->end = get_field(p, size); break;
+        case 2: f->octets = get_field(p, size); break;
+        case 3: f->packets = get_field(p, size); break;
+        case 4: if (size == 16) { memcpy(f->source, p, 16); } break;
+        case 5: if (size == 16) { memcpy(f->destination, p, 16); } break;
+        case 6: f->source_port = (uint16_t)get_field(p, size); break;
+        case 7: f->destination_port = (uint16_t)get_field(p, size); break;
+        case 8: f->tcp_flags = (uint16_t)get_field(p, size); break;
+        case 9: f->protocol = (uint8_t)get_field(p, size); break;
+        default: f->end_reason = (uint8_t)get_field(p, size); break;
+        }
+    }
+    c->records++;
+    if (++c->row_count == FLOWCOL_BLOCK_ROWS) { return write_block(c); }
+    return 1;
+}
+
+// One IPFIX message; returns 0 when it is malformed
+static int read_message(COLLECTOR* c, const uint8_t* message, uint32_t length) {
+    if (length < FLOWCOL_HEADER_LEN || get16(message) != FLOWCOL_IPFIX_VERSION || get16(message + 2) != length) { return 0; }
+    c->messages++;
+    for (uint32_t at = FLOWCOL_HEADER_LEN; at + 4 <= length;) {
+        uint16_t id = (uint16_t)get16(message + at);
+        uint32_t set_length = get16(message + at + 2);
+        if (set_length < 4 || at + set_length > length) { return 0; }
+        if (id == 2) {
+            if (!read_templates(c, message + at + 4, set_length - 4)) { return 0; }
+        } else if (id >= 256) {
+            // Data of a template not seen yet cannot be read; skip it
+            const TEMPLATE* t = find_template(c, id);
+            for (uint32_t r = 4; t != NULL && t->length != 0 && r + t->length <= set_length; r += t->length) {
+                if (!add_record(c, t, message + at + r)) { return -1; }
+            }
+        }
+        at += set_length;
+    }
+    return 1;
+}
+
+static int collect_file(COLLECTOR* c, const char* path) {
+    FILE* f = fopen(path, "rb");
+    static uint8_t message[FLOWCOL_MESSAGE_MAX];
+    uint8_t header[4];
+    if (f == NULL) { perror(path); return 0; }
+    while (fread(header, 1, 4, f) == 4) {
+        uint32_t length = get16(header + 2);
+        memcpy(message, header, 4);
+        if (length < FLOWCOL_HEADER_LEN || fread(message + 4, 1, length - 4, f) != length - 4) {
+            fprintf(stderr, "%s: truncated message\n", path);
+            fclose(f);
+            return 0;
+        }
+        int result = read_message(c, message, length);
+        if (result <= 0) {
+            fprintf(stderr, result < 0 ? "cannot write the output\n" : "%s: malformed message\n", path);
+            fclose(f);
+            return 0;
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+#ifdef _WIN32
+static HANDLE flowcol_device = INVALID_HANDLE_VALUE;
+
+static BOOL WINAPI flowcol_ctrl(DWORD type) {
+    // The read is pending in the driver; cancel it and finish the block
+    (void)type;
+    flowcol_stop = 1;
+    CancelIoEx(flowcol_device, NULL);
+    return TRUE;
+}
+
+static int collect_device(COLLECTOR* c) {
+    static uint8_t message[FLOWCOL_MESSAGE_MAX];
+    flowcol_device = CreateFileW(FLOWCOL_DEVICE, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (flowcol_device == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "cannot open the driver, error %lu\n", GetLastError());
+        return 0;
+    }
+    SetConsoleCtrlHandler(flowcol_ctrl, TRUE);
+    while (!flowcol_stop) {
+        DWORD length = 0;
+        // Completes about once a second, with the flows that ended since
+        if (!DeviceIoControl(flowcol_device, FLOWCOL_IOCTL, NULL, 0, message, sizeof(message), &length, NULL)) {
+            if (!flowcol_stop) { fprintf(stderr, "reading flows failed, error %lu\n", GetLastError()); }
+            break;
+        }
+        if (read_message(c, message, length) <= 0) {
+            fprintf(stderr, "malformed message from the driver\n");
+            break;
+        }
+    }
+    CloseHandle(flowcol_device);
+    return 1;
+}
+#endif
+
+static void print_address(const uint8_t* a) {
+    if (memcmp(a, flowcol_mapped, 12) == 0) {
+        printf("%u.%u.%u.%u", a[12], a[13], a[14], a[15]);
+        return;
+    }
+    for (int i = 0; i < 16; i += 2) { printf(i ? ":%x" : "%x", get16(a + i)); }
+}
+
+// Reads runs of one column until count rows are covered, into value(row)
+static int read_runs(const uint8_t* p, const uint8_t* end, FLOW* rows, uint32_t count, int field, int byte) {
+    for (uint32_t i = 0; i < count;) {
+        uint64_t v, run;
+        if (byte) {
+            if (p == end) { return 0; }
+            v = *p++;
+        } else if (!get_varint(&p, end, &v)) {
+            return 0;
+        }
+        if (!get_varint(&p, end, &run) || run == 0 || run > count - i) { return 0; }
+        for (; run != 0; run--, i++) {
+            if (field == 9) { rows[i].protocol = (uint8_t)v; }
+            else if (field == 10) { rows[i].tcp_flags = (uint16_t)v; }
+            else { rows[i].end_reason = (uint8_t)v; }
+        }
+    }
+    return 1;
+}
+
+static int read_block(const uint8_t* block, size_t length, size_t* used, FLOW* rows, uint32_t* count) {
+    const uint8_t* column[FLOWCOL_COLUMNS];
+    const uint8_t* end[FLOWCOL_COLUMNS];
+    size_t at = 16;
+
+    if (length < 16 || memcmp(block, FLOWCOL_BLOCK_MAGIC, 4) != 0) { return 0; }
+    *count = (uint32_t)get_le(block + 4, 4);
+    uint64_t start = get_le(block + 8, 8);
+    if (*count == 0 || *count > FLOWCOL_BLOCK_ROWS) { return 0; }
+    for (int i = 0; i < FLOWCOL_COLUMNS; i++) {
+        if (at + 4 > length) { return 0; }
+        size_t size = (size_t)get_le(block + at, 4);
+        if (at + 4 + size > length) { return 0; }
+        column[i] = block + at + 4;
+        end[i] = column[i] + size;
+        at += 4 + size;
+    }
+    *used = at;
+
+    uint64_t address_count;
+    if (!get_varint(&column[6], end[6], &address_count) || address_count > (uint64_t)(end[6] - column[6]) / 5) { return 0; }
+    uint8_t (*addresses)[16] = (uint8_t(*)[16])malloc((size_t)(address_count + 1) * 16);
+    if (addresses == NULL) { return 0; }
+    for (uint64_t i = 0; i < address_count; i++) {
+        uint8_t size = (column[6] < end[6]) ? *column[6]++ : 0;
+        if ((size != 4 && size != 16) || end[6] - column[6] < size) { free(addresses); return 0; }
+        memcpy(addresses[i], flowcol_mapped, 12);
+        memcpy(addresses[i] + 16 - size, column[6], size);
+        column[6] += size;
+    }
+    for (uint32_t i = 0; i < *count; i++) {
+        uint64_t delta, duration, source, destination, sport, dport;
+        FLOW* f = &rows[i];
+        if (!get_varint(&column[0], end[0], &delta) || !get_varint(&column[1], end[1], &duration) ||
+            !get_varint(&column[2], end[2], &f->octets) || !get_varint(&column[3], end[3], &f->packets) ||
+            !get_varint(&column[4], end[4], &source) || !get_varint(&column[5], end[5], &destination) ||
+            !get_varint(&column[7], end[7], &sport) || !get_varint(&column[8], end[8], &dport) ||
+            source >= address_count || destination >= address_count) {
+            free(addresses);
+            return 0;
+        }
+        start += (uint64_t)((int64_t)(delta >> 1) ^ -(int64_t)(delta & 1));
+        f->start = start;
+        f->end = start + duration;
+        memcpy(f->source, addresses[source], 16);
+        memcpy(f->destination, addresses[destination], 16);
+        f->source_port = (uint16_t)sport;
+        f->destination_port = (uint16_t)dport;
+    }
+    free(addresses);
+    return read_runs(column[9], end[9], rows, *count, 9, 1) && read_runs(column[10], end[10], rows, *count, 10, 0) &&
+        read_runs(column[11], end[11], rows, *count, 11, 1);
+}
+
+static int dump(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) { perror(path); return 0; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* data = (uint8_t*)malloc(size > 0 ? (size_t)size : 1);
+    FLOW* rows = (FLOW*)malloc(FLOWCOL_BLOCK_ROWS * sizeof(FLOW));
+    int ok = (data != NULL && rows != NULL && fread(data, 1, (size_t)size, f) == (size_t)size &&
+        size >= 8 && memcmp(data, FLOWCOL_MAGIC, 8) == 0);
+    fclose(f);
+
+    printf("start_ms,end_ms,source,destination,source_port,destination_port,protocol,tcp_flags,packets,octets,end_reason\n");
+    for (size_t at = 8; ok && at < (size_t)size;) {
+        size_t used;
+        uint32_t count;
+        ok = read_block(data + at, (size_t)size - at, &used, rows, &count);
+        for (uint32_t i = 0; ok && i < count; i++) {
+            const FLOW* r = &rows[i];
+            printf("%llu,%llu,", (unsigned long long)r->start, (unsigned long long)r->end);
+            print_address(r->source);
+            printf(",");
+            print_address(r->destination);
+            printf(",%u,%u,%u,0x%02x,%llu,%llu,%u\n", r->source_port, r->destination_port, r->protocol, r->tcp_flags,
+                (unsigned long long)r->packets, (unsigned long long)r->octets, r->end_reason);
+        }
+        at += used;
+    }
+    if (!ok) { fprintf(stderr, "%s: not a valid flow file\n", path); }
+    free(data);
+    free(rows);
+    return ok;
+}
+
+static int usage(void) {
+    fprintf(stderr,
+        "usage: flowcol [-i flows.ipfix] flows.col\n"
+        "       flowcol -r flows.col\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    const char* input = NULL;
+    const char* output = NULL;
+    COLLECTOR c;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) { return dump(argv[i + 1]) ? 0 : 1; }
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) { input = argv[++i]; continue; }
+        if (argv[i][0] == '-' || output != NULL) { return usage(); }
+        output = argv[i];
+    }
+    if (output == NULL) { return usage(); }
+#ifndef _WIN32
+    if (input == NULL) {
+        fprintf(stderr, "reading from the driver needs Windows; give -i\n");
+        return 2;
+    }
+#endif
+
+    memset(&c, 0, sizeof(c));
+    c.rows = (FLOW*)malloc(FLOWCOL_BLOCK_ROWS * sizeof(FLOW));
+    c.out = fopen(output, "wb");
+    if (c.rows == NULL || c.out == NULL) { perror(output); return 1; }
+    int ok = (fwrite(FLOWCOL_MAGIC, 1, 8, c.out) == 8);
+    c.written = 8;
+    if (input != NULL) {
+        ok = ok && collect_file(&c, input);
+    }
+#ifdef _WIN32
+    else {
+        ok = ok && collect_device(&c);
+    }
+#endif
+    ok = write_block(&c) && ok;
+    if (fclose(c.out) != 0) { ok = 0; }
+    if (!ok) { fprintf(stderr, "%s: incomplete\n", output); }
+
+    // The records as the driver sent them, 72 bytes each
+    printf("%llu messages, %llu flow records, %llu skipped; %llu bytes, %.1f bytes/record, %.1fx smaller than the records\n",
+        (unsigned long long)c.messages, (unsigned long long)c.records, (unsigned long long)c.skipped,
+        (unsigned long long)c.written, (double)c.written / (c.records + (c.records == 0)),
+        72.0 * c.records / (c.written + (c.written == 0)));
+    for (int i = 0; i < FLOWCOL_COLUMNS; i++) { free(c.columns[i].data); }
+    free(c.rows);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,1052 @@
+//
+// Offline compiler for FilterNetworkDrv rule images (see ruleimage.h).
+// Reads rules in the text form BUGAV shows them in, one per line:
+//
+//   <action> <ether type> <protocol> <source ip> <destination ip> <source port> <destination port> ["content"]
+//   Drop IP TCP 10.0.0.0/8 Ignore Ignore 80-443
+//   Alert IPv6 UDP Ignore 2001:db8::/32 Ignore 53
+//   Drop IP TCP Ignore Ignore Ignore 80 "GET /beacon|0d 0a|"
+//   RateLimit IP TCP Ignore 192.168.0.0/16 Ignore 22
+//
+// or, with -b, the binary record file BUGAV writes, and compiles them with
+// the driver's own classifier into an image the driver loads as it is.
+// Rules with content become content rules (content.h), compiled into one
+// automaton; -d limits the payload bytes the driver scans per frame.
+// RateLimit rules drop only the frames of sources over the rate -l sets
+// (packets per second per source, and the burst after a slash).
+// -r adds an IP reputation set (reputation.h) from a feed file: one IPv4
+// or IPv6 address per line, anything after it on the line ignored.
+// -n adds a domain set (dns.h): one domain per line, blocking the domain and
+// every name under it.
+// -p adds filter programs (vm.h) from an assembly file, verified here and
+// again by the driver.
+// -o optimizes the header rules first (ruleopt.h) and writes them, in the
+// text form, to a file the rules of the image can be read back from; -h
+// gives it hit counts to order them by: "<rule> <count>" lines, rule being
+// the index alerts carry (the header rules in file order, content rules
+// not counted).
+// -c checks an existing image the way the driver will.
+//
+//   gcc -O2 -DNETFLT_USER_MODE -I../FilterNetworkDrv netrulec.c
+//       ../FilterNetworkDrv/ruleimage.c ../FilterNetworkDrv/classifier.c
+//       ../FilterNetworkDrv/lpm.c ../FilterNetworkDrv/content.c
+//       ../FilterNetworkDrv/batch.c ../FilterNetworkDrv/flowcache.c
+//       ../FilterNetworkDrv/reputation.c ../FilterNetworkDrv/dns.c
+//       ../FilterNetworkDrv/vm.c ruleopt.c -o netrulec
+//
+
+#include <stdio.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "content.h"
+#include "reputation.h"
+#include "dns.h"
+#include "vm.h"
+#include "ruleimage.h"
+#include "ratelimit.h"
+#include "ruleopt.h"
+
+#define LINE_MAX_LEN    4096
+#define FIELDS          7
+#define ASM_TOKENS      8
+#define ASM_LABEL_LEN   32
+
+// Content rules in file order, their patterns packed in one buffer
+typedef struct _CONTENT_LIST {
+    PNET_CONTENT_RULE   rules;
+    ULONG               count;
+    ULONG               capacity;
+    UCHAR*              patterns;
+    ULONG               pattern_bytes;
+    char**              lines;          // as read, for -o
+} CONTENT_LIST;
+
+static UCHAR* read_file(const char* path, ULONG* length) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) { perror(path); return NULL; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0 || (unsigned long)size > NET_RULE_IMAGE_MAX_SIZE) {
+        fprintf(stderr, "%s: too large\n", path);
+        fclose(f);
+        return NULL;
+    }
+    // 8-byte aligned, as the driver's copy is
+    UCHAR* data = (UCHAR*)malloc((size_t)size + 1);
+    if (data != NULL && fread(data, 1, (size_t)size, f) != (size_t)size) {
+        perror(path);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *length = (ULONG)size;
+    return data;
+}
+
+static int parse_keyword(const char* token, const char* const* names, const UCHAR (*values)[2], ULONG count, UCHAR* out, ULONG bytes) {
+    for (ULONG i = 0; i < count; i++) {
+        if (strcasecmp(token, names[i]) == 0) {
+            memcpy(out, values[i], bytes);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int parse_ip(const char* token, UCHAR* ip4, UCHAR* ip6, UCHAR* prefix_len) {
+    char address[64];
+    const char* slash = strchr(token, '/');
+    size_t length = slash ? (size_t)(slash - token) : strlen(token);
+    if (strcasecmp(token, "Ignore") == 0) { return 1; }
+    if (length >= sizeof(address)) { return 0; }
+    memcpy(address, token, length);
+    address[length] = '\0';
+
+    ULONG max = 32;
+    if (inet_pton(AF_INET, address, ip4) != 1) {
+        if (inet_pton(AF_INET6, address, ip6) != 1) { return 0; }
+        max = 128;
+    }
+    if (slash != NULL) {
+        char* end;
+        unsigned long bits = strtoul(slash + 1, &end, 10);
+        if (*end != '\0' || bits == 0 || bits > max) { return 0; }
+        *prefix_len = (UCHAR)bits;
+    }
+    return 1;
+}
+
+static int parse_port(const char* token, UCHAR* port, UCHAR* port_last) {
+    char* end;
+    if (strcasecmp(token, "Ignore") == 0) { return 1; }
+    unsigned long first = strtoul(token, &end, 10);
+    if (end == token || first == 0 || first > 0xFFFF) { return 0; }
+    port[0] = (UCHAR)(first >> 8); port[1] = (UCHAR)first;
+    if (*end == '-') {
+        const char* last_token = end + 1;
+        unsigned long last = strtoul(last_token, &end, 10);
+        if (end == last_token || last < first || last > 0xFFFF) { return 0; }
+        port_last[0] = (UCHAR)(last >> 8); port_last[1] = (UCHAR)last;
+    }
+    return (*end == '\0');
+}
+
+static int parse_hex(char c) {
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+// Snort-style content: text with |hex bytes| sections and \" \\ \| escapes,
+// between double quotes. The closing quote has to end the line.
+static int parse_content(const char* text, UCHAR* pattern, ULONG* length) {
+    ULONG n = 0;
+    int hex = 0;
+
+    for (text++; *text != '"'; text++) {
+        if (*text == '\0') { return 0; }
+        if (hex) {
+            if (*text == '|') { hex = 0; continue; }
+            if (*text == ' ') { continue; }
+            int high = parse_hex(text[0]);
+            int low = (high >= 0) ? parse_hex(text[1]) : -1;
+            if (low < 0 || n == NET_CONTENT_MAX_PATTERN) { return 0; }
+            pattern[n++] = (UCHAR)((high << 4) | low);
+            text++;
+            continue;
+        }
+        if (*text == '|') { hex = 1; continue; }
+        if (*text == '\\') {
+            text++;
+            if (*text != '"' && *text != '\\' && *text != '|') { return 0; }
+        }
+        if (n == NET_CONTENT_MAX_PATTERN) { return 0; }
+        pattern[n++] = (UCHAR)*text;
+    }
+    if (hex || n == 0) { return 0; }
+    text += 1 + strspn(text + 1, " \t\r\n");
+    *length = n;
+    return (*text == '\0');
+}
+
+// The header fields of a content rule: no addresses, transport protocols
+// only, ports as ranges
+static int content_rule(const NET_RULES* rule, PNET_CONTENT_RULE content) {
+    static const UCHAR zero[16] = { 0 };
+    if (memcmp(rule->source_ip, zero, 4) != 0 || memcmp(rule->destination_ip, zero, 4) != 0 ||
+        memcmp(rule->source_ip6, zero, 16) != 0 || memcmp(rule->destination_ip6, zero, 16) != 0) {
+        return 0;
+    }
+    UCHAR protocol = rule->ip_next_protocol[0];
+    if (protocol != 0 && protocol != 6 && protocol != 17 && protocol != 132) { return 0; }
+    UINT16 ether_type = (UINT16)((rule->ether_type[0] << 8) | rule->ether_type[1]);
+    if (ether_type != 0 && ether_type != 0x0800 && ether_type != 0x86DD) { return 0; }
+
+    UINT16 source = (UINT16)((rule->source_port[0] << 8) | rule->source_port[1]);
+    UINT16 source_last = (UINT16)((rule->source_port_last[0] << 8) | rule->source_port_last[1]);
+    UINT16 destination = (UINT16)((rule->destination_port[0] << 8) | rule->destination_port[1]);
+    UINT16 destination_last = (UINT16)((rule->destination_port_last[0] << 8) | rule->destination_port_last[1]);
+
+    memset(content, 0, sizeof(*content));
+    content->ether_type = ether_type;
+    content->protocol = protocol;
+    content->action = rule->action;
+    content->source_port_first = source;
+    content->source_port_last = (source == 0) ? 0xFFFF : (source_last != 0) ? source_last : source;
+    content->destination_port_first = destination;
+    content->destination_port_last = (destination == 0) ? 0xFFFF : (destination_last != 0) ? destination_last : destination;
+    return 1;
+}
+
+static const char* const actions[] = { "Alert", "Drop", "Ignore", "RateLimit" };
+static const UCHAR action_values[][2] = { { NET_RULE_ACTION_ALERT }, { NET_RULE_ACTION_DROP }, { NET_RULE_ACTION_IGNORE },
+    { NET_RULE_ACTION_RATE_LIMIT } };
+
+static const char* action_name(UCHAR action) {
+    for (ULONG i = 0; i < 4; i++) {
+        if (action_values[i][0] == action) { return actions[i]; }
+    }
+    return "?";
+}
+
+// Same encoding as RuleComponent.ToBytes in BUGAV\Form_FilterNetworkRule.cs
+static int parse_rule(char* line, PNET_RULES rule) {
+    static const char* const ether_types[] = { "IP", "IPv6", "ARP", "Ignore" };
+    static const UCHAR ether_values[][2] = { { 0x08, 0x00 }, { 0x86, 0xDD }, { 0x08, 0x06 }, { 0x00, 0x00 } };
+    static const char* const protocols[] = { "ICMP", "IGMP", "UDP", "TCP", "Ignore" };
+    static const UCHAR protocol_values[][2] = { { 0x01 }, { 0x02 }, { 0x11 }, { 0x06 }, { 0x00 } };
+    char* token[FIELDS];
+    ULONG count = 0;
+
+    for (char* t = strtok(line, " \t\r\n"); t != NULL; t = strtok(NULL, " \t\r\n")) {
+        if (count == FIELDS) { return 0; }
+        token[count++] = t;
+    }
+    if (count != FIELDS) { return 0; }
+
+    memset(rule, 0, sizeof(*rule));
+    if (!parse_keyword(token[0], actions, action_values, 4, &rule->action, 1)) { return 0; }
+    if (!parse_keyword(token[1], ether_types, ether_values, 4, rule->ether_type, 2)) {
+        char* end;
+        unsigned long ether_type = strtoul(token[1], &end, 0);
+        if (*end != '\0' || ether_type == 0 || ether_type > 0xFFFF) { return 0; }
+        rule->ether_type[0] = (UCHAR)(ether_type >> 8);
+        rule->ether_type[1] = (UCHAR)ether_type;
+    }
+    if (!parse_keyword(token[2], protocols, protocol_values, 5, rule->ip_next_protocol, 1)) {
+        char* end;
+        unsigned long protocol = strtoul(token[2], &end, 10);
+        if (*end != '\0' || protocol == 0 || protocol > 0xFF) { return 0; }
+        rule->ip_next_protocol[0] = (UCHAR)protocol;
+    }
+    return parse_ip(token[3], rule->source_ip, rule->source_ip6, rule->source_prefix_len) &&
+        parse_ip(token[4], rule->destination_ip, rule->destination_ip6, rule->destination_prefix_len) &&
+        parse_port(token[5], rule->source_port, rule->source_port_last) &&
+        parse_port(token[6], rule->destination_port, rule->destination_port_last);
+}
+
+static int add_content(CONTENT_LIST* list, const NET_CONTENT_RULE* rule, const UCHAR* pattern, const char* line) {
+    if (list->count == list->capacity) {
+        ULONG capacity = list->capacity ? list->capacity * 2 : 64;
+        PNET_CONTENT_RULE rules = (PNET_CONTENT_RULE)realloc(list->rules, capacity * sizeof(NET_CONTENT_RULE));
+        UCHAR* patterns = (UCHAR*)realloc(list->patterns, (size_t)capacity * NET_CONTENT_MAX_PATTERN);
+        char** lines = (char**)realloc(list->lines, capacity * sizeof(char*));
+        if (rules != NULL) { list->rules = rules; }
+        if (patterns != NULL) { list->patterns = patterns; }
+        if (lines != NULL) { list->lines = lines; }
+        if (rules == NULL || patterns == NULL || lines == NULL) { return 0; }
+        list->capacity = capacity;
+    }
+    if (list->count == NET_CONTENT_MAX_RULES) { return 0; }
+    if ((list->lines[list->count] = strdup(line)) == NULL) { return 0; }
+    list->rules[list->count] = *rule;
+    list->rules[list->count].pattern_offset = list->pattern_bytes;
+    memcpy(list->patterns + list->pattern_bytes, pattern, rule->pattern_length);
+    list->pattern_bytes += rule->pattern_length;
+    list->count++;
+    return 1;
+}
+
+static PNET_RULES read_text_rules(const char* path, ULONG* rule_count, CONTENT_LIST* contents) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { perror(path); return NULL; }
+    char line[LINE_MAX_LEN];
+    char original[LINE_MAX_LEN];
+    UCHAR pattern[NET_CONTENT_MAX_PATTERN];
+    ULONG capacity = 1024, count = 0, number = 0;
+    PNET_RULES rules = (PNET_RULES)malloc(capacity * sizeof(NET_RULES));
+
+    while (rules != NULL && fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        char* text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\r' || *text == '\n' || *text == '\0') { continue; }
+        text[strcspn(text, "\r\n")] = '\0';
+        strcpy(original, text);
+        if (count == capacity) {
+            capacity *= 2;
+            PNET_RULES grown = (PNET_RULES)realloc(rules, capacity * sizeof(NET_RULES));
+            if (grown == NULL) { free(rules); rules = NULL; break; }
+            rules = grown;
+        }
+
+        // A quoted string after the header fields makes a content rule
+        char* quote = strchr(text, '"');
+        ULONG pattern_length = 0;
+        NET_CONTENT_RULE content;
+        if (quote != NULL && !parse_content(quote, pattern, &pattern_length)) {
+            fprintf(stderr, "%s:%u: bad content\n", path, number);
+            free(rules);
+            rules = NULL;
+            break;
+        }
+        if (quote != NULL) { *quote = '\0'; }
+        if (!parse_rule(text, &rules[count]) || (quote != NULL && !content_rule(&rules[count], &content))) {
+            fprintf(stderr, "%s:%u: bad rule\n", path, number);
+            free(rules);
+            rules = NULL;
+            break;
+        }
+        if (quote == NULL) {
+            count++;
+            continue;
+        }
+        content.pattern_length = (USHORT)pattern_length;
+        if (!add_content(contents, &content, pattern, original)) {
+            fprintf(stderr, "%s:%u: too many content rules\n", path, number);
+            free(rules);
+            rules = NULL;
+            break;
+        }
+    }
+    fclose(f);
+    *rule_count = count;
+    return rules;
+}
+
+static PNET_RULES read_record_rules(const char* path, ULONG* rule_count) {
+    // As ndisParseCfg: NET_RULE_RECORD_SIZE-byte records up to a 0xff byte
+    ULONG length;
+    UCHAR* data = read_file(path, &length);
+    if (data == NULL) { return NULL; }
+    ULONG count = ndisRuleRecordCount(data, length);
+    if (count == NET_RULE_RECORDS_BAD) {
+        fprintf(stderr, "%s: %u bytes are not %u-byte rule records\n", path, length, NET_RULE_RECORD_SIZE);
+        free(data);
+        return NULL;
+    }
+
+    PNET_RULES rules = (PNET_RULES)calloc(count + 1, sizeof(NET_RULES));
+    for (ULONG i = 0; rules != NULL && i < count; i++) {
+        memcpy(&rules[i], data + i * NET_RULE_RECORD_SIZE, NET_RULE_RECORD_SIZE);
+    }
+    free(data);
+    *rule_count = count;
+    return rules;
+}
+
+// Threat-intel feed: an address per line, optionally followed by
+// whatever the feed puts there (score, date, comment)
+static PNET_REPUTATION read_feed(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { perror(path); return NULL; }
+    char line[LINE_MAX_LEN];
+    ULONG count4 = 0, count6 = 0, capacity4 = 1024, capacity6 = 1024, number = 0;
+    UINT32* addresses4 = (UINT32*)malloc(capacity4 * sizeof(UINT32));
+    PNET_LPM6_ADDRESS addresses6 = (PNET_LPM6_ADDRESS)malloc(capacity6 * sizeof(NET_LPM6_ADDRESS));
+    int ok = (addresses4 != NULL && addresses6 != NULL);
+
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        char* text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\r' || *text == '\n' || *text == '\0') { continue; }
+        text[strcspn(text, " \t\r\n,;#")] = '\0';
+
+        UCHAR bytes[16];
+        if (inet_pton(AF_INET, text, bytes) == 1) {
+            if (count4 == capacity4) {
+                UINT32* grown = (UINT32*)realloc(addresses4, (capacity4 *= 2) * sizeof(UINT32));
+                if (grown == NULL) { ok = 0; break; }
+                addresses4 = grown;
+            }
+            addresses4[count4++] = ((UINT32)bytes[0] << 24) | ((UINT32)bytes[1] << 16) | ((UINT32)bytes[2] << 8) | bytes[3];
+        } else if (inet_pton(AF_INET6, text, bytes) == 1) {
+            if (count6 == capacity6) {
+                PNET_LPM6_ADDRESS grown = (PNET_LPM6_ADDRESS)realloc(addresses6, (capacity6 *= 2) * sizeof(NET_LPM6_ADDRESS));
+                if (grown == NULL) { ok = 0; break; }
+                addresses6 = grown;
+            }
+            addresses6[count6].hi = 0;
+            addresses6[count6].lo = 0;
+            for (ULONG i = 0; i < 8; i++) {
+                addresses6[count6].hi = (addresses6[count6].hi << 8) | bytes[i];
+                addresses6[count6].lo = (addresses6[count6].lo << 8) | bytes[8 + i];
+            }
+            count6++;
+        } else {
+            fprintf(stderr, "%s:%u: bad address\n", path, number);
+            ok = 0;
+        }
+    }
+    fclose(f);
+
+    PNET_REPUTATION reputation = NULL;
+    if (ok && (reputation = ndisBuildReputation(addresses4, count4, addresses6, count6)) == NULL) {
+        fprintf(stderr, "%s: %u IPv4 and %u IPv6 addresses do not fit in a reputation set\n", path, count4, count6);
+    }
+    free(addresses4);
+    free(addresses6);
+    return reputation;
+}
+
+// Blocked domains, one per line; hosts-file lines ("0.0.0.0 ads.example")
+// give their second field
+static PNET_DOMAINS read_domains(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { perror(path); return NULL; }
+    char line[LINE_MAX_LEN];
+    ULONG count = 0, capacity = 1024, number = 0;
+    char** names = (char**)malloc(capacity * sizeof(char*));
+    int ok = (names != NULL);
+
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        char* text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\r' || *text == '\n' || *text == '\0') { continue; }
+        size_t length = strcspn(text, " \t\r\n#");
+        if (text[length] == ' ' || text[length] == '\t') {
+            UCHAR bytes[16];
+            text[length] = '\0';
+            if (inet_pton(AF_INET, text, bytes) == 1 || inet_pton(AF_INET6, text, bytes) == 1) {
+                text += length + 1;
+                text += strspn(text, " \t");
+                length = strcspn(text, " \t\r\n#");
+            }
+        }
+        text[length] = '\0';
+        if (length == 0 || length > NET_DNS_NAME_MAX + 1) {
+            fprintf(stderr, "%s:%u: bad domain\n", path, number);
+            ok = 0;
+            break;
+        }
+        if (count == capacity) {
+            char** grown = (char**)realloc(names, (capacity *= 2) * sizeof(char*));
+            if (grown == NULL) { ok = 0; break; }
+            names = grown;
+        }
+        if ((names[count] = strdup(text)) == NULL) { ok = 0; break; }
+        count++;
+    }
+    fclose(f);
+
+    PNET_DOMAINS domains = NULL;
+    if (ok && (domains = ndisBuildDomains((const CHAR* const*)names, count)) == NULL) {
+        fprintf(stderr, "%s: %u domains do not make a domain set (empty, too many or a bad name)\n", path, count);
+    }
+    for (ULONG i = 0; i < count; i++) { free(names[i]); }
+    free(names);
+    return domains;
+}
+
+// Filter programs (vm.h), one instruction per line:
+//
+//   program <action>
+//   label:
+//       ldb|ldh|ldw rD, [frame|net|l4|payload + rS + offset]   (rS and offset optional)
+//       len rD, frame|net|l4|payload
+//       meta rD, ethertype|protocol|sport|dport|length|payload
+//       mov|add|sub|mul|div|mod|and|or|xor|lsh|rsh rD, rS|value
+//       neg rD
+//       ja label
+//       jeq|jne|jgt|jge|jlt|jle|jset rD, rS|value, label
+//       next rD, count, label                                  (label: first instruction of the loop)
+//       ret rS|value
+//   end
+typedef struct _ASM_LABEL {
+    char    name[ASM_LABEL_LEN];
+    ULONG   pc;
+    ULONG   line;                   // of the instruction, for fixups
+} ASM_LABEL;
+
+typedef struct _PROGRAM_LIST {
+    NET_VM_PROGRAM  programs[NET_VM_MAX_PROGRAMS];
+    ULONG           count;
+    NET_VM_INSN     code[NET_VM_MAX_PROGRAMS * NET_VM_MAX_INSNS];
+    ULONG           insn_count;
+    // Of the program being assembled
+    ULONG           lines[NET_VM_MAX_INSNS];
+    ASM_LABEL       labels[NET_VM_MAX_INSNS];
+    ULONG           label_count;
+    ASM_LABEL       fixups[NET_VM_MAX_INSNS];
+    ULONG           fixup_count;
+} PROGRAM_LIST;
+
+static const char* const vm_errors[] = { "ok", "no instructions, or too many", "bad opcode", "bad register",
+    "operand out of range", "division by 0", "jump past the end", "bad loop", "loop body writes the loop register",
+    "last instruction is not ret", "may run too many instructions" };
+
+static int asm_keyword(const char* token, const char* const* names, ULONG count, ULONG* index) {
+    for (ULONG i = 0; i < count; i++) {
+        if (strcasecmp(token, names[i]) == 0) {
+            *index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int asm_register(const char* token, UCHAR* reg) {
+    if ((token[0] != 'r' && token[0] != 'R') || token[1] < '0' || token[1] >= '0' + NET_VM_REGISTERS || token[2] != '\0') {
+        return 0;
+    }
+    *reg = (UCHAR)(token[1] - '0');
+    return 1;
+}
+
+static int asm_value(const char* token, ULONG* value) {
+    char* end;
+    if (token[0] < '0' || token[0] > '9') { return 0; }
+    unsigned long long v = strtoull(token, &end, 0);
+    if (*end != '\0' || v > 0xFFFFFFFFULL) { return 0; }
+    *value = (ULONG)v;
+    return 1;
+}
+
+// A register (NET_VM_X) or a value
+static int asm_operand(const char* token, PNET_VM_INSN insn) {
+    if (asm_register(token, &insn->src)) {
+        insn->opcode |= NET_VM_X;
+        return 1;
+    }
+    return asm_value(token, &insn->imm);
+}
+
+// The label a jump names, resolved at the end of the program
+static int asm_fixup(PROGRAM_LIST* list, const char* name, ULONG line) {
+    if (strlen(name) >= ASM_LABEL_LEN) { return 0; }
+    ASM_LABEL* fixup = &list->fixups[list->fixup_count++];
+    strcpy(fixup->name, name);
+    fixup->pc = list->insn_count - list->programs[list->count].first;
+    fixup->line = line;
+    return 1;
+}
+
+// One instruction; returns what is wrong with it, or NULL
+static const char* asm_insn(PROGRAM_LIST* list, char** token, ULONG count, ULONG line) {
+    static const char* const loads[] = { "ldb", "ldh", "ldw" };
+    static const char* const alu[] = { "mov", "add", "sub", "mul", "div", "mod", "and", "or", "xor", "lsh", "rsh" };
+    static const char* const jumps[] = { "jeq", "jne", "jgt", "jge", "jlt", "jle", "jset" };
+    static const char* const bases[] = { "frame", "net", "l4", "payload" };
+    static const char* const fields[] = { "ethertype", "protocol", "sport", "dport", "length", "payload" };
+    NET_VM_INSN insn = { 0 };
+    ULONG index;
+
+    if (list->insn_count - list->programs[list->count].first == NET_VM_MAX_INSNS) { return "program too long"; }
+    if (asm_keyword(token[0], loads, 3, &index)) {
+        // ldb rD, [base + rS + offset]
+        ULONG next = 3;
+        insn.opcode = (UCHAR)(NET_VM_LDB + index);
+        insn.src = NET_VM_NONE;
+        if (count < 3 || count > 5 || !asm_register(token[1], &insn.dst) || !asm_keyword(token[2], bases, NET_VM_BASES, &index)) {
+            return "bad load";
+        }
+        insn.jump = (UCHAR)index;
+        if (next < count && asm_register(token[next], &insn.src)) { next++; }
+        if (next < count && asm_value(token[next], &insn.imm)) { next++; }
+        if (next != count) { return "bad load"; }
+    } else if (strcasecmp(token[0], "len") == 0) {
+        insn.opcode = NET_VM_LEN;
+        if (count != 3 || !asm_register(token[1], &insn.dst) || !asm_keyword(token[2], bases, NET_VM_BASES, &index)) {
+            return "bad len";
+        }
+        insn.jump = (UCHAR)index;
+    } else if (strcasecmp(token[0], "meta") == 0) {
+        insn.opcode = NET_VM_META;
+        if (count != 3 || !asm_register(token[1], &insn.dst) || !asm_keyword(token[2], fields, NET_VM_META_COUNT, &insn.imm)) {
+            return "bad meta";
+        }
+    } else if (asm_keyword(token[0], alu, 11, &index)) {
+        insn.opcode = (UCHAR)(NET_VM_MOV + index);
+        if (count != 3 || !asm_register(token[1], &insn.dst) || !asm_operand(token[2], &insn)) { return "bad operands"; }
+    } else if (strcasecmp(token[0], "neg") == 0) {
+        insn.opcode = NET_VM_NEG;
+        if (count != 2 || !asm_register(token[1], &insn.dst)) { return "bad operands"; }
+    } else if (strcasecmp(token[0], "ja") == 0) {
+        insn.opcode = NET_VM_JA;
+        if (count != 2 || !asm_fixup(list, token[1], line)) { return "bad label"; }
+    } else if (asm_keyword(token[0], jumps, 7, &index)) {
+        insn.opcode = (UCHAR)(NET_VM_JEQ + index);
+        if (count != 4 || !asm_register(token[1], &insn.dst) || !asm_operand(token[2], &insn)) { return "bad operands"; }
+        if (!asm_fixup(list, token[3], line)) { return "bad label"; }
+    } else if (strcasecmp(token[0], "next") == 0) {
+        insn.opcode = NET_VM_NEXT;
+        if (count != 4 || !asm_register(token[1], &insn.dst) || !asm_value(token[2], &insn.imm)) { return "bad operands"; }
+        if (!asm_fixup(list, token[3], line)) { return "bad label"; }
+    } else if (strcasecmp(token[0], "ret") == 0) {
+        insn.opcode = NET_VM_RET;
+        if (count != 2 || !asm_operand(token[1], &insn)) { return "bad operand"; }
+    } else {
+        return "unknown instruction";
+    }
+    list->lines[list->insn_count - list->programs[list->count].first] = line;
+    list->code[list->insn_count++] = insn;
+    return NULL;
+}
+
+// Resolves the labels of the program being assembled and verifies it
+static int asm_end(PROGRAM_LIST* list, const char* path) {
+    PNET_VM_PROGRAM program = &list->programs[list->count];
+    PNET_VM_INSN code = list->code + program->first;
+    ULONG error_pc;
+
+    program->count = list->insn_count - program->first;
+    for (ULONG f = 0; f < list->fixup_count; f++) {
+        const ASM_LABEL* fixup = &list->fixups[f];
+        ULONG l = 0;
+        while (l < list->label_count && strcmp(list->labels[l].name, fixup->name) != 0) { l++; }
+        if (l == list->label_count) {
+            fprintf(stderr, "%s:%u: no label %s\n", path, fixup->line, fixup->name);
+            return 0;
+        }
+        ULONG target = list->labels[l].pc;
+        PNET_VM_INSN insn = &code[fixup->pc];
+        if (insn->opcode == NET_VM_NEXT) {
+            // Back to the first instruction of the body
+            if (target >= fixup->pc || fixup->pc - target > 0xFF) {
+                fprintf(stderr, "%s:%u: loop label %s not within 255 instructions before next\n", path, fixup->line, fixup->name);
+                return 0;
+            }
+            insn->jump = (UCHAR)(fixup->pc - target);
+        } else if (target <= fixup->pc) {
+            fprintf(stderr, "%s:%u: jump back to %s (only next jumps back)\n", path, fixup->line, fixup->name);
+            return 0;
+        } else if (insn->opcode == NET_VM_JA) {
+            insn->imm = target - fixup->pc - 1;
+        } else if (target - fixup->pc - 1 > 0xFF) {
+            fprintf(stderr, "%s:%u: jump too far to %s (255 instructions at most, ja goes further)\n", path, fixup->line, fixup->name);
+            return 0;
+        } else {
+            insn->jump = (UCHAR)(target - fixup->pc - 1);
+        }
+    }
+
+    ULONG error = ndisVmVerify(code, program->count, &program->cost, &error_pc);
+    if (error != NET_VM_OK) {
+        fprintf(stderr, "%s:%u: program %u does not verify: %s\n", path,
+            (program->count != 0) ? list->lines[error_pc] : 0, list->count, vm_errors[error]);
+        return 0;
+    }
+    list->count++;
+    return 1;
+}
+
+static PNET_VM_PROGRAMS read_programs(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { perror(path); return NULL; }
+    PROGRAM_LIST* list = (PROGRAM_LIST*)calloc(1, sizeof(PROGRAM_LIST));
+    char line[LINE_MAX_LEN];
+    ULONG number = 0;
+    int inside = 0;
+    int ok = (list != NULL);
+
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        char* token[ASM_TOKENS];
+        ULONG count = 0;
+        number++;
+        line[strcspn(line, "#")] = '\0';
+        for (char* t = strtok(line, " \t\r\n,[]+"); t != NULL && ok; t = strtok(NULL, " \t\r\n,[]+")) {
+            if (count == ASM_TOKENS) { ok = 0; break; }
+            token[count++] = t;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%u: too many operands\n", path, number);
+            break;
+        }
+        if (count == 0) { continue; }
+
+        if (strcasecmp(token[0], "program") == 0) {
+            ULONG action;
+            if (inside || count != 2 || !asm_keyword(token[1], actions, 4, &action) || list->count == NET_VM_MAX_PROGRAMS) {
+                fprintf(stderr, "%s:%u: bad program (nested, no action or over %u programs)\n", path, number, NET_VM_MAX_PROGRAMS);
+                ok = 0;
+                break;
+            }
+            memset(&list->programs[list->count], 0, sizeof(NET_VM_PROGRAM));
+            list->programs[list->count].action = action_values[action][0];
+            list->programs[list->count].first = list->insn_count;
+            list->label_count = 0;
+            list->fixup_count = 0;
+            inside = 1;
+            continue;
+        }
+        if (!inside) {
+            fprintf(stderr, "%s:%u: outside of a program\n", path, number);
+            ok = 0;
+            break;
+        }
+        if (strcasecmp(token[0], "end") == 0) {
+            ok = (count == 1) && asm_end(list, path);
+            if (count != 1) { fprintf(stderr, "%s:%u: bad end\n", path, number); }
+            inside = 0;
+            continue;
+        }
+
+        // A label names the instruction after it, on its line or on the next
+        size_t length = strlen(token[0]);
+        if (token[0][length - 1] == ':') {
+            token[0][length - 1] = '\0';
+            if (length == 1 || length > ASM_LABEL_LEN) {
+                fprintf(stderr, "%s:%u: bad label\n", path, number);
+                ok = 0;
+                break;
+            }
+            for (ULONG l = 0; l < list->label_count; l++) {
+                if (strcmp(list->labels[l].name, token[0]) == 0) {
+                    fprintf(stderr, "%s:%u: label %s defined twice\n", path, number, token[0]);
+                    ok = 0;
+                }
+            }
+            if (!ok || list->label_count == NET_VM_MAX_INSNS) { ok = 0; break; }
+            strcpy(list->labels[list->label_count].name, token[0]);
+            list->labels[list->label_count].pc = list->insn_count - list->programs[list->count].first;
+            list->labels[list->label_count].line = number;
+            list->label_count++;
+            if (count == 1) { continue; }
+            for (ULONG i = 1; i < count; i++) { token[i - 1] = token[i]; }
+            count--;
+        }
+        const char* error = asm_insn(list, token, count, number);
+        if (error != NULL) {
+            fprintf(stderr, "%s:%u: %s\n", path, number, error);
+            ok = 0;
+        }
+    }
+    fclose(f);
+    if (ok && inside) {
+        fprintf(stderr, "%s: program %u has no end\n", path, list->count);
+        ok = 0;
+    }
+
+    PNET_VM_PROGRAMS programs = NULL;
+    if (ok && (programs = ndisBuildVmPrograms(list->programs, list->count, list->code, list->insn_count)) == NULL) {
+        fprintf(stderr, "%s: %u programs do not make a program set\n", path, list->count);
+    }
+    free(list);
+    return programs;
+}
+
+static void write_address(FILE* f, const UCHAR* ip, int ip6, UCHAR length) {
+    static const UCHAR zero[16] = { 0 };
+    char text[64];
+    ULONG max = ip6 ? 128 : 32;
+    if (length == 0 && memcmp(ip, zero, ip6 ? 16 : 4) == 0) {
+        fputs(" Ignore", f);
+        return;
+    }
+    inet_ntop(ip6 ? AF_INET6 : AF_INET, ip, text, sizeof(text));
+    // A host needs its /32 or /128 only when it is all zeros
+    if (length >= max) { length = (memcmp(ip, zero, ip6 ? 16 : 4) == 0) ? (UCHAR)max : 0; }
+    if (length != 0) { fprintf(f, " %s/%u", text, length); } else { fprintf(f, " %s", text); }
+}
+
+static void write_port(FILE* f, const UCHAR* port, const UCHAR* port_last) {
+    ULONG first = ((ULONG)port[0] << 8) | port[1];
+    ULONG last = ((ULONG)port_last[0] << 8) | port_last[1];
+    if (first == 0 && last == 0) { fputs(" Ignore", f); } else if (last == 0 || last == first) { fprintf(f, " %u", first); } else {
+        fprintf(f, " %u-%u", first, last);
+    }
+}
+
+// In the form parse_rule reads
+static void write_rule(FILE* f, const NET_RULES* rule) {
+    static const UCHAR zero[16] = { 0 };
+    int ip6 = (memcmp(rule->source_ip6, zero, 16) != 0 || memcmp(rule->destination_ip6, zero, 16) != 0);
+    UINT16 ether_type = (UINT16)((rule->ether_type[0] << 8) | rule->ether_type[1]);
+    UCHAR protocol = rule->ip_next_protocol[0];
+
+    fputs(action_name(rule->action), f);
+    switch (ether_type) {
+    case 0x0000: fputs(" Ignore", f); break;
+    case 0x0800: fputs(" IP", f); break;
+    case 0x86DD: fputs(" IPv6", f); break;
+    case 0x0806: fputs(" ARP", f); break;
+    default: fprintf(f, " 0x%04X", ether_type); break;
+    }
+    switch (protocol) {
+    case 0: fputs(" Ignore", f); break;
+    case 1: fputs(" ICMP", f); break;
+    case 2: fputs(" IGMP", f); break;
+    case 6: fputs(" TCP", f); break;
+    case 17: fputs(" UDP", f); break;
+    default: fprintf(f, " %u", protocol); break;
+    }
+    write_address(f, ip6 ? rule->source_ip6 : rule->source_ip, ip6, rule->source_prefix_len[0]);
+    write_address(f, ip6 ? rule->destination_ip6 : rule->destination_ip, ip6, rule->destination_prefix_len[0]);
+    write_port(f, rule->source_port, rule->source_port_last);
+    write_port(f, rule->destination_port, rule->destination_port_last);
+    fputc('\n', f);
+}
+
+// The optimized header rules, then the content rules as they were read
+static int write_rules(const char* path, const char* source, const NET_RULES* rules, ULONG count, const CONTENT_LIST* contents) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) { perror(path); return 0; }
+    fprintf(f, "# %s, optimized by netrulec -o\n", source);
+    for (ULONG i = 0; i < count; i++) { write_rule(f, &rules[i]); }
+    for (ULONG i = 0; i < contents->count; i++) { fprintf(f, "%s\n", contents->lines[i]); }
+    if (fclose(f) != 0) { perror(path); return 0; }
+    return 1;
+}
+
+// "<rule> <count>" per line, as many as the alerts of each rule say; rules
+// not listed count 0
+static ULONG64* read_hits(const char* path, ULONG rule_count) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { perror(path); return NULL; }
+    char line[LINE_MAX_LEN];
+    ULONG number = 0;
+    ULONG64* hits = (ULONG64*)calloc(rule_count + 1, sizeof(ULONG64));
+
+    while (hits != NULL && fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        char* text = line + strspn(line, " \t");
+        if (*text == '#' || *text == '\r' || *text == '\n' || *text == '\0') { continue; }
+        char* end;
+        char* after;
+        unsigned long rule = strtoul(text, &end, 10);
+        unsigned long long count = strtoull(end, &after, 10);
+        if (end == text || after == end || after[strspn(after, " \t\r\n")] != '\0' || rule >= rule_count) {
+            fprintf(stderr, "%s:%u: bad hit count (rules 0 to %u)\n", path, number, rule_count - 1);
+            free(hits);
+            hits = NULL;
+            break;
+        }
+        hits[rule] += count;
+    }
+    fclose(f);
+    return hits;
+}
+
+static int check_image(const char* path) {
+    ULONG length;
+    UCHAR* data = read_file(path, &length);
+    if (data == NULL) { return 1; }
+    const NET_RULE_IMAGE* image = (const NET_RULE_IMAGE*)data;
+    if (!ndisRuleImageValidate(image, length)) {
+        fprintf(stderr, "%s: not a valid version %d rule image\n", path, NET_RULE_IMAGE_VERSION);
+        free(data);
+        return 1;
+    }
+    const NET_CLASSIFIER* cls = ndisRuleImageClassifier(image);
+    const NET_CONTENT* content = ndisRuleImageContent(image);
+    printf("%s: %u rules, %u bytes, classifier %u bytes, %u tuples, %u wide, checksum %08X\n", path,
+        image->rule_count, image->size, image->classifier_size, cls ? cls->tuple_count : 0,
+        cls ? cls->wide_count : 0, image->checksum);
+    if (content != NULL) {
+        printf("%s: %u content rules, %u bytes, %u states, %u byte classes, depth %u%s\n", path,
+            content->rule_count, content->size, content->state_count, content->class_count, content->depth,
+            (content->flags & NET_CONTENT_F_STREAM) ? ", TCP streams" : "");
+    }
+    const NET_REPUTATION* reputation = ndisRuleImageReputation(image);
+    if (reputation != NULL) {
+        printf("%s: reputation set of %u IPv4 and %u IPv6 addresses, %u bytes\n", path,
+            reputation->count4, reputation->count6, reputation->size);
+    }
+    const NET_DOMAINS* domains = ndisRuleImageDomains(image);
+    if (domains != NULL) {
+        printf("%s: domain set of %u domains, %u bytes\n", path, domains->count, domains->size);
+    }
+    const NET_VM_PROGRAMS* programs = ndisRuleImageVmPrograms(image);
+    if (programs != NULL) {
+        printf("%s: %u filter programs, %u instructions, cost %u, %u bytes\n", path,
+            programs->program_count, programs->insn_count, programs->cost, programs->size);
+        for (ULONG i = 0; i < programs->program_count; i++) {
+            const NET_VM_PROGRAM* program = ndisVmProgram(programs, i);
+            printf("%s: program %u: %s, %u instructions, cost %u\n", path, i,
+                action_name(program->action), program->count, program->cost);
+        }
+    }
+    printf("%s: rate limit %u packets/s per source, burst %u%s\n", path,
+        image->rate_limit ? image->rate_limit : NET_RATE_DEFAULT_LIMIT, image->rate_burst ? image->rate_burst : NET_RATE_DEFAULT_BURST,
+        (image->rate_limit == 0 && image->rate_burst == 0) ? " (defaults)" : "");
+    if (image->defer & NET_RULE_DEFER_DEPTH) {
+        printf("%s: payloads inspected by workers, %u NBLs queued per processor, %s when full\n", path,
+            image->defer & NET_RULE_DEFER_DEPTH, (image->defer & NET_RULE_DEFER_CLOSED) ? "dropped" : "passed");
+    }
+    free(data);
+    return 0;
+}
+
+static int usage(void) {
+    fprintf(stderr,
+        "usage: netrulec [-b] [-t] [-d depth] [-l rate[/burst]] [-q queue[/closed]] [-r feed] [-n domains]\n"
+        "                [-p programs] [-h hits] [-o optimized] <rules> <image>\n"
+        "                                                       compile text rules (-b: BUGAV record file;\n"
+        "                                                       -t: match content across TCP segments;\n"
+        "                                                       -d: payload bytes scanned for content, 0 - all;\n"
+        "                                                       -l: packets per second per source under RateLimit;\n"
+        "                                                       -q: inspect payloads off the receive path, queueing\n"
+        "                                                           up to queue NBLs per processor; beyond that pass\n"
+        "                                                           them, or drop them with /closed;\n"
+        "                                                       -r: add the addresses of a feed as a reputation set;\n"
+        "                                                       -n: add a list of domains to block as a domain set;\n"
+        "                                                       -p: add the filter programs of an assembly file;\n"
+        "                                                       -o: optimize the rules and write them as text;\n"
+        "                                                       -h: hit counts per rule to order them by)\n"
+        "       netrulec -c <image>                             check an image\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    int records = 0;
+    int streams = 0;
+    ULONG depth = 0;
+    ULONG rate_limit = 0, rate_burst = 0;
+    ULONG defer = 0;
+    const char* feed = NULL;
+    const char* domain_list = NULL;
+    const char* program_file = NULL;
+    const char* hit_file = NULL;
+    const char* optimized_file = NULL;
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) { return check_image(argv[2]); }
+    if (argc >= 4 && strcmp(argv[1], "-b") == 0) { records = 1; argv++; argc--; }
+    if (argc >= 4 && strcmp(argv[1], "-t") == 0) { streams = 1; argv++; argc--; }
+    if (argc >= 5 && strcmp(argv[1], "-d") == 0) {
+        char* end;
+        depth = (ULONG)strtoul(argv[2], &end, 0);
+        if (*end != '\0') { return usage(); }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc >= 5 && strcmp(argv[1], "-l") == 0) {
+        char* end;
+        rate_limit = (ULONG)strtoul(argv[2], &end, 0);
+        if (*end == '/') { rate_burst = (ULONG)strtoul(end + 1, &end, 0); }
+        // Beyond 10 Mpps a token would cost less than the 100 ns clock tick
+        if (*end != '\0' || rate_limit == 0 || rate_limit > 10000000) { return usage(); }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc >= 5 && strcmp(argv[1], "-q") == 0) {
+        char* end;
+        defer = (ULONG)strtoul(argv[2], &end, 0);
+        if (strcmp(end, "/closed") == 0) {
+            defer |= NET_RULE_DEFER_CLOSED;
+        } else if (*end != '\0') {
+            return usage();
+        }
+        if ((defer & NET_RULE_DEFER_DEPTH) == 0 || (defer & ~(NET_RULE_DEFER_DEPTH | NET_RULE_DEFER_CLOSED)) != 0) { return usage(); }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc >= 5 && strcmp(argv[1], "-r") == 0) {
+        feed = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc >= 5 && strcmp(argv[1], "-n") == 0) {
+        domain_list = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc >= 5 && strcmp(argv[1], "-p") == 0) {
+        program_file = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc >= 5 && strcmp(argv[1], "-h") == 0) {
+        hit_file = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc >= 5 && strcmp(argv[1], "-o") == 0) {
+        optimized_file = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 3 || (hit_file != NULL && optimized_file == NULL)) { return usage(); }
+
+    ULONG rule_count = 0;
+    CONTENT_LIST contents;
+    memset(&contents, 0, sizeof(contents));
+    PNET_RULES rules = records ? read_record_rules(argv[1], &rule_count) : read_text_rules(argv[1], &rule_count, &contents);
+    if (rules == NULL) { return 1; }
+    if (optimized_file != NULL) {
+        ULONG64* hits = NULL;
+        if (hit_file != NULL && (hits = read_hits(hit_file, rule_count)) == NULL) { return 1; }
+        RULE_OPT_STAT stat;
+        ULONG before = rule_count;
+        rule_count = rule_optimize(rules, rule_count, hits, NULL, &stat);
+        free(hits);
+        if (!write_rules(optimized_file, argv[1], rules, rule_count, &contents)) { return 1; }
+        printf("%s: %u of %u rules left: %u dead, %u shadowed, %u redundant, %u merged; %u moved ahead\n", optimized_file,
+            rule_count, before, stat.dead, stat.shadowed, stat.redundant, stat.merged, stat.moved);
+    }
+    for (ULONG i = 0; i < rule_count; i++) {
+        rules[i]._next = (i + 1 < rule_count) ? &rules[i + 1] : NULL;
+        rules[i]._prev = (i > 0) ? &rules[i - 1] : NULL;
+    }
+
+    PNET_CLASSIFIER cls = (rule_count != 0) ? ndisCompileNetRules(rules) : NULL;
+    PNET_CONTENT content = (contents.count != 0) ? ndisCompileContent(contents.rules, contents.count, contents.patterns, depth) : NULL;
+    PNET_REPUTATION reputation = NULL;
+    if (feed != NULL && (reputation = read_feed(feed)) == NULL) { return 1; }
+    PNET_DOMAINS domains = NULL;
+    if (domain_list != NULL && (domains = read_domains(domain_list)) == NULL) { return 1; }
+    PNET_VM_PROGRAMS programs = NULL;
+    if (program_file != NULL && (programs = read_programs(program_file)) == NULL) { return 1; }
+    ULONG size = ndisRuleImageSize(rule_count, cls, content, reputation, domains, programs);
+    if ((rule_count != 0 && cls == NULL) || (contents.count != 0 && content == NULL) || size == 0) {
+        fprintf(stderr, "%s: %u rules, %u content rules, the reputation and domain sets and the programs do not fit in a rule image\n", argv[1],
+            rule_count, contents.count);
+        return 1;
+    }
+    if (content != NULL && streams) { content->flags |= NET_CONTENT_F_STREAM; }
+    PNET_RULE_IMAGE image = (PNET_RULE_IMAGE)malloc(size);
+    if (image == NULL) { return 1; }
+    ndisRuleImageWrite(image, size, rule_count != 0 ? rules : NULL, cls, content, reputation, domains, programs, rate_limit, rate_burst, defer);
+
+    FILE* f = fopen(argv[2], "wb");
+    if (f == NULL || fwrite(image, 1, size, f) != size || fclose(f) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("%s: %u rules, %u bytes, %u tuples, %u wide\n", argv[2], rule_count, size,
+        cls ? cls->tuple_count : 0, cls ? cls->wide_count : 0);
+    if (content != NULL) {
+        printf("%s: %u content rules, %u states, %u byte classes%s\n", argv[2], content->rule_count,
+            content->state_count, content->class_count, streams ? ", TCP streams" : "");
+    }
+    if (reputation != NULL) {
+        printf("%s: reputation set of %u IPv4 and %u IPv6 addresses, %u bytes, %.2f bytes per address\n", argv[2],
+            reputation->count4, reputation->count6, reputation->size,
+            (double)reputation->size / (reputation->count4 + reputation->count6 + (reputation->count4 + reputation->count6 == 0)));
+    }
+
+    if (domains != NULL) {
+        printf("%s: domain set of %u domains, %u bytes\n", argv[2], domains->count, domains->size);
+    }
+    if (programs != NULL) {
+        printf("%s: %u filter programs, %u instructions, cost %u\n", argv[2], programs->program_count,
+            programs->insn_count, programs->cost);
+    }
+
+    ndisFreeVmPrograms(programs);
+    ndisFreeDomains(domains);
+    ndisFreeReputation(reputation);
+    ndisFreeContent(content);
+    ndisFreeNetClassifier(cls);
+    for (ULONG i = 0; i < contents.count; i++) { free(contents.lines[i]); }
+    free(contents.lines);
+    free(contents.rules);
+    free(contents.patterns);
+    free(image);
+    free(rules);
+    return 0;
+}
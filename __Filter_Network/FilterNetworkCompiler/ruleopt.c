@@ -0,0 +1,582 @@
+//
+// Rule set optimizer, see ruleopt.h. User mode only: built into netrulec
+// and bench_ruleopt.
+//
+
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "ruleopt.h"
+
+// Fields a rule tests, read as the classifier reads them (clsRuleFromNet)
+#define OPT_F_ETHER_TYPE        0x01
+#define OPT_F_PROTOCOL          0x02
+#define OPT_F_SOURCE_IP         0x04        // IPv4 prefix, /32 for a host
+#define OPT_F_DESTINATION_IP    0x08
+#define OPT_F_SOURCE_IP6        0x10        // IPv6 prefix, /128 for a host
+#define OPT_F_DESTINATION_IP6   0x20
+#define OPT_F_SOURCE_PORT       0x40        // range, first == last for one port
+#define OPT_F_DESTINATION_PORT  0x80
+#define OPT_F_IP4               (OPT_F_SOURCE_IP | OPT_F_DESTINATION_IP)
+#define OPT_F_IP6               (OPT_F_SOURCE_IP6 | OPT_F_DESTINATION_IP6)
+#define OPT_F_PORTS             (OPT_F_SOURCE_PORT | OPT_F_DESTINATION_PORT)
+
+// Dimensions a merge can widen: source and destination address, then ports
+#define OPT_DIM_SOURCE_PORT     2
+#define OPT_DIMS                4
+#define OPT_NONE                OPT_DIMS
+#define OPT_NO_RULE             0xFFFFFFFF
+#define OPT_MERGE_WINDOW        65536       // rules apart at most, so that checking a merge stays cheap
+
+typedef struct _OPT_RULE {
+    ULONG   fields;                 // OPT_F_*
+    UCHAR   action;
+    UCHAR   protocol;
+    UINT16  ether_type;
+    UINT64  hi[2];                  // addresses, source and destination; IPv4 in the top bits of hi
+    UINT64  lo[2];
+    UCHAR   length[2];              // prefix lengths
+    UINT16  first[2];               // port ranges, source and destination
+    UINT16  last[2];
+    ULONG   origin;
+    ULONG64 hits;
+    BOOLEAN live;
+} OPT_RULE;
+
+// A merge candidate: the rule's fields but one hashed, that one as a sort key
+typedef struct _OPT_SORT {
+    UINT64  rest;
+    ULONG   length;
+    UINT64  hi;
+    UINT64  lo;
+    ULONG   index;
+} OPT_SORT;
+
+// Earlier (or later) rules by what a rule covering r must look like, so
+// that finding a cover costs a probe per distinct shape instead of a pass
+// over the rules
+typedef struct _OPT_SHAPE {
+    ULONG   fields;
+    UCHAR   length[2];              // prefix lengths
+    BOOLEAN exact[2];               // one port, its value part of the key
+} OPT_SHAPE;
+
+typedef struct _OPT_INDEX {
+    OPT_SHAPE*  shapes;
+    ULONG       shape_count;
+    PULONG      heads;              // by key hash, chained through next
+    PULONG      next;               // by rule
+    ULONG       mask;
+    BOOLEAN     by_action;          // a cover needs the same action
+} OPT_INDEX;
+
+static const ULONG optAddressFields[2] = { OPT_F_SOURCE_IP | OPT_F_SOURCE_IP6, OPT_F_DESTINATION_IP | OPT_F_DESTINATION_IP6 };
+static const ULONG optPortFields[2] = { OPT_F_SOURCE_PORT, OPT_F_DESTINATION_PORT };
+
+static BOOLEAN optIsZero(const UCHAR* data, ULONG length) {
+    for (ULONG i = 0; i < length; i++) {
+        if (data[i] != 0) { return FALSE; }
+    }
+    return TRUE;
+}
+
+static UINT64 optMaskHi(ULONG length) {
+    return (length == 0) ? 0 : (length >= 64) ? ~0ULL : ~0ULL << (64 - length);
+}
+
+static UINT64 optMaskLo(ULONG length) {
+    return (length <= 64) ? 0 : (length >= 128) ? ~0ULL : ~0ULL << (128 - length);
+}
+
+// Only these protocols give a frame port fields (ndisFrameToKey)
+static BOOLEAN optHasPorts(UCHAR protocol) {
+    return (BOOLEAN)(protocol == 6 || protocol == 17 || protocol == 132);
+}
+
+static VOID optIpField(const UCHAR* ip, UCHAR length, ULONG field, OPT_RULE* r, ULONG dim) {
+    UINT32 address = ((UINT32)ip[0] << 24) | ((UINT32)ip[1] << 16) | ((UINT32)ip[2] << 8) | ip[3];
+    if (length >= 1 && length <= 31) {
+        r->hi[dim] = (UINT64)(address & (0xFFFFFFFFu << (32 - length))) << 32;
+        r->length[dim] = length;
+    } else if (address != 0 || length != 0) {
+        r->hi[dim] = (UINT64)address << 32;
+        r->length[dim] = 32;
+    } else {
+        return;
+    }
+    r->fields |= field;
+}
+
+static VOID optIp6Field(const UCHAR* ip, UCHAR length, ULONG field, OPT_RULE* r, ULONG dim) {
+    if (length == 0 && optIsZero(ip, 16)) { return; }
+    if (length == 0 || length > 128) { length = 128; }
+    UINT64 hi = 0, lo = 0;
+    for (ULONG i = 0; i < 8; i++) { hi = (hi << 8) | ip[i]; lo = (lo << 8) | ip[8 + i]; }
+    r->hi[dim] = hi & optMaskHi(length);
+    r->lo[dim] = lo & optMaskLo(length);
+    r->length[dim] = length;
+    r->fields |= field;
+}
+
+static VOID optPortField(const UCHAR* port, const UCHAR* port_last, ULONG field, OPT_RULE* r, ULONG dim) {
+    UINT16 first = (UINT16)((port[0] << 8) | port[1]);
+    UINT16 last = (UINT16)((port_last[0] << 8) | port_last[1]);
+    if (last == 0) {
+        if (first == 0) { return; }
+        last = first;
+    }
+    if (first > last) { UINT16 t = first; first = last; last = t; }
+    if (first == 0 && last == 0xFFFF) { return; }
+    r->first[dim] = first;
+    r->last[dim] = last;
+    r->fields |= field;
+}
+
+static VOID optDecode(const NET_RULES* rule, OPT_RULE* r) {
+    RtlZeroMemory(r, sizeof(OPT_RULE));
+    r->action = rule->action;
+    r->ether_type = (UINT16)((rule->ether_type[0] << 8) | rule->ether_type[1]);
+    r->protocol = rule->ip_next_protocol[0];
+    if (r->ether_type != 0) { r->fields |= OPT_F_ETHER_TYPE; }
+    if (r->protocol != 0) { r->fields |= OPT_F_PROTOCOL; }
+    if (!optIsZero(rule->source_ip6, 16) || !optIsZero(rule->destination_ip6, 16)) {
+        optIp6Field(rule->source_ip6, rule->source_prefix_len[0], OPT_F_SOURCE_IP6, r, 0);
+        optIp6Field(rule->destination_ip6, rule->destination_prefix_len[0], OPT_F_DESTINATION_IP6, r, 1);
+    } else {
+        optIpField(rule->source_ip, rule->source_prefix_len[0], OPT_F_SOURCE_IP, r, 0);
+        optIpField(rule->destination_ip, rule->destination_prefix_len[0], OPT_F_DESTINATION_IP, r, 1);
+    }
+    optPortField(rule->source_port, rule->source_port_last, OPT_F_SOURCE_PORT, r, 0);
+    optPortField(rule->destination_port, rule->destination_port_last, OPT_F_DESTINATION_PORT, r, 1);
+    r->live = TRUE;
+}
+
+static VOID optEncode(const OPT_RULE* r, PNET_RULES rule) {
+    PNET_RULES next = rule->_next, prev = rule->_prev;
+    RtlZeroMemory(rule, sizeof(NET_RULES));
+    rule->_next = next;
+    rule->_prev = prev;
+    rule->action = r->action;
+    rule->ether_type[0] = (UCHAR)(r->ether_type >> 8);
+    rule->ether_type[1] = (UCHAR)r->ether_type;
+    rule->ip_next_protocol[0] = r->protocol;
+
+    UCHAR* ip4[2] = { rule->source_ip, rule->destination_ip };
+    UCHAR* ip6[2] = { rule->source_ip6, rule->destination_ip6 };
+    UCHAR* length[2] = { rule->source_prefix_len, rule->destination_prefix_len };
+    UCHAR* port[2] = { rule->source_port, rule->destination_port };
+    UCHAR* port_last[2] = { rule->source_port_last, rule->destination_port_last };
+    for (ULONG dim = 0; dim < 2; dim++) {
+        if (r->fields & optAddressFields[dim] & OPT_F_IP4) {
+            for (ULONG i = 0; i < 4; i++) { ip4[dim][i] = (UCHAR)(r->hi[dim] >> (56 - 8 * i)); }
+            length[dim][0] = r->length[dim];
+        } else if (r->fields & optAddressFields[dim] & OPT_F_IP6) {
+            for (ULONG i = 0; i < 8; i++) {
+                ip6[dim][i] = (UCHAR)(r->hi[dim] >> (56 - 8 * i));
+                ip6[dim][8 + i] = (UCHAR)(r->lo[dim] >> (56 - 8 * i));
+            }
+            length[dim][0] = r->length[dim];
+        }
+        if (r->fields & optPortFields[dim]) {
+            port[dim][0] = (UCHAR)(r->first[dim] >> 8);
+            port[dim][1] = (UCHAR)r->first[dim];
+            if (r->last[dim] != r->first[dim]) {
+                port_last[dim][0] = (UCHAR)(r->last[dim] >> 8);
+                port_last[dim][1] = (UCHAR)r->last[dim];
+            }
+        }
+    }
+}
+
+// The ether type every frame a rule matches has, 0 - any
+static UINT16 optEtherType(const OPT_RULE* r) {
+    if (r->fields & OPT_F_ETHER_TYPE) { return r->ether_type; }
+    if (r->fields & OPT_F_IP4) { return 0x0800; }
+    if (r->fields & OPT_F_IP6) { return 0x86DD; }
+    return 0;
+}
+
+static BOOLEAN optDead(const OPT_RULE* r) {
+    if (r->fields & OPT_F_ETHER_TYPE) {
+        if ((r->fields & OPT_F_IP4) && r->ether_type != 0x0800) { return TRUE; }
+        if ((r->fields & OPT_F_IP6) && r->ether_type != 0x86DD) { return TRUE; }
+        if ((r->fields & (OPT_F_PROTOCOL | OPT_F_PORTS)) && r->ether_type != 0x0800 && r->ether_type != 0x86DD) { return TRUE; }
+    }
+    return (BOOLEAN)((r->fields & OPT_F_PORTS) && (r->fields & OPT_F_PROTOCOL) && !optHasPorts(r->protocol));
+}
+
+// Prefix a[dim] inside prefix b[dim]
+static BOOLEAN optPrefixIn(const OPT_RULE* a, const OPT_RULE* b, ULONG dim) {
+    ULONG length = b->length[dim];
+    return (BOOLEAN)(a->length[dim] >= length && ((a->hi[dim] ^ b->hi[dim]) & optMaskHi(length)) == 0 &&
+        ((a->lo[dim] ^ b->lo[dim]) & optMaskLo(length)) == 0);
+}
+
+static BOOLEAN optPrefixOverlap(const OPT_RULE* a, const OPT_RULE* b, ULONG dim) {
+    ULONG length = (a->length[dim] < b->length[dim]) ? a->length[dim] : b->length[dim];
+    return (BOOLEAN)(((a->hi[dim] ^ b->hi[dim]) & optMaskHi(length)) == 0 && ((a->lo[dim] ^ b->lo[dim]) & optMaskLo(length)) == 0);
+}
+
+// Every frame a matches, b matches too
+static BOOLEAN optCovers(const OPT_RULE* b, const OPT_RULE* a) {
+    ULONG needed = b->fields & ~OPT_F_ETHER_TYPE;
+    if ((a->fields & needed) != needed) { return FALSE; }
+    if ((b->fields & OPT_F_ETHER_TYPE) && optEtherType(a) != b->ether_type) { return FALSE; }
+    if ((b->fields & OPT_F_PROTOCOL) && a->protocol != b->protocol) { return FALSE; }
+    for (ULONG dim = 0; dim < 2; dim++) {
+        if ((b->fields & optAddressFields[dim]) && !optPrefixIn(a, b, dim)) { return FALSE; }
+        if ((b->fields & optPortFields[dim]) && (a->first[dim] < b->first[dim] || a->last[dim] > b->last[dim])) { return FALSE; }
+    }
+    return TRUE;
+}
+
+// Some frame could match both
+static BOOLEAN optOverlap(const OPT_RULE* a, const OPT_RULE* b) {
+    UINT16 ether_a = optEtherType(a), ether_b = optEtherType(b);
+    if (ether_a != 0 && ether_b != 0 && ether_a != ether_b) { return FALSE; }
+    if ((a->fields & b->fields & OPT_F_PROTOCOL) && a->protocol != b->protocol) { return FALSE; }
+    if ((a->fields & OPT_F_PORTS) && (b->fields & OPT_F_PROTOCOL) && !optHasPorts(b->protocol)) { return FALSE; }
+    if ((b->fields & OPT_F_PORTS) && (a->fields & OPT_F_PROTOCOL) && !optHasPorts(a->protocol)) { return FALSE; }
+    for (ULONG dim = 0; dim < 2; dim++) {
+        ULONG field_a = a->fields & optAddressFields[dim], field_b = b->fields & optAddressFields[dim];
+        if (field_a != 0 && field_b != 0 && (field_a != field_b || !optPrefixOverlap(a, b, dim))) { return FALSE; }
+        if ((a->fields & b->fields & optPortFields[dim]) && (a->first[dim] > b->last[dim] || b->first[dim] > a->last[dim])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static BOOLEAN optDimEqual(const OPT_RULE* a, const OPT_RULE* b, ULONG dim) {
+    if (dim < OPT_DIM_SOURCE_PORT) {
+        if (!(a->fields & optAddressFields[dim])) { return TRUE; }
+        return (BOOLEAN)(a->hi[dim] == b->hi[dim] && a->lo[dim] == b->lo[dim] && a->length[dim] == b->length[dim]);
+    }
+    dim -= OPT_DIM_SOURCE_PORT;
+    return (BOOLEAN)(!(a->fields & optPortFields[dim]) || (a->first[dim] == b->first[dim] && a->last[dim] == b->last[dim]));
+}
+
+// Same action and fields, same values in every dimension but skip
+static BOOLEAN optEqualExcept(const OPT_RULE* a, const OPT_RULE* b, ULONG skip) {
+    if (a->fields != b->fields || a->action != b->action || a->ether_type != b->ether_type || a->protocol != b->protocol) {
+        return FALSE;
+    }
+    for (ULONG dim = 0; dim < OPT_DIMS; dim++) {
+        if (dim != skip && !optDimEqual(a, b, dim)) { return FALSE; }
+    }
+    return TRUE;
+}
+
+// No rule between after and before with another action than rule's could
+// match one of its frames
+static BOOLEAN optClearBetween(const OPT_RULE* r, const OPT_RULE* rule, ULONG after, ULONG before) {
+    for (ULONG k = after + 1; k < before; k++) {
+        if (r[k].live && r[k].action != rule->action && optOverlap(&r[k], rule)) { return FALSE; }
+    }
+    return TRUE;
+}
+
+// m = a with dimension dim widened to the union of a's and b's values, when
+// that union is one prefix (siblings) or one range (overlapping or
+// adjacent) that a rule can say
+static BOOLEAN optUnion(const OPT_RULE* a, const OPT_RULE* b, ULONG dim, OPT_RULE* m) {
+    *m = *a;
+    if (dim < OPT_DIM_SOURCE_PORT) {
+        ULONG length = a->length[dim];
+        if (length != b->length[dim] || length < 2) { return FALSE; }
+        if (a->hi[dim] == b->hi[dim] && a->lo[dim] == b->lo[dim]) { return FALSE; }
+        if (((a->hi[dim] ^ b->hi[dim]) & optMaskHi(length - 1)) != 0 || ((a->lo[dim] ^ b->lo[dim]) & optMaskLo(length - 1)) != 0) {
+            return FALSE;
+        }
+        m->length[dim] = (UCHAR)(length - 1);
+        m->hi[dim] &= optMaskHi(length - 1);
+        m->lo[dim] &= optMaskLo(length - 1);
+    } else {
+        ULONG d = dim - OPT_DIM_SOURCE_PORT;
+        if ((ULONG)a->first[d] > (ULONG)b->last[d] + 1 || (ULONG)b->first[d] > (ULONG)a->last[d] + 1) { return FALSE; }
+        m->first[d] = (a->first[d] < b->first[d]) ? a->first[d] : b->first[d];
+        m->last[d] = (a->last[d] > b->last[d]) ? a->last[d] : b->last[d];
+        // Port 0 only reads as the start of a range, and 0-65535 as no port field
+        if (m->first[d] == 0) { return FALSE; }
+    }
+
+    // What the driver will read back: an IPv6 rule whose addresses are all 0
+    // would turn into an IPv4 one
+    NET_RULES rule;
+    OPT_RULE check;
+    RtlZeroMemory(&rule, sizeof(rule));
+    optEncode(m, &rule);
+    optDecode(&rule, &check);
+    return optEqualExcept(&check, m, OPT_NONE);
+}
+
+static int optCompareSort(const void* x, const void* y) {
+    const OPT_SORT* a = (const OPT_SORT*)x;
+    const OPT_SORT* b = (const OPT_SORT*)y;
+    if (a->rest != b->rest) { return (a->rest < b->rest) ? -1 : 1; }
+    if (a->length != b->length) { return (a->length < b->length) ? -1 : 1; }
+    if (a->hi != b->hi) { return (a->hi < b->hi) ? -1 : 1; }
+    if (a->lo != b->lo) { return (a->lo < b->lo) ? -1 : 1; }
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+static UINT64 optMix(UINT64 h, UINT64 v) {
+    h ^= v + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h * 0xD6E8FEB86659FD93ULL;
+}
+
+static UINT64 optRestHash(const OPT_RULE* r, ULONG skip) {
+    UINT64 h = optMix(optMix(r->fields, r->action), ((UINT64)r->ether_type << 8) | r->protocol);
+    for (ULONG dim = 0; dim < 2; dim++) {
+        if (dim != skip) { h = optMix(optMix(optMix(h, r->hi[dim]), r->lo[dim]), r->length[dim]); }
+        if (dim + OPT_DIM_SOURCE_PORT != skip) { h = optMix(h, ((UINT64)r->first[dim] << 16) | r->last[dim]); }
+    }
+    return h;
+}
+
+static VOID optKill(OPT_RULE* r, PULONG counter) {
+    r->live = FALSE;
+    (*counter)++;
+}
+
+static BOOLEAN optIndexInit(OPT_INDEX* index, ULONG count) {
+    ULONG slots = 2;
+    while (slots < 2 * count) { slots *= 2; }
+    index->shapes = (OPT_SHAPE*)malloc((count + 1) * sizeof(OPT_SHAPE));
+    index->heads = (PULONG)malloc(slots * sizeof(ULONG));
+    index->next = (PULONG)malloc((count + 1) * sizeof(ULONG));
+    index->mask = slots - 1;
+    return (BOOLEAN)(index->shapes != NULL && index->heads != NULL && index->next != NULL);
+}
+
+static VOID optIndexFree(OPT_INDEX* index) {
+    free(index->shapes);
+    free(index->heads);
+    free(index->next);
+}
+
+static VOID optIndexReset(OPT_INDEX* index, BOOLEAN by_action) {
+    memset(index->heads, 0xFF, (index->mask + 1) * sizeof(ULONG));
+    index->shape_count = 0;
+    index->by_action = by_action;
+}
+
+static VOID optShapeOf(const OPT_RULE* r, OPT_SHAPE* shape) {
+    RtlZeroMemory(shape, sizeof(OPT_SHAPE));
+    shape->fields = r->fields;
+    for (ULONG dim = 0; dim < 2; dim++) {
+        shape->length[dim] = (r->fields & optAddressFields[dim]) ? r->length[dim] : 0;
+        shape->exact[dim] = (BOOLEAN)((r->fields & optPortFields[dim]) && r->first[dim] == r->last[dim]);
+    }
+}
+
+// The key under which a rule of this shape covering r would be found, FALSE
+// when no rule of this shape can cover r
+static BOOLEAN optShapeKey(const OPT_INDEX* index, const OPT_SHAPE* shape, const OPT_RULE* r, PULONG slot) {
+    ULONG needed = shape->fields & ~OPT_F_ETHER_TYPE;
+    if ((r->fields & needed) != needed) { return FALSE; }
+    UINT64 h = optMix(shape->fields, index->by_action ? r->action : 0);
+    if (shape->fields & OPT_F_ETHER_TYPE) {
+        if (optEtherType(r) == 0) { return FALSE; }
+        h = optMix(h, optEtherType(r));
+    }
+    if (shape->fields & OPT_F_PROTOCOL) { h = optMix(h, r->protocol); }
+    for (ULONG dim = 0; dim < 2; dim++) {
+        if (shape->fields & optAddressFields[dim]) {
+            ULONG length = shape->length[dim];
+            if (r->length[dim] < length) { return FALSE; }
+            h = optMix(optMix(optMix(h, r->hi[dim] & optMaskHi(length)), r->lo[dim] & optMaskLo(length)), length);
+        }
+        if (shape->exact[dim]) {
+            if (r->first[dim] != r->last[dim]) { return FALSE; }
+            h = optMix(h, r->first[dim]);
+        }
+    }
+    *slot = (ULONG)(h >> 32) & index->mask;
+    return TRUE;
+}
+
+static VOID optIndexAdd(OPT_INDEX* index, const OPT_RULE* r, ULONG id) {
+    OPT_SHAPE shape;
+    ULONG s, slot;
+    optShapeOf(&r[id], &shape);
+    for (s = 0; s < index->shape_count && memcmp(&index->shapes[s], &shape, sizeof(OPT_SHAPE)) != 0; s++) { }
+    if (s == index->shape_count) { index->shapes[index->shape_count++] = shape; }
+    optShapeKey(index, &shape, &r[id], &slot);
+    index->next[id] = index->heads[slot];
+    index->heads[slot] = id;
+}
+
+// The lowest indexed rule covering rule, OPT_NO_RULE if none
+static ULONG optIndexFind(const OPT_INDEX* index, const OPT_RULE* r, const OPT_RULE* rule) {
+    ULONG found = OPT_NO_RULE;
+    for (ULONG s = 0; s < index->shape_count; s++) {
+        ULONG slot;
+        if (!optShapeKey(index, &index->shapes[s], rule, &slot)) { continue; }
+        for (ULONG id = index->heads[slot]; id != OPT_NO_RULE; id = index->next[id]) {
+            if (id < found && (!index->by_action || r[id].action == rule->action) && optCovers(&r[id], rule)) { found = id; }
+        }
+    }
+    return found;
+}
+
+// First to last, each rule looked up among the earlier rules that stay
+static BOOLEAN optShadowed(OPT_RULE* r, ULONG count, OPT_INDEX* index, PRULE_OPT_STAT stat) {
+    BOOLEAN changed = FALSE;
+    optIndexReset(index, FALSE);
+    for (ULONG j = 0; j < count; j++) {
+        if (!r[j].live) { continue; }
+        ULONG i = optIndexFind(index, r, &r[j]);
+        if (i == OPT_NO_RULE) {
+            optIndexAdd(index, r, j);
+            continue;
+        }
+        r[i].hits += r[j].hits;
+        optKill(&r[j], &stat->shadowed);
+        changed = TRUE;
+    }
+    return changed;
+}
+
+// Last to first, each rule looked up among the later rules that stay with
+// the same action: the nearest one covering it will do if any will
+static BOOLEAN optRedundant(OPT_RULE* r, ULONG count, OPT_INDEX* index, PRULE_OPT_STAT stat) {
+    BOOLEAN changed = FALSE;
+    optIndexReset(index, TRUE);
+    for (ULONG i = count; i-- > 0;) {
+        if (!r[i].live) { continue; }
+        ULONG j = optIndexFind(index, r, &r[i]);
+        if (j == OPT_NO_RULE || !optClearBetween(r, &r[i], i, j)) {
+            optIndexAdd(index, r, i);
+            continue;
+        }
+        r[j].hits += r[i].hits;
+        optKill(&r[i], &stat->redundant);
+        changed = TRUE;
+    }
+    return changed;
+}
+
+// One round over every dimension: candidates are sorted by the rest of
+// their fields, then by value, so that sibling prefixes (same length) and
+// ranges that touch end up next to each other
+static BOOLEAN optMerge(OPT_RULE* r, ULONG count, OPT_SORT* sort, PRULE_OPT_STAT stat) {
+    BOOLEAN changed = FALSE;
+    for (ULONG dim = 0; dim < OPT_DIMS; dim++) {
+        ULONG field = (dim < OPT_DIM_SOURCE_PORT) ? optAddressFields[dim] : optPortFields[dim - OPT_DIM_SOURCE_PORT];
+        ULONG n = 0;
+        for (ULONG i = 0; i < count; i++) {
+            if (!r[i].live || !(r[i].fields & field)) { continue; }
+            sort[n].rest = optRestHash(&r[i], dim);
+            if (dim < OPT_DIM_SOURCE_PORT) {
+                sort[n].length = r[i].length[dim];
+                sort[n].hi = r[i].hi[dim];
+                sort[n].lo = r[i].lo[dim];
+            } else {
+                sort[n].length = 0;
+                sort[n].hi = r[i].first[dim - OPT_DIM_SOURCE_PORT];
+                sort[n].lo = r[i].last[dim - OPT_DIM_SOURCE_PORT];
+            }
+            sort[n].index = i;
+            n++;
+        }
+        qsort(sort, n, sizeof(OPT_SORT), optCompareSort);
+
+        ULONG held = OPT_NO_RULE;
+        for (ULONG s = 0; s < n; s++) {
+            ULONG next = sort[s].index;
+            OPT_RULE merged;
+            if (held == OPT_NO_RULE || sort[s].rest != sort[s - 1].rest || !optEqualExcept(&r[held], &r[next], dim) ||
+                !optUnion(&r[held], &r[next], dim, &merged)) {
+                held = next;
+                continue;
+            }
+            ULONG early = (held < next) ? held : next;
+            ULONG late = (held < next) ? next : held;
+            if (late - early > OPT_MERGE_WINDOW || !optClearBetween(r, &r[late], early, late)) {
+                held = next;
+                continue;
+            }
+            merged.origin = (r[early].origin < r[late].origin) ? r[early].origin : r[late].origin;
+            merged.hits = r[early].hits + r[late].hits;
+            r[early] = merged;
+            optKill(&r[late], &stat->merged);
+            held = early;
+            changed = TRUE;
+        }
+    }
+    return changed;
+}
+
+// Hottest rule first: each moves up past colder rules it cannot disagree
+// with, and stops at the first one it could or that is at least as hot
+static VOID optReorder(const OPT_RULE* r, PULONG order, ULONG count, OPT_SORT* sort, PRULE_OPT_STAT stat) {
+    ULONG hot = 0;
+    for (ULONG k = 0; k < count; k++) {
+        if (r[order[k]].hits == 0) { continue; }
+        RtlZeroMemory(&sort[hot], sizeof(OPT_SORT));
+        sort[hot].rest = ~r[order[k]].hits;         // hits down, then rule order
+        sort[hot].index = order[k];
+        hot++;
+    }
+    qsort(sort, hot, sizeof(OPT_SORT), optCompareSort);
+
+    for (ULONG h = 0; h < hot; h++) {
+        ULONG id = sort[h].index, at = 0, to;
+        while (order[at] != id) { at++; }
+        for (to = at; to > 0; to--) {
+            const OPT_RULE* ahead = &r[order[to - 1]];
+            if (ahead->hits >= r[id].hits || (ahead->action != r[id].action && optOverlap(ahead, &r[id]))) { break; }
+        }
+        if (to == at) { continue; }
+        memmove(&order[to + 1], &order[to], (at - to) * sizeof(ULONG));
+        order[to] = id;
+        stat->moved++;
+    }
+}
+
+ULONG rule_optimize(PNET_RULES rules, ULONG count, const ULONG64* hits, PULONG origin, PRULE_OPT_STAT stat) {
+    RtlZeroMemory(stat, sizeof(RULE_OPT_STAT));
+    OPT_RULE* r = (OPT_RULE*)malloc((count + 1) * sizeof(OPT_RULE));
+    OPT_SORT* sort = (OPT_SORT*)malloc((count + 1) * sizeof(OPT_SORT));
+    PULONG order = (PULONG)malloc((count + 1) * sizeof(ULONG));
+    OPT_INDEX index;
+    ULONG left = count;
+    BOOLEAN indexed = optIndexInit(&index, count);
+    if (r == NULL || sort == NULL || order == NULL || !indexed) {
+        // Out of memory: the rules stay as they are
+        for (ULONG i = 0; origin != NULL && i < count; i++) { origin[i] = i; }
+        goto cleanup;
+    }
+
+    for (ULONG i = 0; i < count; i++) {
+        optDecode(&rules[i], &r[i]);
+        r[i].origin = i;
+        r[i].hits = (hits != NULL) ? hits[i] : 0;
+        if (optDead(&r[i])) { optKill(&r[i], &stat->dead); }
+    }
+    // A merge can leave a rule covering others, and dropping rules can
+    // leave neighbours to merge
+    for (BOOLEAN changed = TRUE; changed;) {
+        changed = optShadowed(r, count, &index, stat);
+        changed |= optRedundant(r, count, &index, stat);
+        while (optMerge(r, count, sort, stat)) { changed = TRUE; }
+    }
+
+    left = 0;
+    for (ULONG i = 0; i < count; i++) {
+        if (r[i].live) { order[left++] = i; }
+    }
+    if (hits != NULL) { optReorder(r, order, left, sort, stat); }
+    for (ULONG k = 0; k < left; k++) {
+        optEncode(&r[order[k]], &rules[k]);
+        if (origin != NULL) { origin[k] = r[order[k]].origin; }
+    }
+
+cleanup:
+    optIndexFree(&index);
+    free(order);
+    free(sort);
+    free(r);
+    return left;
+}
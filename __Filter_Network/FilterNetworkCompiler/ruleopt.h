@@ -0,0 +1,48 @@
+#pragma once
+//
+// Rule set optimizer for netrulec (-o).
+//
+// The first rule a frame matches decides its action, so the order of the
+// header rules is part of their meaning and everything the optimizer does
+// keeps, for every frame, the action of the first rule it matches (or that
+// none does). Only the rule index in alerts changes. It reads the rules the
+// way the classifier does (0 - ignore, prefix lengths, ranges) and
+//
+//   - drops rules no frame can match (an ARP ether type with an address,
+//     ports with a protocol that has none);
+//   - drops shadowed rules: those every frame of which an earlier rule
+//     matches first;
+//   - drops redundant rules: those whose frames all reach a later rule with
+//     the same action when they are gone, every rule between that can match
+//     one of them having that action too;
+//   - merges rules that differ in one field only, sibling prefixes into
+//     their parent and overlapping or adjacent port ranges into one, when
+//     the later one can move up to the earlier one under the same condition;
+//   - given hit counts per rule, moves hot rules ahead of colder ones they
+//     cannot disagree with: rules no frame matches both of, or with the same
+//     action.
+//
+// Two rules overlap unless a field they both test cannot take a common
+// value (or their IP versions differ); a rule covers another when it tests
+// no field the other does not and every value of the other's fields is in
+// its own. Both are decided field by field, so a rule covered only by the
+// union of several others is kept: the optimizer may miss a rule it could
+// drop but never drops one it must not. Rules more than 65536 apart are not
+// merged, which keeps the check of the rules between them bounded.
+//
+
+#include "rules.h"
+
+typedef struct _RULE_OPT_STAT {
+    ULONG   dead;                   // rules no frame can match
+    ULONG   shadowed;
+    ULONG   redundant;
+    ULONG   merged;                 // rules folded into another
+    ULONG   moved;                  // rules moved ahead of colder ones
+} RULE_OPT_STAT, * PRULE_OPT_STAT;
+
+// Optimizes the count header rules in place and returns how many are left.
+// hits: NULL or a count per rule, in the same order. origin, when not NULL,
+// gets the input index of each rule left (for a merged rule, the earliest
+// of those it came from). _next and _prev are not touched.
+ULONG rule_optimize(PNET_RULES rules, ULONG count, const ULONG64* hits, PULONG origin, PRULE_OPT_STAT stat);
@@ -44,6 +44,106 @@ BOOL FilterNetworkCtrl::FilterNetworkDrv_UpdateConfig() {
     return Result;
 }
 
+BOOL FilterNetworkCtrl::FilterNetworkDrv_LoadRuleImage(LPCWSTR ImagePath) {
+    // Sends a rule image built by netrulec (or a BUGAV record file) to the
+    // driver, which swaps it in without reading its configuration file
+    DWORD BytesReturned;
+    LARGE_INTEGER FileSize;
+
+    HANDLE hFile = CreateFileW(ImagePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        ErrorPrint("LoadRuleImage: cannot open rule image. Error %d", GetLastError());
+        return FALSE;
+    }
+    if (!GetFileSizeEx(hFile, &FileSize) || FileSize.QuadPart == 0 || FileSize.QuadPart > NDIS_RULE_IMAGE_MAX_SIZE) {
+        ErrorPrint("LoadRuleImage: bad rule image size");
+        CloseHandle(hFile);
+        return FALSE;
+    }
+
+    DWORD ImageSize = (DWORD)FileSize.QuadPart;
+    PUCHAR Image = (PUCHAR)HeapAlloc(GetProcessHeap(), 0, ImageSize);
+    DWORD BytesRead = 0;
+    BOOL Result = (Image != NULL) && ReadFile(hFile, Image, ImageSize, &BytesRead, NULL) && BytesRead == ImageSize;
+    CloseHandle(hFile);
+
+    if (Result == TRUE) {
+        Result = DeviceIoControl(hDriver,
+            IOCTL_FILTER_UPDATE_CONFIG,
+            Image,
+            ImageSize,
+            NULL,
+            0,
+            &BytesReturned,
+            NULL);
+        if (Result != TRUE) {
+            ErrorPrint("LoadRuleImage failed. Error %d", GetLastError());
+        }
+    } else {
+        ErrorPrint("LoadRuleImage: cannot read rule image. Error %d", GetLastError());
+    }
+    if (Image != NULL) { HeapFree(GetProcessHeap(), 0, Image); }
+    return Result;
+}
+
+BOOL FilterNetworkCtrl::FilterNetworkDrv_LoadInstanceRuleImage(LPCWSTR InstanceName, LPCWSTR ImagePath) {
+    // Sends a rule image to run on one filter instance (as listed by
+    // EnumerateAllInstances) ahead of the shared rules; ImagePath NULL
+    // removes the instance's rules
+    DWORD BytesReturned;
+    LARGE_INTEGER FileSize;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    size_t NameLength = wcslen(InstanceName) * sizeof(WCHAR);
+
+    FileSize.QuadPart = 0;
+    if (NameLength == 0 || NameLength > sizeof(((PFILTER_INSTANCE_RULES)NULL)->InstanceName)) {
+        ErrorPrint("LoadInstanceRuleImage: bad instance name");
+        return FALSE;
+    }
+    if (ImagePath != NULL) {
+        hFile = CreateFileW(ImagePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            ErrorPrint("LoadInstanceRuleImage: cannot open rule image. Error %d", GetLastError());
+            return FALSE;
+        }
+        if (!GetFileSizeEx(hFile, &FileSize) || FileSize.QuadPart == 0 || FileSize.QuadPart > NDIS_RULE_IMAGE_MAX_SIZE) {
+            ErrorPrint("LoadInstanceRuleImage: bad rule image size");
+            CloseHandle(hFile);
+            return FALSE;
+        }
+    }
+
+    DWORD ImageSize = (DWORD)FileSize.QuadPart;
+    DWORD BufferSize = FIELD_OFFSET(FILTER_INSTANCE_RULES, Data) + ImageSize;
+    PFILTER_INSTANCE_RULES Rules = (PFILTER_INSTANCE_RULES)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, BufferSize);
+    DWORD BytesRead = 0;
+    BOOL Result = (Rules != NULL);
+    if (Result == TRUE && hFile != INVALID_HANDLE_VALUE) {
+        Result = ReadFile(hFile, Rules->Data, ImageSize, &BytesRead, NULL) && BytesRead == ImageSize;
+    }
+    if (hFile != INVALID_HANDLE_VALUE) { CloseHandle(hFile); }
+
+    if (Result == TRUE) {
+        RtlCopyMemory(Rules->InstanceName, InstanceName, NameLength);
+        Rules->InstanceNameLength = (ULONG)NameLength;
+        Result = DeviceIoControl(hDriver,
+            IOCTL_FILTER_UPDATE_INSTANCE_CONFIG,
+            Rules,
+            BufferSize,
+            NULL,
+            0,
+            &BytesReturned,
+            NULL);
+        if (Result != TRUE) {
+            ErrorPrint("LoadInstanceRuleImage failed. Error %d", GetLastError());
+        }
+    } else {
+        ErrorPrint("LoadInstanceRuleImage: cannot read rule image. Error %d", GetLastError());
+    }
+    if (Rules != NULL) { HeapFree(GetProcessHeap(), 0, Rules); }
+    return Result;
+}
+
 BOOL FilterNetworkCtrl::FilterNetworkDrv_RestartAllInstances() {
     DWORD BytesReturned;
 
@@ -118,3 +218,134 @@ BOOL FilterNetworkCtrl::FilterNetworkDrv_EnumerateAllInstances() {
 
     return Result;
 }
+
+BOOL FilterNetworkCtrl::FilterNetworkDrv_QueryAllStat() {
+    DWORD BytesReturned = 0;
+    FILTER_DRIVER_ALL_STAT AllStat = { 0 };
+
+    BOOL Result = DeviceIoControl(hDriver,
+        IOCTL_FILTER_QUERY_ALL_STAT,
+        NULL,
+        0,
+        &AllStat,
+        sizeof(AllStat),
+        &BytesReturned,
+        NULL);
+
+    if (Result != TRUE) {
+        ErrorPrint("QueryAllStat failed. Error %d", GetLastError());
+        return Result;
+    }
+
+    ULONG64 Lookups = AllStat.FlowCacheHits + AllStat.FlowCacheMisses;
+    wprintf(L"flow cache: %u cpus x %u entries, hits %llu, misses %llu, evictions %llu, hit rate %.1f%%\n",
+        AllStat.FlowCacheCpus, AllStat.FlowCacheEntries,
+        AllStat.FlowCacheHits, AllStat.FlowCacheMisses, AllStat.FlowCacheEvictions,
+        Lookups ? 100.0 * AllStat.FlowCacheHits / Lookups : 0.0);
+    wprintf(L"alerts: written %llu, dropped %llu, pending %u\n",
+        AllStat.AlertsWritten, AllStat.AlertsDropped, AllStat.AlertsPending);
+    wprintf(L"tcp streams: %u cpus x %u entries, continued %llu, started %llu, gaps %llu, evictions %llu\n",
+        AllStat.StreamCpus, AllStat.StreamEntries,
+        AllStat.StreamHits, AllStat.StreamMisses, AllStat.StreamGaps, AllStat.StreamEvictions);
+    wprintf(L"sources: %u cpus, counted %llu, rate limited %llu admitted, %llu dropped\n",
+        AllStat.RateCpus, AllStat.RatePackets, AllStat.RateAdmitted, AllStat.RateLimited);
+    wprintf(L"dns: responses %llu, blocked %llu, addresses cached %llu, %u in cache, frames dropped %llu\n",
+        AllStat.DnsResponses, AllStat.DnsBlocked, AllStat.DnsCached, AllStat.DnsEntries, AllStat.DnsDropped);
+    wprintf(L"deferred payloads: %u cpus, queued %llu, %u waiting, full queue passed %llu, dropped %llu\n",
+        AllStat.DeferCpus, AllStat.DeferredNbls, AllStat.DeferQueued, AllStat.DeferPassed, AllStat.DeferDropped);
+    wprintf(L"flows: %u cpus x %u entries, %u active, frames %llu, started %llu, exported %llu, %u waiting, lost %llu\n",
+        AllStat.MeterCpus, AllStat.MeterEntries, AllStat.MeterActive, AllStat.MeterPackets,
+        AllStat.MeterStarted, AllStat.MeterExported, AllStat.MeterPending, AllStat.MeterLost);
+
+    return Result;
+}
+
+BOOL FilterNetworkCtrl::FilterNetworkDrv_ClearAllStat() {
+    DWORD BytesReturned;
+
+    BOOL Result = DeviceIoControl(hDriver,
+        IOCTL_FILTER_CLEAR_ALL_STAT,
+        NULL,
+        0,
+        NULL,
+        0,
+        &BytesReturned,
+        NULL);
+
+    if (Result != TRUE) {
+        ErrorPrint("ClearAllStat failed. Error %d", GetLastError());
+    }
+    return Result;
+}
+
+BOOL FilterNetworkCtrl::FilterNetworkDrv_ReadAlerts(PFILTER_ALERT_RECORD Records, ULONG MaxRecords, PULONG RecordCount) {
+    // Blocks until the driver has alerts, then returns as many as fit. The
+    // request holds the device handle while it waits, so a reader thread
+    // should open a handle of its own.
+    DWORD BytesReturned = 0;
+
+    *RecordCount = 0;
+    BOOL Result = DeviceIoControl(hDriver,
+        IOCTL_FILTER_READ_ALERTS,
+        NULL,
+        0,
+        Records,
+        MaxRecords * sizeof(FILTER_ALERT_RECORD),
+        &BytesReturned,
+        NULL);
+
+    if (Result != TRUE) {
+        ErrorPrint("ReadAlerts failed. Error %d", GetLastError());
+        return Result;
+    }
+    *RecordCount = BytesReturned / sizeof(FILTER_ALERT_RECORD);
+    return Result;
+}
+
+BOOL FilterNetworkCtrl::FilterNetworkDrv_QueryTopSources(PFILTER_TOP_SOURCE Sources, ULONG MaxSources, PULONG SourceCount) {
+    // Heaviest sources first, as estimated by the driver's per-processor
+    // sketches over roughly the last two seconds
+    DWORD BytesReturned = 0;
+
+    *SourceCount = 0;
+    BOOL Result = DeviceIoControl(hDriver,
+        IOCTL_FILTER_QUERY_TOP_SOURCES,
+        NULL,
+        0,
+        Sources,
+        MaxSources * sizeof(FILTER_TOP_SOURCE),
+        &BytesReturned,
+        NULL);
+
+    if (Result != TRUE) {
+        ErrorPrint("QueryTopSources failed. Error %d", GetLastError());
+        return Result;
+    }
+    *SourceCount = BytesReturned / sizeof(FILTER_TOP_SOURCE);
+    return Result;
+}
+
+BOOL FilterNetworkCtrl::FilterNetworkDrv_ReadFlows(PUCHAR Message, ULONG Size, PULONG Length) {
+    // Blocks until the driver's next sweep (about a second) or until its
+    // rings fill halfway, then returns one IPFIX message of as many flow
+    // records as fit in Size bytes (FILTER_FLOW_MESSAGE_MIN at least). As for
+    // alerts, a reader thread should open a handle of its own.
+    DWORD BytesReturned = 0;
+
+    *Length = 0;
+    BOOL Result = DeviceIoControl(hDriver,
+        IOCTL_FILTER_READ_FLOWS,
+        NULL,
+        0,
+        Message,
+        Size,
+        &BytesReturned,
+        NULL);
+
+    if (Result != TRUE) {
+        ErrorPrint("ReadFlows failed. Error %d", GetLastError());
+        return Result;
+    }
+    *Length = BytesReturned;
+    return Result;
+}
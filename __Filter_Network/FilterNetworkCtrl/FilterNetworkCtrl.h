@@ -12,10 +12,19 @@
 #define IOCTL_FILTER_RESTART_ALL               ( ((0x00000017)<<16)|((0)<<14)|((0)<<2)|(0) )
 #define IOCTL_FILTER_RESTART_ONE_INSTANCE      ( ((0x00000017)<<16)|((0)<<14)|((1)<<2)|(0) )
 #define IOCTL_FILTER_ENUMERATE_ALL_INSTANCES   ( ((0x00000017)<<16)|((0)<<14)|((2)<<2)|(0) )
+#define IOCTL_FILTER_QUERY_ALL_STAT            ( ((0x00000017)<<16)|((0)<<14)|((3)<<2)|(0) )
+#define IOCTL_FILTER_CLEAR_ALL_STAT            ( ((0x00000017)<<16)|((0)<<14)|((4)<<2)|(0) )
 #define IOCTL_FILTER_UPDATE_CONFIG             ( ((0x00000017)<<16)|((0)<<14)|((14)<<2)|(0) )
+#define IOCTL_FILTER_READ_ALERTS               ( ((0x00000017)<<16)|((0)<<14)|((15)<<2)|(0) )
+#define IOCTL_FILTER_QUERY_TOP_SOURCES         ( ((0x00000017)<<16)|((0)<<14)|((16)<<2)|(0) )
+#define IOCTL_FILTER_UPDATE_INSTANCE_CONFIG    ( ((0x00000017)<<16)|((0)<<14)|((17)<<2)|(0) )
+#define IOCTL_FILTER_READ_FLOWS                ( ((0x00000017)<<16)|((0)<<14)|((18)<<2)|(0) )
 
 #define NDIS_BUF_LEN 512
 
+// Must match NET_RULE_IMAGE_MAX_SIZE in FilterNetworkDrv\ruleimage.h
+#define NDIS_RULE_IMAGE_MAX_SIZE     (256u << 20)
+
 #pragma pack(push, 1)
 typedef struct _FLTUNICODE_STRING {
     USHORT Length;
@@ -23,6 +32,99 @@ typedef struct _FLTUNICODE_STRING {
 } FLTUNICODE_STRING, * PFLTUNICODE_STRING;
 #pragma pack(pop)
 
+// Must match FILTER_DRIVER_ALL_STAT in FilterNetworkDrv\filteruser.h
+typedef struct _FILTER_DRIVER_ALL_STAT {
+    ULONG          AttachCount;
+    ULONG          DetachCount;
+    ULONG          ExternalRequestFailedCount;
+    ULONG          ExternalRequestSuccessCount;
+    ULONG          InternalRequestFailedCount;
+    ULONG          FlowCacheCpus;
+    ULONG          FlowCacheEntries;
+    ULONG64        FlowCacheHits;
+    ULONG64        FlowCacheMisses;
+    ULONG64        FlowCacheEvictions;
+    ULONG64        AlertsWritten;
+    ULONG64        AlertsDropped;
+    ULONG          AlertsPending;
+    ULONG          StreamCpus;
+    ULONG          StreamEntries;
+    ULONG64        StreamHits;
+    ULONG64        StreamMisses;
+    ULONG64        StreamGaps;
+    ULONG64        StreamEvictions;
+    ULONG          RateCpus;
+    ULONG64        RatePackets;
+    ULONG64        RateAdmitted;
+    ULONG64        RateLimited;
+    ULONG          DnsEntries;
+    ULONG64        DnsResponses;
+    ULONG64        DnsBlocked;
+    ULONG64        DnsCached;
+    ULONG64        DnsDropped;
+    ULONG          DeferCpus;
+    ULONG          DeferQueued;
+    ULONG64        DeferredNbls;
+    ULONG64        DeferPassed;
+    ULONG64        DeferDropped;
+    ULONG          MeterCpus;
+    ULONG          MeterEntries;
+    ULONG          MeterActive;
+    ULONG          MeterPending;
+    ULONG64        MeterPackets;
+    ULONG64        MeterStarted;
+    ULONG64        MeterExported;
+    ULONG64        MeterLost;
+} FILTER_DRIVER_ALL_STAT, * PFILTER_DRIVER_ALL_STAT;
+
+#define FILTER_ALERT_CONTENT                   0x0001      // Rule is a content rule index
+#define FILTER_ALERT_RATE                      0x0002      // Source was over the rate of a rate limit rule
+#define FILTER_ALERT_REPUTATION                0x0004      // Rule 0 - source, 1 - destination is in the reputation set
+#define FILTER_ALERT_DOMAIN                    0x0008      // Rule 0 - source, 1 - destination was resolved for a blocked domain
+#define FILTER_ALERT_PROGRAM                   0x0010      // Rule is a filter program index
+#define FILTER_ALERT_OVERLAY                   0x0020      // Matched in the overlay of the adapter, not the shared rules
+
+// Must match NET_ALERT_RECORD in FilterNetworkDrv\alert.h
+typedef struct _FILTER_ALERT_RECORD {
+    ULONG64     Timestamp;              // FILETIME
+    ULONG       Rule;
+    ULONG       Generation;
+    ULONG       FrameLength;
+    USHORT      EtherType;
+    UCHAR       Protocol;
+    UCHAR       SnapshotLength;
+    USHORT      SourcePort;
+    USHORT      DestinationPort;
+    USHORT      Cpu;
+    USHORT      Flags;                  // FILTER_ALERT_*
+    UCHAR       SourceIp[16];           // network order, IPv4 in the first 4 bytes
+    UCHAR       DestinationIp[16];
+    UCHAR       Snapshot[64];
+} FILTER_ALERT_RECORD, * PFILTER_ALERT_RECORD;
+
+// Must match FILTER_TOP_SOURCE in FilterNetworkDrv\filteruser.h
+typedef struct _FILTER_TOP_SOURCE {
+    UCHAR       SourceIp[16];           // network order, IPv4 as ::ffff:a.b.c.d
+    ULONG64     Packets;
+} FILTER_TOP_SOURCE, * PFILTER_TOP_SOURCE;
+
+// IOCTL_FILTER_READ_FLOWS returns one IPFIX message (RFC 7011): header,
+// template set, then a data set of FILTER_FLOW_RECORD_LEN-byte records.
+// Must match NET_METER_* in FilterNetworkDrv\meter.h
+#define FILTER_FLOW_TEMPLATE_ID                256
+#define FILTER_FLOW_RECORD_LEN                 72
+#define FILTER_FLOW_MESSAGE_MIN                (16 + 52 + 4 + FILTER_FLOW_RECORD_LEN)
+#define FILTER_FLOW_MESSAGE_MAX                65535
+
+#define NDIS_INSTANCE_NAME_MAX_LENGTH 256
+
+// Must match FILTER_INSTANCE_RULES in FilterNetworkDrv\filteruser.h
+typedef struct _FILTER_INSTANCE_RULES {
+    WCHAR       InstanceName[NDIS_INSTANCE_NAME_MAX_LENGTH];
+    ULONG       InstanceNameLength;     // bytes
+    UCHAR       Data[sizeof(ULONG)];    // rule image to the end of the buffer
+} FILTER_INSTANCE_RULES, * PFILTER_INSTANCE_RULES;
+
 class FilterNetworkCtrl {
     HANDLE hDriver;
 
@@ -36,8 +138,16 @@ public:
     BOOL FilterNetworkDrv_OpenDevice();
 
     BOOL FilterNetworkDrv_UpdateConfig();
+    BOOL FilterNetworkDrv_LoadRuleImage(LPCWSTR ImagePath);
+    BOOL FilterNetworkDrv_LoadInstanceRuleImage(LPCWSTR InstanceName, LPCWSTR ImagePath);
     BOOL FilterNetworkDrv_RestartAllInstances();
     BOOL FilterNetworkDrv_RestartOneInstance();
     BOOL FilterNetworkDrv_EnumerateAllInstances();
+    BOOL FilterNetworkDrv_QueryAllStat();
+    BOOL FilterNetworkDrv_ClearAllStat();
+
+    BOOL FilterNetworkDrv_ReadAlerts(PFILTER_ALERT_RECORD Records, ULONG MaxRecords, PULONG RecordCount);
+    BOOL FilterNetworkDrv_QueryTopSources(PFILTER_TOP_SOURCE Sources, ULONG MaxSources, PULONG SourceCount);
+    BOOL FilterNetworkDrv_ReadFlows(PUCHAR Message, ULONG Size, PULONG Length);
 };
 
@@ -0,0 +1,167 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+#include "alert.h"
+
+static PNET_ALERT_RING  ndisAlertRings = NULL;
+static PVOID            ndisAlertRingsRaw = NULL;
+static ULONG            ndisAlertCpuCount = 0;
+static ULONG            ndisAlertNextCpu = 0;      // where the next drain starts
+static NET_ALERT_NOTIFY ndisAlertNotify = NULL;
+
+BOOLEAN ndisAlertInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = count * sizeof(NET_ALERT_RING) + NETFLT_CACHE_LINE;
+
+    ndisAlertRingsRaw = NETFLT_ALLOC(size, NET_ALERT_TAG);
+    if (ndisAlertRingsRaw == NULL) { return FALSE; }
+    RtlZeroMemory(ndisAlertRingsRaw, size);
+
+    ndisAlertRings = (PNET_ALERT_RING)(((ULONG_PTR)ndisAlertRingsRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+    ndisAlertCpuCount = count;
+    return TRUE;
+}
+
+VOID ndisAlertCleanup() {
+    if (ndisAlertRingsRaw != NULL) { NETFLT_FREE(ndisAlertRingsRaw, NET_ALERT_TAG); }
+    ndisAlertRingsRaw = NULL;
+    ndisAlertRings = NULL;
+    ndisAlertCpuCount = 0;
+    ndisAlertNotify = NULL;
+}
+
+VOID ndisAlertSetNotify(NET_ALERT_NOTIFY notify) {
+    ndisAlertNotify = notify;
+}
+
+static VOID alertPut32(PUCHAR dst, UINT32 v) {
+    dst[0] = (UCHAR)(v >> 24); dst[1] = (UCHAR)(v >> 16); dst[2] = (UCHAR)(v >> 8); dst[3] = (UCHAR)v;
+}
+
+static VOID alertPut64(PUCHAR dst, UINT64 v) {
+    alertPut32(dst, (UINT32)(v >> 32));
+    alertPut32(dst + 4, (UINT32)v);
+}
+
+VOID ndisAlertRecord(ULONG rule, USHORT flags, ULONG generation, const UCHAR* frame, ULONG length, ULONG frame_length) {
+    if (ndisAlertRings == NULL) { return; }
+
+    ULONG cpu = NETFLT_CPU_INDEX();
+    PNET_ALERT_RING ring = &ndisAlertRings[cpu];
+    ULONG64 head = ring->head;
+    if (head - ReadULong64Acquire(&ring->tail) >= NET_ALERT_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+
+    PNET_ALERT_RECORD record = &ring->records[head & (NET_ALERT_RING_SIZE - 1)];
+    NET_CLS_KEY key;
+    NET_LPM6_ADDRESS addresses[2];
+
+    RtlZeroMemory(record, sizeof(NET_ALERT_RECORD));
+    ndisFrameToKey(frame, length, &key, addresses);
+    NETFLT_SYSTEM_TIME(&record->timestamp);
+    record->rule = rule;
+    record->flags = flags;
+    record->generation = generation;
+    record->frame_length = frame_length;
+    record->ether_type = key.ether_type;
+    record->protocol = key.protocol;
+    record->cpu = (USHORT)cpu;
+    if (key.shape & NET_CLS_SHAPE_IP6) {
+        alertPut64(record->source_ip, addresses[0].hi);
+        alertPut64(record->source_ip + 8, addresses[0].lo);
+        alertPut64(record->destination_ip, addresses[1].hi);
+        alertPut64(record->destination_ip + 8, addresses[1].lo);
+    } else if (key.shape & NET_CLS_SHAPE_IP) {
+        alertPut32(record->source_ip, key.source_ip);
+        alertPut32(record->destination_ip, key.destination_ip);
+    }
+    if (key.shape & NET_CLS_SHAPE_L4) {
+        record->source_port = key.source_port;
+        record->destination_port = key.destination_port;
+    }
+    record->snapshot_length = (UCHAR)((length < NET_ALERT_SNAPSHOT_LEN) ? length : NET_ALERT_SNAPSHOT_LEN);
+    RtlCopyMemory(record->snapshot, frame, record->snapshot_length);
+    ring->written++;
+
+    WriteULong64Release(&ring->head, head + 1);
+
+    // Wake a reader when this record is the only one in the ring: either the
+    // ring was empty or a drain emptied it meanwhile. Records behind it are
+    // picked up by the drain this one triggers.
+    KeMemoryBarrier();
+    if (ndisAlertNotify != NULL && ReadULong64Acquire(&ring->tail) == head) {
+        ndisAlertNotify();
+    }
+}
+
+ULONG ndisAlertDrain(PNET_ALERT_RECORD records, ULONG max_records) {
+    ULONG count = 0;
+    ULONG start = ndisAlertNextCpu;
+    BOOLEAN left = FALSE;                   // records may be left that no record will wake a reader for
+
+    // Starting one processor further each time keeps a small reader buffer
+    // from always favouring the first rings
+    for (ULONG n = 0; n < ndisAlertCpuCount && count < max_records; n++) {
+        PNET_ALERT_RING ring = &ndisAlertRings[(start + n) % ndisAlertCpuCount];
+        if (InterlockedCompareExchange(&ring->draining, 1, 0) != 0) {
+            left = TRUE;
+            continue;
+        }
+
+        ULONG64 tail = ring->tail;
+        ULONG64 available = ReadULong64Acquire(&ring->head) - tail;
+        ULONG take = (available < max_records - count) ? (ULONG)available : max_records - count;
+        for (ULONG i = 0; i < take; i++) {
+            records[count++] = ring->records[(tail + i) & (NET_ALERT_RING_SIZE - 1)];
+        }
+        WriteULong64Release(&ring->tail, tail + take);
+        InterlockedExchange(&ring->draining, 0);
+
+        // Either the producer sees the new tail or this sees its record,
+        // as in ndisAlertRecord
+        KeMemoryBarrier();
+        if (ReadULong64Acquire(&ring->head) != tail + take) { left = TRUE; }
+    }
+    if (count == max_records) { left = TRUE; }
+    if (ndisAlertCpuCount != 0) { ndisAlertNextCpu = (start + 1) % ndisAlertCpuCount; }
+
+    // A record left in a ring that is not empty wakes nobody when it lands,
+    // and neither do the ones behind it: re-arm the reader for what this
+    // drain stopped short of, what landed while it drained and the rings
+    // another drain was in
+    if (left && ndisAlertNotify != NULL) { ndisAlertNotify(); }
+    return count;
+}
+
+BOOLEAN ndisAlertPending() {
+    for (ULONG cpu = 0; cpu < ndisAlertCpuCount; cpu++) {
+        if (ReadULong64Acquire(&ndisAlertRings[cpu].head) != ndisAlertRings[cpu].tail) { return TRUE; }
+    }
+    return FALSE;
+}
+
+VOID ndisAlertQueryStat(PNET_ALERT_STAT stat) {
+    RtlZeroMemory(stat, sizeof(NET_ALERT_STAT));
+    stat->cpus = ndisAlertCpuCount;
+
+    // As with the flow cache, the counters of other processors may be a few
+    // records behind
+    for (ULONG cpu = 0; cpu < ndisAlertCpuCount; cpu++) {
+        stat->written += ndisAlertRings[cpu].written;
+        stat->dropped += ndisAlertRings[cpu].dropped;
+        stat->pending += (ULONG)(ndisAlertRings[cpu].head - ndisAlertRings[cpu].tail);
+    }
+}
+
+VOID ndisAlertClearStat() {
+    for (ULONG cpu = 0; cpu < ndisAlertCpuCount; cpu++) {
+        ndisAlertRings[cpu].written = 0;
+        ndisAlertRings[cpu].dropped = 0;
+    }
+}
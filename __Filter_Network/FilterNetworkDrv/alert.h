@@ -0,0 +1,94 @@
+#pragma once
+//
+// Per-processor alert rings.
+//
+// A rule match is reported as one fixed-size binary record written to the
+// ring of the processor that saw it; nothing is formatted or printed on the
+// packet path. User mode drains the rings in batches through
+// IOCTL_FILTER_READ_ALERTS, an inverted call: the request stays pending in
+// the driver until records are there to complete it with.
+//
+// Every ring has a single producer, the packet path of its own processor
+// inside an epoch section (at DISPATCH_LEVEL), and a single consumer at a
+// time. head and tail are free-running counters on separate cache lines;
+// the producer publishes a record by advancing head after writing it, the
+// consumer frees slots by advancing tail after copying them out. When the
+// ring is full the new record is dropped and counted, so a flood of matches
+// costs the packet path no more than a failed comparison per match.
+//
+
+#define NET_ALERT_TAG           '1trA'
+#define NET_ALERT_RING_SIZE     1024        // records per processor, power of two
+#define NET_ALERT_SNAPSHOT_LEN  64          // leading frame bytes kept in a record
+
+// NET_ALERT_RECORD.flags
+#define NET_ALERT_F_CONTENT     0x0001      // rule is a content rule (content.h)
+#define NET_ALERT_F_RATE        0x0002      // source over the rate of a rate limit rule (ratelimit.h)
+#define NET_ALERT_F_REPUTATION  0x0004      // address in the reputation set; rule is NET_REPUTATION_SOURCE or _DESTINATION
+#define NET_ALERT_F_DOMAIN      0x0008      // address resolved for a blocked domain (dns.h); rule is NET_DNS_SOURCE or _DESTINATION
+#define NET_ALERT_F_PROGRAM     0x0010      // rule is a filter program (vm.h)
+#define NET_ALERT_F_OVERLAY     0x0020      // matched in the overlay of the adapter; generation is the overlay's (rules.h)
+
+// One match. Must match FILTER_ALERT_RECORD in FilterNetworkCtrl.h
+typedef struct _NET_ALERT_RECORD {
+    ULONG64     timestamp;              // system time, 100 ns units since 1601
+    ULONG       rule;                   // index of the matching rule or content rule
+    ULONG       generation;             // low bits of the rule set generation
+    ULONG       frame_length;           // of the whole frame
+    USHORT      ether_type;
+    UCHAR       protocol;
+    UCHAR       snapshot_length;
+    USHORT      source_port;
+    USHORT      destination_port;
+    USHORT      cpu;
+    USHORT      flags;                  // NET_ALERT_F_*
+    UCHAR       source_ip[16];          // network order, IPv4 in the first 4 bytes
+    UCHAR       destination_ip[16];
+    UCHAR       snapshot[NET_ALERT_SNAPSHOT_LEN];
+} NET_ALERT_RECORD, * PNET_ALERT_RECORD;
+
+C_ASSERT(sizeof(NET_ALERT_RECORD) == 128);
+
+typedef struct DECLSPEC_CACHEALIGN _NET_ALERT_RING {
+    volatile ULONG64    head;           // written by the producer only
+    ULONG64             written;
+    ULONG64             dropped;        // records lost to a full ring
+    UCHAR               pad[NETFLT_CACHE_LINE - 3 * sizeof(ULONG64)];
+    volatile ULONG64    tail;           // written by the consumer only
+    volatile LONG       draining;       // 1 while a consumer owns the tail
+    UCHAR               pad2[NETFLT_CACHE_LINE - sizeof(ULONG64) - sizeof(LONG)];
+    NET_ALERT_RECORD    records[NET_ALERT_RING_SIZE];
+} NET_ALERT_RING, * PNET_ALERT_RING;
+
+typedef struct _NET_ALERT_STAT {
+    ULONG64 written;
+    ULONG64 dropped;
+    ULONG   pending;                    // records waiting in the rings
+    ULONG   cpus;
+} NET_ALERT_STAT, * PNET_ALERT_STAT;
+
+// Called at DISPATCH_LEVEL when a record lands in an empty ring, and at
+// DISPATCH_LEVEL or below by a drain that leaves records behind, so that a
+// waiting reader can be completed (see device.c)
+typedef VOID (*NET_ALERT_NOTIFY)(VOID);
+
+BOOLEAN ndisAlertInit();
+VOID ndisAlertCleanup();
+VOID ndisAlertSetNotify(NET_ALERT_NOTIFY notify);
+
+// Records a match of rule on the first length bytes of a frame of
+// frame_length bytes. Call from inside an epoch section.
+VOID ndisAlertRecord(ULONG rule, USHORT flags, ULONG generation, const UCHAR* frame, ULONG length, ULONG frame_length);
+
+// Copies up to max_records records from the rings into records, oldest
+// first within each processor. Returns the number copied. Any IRQL up to
+// DISPATCH_LEVEL; concurrent callers never return the same record. A drain
+// that stops short of a ring, or finds another drain in it, calls the
+// notify routine.
+ULONG ndisAlertDrain(PNET_ALERT_RECORD records, ULONG max_records);
+
+// TRUE if some ring holds a record
+BOOLEAN ndisAlertPending();
+
+VOID ndisAlertQueryStat(PNET_ALERT_STAT stat);
+VOID ndisAlertClearStat();
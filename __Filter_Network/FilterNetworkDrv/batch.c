@@ -0,0 +1,162 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+
+static UINT64 batchLoad64(const UCHAR* bytes) {
+    UINT64 value = 0;
+    for (ULONG i = 0; i < 8; i++) { value = (value << 8) | bytes[i]; }
+    return value;
+}
+
+ULONG ndisIpv6Transport(const UCHAR* ip6, ULONG length, PUCHAR protocol, PULONG needed) {
+    ULONG offset = NET_BATCH_IPV6_LEN;
+    UCHAR next = ip6[6];
+
+    for (ULONG count = 0; ; count++) {
+        const UCHAR* hdr = ip6 + offset;
+        ULONG size;
+
+        *protocol = next;
+        *needed = offset;
+        switch (next) {
+        case 6:         // TCP
+        case 17:        // UDP
+        case 132:       // SCTP
+            *needed = offset + NET_BATCH_PORTS_LEN;
+            return (*needed <= length) ? offset : 0;
+        case 0:         // Hop-by-Hop
+        case 43:        // Routing
+        case 44:        // Fragment
+        case 51:        // AH
+        case 60:        // Destination Options
+        case 135:       // Mobility
+        case 139:       // HIP
+        case 140:       // Shim6
+            break;
+        default:        // ESP, No Next Header, ICMPv6 and the rest
+            return 0;
+        }
+
+        // Every extension header is at least 8 bytes
+        if (count == NET_BATCH_IPV6_EXT_MAX) { return 0; }
+        *needed = offset + 8;
+        if (*needed > length) { return 0; }
+
+        if (next == 44) {
+            // Only the first fragment carries the ports
+            if (((hdr[2] << 8) | (hdr[3] & 0xF8)) != 0) { *needed = offset; return 0; }
+            size = 8;
+        } else if (next == 51) {
+            size = ((ULONG)hdr[1] + 2) * 4;
+        } else {
+            size = ((ULONG)hdr[1] + 1) * 8;
+        }
+        next = hdr[0];
+        offset += size;
+    }
+}
+
+ULONG ndisFrameNetworkOffset(const UCHAR* frame, ULONG length, PUINT16 ether_type) {
+    ULONG offset = NET_BATCH_ETH_LEN;
+
+    *ether_type = 0;
+    if (length < NET_BATCH_ETH_LEN) { return NET_BATCH_ETH_LEN; }
+    *ether_type = (UINT16)((frame[12] << 8) | frame[13]);
+
+    // 802.1Q / 802.1ad: rules see the encapsulated ether type
+    for (ULONG tags = 0; (*ether_type == 0x8100 || *ether_type == 0x88A8) && tags < NET_BATCH_VLAN_MAX; tags++) {
+        if (offset + NET_BATCH_VLAN_LEN > length) { return offset + NET_BATCH_VLAN_LEN; }
+        *ether_type = (UINT16)((frame[offset + 2] << 8) | frame[offset + 3]);
+        offset += NET_BATCH_VLAN_LEN;
+    }
+    return offset;
+}
+
+ULONG ndisFrameToKey(const UCHAR* frame, ULONG length, PNET_CLS_KEY key, PNET_LPM6_ADDRESS addresses) {
+    // Same view of the frame as parse_frame: IPv4 and IPv6 frames have IP
+    // fields and, behind a TCP, UDP or SCTP header that is not a later
+    // fragment, port fields. ARP and anything else have neither.
+    const UCHAR* l4;
+
+    RtlZeroMemory(key, sizeof(NET_CLS_KEY));
+    ULONG offset = ndisFrameNetworkOffset(frame, length, &key->ether_type);
+    if (offset > length) { return offset; }
+
+    if (key->ether_type == 0x0800) {
+        const UCHAR* ip = frame + offset;
+        if (offset + NET_BATCH_IPV4_LEN > length) { return offset + NET_BATCH_IPV4_LEN; }
+        ULONG ihl = (ULONG)(ip[0] & 0x0F) * 4;
+        if ((ip[0] >> 4) != 4 || ihl < NET_BATCH_IPV4_LEN) { return offset + NET_BATCH_IPV4_LEN; }
+
+        key->shape |= NET_CLS_SHAPE_IP;
+        key->protocol = ip[9];
+        key->source_ip = ((UINT32)ip[12] << 24) | ((UINT32)ip[13] << 16) | ((UINT32)ip[14] << 8) | ip[15];
+        key->destination_ip = ((UINT32)ip[16] << 24) | ((UINT32)ip[17] << 16) | ((UINT32)ip[18] << 8) | ip[19];
+
+        // Later fragments and other protocols have no ports
+        if ((((ip[6] << 8) | ip[7]) & 0x1FFF) != 0) { return offset + NET_BATCH_IPV4_LEN; }
+        if (key->protocol != 6 && key->protocol != 17 && key->protocol != 132) { return offset + NET_BATCH_IPV4_LEN; }
+        offset += ihl;
+        if (offset + NET_BATCH_PORTS_LEN > length) { return offset + NET_BATCH_PORTS_LEN; }
+        l4 = frame + offset;
+    } else if (key->ether_type == 0x86DD) {
+        const UCHAR* ip6 = frame + offset;
+        ULONG needed;
+        if (offset + NET_BATCH_IPV6_LEN > length) { return offset + NET_BATCH_IPV6_LEN; }
+
+        key->shape |= NET_CLS_SHAPE_IP6;
+        addresses[0].hi = batchLoad64(ip6 + 8);
+        addresses[0].lo = batchLoad64(ip6 + 16);
+        addresses[1].hi = batchLoad64(ip6 + 24);
+        addresses[1].lo = batchLoad64(ip6 + 32);
+
+        ULONG transport = ndisIpv6Transport(ip6, length - offset, &key->protocol, &needed);
+        if (transport == 0) { return offset + needed; }
+        offset += transport;
+        l4 = frame + offset;
+    } else {
+        return offset;
+    }
+
+    key->shape |= NET_CLS_SHAPE_L4;
+    key->source_port = (UINT16)((l4[0] << 8) | l4[1]);
+    key->destination_port = (UINT16)((l4[2] << 8) | l4[3]);
+    return offset + NET_BATCH_PORTS_LEN;
+}
+
+VOID ndisClassifyBatch(const NET_CLASSIFIER* cls, PNET_FLOW_CACHE flows, ULONG generation,
+    const NET_BATCH_FRAME* frames, ULONG count, PULONG rules) {
+    NET_CLS_KEY keys[NET_BATCH_MAX];
+    NET_LPM6_ADDRESS addresses[2];
+    ULONG i;
+
+    // Headers are usually cold (just DMA'd or written by the stack); start
+    // pulling in the first few before touching any of them
+    for (i = 0; i < count && i < NET_BATCH_PREFETCH; i++) {
+        NETFLT_PREFETCH(frames[i].data);
+        NETFLT_PREFETCH(frames[i].data + NETFLT_CACHE_LINE);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (i + NET_BATCH_PREFETCH < count) {
+            NETFLT_PREFETCH(frames[i + NET_BATCH_PREFETCH].data);
+            NETFLT_PREFETCH(frames[i + NET_BATCH_PREFETCH].data + NETFLT_CACHE_LINE);
+        }
+        ndisFrameToKey(frames[i].data, frames[i].length, &keys[i], addresses);
+        if (keys[i].shape & NET_CLS_SHAPE_IP6) { ndisClsResolve6(cls, &keys[i], addresses); }
+    }
+    // Second pass over keys that are now all in L1
+    if (flows != NULL) {
+        for (i = 0; i < count; i++) {
+            rules[i] = ndisFlowClassify(flows, generation, cls, &keys[i]);
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            rules[i] = ndisClassify(cls, &keys[i]);
+        }
+    }
+}
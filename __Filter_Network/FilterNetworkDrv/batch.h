@@ -0,0 +1,69 @@
+#pragma once
+//
+// Batch classification of frame headers.
+//
+// The receive and send handlers collect the header pointers of a whole NBL
+// chain (up to NET_BATCH_MAX frames at a time) and classify them in one
+// pass. Keys are extracted while the headers NET_BATCH_PREFETCH frames
+// ahead are being prefetched, so the cache misses on header memory overlap
+// instead of being paid one frame at a time.
+//
+// Frames are read in place. Every header read is checked against the
+// length of the contiguous view, and a frame whose headers run past it is
+// classified on the headers that are there, so a short or malformed frame
+// can never make the parser read beyond its buffer.
+//
+
+#define NET_BATCH_MAX           64
+#define NET_BATCH_PREFETCH      4
+
+// Header sizes the parser works with. Up to NET_BATCH_VLAN_MAX 802.1Q/802.1ad
+// tags are skipped, IPv4 options are skipped by IHL and IPv6 extension
+// headers are walked, NET_BATCH_IPV6_EXT_MAX of them at most.
+#define NET_BATCH_ETH_LEN           14
+#define NET_BATCH_VLAN_LEN          4
+#define NET_BATCH_VLAN_MAX          2
+#define NET_BATCH_IPV4_LEN          20
+#define NET_BATCH_IPV6_LEN          40
+#define NET_BATCH_IPV6_EXT_MAX      8
+#define NET_BATCH_PORTS_LEN         4       // the key reads the ports only
+
+// Headers longer than this are not followed (the frame is classified on
+// what precedes them); also the size of a header copy when the headers
+// straddle an MDL boundary
+#define NET_BATCH_HDR_MAX           192
+
+// A frame as the classifier sees it: the first length bytes, contiguous.
+// length may stop short of the frame; the parser never reads past it.
+typedef struct _NET_BATCH_FRAME {
+    const UCHAR*    data;
+    ULONG           length;
+} NET_BATCH_FRAME, * PNET_BATCH_FRAME;
+
+// Walks the IPv6 extension headers within length bytes of ip6. Returns the
+// offset of the transport header and its protocol in *protocol, or 0 when
+// the frame has no TCP/UDP/SCTP header to read (non-first fragment, ESP, no
+// next header, too many extension headers). *needed is the number of bytes
+// from ip6 the walk had to see; it exceeds length when the headers were cut
+// short.
+ULONG ndisIpv6Transport(const UCHAR* ip6, ULONG length, PUCHAR protocol, PULONG needed);
+
+// Offset of the network header behind the Ethernet header and any VLAN
+// tags, and its ether type. A value above length means the tags run past
+// the bytes given.
+ULONG ndisFrameNetworkOffset(const UCHAR* frame, ULONG length, PUINT16 ether_type);
+
+// Builds the key of the first length bytes of an Ethernet frame. addresses
+// receives the IPv6 source and destination of NET_CLS_SHAPE_IP6 frames;
+// key->source_ip/destination_ip stay 0 until ndisClsResolve6.
+// Returns the number of header bytes the key needed. A value above length
+// means the headers run past the bytes given and the key only covers the
+// outer headers: the caller may retry with that many contiguous bytes.
+ULONG ndisFrameToKey(const UCHAR* frame, ULONG length, PNET_CLS_KEY key, PNET_LPM6_ADDRESS addresses);
+
+// rules[i] receives the first matching rule for frames[i], or
+// NET_CLS_NO_MATCH. count must not exceed NET_BATCH_MAX. flows may be NULL
+// to bypass the flow cache; generation is that of the rule set cls
+// belongs to.
+VOID ndisClassifyBatch(const NET_CLASSIFIER* cls, PNET_FLOW_CACHE flows, ULONG generation,
+    const NET_BATCH_FRAME* frames, ULONG count, PULONG rules);
@@ -0,0 +1,1098 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+
+#define NET_CLS_MAX_TUPLES      (NET_CLS_SHAPES * 1024)     // field and prefix length combinations of a shape
+#define NET_CLS_TUPLE_INDEX     (2 * NET_CLS_MAX_TUPLES)    // build-time tuple lookup, power of two
+#define NET_CLS_PORTS           65536
+
+// How a rule is stored, cheapest lookup first
+#define NET_CLS_MODE_LABELS     0       // expanded over the labels of its prefixes and ranges
+#define NET_CLS_MODE_PREFIX     1       // keyed on its widest prefix at its length, expanded over the rest
+#define NET_CLS_MODE_PREFIXES   2       // keyed on both prefixes at their lengths, expanded over its ranges
+#define NET_CLS_MODE_RANGES     3       // keyed on its prefixes, its ranges checked after the probe
+#define NET_CLS_MODE_WIDE       4       // kept out of the hash tables
+
+// Label dimensions
+#define NET_CLS_DIM_SOURCE_IP           0
+#define NET_CLS_DIM_DESTINATION_IP      1
+#define NET_CLS_DIM_SOURCE_IP6          2
+#define NET_CLS_DIM_DESTINATION_IP6     3
+#define NET_CLS_DIM_SOURCE_PORT         4
+#define NET_CLS_DIM_DESTINATION_PORT    5
+#define NET_CLS_DIMS                    6
+
+#define NET_CLS_F_IP4_FIELDS    (NET_CLS_F_SOURCE_IP | NET_CLS_F_DESTINATION_IP | NET_CLS_F_SOURCE_PREFIX | NET_CLS_F_DESTINATION_PREFIX)
+#define NET_CLS_F_IP6_FIELDS    (NET_CLS_F_SOURCE_IP6 | NET_CLS_F_DESTINATION_IP6)
+#define NET_CLS_F_L4_FIELDS     (NET_CLS_F_SOURCE_PORT | NET_CLS_F_DESTINATION_PORT | NET_CLS_F_SOURCE_RANGE | NET_CLS_F_DESTINATION_RANGE)
+#define NET_CLS_F_RANGES        (NET_CLS_F_SOURCE_RANGE | NET_CLS_F_DESTINATION_RANGE)
+#define NET_CLS_F_SOURCE_PREFIXES       (NET_CLS_F_SOURCE_PREFIX | NET_CLS_F_SOURCE_IP6)
+#define NET_CLS_F_DESTINATION_PREFIXES  (NET_CLS_F_DESTINATION_PREFIX | NET_CLS_F_DESTINATION_IP6)
+#define NET_CLS_F_CHECKED       (NET_CLS_F_RANGES | NET_CLS_F_SOURCE_PREFIXES | NET_CLS_F_DESTINATION_PREFIXES)
+
+typedef struct _NET_CLS_BUILD_TUPLE {
+    ULONG   fields;
+    ULONG   min_rule;
+    ULONG   count;
+    ULONG   layout;                         // clsRuleLayout
+    ULONG   checked;                        // clsRuleChecked of all its rules
+} NET_CLS_BUILD_TUPLE, * PNET_CLS_BUILD_TUPLE;
+
+typedef struct _NET_CLS_BUILD_RULE {
+    NET_CLS_KEY key;
+    ULONG   fields;
+    UCHAR   mode;                           // NET_CLS_MODE_*
+    ULONG   keyed;                          // NET_CLS_F_*_PREFIXES keyed at their length, by mode
+    UCHAR   level;                          // keyed prefixes cut back to a multiple of the bucket step >> level
+    ULONG   cost[NET_CLS_MODE_WIDE];        // keys stored in each mode
+    UCHAR   length[2];                      // prefix lengths, source and destination
+    UINT16  last[2];                        // NET_CLS_F_*_RANGE, source and destination
+    NET_LPM6_ADDRESS address6[2];           // NET_CLS_F_*_IP6
+    ULONG   bucket_label[2];                // NET_CLS_F_*_IP6: label of the prefix at its key length
+    ULONG   label_first[NET_CLS_DIMS];
+    ULONG   label_count[NET_CLS_DIMS];
+} NET_CLS_BUILD_RULE, * PNET_CLS_BUILD_RULE;
+
+typedef struct _NET_CLS_LABELS {
+    ULONG   label[NET_CLS_DIMS];
+} NET_CLS_LABELS, * PNET_CLS_LABELS;
+
+static const ULONG clsDimFields[NET_CLS_DIMS] = {
+    NET_CLS_F_SOURCE_PREFIX, NET_CLS_F_DESTINATION_PREFIX,
+    NET_CLS_F_SOURCE_IP6, NET_CLS_F_DESTINATION_IP6,
+    NET_CLS_F_SOURCE_RANGE, NET_CLS_F_DESTINATION_RANGE
+};
+
+static ULONG clsShapeFields(ULONG shape) {
+    ULONG fields = NET_CLS_F_ETHER_TYPE;
+    if (shape & NET_CLS_SHAPE_IP) { fields |= NET_CLS_F_PROTOCOL | NET_CLS_F_IP4_FIELDS; }
+    if (shape & NET_CLS_SHAPE_IP6) { fields |= NET_CLS_F_PROTOCOL | NET_CLS_F_IP6_FIELDS; }
+    if (shape & NET_CLS_SHAPE_L4) { fields |= NET_CLS_F_L4_FIELDS; }
+    return fields;
+}
+
+static FORCEINLINE BOOLEAN clsRuleInShape(ULONG fields, ULONG shape) {
+    return (BOOLEAN)((fields & ~clsShapeFields(shape)) == 0);
+}
+
+// Ancestor of length length of an IPv6 label, 0 - none. Parents have lower
+// labels (ndisValidateNetClassifier), so the walk ends.
+static FORCEINLINE ULONG clsAncestor6(const NET_CLASSIFIER* cls, ULONG offset, ULONG count, ULONG label, ULONG length) {
+    const NET_CLS_PREFIX6* prefixes = (const NET_CLS_PREFIX6*)((const UCHAR*)cls + offset);
+    if (offset == 0 || label > count) { return 0; }
+    while (label != 0 && prefixes[label].length > length) { label = prefixes[label].parent; }
+    return (label != 0 && prefixes[label].length == length) ? label : 0;
+}
+
+static FORCEINLINE UINT32 clsMaskIp(UINT32 address, ULONG length) {
+    return address & (0xFFFFFFFFu << (32 - length));
+}
+
+// Length a prefix is keyed at: the longest multiple of the bucket step >>
+// level not over its own, or 1. Past the last level, its own.
+static FORCEINLINE UCHAR clsBucket(UCHAR length, ULONG step, ULONG level) {
+    step >>= level;
+    return (UCHAR)(step <= 1 ? length : length < step ? 1 : length - length % step);
+}
+
+// Prefix and range fields hash the label in place of the header field, or
+// the prefix cut to the tuple's length, and a checked range hashes 0; IPv6
+// keys already carry labels
+static FORCEINLINE VOID clsMaskKey(const NET_CLASSIFIER* cls, const NET_CLS_TUPLE* tuple, const NET_CLS_KEY* key,
+    const NET_CLS_LABELS* labels, PNET_CLS_KEY masked) {
+    ULONG fields = tuple->fields;
+    const UCHAR* length = tuple->length;
+
+    masked->ether_type = (fields & NET_CLS_F_ETHER_TYPE) ? key->ether_type : 0;
+    masked->protocol = (fields & NET_CLS_F_PROTOCOL) ? key->protocol : 0;
+    masked->shape = 0;
+    masked->source_ip = (fields & NET_CLS_F_SOURCE_IP) ? key->source_ip :
+        (fields & NET_CLS_F_SOURCE_PREFIX) ? (length[0] ?
+            clsMaskIp(key->source_ip, length[0]) : labels->label[NET_CLS_DIM_SOURCE_IP]) :
+        (fields & NET_CLS_F_SOURCE_IP6) ? (length[0] ?
+            clsAncestor6(cls, cls->source_prefixes6, cls->source_labels6, key->source_ip, length[0]) : key->source_ip) : 0;
+    masked->destination_ip = (fields & NET_CLS_F_DESTINATION_IP) ? key->destination_ip :
+        (fields & NET_CLS_F_DESTINATION_PREFIX) ? (length[1] ?
+            clsMaskIp(key->destination_ip, length[1]) : labels->label[NET_CLS_DIM_DESTINATION_IP]) :
+        (fields & NET_CLS_F_DESTINATION_IP6) ? (length[1] ?
+            clsAncestor6(cls, cls->destination_prefixes6, cls->destination_labels6, key->destination_ip, length[1]) :
+            key->destination_ip) : 0;
+    masked->source_port = (fields & NET_CLS_F_SOURCE_PORT) ? key->source_port :
+        (fields & NET_CLS_F_SOURCE_RANGE & ~tuple->checked) ? (UINT16)labels->label[NET_CLS_DIM_SOURCE_PORT] : 0;
+    masked->destination_port = (fields & NET_CLS_F_DESTINATION_PORT) ? key->destination_port :
+        (fields & NET_CLS_F_DESTINATION_RANGE & ~tuple->checked) ? (UINT16)labels->label[NET_CLS_DIM_DESTINATION_PORT] : 0;
+}
+
+// What a tuple that checks leaves to after the probe: the frame's label
+// has to be in the run of the rule's prefix, its port in the rule's range
+static FORCEINLINE BOOLEAN clsCheckMatch(const NET_CLS_CHECK* check, ULONG checked, const NET_CLS_KEY* key,
+    const NET_CLS_LABELS* labels) {
+    if ((checked & NET_CLS_F_SOURCE_PREFIX) &&
+        labels->label[NET_CLS_DIM_SOURCE_IP] - check->source_label >= check->source_labels) { return FALSE; }
+    if ((checked & NET_CLS_F_DESTINATION_PREFIX) &&
+        labels->label[NET_CLS_DIM_DESTINATION_IP] - check->destination_label >= check->destination_labels) { return FALSE; }
+    if ((checked & NET_CLS_F_SOURCE_IP6) && key->source_ip - check->source_label >= check->source_labels) { return FALSE; }
+    if ((checked & NET_CLS_F_DESTINATION_IP6) && key->destination_ip - check->destination_label >= check->destination_labels) { return FALSE; }
+    if ((checked & NET_CLS_F_SOURCE_RANGE) &&
+        (key->source_port < check->source_first || key->source_port > check->source_last)) { return FALSE; }
+    if ((checked & NET_CLS_F_DESTINATION_RANGE) &&
+        (key->destination_port < check->destination_first || key->destination_port > check->destination_last)) { return FALSE; }
+    return TRUE;
+}
+
+static FORCEINLINE BOOLEAN clsSameCheck(const NET_CLS_CHECK* a, const NET_CLS_CHECK* b) {
+    return (BOOLEAN)(a->source_first == b->source_first && a->source_last == b->source_last &&
+        a->destination_first == b->destination_first && a->destination_last == b->destination_last &&
+        a->source_label == b->source_label && a->source_labels == b->source_labels &&
+        a->destination_label == b->destination_label && a->destination_labels == b->destination_labels);
+}
+
+static FORCEINLINE PNET_CLS_SLOT clsSlots(const NET_CLASSIFIER* cls, const NET_CLS_TUPLE* tuple) {
+    return (PNET_CLS_SLOT)((PUCHAR)cls + tuple->slot_offset);
+}
+
+static BOOLEAN clsIsZero(const UCHAR* bytes, ULONG length) {
+    for (ULONG i = 0; i < length; i++) { if (bytes[i] != 0) { return FALSE; } }
+    return TRUE;
+}
+
+static VOID clsIpField(const UCHAR* ip, UCHAR length, ULONG exact_field, ULONG prefix_field,
+    PUINT32 key_ip, PUCHAR key_length, PULONG fields) {
+    UINT32 address = ((UINT32)ip[0] << 24) | ((UINT32)ip[1] << 16) | ((UINT32)ip[2] << 8) | ip[3];
+
+    if (length >= 1 && length <= 31) {
+        *key_ip = address & (0xFFFFFFFFu << (32 - length));
+        *key_length = length;
+        *fields |= prefix_field;
+    } else if (address != 0 || length != 0) {
+        // /32 is a host and stays in the exact tables; length 0 keeps the
+        // old meaning (0.0.0.0 - ignore)
+        *key_ip = address;
+        *fields |= exact_field;
+    }
+}
+
+static VOID clsIp6Field(const UCHAR* ip, UCHAR length, ULONG field,
+    PNET_LPM6_ADDRESS key_address, PUCHAR key_length, PULONG fields) {
+    if (length == 0 && clsIsZero(ip, 16)) { return; }
+    if (length == 0 || length > 128) { length = 128; }
+
+    UINT64 hi = 0, lo = 0;
+    for (ULONG i = 0; i < 8; i++) { hi = (hi << 8) | ip[i]; lo = (lo << 8) | ip[8 + i]; }
+    if (length <= 64) {
+        hi &= ~0ULL << (64 - length);
+        lo = 0;
+    } else if (length < 128) {
+        lo &= ~0ULL << (128 - length);
+    }
+    key_address->hi = hi;
+    key_address->lo = lo;
+    *key_length = length;
+    *fields |= field;
+}
+
+static VOID clsPortField(const UCHAR* port, const UCHAR* port_last, ULONG exact_field, ULONG range_field,
+    PUINT16 key_port, PUINT16 key_last, PULONG fields) {
+    UINT16 first = (UINT16)((port[0] << 8) | port[1]);
+    UINT16 last = (UINT16)((port_last[0] << 8) | port_last[1]);
+
+    if (last == 0) {
+        // Not a range: 0 means "ignore"
+        if (first != 0) { *key_port = first; *fields |= exact_field; }
+        return;
+    }
+    if (first > last) { UINT16 t = first; first = last; last = t; }
+    if (first == last) {
+        *key_port = first;
+        *fields |= exact_field;
+    } else if (first != 0 || last != 0xFFFF) {
+        *key_port = first;
+        *key_last = last;
+        *fields |= range_field;
+    }
+}
+
+static VOID clsRuleFromNet(const NET_RULES* rule, PNET_CLS_BUILD_RULE build) {
+    RtlZeroMemory(build, sizeof(NET_CLS_BUILD_RULE));
+    build->key.ether_type = (UINT16)((rule->ether_type[0] << 8) | rule->ether_type[1]);
+    build->key.protocol = rule->ip_next_protocol[0];
+
+    // 0 in a rule field means "ignore"
+    if (build->key.ether_type != 0) { build->fields |= NET_CLS_F_ETHER_TYPE; }
+    if (build->key.protocol != 0) { build->fields |= NET_CLS_F_PROTOCOL; }
+    if (!clsIsZero(rule->source_ip6, 16) || !clsIsZero(rule->destination_ip6, 16)) {
+        clsIp6Field(rule->source_ip6, rule->source_prefix_len[0], NET_CLS_F_SOURCE_IP6,
+            &build->address6[0], &build->length[0], &build->fields);
+        clsIp6Field(rule->destination_ip6, rule->destination_prefix_len[0], NET_CLS_F_DESTINATION_IP6,
+            &build->address6[1], &build->length[1], &build->fields);
+    } else {
+        clsIpField(rule->source_ip, rule->source_prefix_len[0], NET_CLS_F_SOURCE_IP, NET_CLS_F_SOURCE_PREFIX,
+            &build->key.source_ip, &build->length[0], &build->fields);
+        clsIpField(rule->destination_ip, rule->destination_prefix_len[0], NET_CLS_F_DESTINATION_IP, NET_CLS_F_DESTINATION_PREFIX,
+            &build->key.destination_ip, &build->length[1], &build->fields);
+    }
+    clsPortField(rule->source_port, rule->source_port_last, NET_CLS_F_SOURCE_PORT, NET_CLS_F_SOURCE_RANGE,
+        &build->key.source_port, &build->last[0], &build->fields);
+    clsPortField(rule->destination_port, rule->destination_port_last, NET_CLS_F_DESTINATION_PORT, NET_CLS_F_DESTINATION_RANGE,
+        &build->key.destination_port, &build->last[1], &build->fields);
+
+    for (ULONG dim = 0; dim < NET_CLS_DIMS; dim++) { build->label_count[dim] = 1; }
+}
+
+static FORCEINLINE UINT32 clsRuleAddress(const NET_CLS_BUILD_RULE* rule, ULONG dim) {
+    return dim == NET_CLS_DIM_SOURCE_IP ? rule->key.source_ip : rule->key.destination_ip;
+}
+
+static FORCEINLINE UINT16 clsRulePort(const NET_CLS_BUILD_RULE* rule, ULONG dim) {
+    return dim == NET_CLS_DIM_SOURCE_PORT ? rule->key.source_port : rule->key.destination_port;
+}
+
+static ULONG clsUnique(UINT64* values, ULONG count) {
+    ULONG distinct = 0;
+    ndisSortUint64(values, count);
+    for (ULONG i = 0; i < count; i++) {
+        if (distinct == 0 || values[i] != values[distinct - 1]) { values[distinct++] = values[i]; }
+    }
+    return distinct;
+}
+
+//
+// Prefix labels. The distinct prefixes of a dimension are sorted by
+// (address, length), so the prefixes nested in Q directly follow Q and a
+// rule on Q covers one contiguous run of labels. Label = position + 1.
+//
+static ULONG clsPrefixLabels(PNET_CLS_BUILD_RULE rules, ULONG rule_count, ULONG dim, UINT64* prefixes) {
+    ULONG count = 0;
+    for (ULONG i = 0; i < rule_count; i++) {
+        if (rules[i].fields & clsDimFields[dim]) {
+            prefixes[count++] = ((UINT64)clsRuleAddress(&rules[i], dim) << 8) | rules[i].length[dim];
+        }
+    }
+    count = clsUnique(prefixes, count);
+
+    for (ULONG i = 0; i < rule_count; i++) {
+        if (!(rules[i].fields & clsDimFields[dim])) { continue; }
+        UINT32 address = clsRuleAddress(&rules[i], dim);
+        UINT64 target = ((UINT64)address << 8) | rules[i].length[dim];
+        UINT64 end = (UINT64)address + ((UINT64)1 << (32 - rules[i].length[dim]));
+
+        ULONG lo = 0, hi = count;
+        while (lo < hi) {
+            ULONG mid = (lo + hi) / 2;
+            if (prefixes[mid] < target) { lo = mid + 1; } else { hi = mid; }
+        }
+        ULONG last = lo;
+        while (last + 1 < count && (prefixes[last + 1] >> 8) < end) { last++; }
+
+        rules[i].label_first[dim] = lo + 1;
+        rules[i].label_count[dim] = last - lo + 1;
+    }
+    return count;
+}
+
+// Prefixes for ndisLpmBuild: ascending length, labelled by address order
+static VOID clsLpmPrefixes(const UINT64* prefixes, ULONG count, UINT64* scratch, PNET_LPM_PREFIX lpm_prefixes) {
+    for (ULONG i = 0; i < count; i++) { scratch[i] = ((prefixes[i] & 0xFF) << 32) | i; }
+    ndisSortUint64(scratch, count);
+    for (ULONG i = 0; i < count; i++) {
+        ULONG index = (ULONG)scratch[i];
+        lpm_prefixes[i].address = (UINT32)(prefixes[index] >> 8);
+        lpm_prefixes[i].length = (UCHAR)prefixes[index];
+        lpm_prefixes[i].label = index + 1;
+    }
+}
+
+static VOID clsMask6(const NET_LPM6_ADDRESS* address, ULONG length, PNET_LPM6_ADDRESS masked) {
+    UINT64 hi_mask = length >= 64 ? ~0ULL : (length == 0 ? 0 : ~0ULL << (64 - length));
+    UINT64 lo_mask = length >= 128 ? ~0ULL : (length <= 64 ? 0 : ~0ULL << (128 - length));
+    masked->hi = address->hi & hi_mask;
+    masked->lo = address->lo & lo_mask;
+}
+
+static BOOLEAN clsPrefix6Contains(const NET_LPM6_PREFIX* outer, const NET_LPM6_ADDRESS* address) {
+    NET_LPM6_ADDRESS masked;
+    clsMask6(address, outer->length, &masked);
+    return ndisLpm6Equal(&masked, &outer->address);
+}
+
+// First of the sorted prefixes not below target in (address, length) order
+static ULONG clsPrefix6Find(const NET_LPM6_PREFIX* prefixes, ULONG count, const NET_LPM6_PREFIX* target) {
+    ULONG lo = 0, hi = count;
+    while (lo < hi) {
+        ULONG mid = (lo + hi) / 2;
+        const NET_LPM6_PREFIX* p = &prefixes[mid];
+        BOOLEAN less = p->address.hi != target->address.hi ? p->address.hi < target->address.hi :
+            p->address.lo != target->address.lo ? p->address.lo < target->address.lo : p->length < target->length;
+        if (less) { lo = mid + 1; } else { hi = mid; }
+    }
+    return lo;
+}
+
+// IPv6 prefixes labelled per rule: its own and one per bucket level
+static ULONG clsPrefixes6(VOID) {
+    ULONG count = 1;
+    for (ULONG step = NET_CLS_BUCKET6; step > 1; step >>= 1) { count++; }
+    return count;
+}
+
+// Same as clsPrefixLabels for one IPv6 dimension, with every prefix cut
+// back to each bucket length labelled too, for clsAncestor6 to find.
+// prefixes holds clsPrefixes6 entries per rule.
+
+static ULONG clsPrefix6Labels(PNET_CLS_BUILD_RULE rules, ULONG rule_count, ULONG dim, PNET_LPM6_PREFIX prefixes) {
+    ULONG side = dim - NET_CLS_DIM_SOURCE_IP6;
+    ULONG count = 0;
+    for (ULONG i = 0; i < rule_count; i++) {
+        if (!(rules[i].fields & clsDimFields[dim])) { continue; }
+        prefixes[count].address = rules[i].address6[side];
+        prefixes[count].length = rules[i].length[side];
+        prefixes[count].label = 0;
+        count++;
+        for (ULONG level = 0; (NET_CLS_BUCKET6 >> level) > 1; level++) {
+            UCHAR bucket = clsBucket(rules[i].length[side], NET_CLS_BUCKET6, level);
+            if (bucket == rules[i].length[side]) { continue; }
+            clsMask6(&rules[i].address6[side], bucket, &prefixes[count].address);
+            prefixes[count].length = bucket;
+            prefixes[count].label = 0;
+            count++;
+        }
+    }
+    ndisLpm6Sort(prefixes, count);
+    ULONG distinct = 0;
+    for (ULONG i = 0; i < count; i++) {
+        if (distinct == 0 || !ndisLpm6Equal(&prefixes[i].address, &prefixes[distinct - 1].address) ||
+            prefixes[i].length != prefixes[distinct - 1].length) {
+            prefixes[distinct++] = prefixes[i];
+        }
+    }
+    count = distinct;
+
+    for (ULONG i = 0; i < count; i++) { prefixes[i].label = i + 1; }
+
+    for (ULONG i = 0; i < rule_count; i++) {
+        if (!(rules[i].fields & clsDimFields[dim])) { continue; }
+        NET_LPM6_PREFIX target;
+        target.address = rules[i].address6[side];
+        target.length = rules[i].length[side];
+
+        ULONG lo = clsPrefix6Find(prefixes, count, &target);
+        ULONG last = lo;
+        while (last + 1 < count && clsPrefix6Contains(&target, &prefixes[last + 1].address)) { last++; }
+
+        rules[i].label_first[dim] = lo + 1;
+        rules[i].label_count[dim] = last - lo + 1;
+    }
+    return count;
+}
+
+// Labels of the IPv6 prefixes of a rule cut back to their key lengths
+static VOID clsBucketLabels(PNET_CLS_BUILD_RULE rule, PNET_LPM6_PREFIX* labels6, const ULONG* label_count) {
+    for (ULONG side = 0; side < 2; side++) {
+        NET_LPM6_PREFIX target;
+        if (!(rule->fields & clsDimFields[NET_CLS_DIM_SOURCE_IP6 + side])) { continue; }
+        target.length = clsBucket(rule->length[side], NET_CLS_BUCKET6, rule->level);
+        clsMask6(&rule->address6[side], target.length, &target.address);
+        rule->bucket_label[side] = clsPrefix6Find(labels6[side], label_count[NET_CLS_DIM_SOURCE_IP6 + side], &target) + 1;
+    }
+}
+
+// Nesting of labelled IPv6 prefixes for clsAncestor6. In (address, length)
+// order a prefix follows everything that contains it, so the prefixes
+// still open on a stack are its ancestors. stack holds count values.
+static VOID clsPrefix6Parents(const NET_LPM6_PREFIX* prefixes, ULONG count, UINT64* stack, PNET_CLS_PREFIX6 parents) {
+    ULONG depth = 0;
+    parents[0].parent = 0;
+    parents[0].length = 0;
+    for (ULONG i = 0; i < count; i++) {
+        while (depth > 0 && !clsPrefix6Contains(&prefixes[stack[depth - 1]], &prefixes[i].address)) { depth--; }
+        parents[i + 1].parent = depth > 0 ? (ULONG)stack[depth - 1] + 1 : 0;
+        parents[i + 1].length = prefixes[i].length;
+        stack[depth++] = i;
+    }
+}
+
+// Reorders labelled IPv6 prefixes by ascending length for ndisLpm6Build
+static VOID clsLpm6Prefixes(const NET_LPM6_PREFIX* prefixes, ULONG count, UINT64* scratch, PNET_LPM6_PREFIX lpm_prefixes) {
+    for (ULONG i = 0; i < count; i++) { scratch[i] = ((UINT64)prefixes[i].length << 32) | i; }
+    ndisSortUint64(scratch, count);
+    for (ULONG i = 0; i < count; i++) { lpm_prefixes[i] = prefixes[(ULONG)scratch[i]]; }
+}
+
+//
+// Port labels. The range end points cut 0..65535 into elementary intervals,
+// each either fully inside or fully outside every range, and the map gives
+// the interval of a port. Label = interval index.
+//
+static VOID clsPortLabels(PNET_CLS_BUILD_RULE rules, ULONG rule_count, ULONG dim, UINT64* bounds, PUINT16 map) {
+    ULONG side = dim - NET_CLS_DIM_SOURCE_PORT;
+    ULONG count = 0;
+    bounds[count++] = 0;
+    for (ULONG i = 0; i < rule_count; i++) {
+        if (rules[i].fields & clsDimFields[dim]) {
+            bounds[count++] = clsRulePort(&rules[i], dim);
+            bounds[count++] = (UINT64)rules[i].last[side] + 1;
+        }
+    }
+    count = clsUnique(bounds, count);
+    if (bounds[count - 1] == NET_CLS_PORTS) { count--; }
+
+    for (ULONG k = 0; k < count; k++) {
+        ULONG end = (k + 1 < count) ? (ULONG)bounds[k + 1] : NET_CLS_PORTS;
+        for (ULONG port = (ULONG)bounds[k]; port < end; port++) { map[port] = (UINT16)k; }
+    }
+
+    for (ULONG i = 0; i < rule_count; i++) {
+        if (!(rules[i].fields & clsDimFields[dim])) { continue; }
+        ULONG first = map[clsRulePort(&rules[i], dim)];
+        rules[i].label_first[dim] = first;
+        rules[i].label_count[dim] = (ULONG)map[rules[i].last[side]] - first + 1;
+    }
+}
+
+// Number of slots a rule takes in a tuple: one per label combination.
+// Saturates above NET_CLS_MAX_EXPANSION.
+static ULONG clsExpansion(const NET_CLS_BUILD_RULE* rule, ULONG fields) {
+    ULONG count = 1;
+    for (ULONG dim = 0; dim < NET_CLS_DIMS; dim++) {
+        if (fields & clsDimFields[dim]) {
+            if (rule->label_count[dim] > NET_CLS_MAX_EXPANSION) { return NET_CLS_MAX_EXPANSION + 1; }
+            count *= rule->label_count[dim];
+            if (count > NET_CLS_MAX_EXPANSION) { return NET_CLS_MAX_EXPANSION + 1; }
+        }
+    }
+    return count;
+}
+
+// Prefix fields a rule is keyed on at their length in mode
+static ULONG clsKeyed(const NET_CLS_BUILD_RULE* rule, ULONG mode) {
+    ULONG source = rule->fields & NET_CLS_F_SOURCE_PREFIXES;
+    ULONG destination = rule->fields & NET_CLS_F_DESTINATION_PREFIXES;
+    if (mode == NET_CLS_MODE_LABELS) { return 0; }
+    if (mode == NET_CLS_MODE_PREFIX) {
+        ULONG source_labels = source ? rule->label_count[(source & NET_CLS_F_SOURCE_IP6) ? NET_CLS_DIM_SOURCE_IP6 : NET_CLS_DIM_SOURCE_IP] : 0;
+        ULONG destination_labels = destination ?
+            rule->label_count[(destination & NET_CLS_F_DESTINATION_IP6) ? NET_CLS_DIM_DESTINATION_IP6 : NET_CLS_DIM_DESTINATION_IP] : 0;
+        return source_labels >= destination_labels ? source : destination;
+    }
+    return source | destination;
+}
+
+// Fields a rule is expanded over in its mode
+static FORCEINLINE ULONG clsLabelled(const NET_CLS_BUILD_RULE* rule) {
+    return rule->fields & ~rule->keyed & ~(rule->mode == NET_CLS_MODE_RANGES ? NET_CLS_F_RANGES : 0);
+}
+
+// Length a keyed prefix of a rule is cut to, source (0) or destination
+static FORCEINLINE UCHAR clsKeyLength(const NET_CLS_BUILD_RULE* rule, ULONG side) {
+    ULONG ip6 = side == 0 ? NET_CLS_F_SOURCE_IP6 : NET_CLS_F_DESTINATION_IP6;
+    return clsBucket(rule->length[side], (rule->fields & ip6) ? NET_CLS_BUCKET6 : NET_CLS_BUCKET, rule->level);
+}
+
+// What tells the tuples of one field set apart: the prefix lengths a rule
+// is keyed at, source and destination, and the ranges it has checked
+static ULONG clsRuleLayout(const NET_CLS_BUILD_RULE* rule) {
+    ULONG layout = 0;
+    if (rule->keyed & NET_CLS_F_SOURCE_PREFIXES) { layout |= clsKeyLength(rule, 0); }
+    if (rule->keyed & NET_CLS_F_DESTINATION_PREFIXES) { layout |= (ULONG)clsKeyLength(rule, 1) << 8; }
+    if (rule->mode == NET_CLS_MODE_RANGES) { layout |= (rule->fields & NET_CLS_F_RANGES) << 16; }
+    return layout;
+}
+
+// Fields its tuple has to check for a rule: ranges left out of the key and
+// prefixes keyed shorter than they are
+static ULONG clsRuleChecked(const NET_CLS_BUILD_RULE* rule) {
+    ULONG checked = (rule->mode == NET_CLS_MODE_RANGES) ? rule->fields & NET_CLS_F_RANGES : 0;
+    if (clsKeyLength(rule, 0) != rule->length[0]) { checked |= rule->keyed & NET_CLS_F_SOURCE_PREFIXES; }
+    if (clsKeyLength(rule, 1) != rule->length[1]) { checked |= rule->keyed & NET_CLS_F_DESTINATION_PREFIXES; }
+    return checked;
+}
+
+// The key a rule is stored under in its tuple, for one label combination
+static VOID clsRuleKey(const NET_CLS_BUILD_RULE* rule, const NET_CLS_LABELS* labels, PNET_CLS_KEY key) {
+    ULONG fields = rule->fields;
+    ULONG labelled = clsLabelled(rule);
+
+    key->ether_type = (fields & NET_CLS_F_ETHER_TYPE) ? rule->key.ether_type : 0;
+    key->protocol = (fields & NET_CLS_F_PROTOCOL) ? rule->key.protocol : 0;
+    key->shape = 0;
+    key->source_ip = (fields & NET_CLS_F_SOURCE_IP) ? rule->key.source_ip :
+        (labelled & NET_CLS_F_SOURCE_PREFIX) ? labels->label[NET_CLS_DIM_SOURCE_IP] :
+        (labelled & NET_CLS_F_SOURCE_IP6) ? labels->label[NET_CLS_DIM_SOURCE_IP6] :
+        (fields & NET_CLS_F_SOURCE_PREFIX) ? clsMaskIp(rule->key.source_ip, clsKeyLength(rule, 0)) :
+        (fields & NET_CLS_F_SOURCE_IP6) ? rule->bucket_label[0] : 0;
+    key->destination_ip = (fields & NET_CLS_F_DESTINATION_IP) ? rule->key.destination_ip :
+        (labelled & NET_CLS_F_DESTINATION_PREFIX) ? labels->label[NET_CLS_DIM_DESTINATION_IP] :
+        (labelled & NET_CLS_F_DESTINATION_IP6) ? labels->label[NET_CLS_DIM_DESTINATION_IP6] :
+        (fields & NET_CLS_F_DESTINATION_PREFIX) ? clsMaskIp(rule->key.destination_ip, clsKeyLength(rule, 1)) :
+        (fields & NET_CLS_F_DESTINATION_IP6) ? rule->bucket_label[1] : 0;
+    key->source_port = (fields & NET_CLS_F_SOURCE_PORT) ? rule->key.source_port :
+        (labelled & NET_CLS_F_SOURCE_RANGE) ? (UINT16)labels->label[NET_CLS_DIM_SOURCE_PORT] : 0;
+    key->destination_port = (fields & NET_CLS_F_DESTINATION_PORT) ? rule->key.destination_port :
+        (labelled & NET_CLS_F_DESTINATION_RANGE) ? (UINT16)labels->label[NET_CLS_DIM_DESTINATION_PORT] : 0;
+}
+
+//
+// Build-time lookup of the tuple with given fields and layout among the
+// build entries of one shape. index holds entry + 1, 0 - empty; the caller
+// clears it per shape.
+//
+static FORCEINLINE ULONG clsTupleHash(ULONG fields, ULONG layout) {
+    return (ULONG)((((UINT64)fields << 32 | layout) * 0x9E3779B97F4A7C15ULL) >> 40);
+}
+
+static ULONG clsFindTuple(const NET_CLS_BUILD_TUPLE* build, PULONG index, ULONG fields, ULONG layout) {
+    ULONG s = clsTupleHash(fields, layout) & (NET_CLS_TUPLE_INDEX - 1);
+    for (; index[s] != 0; s = (s + 1) & (NET_CLS_TUPLE_INDEX - 1)) {
+        const NET_CLS_BUILD_TUPLE* tuple = &build[index[s] - 1];
+        if (tuple->fields == fields && tuple->layout == layout) { return index[s] - 1; }
+    }
+    return NET_CLS_NO_MATCH;
+}
+
+static VOID clsIndexTuple(const NET_CLS_BUILD_TUPLE* build, PULONG index, ULONG tuple) {
+    ULONG s = clsTupleHash(build[tuple].fields, build[tuple].layout) & (NET_CLS_TUPLE_INDEX - 1);
+    while (index[s] != 0) { s = (s + 1) & (NET_CLS_TUPLE_INDEX - 1); }
+    index[s] = tuple + 1;
+}
+
+static VOID clsWideFromBuild(const NET_CLS_BUILD_RULE* rule, ULONG index, PNET_CLS_WIDE wide) {
+    ULONG source_dim = (rule->fields & NET_CLS_F_SOURCE_IP6) ? NET_CLS_DIM_SOURCE_IP6 : NET_CLS_DIM_SOURCE_IP;
+    ULONG destination_dim = (rule->fields & NET_CLS_F_DESTINATION_IP6) ? NET_CLS_DIM_DESTINATION_IP6 : NET_CLS_DIM_DESTINATION_IP;
+
+    wide->key = rule->key;
+    wide->rule = index;
+    wide->fields = rule->fields;
+    wide->source_label = rule->label_first[source_dim];
+    wide->source_labels = rule->label_count[source_dim];
+    wide->destination_label = rule->label_first[destination_dim];
+    wide->destination_labels = rule->label_count[destination_dim];
+    wide->source_last = rule->last[0];
+    wide->destination_last = rule->last[1];
+}
+
+static FORCEINLINE BOOLEAN clsWideMatch(const NET_CLS_WIDE* wide, const NET_CLS_KEY* key, const NET_CLS_LABELS* labels) {
+    ULONG fields = wide->fields;
+    if ((fields & NET_CLS_F_ETHER_TYPE) && key->ether_type != wide->key.ether_type) { return FALSE; }
+    if ((fields & NET_CLS_F_PROTOCOL) && key->protocol != wide->key.protocol) { return FALSE; }
+    if ((fields & NET_CLS_F_SOURCE_IP) && key->source_ip != wide->key.source_ip) { return FALSE; }
+    if ((fields & NET_CLS_F_DESTINATION_IP) && key->destination_ip != wide->key.destination_ip) { return FALSE; }
+    if ((fields & NET_CLS_F_SOURCE_PREFIX) &&
+        labels->label[NET_CLS_DIM_SOURCE_IP] - wide->source_label >= wide->source_labels) { return FALSE; }
+    if ((fields & NET_CLS_F_DESTINATION_PREFIX) &&
+        labels->label[NET_CLS_DIM_DESTINATION_IP] - wide->destination_label >= wide->destination_labels) { return FALSE; }
+    if ((fields & NET_CLS_F_SOURCE_IP6) && key->source_ip - wide->source_label >= wide->source_labels) { return FALSE; }
+    if ((fields & NET_CLS_F_DESTINATION_IP6) && key->destination_ip - wide->destination_label >= wide->destination_labels) { return FALSE; }
+    if ((fields & NET_CLS_F_SOURCE_PORT) && key->source_port != wide->key.source_port) { return FALSE; }
+    if ((fields & NET_CLS_F_DESTINATION_PORT) && key->destination_port != wide->key.destination_port) { return FALSE; }
+    if ((fields & NET_CLS_F_SOURCE_RANGE) &&
+        (key->source_port < wide->key.source_port || key->source_port > wide->source_last)) { return FALSE; }
+    if ((fields & NET_CLS_F_DESTINATION_RANGE) &&
+        (key->destination_port < wide->key.destination_port || key->destination_port > wide->destination_last)) { return FALSE; }
+    return TRUE;
+}
+
+// A tuple that checks keeps every rule on a key, in the order they are
+// inserted, unless an earlier one checks the same
+static VOID clsInsert(PNET_CLASSIFIER cls, PNET_CLS_TUPLE tuple, const NET_CLS_KEY* key, ULONG rule) {
+    PNET_CLS_SLOT slots = clsSlots(cls, tuple);
+    const NET_CLS_CHECK* checks = (const NET_CLS_CHECK*)((const UCHAR*)cls + cls->check_offset);
+    ULONG s = ndisClsKeyHash(key) & tuple->slot_mask;
+    while (slots[s].rule != NET_CLS_NO_MATCH) {
+        if (ndisClsKeyEqual(&slots[s].key, key) &&
+            (tuple->checked == 0 || clsSameCheck(&checks[slots[s].rule], &checks[rule]))) { return; }
+        s = (s + 1) & tuple->slot_mask;
+    }
+    slots[s].key = *key;
+    slots[s].rule = rule;
+}
+
+// Rules that need any of which checked, grouped by tuple and by the key of
+// their first label combination: scratch gets (hash, rule) for each, sorted
+static ULONG clsCheckedKeys(const NET_CLS_BUILD_RULE* rules, ULONG rule_count, ULONG which, UINT64* scratch) {
+    ULONG count = 0;
+    for (ULONG i = 0; i < rule_count; i++) {
+        const NET_CLS_BUILD_RULE* rule = &rules[i];
+        NET_CLS_LABELS first;
+        NET_CLS_KEY key;
+        if (rule->mode == NET_CLS_MODE_WIDE || (clsRuleChecked(rule) & which) == 0) { continue; }
+        for (ULONG dim = 0; dim < NET_CLS_DIMS; dim++) { first.label[dim] = rule->label_first[dim]; }
+        clsRuleKey(rule, &first, &key);
+        scratch[count++] = ((UINT64)(ndisClsKeyHash(&key) ^ clsTupleHash(rule->fields, clsRuleLayout(rule))) << 32) | i;
+    }
+    ndisSortUint64(scratch, count);
+    return count;
+}
+
+PNET_CLASSIFIER ndisCompileNetRules(PNET_RULES rules) {
+    ULONG rule_count = 0;
+    for (PNET_RULES rule_ptr = rules; rule_ptr != NULL; rule_ptr = rule_ptr->_next) { rule_count++; }
+    if (rule_count == 0) { return NULL; }
+
+    ULONG dim, i;
+    ULONG label_count[NET_CLS_DIMS] = { 0, 0, 0, 0, 0, 0 };
+    UINT64* labels[2] = { NULL, NULL };
+    PNET_LPM6_PREFIX labels6[2] = { NULL, NULL };
+    PUINT16 port_map[2] = { NULL, NULL };
+    BOOLEAN ranges[2] = { FALSE, FALSE };
+    PNET_CLS_BUILD_RULE build_rules = (PNET_CLS_BUILD_RULE)NETFLT_ALLOC(rule_count * sizeof(NET_CLS_BUILD_RULE), NET_CLS_TAG);
+    PNET_CLS_BUILD_TUPLE build = (PNET_CLS_BUILD_TUPLE)NETFLT_ALLOC(NET_CLS_MAX_TUPLES * sizeof(NET_CLS_BUILD_TUPLE), NET_CLS_TAG);
+    UINT64* scratch = (UINT64*)NETFLT_ALLOC((clsPrefixes6() * rule_count + 1) * sizeof(UINT64), NET_CLS_TAG);
+    PNET_LPM_PREFIX lpm_prefixes = (PNET_LPM_PREFIX)NETFLT_ALLOC(rule_count * sizeof(NET_LPM_PREFIX), NET_CLS_TAG);
+    PNET_LPM6_PREFIX lpm6_prefixes = (PNET_LPM6_PREFIX)NETFLT_ALLOC(clsPrefixes6() * rule_count * sizeof(NET_LPM6_PREFIX), NET_CLS_TAG);
+    PNET_LPM6_PREFIX lpm6_scratch = (PNET_LPM6_PREFIX)NETFLT_ALLOC(clsPrefixes6() * rule_count * sizeof(NET_LPM6_PREFIX), NET_CLS_TAG);
+    PULONG tuple_index = (PULONG)NETFLT_ALLOC(NET_CLS_TUPLE_INDEX * sizeof(ULONG), NET_CLS_TAG);
+    PNET_CLASSIFIER cls = NULL;
+    if (build_rules == NULL || build == NULL || scratch == NULL || lpm_prefixes == NULL ||
+        lpm6_prefixes == NULL || lpm6_scratch == NULL || tuple_index == NULL) {
+        goto cleanup;
+    }
+
+    i = 0;
+    for (PNET_RULES rule_ptr = rules; rule_ptr != NULL; rule_ptr = rule_ptr->_next, i++) {
+        clsRuleFromNet(rule_ptr, &build_rules[i]);
+        if (build_rules[i].fields & NET_CLS_F_SOURCE_RANGE) { ranges[0] = TRUE; }
+        if (build_rules[i].fields & NET_CLS_F_DESTINATION_RANGE) { ranges[1] = TRUE; }
+    }
+
+    // Label every prefix and port range up front: a rule's slot count
+    // depends on how many labels it covers
+    for (dim = NET_CLS_DIM_SOURCE_IP; dim <= NET_CLS_DIM_DESTINATION_IP; dim++) {
+        labels[dim] = (UINT64*)NETFLT_ALLOC(rule_count * sizeof(UINT64), NET_CLS_TAG);
+        if (labels[dim] == NULL) { goto cleanup; }
+        label_count[dim] = clsPrefixLabels(build_rules, rule_count, dim, labels[dim]);
+    }
+    for (dim = NET_CLS_DIM_SOURCE_IP6; dim <= NET_CLS_DIM_DESTINATION_IP6; dim++) {
+        labels6[dim - NET_CLS_DIM_SOURCE_IP6] = (PNET_LPM6_PREFIX)NETFLT_ALLOC(clsPrefixes6() * rule_count * sizeof(NET_LPM6_PREFIX), NET_CLS_TAG);
+        if (labels6[dim - NET_CLS_DIM_SOURCE_IP6] == NULL) { goto cleanup; }
+        label_count[dim] = clsPrefix6Labels(build_rules, rule_count, dim, labels6[dim - NET_CLS_DIM_SOURCE_IP6]);
+    }
+    for (dim = NET_CLS_DIM_SOURCE_PORT; dim <= NET_CLS_DIM_DESTINATION_PORT; dim++) {
+        if (!ranges[dim - NET_CLS_DIM_SOURCE_PORT]) { continue; }
+        port_map[dim - NET_CLS_DIM_SOURCE_PORT] = (PUINT16)NETFLT_ALLOC(NET_CLS_PORTS * sizeof(UINT16), NET_CLS_TAG);
+        if (port_map[dim - NET_CLS_DIM_SOURCE_PORT] == NULL) { goto cleanup; }
+        clsPortLabels(build_rules, rule_count, dim, scratch, port_map[dim - NET_CLS_DIM_SOURCE_PORT]);
+    }
+
+    // A rule that expands too far is keyed on its prefix lengths, then has
+    // its ranges checked too: each takes the first mode that stores it in at
+    // most limit keys, and limit halves until the keys fit the slot budget.
+    // Each step down adds tuples, or rules to walk on a key, so the budget
+    // is only spent on keeping them few.
+    ULONG expanded = 0;
+    ULONG budget = NET_CLS_MAX_EXPANDED + rule_count * NET_CLS_RULE_EXPANDED;
+    BOOLEAN keyed6[2] = { FALSE, FALSE };
+    for (i = 0; i < rule_count; i++) {
+        PNET_CLS_BUILD_RULE rule = &build_rules[i];
+        rule->cost[NET_CLS_MODE_LABELS] = clsExpansion(rule, rule->fields);
+        rule->cost[NET_CLS_MODE_PREFIX] = clsExpansion(rule, rule->fields & ~clsKeyed(rule, NET_CLS_MODE_PREFIX));
+        rule->cost[NET_CLS_MODE_PREFIXES] = clsExpansion(rule, rule->fields & ~clsKeyed(rule, NET_CLS_MODE_PREFIXES));
+        rule->cost[NET_CLS_MODE_RANGES] = 1;
+    }
+    for (ULONG limit = NET_CLS_MAX_EXPANSION; ; limit /= 2) {
+        expanded = 0;
+        for (i = 0; i < rule_count; i++) {
+            PNET_CLS_BUILD_RULE rule = &build_rules[i];
+            for (rule->mode = NET_CLS_MODE_LABELS; rule->cost[rule->mode] > limit; rule->mode++) {}
+            expanded += rule->cost[rule->mode];
+        }
+        if (expanded <= budget || limit == 1) { break; }
+    }
+
+    // Keyed prefixes are cut back to their bucket lengths, so that the
+    // tuples stay few however many lengths the rules use. Rules in one
+    // bucket share a key, and a lookup may walk all of them: past
+    // NET_CLS_MAX_CHECKED on one key a rule goes down a level, to half
+    // the step, until it is keyed at its own lengths.
+    for (i = 0; i < rule_count; i++) { build_rules[i].keyed = clsKeyed(&build_rules[i], build_rules[i].mode); }
+    ULONG checked;
+    for (BOOLEAN split = TRUE; split; ) {
+        split = FALSE;
+        for (i = 0; i < rule_count; i++) { clsBucketLabels(&build_rules[i], labels6, label_count); }
+        checked = clsCheckedKeys(build_rules, rule_count, NET_CLS_F_SOURCE_PREFIXES | NET_CLS_F_DESTINATION_PREFIXES, scratch);
+        for (ULONG run = 0, k = 0; k < checked; k++) {
+            run = (k > 0 && (scratch[k] >> 32) == (scratch[k - 1] >> 32)) ? run + 1 : 0;
+            if (run >= NET_CLS_MAX_CHECKED) {
+                build_rules[(ULONG)scratch[k]].level++;
+                split = TRUE;
+            }
+        }
+    }
+
+    // Rules that only differ in their checked ranges share a key the same
+    // way: past NET_CLS_MAX_CHECKED a rule is expanded over its ranges
+    // after all, if that fits. Otherwise the walk is still only over the
+    // rules on the frame's prefixes, where the wide list would be walked
+    // for every frame.
+    checked = clsCheckedKeys(build_rules, rule_count, NET_CLS_F_RANGES, scratch);
+    for (ULONG run = 0, k = 0; k < checked; k++) {
+        run = (k > 0 && (scratch[k] >> 32) == (scratch[k - 1] >> 32)) ? run + 1 : 0;
+        if (run < NET_CLS_MAX_CHECKED) { continue; }
+        PNET_CLS_BUILD_RULE rule = &build_rules[(ULONG)scratch[k]];
+        if (rule->cost[NET_CLS_MODE_PREFIXES] <= NET_CLS_MAX_EXPANSION && expanded + rule->cost[NET_CLS_MODE_PREFIXES] - 1 <= budget) {
+            rule->mode = NET_CLS_MODE_PREFIXES;
+            expanded += rule->cost[rule->mode] - 1;
+        }
+    }
+    for (i = 0; i < rule_count; i++) {
+        PNET_CLS_BUILD_RULE rule = &build_rules[i];
+        if (rule->mode == NET_CLS_MODE_WIDE) { continue; }
+        rule->keyed = clsKeyed(rule, rule->mode);
+        if (rule->keyed & NET_CLS_F_SOURCE_IP6) { keyed6[0] = TRUE; }
+        if (rule->keyed & NET_CLS_F_DESTINATION_IP6) { keyed6[1] = TRUE; }
+    }
+
+    // Pass 1: discover tuples per shape, in order of their first rule. A
+    // rule that finds no room for a new tuple goes to the wide list.
+    ULONG tuple_count = 0;
+    ULONG shape_first[NET_CLS_SHAPES];
+    ULONG shape_count[NET_CLS_SHAPES];
+    BOOLEAN checking = FALSE;
+    for (ULONG shape = 0; shape < NET_CLS_SHAPES; shape++) {
+        shape_first[shape] = tuple_count;
+        RtlZeroMemory(tuple_index, NET_CLS_TUPLE_INDEX * sizeof(ULONG));
+        for (i = 0; i < rule_count; i++) {
+            PNET_CLS_BUILD_RULE rule = &build_rules[i];
+            if (rule->mode == NET_CLS_MODE_WIDE || !clsRuleInShape(rule->fields, shape)) { continue; }
+            ULONG layout = clsRuleLayout(rule);
+            ULONG t = clsFindTuple(build, tuple_index, rule->fields, layout);
+            if (t == NET_CLS_NO_MATCH) {
+                if (tuple_count == NET_CLS_MAX_TUPLES) {
+                    rule->mode = NET_CLS_MODE_WIDE;
+                    continue;
+                }
+                t = tuple_count++;
+                build[t].fields = rule->fields;
+                build[t].min_rule = i;
+                build[t].count = 0;
+                build[t].layout = layout;
+                build[t].checked = 0;
+                clsIndexTuple(build, tuple_index, t);
+            }
+            build[t].count += clsExpansion(rule, clsLabelled(rule));
+            build[t].checked |= clsRuleChecked(rule);
+            if (build[t].checked != 0) { checking = TRUE; }
+        }
+        shape_count[shape] = tuple_count - shape_first[shape];
+    }
+
+    ULONG wide_count = 0;
+    for (i = 0; i < rule_count; i++) { wide_count += (build_rules[i].mode == NET_CLS_MODE_WIDE); }
+
+    // Pass 2: size the tables (load factor <= 1/2) and lay out the blob:
+    // header, tuples, slots, wide rules, then the LPM tables, port maps,
+    // IPv6 prefix nesting and what the rules have checked
+    ULONG size = FIELD_OFFSET(NET_CLASSIFIER, tuples) + tuple_count * sizeof(NET_CLS_TUPLE);
+    for (ULONG t = 0; t < tuple_count; t++) {
+        ULONG slots = 2;
+        while (slots < 2 * build[t].count) { slots <<= 1; }
+        build[t].count = slots;
+        size += slots * sizeof(NET_CLS_SLOT);
+    }
+    ULONG wide_offset = size;
+    size += wide_count * sizeof(NET_CLS_WIDE);
+
+    ULONG table_offset[NET_CLS_DIMS] = { 0, 0, 0, 0, 0, 0 };
+    ULONG prefixes6_offset[2] = { 0, 0 };
+    for (dim = NET_CLS_DIM_SOURCE_IP; dim <= NET_CLS_DIM_DESTINATION_IP; dim++) {
+        if (label_count[dim] == 0) { continue; }
+        clsLpmPrefixes(labels[dim], label_count[dim], scratch, lpm_prefixes);
+        table_offset[dim] = size;
+        size += ndisLpmSize(lpm_prefixes, label_count[dim], scratch);
+    }
+    for (dim = NET_CLS_DIM_SOURCE_IP6; dim <= NET_CLS_DIM_DESTINATION_IP6; dim++) {
+        if (label_count[dim] == 0) { continue; }
+        size = (size + sizeof(UINT64) - 1) & ~(ULONG)(sizeof(UINT64) - 1);
+        table_offset[dim] = size;
+        size += ndisLpm6Size(labels6[dim - NET_CLS_DIM_SOURCE_IP6], label_count[dim], lpm6_scratch);
+    }
+    for (dim = NET_CLS_DIM_SOURCE_PORT; dim <= NET_CLS_DIM_DESTINATION_PORT; dim++) {
+        if (port_map[dim - NET_CLS_DIM_SOURCE_PORT] == NULL) { continue; }
+        table_offset[dim] = size;
+        size += NET_CLS_PORTS * sizeof(UINT16);
+    }
+    for (dim = 0; dim < 2; dim++) {
+        if (!keyed6[dim]) { continue; }
+        prefixes6_offset[dim] = size;
+        size += (label_count[NET_CLS_DIM_SOURCE_IP6 + dim] + 1) * sizeof(NET_CLS_PREFIX6);
+    }
+    size = (size + sizeof(ULONG) - 1) & ~(ULONG)(sizeof(ULONG) - 1);
+    ULONG check_offset = checking ? size : 0;
+    if (checking) { size += rule_count * sizeof(NET_CLS_CHECK); }
+
+    cls = (PNET_CLASSIFIER)NETFLT_ALLOC(size, NET_CLS_TAG);
+    if (cls == NULL) { goto cleanup; }
+    RtlZeroMemory(cls, size);
+
+    cls->size = size;
+    cls->rule_count = rule_count;
+    cls->tuple_count = tuple_count;
+    cls->wide_count = wide_count;
+    cls->wide_offset = wide_offset;
+    cls->source_lpm = table_offset[NET_CLS_DIM_SOURCE_IP];
+    cls->destination_lpm = table_offset[NET_CLS_DIM_DESTINATION_IP];
+    cls->source_lpm6 = table_offset[NET_CLS_DIM_SOURCE_IP6];
+    cls->destination_lpm6 = table_offset[NET_CLS_DIM_DESTINATION_IP6];
+    cls->source_ports = table_offset[NET_CLS_DIM_SOURCE_PORT];
+    cls->destination_ports = table_offset[NET_CLS_DIM_DESTINATION_PORT];
+    cls->source_prefixes6 = prefixes6_offset[0];
+    cls->destination_prefixes6 = prefixes6_offset[1];
+    cls->source_labels6 = keyed6[0] ? label_count[NET_CLS_DIM_SOURCE_IP6] : 0;
+    cls->destination_labels6 = keyed6[1] ? label_count[NET_CLS_DIM_DESTINATION_IP6] : 0;
+    cls->check_offset = check_offset;
+    RtlCopyMemory(cls->shape_first, shape_first, sizeof(shape_first));
+    RtlCopyMemory(cls->shape_count, shape_count, sizeof(shape_count));
+
+    for (dim = NET_CLS_DIM_SOURCE_IP; dim <= NET_CLS_DIM_DESTINATION_IP; dim++) {
+        if (table_offset[dim] == 0) { continue; }
+        clsLpmPrefixes(labels[dim], label_count[dim], scratch, lpm_prefixes);
+        ndisLpmBuild((PNET_LPM)((PUCHAR)cls + table_offset[dim]), lpm_prefixes, label_count[dim]);
+    }
+    for (dim = 0; dim < 2; dim++) {
+        if (prefixes6_offset[dim] == 0) { continue; }
+        clsPrefix6Parents(labels6[dim], label_count[NET_CLS_DIM_SOURCE_IP6 + dim], scratch,
+            (PNET_CLS_PREFIX6)((PUCHAR)cls + prefixes6_offset[dim]));
+    }
+    for (dim = NET_CLS_DIM_SOURCE_IP6; dim <= NET_CLS_DIM_DESTINATION_IP6; dim++) {
+        if (table_offset[dim] == 0) { continue; }
+        clsLpm6Prefixes(labels6[dim - NET_CLS_DIM_SOURCE_IP6], label_count[dim], scratch, lpm6_prefixes);
+        ndisLpm6Build((PNET_LPM6)((PUCHAR)cls + table_offset[dim]), lpm6_prefixes, label_count[dim]);
+    }
+    for (dim = NET_CLS_DIM_SOURCE_PORT; dim <= NET_CLS_DIM_DESTINATION_PORT; dim++) {
+        if (table_offset[dim] == 0) { continue; }
+        RtlCopyMemory((PUCHAR)cls + table_offset[dim], port_map[dim - NET_CLS_DIM_SOURCE_PORT], NET_CLS_PORTS * sizeof(UINT16));
+    }
+
+    PNET_CLS_CHECK check = (PNET_CLS_CHECK)((PUCHAR)cls + check_offset);
+    for (i = 0; i < rule_count && checking; i++) {
+        ULONG source_dim = (build_rules[i].fields & NET_CLS_F_SOURCE_IP6) ? NET_CLS_DIM_SOURCE_IP6 : NET_CLS_DIM_SOURCE_IP;
+        ULONG destination_dim = (build_rules[i].fields & NET_CLS_F_DESTINATION_IP6) ? NET_CLS_DIM_DESTINATION_IP6 : NET_CLS_DIM_DESTINATION_IP;
+        check[i].source_first = build_rules[i].key.source_port;
+        check[i].source_last = build_rules[i].last[0];
+        check[i].destination_first = build_rules[i].key.destination_port;
+        check[i].destination_last = build_rules[i].last[1];
+        check[i].source_label = build_rules[i].label_first[source_dim];
+        check[i].source_labels = build_rules[i].label_count[source_dim];
+        check[i].destination_label = build_rules[i].label_first[destination_dim];
+        check[i].destination_labels = build_rules[i].label_count[destination_dim];
+    }
+
+    PNET_CLS_WIDE wide = (PNET_CLS_WIDE)((PUCHAR)cls + wide_offset);
+    for (i = 0; i < rule_count; i++) {
+        if (build_rules[i].mode == NET_CLS_MODE_WIDE) { clsWideFromBuild(&build_rules[i], i, wide++); }
+    }
+
+    ULONG offset = FIELD_OFFSET(NET_CLASSIFIER, tuples) + tuple_count * sizeof(NET_CLS_TUPLE);
+    for (ULONG t = 0; t < tuple_count; t++) {
+        PNET_CLS_TUPLE tuple = &cls->tuples[t];
+        tuple->fields = build[t].fields;
+        tuple->min_rule = build[t].min_rule;
+        tuple->slot_mask = build[t].count - 1;
+        tuple->slot_offset = offset;
+        tuple->length[0] = (UCHAR)build[t].layout;
+        tuple->length[1] = (UCHAR)(build[t].layout >> 8);
+        tuple->checked = (USHORT)build[t].checked;
+        offset += build[t].count * sizeof(NET_CLS_SLOT);
+
+        PNET_CLS_SLOT slots = clsSlots(cls, tuple);
+        for (ULONG s = 0; s <= tuple->slot_mask; s++) { slots[s].rule = NET_CLS_NO_MATCH; }
+    }
+
+    // Pass 3: insert rules in list order, so an existing key already holds
+    // the lower (first-match) rule index, or in a tuple that checks ranges
+    // comes first on the probe. A rule goes in once per label combination.
+    // The checks are in place by now, for clsInsert to compare.
+    for (ULONG shape = 0; shape < NET_CLS_SHAPES; shape++) {
+        RtlZeroMemory(tuple_index, NET_CLS_TUPLE_INDEX * sizeof(ULONG));
+        for (ULONG t = shape_first[shape]; t < shape_first[shape] + shape_count[shape]; t++) { clsIndexTuple(build, tuple_index, t); }
+
+        for (i = 0; i < rule_count; i++) {
+            PNET_CLS_BUILD_RULE rule = &build_rules[i];
+            if (rule->mode == NET_CLS_MODE_WIDE || !clsRuleInShape(rule->fields, shape)) { continue; }
+            PNET_CLS_TUPLE tuple = &cls->tuples[clsFindTuple(build, tuple_index, rule->fields, clsRuleLayout(rule))];
+            ULONG labelled = clsLabelled(rule);
+            ULONG combinations = clsExpansion(rule, labelled);
+
+            for (ULONG c = 0; c < combinations; c++) {
+                NET_CLS_LABELS combination;
+                NET_CLS_KEY key;
+                ULONG digits = c;
+                for (dim = 0; dim < NET_CLS_DIMS; dim++) {
+                    combination.label[dim] = 0;
+                    if (labelled & clsDimFields[dim]) {
+                        combination.label[dim] = rule->label_first[dim] + digits % rule->label_count[dim];
+                        digits /= rule->label_count[dim];
+                    }
+                }
+                clsRuleKey(rule, &combination, &key);
+                clsInsert(cls, tuple, &key, i);
+            }
+        }
+    }
+
+cleanup:
+    for (dim = 0; dim < 2; dim++) {
+        if (labels[dim] != NULL) { NETFLT_FREE(labels[dim], NET_CLS_TAG); }
+        if (labels6[dim] != NULL) { NETFLT_FREE(labels6[dim], NET_CLS_TAG); }
+        if (port_map[dim] != NULL) { NETFLT_FREE(port_map[dim], NET_CLS_TAG); }
+    }
+    if (tuple_index != NULL) { NETFLT_FREE(tuple_index, NET_CLS_TAG); }
+    if (lpm6_scratch != NULL) { NETFLT_FREE(lpm6_scratch, NET_CLS_TAG); }
+    if (lpm6_prefixes != NULL) { NETFLT_FREE(lpm6_prefixes, NET_CLS_TAG); }
+    if (lpm_prefixes != NULL) { NETFLT_FREE(lpm_prefixes, NET_CLS_TAG); }
+    if (scratch != NULL) { NETFLT_FREE(scratch, NET_CLS_TAG); }
+    if (build_rules != NULL) { NETFLT_FREE(build_rules, NET_CLS_TAG); }
+    if (build != NULL) { NETFLT_FREE(build, NET_CLS_TAG); }
+    return cls;
+}
+
+VOID ndisFreeNetClassifier(PNET_CLASSIFIER cls) {
+    if (cls != NULL) { NETFLT_FREE(cls, NET_CLS_TAG); }
+}
+
+static BOOLEAN clsValidTable(const NET_CLASSIFIER* cls, ULONG offset, UINT64 length, ULONG align) {
+    return (BOOLEAN)(offset >= FIELD_OFFSET(NET_CLASSIFIER, tuples) && (offset & (align - 1)) == 0 &&
+        offset + length <= cls->size);
+}
+
+// 0 when the tuple does not cut the field, else 1..limit
+static FORCEINLINE BOOLEAN clsValidLength(UCHAR length, ULONG limit) {
+    return (BOOLEAN)(length <= limit);
+}
+
+BOOLEAN ndisValidateNetClassifier(const NET_CLASSIFIER* cls, ULONG size) {
+    ULONG i, s;
+    if (size < FIELD_OFFSET(NET_CLASSIFIER, tuples) || cls->size != size) { return FALSE; }
+    if (cls->tuple_count > (size - FIELD_OFFSET(NET_CLASSIFIER, tuples)) / sizeof(NET_CLS_TUPLE)) { return FALSE; }
+    for (i = 0; i < NET_CLS_SHAPES; i++) {
+        if ((UINT64)cls->shape_first[i] + cls->shape_count[i] > cls->tuple_count) { return FALSE; }
+    }
+
+    // Every probe sequence has to end on an empty slot, every rule index
+    // has to be one the caller can look up, and a length only goes with
+    // the field it cuts
+    for (i = 0; i < cls->tuple_count; i++) {
+        const NET_CLS_TUPLE* tuple = &cls->tuples[i];
+        UINT64 slot_count = (UINT64)tuple->slot_mask + 1;
+        if (!clsValidLength(tuple->length[0], tuple->fields & NET_CLS_F_SOURCE_PREFIX ? 32 :
+                tuple->fields & NET_CLS_F_SOURCE_IP6 ? 128 : 0) ||
+            !clsValidLength(tuple->length[1], tuple->fields & NET_CLS_F_DESTINATION_PREFIX ? 32 :
+                tuple->fields & NET_CLS_F_DESTINATION_IP6 ? 128 : 0) ||
+            (tuple->checked & ~(tuple->fields & NET_CLS_F_CHECKED)) != 0 || (tuple->checked != 0 && cls->check_offset == 0)) {
+            return FALSE;
+        }
+        if ((slot_count & (slot_count - 1)) != 0 ||
+            !clsValidTable(cls, tuple->slot_offset, slot_count * sizeof(NET_CLS_SLOT), sizeof(ULONG))) {
+            return FALSE;
+        }
+        const NET_CLS_SLOT* slots = clsSlots(cls, tuple);
+        BOOLEAN empty = FALSE;
+        for (s = 0; s <= tuple->slot_mask; s++) {
+            if (slots[s].rule == NET_CLS_NO_MATCH) { empty = TRUE; }
+            else if (slots[s].rule >= cls->rule_count) { return FALSE; }
+        }
+        if (!empty) { return FALSE; }
+    }
+
+    if (!clsValidTable(cls, cls->wide_offset, (UINT64)cls->wide_count * sizeof(NET_CLS_WIDE), sizeof(ULONG))) { return FALSE; }
+    const NET_CLS_WIDE* wide = (const NET_CLS_WIDE*)((const UCHAR*)cls + cls->wide_offset);
+    for (i = 0; i < cls->wide_count; i++) {
+        if (wide[i].rule >= cls->rule_count) { return FALSE; }
+    }
+
+    if (cls->check_offset != 0 &&
+        !clsValidTable(cls, cls->check_offset, (UINT64)cls->rule_count * sizeof(NET_CLS_CHECK), sizeof(ULONG))) {
+        return FALSE;
+    }
+
+    // Parents have lower labels, so clsAncestor6 always reaches label 0
+    ULONG prefixes6[2] = { cls->source_prefixes6, cls->destination_prefixes6 };
+    ULONG labels6[2] = { cls->source_labels6, cls->destination_labels6 };
+    for (i = 0; i < 2; i++) {
+        if (prefixes6[i] == 0) { continue; }
+        if (!clsValidTable(cls, prefixes6[i], ((UINT64)labels6[i] + 1) * sizeof(NET_CLS_PREFIX6), sizeof(ULONG))) { return FALSE; }
+        const NET_CLS_PREFIX6* prefixes = (const NET_CLS_PREFIX6*)((const UCHAR*)cls + prefixes6[i]);
+        for (s = 1; s <= labels6[i]; s++) {
+            if (prefixes[s].parent >= s) { return FALSE; }
+        }
+    }
+
+    if (cls->source_ports != 0 && !clsValidTable(cls, cls->source_ports, NET_CLS_PORTS * sizeof(UINT16), sizeof(UINT16))) { return FALSE; }
+    if (cls->destination_ports != 0 && !clsValidTable(cls, cls->destination_ports, NET_CLS_PORTS * sizeof(UINT16), sizeof(UINT16))) { return FALSE; }
+
+    ULONG lpm[2] = { cls->source_lpm, cls->destination_lpm };
+    ULONG lpm6[2] = { cls->source_lpm6, cls->destination_lpm6 };
+    if ((lpm[0] | lpm[1] | lpm6[0] | lpm6[1]) == 0) { return TRUE; }
+
+    BOOLEAN valid = TRUE;
+    PUCHAR depth = (PUCHAR)NETFLT_ALLOC(size / (NET_LPM_CHUNK_SIZE * sizeof(ULONG)) + 1, NET_CLS_TAG);
+    if (depth == NULL) { return FALSE; }
+    for (i = 0; i < 2 && valid; i++) {
+        if (lpm[i] != 0) {
+            valid = (BOOLEAN)(clsValidTable(cls, lpm[i], 0, sizeof(ULONG)) &&
+                ndisLpmValidate((const NET_LPM*)((const UCHAR*)cls + lpm[i]), size - lpm[i], depth));
+        }
+        if (valid && lpm6[i] != 0) {
+            valid = (BOOLEAN)(clsValidTable(cls, lpm6[i], 0, sizeof(UINT64)) &&
+                ndisLpm6Validate((const NET_LPM6*)((const UCHAR*)cls + lpm6[i]), size - lpm6[i], depth));
+        }
+    }
+    NETFLT_FREE(depth, NET_CLS_TAG);
+    return valid;
+}
+
+ULONG ndisClassify(const NET_CLASSIFIER* cls, const NET_CLS_KEY* key) {
+    ULONG best = NET_CLS_NO_MATCH;
+    const NET_CLS_TUPLE* tuple = &cls->tuples[cls->shape_first[key->shape]];
+    const NET_CLS_TUPLE* end = tuple + cls->shape_count[key->shape];
+    NET_CLS_LABELS labels = { { 0, 0, 0, 0, 0, 0 } };
+    const NET_CLS_CHECK* checks = (const NET_CLS_CHECK*)((const UCHAR*)cls + cls->check_offset);
+
+    // One LPM walk and one map read per labelled field, whatever the
+    // number of prefixes and ranges
+    if (key->shape & NET_CLS_SHAPE_IP) {
+        if (cls->source_lpm != 0) {
+            labels.label[NET_CLS_DIM_SOURCE_IP] = ndisLpmLookup((const NET_LPM*)((const UCHAR*)cls + cls->source_lpm), key->source_ip);
+        }
+        if (cls->destination_lpm != 0) {
+            labels.label[NET_CLS_DIM_DESTINATION_IP] = ndisLpmLookup((const NET_LPM*)((const UCHAR*)cls + cls->destination_lpm), key->destination_ip);
+        }
+    }
+    if (key->shape & NET_CLS_SHAPE_L4) {
+        if (cls->source_ports != 0) {
+            labels.label[NET_CLS_DIM_SOURCE_PORT] = ((const UINT16*)((const UCHAR*)cls + cls->source_ports))[key->source_port];
+        }
+        if (cls->destination_ports != 0) {
+            labels.label[NET_CLS_DIM_DESTINATION_PORT] = ((const UINT16*)((const UCHAR*)cls + cls->destination_ports))[key->destination_port];
+        }
+    }
+
+    for (; tuple < end; tuple++) {
+        // Tuples are ordered by min_rule: nothing below can win any more
+        if (tuple->min_rule >= best) { break; }
+
+        NET_CLS_KEY masked;
+        clsMaskKey(cls, tuple, key, &labels, &masked);
+        const NET_CLS_SLOT* slots = clsSlots(cls, tuple);
+        ULONG s = ndisClsKeyHash(&masked) & tuple->slot_mask;
+        while (slots[s].rule != NET_CLS_NO_MATCH) {
+            // Rules on one key come in ascending order
+            if (ndisClsKeyEqual(&slots[s].key, &masked)) {
+                if (slots[s].rule >= best) { break; }
+                if (tuple->checked == 0 || clsCheckMatch(&checks[slots[s].rule], tuple->checked, key, &labels)) {
+                    best = slots[s].rule;
+                    break;
+                }
+            }
+            s = (s + 1) & tuple->slot_mask;
+        }
+    }
+
+    const NET_CLS_WIDE* wide = (const NET_CLS_WIDE*)((const UCHAR*)cls + cls->wide_offset);
+    const NET_CLS_WIDE* wide_end = wide + cls->wide_count;
+    for (; wide < wide_end && wide->rule < best; wide++) {
+        if (clsRuleInShape(wide->fields, key->shape) && clsWideMatch(wide, key, &labels)) { return wide->rule; }
+    }
+    return best;
+}
@@ -0,0 +1,204 @@
+#pragma once
+//
+// Tuple-space classifier compiled from the NET_RULES list.
+//
+// Every rule is reduced to the set of fields it actually tests (its "tuple").
+// Rules sharing a tuple live in one open-addressing hash table keyed by the
+// masked header fields, and each slot keeps the lowest rule index that
+// produced it. A lookup probes one table per distinct tuple, so its cost
+// depends on how many field combinations are in use. Prefix lengths are
+// folded into a few fixed ones (below) to keep that number small as rules
+// are added. It is not constant: a crowded bucket is split into finer
+// lengths, and each probe is more likely to miss the cache as the tables
+// grow.
+//
+// CIDR prefixes and port ranges cannot be hashed directly. Every distinct
+// source (destination) prefix gets a label, and an LPM table (lpm.h) maps
+// an address to the label of its longest matching prefix. A rule on prefix
+// Q is stored once under the label of every prefix nested in Q (Q
+// included), so the label found for the packet is enough to match it. Port
+// ranges are cut into elementary intervals the same way, with a direct
+// 64K-entry map from port to interval label. The labels are looked up once
+// per packet and then hashed like any other field.
+//
+// Expansion multiplies across fields, so a rule that would take more than
+// NET_CLS_MAX_EXPANSION slots (a wide subnet pair over a wide port range,
+// say) is not expanded over its prefixes. Its tuple is keyed instead on
+// the prefixes themselves, cut back to the longest bucket length not over
+// their own (NET_CLS_BUCKET, NET_CLS_BUCKET6): an IPv4 address is masked
+// to it and an IPv6 label is replaced by its ancestor of that length
+// (NET_CLS_PREFIX6; the compiler labels the bucket prefixes too). A tuple
+// whose rules were cut short "checks" the rest: a key found is only a
+// match once the frame's label is in the rule's run of labels
+// (NET_CLS_CHECK). If the port ranges alone still expand too far, they are
+// left out of the key and checked the same way, against the rule's range.
+// Slots of a tuple that checks may repeat a key. When more than
+// NET_CLS_MAX_CHECKED rules would share one key, the rest are keyed at
+// their own prefix lengths or expanded over their ranges, trading a few
+// more tuples for a short walk. Only a rule that finds no tuple left for
+// it is kept in the "wide" list, ordered by rule index and compared field
+// by field once the hash probes are done.
+//
+// IPv6 addresses are always labelled, /128 hosts included: the key has no
+// room for them, so ndisClsResolve6 replaces them by their labels before
+// the key reaches ndisClassify or the flow cache.
+//
+// A rule only matches frames that carry every field it tests. The compiler
+// builds one tuple space per frame "shape" (which of IPv4, IPv6 and a
+// transport header the frame has) holding just the rules that can match
+// it. Tuples are kept ordered by their lowest rule index which lets the
+// lookup stop as soon as no remaining tuple can beat the best match so far.
+//
+// The whole classifier is one flat allocation with offset-based links.
+//
+
+#define NET_CLS_NO_MATCH            0xFFFFFFFF
+#define NET_CLS_TAG                 '1slC'
+
+// Fields a rule can test
+#define NET_CLS_F_ETHER_TYPE            0x001
+#define NET_CLS_F_PROTOCOL              0x002
+#define NET_CLS_F_SOURCE_IP             0x004
+#define NET_CLS_F_DESTINATION_IP        0x008
+#define NET_CLS_F_SOURCE_PORT           0x010
+#define NET_CLS_F_DESTINATION_PORT      0x020
+#define NET_CLS_F_SOURCE_PREFIX         0x040   // key holds a prefix label
+#define NET_CLS_F_DESTINATION_PREFIX    0x080
+#define NET_CLS_F_SOURCE_RANGE          0x100   // key holds a port interval label
+#define NET_CLS_F_DESTINATION_RANGE     0x200
+#define NET_CLS_F_SOURCE_IP6            0x400   // key holds an IPv6 prefix label
+#define NET_CLS_F_DESTINATION_IP6       0x800
+
+// Frame shapes: which headers parse_frame found
+#define NET_CLS_SHAPE_IP            0x01
+#define NET_CLS_SHAPE_L4            0x02
+#define NET_CLS_SHAPE_IP6           0x04
+#define NET_CLS_SHAPES              8
+
+// Header fields in host byte order
+typedef struct _NET_CLS_KEY {
+    UINT16  ether_type;
+    UCHAR   protocol;               // IPv6: the upper-layer header after any extension headers
+    UCHAR   shape;
+    UINT32  source_ip;              // IPv6: label, see ndisClsResolve6
+    UINT32  destination_ip;
+    UINT16  source_port;
+    UINT16  destination_port;
+} NET_CLS_KEY, * PNET_CLS_KEY;
+
+typedef struct _NET_CLS_SLOT {
+    NET_CLS_KEY key;
+    ULONG       rule;               // NET_CLS_NO_MATCH - empty slot
+} NET_CLS_SLOT, * PNET_CLS_SLOT;
+
+typedef struct _NET_CLS_TUPLE {
+    ULONG   fields;                 // NET_CLS_F_*
+    ULONG   min_rule;               // lowest rule index stored in this tuple
+    ULONG   slot_mask;              // slot count - 1, power of two
+    ULONG   slot_offset;            // from the start of NET_CLASSIFIER
+    UCHAR   length[2];              // prefix length a prefix field is keyed at, source and destination, 0 - labelled
+    USHORT  checked;                // NET_CLS_F_* cut short or left out of the key, checked against NET_CLS_CHECK
+} NET_CLS_TUPLE, * PNET_CLS_TUPLE;
+
+// What a tuple that checks tests after the probe, per rule: the port
+// ranges, and the run of labels nested in each prefix (as NET_CLS_WIDE)
+typedef struct _NET_CLS_CHECK {
+    UINT16  source_first;           // NET_CLS_F_SOURCE_RANGE
+    UINT16  source_last;
+    UINT16  destination_first;
+    UINT16  destination_last;
+    ULONG   source_label;           // NET_CLS_F_SOURCE_PREFIX/IP6: first label
+    ULONG   source_labels;          // and label count
+    ULONG   destination_label;
+    ULONG   destination_labels;
+} NET_CLS_CHECK, * PNET_CLS_CHECK;
+
+// Nesting of the IPv6 prefixes of one side, indexed by label: the longest
+// prefix strictly containing each one, 0 - none
+typedef struct _NET_CLS_PREFIX6 {
+    ULONG   parent;
+    ULONG   length;
+} NET_CLS_PREFIX6, * PNET_CLS_PREFIX6;
+
+// A rule matched without the hash tables. Prefixes nest as contiguous
+// label runs, so a prefix field is a label range check.
+typedef struct _NET_CLS_WIDE {
+    NET_CLS_KEY key;
+    ULONG   rule;
+    ULONG   fields;                 // NET_CLS_F_*
+    ULONG   source_label;           // NET_CLS_F_SOURCE_PREFIX/IP6: first label
+    ULONG   source_labels;          // and label count
+    ULONG   destination_label;
+    ULONG   destination_labels;
+    UINT16  source_last;            // NET_CLS_F_SOURCE_RANGE, key holds the first port
+    UINT16  destination_last;
+} NET_CLS_WIDE, * PNET_CLS_WIDE;
+
+#define NET_CLS_MAX_EXPANSION       1024
+#define NET_CLS_MAX_EXPANDED        (1 << 18)   // keys stored for all rules,
+#define NET_CLS_RULE_EXPANDED       4           // plus this many per rule
+#define NET_CLS_MAX_CHECKED         16          // rules on one key of a tuple that checks
+#define NET_CLS_BUCKET              8           // IPv4 prefixes are keyed at a multiple of this, or at 1
+#define NET_CLS_BUCKET6             16          // IPv6 prefixes likewise
+
+typedef struct _NET_CLASSIFIER {
+    ULONG   size;                   // bytes, including tuples, slots and label tables
+    ULONG   rule_count;
+    ULONG   tuple_count;
+    ULONG   wide_count;
+    ULONG   wide_offset;            // NET_CLS_WIDE array, by ascending rule
+    ULONG   source_lpm;             // NET_LPM offsets, 0 - no prefix rules
+    ULONG   destination_lpm;
+    ULONG   source_lpm6;            // NET_LPM6 offsets, 0 - no IPv6 rules
+    ULONG   destination_lpm6;
+    ULONG   source_ports;           // UINT16[65536] port label map offsets, 0 - no range rules
+    ULONG   destination_ports;
+    ULONG   source_prefixes6;       // NET_CLS_PREFIX6[source_labels6 + 1] offsets, 0 - no tuple keyed on an IPv6 prefix length
+    ULONG   destination_prefixes6;
+    ULONG   source_labels6;
+    ULONG   destination_labels6;
+    ULONG   check_offset;           // NET_CLS_CHECK[rule_count], 0 - no tuple checks
+    ULONG   shape_first[NET_CLS_SHAPES];
+    ULONG   shape_count[NET_CLS_SHAPES];
+    NET_CLS_TUPLE tuples[1];
+} NET_CLASSIFIER, * PNET_CLASSIFIER;
+
+static FORCEINLINE ULONG ndisClsKeyHash(const NET_CLS_KEY* key) {
+    UINT64 lo, hi;
+    RtlCopyMemory(&lo, (const UCHAR*)key, sizeof(UINT64));
+    RtlCopyMemory(&hi, (const UCHAR*)key + sizeof(UINT64), sizeof(UINT64));
+    UINT64 h = (lo * 0x9E3779B97F4A7C15ULL) ^ hi;
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    h ^= h >> 32;
+    return (ULONG)h;
+}
+
+static FORCEINLINE BOOLEAN ndisClsKeyEqual(const NET_CLS_KEY* a, const NET_CLS_KEY* b) {
+    UINT64 a0, a1, b0, b1;
+    RtlCopyMemory(&a0, (const UCHAR*)a, sizeof(UINT64));
+    RtlCopyMemory(&a1, (const UCHAR*)a + sizeof(UINT64), sizeof(UINT64));
+    RtlCopyMemory(&b0, (const UCHAR*)b, sizeof(UINT64));
+    RtlCopyMemory(&b1, (const UCHAR*)b + sizeof(UINT64), sizeof(UINT64));
+    return (BOOLEAN)(a0 == b0 && a1 == b1);
+}
+
+PNET_CLASSIFIER ndisCompileNetRules(PNET_RULES rules);
+VOID ndisFreeNetClassifier(PNET_CLASSIFIER cls);
+ULONG ndisClassify(const NET_CLASSIFIER* cls, const NET_CLS_KEY* key);
+
+// Checks a classifier that was not built by ndisCompileNetRules in this
+// driver (see ruleimage.h): every offset inside the size bytes at cls, every
+// probe bounded and every rule index below rule_count, so that ndisClassify
+// cannot read outside the blob or loop on it.
+BOOLEAN ndisValidateNetClassifier(const NET_CLASSIFIER* cls, ULONG size);
+
+// For NET_CLS_SHAPE_IP6 keys: stores the labels of addresses[0] (source)
+// and addresses[1] (destination) in the key. The key is then only valid
+// for cls.
+static FORCEINLINE VOID ndisClsResolve6(const NET_CLASSIFIER* cls, PNET_CLS_KEY key, const NET_LPM6_ADDRESS* addresses) {
+    key->source_ip = (cls->source_lpm6 != 0) ?
+        ndisLpm6Lookup((const NET_LPM6*)((const UCHAR*)cls + cls->source_lpm6), &addresses[0]) : 0;
+    key->destination_ip = (cls->destination_lpm6 != 0) ?
+        ndisLpm6Lookup((const NET_LPM6*)((const UCHAR*)cls + cls->destination_lpm6), &addresses[1]) : 0;
+}
@@ -0,0 +1,596 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "content.h"
+
+#define NET_CONTENT_MAX_SIZE    (256u << 20)
+#define NET_CONTENT_TEDDY_REJECT    8
+
+static BOOLEAN contentSsse3 = FALSE;
+
+static ULONG contentAlign(ULONG offset) {
+    return (offset + 7) & ~(ULONG)7;
+}
+
+VOID ndisContentInit(BOOLEAN simd) {
+#ifdef NETFLT_SSSE3
+    contentSsse3 = (BOOLEAN)(simd && NETFLT_HAS_SSSE3());
+#else
+    UNREFERENCED_PARAMETER(simd);
+    contentSsse3 = FALSE;
+#endif
+}
+
+VOID ndisFreeContent(PNET_CONTENT content) {
+    if (content != NULL) { NETFLT_FREE(content, NET_CONTENT_TAG); }
+}
+
+//
+// Compiler
+//
+
+typedef struct _NET_CONTENT_BUILD {
+    ULONG   class_count;
+    ULONG   state_count;
+    PULONG  next;                   // state_count rows of class_count, state numbers
+    PULONG  fail;
+    PULONG  order;                  // states in breadth-first order
+    PULONG  depth;
+    PULONG  end_state;              // per rule
+    UINT64* own;                    // (state << 32) | rule, sorted
+    PULONG  list_first;             // per state, into lists
+    PULONG  list_length;
+    PULONG  lists;
+} NET_CONTENT_BUILD, * PNET_CONTENT_BUILD;
+
+static VOID contentFreeBuild(PNET_CONTENT_BUILD build) {
+    if (build->next != NULL) { NETFLT_FREE(build->next, NET_CONTENT_TAG); }
+    if (build->fail != NULL) { NETFLT_FREE(build->fail, NET_CONTENT_TAG); }
+    if (build->order != NULL) { NETFLT_FREE(build->order, NET_CONTENT_TAG); }
+    if (build->depth != NULL) { NETFLT_FREE(build->depth, NET_CONTENT_TAG); }
+    if (build->end_state != NULL) { NETFLT_FREE(build->end_state, NET_CONTENT_TAG); }
+    if (build->own != NULL) { NETFLT_FREE(build->own, NET_CONTENT_TAG); }
+    if (build->list_first != NULL) { NETFLT_FREE(build->list_first, NET_CONTENT_TAG); }
+    if (build->list_length != NULL) { NETFLT_FREE(build->list_length, NET_CONTENT_TAG); }
+    if (build->lists != NULL) { NETFLT_FREE(build->lists, NET_CONTENT_TAG); }
+}
+
+// The trie of all patterns, then the failure links folded into its missing
+// transitions, breadth first so that a state's failure row is complete
+// before the state's own row is filled
+static BOOLEAN contentBuildAutomaton(PNET_CONTENT_BUILD build, const UCHAR* classes, const NET_CONTENT_RULE* rules, ULONG rule_count, const UCHAR* patterns, ULONG max_states) {
+    ULONG c_count = build->class_count;
+
+    build->next = (PULONG)NETFLT_ALLOC((SIZE_T)max_states * c_count * sizeof(ULONG), NET_CONTENT_TAG);
+    build->fail = (PULONG)NETFLT_ALLOC((SIZE_T)max_states * sizeof(ULONG), NET_CONTENT_TAG);
+    build->order = (PULONG)NETFLT_ALLOC((SIZE_T)max_states * sizeof(ULONG), NET_CONTENT_TAG);
+    build->depth = (PULONG)NETFLT_ALLOC((SIZE_T)max_states * sizeof(ULONG), NET_CONTENT_TAG);
+    build->end_state = (PULONG)NETFLT_ALLOC((SIZE_T)rule_count * sizeof(ULONG), NET_CONTENT_TAG);
+    if (build->next == NULL || build->fail == NULL || build->order == NULL || build->depth == NULL || build->end_state == NULL) {
+        return FALSE;
+    }
+    RtlZeroMemory(build->next, (SIZE_T)max_states * c_count * sizeof(ULONG));
+
+    // 0 is the root and never a child, so a 0 entry is a missing edge
+    build->state_count = 1;
+    for (ULONG r = 0; r < rule_count; r++) {
+        const UCHAR* pattern = patterns + rules[r].pattern_offset;
+        ULONG s = 0;
+        for (ULONG i = 0; i < rules[r].pattern_length; i++) {
+            PULONG edge = &build->next[s * c_count + classes[pattern[i]]];
+            if (*edge == 0) { *edge = build->state_count++; }
+            s = *edge;
+        }
+        build->end_state[r] = s;
+    }
+
+    ULONG head = 0;
+    ULONG tail = 0;
+    build->fail[0] = 0;
+    build->depth[0] = 0;
+    build->order[tail++] = 0;
+    while (head < tail) {
+        ULONG u = build->order[head++];
+        PULONG row = &build->next[u * c_count];
+        const ULONG* fail_row = &build->next[build->fail[u] * c_count];
+
+        // Row u is only written here, so its non-zero entries are still
+        // exactly the trie children
+        for (ULONG c = 0; c < c_count; c++) {
+            ULONG v = row[c];
+            if (v != 0) {
+                build->fail[v] = (u == 0) ? 0 : fail_row[c];
+                build->depth[v] = build->depth[u] + 1;
+                build->order[tail++] = v;
+            } else if (u != 0) {
+                row[c] = fail_row[c];
+            }
+        }
+    }
+    return TRUE;
+}
+
+// A state outputs the rules ending in it and everything its failure state
+// outputs. Rules end in one state each and the failure state is shallower,
+// so the two sets are disjoint and the merge keeps every entry.
+static BOOLEAN contentBuildOutputs(PNET_CONTENT_BUILD build, ULONG rule_count, PULONG list_total) {
+    ULONG s_count = build->state_count;
+
+    build->own = (UINT64*)NETFLT_ALLOC((SIZE_T)rule_count * sizeof(UINT64), NET_CONTENT_TAG);
+    build->list_first = (PULONG)NETFLT_ALLOC((SIZE_T)s_count * sizeof(ULONG), NET_CONTENT_TAG);
+    build->list_length = (PULONG)NETFLT_ALLOC((SIZE_T)s_count * sizeof(ULONG), NET_CONTENT_TAG);
+    if (build->own == NULL || build->list_first == NULL || build->list_length == NULL) { return FALSE; }
+
+    for (ULONG r = 0; r < rule_count; r++) { build->own[r] = ((UINT64)build->end_state[r] << 32) | r; }
+    ndisSortUint64(build->own, rule_count);
+
+    // list_length counts the merged lists, breadth first so that the
+    // failure state is counted before
+    RtlZeroMemory(build->list_first, (SIZE_T)s_count * sizeof(ULONG));
+    RtlZeroMemory(build->list_length, (SIZE_T)s_count * sizeof(ULONG));
+    for (ULONG r = 0; r < rule_count; r++) { build->list_length[build->own[r] >> 32]++; }
+
+    UINT64 total = 1;                   // slot 0: the empty list of the states without output
+    for (ULONG n = 1; n < s_count; n++) {
+        ULONG s = build->order[n];
+        build->list_length[s] += build->list_length[build->fail[s]];
+        total += (build->list_length[s] != 0) ? build->list_length[s] + 1 : 0;
+        if (total > NET_CONTENT_MAX_OUTPUTS) { return FALSE; }
+    }
+
+    build->lists = (PULONG)NETFLT_ALLOC((SIZE_T)total * sizeof(ULONG), NET_CONTENT_TAG);
+    if (build->lists == NULL) { return FALSE; }
+    build->lists[0] = NET_CLS_NO_MATCH;
+
+    ULONG used = 1;
+    for (ULONG n = 1; n < s_count; n++) {
+        ULONG s = build->order[n];
+        if (build->list_length[s] == 0) { continue; }
+
+        // Own rules by binary search in the sorted pairs
+        ULONG low = 0;
+        ULONG high = rule_count;
+        while (low < high) {
+            ULONG mid = low + (high - low) / 2;
+            if ((build->own[mid] >> 32) < s) { low = mid + 1; } else { high = mid; }
+        }
+        ULONG own_index = low;
+
+        ULONG f = build->fail[s];
+        const ULONG* inherited = &build->lists[build->list_first[f]];
+        ULONG fail_length = build->list_length[f];
+        ULONG j = 0;
+        build->list_first[s] = used;
+        for (;;) {
+            ULONG a = (own_index < rule_count && (build->own[own_index] >> 32) == s) ? (ULONG)build->own[own_index] : NET_CLS_NO_MATCH;
+            ULONG b = (j < fail_length) ? inherited[j] : NET_CLS_NO_MATCH;
+            if (a == NET_CLS_NO_MATCH && b == NET_CLS_NO_MATCH) { break; }
+            if (a < b) { build->lists[used++] = a; own_index++; } else { build->lists[used++] = b; j++; }
+        }
+        build->lists[used++] = NET_CLS_NO_MATCH;
+    }
+    *list_total = used;
+    return TRUE;
+}
+
+// Patterns sorted by prefix and cut into NET_CONTENT_BUCKETS runs, so that
+// patterns sharing leading bytes share a bucket and the nibble masks of a
+// bucket stay tight. The nibble filter is only used when it would pass
+// less than 1/NET_CONTENT_TEDDY_REJECT of uniformly random positions;
+// with many patterns every bucket ends up with most nibbles set.
+static BOOLEAN contentBuildPrefilter(PNET_CONTENT content, const NET_CONTENT_RULE* rules, ULONG rule_count, const UCHAR* patterns) {
+    UINT64* sorted = (UINT64*)NETFLT_ALLOC((SIZE_T)rule_count * sizeof(UINT64), NET_CONTENT_TAG);
+    if (sorted == NULL) { return FALSE; }
+
+    for (ULONG r = 0; r < rule_count; r++) {
+        const UCHAR* pattern = patterns + rules[r].pattern_offset;
+        UINT64 prefix = 0;
+        for (ULONG k = 0; k < NET_CONTENT_PREFIX; k++) {
+            prefix = (prefix << 8) | ((k < content->prefix) ? pattern[k] : 0);
+        }
+        sorted[r] = (prefix << 32) | r;
+    }
+    ndisSortUint64(sorted, rule_count);
+
+    for (ULONG n = 0; n < rule_count; n++) {
+        const UCHAR* pattern = patterns + rules[(ULONG)sorted[n]].pattern_offset;
+        UCHAR bit = (UCHAR)(1 << ((UINT64)n * NET_CONTENT_BUCKETS / rule_count));
+        for (ULONG k = 0; k < content->prefix; k++) {
+            content->prefilter_lo[k][pattern[k] & 0x0F] |= bit;
+            content->prefilter_hi[k][pattern[k] >> 4] |= bit;
+            content->prefilter[k][pattern[k]] |= bit;
+        }
+        if (content->filter_offset != 0) {
+            ULONG hash = ndisContentHash(pattern, content->filter_shift);
+            ((PULONG)((PUCHAR)content + content->filter_offset))[hash >> 5] |= 1u << (hash & 31);
+        }
+    }
+    NETFLT_FREE(sorted, NET_CONTENT_TAG);
+
+    UINT64 passed = 0;
+    UINT64 positions = 1;
+    for (ULONG b = 0; b < NET_CONTENT_BUCKETS; b++) {
+        UINT64 bucket = 1;
+        for (ULONG k = 0; k < content->prefix; k++) {
+            ULONG lo = 0, hi = 0;
+            for (ULONG x = 0; x < 16; x++) {
+                lo += (content->prefilter_lo[k][x] >> b) & 1;
+                hi += (content->prefilter_hi[k][x] >> b) & 1;
+            }
+            bucket *= lo * hi;
+        }
+        passed += bucket;
+    }
+    for (ULONG k = 0; k < content->prefix; k++) { positions *= 256; }
+    if (passed * NET_CONTENT_TEDDY_REJECT < positions) { content->flags |= NET_CONTENT_F_TEDDY; }
+    return TRUE;
+}
+
+PNET_CONTENT ndisCompileContent(const NET_CONTENT_RULE* rules, ULONG rule_count, const UCHAR* patterns, ULONG depth) {
+    NET_CONTENT_BUILD build;
+    UCHAR classes[256];
+    BOOLEAN used[256];
+    PNET_CONTENT content = NULL;
+    UINT64 pattern_bytes = 0;
+    ULONG shortest = NET_CONTENT_MAX_PATTERN;
+    ULONG list_total = 0;
+
+    if (rule_count == 0 || rule_count > NET_CONTENT_MAX_RULES) { return NULL; }
+    RtlZeroMemory(&build, sizeof(build));
+    RtlZeroMemory(used, sizeof(used));
+
+    for (ULONG r = 0; r < rule_count; r++) {
+        ULONG length = rules[r].pattern_length;
+        if (length == 0 || length > NET_CONTENT_MAX_PATTERN) { return NULL; }
+        for (ULONG i = 0; i < length; i++) { used[patterns[rules[r].pattern_offset + i]] = TRUE; }
+        pattern_bytes += length;
+        if (length < shortest) { shortest = length; }
+    }
+    if (pattern_bytes + 1 > NET_CONTENT_MAX_STATES) { return NULL; }
+
+    // Class 0 stands for every byte no pattern uses
+    build.class_count = 1;
+    for (ULONG b = 0; b < 256; b++) { classes[b] = used[b] ? (UCHAR)build.class_count++ : 0; }
+    if (build.class_count > 256) {
+        // All 256 byte values used: class numbers need the whole UCHAR range
+        for (ULONG b = 0; b < 256; b++) { classes[b] = (UCHAR)b; }
+        build.class_count = 256;
+    }
+
+    if (!contentBuildAutomaton(&build, classes, rules, rule_count, patterns, (ULONG)pattern_bytes + 1) ||
+        !contentBuildOutputs(&build, rule_count, &list_total)) {
+        goto done;
+    }
+
+    ULONG rules_offset = contentAlign(sizeof(NET_CONTENT));
+    ULONG patterns_offset = rules_offset + rule_count * sizeof(NET_CONTENT_RULE);
+    UINT64 transitions_offset = contentAlign(patterns_offset + (ULONG)pattern_bytes);
+    UINT64 outputs_offset = transitions_offset + (UINT64)build.state_count * build.class_count * sizeof(ULONG);
+    UINT64 output_list_offset = outputs_offset + (UINT64)build.state_count * sizeof(ULONG);
+    if (output_list_offset + (UINT64)list_total * sizeof(ULONG) > NET_CONTENT_MAX_SIZE) { goto done; }
+    ULONG size = contentAlign((ULONG)(output_list_offset + (UINT64)list_total * sizeof(ULONG)));
+
+    // About 32 bitmap bits per pattern keep the false positive rate near 3%
+    ULONG filter_bits = NET_CONTENT_FILTER_MIN_BITS;
+    while (filter_bits < NET_CONTENT_FILTER_MAX_BITS && (1u << filter_bits) < rule_count * 32) { filter_bits++; }
+    ULONG filter_offset = 0;
+    if (shortest >= NET_CONTENT_PREFIX) {
+        filter_offset = size;
+        size += (1u << filter_bits) / 8;
+    }
+
+    content = (PNET_CONTENT)NETFLT_ALLOC(size, NET_CONTENT_TAG);
+    if (content == NULL) { goto done; }
+    RtlZeroMemory(content, size);
+    content->size = size;
+    content->rule_count = rule_count;
+    content->rules_offset = rules_offset;
+    content->patterns_offset = patterns_offset;
+    content->state_count = build.state_count;
+    content->class_count = build.class_count;
+    content->transitions_offset = (ULONG)transitions_offset;
+    content->outputs_offset = (ULONG)outputs_offset;
+    content->output_list_offset = (ULONG)output_list_offset;
+    content->output_list_count = list_total;
+    content->depth = depth;
+    content->prefix = (shortest < NET_CONTENT_PREFIX) ? shortest : NET_CONTENT_PREFIX;
+    content->filter_shift = 32 - filter_bits;
+    content->filter_offset = filter_offset;
+    RtlCopyMemory(content->classes, classes, sizeof(classes));
+
+    PNET_CONTENT_RULE out_rules = (PNET_CONTENT_RULE)((PUCHAR)content + rules_offset);
+    ULONG pattern_offset = patterns_offset;
+    for (ULONG r = 0; r < rule_count; r++) {
+        out_rules[r] = rules[r];
+        out_rules[r].pattern_offset = pattern_offset;
+        RtlCopyMemory((PUCHAR)content + pattern_offset, patterns + rules[r].pattern_offset, rules[r].pattern_length);
+        pattern_offset += rules[r].pattern_length;
+    }
+
+    // Transitions become row offsets of the next state, flagged when that
+    // state has output and tagged with its depth when that is below the
+    // prefix
+    PULONG transitions = (PULONG)((PUCHAR)content + content->transitions_offset);
+    PULONG outputs = (PULONG)((PUCHAR)content + content->outputs_offset);
+    for (ULONG s = 0; s < build.state_count; s++) {
+        for (ULONG c = 0; c < build.class_count; c++) {
+            ULONG v = build.next[s * build.class_count + c];
+            ULONG shallow = (build.depth[v] < content->prefix) ? build.depth[v] : 0;
+            transitions[s * build.class_count + c] = (v * build.class_count) | (shallow << NET_CONTENT_DEPTH_SHIFT) |
+                ((build.list_length[v] != 0) ? NET_CONTENT_OUTPUT : 0);
+        }
+        outputs[s] = build.list_first[s];
+    }
+    RtlCopyMemory((PUCHAR)content + content->output_list_offset, build.lists, list_total * sizeof(ULONG));
+
+    if (!contentBuildPrefilter(content, out_rules, rule_count, (const UCHAR*)content)) {
+        NETFLT_FREE(content, NET_CONTENT_TAG);
+        content = NULL;
+    }
+
+done:
+    contentFreeBuild(&build);
+    return content;
+}
+
+BOOLEAN ndisValidateContent(const NET_CONTENT* content, ULONG size) {
+    if (size < sizeof(NET_CONTENT) || content->size != size || size > NET_CONTENT_MAX_SIZE) { return FALSE; }
+    if (content->rule_count == 0 || content->rule_count > NET_CONTENT_MAX_RULES ||
+        content->state_count == 0 || content->state_count > NET_CONTENT_MAX_STATES ||
+        content->class_count == 0 || content->class_count > 256 ||
+        content->output_list_count == 0 || content->output_list_count > NET_CONTENT_MAX_OUTPUTS ||
+        content->prefix == 0 || content->prefix > NET_CONTENT_PREFIX ||
+        content->filter_shift < 32 - NET_CONTENT_FILTER_MAX_BITS || content->filter_shift > 32 - NET_CONTENT_FILTER_MIN_BITS) {
+        return FALSE;
+    }
+    if ((content->rules_offset | content->transitions_offset | content->outputs_offset | content->output_list_offset |
+        content->filter_offset) & 3) {
+        return FALSE;
+    }
+    if ((content->filter_offset != 0) != (content->prefix == NET_CONTENT_PREFIX) ||
+        (content->filter_offset != 0 && (content->filter_offset < sizeof(NET_CONTENT) ||
+        content->filter_offset + ((UINT64)1 << (32 - content->filter_shift)) / 8 > size))) {
+        return FALSE;
+    }
+    if (content->rules_offset < sizeof(NET_CONTENT) ||
+        content->rules_offset + (UINT64)content->rule_count * sizeof(NET_CONTENT_RULE) > size ||
+        content->transitions_offset + (UINT64)content->state_count * content->class_count * sizeof(ULONG) > size ||
+        content->outputs_offset + (UINT64)content->state_count * sizeof(ULONG) > size ||
+        content->output_list_offset + (UINT64)content->output_list_count * sizeof(ULONG) > size) {
+        return FALSE;
+    }
+
+    for (ULONG b = 0; b < 256; b++) {
+        if (content->classes[b] >= content->class_count) { return FALSE; }
+    }
+    for (ULONG r = 0; r < content->rule_count; r++) {
+        const NET_CONTENT_RULE* rule = ndisContentRule(content, r);
+        if (rule->pattern_length == 0 || rule->pattern_length > NET_CONTENT_MAX_PATTERN ||
+            (UINT64)rule->pattern_offset + rule->pattern_length > size) {
+            return FALSE;
+        }
+    }
+
+    // Every list ends inside the array and names existing rules, so a walk
+    // from any index stays in bounds
+    const ULONG* lists = (const ULONG*)((const UCHAR*)content + content->output_list_offset);
+    if (lists[0] != NET_CLS_NO_MATCH || lists[content->output_list_count - 1] != NET_CLS_NO_MATCH) { return FALSE; }
+    for (ULONG i = 0; i < content->output_list_count; i++) {
+        if (lists[i] != NET_CLS_NO_MATCH && lists[i] >= content->rule_count) { return FALSE; }
+    }
+    const ULONG* outputs = (const ULONG*)((const UCHAR*)content + content->outputs_offset);
+    for (ULONG s = 0; s < content->state_count; s++) {
+        if (outputs[s] >= content->output_list_count) { return FALSE; }
+    }
+
+    // The root must not be an output state: the scan treats row 0 as "no
+    // match in progress"
+    if (outputs[0] != 0) { return FALSE; }
+    const ULONG* transitions = (const ULONG*)((const UCHAR*)content + content->transitions_offset);
+    for (UINT64 i = 0; i < (UINT64)content->state_count * content->class_count; i++) {
+        ULONG row = transitions[i] & NET_CONTENT_ROW;
+        if (row % content->class_count != 0 || row / content->class_count >= content->state_count) { return FALSE; }
+        if (((transitions[i] & NET_CONTENT_OUTPUT) != 0) != (outputs[row / content->class_count] != 0)) { return FALSE; }
+    }
+    return TRUE;
+}
+
+//
+// Scanner
+//
+
+static FORCEINLINE BOOLEAN contentRuleApplies(const NET_CONTENT_RULE* rule, const NET_CLS_KEY* key) {
+    return (BOOLEAN)((rule->ether_type == 0 || rule->ether_type == key->ether_type) &&
+        (rule->protocol == 0 || rule->protocol == key->protocol) &&
+        key->source_port >= rule->source_port_first && key->source_port <= rule->source_port_last &&
+        key->destination_port >= rule->destination_port_first && key->destination_port <= rule->destination_port_last);
+}
+
+static ULONG contentOutput(const NET_CONTENT* content, ULONG row, const NET_CLS_KEY* key) {
+    const ULONG* outputs = (const ULONG*)((const UCHAR*)content + content->outputs_offset);
+    const ULONG* list = (const ULONG*)((const UCHAR*)content + content->output_list_offset) + outputs[row / content->class_count];
+
+    for (; *list != NET_CLS_NO_MATCH; list++) {
+        if (contentRuleApplies(ndisContentRule(content, *list), key)) { return *list; }
+    }
+    return NET_CLS_NO_MATCH;
+}
+
+static FORCEINLINE BOOLEAN contentFiltered(const NET_CONTENT* content, const ULONG* filter, const UCHAR* bytes) {
+    ULONG hash = ndisContentHash(bytes, content->filter_shift);
+    return (BOOLEAN)((filter[hash >> 5] >> (hash & 31)) & 1);
+}
+
+// First position in [i, limit) whose prefix bytes may start a pattern;
+// limit when there is none. Positions up to limit + prefix - 1 are read.
+static FORCEINLINE ULONG contentFindScalar(const NET_CONTENT* content, const UCHAR* data, ULONG i, ULONG limit) {
+    const ULONG* filter = (const ULONG*)((const UCHAR*)content + content->filter_offset);
+
+    switch (content->prefix) {
+    case 1:
+        for (; i < limit; i++) {
+            if (content->prefilter[0][data[i]]) { return i; }
+        }
+        break;
+    case 2:
+        for (; i < limit; i++) {
+            if (content->prefilter[0][data[i]] & content->prefilter[1][data[i + 1]]) { return i; }
+        }
+        break;
+    default:
+        for (; i < limit; i++) {
+            if (contentFiltered(content, filter, data + i)) { return i; }
+        }
+        break;
+    }
+    return limit;
+}
+
+// Steps the automaton from data[*i] until a rule that applies to key
+// matched, the data ran out or the prefilter can take over: at the root,
+// or in a shallow state whose match began after from, where the automaton
+// was last started. *i is then the position the prefilter resumes at, the
+// start of that match, which is re-tested like any other. From only grows,
+// so the scan always moves on.
+static FORCEINLINE ULONG contentRun(const NET_CONTENT* content, const ULONG* transitions, PULONG row, const UCHAR* data, PULONG i, ULONG from, ULONG length, const NET_CLS_KEY* key) {
+    ULONG r = *row;
+    ULONG n = *i;
+
+    do {
+        ULONG next = transitions[r + content->classes[data[n++]]];
+        r = next & NET_CONTENT_ROW;
+        if (next & (NET_CONTENT_OUTPUT | NET_CONTENT_DEPTH)) {
+            if (next & NET_CONTENT_OUTPUT) {
+                ULONG rule = contentOutput(content, r, key);
+                if (rule != NET_CLS_NO_MATCH) {
+                    *row = r;
+                    *i = n;
+                    return rule;
+                }
+            }
+            ULONG depth = (next & NET_CONTENT_DEPTH) >> NET_CONTENT_DEPTH_SHIFT;
+            if (depth != 0 && n > from + depth) {
+                r = 0;
+                n -= depth;
+            }
+        }
+    } while (r != 0 && n < length);
+    *row = r;
+    *i = n;
+    return NET_CLS_NO_MATCH;
+}
+
+// The last prefix - 1 bytes cannot be tested by the prefilter; the
+// automaton reads them, so a match across the next buffer is not lost
+static FORCEINLINE ULONG contentLimit(const NET_CONTENT* content, ULONG length) {
+    return (length >= content->prefix) ? length - content->prefix + 1 : 0;
+}
+
+static ULONG contentScanScalar(const NET_CONTENT* content, PULONG state, const NET_CLS_KEY* key, const UCHAR* data, ULONG length) {
+    const ULONG* transitions = (const ULONG*)((const UCHAR*)content + content->transitions_offset);
+    ULONG limit = contentLimit(content, length);
+    ULONG row = *state;
+    ULONG i = 0;
+    ULONG from = 0;                 // a state carried from the previous buffer began before 0
+
+    while (i < length) {
+        if (row == 0) {
+            if (i < limit) {
+                i = contentFindScalar(content, data, i, limit);
+                if (i == length) { break; }
+            }
+            from = i;
+        }
+        ULONG rule = contentRun(content, transitions, &row, data, &i, from, length, key);
+        if (rule != NET_CLS_NO_MATCH) {
+            *state = row;
+            return rule;
+        }
+    }
+    *state = row;
+    return NET_CLS_NO_MATCH;
+}
+
+#ifdef NETFLT_SSSE3
+// Teddy: for 16 positions at once, look the low and high nibble of each
+// prefix byte up in the bucket masks with PSHUFB and AND everything
+// together. A non-zero lane is a candidate; the nibble split lets through
+// some non-candidates, which the bitmap mostly rejects. The candidates of
+// a block are kept across automaton runs, so a block is tested once.
+static NETFLT_SSSE3_TARGET ULONG contentScanSsse3(const NET_CONTENT* content, PULONG state, const NET_CLS_KEY* key, const UCHAR* data, ULONG length) {
+    const ULONG* transitions = (const ULONG*)((const UCHAR*)content + content->transitions_offset);
+    const ULONG* filter = (const ULONG*)((const UCHAR*)content + content->filter_offset);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo[NET_CONTENT_PREFIX];
+    __m128i hi[NET_CONTENT_PREFIX];
+    ULONG prefix = content->prefix;
+    ULONG limit = contentLimit(content, length);
+    ULONG row = *state;
+    ULONG i = 0;
+    ULONG from = 0;
+    ULONG block = 0;                // candidates left in the 16 positions from block
+    ULONG mask = 0;
+    ULONG next = 0;                 // first position the nibble filter has not seen
+
+    for (ULONG k = 0; k < prefix; k++) {
+        lo[k] = _mm_loadu_si128((const __m128i*)content->prefilter_lo[k]);
+        hi[k] = _mm_loadu_si128((const __m128i*)content->prefilter_hi[k]);
+    }
+
+    while (i < length) {
+        if (row == 0 && i < limit) {
+            for (;;) {
+                if (i >= block + 16) {
+                    mask = 0;
+                } else if (i > block) {
+                    mask &= 0xFFFFu << (i - block);
+                }
+                if (mask != 0) {
+                    ULONG at = block + netfltLowestBit(mask);
+                    if (content->filter_offset != 0 && !contentFiltered(content, filter, data + at)) {
+                        mask &= mask - 1;
+                        continue;
+                    }
+                    i = at;
+                    break;
+                }
+                if (next < i) { next = i; }
+                if (next + 16 > limit) {
+                    i = contentFindScalar(content, data, next, limit);
+                    break;
+                }
+
+                __m128i match = _mm_set1_epi8((char)0xFF);
+                for (ULONG k = 0; k < prefix; k++) {
+                    __m128i bytes = _mm_loadu_si128((const __m128i*)(data + next + k));
+                    __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(bytes, nibble));
+                    __m128i h = _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+                    match = _mm_and_si128(match, _mm_and_si128(l, h));
+                }
+                block = next;
+                next += 16;
+                mask = (ULONG)_mm_movemask_epi8(_mm_cmpeq_epi8(match, zero)) ^ 0xFFFF;
+            }
+            if (i == length) { break; }
+        }
+        if (row == 0) { from = i; }
+        ULONG rule = contentRun(content, transitions, &row, data, &i, from, length, key);
+        if (rule != NET_CLS_NO_MATCH) {
+            *state = row;
+            return rule;
+        }
+    }
+    *state = row;
+    return NET_CLS_NO_MATCH;
+}
+#endif
+
+ULONG ndisContentScan(const NET_CONTENT* content, PULONG state, const NET_CLS_KEY* key, const UCHAR* data, ULONG length) {
+#ifdef NETFLT_SSSE3
+    if (contentSsse3 && (content->flags & NET_CONTENT_F_TEDDY)) { return contentScanSsse3(content, state, key, data, length); }
+#endif
+    return contentScanScalar(content, state, key, data, length);
+}
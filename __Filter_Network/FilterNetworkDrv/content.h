@@ -0,0 +1,117 @@
+#pragma once
+//
+// Payload content matching.
+//
+// Header rules (classifier.h) only see header fields. A content rule adds
+// a byte string that has to occur in the TCP, UDP or SCTP payload, and may
+// narrow it to an ether type, a protocol and port ranges. Content rules run
+// as a second stage, on the frames the header rules let through.
+//
+// All patterns of a rule set are compiled offline into one Aho-Corasick
+// automaton, stored as a dense DFA: bytes are mapped to classes (every
+// byte that occurs in no pattern shares class 0) and each state has one
+// row of class_count transitions holding the next state's row offset, with
+// NET_CONTENT_OUTPUT set when the next state ends a pattern. Scanning costs
+// two loads per byte and no branches until a pattern ends.
+//
+// Most payload bytes cannot start a pattern, so the automaton only runs
+// from candidate positions. The prefilter looks at the first prefix bytes
+// (at most NET_CONTENT_PREFIX, at most the shortest pattern) of every
+// position. With a 3-byte prefix a position is a candidate when the hash
+// of its 3 bytes is set in a bitmap holding every pattern's prefix, about
+// 32 bits per pattern; shorter prefixes go through exact per-byte tables.
+// In front of that, with SSSE3 and when the compiler expects it to reject
+// most positions (NET_CONTENT_F_TEDDY), a Teddy filter tests 16 positions
+// at a time: patterns are sorted by prefix and split into 8 buckets, and a
+// position passes when some bucket has the low and the high nibble of each
+// of its bytes. The prefilter takes over again whenever no match can be in
+// progress that started before the next position it would test: back in
+// the root state, or in a state shallower than the prefix whose match began
+// after the position the automaton was started at. Transitions into such
+// states carry their depth (NET_CONTENT_DEPTH), so binary payloads, where
+// nearly every byte begins some pattern, do not keep the automaton running.
+//
+// The blob is offset based, like NET_CLASSIFIER, and travels in the rule
+// image (ruleimage.h). ndisValidateContent checks every offset and every
+// transition of a blob that was not built by ndisCompileContent.
+//
+
+#define NET_CONTENT_TAG             '1tnC'
+#define NET_CONTENT_PREFIX          3
+#define NET_CONTENT_BUCKETS         8
+#define NET_CONTENT_MAX_PATTERN     1024
+#define NET_CONTENT_MAX_RULES       (1 << 16)
+#define NET_CONTENT_MAX_STATES      (1 << 21)   // rows of 256 fit NET_CONTENT_ROW
+#define NET_CONTENT_MAX_OUTPUTS     (1 << 22)
+#define NET_CONTENT_FILTER_MIN_BITS 12          // log2 of the prefix bitmap size
+#define NET_CONTENT_FILTER_MAX_BITS 20
+#define NET_CONTENT_OUTPUT          0x80000000  // in a transition: the next state ends a pattern
+#define NET_CONTENT_DEPTH           0x60000000  // its depth when below the prefix, else 0
+#define NET_CONTENT_DEPTH_SHIFT     29
+#define NET_CONTENT_ROW             0x1FFFFFFF  // its row offset
+
+// NET_CONTENT.flags
+#define NET_CONTENT_F_TEDDY         0x0001      // the nibble filter pays off
+#define NET_CONTENT_F_STREAM        0x0002      // carry TCP streams across segments (stream.h)
+
+typedef struct _NET_CONTENT_RULE {
+    ULONG   pattern_offset;         // from the start of NET_CONTENT (compiler input: of the pattern buffer)
+    USHORT  pattern_length;         // 1..NET_CONTENT_MAX_PATTERN
+    USHORT  ether_type;             // 0 - any
+    UCHAR   protocol;               // 0 - any transport
+    UCHAR   action;                 // as NET_RULES.action
+    USHORT  reserved;
+    UINT16  source_port_first;      // port ranges, 0-65535 - any
+    UINT16  source_port_last;
+    UINT16  destination_port_first;
+    UINT16  destination_port_last;
+} NET_CONTENT_RULE, * PNET_CONTENT_RULE;
+
+typedef struct _NET_CONTENT {
+    ULONG   size;                   // bytes, everything below included
+    ULONG   rule_count;
+    ULONG   rules_offset;           // NET_CONTENT_RULE array
+    ULONG   patterns_offset;        // pattern bytes
+    ULONG   state_count;
+    ULONG   class_count;            // row length of the transition table
+    ULONG   transitions_offset;     // ULONG[state_count * class_count]
+    ULONG   outputs_offset;         // ULONG[state_count]: first output of the state
+    ULONG   output_list_offset;     // ULONG rule indexes, ascending, each list ended by NET_CLS_NO_MATCH
+    ULONG   output_list_count;
+    ULONG   depth;                  // payload bytes scanned per frame, 0 - all
+    ULONG   prefix;                 // bytes the prefilter tests, 1..NET_CONTENT_PREFIX
+    ULONG   flags;                  // NET_CONTENT_F_*
+    ULONG   filter_shift;           // 32 - log2 of the bitmap bits
+    ULONG   filter_offset;          // ULONG bitmap of hashed 3-byte prefixes, 0 - prefix < 3
+    ULONG   reserved;
+    UCHAR   classes[256];
+    UCHAR   prefilter_lo[NET_CONTENT_PREFIX][16];  // bucket bits by low nibble
+    UCHAR   prefilter_hi[NET_CONTENT_PREFIX][16];  // and by high nibble
+    UCHAR   prefilter[NET_CONTENT_PREFIX][256];    // bucket bits by byte, prefix < 3
+} NET_CONTENT, * PNET_CONTENT;
+
+// Compiles rule_count rules whose pattern_offset index patterns. The
+// result is one NETFLT_ALLOC block; NULL when out of memory or over the
+// limits above.
+PNET_CONTENT ndisCompileContent(const NET_CONTENT_RULE* rules, ULONG rule_count, const UCHAR* patterns, ULONG depth);
+VOID ndisFreeContent(PNET_CONTENT content);
+BOOLEAN ndisValidateContent(const NET_CONTENT* content, ULONG size);
+
+// Picks the SSSE3 prefilter when simd is TRUE and the processor has it.
+// Until then the scalar one is used.
+VOID ndisContentInit(BOOLEAN simd);
+
+// Scans length bytes of payload. *state is the automaton state, 0 at the
+// start of a payload; a payload split over several buffers is scanned by
+// calling again with the same state. Returns the first content rule found
+// that applies to key (the lowest-numbered of those ending at the same
+// byte), or NET_CLS_NO_MATCH.
+ULONG ndisContentScan(const NET_CONTENT* content, PULONG state, const NET_CLS_KEY* key, const UCHAR* data, ULONG length);
+
+static FORCEINLINE ULONG ndisContentHash(const UCHAR* bytes, ULONG shift) {
+    return (((ULONG)bytes[0] | ((ULONG)bytes[1] << 8) | ((ULONG)bytes[2] << 16)) * 0x9E3779B1u) >> shift;
+}
+
+static FORCEINLINE const NET_CONTENT_RULE* ndisContentRule(const NET_CONTENT* content, ULONG index) {
+    return (const NET_CONTENT_RULE*)((const UCHAR*)content + content->rules_offset) + index;
+}
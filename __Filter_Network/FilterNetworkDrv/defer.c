@@ -0,0 +1,429 @@
+#include "precomp.h"
+
+// Tag of a queued NBL, kept in an NBL context area while it waits: its
+// MS_FILTER, which pool blocks align to 8 bytes at least, with these in
+// the low bits
+#define DEFER_TAG_SEND          0x1
+#define DEFER_TAG_LOOPBACK      0x2     // NDIS_SEND_FLAGS_CHECK_FOR_LOOPBACK
+#define DEFER_TAG_PASS          0x4     // past the room of a fail-open queue, passed uninspected in its turn
+#define DEFER_TAG_MASK          0x7
+#define DEFER_CONTEXT_SIZE      MEMORY_ALLOCATION_ALIGNMENT
+
+C_ASSERT(sizeof(ULONG_PTR) <= DEFER_CONTEXT_SIZE);
+
+typedef struct DECLSPEC_CACHEALIGN _NET_DEFER_CPU {
+    KSPIN_LOCK          lock;
+    PNET_BUFFER_LIST    head;       // waiting NBLs, in arrival order
+    PNET_BUFFER_LIST*   tail;
+    ULONG               queued;     // of them, the ones to inspect
+    BOOLEAN             stop;
+    ULONG               index;      // processor
+    KEVENT              ready;      // set when the queue stops being empty
+    HANDLE              thread;
+    ULONG64             deferred;   // counters, under lock
+    ULONG64             passed;
+    ULONG64             dropped;
+} NET_DEFER_CPU, * PNET_DEFER_CPU;
+
+static PNET_DEFER_CPU   ndisDeferCpus = NULL;      // set once every worker runs
+static PVOID            ndisDeferCpusRaw = NULL;
+static ULONG            ndisDeferCpuCount = 0;
+
+static FORCEINLINE BOOLEAN deferTag(PNET_BUFFER_LIST nbl, ULONG_PTR tag) {
+    if (NdisAllocateNetBufferListContext(nbl, DEFER_CONTEXT_SIZE, 0, NET_DEFER_TAG) != NDIS_STATUS_SUCCESS) {
+        return FALSE;
+    }
+    *(ULONG_PTR*)NET_BUFFER_LIST_CONTEXT_DATA_START(nbl) = tag;
+    return TRUE;
+}
+
+static FORCEINLINE ULONG_PTR deferTagOf(PNET_BUFFER_LIST nbl) {
+    return *(ULONG_PTR*)NET_BUFFER_LIST_CONTEXT_DATA_START(nbl);
+}
+
+// Frees the context area of an NBL taken off a queue, before NDIS gets it
+// back
+static FORCEINLINE VOID deferUntag(PNET_BUFFER_LIST nbl) {
+    NdisFreeNetBufferListContext(nbl, DEFER_CONTEXT_SIZE);
+}
+
+// Drops count NBLs of filter from what the workers hold; the last one
+// wakes a pausing instance
+static VOID deferRelease(PMS_FILTER filter, ULONG count) {
+    if (InterlockedExchangeAdd(&filter->DeferredNbls, -(LONG)count) == (LONG)count && filter->DeferPaused) {
+        NdisSetEvent(&filter->DeferDrained);
+    }
+}
+
+static VOID deferAppend(PNET_BUFFER_LIST* chain, PULONG count, PNET_BUFFER_LIST nbls, ULONG nbl_count) {
+    while (*chain != NULL) { chain = &NET_BUFFER_LIST_NEXT_NBL(*chain); }
+    *chain = nbls;
+    *count += nbl_count;
+}
+
+// Completes sends the filter keeps, as the send path does with the ones
+// it drops
+static VOID deferAbortSends(PMS_FILTER filter, PNET_BUFFER_LIST sends, ULONG count, NDIS_STATUS status, BOOLEAN dispatch) {
+    for (PNET_BUFFER_LIST nbl = sends; nbl != NULL; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+        NET_BUFFER_LIST_STATUS(nbl) = status;
+    }
+    if (filter->TrackSends) {
+        FILTER_ACQUIRE_LOCK(&filter->Lock, dispatch);
+        filter->OutstandingSends -= count;
+        FILTER_RELEASE_LOCK(&filter->Lock, dispatch);
+    }
+    NdisFSendNetBufferListsComplete(filter->FilterHandle, sends, dispatch ? NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL : 0);
+}
+
+// Finishes count NBLs of one instance and direction, untagged, at
+// PASSIVE_LEVEL: the payload stages in one epoch section at
+// DISPATCH_LEVEL, then on to NDIS the way the path would have sent them.
+// count is NET_BATCH_MAX at most, which is all the processor's DPCs wait
+// for. A pausing instance gets them back uninspected.
+static VOID deferComplete(ULONG_PTR tag, PNET_BUFFER_LIST chain, ULONG count) {
+    PMS_FILTER          filter = (PMS_FILTER)(tag & ~(ULONG_PTR)DEFER_TAG_MASK);
+    PNET_BUFFER_LIST    chains[INSPECT_VERDICTS];
+    ULONG               counts[INSPECT_VERDICTS];
+    BOOLEAN             paused = FALSE;
+    NETFLT_EPOCH_READER epoch_reader;
+
+    RtlZeroMemory(chains, sizeof(chains));
+    RtlZeroMemory(counts, sizeof(counts));
+    chains[INSPECT_PASS] = chain;
+    counts[INSPECT_PASS] = count;
+    if (!(tag & DEFER_TAG_PASS) && !filter->DeferPaused) {
+        PNET_RULE_SET rule_set = ndisAcquireNetRules(&epoch_reader, filter);
+        inspect_chain(rule_set, INSPECT_PAYLOAD, chain, chains, counts);
+        ndisReleaseNetRules(&epoch_reader);
+    }
+
+    // A pausing instance, or one that paused meanwhile, gets the ones that
+    // passed back too
+    if (filter->DeferPaused && chains[INSPECT_PASS] != NULL) {
+        paused = TRUE;
+        deferAppend(&chains[INSPECT_DROP], &counts[INSPECT_DROP], chains[INSPECT_PASS], counts[INSPECT_PASS]);
+        chains[INSPECT_PASS] = NULL;
+        counts[INSPECT_PASS] = 0;
+    }
+
+    if (tag & DEFER_TAG_SEND) {
+        if (chains[INSPECT_DROP] != NULL) {
+            deferAbortSends(filter, chains[INSPECT_DROP], counts[INSPECT_DROP],
+                paused ? NDIS_STATUS_PAUSED : NDIS_STATUS_SUCCESS, FALSE);
+        }
+        if (chains[INSPECT_PASS] != NULL) {
+            NdisFSendNetBufferLists(filter->FilterHandle, chains[INSPECT_PASS], NDIS_DEFAULT_PORT_NUMBER,
+                (tag & DEFER_TAG_LOOPBACK) ? NDIS_SEND_FLAGS_CHECK_FOR_LOOPBACK : 0);
+        }
+    } else {
+        if (chains[INSPECT_DROP] != NULL) {
+            NdisFReturnNetBufferLists(filter->FilterHandle, chains[INSPECT_DROP], 0);
+        }
+        if (chains[INSPECT_PASS] != NULL) {
+            if (filter->TrackReceives) {
+                FILTER_ACQUIRE_LOCK(&filter->Lock, FALSE);
+                filter->OutstandingRcvs += counts[INSPECT_PASS];
+                FILTER_RELEASE_LOCK(&filter->Lock, FALSE);
+            }
+            NdisFIndicateReceiveNetBufferLists(filter->FilterHandle, chains[INSPECT_PASS], NDIS_DEFAULT_PORT_NUMBER,
+                counts[INSPECT_PASS], 0);
+        }
+    }
+    deferRelease(filter, count);
+}
+
+static KSTART_ROUTINE deferWorker;
+
+static VOID deferWorker(PVOID context) {
+    PNET_DEFER_CPU  cpu = (PNET_DEFER_CPU)context;
+    PROCESSOR_NUMBER number;
+    GROUP_AFFINITY  affinity;
+
+    // Bound to the processor it serves, whose stream table and flow cache
+    // its epoch sections use
+    RtlZeroMemory(&affinity, sizeof(affinity));
+    if (NT_SUCCESS(KeGetProcessorNumberFromIndex(cpu->index, &number))) {
+        affinity.Group = number.Group;
+        affinity.Mask = (KAFFINITY)1 << number.Number;
+        KeSetSystemGroupAffinityThread(&affinity, NULL);
+    }
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    for (;;) {
+        BOOLEAN stop;
+        KeWaitForSingleObject(&cpu->ready, Executive, KernelMode, FALSE, NULL);
+        for (;;) {
+            KIRQL irql;
+            KeAcquireSpinLock(&cpu->lock, &irql);
+            PNET_BUFFER_LIST chain = cpu->head;
+            cpu->head = NULL;
+            cpu->tail = &cpu->head;
+            cpu->queued = 0;
+            stop = cpu->stop;
+            KeReleaseSpinLock(&cpu->lock, irql);
+            if (chain == NULL) { break; }
+
+            // Runs of the same instance and direction, in queue order and
+            // one batch at a time, so that the worker is back at
+            // PASSIVE_LEVEL after every NET_BATCH_MAX NBLs
+            while (chain != NULL) {
+                ULONG_PTR tag = deferTagOf(chain);
+                PNET_BUFFER_LIST last = chain;
+                ULONG count = 1;
+                deferUntag(chain);
+                while (count < NET_BATCH_MAX && NET_BUFFER_LIST_NEXT_NBL(last) != NULL &&
+                    deferTagOf(NET_BUFFER_LIST_NEXT_NBL(last)) == tag) {
+                    last = NET_BUFFER_LIST_NEXT_NBL(last);
+                    deferUntag(last);
+                    count++;
+                }
+                PNET_BUFFER_LIST next = NET_BUFFER_LIST_NEXT_NBL(last);
+                NET_BUFFER_LIST_NEXT_NBL(last) = NULL;
+                deferComplete(tag, chain, count);
+                chain = next;
+            }
+        }
+        if (stop) { break; }
+    }
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static VOID deferStop(PNET_DEFER_CPU cpu) {
+    KIRQL irql;
+    KeAcquireSpinLock(&cpu->lock, &irql);
+    cpu->stop = TRUE;
+    KeReleaseSpinLock(&cpu->lock, irql);
+    KeSetEvent(&cpu->ready, IO_NO_INCREMENT, FALSE);
+    ZwWaitForSingleObject(cpu->thread, FALSE, NULL);
+    ZwClose(cpu->thread);
+    cpu->thread = NULL;
+}
+
+BOOLEAN ndisDeferInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = count * sizeof(NET_DEFER_CPU) + NETFLT_CACHE_LINE;
+    OBJECT_ATTRIBUTES attributes;
+
+    ndisDeferCpusRaw = NETFLT_ALLOC(size, NET_DEFER_TAG);
+    if (ndisDeferCpusRaw == NULL) { return FALSE; }
+    RtlZeroMemory(ndisDeferCpusRaw, size);
+
+    PNET_DEFER_CPU cpus = (PNET_DEFER_CPU)(((ULONG_PTR)ndisDeferCpusRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+    InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    for (ULONG i = 0; i < count; i++) {
+        PNET_DEFER_CPU cpu = &cpus[i];
+        KeInitializeSpinLock(&cpu->lock);
+        KeInitializeEvent(&cpu->ready, SynchronizationEvent, FALSE);
+        cpu->tail = &cpu->head;
+        cpu->index = i;
+        if (!NT_SUCCESS(PsCreateSystemThread(&cpu->thread, THREAD_ALL_ACCESS, &attributes, NULL, NULL, deferWorker, cpu))) {
+            for (ULONG j = 0; j < i; j++) { deferStop(&cpus[j]); }
+            NETFLT_FREE(ndisDeferCpusRaw, NET_DEFER_TAG);
+            ndisDeferCpusRaw = NULL;
+            return FALSE;
+        }
+    }
+    ndisDeferCpuCount = count;
+    ndisDeferCpus = cpus;
+    return TRUE;
+}
+
+VOID ndisDeferCleanup() {
+    if (ndisDeferCpus != NULL) {
+        for (ULONG i = 0; i < ndisDeferCpuCount; i++) { deferStop(&ndisDeferCpus[i]); }
+    }
+    if (ndisDeferCpusRaw != NULL) { NETFLT_FREE(ndisDeferCpusRaw, NET_DEFER_TAG); }
+    ndisDeferCpusRaw = NULL;
+    ndisDeferCpus = NULL;
+    ndisDeferCpuCount = 0;
+}
+
+ULONG ndisDeferPolicy(PMS_FILTER filter, const NET_RULE_SET* rule_set, NDIS_PORT_NUMBER port) {
+    // The shared rules decide, whatever image an overlay came from
+    if (rule_set != NULL && rule_set->base != NULL) { rule_set = rule_set->base; }
+    if (ndisDeferCpus == NULL || rule_set == NULL || rule_set->image == NULL || port != NDIS_DEFAULT_PORT_NUMBER ||
+        filter->DeferPaused) {
+        return 0;
+    }
+    return ((rule_set->image->defer & NET_RULE_DEFER_DEPTH) != 0) ? rule_set->image->defer : 0;
+}
+
+VOID ndisDeferQueue(PMS_FILTER filter, BOOLEAN send, ULONG flags, ULONG defer, PNET_BUFFER_LIST* chains, PULONG counts) {
+    PNET_BUFFER_LIST    chain = chains[INSPECT_DEFER];
+    ULONG               count = counts[INSPECT_DEFER];
+    BOOLEAN             closed = (BOOLEAN)((defer & NET_RULE_DEFER_CLOSED) != 0);
+    ULONG               tagged = 0;
+    ULONG               room = 0;
+    ULONG               queued = 0;         // room, plus what a fail-open queue passes in its turn
+    BOOLEAN             wake = FALSE;
+    KIRQL               irql;
+
+    chains[INSPECT_DEFER] = NULL;
+    counts[INSPECT_DEFER] = 0;
+    if (chain == NULL) { return; }
+
+    ULONG_PTR tag = (ULONG_PTR)filter | (send ? DEFER_TAG_SEND : 0) |
+        ((send && (flags & NDIS_SEND_FLAGS_CHECK_FOR_LOOPBACK)) ? DEFER_TAG_LOOPBACK : 0);
+
+    // Counted before the instance is checked, so that ndisDeferPause either
+    // sees these NBLs or this sees the pause
+    InterlockedExchangeAdd(&filter->DeferredNbls, (LONG)count);
+
+    // Up to the first NBL no context area is left for
+    for (PNET_BUFFER_LIST nbl = chain; nbl != NULL && deferTag(nbl, tag); nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+        tagged++;
+    }
+
+    NETFLT_RAISE_IRQL(&irql);
+    PNET_DEFER_CPU cpu = &ndisDeferCpus[NETFLT_CPU_INDEX()];
+    KeAcquireSpinLockAtDpcLevel(&cpu->lock);
+    ULONG depth = defer & NET_RULE_DEFER_DEPTH;
+    if (!filter->DeferPaused && tagged != 0) {
+        if (cpu->queued < depth) { room = min(depth - cpu->queued, tagged); }
+        // Past its room a fail-open queue still takes the NBLs, to pass
+        // them uninspected behind the ones it holds rather than ahead
+        queued = closed ? room : tagged;
+    }
+    if (queued != 0) {
+        PNET_BUFFER_LIST last = chain;
+        for (ULONG i = 1; ; i++) {
+            if (i > room) { *(ULONG_PTR*)NET_BUFFER_LIST_CONTEXT_DATA_START(last) = tag | DEFER_TAG_PASS; }
+            if (i == queued) { break; }
+            last = NET_BUFFER_LIST_NEXT_NBL(last);
+        }
+        PNET_BUFFER_LIST rest = NET_BUFFER_LIST_NEXT_NBL(last);
+        NET_BUFFER_LIST_NEXT_NBL(last) = NULL;
+        wake = (BOOLEAN)(cpu->head == NULL);
+        *cpu->tail = chain;
+        cpu->tail = &NET_BUFFER_LIST_NEXT_NBL(last);
+        cpu->queued += room;
+        cpu->deferred += room;
+        chain = rest;
+    }
+    if (room < count) {
+        if (closed) { cpu->dropped += count - room; } else { cpu->passed += count - room; }
+    }
+    KeReleaseSpinLockFromDpcLevel(&cpu->lock);
+    if (wake) { KeSetEvent(&cpu->ready, IO_NO_INCREMENT, FALSE); }
+    NETFLT_LOWER_IRQL(irql);
+
+    // The rest goes back untagged: what a closed queue has no room for, all
+    // of a pausing instance, and from the first NBL left without a context
+    // area on, which is passed or dropped here, ahead of what is queued
+    if (queued < count) {
+        PNET_BUFFER_LIST nbl = chain;
+        for (ULONG i = queued; i < tagged; i++) {
+            deferUntag(nbl);
+            nbl = NET_BUFFER_LIST_NEXT_NBL(nbl);
+        }
+        deferRelease(filter, count - queued);
+        deferAppend(closed ? &chains[INSPECT_DROP] : &chains[INSPECT_PASS],
+            closed ? &counts[INSPECT_DROP] : &counts[INSPECT_PASS], chain, count - queued);
+    }
+}
+
+VOID ndisDeferAttach(PMS_FILTER filter) {
+    filter->DeferredNbls = 0;
+    filter->DeferPaused = TRUE;
+    NdisInitializeEvent(&filter->DeferDrained);
+}
+
+VOID ndisDeferRestart(PMS_FILTER filter) {
+    InterlockedExchange(&filter->DeferPaused, FALSE);
+}
+
+// Takes the queued NBLs of filter out of every queue, all of them or the
+// sends of one cancel ID, keeping the others in order. The workers finish
+// what they took already.
+static VOID deferTake(PMS_FILTER filter, BOOLEAN all, PVOID cancel_id, PNET_BUFFER_LIST* sends, PULONG send_count,
+    PNET_BUFFER_LIST* receives, PULONG receive_count) {
+    KIRQL irql;
+
+    for (ULONG i = 0; i < ndisDeferCpuCount; i++) {
+        PNET_DEFER_CPU cpu = &ndisDeferCpus[i];
+        KeAcquireSpinLock(&cpu->lock, &irql);
+        PNET_BUFFER_LIST* link = &cpu->head;
+        cpu->tail = &cpu->head;
+        while (*link != NULL) {
+            PNET_BUFFER_LIST nbl = *link;
+            ULONG_PTR tag = deferTagOf(nbl);
+            if ((PMS_FILTER)(tag & ~(ULONG_PTR)DEFER_TAG_MASK) != filter ||
+                (!all && (!(tag & DEFER_TAG_SEND) || NDIS_GET_NET_BUFFER_LIST_CANCEL_ID(nbl) != cancel_id))) {
+                link = &NET_BUFFER_LIST_NEXT_NBL(nbl);
+                cpu->tail = link;
+                continue;
+            }
+            *link = NET_BUFFER_LIST_NEXT_NBL(nbl);
+            deferUntag(nbl);
+            if (!(tag & DEFER_TAG_PASS)) { cpu->queued--; }
+            if (tag & DEFER_TAG_SEND) {
+                NET_BUFFER_LIST_NEXT_NBL(nbl) = *sends;
+                *sends = nbl;
+                (*send_count)++;
+            } else {
+                NET_BUFFER_LIST_NEXT_NBL(nbl) = *receives;
+                *receives = nbl;
+                (*receive_count)++;
+            }
+        }
+        KeReleaseSpinLock(&cpu->lock, irql);
+    }
+}
+
+VOID ndisDeferPause(PMS_FILTER filter) {
+    PNET_BUFFER_LIST    sends = NULL;
+    PNET_BUFFER_LIST    receives = NULL;
+    ULONG               send_count = 0;
+    ULONG               receive_count = 0;
+
+    NdisResetEvent(&filter->DeferDrained);
+    InterlockedExchange(&filter->DeferPaused, TRUE);
+    if (ndisDeferCpus == NULL) { return; }
+
+    deferTake(filter, TRUE, NULL, &sends, &send_count, &receives, &receive_count);
+    if (sends != NULL) { deferAbortSends(filter, sends, send_count, NDIS_STATUS_PAUSED, FALSE); }
+    if (receives != NULL) { NdisFReturnNetBufferLists(filter->FilterHandle, receives, 0); }
+    if (send_count + receive_count != 0) { deferRelease(filter, send_count + receive_count); }
+
+    if (filter->DeferredNbls != 0) {
+        NdisWaitEvent(&filter->DeferDrained, 0);
+    }
+}
+
+VOID ndisDeferCancelSends(PMS_FILTER filter, PVOID cancel_id) {
+    PNET_BUFFER_LIST    sends = NULL;
+    PNET_BUFFER_LIST    receives = NULL;
+    ULONG               send_count = 0;
+    ULONG               receive_count = 0;
+    KIRQL               irql;
+
+    if (ndisDeferCpus == NULL) { return; }
+    NETFLT_RAISE_IRQL(&irql);
+    deferTake(filter, FALSE, cancel_id, &sends, &send_count, &receives, &receive_count);
+    if (sends != NULL) {
+        deferAbortSends(filter, sends, send_count, NDIS_STATUS_SEND_ABORTED, TRUE);
+        deferRelease(filter, send_count);
+    }
+    NETFLT_LOWER_IRQL(irql);
+}
+
+VOID ndisDeferQueryStat(PNET_DEFER_STAT stat) {
+    RtlZeroMemory(stat, sizeof(NET_DEFER_STAT));
+    if (ndisDeferCpus == NULL) { return; }
+    stat->cpus = ndisDeferCpuCount;
+    for (ULONG i = 0; i < ndisDeferCpuCount; i++) {
+        stat->queued += ndisDeferCpus[i].queued;
+        stat->deferred += ndisDeferCpus[i].deferred;
+        stat->passed += ndisDeferCpus[i].passed;
+        stat->dropped += ndisDeferCpus[i].dropped;
+    }
+}
+
+VOID ndisDeferClearStat() {
+    if (ndisDeferCpus == NULL) { return; }
+    for (ULONG i = 0; i < ndisDeferCpuCount; i++) {
+        ndisDeferCpus[i].deferred = 0;
+        ndisDeferCpus[i].passed = 0;
+        ndisDeferCpus[i].dropped = 0;
+    }
+}
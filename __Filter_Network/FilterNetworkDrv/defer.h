@@ -0,0 +1,79 @@
+#pragma once
+//
+// Deferred payload inspection.
+//
+// With a queue depth in the rule image (NET_RULE_DEFER_DEPTH, netrulec -q)
+// the receive and send paths only run the header stages of the rules
+// (INSPECT_HEADERS, tcp_ip.h) at the IRQL NDIS calls them at. An NBL a
+// content rule or a filter program still has to see is queued to a worker
+// thread of the processor it arrived on, which runs the payload stages
+// over it (INSPECT_PAYLOAD) and then indicates, returns, sends or completes
+// it as the path would have. Frames the header stages decide, and all
+// traffic of a rule set without payload stages, never wait behind a
+// content scan; a burst of expensive payloads fills the queue instead of
+// stretching the DPC.
+//
+// The queues are per processor, not per filter instance: a TCP stream
+// keeps the stream table of the processor RSS delivers it on (stream.h)
+// and its segments are scanned in the order they arrived. The worker is
+// bound to its processor and runs the payload stages inside an epoch
+// section, at DISPATCH_LEVEL, so it owns that processor's tables as the
+// paths do. Each section covers one batch of NET_BATCH_MAX NBLs at most,
+// and the worker hands the batch on to NDIS back at PASSIVE_LEVEL, so the
+// DPCs of its processor never wait for more than one batch. The depth is
+// in NBLs per processor. What a full queue has no room for is dropped when
+// the image says so (NET_RULE_DEFER_CLOSED); otherwise it still joins the
+// queue, to be passed without its payload inspected once the NBLs ahead of
+// it are done, so that it does not overtake them.
+//
+// Only pendable receives and sends on the default port are deferred. A
+// queued NBL carries its instance, direction and loopback flag in an NBL
+// context area, allocated as it is queued and freed before NDIS gets it
+// back. An NBL none can be allocated for is passed or dropped at once, with
+// the rest of its chain, like one a full queue has no room for; only these
+// may overtake queued NBLs. A pausing instance gets its queued NBLs back
+// as FilterPause asks: sends completed with NDIS_STATUS_PAUSED, receives
+// returned. A cancel ID takes the queued sends it names, completed with
+// NDIS_STATUS_SEND_ABORTED.
+//
+
+#define NET_DEFER_TAG           '1feD'
+
+typedef struct _NET_DEFER_STAT {
+    ULONG   cpus;                   // one queue and worker per processor, 0 - none
+    ULONG   queued;                 // NBLs waiting to be inspected
+    ULONG64 deferred;               // NBLs queued to a worker
+    ULONG64 passed;                 // NBLs a full queue passed uninspected
+    ULONG64 dropped;                // NBLs a full queue dropped
+} NET_DEFER_STAT, * PNET_DEFER_STAT;
+
+struct _MS_FILTER;
+
+// Starts a worker per processor, at PASSIVE_LEVEL. Without them every
+// payload is inspected inline.
+BOOLEAN ndisDeferInit();
+// Stops the workers; every instance is detached by then
+VOID ndisDeferCleanup();
+
+// NET_RULE_IMAGE.defer of the shared rules when the receive or send path
+// of filter can defer the payloads of a chain on port under rule_set (and
+// inspects it with INSPECT_HEADERS); 0 - it runs INSPECT_ALL. Called inside
+// the epoch section rule_set was acquired in.
+ULONG ndisDeferPolicy(struct _MS_FILTER* filter, const NET_RULE_SET* rule_set, NDIS_PORT_NUMBER port);
+// Queues chains[INSPECT_DEFER] to this processor's worker, at DISPATCH_LEVEL
+// or below, after the epoch section; defer is what ndisDeferPolicy returned.
+// The NBLs it does not queue move to chains[INSPECT_PASS] or
+// chains[INSPECT_DROP]. send: the chain is a send of SendFlags flags.
+VOID ndisDeferQueue(struct _MS_FILTER* filter, BOOLEAN send, ULONG flags, ULONG defer, PNET_BUFFER_LIST* chains, PULONG counts);
+
+// Instance state, at PASSIVE_LEVEL: ndisDeferPause hands back everything
+// the instance has queued and waits for what the workers are inspecting.
+// An instance defers nothing from attach until its first restart.
+VOID ndisDeferAttach(struct _MS_FILTER* filter);
+VOID ndisDeferRestart(struct _MS_FILTER* filter);
+VOID ndisDeferPause(struct _MS_FILTER* filter);
+// FilterCancelSendNetBufferLists, at DISPATCH_LEVEL or below
+VOID ndisDeferCancelSends(struct _MS_FILTER* filter, PVOID cancel_id);
+
+VOID ndisDeferQueryStat(PNET_DEFER_STAT stat);
+VOID ndisDeferClearStat();
@@ -7,6 +7,240 @@
 
 #pragma NDIS_INIT_FUNCTION(FilterRegisterDevice)
 
+// IOCTL_FILTER_QUERY_TOP_SOURCES rewrites the merged entries in place
+C_ASSERT(sizeof(NET_RATE_SOURCE) == sizeof(FILTER_TOP_SOURCE));
+
+// Reads that wait for records: IOCTL_FILTER_READ_ALERTS requests wait in
+// FilterAlertQueue until the packet path records an alert, and
+// IOCTL_FILTER_READ_FLOWS requests in FilterFlowQueue until the sweep or a
+// ring filling halfway. The queue's DPC completes them with the records.
+typedef struct _FILTER_READ_QUEUE {
+    IO_CSQ              Csq;                // first: the callbacks get it
+    LIST_ENTRY          IrpList;
+    KSPIN_LOCK          IrpLock;
+    volatile LONG       Waiters;
+    KDPC                Dpc;
+} FILTER_READ_QUEUE, * PFILTER_READ_QUEUE;
+
+static FILTER_READ_QUEUE    FilterAlertQueue;
+static FILTER_READ_QUEUE    FilterFlowQueue;
+
+// The sweep: a periodic timer whose DPC queues one DPC per processor, which
+// expires the idle flows of that processor's table
+static KTIMER               FilterFlowTimer;
+static KDPC                 FilterFlowTimerDpc;
+static PKDPC                FilterFlowSweepDpcs = NULL;
+static ULONG                FilterFlowSweepCount = 0;
+
+static IO_CSQ_INSERT_IRP            filterReadCsqInsertIrp;
+static IO_CSQ_REMOVE_IRP            filterReadCsqRemoveIrp;
+static IO_CSQ_PEEK_NEXT_IRP         filterReadCsqPeekNextIrp;
+static IO_CSQ_ACQUIRE_LOCK          filterReadCsqAcquireLock;
+static IO_CSQ_RELEASE_LOCK          filterReadCsqReleaseLock;
+static IO_CSQ_COMPLETE_CANCELED_IRP filterReadCsqCompleteCanceledIrp;
+static KDEFERRED_ROUTINE            filterAlertDpcRoutine;
+static KDEFERRED_ROUTINE            filterFlowDpcRoutine;
+static KDEFERRED_ROUTINE            filterFlowTimerDpcRoutine;
+static KDEFERRED_ROUTINE            filterFlowSweepDpcRoutine;
+
+static VOID filterReadCsqInsertIrp(PIO_CSQ Csq, PIRP Irp) {
+    PFILTER_READ_QUEUE Queue = CONTAINING_RECORD(Csq, FILTER_READ_QUEUE, Csq);
+    InsertTailList(&Queue->IrpList, &Irp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&Queue->Waiters);
+}
+
+static VOID filterReadCsqRemoveIrp(PIO_CSQ Csq, PIRP Irp) {
+    PFILTER_READ_QUEUE Queue = CONTAINING_RECORD(Csq, FILTER_READ_QUEUE, Csq);
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    InterlockedDecrement(&Queue->Waiters);
+}
+
+static PIRP filterReadCsqPeekNextIrp(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext) {
+    // PeekContext is a file object when its handle is being cleaned up
+    PFILTER_READ_QUEUE Queue = CONTAINING_RECORD(Csq, FILTER_READ_QUEUE, Csq);
+    PLIST_ENTRY Link = (Irp == NULL) ? Queue->IrpList.Flink : Irp->Tail.Overlay.ListEntry.Flink;
+
+    for (; Link != &Queue->IrpList; Link = Link->Flink) {
+        PIRP NextIrp = CONTAINING_RECORD(Link, IRP, Tail.Overlay.ListEntry);
+        if (PeekContext == NULL || IoGetCurrentIrpStackLocation(NextIrp)->FileObject == (PFILE_OBJECT)PeekContext) {
+            return NextIrp;
+        }
+    }
+    return NULL;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(Csq, FILTER_READ_QUEUE, Csq)->IrpLock)
+static VOID filterReadCsqAcquireLock(PIO_CSQ Csq, _Out_ _At_(*Irql, _Post_ _IRQL_saves_) PKIRQL Irql) {
+    KeAcquireSpinLock(&CONTAINING_RECORD(Csq, FILTER_READ_QUEUE, Csq)->IrpLock, Irql);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(Csq, FILTER_READ_QUEUE, Csq)->IrpLock)
+static VOID filterReadCsqReleaseLock(PIO_CSQ Csq, _In_ _IRQL_restores_ KIRQL Irql) {
+    KeReleaseSpinLock(&CONTAINING_RECORD(Csq, FILTER_READ_QUEUE, Csq)->IrpLock, Irql);
+}
+
+static VOID filterReadCsqCompleteCanceledIrp(PIO_CSQ Csq, PIRP Irp) {
+    UNREFERENCED_PARAMETER(Csq);
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+static VOID filterReadQueueInit(PFILTER_READ_QUEUE Queue, PKDEFERRED_ROUTINE DpcRoutine) {
+    InitializeListHead(&Queue->IrpList);
+    KeInitializeSpinLock(&Queue->IrpLock);
+    Queue->Waiters = 0;
+    KeInitializeDpc(&Queue->Dpc, DpcRoutine, NULL);
+    IoCsqInitialize(&Queue->Csq, filterReadCsqInsertIrp, filterReadCsqRemoveIrp, filterReadCsqPeekNextIrp,
+        filterReadCsqAcquireLock, filterReadCsqReleaseLock, filterReadCsqCompleteCanceledIrp);
+}
+
+static VOID filterReadQueueCancel(PFILTER_READ_QUEUE Queue, PFILE_OBJECT FileObject) {
+    PIRP PendingIrp;
+
+    while ((PendingIrp = IoCsqRemoveNextIrp(&Queue->Csq, FileObject)) != NULL) {
+        PendingIrp->IoStatus.Status = STATUS_CANCELLED;
+        PendingIrp->IoStatus.Information = 0;
+        IoCompleteRequest(PendingIrp, IO_NO_INCREMENT);
+    }
+}
+
+static VOID filterAlertDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    PIRP Irp;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    // Each waiting reader takes as many records as its buffer holds
+    while (ndisAlertPending() && (Irp = IoCsqRemoveNextIrp(&FilterAlertQueue.Csq, NULL)) != NULL) {
+        PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+        ULONG Count = ndisAlertDrain((PNET_ALERT_RECORD)Irp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength / sizeof(NET_ALERT_RECORD));
+
+        if (Count == 0) {
+            // A concurrent drain holds the records. What it leaves behind it
+            // re-arms this DPC for, and so did this drain if it found them
+            // still pending.
+            IoCsqInsertIrp(&FilterAlertQueue.Csq, Irp, NULL);
+            break;
+        }
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Irp->IoStatus.Information = Count * sizeof(NET_ALERT_RECORD);
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+static VOID filterAlertNotify(VOID) {
+    // Called on the packet path at DISPATCH_LEVEL; costs nothing without readers
+    if (FilterAlertQueue.Waiters != 0) {
+        KeInsertQueueDpc(&FilterAlertQueue.Dpc, NULL, NULL);
+    }
+}
+
+static VOID filterFlowDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    PIRP Irp;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    // Each waiting reader gets one IPFIX message of as many records as its
+    // buffer holds
+    while (ndisMeterPending() && (Irp = IoCsqRemoveNextIrp(&FilterFlowQueue.Csq, NULL)) != NULL) {
+        PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+        LARGE_INTEGER SystemTime;
+        ULONG64 InterruptTime = KeQueryInterruptTime();
+        KeQuerySystemTime(&SystemTime);
+        ULONG Length = ndisMeterExport((PUCHAR)Irp->AssociatedIrp.SystemBuffer,
+            IrpSp->Parameters.DeviceIoControl.OutputBufferLength, (ULONG64)SystemTime.QuadPart, InterruptTime);
+
+        if (Length == 0) {
+            IoCsqInsertIrp(&FilterFlowQueue.Csq, Irp, NULL);
+            break;
+        }
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Irp->IoStatus.Information = Length;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
+
+static VOID filterFlowNotify(VOID) {
+    // A ring filled halfway on the packet path; do not wait for the sweep
+    if (FilterFlowQueue.Waiters != 0) {
+        KeInsertQueueDpc(&FilterFlowQueue.Dpc, NULL, NULL);
+    }
+}
+
+static VOID filterFlowTimerDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    for (ULONG i = 0; i < FilterFlowSweepCount; i++) {
+        KeInsertQueueDpc(&FilterFlowSweepDpcs[i], NULL, NULL);
+    }
+}
+
+static VOID filterFlowSweepDpcRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    PNET_METER_TABLE Table = ndisMeterCurrent();
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    // Targeted at the table's processor, at DISPATCH_LEVEL: the packet path
+    // cannot be inside the table meanwhile
+    if (Table != NULL) {
+        ndisMeterExpire(Table, KeQueryInterruptTime(), Table->capacity);
+    }
+    if (FilterFlowQueue.Waiters != 0 && ndisMeterPending()) {
+        KeInsertQueueDpc(&FilterFlowQueue.Dpc, NULL, NULL);
+    }
+}
+
+static VOID filterFlowSweepStart(VOID) {
+    ULONG Count = NETFLT_CPU_COUNT();
+    LARGE_INTEGER DueTime;
+
+    // Without metering, or without the DPCs, flows expire on the packet
+    // path only and reads complete when a ring fills halfway
+    if (ndisMeterCurrent() == NULL) { return; }
+    FilterFlowSweepDpcs = (PKDPC)NETFLT_ALLOC(Count * sizeof(KDPC), NET_METER_TAG);
+    if (FilterFlowSweepDpcs == NULL) { return; }
+    for (ULONG i = 0; i < Count; i++) {
+        PROCESSOR_NUMBER Number;
+        KeInitializeDpc(&FilterFlowSweepDpcs[i], filterFlowSweepDpcRoutine, NULL);
+        if (NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &Number))) {
+            KeSetTargetProcessorDpcEx(&FilterFlowSweepDpcs[i], &Number);
+        }
+    }
+    FilterFlowSweepCount = Count;
+
+    KeInitializeDpc(&FilterFlowTimerDpc, filterFlowTimerDpcRoutine, NULL);
+    KeInitializeTimer(&FilterFlowTimer);
+    DueTime.QuadPart = -(LONGLONG)NET_METER_SWEEP;
+    KeSetTimerEx(&FilterFlowTimer, DueTime, NET_METER_SWEEP / 10000, &FilterFlowTimerDpc);
+}
+
+static VOID filterFlowSweepStop(VOID) {
+    if (FilterFlowSweepDpcs == NULL) { return; }
+    KeCancelTimer(&FilterFlowTimer);
+    // Twice: a timer DPC still running queues the per-processor DPCs the
+    // first flush may not have seen
+    KeFlushQueuedDpcs();
+    KeFlushQueuedDpcs();
+    NETFLT_FREE(FilterFlowSweepDpcs, NET_METER_TAG);
+    FilterFlowSweepDpcs = NULL;
+    FilterFlowSweepCount = 0;
+}
+
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NDIS_STATUS
@@ -30,6 +264,9 @@ FilterRegisterDevice(
     DispatchTable[IRP_MJ_DEVICE_CONTROL] = FilterDeviceIoControl;
 
 
+    filterReadQueueInit(&FilterAlertQueue, filterAlertDpcRoutine);
+    filterReadQueueInit(&FilterFlowQueue, filterFlowDpcRoutine);
+
     NdisInitUnicodeString(&DeviceName, NTDEVICE_STRING);
     NdisInitUnicodeString(&DeviceLinkUnicodeString, LINKNAME_STRING);
 
@@ -58,6 +295,10 @@ FilterRegisterDevice(
 
         FilterDeviceExtension->Signature = 'FTDR';
         FilterDeviceExtension->Handle = FilterDriverHandle;
+
+        ndisAlertSetNotify(filterAlertNotify);
+        ndisMeterSetNotify(filterFlowNotify);
+        filterFlowSweepStart();
     }
 
 
@@ -74,6 +315,12 @@ FilterDeregisterDevice(
 )
 {
     if (NdisFilterDeviceHandle != NULL) {
+        // Every handle is closed by now, so no reader is waiting; make sure
+        // the read and sweep DPCs are not running either
+        ndisAlertSetNotify(NULL);
+        ndisMeterSetNotify(NULL);
+        filterFlowSweepStop();
+        KeFlushQueuedDpcs();
         NdisDeregisterDeviceEx(NdisFilterDeviceHandle);
     }
 
@@ -99,6 +346,9 @@ FilterDispatch(
         break;
 
     case IRP_MJ_CLEANUP:
+        // Alert and flow reads still waiting on this handle
+        filterReadQueueCancel(&FilterAlertQueue, IrpStack->FileObject);
+        filterReadQueueCancel(&FilterFlowQueue, IrpStack->FileObject);
         break;
 
     case IRP_MJ_CLOSE:
@@ -216,10 +466,161 @@ FilterDeviceIoControl(
         }
         break;
 
+    case IOCTL_FILTER_QUERY_ALL_STAT:
+        DbgPrint("NDIS \tFilterDeviceIoControl!IOCTL_FILTER_QUERY_ALL_STAT\n");
+        OutputBuffer = (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+        OutputBufferLength = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+
+        if (OutputBufferLength < sizeof(FILTER_DRIVER_ALL_STAT)) {
+            DbgPrint("NDIS \tFilterDeviceIoControl!STATUS_BUFFER_TOO_SMALL\n");
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        } else {
+            PFILTER_DRIVER_ALL_STAT AllStat = (PFILTER_DRIVER_ALL_STAT)OutputBuffer;
+            NET_FLOW_CACHE_STAT FlowStat;
+            NET_ALERT_STAT AlertStat;
+            NET_STREAM_STAT StreamStat;
+            NET_RATE_STAT RateStat;
+            NET_DNS_STAT DnsStat;
+            NET_DEFER_STAT DeferStat;
+            NET_METER_STAT MeterStat;
+
+            NdisZeroMemory(AllStat, sizeof(FILTER_DRIVER_ALL_STAT));
+            ndisFlowCacheQueryStat(&FlowStat);
+            AllStat->FlowCacheCpus = FlowStat.cpus;
+            AllStat->FlowCacheEntries = FlowStat.entries;
+            AllStat->FlowCacheHits = FlowStat.hits;
+            AllStat->FlowCacheMisses = FlowStat.misses;
+            AllStat->FlowCacheEvictions = FlowStat.evictions;
+            ndisAlertQueryStat(&AlertStat);
+            AllStat->AlertsWritten = AlertStat.written;
+            AllStat->AlertsDropped = AlertStat.dropped;
+            AllStat->AlertsPending = AlertStat.pending;
+            ndisStreamQueryStat(&StreamStat);
+            AllStat->StreamCpus = StreamStat.cpus;
+            AllStat->StreamEntries = StreamStat.entries;
+            AllStat->StreamHits = StreamStat.hits;
+            AllStat->StreamMisses = StreamStat.misses;
+            AllStat->StreamGaps = StreamStat.gaps;
+            AllStat->StreamEvictions = StreamStat.evictions;
+            ndisRateQueryStat(&RateStat);
+            AllStat->RateCpus = RateStat.cpus;
+            AllStat->RatePackets = RateStat.packets;
+            AllStat->RateAdmitted = RateStat.admitted;
+            AllStat->RateLimited = RateStat.limited;
+            ndisDnsQueryStat(&DnsStat);
+            AllStat->DnsEntries = DnsStat.entries;
+            AllStat->DnsResponses = DnsStat.responses;
+            AllStat->DnsBlocked = DnsStat.blocked;
+            AllStat->DnsCached = DnsStat.cached;
+            AllStat->DnsDropped = DnsStat.dropped;
+            ndisDeferQueryStat(&DeferStat);
+            AllStat->DeferCpus = DeferStat.cpus;
+            AllStat->DeferQueued = DeferStat.queued;
+            AllStat->DeferredNbls = DeferStat.deferred;
+            AllStat->DeferPassed = DeferStat.passed;
+            AllStat->DeferDropped = DeferStat.dropped;
+            ndisMeterQueryStat(&MeterStat);
+            AllStat->MeterCpus = MeterStat.cpus;
+            AllStat->MeterEntries = MeterStat.entries;
+            AllStat->MeterActive = MeterStat.active;
+            AllStat->MeterPending = MeterStat.pending;
+            AllStat->MeterPackets = MeterStat.packets;
+            AllStat->MeterStarted = MeterStat.started;
+            AllStat->MeterExported = MeterStat.exported;
+            AllStat->MeterLost = MeterStat.lost;
+            InfoLength = sizeof(FILTER_DRIVER_ALL_STAT);
+        }
+        break;
+
+    case IOCTL_FILTER_CLEAR_ALL_STAT:
+        DbgPrint("NDIS \tFilterDeviceIoControl!IOCTL_FILTER_CLEAR_ALL_STAT\n");
+        ndisFlowCacheClearStat();
+        ndisAlertClearStat();
+        ndisStreamClearStat();
+        ndisRateClearStat();
+        ndisDnsClearStat();
+        ndisDeferClearStat();
+        ndisMeterClearStat();
+        break;
+
     case IOCTL_FILTER_UPDATE_CONFIG:
         DbgPrint("NDIS \tFilterDeviceIoControl!IOCTL_FILTER_UPDATE_CONFIG\n");
-        ndisUpdateNetRules();
+        // A rule image (or BUGAV records) in the input buffer replaces the
+        // rules; an empty buffer re-reads the configuration file
+        InputBuffer = (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+        InputBufferLength = IrpSp->Parameters.DeviceIoControl.InputBufferLength;
+        Status = ndisUpdateNetRules(InputBuffer, InputBufferLength);
+        break;
 
+    case IOCTL_FILTER_UPDATE_INSTANCE_CONFIG:
+        DbgPrint("NDIS \tFilterDeviceIoControl!IOCTL_FILTER_UPDATE_INSTANCE_CONFIG\n");
+        // The rules of one instance, run ahead of the shared ones
+        InputBuffer = (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+        InputBufferLength = IrpSp->Parameters.DeviceIoControl.InputBufferLength;
+        if (InputBufferLength < FIELD_OFFSET(FILTER_INSTANCE_RULES, Data) ||
+            ((PFILTER_INSTANCE_RULES)InputBuffer)->InstanceNameLength > sizeof(((PFILTER_INSTANCE_RULES)InputBuffer)->InstanceName)) {
+            Status = STATUS_INVALID_PARAMETER;
+            break;
+        } else {
+            PFILTER_INSTANCE_RULES InstanceRules = (PFILTER_INSTANCE_RULES)InputBuffer;
+            Status = ndisUpdateInstanceRules((PUCHAR)InstanceRules->InstanceName, InstanceRules->InstanceNameLength,
+                InstanceRules->Data, InputBufferLength - FIELD_OFFSET(FILTER_INSTANCE_RULES, Data));
+        }
+        break;
+
+    case IOCTL_FILTER_READ_ALERTS:
+        // Inverted call: completes at once with the records there are, or
+        // waits until the packet path records one
+        OutputBuffer = (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+        OutputBufferLength = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+        if (OutputBufferLength < sizeof(NET_ALERT_RECORD)) {
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        InfoLength = ndisAlertDrain((PNET_ALERT_RECORD)OutputBuffer, OutputBufferLength / sizeof(NET_ALERT_RECORD)) * sizeof(NET_ALERT_RECORD);
+        if (InfoLength != 0) {
+            break;
+        }
+        IoCsqInsertIrp(&FilterAlertQueue.Csq, Irp, NULL);
+        // A record that landed after the drain found no reader to wake
+        KeInsertQueueDpc(&FilterAlertQueue.Dpc, NULL, NULL);
+        return STATUS_PENDING;
+
+    case IOCTL_FILTER_READ_FLOWS:
+        // Inverted call too, but always waits: records leave in batches, on
+        // the next sweep or when a ring fills halfway
+        OutputBufferLength = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+        if (OutputBufferLength < NET_METER_MESSAGE_MIN) {
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        IoCsqInsertIrp(&FilterFlowQueue.Csq, Irp, NULL);
+        return STATUS_PENDING;
+
+    case IOCTL_FILTER_QUERY_TOP_SOURCES:
+        DbgPrint("NDIS \tFilterDeviceIoControl!IOCTL_FILTER_QUERY_TOP_SOURCES\n");
+        OutputBuffer = (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+        OutputBufferLength = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+        if (OutputBufferLength < sizeof(FILTER_TOP_SOURCE)) {
+            Status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        } else {
+            // Merged into the buffer, then rewritten in place in network order
+            PNET_RATE_SOURCE Sources = (PNET_RATE_SOURCE)OutputBuffer;
+            PFILTER_TOP_SOURCE Top = (PFILTER_TOP_SOURCE)OutputBuffer;
+            ULONG Count = ndisRateQueryTop(Sources, OutputBufferLength / sizeof(FILTER_TOP_SOURCE));
+
+            for (ULONG i = 0; i < Count; i++) {
+                NET_RATE_SOURCE Source = Sources[i];
+                for (ULONG b = 0; b < 8; b++) {
+                    Top[i].SourceIp[b] = (UCHAR)(Source.address.hi >> (56 - 8 * b));
+                    Top[i].SourceIp[8 + b] = (UCHAR)(Source.address.lo >> (56 - 8 * b));
+                }
+                Top[i].Packets = Source.packets;
+            }
+            InfoLength = Count * sizeof(FILTER_TOP_SOURCE);
+        }
         break;
 
     default:
@@ -0,0 +1,449 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+#include "dns.h"
+
+#define DNS_FNV_BASIS       0xCBF29CE484222325ULL
+#define DNS_FNV_PRIME       0x00000100000001B3ULL
+#define DNS_SEED            0x9E3779B97F4A7C15ULL
+#define DNS_MIN_SLOT_BITS   4
+#define DNS_MAX_SLOT_BITS   23              // twice NET_DNS_MAX
+#define DNS_HEADER_LEN      12
+#define DNS_TYPE_A          1
+#define DNS_TYPE_CNAME      5
+#define DNS_TYPE_AAAA       28
+#define DNS_CLASS_IN        1
+#define DNS_SECOND          10000000ULL     // interrupt time units
+
+C_ASSERT(sizeof(NET_DOMAIN_SLOT) == 16);
+C_ASSERT(sizeof(NET_DNS_BUCKET) == NETFLT_CACHE_LINE);
+C_ASSERT((NET_DNS_BUCKETS & (NET_DNS_BUCKETS - 1)) == 0);
+
+static PNET_DNS_BUCKET      ndisDnsBuckets = NULL;
+static PNET_DNS_COUNTERS    ndisDnsCounters = NULL;
+static PNET_DNS_SCRATCH     ndisDnsScratch = NULL;
+static PVOID                ndisDnsRaw = NULL;
+static ULONG                ndisDnsCpuCount = 0;
+static volatile LONG        ndisDnsLatest = 0;      // latest expiry in the cache, seconds
+
+static ULONG dnsAlign(ULONG offset) {
+    return (offset + 7) & ~(ULONG)7;
+}
+
+static UINT64 dnsLoad64(const UCHAR* bytes) {
+    UINT64 value = 0;
+    for (ULONG i = 0; i < 8; i++) { value = (value << 8) | bytes[i]; }
+    return value;
+}
+
+static FORCEINLINE UINT64 dnsMix(UINT64 h) {
+    h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ULL;
+    return h ^ (h >> 32);
+}
+
+// FNV-1a over the name from its last character back, mixed; what the set
+// stores for a name and what a lookup has at each of its label boundaries
+static UINT64 dnsNameHash(UINT64 seed, const CHAR* name, ULONG length) {
+    UINT64 h = DNS_FNV_BASIS ^ seed;
+    for (ULONG i = length; i-- > 0; ) { h = (h ^ (UCHAR)name[i]) * DNS_FNV_PRIME; }
+    return dnsMix(h);
+}
+
+static FORCEINLINE const NET_DOMAIN_SLOT* dnsSlots(const NET_DOMAINS* domains) {
+    return (const NET_DOMAIN_SLOT*)((const UCHAR*)domains + domains->slot_offset);
+}
+
+static FORCEINLINE const CHAR* dnsNames(const NET_DOMAINS* domains) {
+    return (const CHAR*)domains + domains->name_offset;
+}
+
+// Linear probing; a valid set always has an empty slot to stop at
+static BOOLEAN dnsProbe(const NET_DOMAINS* domains, UINT64 hash, const CHAR* name, ULONG length) {
+    const NET_DOMAIN_SLOT* slots = dnsSlots(domains);
+    ULONG mask = (1u << domains->slot_bits) - 1;
+
+    for (ULONG i = (ULONG)hash & mask; slots[i].name_length != 0; i = (i + 1) & mask) {
+        if (slots[i].hash == hash && slots[i].name_length == length &&
+            memcmp(dnsNames(domains) + slots[i].name_offset, name, length) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+BOOLEAN ndisDomainBlocked(const NET_DOMAINS* domains, const CHAR* name, ULONG length) {
+    UINT64 h = DNS_FNV_BASIS ^ domains->seed;
+
+    if (length == 0 || length > NET_DNS_NAME_MAX) { return FALSE; }
+    // Every suffix that starts a label: "com", "example.com", ...
+    for (ULONG i = length; i-- > 0; ) {
+        h = (h ^ (UCHAR)name[i]) * DNS_FNV_PRIME;
+        if (i != 0 && name[i - 1] != '.') { continue; }
+        if (dnsProbe(domains, dnsMix(h), name + i, length - i)) { return TRUE; }
+    }
+    return FALSE;
+}
+
+VOID ndisFreeDomains(PNET_DOMAINS domains) {
+    if (domains != NULL) { NETFLT_FREE(domains, NET_DNS_TAG); }
+}
+
+//
+// Builder
+//
+
+// Lower case, without a leading "*." or a trailing dot, into out (at least
+// NET_DNS_NAME_MAX bytes). Returns the length, 0 for a name that is empty,
+// too long or has an empty label.
+static ULONG dnsNormalize(const CHAR* name, CHAR* out) {
+    ULONG length = 0;
+
+    if (name[0] == '*' && name[1] == '.') { name += 2; }
+    for (; *name != '\0'; name++) {
+        CHAR c = *name;
+        if ((UCHAR)c <= ' ' || length == NET_DNS_NAME_MAX) { return 0; }
+        if (c == '.' && (length == 0 || out[length - 1] == '.')) { return 0; }
+        out[length++] = (c >= 'A' && c <= 'Z') ? (CHAR)(c + 'a' - 'A') : c;
+    }
+    if (length != 0 && out[length - 1] == '.') { length--; }
+    return length;
+}
+
+PNET_DOMAINS ndisBuildDomains(const CHAR* const* names, ULONG count) {
+    CHAR name[NET_DNS_NAME_MAX];
+    PNET_DOMAINS domains = NULL;
+    UINT64 name_size = 0;
+
+    if (count == 0 || count > NET_DNS_MAX) { return NULL; }
+    for (ULONG i = 0; i < count; i++) {
+        ULONG length = dnsNormalize(names[i], name);
+        if (length == 0) { return NULL; }
+        name_size += length;
+    }
+
+    // At most half full, so probes stay short
+    ULONG slot_bits = DNS_MIN_SLOT_BITS;
+    while ((1u << slot_bits) < 2 * count) { slot_bits++; }
+    ULONG slot_offset = dnsAlign(sizeof(NET_DOMAINS));
+    ULONG name_offset = slot_offset + (1u << slot_bits) * (ULONG)sizeof(NET_DOMAIN_SLOT);
+    UINT64 size = (UINT64)name_offset + name_size;
+    if (size > 0x7FFFFFFF) { return NULL; }
+
+    domains = (PNET_DOMAINS)NETFLT_ALLOC((SIZE_T)size, NET_DNS_TAG);
+    if (domains == NULL) { return NULL; }
+    RtlZeroMemory(domains, (SIZE_T)size);
+    domains->slot_bits = slot_bits;
+    domains->slot_offset = slot_offset;
+    domains->name_offset = name_offset;
+    domains->seed = DNS_SEED;
+
+    PNET_DOMAIN_SLOT slots = (PNET_DOMAIN_SLOT)((PUCHAR)domains + slot_offset);
+    PCHAR pool = (PCHAR)domains + name_offset;
+    ULONG mask = (1u << slot_bits) - 1;
+    for (ULONG n = 0; n < count; n++) {
+        ULONG length = dnsNormalize(names[n], name);
+        UINT64 hash = dnsNameHash(domains->seed, name, length);
+        if (dnsProbe(domains, hash, name, length)) { continue; }
+
+        ULONG i = (ULONG)hash & mask;
+        while (slots[i].name_length != 0) { i = (i + 1) & mask; }
+        slots[i].hash = hash;
+        slots[i].name_offset = domains->name_size;
+        slots[i].name_length = length;
+        RtlCopyMemory(pool + domains->name_size, name, length);
+        domains->name_size += length;
+        domains->count++;
+    }
+    domains->size = name_offset + domains->name_size;
+    return domains;
+}
+
+BOOLEAN ndisValidateDomains(const NET_DOMAINS* domains, ULONG size) {
+    if (size < sizeof(NET_DOMAINS) || domains->size != size || domains->count == 0 || domains->count > NET_DNS_MAX ||
+        domains->slot_bits < DNS_MIN_SLOT_BITS || domains->slot_bits > DNS_MAX_SLOT_BITS ||
+        domains->count >= (1u << domains->slot_bits)) {
+        return FALSE;
+    }
+    UINT64 slot_end = (UINT64)domains->slot_offset + ((UINT64)sizeof(NET_DOMAIN_SLOT) << domains->slot_bits);
+    if (domains->slot_offset < sizeof(NET_DOMAINS) || (domains->slot_offset & 7) != 0 ||
+        domains->name_offset < slot_end || (UINT64)domains->name_offset + domains->name_size > size) {
+        return FALSE;
+    }
+
+    // Every name inside the pool and hashed to what its slot says, and
+    // fewer names than slots, so that every probe ends
+    const NET_DOMAIN_SLOT* slots = dnsSlots(domains);
+    ULONG used = 0;
+    for (ULONG i = 0; i < (1u << domains->slot_bits); i++) {
+        if (slots[i].name_length == 0) { continue; }
+        if (slots[i].name_length > NET_DNS_NAME_MAX ||
+            (UINT64)slots[i].name_offset + slots[i].name_length > domains->name_size ||
+            slots[i].hash != dnsNameHash(domains->seed, dnsNames(domains) + slots[i].name_offset, slots[i].name_length)) {
+            return FALSE;
+        }
+        used++;
+    }
+    return (BOOLEAN)(used == domains->count);
+}
+
+//
+// Block cache
+//
+
+BOOLEAN ndisDnsInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = NET_DNS_BUCKETS * sizeof(NET_DNS_BUCKET) + count * (sizeof(NET_DNS_COUNTERS) + sizeof(NET_DNS_SCRATCH)) +
+        NETFLT_CACHE_LINE;
+
+    ndisDnsRaw = NETFLT_ALLOC(size, NET_DNS_TAG);
+    if (ndisDnsRaw == NULL) { return FALSE; }
+    RtlZeroMemory(ndisDnsRaw, size);
+
+    ndisDnsBuckets = (PNET_DNS_BUCKET)(((ULONG_PTR)ndisDnsRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+    ndisDnsCounters = (PNET_DNS_COUNTERS)&ndisDnsBuckets[NET_DNS_BUCKETS];
+    ndisDnsScratch = (PNET_DNS_SCRATCH)&ndisDnsCounters[count];
+    ndisDnsCpuCount = count;
+    ndisDnsLatest = 0;
+    return TRUE;
+}
+
+VOID ndisDnsCleanup() {
+    if (ndisDnsRaw != NULL) { NETFLT_FREE(ndisDnsRaw, NET_DNS_TAG); }
+    ndisDnsRaw = NULL;
+    ndisDnsBuckets = NULL;
+    ndisDnsCounters = NULL;
+    ndisDnsScratch = NULL;
+    ndisDnsCpuCount = 0;
+    ndisDnsLatest = 0;
+}
+
+static FORCEINLINE PNET_DNS_BUCKET dnsBucket(const NET_LPM6_ADDRESS* address) {
+    return &ndisDnsBuckets[dnsMix(address->hi ^ (address->lo * 0x9E3779B97F4A7C15ULL)) & (NET_DNS_BUCKETS - 1)];
+}
+
+static VOID dnsInsert(const NET_LPM6_ADDRESS* address, ULONG expiry) {
+    PNET_DNS_BUCKET bucket = dnsBucket(address);
+    ULONG way = 0;
+    LONG sequence;
+
+    for (;;) {
+        sequence = bucket->sequence;
+        if (!(sequence & 1) && InterlockedCompareExchange(&bucket->sequence, sequence + 1, sequence) == sequence) { break; }
+        YieldProcessor();
+    }
+    // The address again, else the entry closest to expiry (empty ones are 0)
+    for (ULONG i = 0; i < NET_DNS_WAYS; i++) {
+        if (bucket->expiry[i] != 0 && bucket->address[i].hi == address->hi && bucket->address[i].lo == address->lo) {
+            way = i;
+            if (bucket->expiry[i] > expiry) { expiry = bucket->expiry[i]; }
+            break;
+        }
+        if (bucket->expiry[i] < bucket->expiry[way]) { way = i; }
+    }
+    bucket->address[way] = *address;
+    bucket->expiry[way] = expiry;
+    KeMemoryBarrier();
+    InterlockedExchange(&bucket->sequence, sequence + 2);
+
+    LONG latest;
+    while ((ULONG)(latest = ndisDnsLatest) < expiry) {
+        if (InterlockedCompareExchange(&ndisDnsLatest, (LONG)expiry, latest) == latest) { break; }
+    }
+}
+
+static BOOLEAN dnsCached(const NET_LPM6_ADDRESS* address, ULONG second) {
+    PNET_DNS_BUCKET bucket = dnsBucket(address);
+    BOOLEAN found;
+    LONG sequence;
+
+    // Read while no writer has the bucket; writers never wait for readers
+    do {
+        while ((sequence = bucket->sequence) & 1) { YieldProcessor(); }
+        KeMemoryBarrier();
+        found = FALSE;
+        for (ULONG i = 0; i < NET_DNS_WAYS; i++) {
+            if (bucket->expiry[i] > second && bucket->address[i].hi == address->hi && bucket->address[i].lo == address->lo) {
+                found = TRUE;
+            }
+        }
+        KeMemoryBarrier();
+    } while (bucket->sequence != sequence);
+    return found;
+}
+
+ULONG ndisDnsCacheFrame(const UCHAR* frame, ULONG length, ULONG64 now) {
+    NET_LPM6_ADDRESS source, destination;
+    UINT16 ether_type;
+    ULONG second = (ULONG)(now / DNS_SECOND);
+
+    // Nothing cached, or all of it expired: one shared, rarely written load
+    if (ndisDnsBuckets == NULL || second >= (ULONG)ndisDnsLatest) { return NET_CLS_NO_MATCH; }
+
+    ULONG ip = ndisFrameNetworkOffset(frame, length, &ether_type);
+    if (ether_type == 0x0800 && ip + 20 <= length) {
+        const UCHAR* a = frame + ip + 12;
+        source.hi = 0;
+        source.lo = 0x0000FFFF00000000ULL | ((ULONG)a[0] << 24) | ((ULONG)a[1] << 16) | ((ULONG)a[2] << 8) | a[3];
+        destination.hi = 0;
+        destination.lo = 0x0000FFFF00000000ULL | ((ULONG)a[4] << 24) | ((ULONG)a[5] << 16) | ((ULONG)a[6] << 8) | a[7];
+    } else if (ether_type == 0x86DD && ip + 40 <= length) {
+        source.hi = dnsLoad64(frame + ip + 8);
+        source.lo = dnsLoad64(frame + ip + 16);
+        destination.hi = dnsLoad64(frame + ip + 24);
+        destination.lo = dnsLoad64(frame + ip + 32);
+    } else {
+        return NET_CLS_NO_MATCH;
+    }
+
+    ULONG side = dnsCached(&source, second) ? NET_DNS_SOURCE :
+        dnsCached(&destination, second) ? NET_DNS_DESTINATION : NET_CLS_NO_MATCH;
+    if (side != NET_CLS_NO_MATCH) { ndisDnsCounters[NETFLT_CPU_INDEX()].dropped++; }
+    return side;
+}
+
+//
+// Responses
+//
+
+// Reads the name at offset. With name, decodes it dotted and in lower case
+// into name (NET_DNS_NAME_MAX bytes) following compression pointers, each
+// of which must point before the part of the name it was found in, so that
+// a message cannot make the walk loop. Without name, only skips it. Returns
+// the offset past the name where it started, 0 for a malformed name.
+static ULONG dnsName(const UCHAR* message, ULONG length, ULONG offset, CHAR* name, PULONG name_length) {
+    ULONG end = 0;
+    ULONG limit = offset;
+    ULONG written = 0;
+
+    for (;;) {
+        if (offset >= length) { return 0; }
+        ULONG label = message[offset];
+        if (label == 0) {
+            offset++;
+            break;
+        }
+        if ((label & 0xC0) == 0xC0) {
+            if (offset + 2 > length) { return 0; }
+            if (name == NULL) { return offset + 2; }
+            ULONG target = ((label & 0x3F) << 8) | message[offset + 1];
+            if (end == 0) { end = offset + 2; }
+            if (target >= limit) { return 0; }
+            offset = limit = target;
+            continue;
+        }
+        if ((label & 0xC0) != 0 || offset + 1 + label > length) { return 0; }
+        if (name != NULL) {
+            if (written + (written != 0) + label > NET_DNS_NAME_MAX) { return 0; }
+            if (written != 0) { name[written++] = '.'; }
+            for (ULONG i = 0; i < label; i++) {
+                CHAR c = (CHAR)message[offset + 1 + i];
+                if (c == '.') { return 0; }
+                name[written++] = (c >= 'A' && c <= 'Z') ? (CHAR)(c + 'a' - 'A') : c;
+            }
+        }
+        offset += 1 + label;
+    }
+    if (name != NULL) { *name_length = written; }
+    return (end != 0) ? end : offset;
+}
+
+static FORCEINLINE ULONG dnsLoad16(const UCHAR* bytes) {
+    return ((ULONG)bytes[0] << 8) | bytes[1];
+}
+
+ULONG ndisDnsResponse(const NET_DOMAINS* domains, const UCHAR* message, ULONG length, ULONG64 now) {
+    ULONG name_length;
+    ULONG count = 0;
+    BOOLEAN blocked = FALSE;
+
+    // A standard query response
+    if (ndisDnsBuckets == NULL || domains == NULL || length < DNS_HEADER_LEN ||
+        !(message[2] & 0x80) || (message[2] & 0x78) != 0) {
+        return 0;
+    }
+    ULONG cpu = NETFLT_CPU_INDEX();
+    PNET_DNS_COUNTERS counters = &ndisDnsCounters[cpu];
+    PNET_LPM6_ADDRESS addresses = ndisDnsScratch[cpu].addresses;
+    PULONG ttls = ndisDnsScratch[cpu].ttls;
+    PCHAR name = ndisDnsScratch[cpu].name;
+    ULONG questions = dnsLoad16(message + 4);
+    ULONG answers = dnsLoad16(message + 6);
+    ULONG offset = DNS_HEADER_LEN;
+    counters->responses++;
+
+    for (ULONG q = 0; q < questions; q++) {
+        offset = dnsName(message, length, offset, name, &name_length);
+        if (offset == 0 || offset + 4 > length) { return 0; }
+        if (!blocked) { blocked = ndisDomainBlocked(domains, name, name_length); }
+        offset += 4;
+    }
+
+    // Up to the first record that does not fit: a truncated answer still
+    // gives the addresses before it
+    for (ULONG a = 0; a < answers; a++) {
+        offset = dnsName(message, length, offset, NULL, NULL);
+        if (offset == 0 || offset + 10 > length) { break; }
+        const UCHAR* record = message + offset;
+        ULONG rdata = offset + 10;
+        ULONG rdlength = dnsLoad16(record + 8);
+        if (rdata + rdlength > length) { break; }
+        offset = rdata + rdlength;
+        if (dnsLoad16(record + 2) != DNS_CLASS_IN) { continue; }
+
+        ULONG type = dnsLoad16(record);
+        ULONG ttl = ((ULONG)record[4] << 24) | ((ULONG)record[5] << 16) | ((ULONG)record[6] << 8) | record[7];
+        if (type == DNS_TYPE_A && rdlength == 4 && count < NET_DNS_ANSWERS_MAX) {
+            const UCHAR* b = message + rdata;
+            addresses[count].hi = 0;
+            addresses[count].lo = 0x0000FFFF00000000ULL | ((ULONG)b[0] << 24) | ((ULONG)b[1] << 16) | ((ULONG)b[2] << 8) | b[3];
+            ttls[count++] = ttl;
+        } else if (type == DNS_TYPE_AAAA && rdlength == 16 && count < NET_DNS_ANSWERS_MAX) {
+            addresses[count].hi = dnsLoad64(message + rdata);
+            addresses[count].lo = dnsLoad64(message + rdata + 8);
+            ttls[count++] = ttl;
+        } else if (type == DNS_TYPE_CNAME && !blocked) {
+            // A CNAME into a blocked domain blocks the name asked for
+            if (dnsName(message, length, rdata, name, &name_length) != 0) {
+                blocked = ndisDomainBlocked(domains, name, name_length);
+            }
+        }
+    }
+    if (!blocked) { return 0; }
+
+    ULONG second = (ULONG)(now / DNS_SECOND);
+    for (ULONG i = 0; i < count; i++) {
+        ULONG ttl = (ttls[i] < NET_DNS_TTL_MIN) ? NET_DNS_TTL_MIN : (ttls[i] > NET_DNS_TTL_MAX) ? NET_DNS_TTL_MAX : ttls[i];
+        dnsInsert(&addresses[i], second + ttl);
+    }
+    counters->blocked++;
+    counters->cached += count;
+    return count;
+}
+
+VOID ndisDnsQueryStat(PNET_DNS_STAT stat) {
+    RtlZeroMemory(stat, sizeof(NET_DNS_STAT));
+    if (ndisDnsBuckets == NULL) { return; }
+
+    for (ULONG cpu = 0; cpu < ndisDnsCpuCount; cpu++) {
+        stat->responses += ndisDnsCounters[cpu].responses;
+        stat->blocked += ndisDnsCounters[cpu].blocked;
+        stat->cached += ndisDnsCounters[cpu].cached;
+        stat->dropped += ndisDnsCounters[cpu].dropped;
+    }
+    for (ULONG i = 0; i < NET_DNS_BUCKETS; i++) {
+        for (ULONG way = 0; way < NET_DNS_WAYS; way++) { stat->entries += (ndisDnsBuckets[i].expiry[way] != 0); }
+    }
+}
+
+VOID ndisDnsClearStat() {
+    for (ULONG cpu = 0; cpu < ndisDnsCpuCount; cpu++) {
+        ndisDnsCounters[cpu].responses = 0;
+        ndisDnsCounters[cpu].blocked = 0;
+        ndisDnsCounters[cpu].cached = 0;
+        ndisDnsCounters[cpu].dropped = 0;
+    }
+}
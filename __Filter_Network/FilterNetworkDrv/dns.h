@@ -0,0 +1,130 @@
+#pragma once
+//
+// DNS-aware domain blocking.
+//
+// Addresses change far faster than the names behind them, so instead of
+// listing the addresses of a tracker or a malware domain the rule image can
+// carry a domain set (..\FilterNetworkCompiler, -n). Every UDP datagram from
+// port 53 that reaches the rules is read as a DNS response: its question
+// names and the targets of its CNAME records are looked up in the set, and
+// when any of them is blocked the A and AAAA records of the response go into
+// the block cache below, for as long as their TTL says (within
+// NET_DNS_TTL_MIN and NET_DNS_TTL_MAX). The response itself passes; the
+// connections that follow it, to or from a cached address, are dropped and
+// alerted as NET_ALERT_F_DOMAIN.
+//
+// The domain set is a hashed suffix set. An entry blocks the name and every
+// name under it; a lookup hashes the name from its last character back to
+// its first and probes the table at every label boundary, so a name of n
+// labels costs n probes and no allocation. The names themselves are stored
+// too and compared, a hash match alone never blocks. Like the other parts
+// of the image the blob holds no pointers and ndisValidateDomains checks all
+// of it.
+//
+// The block cache is shared by all processors: a response seen on one must
+// block the connection on another. It is a fixed array of buckets of
+// NET_DNS_WAYS addresses each, allocated once; a full bucket gives up its
+// entry closest to expiry. Writers (responses for blocked names, rare) take
+// a bucket's sequence with a compare-exchange; readers (every IP frame while
+// the cache holds anything) retry while it changes. Entries do not depend on
+// the rules and outlive reloads, but only a rule set with a domain set looks
+// at them, and they are gone NET_DNS_TTL_MAX after the last response that
+// put them there.
+//
+// Only the first NET_DNS_MESSAGE_MAX bytes of a response are parsed, which
+// holds the question and the first records of nearly every answer; DNS over
+// TCP, DoT and DoH are not seen.
+//
+
+#define NET_DNS_TAG             '1snD'
+#define NET_DNS_PORT            53
+#define NET_DNS_MAX             (1u << 22)      // domains in a set
+#define NET_DNS_NAME_MAX        253             // dotted, without the root
+#define NET_DNS_MESSAGE_MAX     512             // response bytes parsed
+#define NET_DNS_ANSWERS_MAX     16              // A/AAAA records cached per response
+#define NET_DNS_BUCKETS         4096            // block cache buckets, power of two
+#define NET_DNS_WAYS            3               // addresses per bucket
+#define NET_DNS_TTL_MIN         30              // seconds
+#define NET_DNS_TTL_MAX         300
+
+// Returned by ndisDnsCacheFrame
+#define NET_DNS_SOURCE          0
+#define NET_DNS_DESTINATION     1
+
+typedef struct _NET_DOMAIN_SLOT {
+    UINT64  hash;
+    ULONG   name_offset;            // into the names, from NET_DOMAINS.name_offset
+    ULONG   name_length;            // 0 - empty slot
+} NET_DOMAIN_SLOT, * PNET_DOMAIN_SLOT;
+
+typedef struct _NET_DOMAINS {
+    ULONG   size;                   // bytes, everything below included
+    ULONG   count;                  // domains
+    ULONG   slot_bits;              // log2 of the slot count
+    ULONG   slot_offset;            // NET_DOMAIN_SLOT[1 << slot_bits], 8-byte aligned
+    ULONG   name_offset;            // lower case, dotted, no trailing dot
+    ULONG   name_size;
+    UINT64  seed;                   // of the name hash
+} NET_DOMAINS, * PNET_DOMAINS;
+
+// One cache line: a sequence, then the addresses and the second of
+// interrupt time each expires at (0 - empty)
+typedef struct DECLSPEC_CACHEALIGN _NET_DNS_BUCKET {
+    volatile LONG       sequence;   // odd while a writer owns the bucket
+    ULONG               expiry[NET_DNS_WAYS];
+    NET_LPM6_ADDRESS    address[NET_DNS_WAYS];  // IPv4: ::ffff:a.b.c.d
+} NET_DNS_BUCKET, * PNET_DNS_BUCKET;
+
+typedef struct DECLSPEC_CACHEALIGN _NET_DNS_COUNTERS {
+    ULONG64 responses;              // DNS responses parsed
+    ULONG64 blocked;                // of them naming a blocked domain
+    ULONG64 cached;                 // addresses put in the cache
+    ULONG64 dropped;                // frames to or from a cached address
+} NET_DNS_COUNTERS, * PNET_DNS_COUNTERS;
+
+// What ndisDnsResponse reads out of one message, per processor
+typedef struct DECLSPEC_CACHEALIGN _NET_DNS_SCRATCH {
+    NET_LPM6_ADDRESS    addresses[NET_DNS_ANSWERS_MAX];
+    ULONG               ttls[NET_DNS_ANSWERS_MAX];
+    CHAR                name[NET_DNS_NAME_MAX];
+} NET_DNS_SCRATCH, * PNET_DNS_SCRATCH;
+
+typedef struct _NET_DNS_STAT {
+    ULONG64 responses;
+    ULONG64 blocked;
+    ULONG64 cached;
+    ULONG64 dropped;
+    ULONG   entries;                // addresses in the cache, expired or not
+} NET_DNS_STAT, * PNET_DNS_STAT;
+
+// Builds the set of count domains, each a NUL-terminated name. Names are
+// folded to lower case and lose a leading "*." and a trailing dot;
+// duplicates are dropped. One NETFLT_ALLOC block; NULL when out of memory,
+// over NET_DNS_MAX or when a name is empty or longer than NET_DNS_NAME_MAX.
+PNET_DOMAINS ndisBuildDomains(const CHAR* const* names, ULONG count);
+VOID ndisFreeDomains(PNET_DOMAINS domains);
+BOOLEAN ndisValidateDomains(const NET_DOMAINS* domains, ULONG size);
+
+// TRUE if the dotted, lower case name of length bytes or a domain it is
+// under is in the set
+BOOLEAN ndisDomainBlocked(const NET_DOMAINS* domains, const CHAR* name, ULONG length);
+
+// A failed init leaves the cache off: responses are not parsed and no
+// frame is dropped for its domain
+BOOLEAN ndisDnsInit();
+VOID ndisDnsCleanup();
+
+// Parses length bytes of a DNS message (the UDP payload) received at
+// interrupt time now and caches the addresses it gives for blocked names.
+// Returns the number of addresses cached. Runs inside an epoch section,
+// the message being read into this processor's NET_DNS_SCRATCH.
+ULONG ndisDnsResponse(const NET_DOMAINS* domains, const UCHAR* message, ULONG length, ULONG64 now);
+
+// Checks the source, then the destination of the first length bytes of an
+// Ethernet frame against the cache at interrupt time now. Returns
+// NET_DNS_SOURCE or _DESTINATION for a cached address, or NET_CLS_NO_MATCH.
+// Called inside an epoch section.
+ULONG ndisDnsCacheFrame(const UCHAR* frame, ULONG length, ULONG64 now);
+
+VOID ndisDnsQueryStat(PNET_DNS_STAT stat);
+VOID ndisDnsClearStat();
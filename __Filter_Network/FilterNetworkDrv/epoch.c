@@ -0,0 +1,69 @@
+#include "portable.h"
+#include "epoch.h"
+
+static volatile LONG64      ndisEpochGlobal = 1;
+static PNETFLT_EPOCH_CPU    ndisEpochCpus = NULL;
+static PVOID                ndisEpochCpusRaw = NULL;
+static ULONG                ndisEpochCpuCount = 0;
+
+BOOLEAN ndisEpochInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = count * sizeof(NETFLT_EPOCH_CPU) + NETFLT_CACHE_LINE;
+
+    ndisEpochCpusRaw = NETFLT_ALLOC(size, NETFLT_EPOCH_TAG);
+    if (ndisEpochCpusRaw == NULL) { return FALSE; }
+    RtlZeroMemory(ndisEpochCpusRaw, size);
+
+    // Pool blocks are only 16-byte aligned; give every slot its own line
+    ndisEpochCpus = (PNETFLT_EPOCH_CPU)(((ULONG_PTR)ndisEpochCpusRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+    ndisEpochCpuCount = count;
+    return TRUE;
+}
+
+VOID ndisEpochCleanup() {
+    if (ndisEpochCpusRaw != NULL) { NETFLT_FREE(ndisEpochCpusRaw, NETFLT_EPOCH_TAG); }
+    ndisEpochCpusRaw = NULL;
+    ndisEpochCpus = NULL;
+    ndisEpochCpuCount = 0;
+}
+
+VOID ndisEpochEnter(PNETFLT_EPOCH_READER reader) {
+    // Stay on this processor until ndisEpochLeave
+    NETFLT_RAISE_IRQL(&reader->old_irql);
+    reader->cpu = NETFLT_CPU_INDEX();
+
+    PNETFLT_EPOCH_CPU slot = &ndisEpochCpus[reader->cpu];
+    if (slot->nesting++ == 0) {
+        // Full barrier: the pin must be visible before the protected pointer is read
+        InterlockedExchange64(&slot->active, ndisEpochGlobal);
+    }
+}
+
+VOID ndisEpochLeave(PNETFLT_EPOCH_READER reader) {
+    PNETFLT_EPOCH_CPU slot = &ndisEpochCpus[reader->cpu];
+    if (--slot->nesting == 0) {
+        InterlockedExchange64(&slot->active, 0);
+    }
+    NETFLT_LOWER_IRQL(reader->old_irql);
+}
+
+VOID ndisEpochSynchronize() {
+    // Called at PASSIVE_LEVEL after the old object has been unpublished.
+    // Readers that pin an epoch >= target started after the exchange and
+    // cannot see the old object.
+    LONG64 target = InterlockedIncrement64(&ndisEpochGlobal);
+
+    for (ULONG cpu = 0; cpu < ndisEpochCpuCount; cpu++) {
+        for (;;) {
+            LONG64 active = ndisEpochCpus[cpu].active;
+            if (active == 0 || active >= target) { break; }
+#ifdef NETFLT_USER_MODE
+            YieldProcessor();
+#else
+            LARGE_INTEGER interval;
+            interval.QuadPart = -10 * 1000;     // 1 ms
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+#endif
+        }
+    }
+}
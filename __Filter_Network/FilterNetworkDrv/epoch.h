@@ -0,0 +1,29 @@
+#pragma once
+//
+// Epoch-based reclamation for data read on the packet path.
+//
+// Readers pin the current epoch in their processor's slot for the duration
+// of a read-side section. A writer publishes a new object with an atomic
+// pointer exchange, advances the global epoch and then waits until every
+// processor is either idle or inside a section that started after the
+// exchange; only then can the old object be freed. The read side costs two
+// interlocked stores to a processor-local cache line and takes no locks.
+//
+
+#define NETFLT_EPOCH_TAG    '1cpE'
+
+typedef struct DECLSPEC_CACHEALIGN _NETFLT_EPOCH_CPU {
+    volatile LONG64 active;         // epoch pinned by this processor, 0 - idle
+    ULONG           nesting;
+} NETFLT_EPOCH_CPU, * PNETFLT_EPOCH_CPU;
+
+typedef struct _NETFLT_EPOCH_READER {
+    ULONG   cpu;
+    KIRQL   old_irql;
+} NETFLT_EPOCH_READER, * PNETFLT_EPOCH_READER;
+
+BOOLEAN ndisEpochInit();
+VOID ndisEpochCleanup();
+VOID ndisEpochEnter(PNETFLT_EPOCH_READER reader);
+VOID ndisEpochLeave(PNETFLT_EPOCH_READER reader);
+VOID ndisEpochSynchronize();
@@ -124,7 +124,11 @@ Return Value:
         FilterDriverHandle = NULL;
 
         // Read Net Rules
-        ndisReadCfg();
+        Status = ndisInitNetRules();
+        if (Status != NDIS_STATUS_SUCCESS) {
+            DbgPrint("NDIS \tInitialize net rules failed.\n");
+            break;
+        }
 
         // Initialize spin locks
         FILTER_INIT_LOCK(&FilterListLock);
@@ -136,6 +140,7 @@ Return Value:
             &FChars,
             &FilterDriverHandle);
         if (Status != NDIS_STATUS_SUCCESS) {
+            ndisCleanupNetRules();
             DbgPrint("NDIS \tRegister filter driver failed.\n");
             break;
         }
@@ -145,6 +150,7 @@ Return Value:
         if (Status != NDIS_STATUS_SUCCESS) {
             NdisFDeregisterFilterDriver(FilterDriverHandle);
             FILTER_FREE_LOCK(&FilterListLock);
+            ndisCleanupNetRules();
             DbgPrint("NDIS \tRegister device for the filter driver failed.\n");
             break;
         }
@@ -317,6 +323,7 @@ N.B.:  FILTER can use NdisRegisterDeviceEx to create a device, so the upper
         pFilter->TrackReceives = TRUE;
         pFilter->TrackSends = TRUE;
         pFilter->FilterHandle = NdisFilterHandle;
+        ndisDeferAttach(pFilter);
 
 
         NdisZeroMemory(&FilterAttributes, sizeof(NDIS_FILTER_ATTRIBUTES));
@@ -412,7 +419,7 @@ N.B.: When the filter is in Pausing state, it can still process OID requests,
     // If you send or receive original NBLs, stop doing that and wait for your
     // NBLs to return to you now.
     //
-
+    ndisDeferPause(pFilter);
 
     Status = NDIS_STATUS_SUCCESS;
 
@@ -563,6 +570,7 @@ Return Value:
     // If everything is OK, set the filter in running state.
     //
     pFilter->State = FilterRunning; // when successful
+    ndisDeferRestart(pFilter);
 
 
     Status = NDIS_STATUS_SUCCESS;
@@ -626,6 +634,10 @@ NOTE: Called at PASSIVE_LEVEL and the filter is in paused state
     RemoveEntryList(&pFilter->FilterModuleLink);
     FILTER_RELEASE_LOCK(&FilterListLock, bFalse);
 
+    // Off the list, no rule update can find the instance any more; one that
+    // already has finishes before its overlay is dropped
+    ndisReleaseInstanceRules(pFilter);
+
     // Free the memory allocated
     FILTER_FREE_MEM(pFilter);
 
@@ -678,6 +690,8 @@ Return Value:
 
     FILTER_FREE_LOCK(&FilterListLock);
 
+    ndisCleanupNetRules();
+
     DbgPrint("NDIS \t<===FilterUnload\n");
 
     return;
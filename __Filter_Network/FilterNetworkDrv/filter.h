@@ -318,10 +318,9 @@ typedef struct _MS_FILTER
     ULONG                           OutstandingSends;
     ULONG                           OutstandingRequest;
     ULONG                           OutstandingRcvs;
-    FILTER_LOCK                     SendLock;
-    FILTER_LOCK                     RcvLock;
-    QUEUE_HEADER                    SendNBLQueue;
-    QUEUE_HEADER                    RcvNBLQueue;
+    volatile LONG                   DeferredNbls;       // queued to or held by the workers (defer.h)
+    volatile LONG                   DeferPaused;        // TRUE - nothing is deferred
+    NDIS_EVENT                      DeferDrained;       // set when DeferredNbls drops to 0 while paused
 
 
     NDIS_STRING                     FilterName;
@@ -334,6 +333,9 @@ typedef struct _MS_FILTER
 
     PNDIS_OID_REQUEST               PendingOidRequest;
 
+    struct _NET_RULE_SET* volatile  RuleOverlay;        // rules of this instance over the base set, NULL - none (rules.h)
+    LIST_ENTRY                      RuleOverlayLink;    // while RuleOverlay is set
+
 }MS_FILTER, * PMS_FILTER;
 
 
@@ -27,6 +27,10 @@
 #define IOCTL_FILTER_READ_INSTANCE_CONFIG   _NDIS_CONTROL_CODE(12, METHOD_BUFFERED)
 #define IOCTL_FILTER_WRITE_INSTANCE_CONFIG  _NDIS_CONTROL_CODE(13, METHOD_BUFFERED)
 #define IOCTL_FILTER_UPDATE_CONFIG          _NDIS_CONTROL_CODE(14, METHOD_BUFFERED)
+#define IOCTL_FILTER_READ_ALERTS            _NDIS_CONTROL_CODE(15, METHOD_BUFFERED)
+#define IOCTL_FILTER_QUERY_TOP_SOURCES      _NDIS_CONTROL_CODE(16, METHOD_BUFFERED)
+#define IOCTL_FILTER_UPDATE_INSTANCE_CONFIG _NDIS_CONTROL_CODE(17, METHOD_BUFFERED)
+#define IOCTL_FILTER_READ_FLOWS             _NDIS_CONTROL_CODE(18, METHOD_BUFFERED)
 
 #define MAX_FILTER_INSTANCE_NAME_LENGTH     256
 #define MAX_FILTER_CONFIG_KEYWORD_LENGTH    256
@@ -37,8 +41,62 @@ typedef struct _FILTER_DRIVER_ALL_STAT
     ULONG          ExternalRequestFailedCount;
     ULONG          ExternalRequestSuccessCount;
     ULONG          InternalRequestFailedCount;
+    ULONG          FlowCacheCpus;           // one flow cache per processor
+    ULONG          FlowCacheEntries;        // capacity of each flow cache
+    ULONG64        FlowCacheHits;
+    ULONG64        FlowCacheMisses;
+    ULONG64        FlowCacheEvictions;
+    ULONG64        AlertsWritten;
+    ULONG64        AlertsDropped;           // lost to a full alert ring
+    ULONG          AlertsPending;           // recorded but not read yet
+    ULONG          StreamCpus;              // one TCP stream table per processor, 0 - not tracked
+    ULONG          StreamEntries;           // capacity of each table
+    ULONG64        StreamHits;              // segments that continued a stream
+    ULONG64        StreamMisses;            // segments that started one
+    ULONG64        StreamGaps;              // segments past lost or reordered data
+    ULONG64        StreamEvictions;         // live streams recycled for new ones
+    ULONG          RateCpus;                // one source sketch per processor, 0 - not counted
+    ULONG64        RatePackets;             // IP frames counted against their source
+    ULONG64        RateAdmitted;            // rate limited frames within their source's rate
+    ULONG64        RateLimited;             // rate limited frames dropped
+    ULONG          DnsEntries;              // addresses in the domain block cache
+    ULONG64        DnsResponses;            // DNS responses parsed
+    ULONG64        DnsBlocked;              // of them naming a blocked domain
+    ULONG64        DnsCached;               // addresses they put in the cache
+    ULONG64        DnsDropped;              // frames to or from a cached address
+    ULONG          DeferCpus;               // one payload worker per processor, 0 - inspected inline
+    ULONG          DeferQueued;             // NBLs waiting for a worker
+    ULONG64        DeferredNbls;            // NBLs queued to a worker
+    ULONG64        DeferPassed;             // NBLs a full queue passed uninspected
+    ULONG64        DeferDropped;            // NBLs a full queue dropped
+    ULONG          MeterCpus;               // one flow table per processor, 0 - flows are not metered
+    ULONG          MeterEntries;            // flows per table
+    ULONG          MeterActive;             // flows in the tables
+    ULONG          MeterPending;            // flow records waiting for IOCTL_FILTER_READ_FLOWS
+    ULONG64        MeterPackets;            // IP frames metered
+    ULONG64        MeterStarted;            // flows started
+    ULONG64        MeterExported;           // flow records exported
+    ULONG64        MeterLost;               // flow records lost to a full ring
 } FILTER_DRIVER_ALL_STAT, * PFILTER_DRIVER_ALL_STAT;
 
+// One entry of IOCTL_FILTER_QUERY_TOP_SOURCES, heaviest first
+typedef struct _FILTER_TOP_SOURCE
+{
+    UCHAR          SourceIp[16];            // network order, IPv4 as ::ffff:a.b.c.d
+    ULONG64        Packets;                 // estimate, halved every second
+} FILTER_TOP_SOURCE, *PFILTER_TOP_SOURCE;
+
+// Input of IOCTL_FILTER_UPDATE_INSTANCE_CONFIG: the filter instance, named
+// as for IOCTL_FILTER_RESTART_ONE_INSTANCE, and the rule image (or BUGAV
+// records) of its overlay from Data to the end of the buffer. No data
+// removes the overlay.
+typedef struct _FILTER_INSTANCE_RULES
+{
+    _Field_size_bytes_part_(MAX_FILTER_INSTANCE_NAME_LENGTH,InstanceNameLength)
+    WCHAR           InstanceName[MAX_FILTER_INSTANCE_NAME_LENGTH];
+    ULONG           InstanceNameLength;
+    UCHAR           Data[sizeof(ULONG)];
+} FILTER_INSTANCE_RULES, *PFILTER_INSTANCE_RULES;
 
 typedef struct _FILTER_SET_OID
 {
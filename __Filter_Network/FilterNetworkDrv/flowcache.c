@@ -0,0 +1,108 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+
+static PNET_FLOW_CACHE  ndisFlowCaches = NULL;
+static PVOID            ndisFlowCachesRaw = NULL;
+static ULONG            ndisFlowCacheCpuCount = 0;
+
+BOOLEAN ndisFlowCacheInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = count * sizeof(NET_FLOW_CACHE) + NETFLT_CACHE_LINE;
+
+    ndisFlowCachesRaw = NETFLT_ALLOC(size, NET_FLOW_CACHE_TAG);
+    if (ndisFlowCachesRaw == NULL) { return FALSE; }
+    RtlZeroMemory(ndisFlowCachesRaw, size);
+
+    ndisFlowCaches = (PNET_FLOW_CACHE)(((ULONG_PTR)ndisFlowCachesRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+    ndisFlowCacheCpuCount = count;
+    return TRUE;
+}
+
+VOID ndisFlowCacheCleanup() {
+    if (ndisFlowCachesRaw != NULL) { NETFLT_FREE(ndisFlowCachesRaw, NET_FLOW_CACHE_TAG); }
+    ndisFlowCachesRaw = NULL;
+    ndisFlowCaches = NULL;
+    ndisFlowCacheCpuCount = 0;
+}
+
+PNET_FLOW_CACHE ndisFlowCacheCurrent() {
+    if (ndisFlowCaches == NULL) { return NULL; }
+    return &ndisFlowCaches[NETFLT_CPU_INDEX()];
+}
+
+ULONG ndisFlowClassify(PNET_FLOW_CACHE cache, ULONG generation, const NET_CLASSIFIER* cls, const NET_CLS_KEY* key) {
+    if (!(key->shape & NET_CLS_SHAPE_L4)) {
+        return ndisClassify(cls, key);
+    }
+
+    // 0 marks an empty entry
+    if (generation == 0) { generation = 1; }
+
+    ULONG set_index = ndisClsKeyHash(key) & (NET_FLOW_CACHE_SETS - 1);
+    PNET_FLOW_SET set = &cache->sets[set_index];
+    ULONG way;
+
+    for (way = 0; way < NET_FLOW_CACHE_WAYS; way++) {
+        PNET_FLOW_ENTRY entry = &set->ways[way];
+        if (entry->generation == generation && ndisClsKeyEqual(&entry->key, key)) {
+            entry->referenced = 1;
+            cache->hits++;
+            return entry->rule;
+        }
+    }
+
+    cache->misses++;
+    ULONG rule = ndisClassify(cls, key);
+
+    // Stale or empty entries go first, then the clock picks a victim
+    PNET_FLOW_ENTRY victim = NULL;
+    for (way = 0; way < NET_FLOW_CACHE_WAYS; way++) {
+        if (set->ways[way].generation != generation) {
+            victim = &set->ways[way];
+            break;
+        }
+    }
+    if (victim == NULL) {
+        ULONG hand = cache->hand[set_index];
+        while (set->ways[hand].referenced) {
+            set->ways[hand].referenced = 0;
+            hand = (hand + 1) % NET_FLOW_CACHE_WAYS;
+        }
+        victim = &set->ways[hand];
+        cache->hand[set_index] = (UCHAR)((hand + 1) % NET_FLOW_CACHE_WAYS);
+        cache->evictions++;
+    }
+
+    victim->key = *key;
+    victim->rule = rule;
+    victim->generation = generation;
+    victim->drop = (BOOLEAN)(rule != NET_CLS_NO_MATCH);
+    victim->referenced = 0;
+    return rule;
+}
+
+VOID ndisFlowCacheQueryStat(PNET_FLOW_CACHE_STAT stat) {
+    RtlZeroMemory(stat, sizeof(NET_FLOW_CACHE_STAT));
+    stat->entries = NET_FLOW_CACHE_SETS * NET_FLOW_CACHE_WAYS;
+    stat->cpus = ndisFlowCacheCpuCount;
+
+    // Counters are written only by their own processor; a snapshot that is
+    // a few packets behind is fine for sizing
+    for (ULONG cpu = 0; cpu < ndisFlowCacheCpuCount; cpu++) {
+        stat->hits += ndisFlowCaches[cpu].hits;
+        stat->misses += ndisFlowCaches[cpu].misses;
+        stat->evictions += ndisFlowCaches[cpu].evictions;
+    }
+}
+
+VOID ndisFlowCacheClearStat() {
+    for (ULONG cpu = 0; cpu < ndisFlowCacheCpuCount; cpu++) {
+        ndisFlowCaches[cpu].hits = 0;
+        ndisFlowCaches[cpu].misses = 0;
+        ndisFlowCaches[cpu].evictions = 0;
+    }
+}
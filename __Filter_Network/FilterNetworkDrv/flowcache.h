@@ -0,0 +1,68 @@
+#pragma once
+//
+// Per-processor flow cache in front of the classifier.
+//
+// Long-lived flows send most of the traffic, so the verdict of the first
+// packet of a 5-tuple is remembered and reused for the rest of the flow.
+// IPv6 keys carry prefix labels instead of addresses (ndisClsResolve6);
+// the labels are only valid for the rule set that produced them, which the
+// generation stamp below already takes care of.
+// Every processor owns one cache and only touches it from inside an epoch
+// section (at DISPATCH_LEVEL), so lookups and inserts need no locking.
+//
+// The cache is 4-way set associative with a clock hand per set: a hit sets
+// the entry's referenced bit, and a miss replaces the first entry of the
+// set whose bit is clear, clearing bits as the hand passes over them.
+//
+// Entries are stamped with the generation of the rule set that produced
+// them. An entry from an older generation never matches, so a rule reload
+// invalidates every cache without touching them.
+//
+
+#define NET_FLOW_CACHE_TAG      '1wlF'
+#define NET_FLOW_CACHE_WAYS     4
+#define NET_FLOW_CACHE_SETS     512         // per processor, power of two
+
+typedef struct _NET_FLOW_ENTRY {
+    NET_CLS_KEY key;
+    ULONG       rule;               // first matching rule or NET_CLS_NO_MATCH
+    ULONG       generation;         // low bits of NET_RULE_SET.generation, 0 - empty
+    BOOLEAN     drop;
+    UCHAR       referenced;         // clock bit
+    UCHAR       reserved[6];
+} NET_FLOW_ENTRY, * PNET_FLOW_ENTRY;
+
+typedef struct DECLSPEC_CACHEALIGN _NET_FLOW_SET {
+    NET_FLOW_ENTRY  ways[NET_FLOW_CACHE_WAYS];
+} NET_FLOW_SET, * PNET_FLOW_SET;
+
+typedef struct DECLSPEC_CACHEALIGN _NET_FLOW_CACHE {
+    ULONG64         hits;
+    ULONG64         misses;
+    ULONG64         evictions;      // valid entries of the current generation replaced
+    UCHAR           hand[NET_FLOW_CACHE_SETS];
+    NET_FLOW_SET    sets[NET_FLOW_CACHE_SETS];
+} NET_FLOW_CACHE, * PNET_FLOW_CACHE;
+
+typedef struct _NET_FLOW_CACHE_STAT {
+    ULONG64 hits;
+    ULONG64 misses;
+    ULONG64 evictions;
+    ULONG   entries;                // capacity of one processor's cache
+    ULONG   cpus;
+} NET_FLOW_CACHE_STAT, * PNET_FLOW_CACHE_STAT;
+
+BOOLEAN ndisFlowCacheInit();
+VOID ndisFlowCacheCleanup();
+
+// The calling processor's cache; NULL if the cache is not initialized
+PNET_FLOW_CACHE ndisFlowCacheCurrent();
+
+// Verdict for a frame key, from the cache when the flow was seen under the
+// same rule set generation, otherwise from the classifier. Only frames with
+// a transport header, IPv4 or IPv6, are cached; an IPv6 key has to hold the
+// labels of cls already (ndisClsResolve6).
+ULONG ndisFlowClassify(PNET_FLOW_CACHE cache, ULONG generation, const NET_CLASSIFIER* cls, const NET_CLS_KEY* key);
+
+VOID ndisFlowCacheQueryStat(PNET_FLOW_CACHE_STAT stat);
+VOID ndisFlowCacheClearStat();
@@ -0,0 +1,256 @@
+#include "portable.h"
+#include "lpm.h"
+
+static VOID lpmSiftDown(UINT64* values, ULONG root, ULONG count) {
+    for (;;) {
+        ULONG child = 2 * root + 1;
+        if (child >= count) { return; }
+        if (child + 1 < count && values[child + 1] > values[child]) { child++; }
+        if (values[root] >= values[child]) { return; }
+        UINT64 t = values[root]; values[root] = values[child]; values[child] = t;
+        root = child;
+    }
+}
+
+VOID ndisSortUint64(UINT64* values, ULONG count) {
+    if (count < 2) { return; }
+    for (ULONG i = count / 2; i-- > 0;) { lpmSiftDown(values, i, count); }
+    for (ULONG end = count - 1; end > 0; end--) {
+        UINT64 t = values[0]; values[0] = values[end]; values[end] = t;
+        lpmSiftDown(values, 0, end);
+    }
+}
+
+static ULONG lpmCountDistinct(UINT64* values, ULONG count) {
+    ULONG distinct = 0;
+    ndisSortUint64(values, count);
+    for (ULONG i = 0; i < count; i++) {
+        if (i == 0 || values[i] != values[i - 1]) { distinct++; }
+    }
+    return distinct;
+}
+
+ULONG ndisLpmSize(const NET_LPM_PREFIX* prefixes, ULONG count, UINT64* scratch) {
+    // One chunk per /16 that holds a longer prefix, one per /24 that holds
+    // a prefix longer than /24
+    ULONG n = 0;
+    for (ULONG i = 0; i < count; i++) {
+        if (prefixes[i].length > 16) { scratch[n++] = prefixes[i].address >> 16; }
+    }
+    ULONG chunks = lpmCountDistinct(scratch, n);
+
+    n = 0;
+    for (ULONG i = 0; i < count; i++) {
+        if (prefixes[i].length > 24) { scratch[n++] = prefixes[i].address >> 8; }
+    }
+    chunks += lpmCountDistinct(scratch, n);
+
+    return FIELD_OFFSET(NET_LPM, chunks) + chunks * NET_LPM_CHUNK_SIZE * sizeof(ULONG);
+}
+
+static ULONG lpmChild(PULONG chunk_count, ULONG (*chunks)[NET_LPM_CHUNK_SIZE], PULONG entry) {
+    // Replace a leaf by a chunk that inherits its label
+    if (!(*entry & NET_LPM_CHILD)) {
+        ULONG chunk = (*chunk_count)++;
+        for (ULONG i = 0; i < NET_LPM_CHUNK_SIZE; i++) { chunks[chunk][i] = *entry; }
+        *entry = NET_LPM_CHILD | chunk;
+    }
+    return *entry & ~NET_LPM_CHILD;
+}
+
+static VOID lpmFill(PULONG entries, ULONG first, ULONG span, ULONG label) {
+    for (ULONG i = first; i < first + span; i++) { entries[i] = label; }
+}
+
+VOID ndisLpmBuild(PNET_LPM lpm, const NET_LPM_PREFIX* prefixes, ULONG count) {
+    lpm->chunk_count = 0;
+    lpm->reserved = 0;
+    RtlZeroMemory(lpm->root, sizeof(lpm->root));
+
+    // Shorter prefixes first, so a prefix only ever overwrites leaves of
+    // the prefixes that contain it
+    for (ULONG i = 0; i < count; i++) {
+        UINT32 address = prefixes[i].address;
+        ULONG length = prefixes[i].length;
+        ULONG label = prefixes[i].label;
+
+        if (length <= 16) {
+            lpmFill(lpm->root, address >> 16, 1u << (16 - length), label);
+        } else if (length <= 24) {
+            ULONG c2 = lpmChild(&lpm->chunk_count, lpm->chunks, &lpm->root[address >> 16]);
+            lpmFill(lpm->chunks[c2], (address >> 8) & 0xFF, 1u << (24 - length), label);
+        } else {
+            ULONG c2 = lpmChild(&lpm->chunk_count, lpm->chunks, &lpm->root[address >> 16]);
+            ULONG c3 = lpmChild(&lpm->chunk_count, lpm->chunks, &lpm->chunks[c2][(address >> 8) & 0xFF]);
+            lpmFill(lpm->chunks[c3], address & 0xFF, 1u << (32 - length), label);
+        }
+    }
+}
+
+static LONG lpm6Compare(const NET_LPM6_PREFIX* a, const NET_LPM6_PREFIX* b) {
+    if (a->address.hi != b->address.hi) { return a->address.hi < b->address.hi ? -1 : 1; }
+    if (a->address.lo != b->address.lo) { return a->address.lo < b->address.lo ? -1 : 1; }
+    return (LONG)a->length - (LONG)b->length;
+}
+
+static VOID lpm6SiftDown(PNET_LPM6_PREFIX prefixes, ULONG root, ULONG count) {
+    for (;;) {
+        ULONG child = 2 * root + 1;
+        if (child >= count) { return; }
+        if (child + 1 < count && lpm6Compare(&prefixes[child + 1], &prefixes[child]) > 0) { child++; }
+        if (lpm6Compare(&prefixes[root], &prefixes[child]) >= 0) { return; }
+        NET_LPM6_PREFIX t = prefixes[root]; prefixes[root] = prefixes[child]; prefixes[child] = t;
+        root = child;
+    }
+}
+
+VOID ndisLpm6Sort(PNET_LPM6_PREFIX prefixes, ULONG count) {
+    if (count < 2) { return; }
+    for (ULONG i = count / 2; i-- > 0;) { lpm6SiftDown(prefixes, i, count); }
+    for (ULONG end = count - 1; end > 0; end--) {
+        NET_LPM6_PREFIX t = prefixes[0]; prefixes[0] = prefixes[end]; prefixes[end] = t;
+        lpm6SiftDown(prefixes, 0, end);
+    }
+}
+
+// TRUE if a and b agree on their first bytes bytes
+static BOOLEAN lpm6SameBytes(const NET_LPM6_ADDRESS* a, const NET_LPM6_ADDRESS* b, ULONG bytes) {
+    for (ULONG i = 0; i < bytes; i++) {
+        if (ndisLpm6Byte(a, i) != ndisLpm6Byte(b, i)) { return FALSE; }
+    }
+    return TRUE;
+}
+
+static ULONG lpm6HostSlots(ULONG hosts) {
+    ULONG slots = 2;
+    while (slots < 2 * hosts) { slots <<= 1; }
+    return hosts == 0 ? 0 : slots;
+}
+
+static ULONG lpm6ChunkBytes(ULONG chunk_count) {
+    return FIELD_OFFSET(NET_LPM6, chunks) + chunk_count * NET_LPM_CHUNK_SIZE * sizeof(ULONG);
+}
+
+ULONG ndisLpm6Size(const NET_LPM6_PREFIX* prefixes, ULONG count, PNET_LPM6_PREFIX scratch) {
+    ULONG n = 0, hosts = 0, chunks = 0;
+    for (ULONG i = 0; i < count; i++) {
+        if (prefixes[i].length >= 128) { hosts++; } else { scratch[n++] = prefixes[i]; }
+    }
+    ndisLpm6Sort(scratch, n);
+
+    // One chunk per distinct leading `bytes` bytes among the prefixes that
+    // reach past them. In address order those prefixes are adjacent.
+    for (ULONG bytes = 2; bytes < 16; bytes++) {
+        const NET_LPM6_PREFIX* last = NULL;
+        for (ULONG i = 0; i < n; i++) {
+            if (scratch[i].length <= 8 * bytes) { continue; }
+            if (last == NULL || !lpm6SameBytes(&last->address, &scratch[i].address, bytes)) { chunks++; }
+            last = &scratch[i];
+        }
+    }
+
+    return lpm6ChunkBytes(chunks) + lpm6HostSlots(hosts) * sizeof(NET_LPM6_HOST);
+}
+
+VOID ndisLpm6Build(PNET_LPM6 lpm, const NET_LPM6_PREFIX* prefixes, ULONG count) {
+    ULONG hosts = 0;
+    lpm->chunk_count = 0;
+    lpm->reserved = 0;
+    RtlZeroMemory(lpm->root, sizeof(lpm->root));
+
+    for (ULONG i = 0; i < count; i++) {
+        const NET_LPM6_ADDRESS* address = &prefixes[i].address;
+        ULONG length = prefixes[i].length;
+        ULONG label = prefixes[i].label;
+
+        if (length >= 128) {
+            hosts++;
+        } else if (length <= 16) {
+            lpmFill(lpm->root, (ULONG)(address->hi >> 48), 1u << (16 - length), label);
+        } else {
+            // Walk down one byte per level to the chunk holding the last bits
+            PULONG entry = &lpm->root[address->hi >> 48];
+            for (ULONG index = 2;; index++) {
+                ULONG chunk = lpmChild(&lpm->chunk_count, lpm->chunks, entry);
+                if (length <= 8 * (index + 1)) {
+                    lpmFill(lpm->chunks[chunk], ndisLpm6Byte(address, index), 1u << (8 * (index + 1) - length), label);
+                    break;
+                }
+                entry = &lpm->chunks[chunk][ndisLpm6Byte(address, index)];
+            }
+        }
+    }
+
+    // Hosts go after the last chunk
+    lpm->host_offset = lpm6ChunkBytes(lpm->chunk_count);
+    lpm->host_mask = 0;
+    if (hosts != 0) {
+        ULONG slots = lpm6HostSlots(hosts);
+        PNET_LPM6_HOST table = (PNET_LPM6_HOST)((PUCHAR)lpm + lpm->host_offset);
+        RtlZeroMemory(table, slots * sizeof(NET_LPM6_HOST));
+        lpm->host_mask = slots - 1;
+        for (ULONG i = 0; i < count; i++) {
+            if (prefixes[i].length < 128) { continue; }
+            ULONG s = ndisLpm6Hash(&prefixes[i].address) & lpm->host_mask;
+            while (table[s].label != 0 && !ndisLpm6Equal(&table[s].address, &prefixes[i].address)) {
+                s = (s + 1) & lpm->host_mask;
+            }
+            table[s].address = prefixes[i].address;
+            table[s].label = prefixes[i].label;
+        }
+    }
+}
+
+// Chunks are appended the first time a prefix needs them, so a child always
+// comes after its parent: one pass in index order sees every parent first.
+// depth holds chunk_count bytes.
+static BOOLEAN lpmValidateChunks(const ULONG* root, const ULONG (*chunks)[NET_LPM_CHUNK_SIZE], ULONG chunk_count,
+    ULONG max_depth, PUCHAR depth) {
+    ULONG i, j;
+    for (i = 0; i < chunk_count; i++) { depth[i] = 0xFF; }
+    for (i = 0; i < NET_LPM_ROOT_SIZE; i++) {
+        if (!(root[i] & NET_LPM_CHILD)) { continue; }
+        ULONG child = root[i] & ~NET_LPM_CHILD;
+        if (child >= chunk_count) { return FALSE; }
+        depth[child] = 0;
+    }
+    for (j = 0; j < chunk_count; j++) {
+        if (depth[j] == 0xFF) { continue; }     // unreachable, never read
+        for (i = 0; i < NET_LPM_CHUNK_SIZE; i++) {
+            if (!(chunks[j][i] & NET_LPM_CHILD)) { continue; }
+            ULONG child = chunks[j][i] & ~NET_LPM_CHILD;
+            if (child <= j || child >= chunk_count || depth[j] >= max_depth) { return FALSE; }
+            if (depth[child] != 0xFF && depth[child] != depth[j] + 1) { return FALSE; }
+            depth[child] = (UCHAR)(depth[j] + 1);
+        }
+    }
+    return TRUE;
+}
+
+BOOLEAN ndisLpmValidate(const NET_LPM* lpm, ULONG size, PUCHAR depth) {
+    if (size < FIELD_OFFSET(NET_LPM, chunks)) { return FALSE; }
+    if (lpm->chunk_count > (size - FIELD_OFFSET(NET_LPM, chunks)) / (NET_LPM_CHUNK_SIZE * sizeof(ULONG))) { return FALSE; }
+    // Chunks for bits 16..23, then 24..31
+    return lpmValidateChunks(lpm->root, lpm->chunks, lpm->chunk_count, 1, depth);
+}
+
+BOOLEAN ndisLpm6Validate(const NET_LPM6* lpm, ULONG size, PUCHAR depth) {
+    if (size < FIELD_OFFSET(NET_LPM6, chunks)) { return FALSE; }
+    if (lpm->chunk_count > (size - FIELD_OFFSET(NET_LPM6, chunks)) / (NET_LPM_CHUNK_SIZE * sizeof(ULONG))) { return FALSE; }
+
+    if (lpm->host_mask != 0) {
+        // A probe stops at an empty slot, so there has to be one
+        UINT64 slots = (UINT64)lpm->host_mask + 1;
+        if ((slots & (slots - 1)) != 0 || (lpm->host_offset & (sizeof(UINT64) - 1)) != 0 ||
+            lpm->host_offset + slots * sizeof(NET_LPM6_HOST) > size) {
+            return FALSE;
+        }
+        const NET_LPM6_HOST* hosts = (const NET_LPM6_HOST*)((const UCHAR*)lpm + lpm->host_offset);
+        ULONG s = 0;
+        while (s <= lpm->host_mask && hosts[s].label != 0) { s++; }
+        if (s > lpm->host_mask) { return FALSE; }
+    }
+
+    // Chunks for bytes 2..15 of the address
+    return lpmValidateChunks(lpm->root, lpm->chunks, lpm->chunk_count, 13, depth);
+}
@@ -0,0 +1,133 @@
+#pragma once
+//
+// Longest-prefix-match table for IPv4 addresses (DIR-16-8-8).
+//
+// The first 16 bits of an address index a flat root array. An entry either
+// holds the label of the longest prefix covering that whole /16, or points
+// to a 256-entry chunk indexed by the next 8 bits, which may in turn point
+// to a chunk for the last 8 bits. Prefixes are leaf-pushed at build time,
+// so a lookup is one read for addresses covered only by prefixes up to /16,
+// two reads up to /24 and three beyond that, however many prefixes there
+// are.
+//
+// Label 0 means no prefix covers the address. The table is built in place
+// in memory sized by ndisLpmSize and holds no pointers, so it can live
+// inside another flat allocation.
+//
+// NET_LPM6 is the same layout carried on to 128 bits: a 16-bit root and a
+// chain of 8-bit chunks. Rule sets are dominated by /32../64 prefixes and
+// /128 hosts; hosts go to a small open-addressing table probed first, so
+// the trie only ever holds prefixes up to /127 and a lookup stops at the
+// depth of the longest prefix under the address (four reads at /48, six
+// at /64).
+//
+
+#define NET_LPM_ROOT_BITS       16
+#define NET_LPM_ROOT_SIZE       (1 << NET_LPM_ROOT_BITS)
+#define NET_LPM_CHUNK_SIZE      256
+#define NET_LPM_CHILD           0x80000000      // entry is a chunk index
+#define NET_LPM_MAX_LABEL       0x7FFFFFFF
+
+typedef struct _NET_LPM_PREFIX {
+    UINT32  address;                // host byte order, host bits zero
+    UCHAR   length;                 // 0..32
+    ULONG   label;                  // 1..NET_LPM_MAX_LABEL
+} NET_LPM_PREFIX, * PNET_LPM_PREFIX;
+
+typedef struct _NET_LPM {
+    ULONG   chunk_count;
+    ULONG   reserved;
+    ULONG   root[NET_LPM_ROOT_SIZE];
+    ULONG   chunks[1][NET_LPM_CHUNK_SIZE];
+} NET_LPM, * PNET_LPM;
+
+// prefixes must be sorted by ascending length; scratch holds count values
+ULONG ndisLpmSize(const NET_LPM_PREFIX* prefixes, ULONG count, UINT64* scratch);
+VOID ndisLpmBuild(PNET_LPM lpm, const NET_LPM_PREFIX* prefixes, ULONG count);
+
+// In-place heapsort for the table builders; there is no qsort to rely on
+// in the kernel build
+VOID ndisSortUint64(UINT64* values, ULONG count);
+
+typedef struct _NET_LPM6_ADDRESS {
+    UINT64  hi;                     // bytes 0..7 in host byte order
+    UINT64  lo;                     // bytes 8..15
+} NET_LPM6_ADDRESS, * PNET_LPM6_ADDRESS;
+
+typedef struct _NET_LPM6_PREFIX {
+    NET_LPM6_ADDRESS address;       // host bits zero
+    UCHAR   length;                 // 0..128
+    ULONG   label;                  // 1..NET_LPM_MAX_LABEL
+} NET_LPM6_PREFIX, * PNET_LPM6_PREFIX;
+
+typedef struct _NET_LPM6_HOST {
+    NET_LPM6_ADDRESS address;
+    ULONG   label;                  // 0 - empty slot
+    ULONG   reserved;
+} NET_LPM6_HOST, * PNET_LPM6_HOST;
+
+typedef struct _NET_LPM6 {
+    ULONG   chunk_count;
+    ULONG   host_mask;              // host slot count - 1, 0 - no hosts
+    ULONG   host_offset;            // NET_LPM6_HOST array, from the start of NET_LPM6
+    ULONG   reserved;
+    ULONG   root[NET_LPM_ROOT_SIZE];
+    ULONG   chunks[1][NET_LPM_CHUNK_SIZE];
+} NET_LPM6, * PNET_LPM6;
+
+// Sorts by address, then length
+VOID ndisLpm6Sort(PNET_LPM6_PREFIX prefixes, ULONG count);
+// scratch holds count prefixes; prefixes need no particular order here
+ULONG ndisLpm6Size(const NET_LPM6_PREFIX* prefixes, ULONG count, PNET_LPM6_PREFIX scratch);
+// prefixes must be sorted by ascending length
+VOID ndisLpm6Build(PNET_LPM6 lpm, const NET_LPM6_PREFIX* prefixes, ULONG count);
+
+// Checks a table received from outside the driver before it is looked up:
+// every chunk index in range, no walk deeper than the address and, for
+// NET_LPM6, a host table that fits and has an empty slot. size is the
+// number of readable bytes from lpm on; depth holds size / 1 KiB bytes.
+BOOLEAN ndisLpmValidate(const NET_LPM* lpm, ULONG size, PUCHAR depth);
+BOOLEAN ndisLpm6Validate(const NET_LPM6* lpm, ULONG size, PUCHAR depth);
+
+static FORCEINLINE BOOLEAN ndisLpm6Equal(const NET_LPM6_ADDRESS* a, const NET_LPM6_ADDRESS* b) {
+    return (BOOLEAN)(a->hi == b->hi && a->lo == b->lo);
+}
+
+static FORCEINLINE ULONG ndisLpm6Hash(const NET_LPM6_ADDRESS* address) {
+    UINT64 h = (address->hi * 0x9E3779B97F4A7C15ULL) ^ address->lo;
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    return (ULONG)(h >> 32);
+}
+
+static FORCEINLINE ULONG ndisLpm6Byte(const NET_LPM6_ADDRESS* address, ULONG index) {
+    return index < 8 ? (ULONG)(address->hi >> (56 - 8 * index)) & 0xFF : (ULONG)(address->lo >> (120 - 8 * index)) & 0xFF;
+}
+
+static FORCEINLINE ULONG ndisLpm6Lookup(const NET_LPM6* lpm, const NET_LPM6_ADDRESS* address) {
+    if (lpm->host_mask != 0) {
+        const NET_LPM6_HOST* hosts = (const NET_LPM6_HOST*)((const UCHAR*)lpm + lpm->host_offset);
+        ULONG s = ndisLpm6Hash(address) & lpm->host_mask;
+        while (hosts[s].label != 0) {
+            if (ndisLpm6Equal(&hosts[s].address, address)) { return hosts[s].label; }
+            s = (s + 1) & lpm->host_mask;
+        }
+    }
+
+    ULONG entry = lpm->root[address->hi >> 48];
+    for (ULONG index = 2; entry & NET_LPM_CHILD; index++) {
+        entry = lpm->chunks[entry & ~NET_LPM_CHILD][ndisLpm6Byte(address, index)];
+    }
+    return entry;
+}
+
+static FORCEINLINE ULONG ndisLpmLookup(const NET_LPM* lpm, UINT32 address) {
+    ULONG entry = lpm->root[address >> 16];
+    if (entry & NET_LPM_CHILD) {
+        entry = lpm->chunks[entry & ~NET_LPM_CHILD][(address >> 8) & 0xFF];
+        if (entry & NET_LPM_CHILD) {
+            entry = lpm->chunks[entry & ~NET_LPM_CHILD][address & 0xFF];
+        }
+    }
+    return entry;
+}
@@ -0,0 +1,348 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+#include "meter.h"
+
+C_ASSERT(sizeof(NET_METER_RECORD) == NET_METER_RECORD_LEN);
+C_ASSERT(NET_METER_TEMPLATE_LEN == 4 + 4 + 11 * 4);
+
+static PNET_METER_TABLE     ndisMeterTables = NULL;
+static PVOID                ndisMeterTablesRaw = NULL;
+static PVOID                ndisMeterSlab = NULL;
+static ULONG                ndisMeterCpuCount = 0;
+static ULONG                ndisMeterNextCpu = 0;      // where the next export starts
+static volatile LONG        ndisMeterSequence = 0;     // data records exported, for the message header
+static NET_METER_NOTIFY     ndisMeterNotify = NULL;
+
+// The template set every message starts with: information element and
+// length of each field, in record order
+static const UINT16 ndisMeterTemplate[11][2] = {
+    { 152, 8 }, { 153, 8 }, { 1, 8 }, { 2, 8 }, { 27, 16 }, { 28, 16 },
+    { 7, 2 }, { 11, 2 }, { 6, 2 }, { 4, 1 }, { 136, 1 },
+};
+
+BOOLEAN ndisMeterInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = count * sizeof(NET_METER_TABLE) + NETFLT_CACHE_LINE;
+
+    // The largest power of two of flows, with their buckets, that fits a
+    // processor's share next to its ring
+    SIZE_T share = NET_METER_MEMORY / count;
+    SIZE_T ring = NET_METER_RING_SIZE * sizeof(NET_METER_RECORD);
+    ULONG capacity = 1;
+    while (ring + (SIZE_T)capacity * 2 * (sizeof(NET_METER_FLOW) + sizeof(ULONG)) <= share) { capacity *= 2; }
+    SIZE_T slab_size = ((SIZE_T)capacity * (sizeof(NET_METER_FLOW) + sizeof(ULONG)) + ring) * count;
+
+    ndisMeterTablesRaw = NETFLT_ALLOC(size, NET_METER_TAG);
+    ndisMeterSlab = NETFLT_ALLOC(slab_size, NET_METER_TAG);
+    if (ndisMeterTablesRaw == NULL || ndisMeterSlab == NULL) {
+        ndisMeterCleanup();
+        return FALSE;
+    }
+    RtlZeroMemory(ndisMeterTablesRaw, size);
+    ndisMeterTables = (PNET_METER_TABLE)(((ULONG_PTR)ndisMeterTablesRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+
+    // Flows of every processor, then the rings, then the buckets
+    PNET_METER_FLOW flows = (PNET_METER_FLOW)ndisMeterSlab;
+    PNET_METER_RECORD records = (PNET_METER_RECORD)(flows + (SIZE_T)capacity * count);
+    PULONG buckets = (PULONG)(records + (SIZE_T)NET_METER_RING_SIZE * count);
+    for (ULONG cpu = 0; cpu < count; cpu++) {
+        PNET_METER_TABLE table = &ndisMeterTables[cpu];
+        table->capacity = capacity;
+        table->flows = flows + (SIZE_T)capacity * cpu;
+        table->records = records + (SIZE_T)NET_METER_RING_SIZE * cpu;
+        table->buckets = buckets + (SIZE_T)capacity * cpu;
+        table->lru_head = NET_METER_NIL;
+        table->lru_tail = NET_METER_NIL;
+        for (ULONG i = 0; i < capacity; i++) {
+            table->flows[i].hash_next = (i + 1 < capacity) ? i + 1 : NET_METER_NIL;
+            table->buckets[i] = NET_METER_NIL;
+        }
+        table->free = 0;
+    }
+    ndisMeterCpuCount = count;
+    return TRUE;
+}
+
+VOID ndisMeterCleanup() {
+    if (ndisMeterTablesRaw != NULL) { NETFLT_FREE(ndisMeterTablesRaw, NET_METER_TAG); }
+    if (ndisMeterSlab != NULL) { NETFLT_FREE(ndisMeterSlab, NET_METER_TAG); }
+    ndisMeterTablesRaw = NULL;
+    ndisMeterSlab = NULL;
+    ndisMeterTables = NULL;
+    ndisMeterCpuCount = 0;
+    ndisMeterNotify = NULL;
+}
+
+VOID ndisMeterSetNotify(NET_METER_NOTIFY notify) {
+    ndisMeterNotify = notify;
+}
+
+PNET_METER_TABLE ndisMeterCurrent() {
+    if (ndisMeterTables == NULL) { return NULL; }
+    return &ndisMeterTables[NETFLT_CPU_INDEX()];
+}
+
+static ULONG meterHash(const NET_METER_RECORD* key) {
+    UINT64 h = key->source.hi ^ (key->source.lo * 0x9E3779B97F4A7C15ULL);
+    h = (h ^ key->destination.hi) * 0xC2B2AE3D27D4EB4FULL;
+    h = (h ^ key->destination.lo ^ ((UINT64)key->source_port << 24) ^ ((UINT64)key->destination_port << 8) ^ key->protocol) *
+        0x9E3779B97F4A7C15ULL;
+    return (ULONG)(h >> 32);
+}
+
+static VOID meterLruUnlink(PNET_METER_TABLE table, ULONG index) {
+    PNET_METER_FLOW flow = &table->flows[index];
+    if (flow->lru_prev != NET_METER_NIL) { table->flows[flow->lru_prev].lru_next = flow->lru_next; } else { table->lru_head = flow->lru_next; }
+    if (flow->lru_next != NET_METER_NIL) { table->flows[flow->lru_next].lru_prev = flow->lru_prev; } else { table->lru_tail = flow->lru_prev; }
+}
+
+static VOID meterLruPush(PNET_METER_TABLE table, ULONG index) {
+    PNET_METER_FLOW flow = &table->flows[index];
+    flow->lru_prev = NET_METER_NIL;
+    flow->lru_next = table->lru_head;
+    if (table->lru_head != NET_METER_NIL) { table->flows[table->lru_head].lru_prev = index; } else { table->lru_tail = index; }
+    table->lru_head = index;
+}
+
+// Puts the record of a flow in the ring and frees the flow
+static VOID meterExport(PNET_METER_TABLE table, ULONG index, UCHAR reason) {
+    PNET_METER_FLOW flow = &table->flows[index];
+    PULONG link = &table->buckets[meterHash(&flow->record) & (table->capacity - 1)];
+    ULONG64 head = table->head;
+
+    if (head - ReadULong64Acquire(&table->tail) < NET_METER_RING_SIZE) {
+        PNET_METER_RECORD record = &table->records[head & (NET_METER_RING_SIZE - 1)];
+        *record = flow->record;
+        record->end_reason = reason;
+        table->exported++;
+        WriteULong64Release(&table->head, head + 1);
+
+        // Wake a reader once per half ring; the sweep DPC picks up the rest
+        KeMemoryBarrier();
+        if (ndisMeterNotify != NULL && head + 1 - ReadULong64Acquire(&table->tail) == NET_METER_RING_SIZE / 2) {
+            ndisMeterNotify();
+        }
+    } else {
+        table->lost++;
+    }
+
+    while (*link != index) { link = &table->flows[*link].hash_next; }
+    *link = flow->hash_next;
+    meterLruUnlink(table, index);
+    flow->hash_next = table->free;
+    table->free = index;
+    table->active--;
+}
+
+VOID ndisMeterFrame(PNET_METER_TABLE table, const UCHAR* frame, ULONG length, ULONG frame_length, ULONG64 now) {
+    NET_CLS_KEY cls_key;
+    NET_LPM6_ADDRESS addresses[2];
+    NET_METER_RECORD key;
+    UINT16 ether_type;
+    UCHAR tcp_flags = 0;
+
+    ULONG end = ndisFrameToKey(frame, length, &cls_key, addresses);
+    if (!(cls_key.shape & (NET_CLS_SHAPE_IP | NET_CLS_SHAPE_IP6))) { return; }
+    table->packets++;
+
+    RtlZeroMemory(&key, sizeof(key));
+    if (cls_key.shape & NET_CLS_SHAPE_IP6) {
+        key.source = addresses[0];
+        key.destination = addresses[1];
+    } else {
+        key.source.lo = 0x0000FFFF00000000ULL | cls_key.source_ip;
+        key.destination.lo = 0x0000FFFF00000000ULL | cls_key.destination_ip;
+    }
+    key.protocol = cls_key.protocol;
+    if (cls_key.shape & NET_CLS_SHAPE_L4) {
+        key.source_port = cls_key.source_port;
+        key.destination_port = cls_key.destination_port;
+        // The flags are a few bytes past the ports, almost always at hand
+        if (cls_key.protocol == 6 && end - NET_BATCH_PORTS_LEN + 14 <= length) {
+            tcp_flags = frame[end - NET_BATCH_PORTS_LEN + 13];
+        }
+    }
+    ULONG ip = ndisFrameNetworkOffset(frame, length, &ether_type);
+    ULONG octets = (frame_length > ip) ? frame_length - ip : 0;
+
+    ULONG bucket = meterHash(&key) & (table->capacity - 1);
+    ULONG index = table->buckets[bucket];
+    while (index != NET_METER_NIL) {
+        const NET_METER_RECORD* record = &table->flows[index].record;
+        if (record->source_port == key.source_port && record->destination_port == key.destination_port &&
+            record->protocol == key.protocol &&
+            record->source.hi == key.source.hi && record->source.lo == key.source.lo &&
+            record->destination.hi == key.destination.hi && record->destination.lo == key.destination.lo) {
+            break;
+        }
+        index = table->flows[index].hash_next;
+    }
+
+    if (index == NET_METER_NIL) {
+        table->started++;
+        if (table->free == NET_METER_NIL) {
+            // Full: the least recently seen flow makes room
+            meterExport(table, table->lru_tail, NET_METER_END_RESOURCES);
+        }
+        index = table->free;
+        table->free = table->flows[index].hash_next;
+        table->active++;
+
+        PNET_METER_FLOW flow = &table->flows[index];
+        flow->record = key;
+        flow->record.first = now;
+        flow->hash_next = table->buckets[bucket];
+        table->buckets[bucket] = index;
+        meterLruPush(table, index);
+    } else if (index != table->lru_head) {
+        meterLruUnlink(table, index);
+        meterLruPush(table, index);
+    }
+
+    PNET_METER_RECORD record = &table->flows[index].record;
+    record->packets++;
+    record->octets += octets;
+    record->last = now;
+    record->tcp_flags |= tcp_flags;
+    if (tcp_flags & 0x05) {
+        // FIN or RST
+        meterExport(table, index, NET_METER_END_FLOW);
+    } else if (now - record->first >= NET_METER_ACTIVE) {
+        meterExport(table, index, NET_METER_END_ACTIVE);
+    }
+}
+
+VOID ndisMeterExpire(PNET_METER_TABLE table, ULONG64 now, ULONG max) {
+    for (ULONG n = 0; n < max && table->lru_tail != NET_METER_NIL; n++) {
+        if (table->flows[table->lru_tail].record.last + NET_METER_IDLE > now) { break; }
+        // An idle flow can wait for room in the ring; its record is not lost
+        if (table->head - ReadULong64Acquire(&table->tail) >= NET_METER_RING_SIZE) { break; }
+        meterExport(table, table->lru_tail, NET_METER_END_IDLE);
+    }
+}
+
+static VOID meterPut16(PUCHAR dst, UINT32 v) {
+    dst[0] = (UCHAR)(v >> 8); dst[1] = (UCHAR)v;
+}
+
+static VOID meterPut32(PUCHAR dst, UINT32 v) {
+    dst[0] = (UCHAR)(v >> 24); dst[1] = (UCHAR)(v >> 16); dst[2] = (UCHAR)(v >> 8); dst[3] = (UCHAR)v;
+}
+
+static VOID meterPut64(PUCHAR dst, UINT64 v) {
+    meterPut32(dst, (UINT32)(v >> 32));
+    meterPut32(dst + 4, (UINT32)v);
+}
+
+// 100 ns units since 1601 to ms since 1970
+static UINT64 meterUnixMs(UINT64 system_time) {
+    return (system_time > 116444736000000000ULL) ? (system_time - 116444736000000000ULL) / 10000 : 0;
+}
+
+static VOID meterPutRecord(PUCHAR dst, const NET_METER_RECORD* record, ULONG64 system_time, ULONG64 interrupt_time) {
+    meterPut64(dst, meterUnixMs(system_time - (interrupt_time - record->first)));
+    meterPut64(dst + 8, meterUnixMs(system_time - (interrupt_time - record->last)));
+    meterPut64(dst + 16, record->octets);
+    meterPut64(dst + 24, record->packets);
+    meterPut64(dst + 32, record->source.hi);
+    meterPut64(dst + 40, record->source.lo);
+    meterPut64(dst + 48, record->destination.hi);
+    meterPut64(dst + 56, record->destination.lo);
+    meterPut16(dst + 64, record->source_port);
+    meterPut16(dst + 66, record->destination_port);
+    meterPut16(dst + 68, record->tcp_flags);
+    dst[70] = record->protocol;
+    dst[71] = record->end_reason;
+}
+
+ULONG ndisMeterExport(PUCHAR message, ULONG size, ULONG64 system_time, ULONG64 interrupt_time) {
+    ULONG offset = NET_METER_HEADER_LEN + NET_METER_TEMPLATE_LEN + NET_METER_SET_LEN;
+    ULONG count = 0;
+    ULONG start = ndisMeterNextCpu;
+
+    if (size > NET_METER_MESSAGE_MAX) { size = NET_METER_MESSAGE_MAX; }
+    if (size < NET_METER_MESSAGE_MIN) { return 0; }
+    ULONG max_records = (size - offset) / NET_METER_RECORD_LEN;
+
+    // As for alerts, starting one processor further each time keeps a small
+    // message from always favouring the first rings
+    for (ULONG n = 0; n < ndisMeterCpuCount && count < max_records; n++) {
+        PNET_METER_TABLE table = &ndisMeterTables[(start + n) % ndisMeterCpuCount];
+        if (InterlockedCompareExchange(&table->draining, 1, 0) != 0) { continue; }
+
+        ULONG64 tail = table->tail;
+        ULONG64 available = ReadULong64Acquire(&table->head) - tail;
+        ULONG take = (available < max_records - count) ? (ULONG)available : max_records - count;
+        for (ULONG i = 0; i < take; i++) {
+            meterPutRecord(message + offset, &table->records[(tail + i) & (NET_METER_RING_SIZE - 1)], system_time, interrupt_time);
+            offset += NET_METER_RECORD_LEN;
+        }
+        count += take;
+        WriteULong64Release(&table->tail, tail + take);
+        InterlockedExchange(&table->draining, 0);
+    }
+    if (ndisMeterCpuCount != 0) { ndisMeterNextCpu = (start + 1) % ndisMeterCpuCount; }
+    if (count == 0) { return 0; }
+
+    // Message header: the sequence number counts the data records of the
+    // messages before this one
+    meterPut16(message, NET_METER_IPFIX_VERSION);
+    meterPut16(message + 2, offset);
+    meterPut32(message + 4, (UINT32)(meterUnixMs(system_time) / 1000));
+    meterPut32(message + 8, (UINT32)InterlockedExchangeAdd(&ndisMeterSequence, (LONG)count));
+    meterPut32(message + 12, 0);
+
+    // Template set (ID 2) with the one template, then the data set
+    PUCHAR set = message + NET_METER_HEADER_LEN;
+    meterPut16(set, 2);
+    meterPut16(set + 2, NET_METER_TEMPLATE_LEN);
+    meterPut16(set + 4, NET_METER_TEMPLATE_ID);
+    meterPut16(set + 6, 11);
+    for (ULONG i = 0; i < 11; i++) {
+        meterPut16(set + 8 + 4 * i, ndisMeterTemplate[i][0]);
+        meterPut16(set + 10 + 4 * i, ndisMeterTemplate[i][1]);
+    }
+    set += NET_METER_TEMPLATE_LEN;
+    meterPut16(set, NET_METER_TEMPLATE_ID);
+    meterPut16(set + 2, NET_METER_SET_LEN + count * NET_METER_RECORD_LEN);
+    return offset;
+}
+
+BOOLEAN ndisMeterPending() {
+    for (ULONG cpu = 0; cpu < ndisMeterCpuCount; cpu++) {
+        if (ReadULong64Acquire(&ndisMeterTables[cpu].head) != ndisMeterTables[cpu].tail) { return TRUE; }
+    }
+    return FALSE;
+}
+
+VOID ndisMeterQueryStat(PNET_METER_STAT stat) {
+    RtlZeroMemory(stat, sizeof(NET_METER_STAT));
+    stat->cpus = ndisMeterCpuCount;
+    if (ndisMeterTables == NULL) { return; }
+    stat->entries = ndisMeterTables[0].capacity;
+
+    // Counters are written only by their own processor, as in the flow cache
+    for (ULONG cpu = 0; cpu < ndisMeterCpuCount; cpu++) {
+        PNET_METER_TABLE table = &ndisMeterTables[cpu];
+        stat->packets += table->packets;
+        stat->started += table->started;
+        stat->exported += table->exported;
+        stat->lost += table->lost;
+        stat->active += table->active;
+        stat->pending += (ULONG)(table->head - table->tail);
+    }
+}
+
+VOID ndisMeterClearStat() {
+    for (ULONG cpu = 0; cpu < ndisMeterCpuCount; cpu++) {
+        ndisMeterTables[cpu].packets = 0;
+        ndisMeterTables[cpu].started = 0;
+        ndisMeterTables[cpu].exported = 0;
+        ndisMeterTables[cpu].lost = 0;
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+//
+// Per-processor flow metering and IPFIX-style export.
+//
+// Every IP frame the header stages see is counted against its flow, the
+// 5-tuple of one direction (an IPFIX uniflow), in the table of the
+// processor it arrived on: packets, bytes from the IP header on, first and
+// last time seen and the OR of the TCP flags. A flow is exported when it
+// has been idle for NET_METER_IDLE, when it has run for NET_METER_ACTIVE,
+// when a FIN or RST ends it, or when a full table recycles its least
+// recently seen flow; its next frame starts it afresh. One record per flow
+// and interval instead of one event per frame is what makes the export
+// cheap: a bulk TCP flow of thousands of segments costs a few records.
+//
+// Exported flows wait in a per-processor ring, as alerts do (alert.h), and
+// user mode reads them through IOCTL_FILTER_READ_FLOWS as IPFIX messages
+// (RFC 7011): the message header, a template set describing the record,
+// then one data set of NET_METER_RECORD_LEN-byte records in network order.
+// A read waits for the next sweep or for a ring to fill halfway, so
+// records leave in batches. A record that finds its ring full is lost and
+// counted.
+//
+// Entries come from a fixed slab of NET_METER_MEMORY bytes split between
+// the processors, as in stream.h. Every processor owns its table and only
+// touches it at DISPATCH_LEVEL on that processor: from the packet path
+// inside an epoch section, or from the sweep DPC targeted at it, which
+// expires the flows of a processor no frames arrive on. Idle flows are
+// taken from the tail of the least-recently-seen list, so expiry never
+// looks at a live flow. A flow whose frames reach several processors is
+// metered on each of them; its records add up.
+//
+
+#define NET_METER_TAG           '1teM'
+#define NET_METER_MEMORY        (16 << 20)  // flows and hash buckets of all processors
+#define NET_METER_RING_SIZE     2048        // exported records per processor, power of two
+#define NET_METER_NIL           0xFFFFFFFF
+
+// 100 ns units
+#define NET_METER_IDLE          150000000ULL    // 15 s without a frame
+#define NET_METER_ACTIVE        600000000ULL    // 60 s since the first frame
+#define NET_METER_SWEEP         10000000        // period of the sweep DPC, 1 s
+
+// Idle flows a frame's batch may export on the packet path; the sweep
+// takes the rest
+#define NET_METER_EXPIRE_BATCH  32
+
+// flowEndReason (IPFIX information element 136)
+#define NET_METER_END_IDLE      1
+#define NET_METER_END_ACTIVE    2
+#define NET_METER_END_FLOW      3           // FIN or RST
+#define NET_METER_END_FORCED    4
+#define NET_METER_END_RESOURCES 5           // recycled by a full table
+
+// IPFIX message layout. Must match FILTER_FLOW_* in FilterNetworkCtrl.h
+// and FilterNetworkCollector\flowcol.c
+#define NET_METER_IPFIX_VERSION 10
+#define NET_METER_TEMPLATE_ID   256
+#define NET_METER_HEADER_LEN    16          // version, length, export time, sequence, domain
+#define NET_METER_TEMPLATE_LEN  52          // set header, template header, 11 fields
+#define NET_METER_SET_LEN       4           // data set header
+#define NET_METER_RECORD_LEN    72
+#define NET_METER_MESSAGE_MAX   65535       // the length field is 16 bits
+#define NET_METER_MESSAGE_MIN   (NET_METER_HEADER_LEN + NET_METER_TEMPLATE_LEN + NET_METER_SET_LEN + NET_METER_RECORD_LEN)
+
+// Record fields in template order, each in network order:
+//   flowStartMilliseconds (152)    8   ms since 1970
+//   flowEndMilliseconds (153)      8
+//   octetDeltaCount (1)            8
+//   packetDeltaCount (2)           8
+//   sourceIPv6Address (27)         16  IPv4 as ::ffff:a.b.c.d
+//   destinationIPv6Address (28)    16
+//   sourceTransportPort (7)        2   0 without ports
+//   destinationTransportPort (11)  2
+//   tcpControlBits (6)             2
+//   protocolIdentifier (4)         1
+//   flowEndReason (136)            1
+
+typedef struct _NET_METER_RECORD {
+    NET_LPM6_ADDRESS    source;     // IPv4: ::ffff:a.b.c.d
+    NET_LPM6_ADDRESS    destination;
+    UINT16              source_port;
+    UINT16              destination_port;
+    UINT16              tcp_flags;  // OR of every segment's
+    UCHAR               protocol;
+    UCHAR               end_reason; // NET_METER_END_*, set on export
+    ULONG64             packets;
+    ULONG64             octets;
+    ULONG64             first;      // interrupt time
+    ULONG64             last;
+} NET_METER_RECORD, * PNET_METER_RECORD;
+
+typedef struct _NET_METER_FLOW {
+    NET_METER_RECORD    record;
+    ULONG               hash_next;  // in its bucket, or in the free list
+    ULONG               lru_prev;   // towards the most recently seen
+    ULONG               lru_next;
+    ULONG               pad;
+} NET_METER_FLOW, * PNET_METER_FLOW;
+
+typedef struct DECLSPEC_CACHEALIGN _NET_METER_TABLE {
+    ULONG64             packets;    // frames metered
+    ULONG64             started;    // flows started
+    ULONG64             exported;   // records put in the ring
+    ULONG64             lost;       // records lost to a full ring
+    ULONG               capacity;   // flows, power of two
+    ULONG               active;     // flows in the table
+    ULONG               free;       // free list through hash_next
+    ULONG               lru_head;   // most recently seen
+    ULONG               lru_tail;
+    PULONG              buckets;    // capacity flow indexes
+    PNET_METER_FLOW     flows;
+    PNET_METER_RECORD   records;    // the ring
+    volatile ULONG64    head;       // ring, written by the table's processor only
+    UCHAR               pad[NETFLT_CACHE_LINE - sizeof(ULONG64)];
+    volatile ULONG64    tail;       // written by the reader only
+    volatile LONG       draining;   // 1 while a reader owns the tail
+} NET_METER_TABLE, * PNET_METER_TABLE;
+
+typedef struct _NET_METER_STAT {
+    ULONG64 packets;
+    ULONG64 started;
+    ULONG64 exported;
+    ULONG64 lost;
+    ULONG   active;                 // flows in all tables
+    ULONG   pending;                // records waiting in the rings
+    ULONG   entries;                // capacity of one processor's table
+    ULONG   cpus;
+} NET_METER_STAT, * PNET_METER_STAT;
+
+// Called at DISPATCH_LEVEL when a ring fills halfway, so that a waiting
+// reader can be completed (see device.c)
+typedef VOID (*NET_METER_NOTIFY)(VOID);
+
+// A failed init leaves metering off
+BOOLEAN ndisMeterInit();
+VOID ndisMeterCleanup();
+VOID ndisMeterSetNotify(NET_METER_NOTIFY notify);
+
+// The calling processor's table; NULL if metering is off
+PNET_METER_TABLE ndisMeterCurrent();
+
+// Counts a frame of frame_length bytes, the first length of them at frame,
+// at interrupt time now. Frames other than IPv4 and IPv6 are not metered.
+VOID ndisMeterFrame(PNET_METER_TABLE table, const UCHAR* frame, ULONG length, ULONG frame_length, ULONG64 now);
+
+// Exports up to max flows idle at interrupt time now, oldest first, while
+// the ring has room
+VOID ndisMeterExpire(PNET_METER_TABLE table, ULONG64 now, ULONG max);
+
+// Writes one IPFIX message of the records waiting in the rings to message,
+// at most size bytes (NET_METER_MESSAGE_MIN at least), and returns its
+// length, 0 when no record was waiting. Interrupt times become wall clock
+// times through system_time and interrupt_time, read together. Any IRQL up
+// to DISPATCH_LEVEL; concurrent callers never return the same record.
+ULONG ndisMeterExport(PUCHAR message, ULONG size, ULONG64 system_time, ULONG64 interrupt_time);
+
+// TRUE if some ring holds a record
+BOOLEAN ndisMeterPending();
+
+VOID ndisMeterQueryStat(PNET_METER_STAT stat);
+VOID ndisMeterClearStat();
@@ -93,89 +93,78 @@ N.B.: It is important to check the ReceiveFlags in NDIS_TEST_RECEIVE_CANNOT_PEND
         // deep copy, and return the original NBL.
 
         /// My++
-        
-        PNET_BUFFER_LIST nbl_ptr = NetBufferLists;
-        PNET_BUFFER_LIST nbl_drop_ptrbeg = NULL;
-        PNET_BUFFER_LIST nbl_keep_ptrbeg = NULL;
-        PNET_BUFFER_LIST nbl_drop_ptr = nbl_drop_ptrbeg;
-        PNET_BUFFER_LIST nbl_keep_ptr = nbl_keep_ptrbeg;
+
+        PNET_BUFFER_LIST    nbl_keep_ptrbeg = NULL;
+        PNET_BUFFER_LIST    nbl_drop_ptrbeg = NULL;
         ULONG               NumberOfKeepedLists = 0;
+        ULONG               NumberOfDroppedLists = 0;
+        NETFLT_EPOCH_READER epoch_reader;
 
         if (NDIS_TEST_RECEIVE_CANNOT_PEND(ReceiveFlags)) {
-            DbgPrint("NDIS: NDIS_TEST_RECEIVE_CANNOT_PEND\n");
+            DEBUGP(DL_VERY_LOUD, "NDIS: NDIS_TEST_RECEIVE_CANNOT_PEND\n");
+
+            // The NBLs still belong to the miniport: classify them in batches,
+            // indicate the kept ones of each batch as one temporary chain with
+            // NDIS_RECEIVE_FLAGS_RESOURCES, then restore the original links.
+            PNET_BUFFER_LIST    nbls[NET_BATCH_MAX];
+            PNET_BUFFER_LIST    next[NET_BATCH_MAX];
+            UCHAR               verdicts[NET_BATCH_MAX];
+            PNET_BUFFER_LIST    nbl_ptr = NetBufferLists;
 
             while (nbl_ptr != NULL) {
-                DbgPrint("NDIS: \tinspect_list\n");
-                BOOLEAN drop = inspect_list(nbl_ptr);
-                if (!drop) {
-                    PNET_BUFFER_LIST oldnbl_ptr = NET_BUFFER_LIST_NEXT_NBL(nbl_ptr);
-                    nbl_ptr->Next = NULL;
-                    NdisFReturnNetBufferLists(pFilter->FilterHandle, nbl_ptr, NDIS_RECEIVE_FLAGS_RESOURCES);
-                    nbl_ptr->Next = oldnbl_ptr;
+                PNET_RULE_SET rule_set = ndisAcquireNetRules(&epoch_reader, pFilter);
+                ULONG nbl_count = inspect_batch(rule_set, INSPECT_ALL, nbl_ptr, nbls, verdicts);
+                ndisReleaseNetRules(&epoch_reader);
+
+                PNET_BUFFER_LIST* keep_tail = &nbl_keep_ptrbeg;
+                ULONG keep_count = 0;
+                for (ULONG i = 0; i < nbl_count; i++) {
+                    next[i] = NET_BUFFER_LIST_NEXT_NBL(nbls[i]);
+                    if (verdicts[i] != INSPECT_DROP) {
+                        *keep_tail = nbls[i];
+                        keep_tail = &NET_BUFFER_LIST_NEXT_NBL(nbls[i]);
+                        keep_count++;
+                    }
+                }
+                *keep_tail = NULL;
+                nbl_ptr = next[nbl_count - 1];
+
+                if (nbl_keep_ptrbeg != NULL) {
+                    NdisFIndicateReceiveNetBufferLists(pFilter->FilterHandle, nbl_keep_ptrbeg, PortNumber, keep_count,
+                        ReceiveFlags | NDIS_RECEIVE_FLAGS_RESOURCES);
                 }
-                nbl_ptr = NET_BUFFER_LIST_NEXT_NBL(nbl_ptr);
+                for (ULONG i = 0; i < nbl_count; i++) {
+                    NET_BUFFER_LIST_NEXT_NBL(nbls[i]) = next[i];
+                }
+                nbl_keep_ptrbeg = NULL;
+                NumberOfKeepedLists += keep_count;
             }
 
         } else {
 
-            DbgPrint("NDIS: NOT NDIS_TEST_RECEIVE_CANNOT_PEND\n");
-            
-            while (nbl_ptr != NULL) {
-            
-                DbgPrint("NDIS: \tinspect_list\n");
-                
-                BOOLEAN drop = inspect_list(nbl_ptr);
-                if(drop){
-
-                    DbgPrint("NDIS: \t\tdrop\n");
-                    
-                    if(nbl_drop_ptrbeg == NULL){
-                        DbgPrint("NDIS: \t\t\tnbl_drop_ptrbeg == NULL\n");
-                        nbl_drop_ptrbeg = nbl_ptr;
-                        PNET_BUFFER_LIST oldnbl_ptr = NET_BUFFER_LIST_NEXT_NBL(nbl_ptr);
-                        nbl_drop_ptr = nbl_drop_ptrbeg;
-                        //nbl_drop_ptr->Next = NULL;
-                        nbl_ptr = oldnbl_ptr;
-                        continue;
-                    } else {
-                        DbgPrint("NDIS: \t\t\tnbl_drop_ptrbeg != NULL\n");
-                        nbl_drop_ptr->Next = nbl_ptr;
-                        nbl_drop_ptr = nbl_drop_ptr->Next;
-                        PNET_BUFFER_LIST oldnbl_ptr = NET_BUFFER_LIST_NEXT_NBL(nbl_ptr);
-                        //nbl_drop_ptr->Next = NULL;
-                        nbl_ptr = oldnbl_ptr;
-                        continue;
-                    }
+            DEBUGP(DL_VERY_LOUD, "NDIS: NOT NDIS_TEST_RECEIVE_CANNOT_PEND\n");
+
+            // Rule set reference is released before anything is indicated up
+            // or returned. The NBLs are ours to hold, so those a payload
+            // stage still has to see can go to a worker (defer.h).
+            PNET_BUFFER_LIST    chains[INSPECT_VERDICTS];
+            ULONG               counts[INSPECT_VERDICTS];
+            PNET_RULE_SET rule_set = ndisAcquireNetRules(&epoch_reader, pFilter);
+            ULONG defer = ndisDeferPolicy(pFilter, rule_set, PortNumber);
+            inspect_chain(rule_set, defer ? INSPECT_HEADERS : INSPECT_ALL, NetBufferLists, chains, counts);
+            ndisReleaseNetRules(&epoch_reader);
+            ndisDeferQueue(pFilter, FALSE, ReceiveFlags, defer, chains, counts);
+            nbl_keep_ptrbeg = chains[INSPECT_PASS];
+            NumberOfKeepedLists = counts[INSPECT_PASS];
+            nbl_drop_ptrbeg = chains[INSPECT_DROP];
+            NumberOfDroppedLists = counts[INSPECT_DROP];
 
-                } else {
-                    DbgPrint("NDIS: \t\tkeep\n");
-                    NumberOfKeepedLists++;
-                    if (nbl_keep_ptrbeg == NULL) {
-                        DbgPrint("NDIS: \t\t\tnbl_keep_ptrbeg == NULL\n");
-                        nbl_keep_ptrbeg = nbl_ptr;
-                        PNET_BUFFER_LIST oldnbl_ptr = NET_BUFFER_LIST_NEXT_NBL(nbl_ptr);
-                        nbl_keep_ptr = nbl_keep_ptrbeg;
-                        //nbl_keep_ptr->Next = NULL;
-                        nbl_ptr = oldnbl_ptr;
-                        continue;
-                    } else {
-                        DbgPrint("NDIS: \t\t\tnbl_keep_ptrbeg != NULL\n");
-                        nbl_keep_ptr->Next = nbl_ptr;
-                        nbl_keep_ptr = nbl_keep_ptr->Next;
-                        PNET_BUFFER_LIST oldnbl_ptr = NET_BUFFER_LIST_NEXT_NBL(nbl_ptr);
-                        //nbl_keep_ptr->Next = NULL;
-                        nbl_ptr = oldnbl_ptr;
-                        continue;
-                    }
-                }
-            }
-            
             if (nbl_drop_ptrbeg) {
-                DbgPrint("NDIS: NdisFReturnNetBufferLists\n");
-                NdisFReturnNetBufferLists(pFilter->FilterHandle, nbl_drop_ptrbeg, ReceiveFlags);
+                NdisFReturnNetBufferLists(pFilter->FilterHandle, nbl_drop_ptrbeg,
+                    DispatchLevel ? NDIS_RETURN_FLAGS_DISPATCH_LEVEL : 0);
             }
             if (nbl_keep_ptrbeg) {
-                DbgPrint("NDIS: NdisFIndicateReceiveNetBufferLists pn= %d, nofkl= %d\n", (ULONG)PortNumber, NumberOfKeepedLists);
+                DEBUGP(DL_VERY_LOUD, "NDIS: NdisFIndicateReceiveNetBufferLists pn= %d, nofkl= %d\n", (ULONG)PortNumber, NumberOfKeepedLists);
                 NdisFIndicateReceiveNetBufferLists(pFilter->FilterHandle, nbl_keep_ptrbeg, PortNumber, NumberOfKeepedLists, ReceiveFlags);
             }
         }
@@ -184,7 +173,7 @@ N.B.: It is important to check the ReceiveFlags in NDIS_TEST_RECEIVE_CANNOT_PEND
 
         if (pFilter->TrackReceives) {
             FILTER_ACQUIRE_LOCK(&pFilter->Lock, DispatchLevel);
-            pFilter->OutstandingRcvs += NumberOfNetBufferLists;
+            pFilter->OutstandingRcvs += NumberOfKeepedLists;
             Ref = pFilter->OutstandingRcvs;
 
             FILTER_LOG_RCV_REF(1, pFilter, NetBufferLists, Ref);
@@ -202,7 +191,7 @@ N.B.: It is important to check the ReceiveFlags in NDIS_TEST_RECEIVE_CANNOT_PEND
 
         if (NDIS_TEST_RECEIVE_CANNOT_PEND(ReceiveFlags) && pFilter->TrackReceives) {
             FILTER_ACQUIRE_LOCK(&pFilter->Lock, DispatchLevel);
-            pFilter->OutstandingRcvs -= NumberOfNetBufferLists;
+            pFilter->OutstandingRcvs -= NumberOfKeepedLists;
             Ref = pFilter->OutstandingRcvs;
             FILTER_LOG_RCV_REF(2, pFilter, NetBufferLists, Ref);
             FILTER_RELEASE_LOCK(&pFilter->Lock, DispatchLevel);
@@ -348,7 +337,44 @@ FilterSendNetBufferLists(
         // NBL for an unbounded amount of time, then allocate memory, perform a
         // deep copy, and complete the original NBL.
 
-        NdisFSendNetBufferLists(pFilter->FilterHandle, NetBufferLists, PortNumber, SendFlags);
+        /// My++
+
+        PNET_BUFFER_LIST    nbl_pass_ptrbeg = NULL;
+        PNET_BUFFER_LIST    nbl_drop_ptrbeg = NULL;
+        ULONG               NumberOfPassedLists = 0;
+        ULONG               NumberOfDroppedLists = 0;
+        NETFLT_EPOCH_READER epoch_reader;
+
+        PNET_BUFFER_LIST    chains[INSPECT_VERDICTS];
+        ULONG               counts[INSPECT_VERDICTS];
+        PNET_RULE_SET rule_set = ndisAcquireNetRules(&epoch_reader, pFilter);
+        ULONG defer = ndisDeferPolicy(pFilter, rule_set, PortNumber);
+        inspect_chain(rule_set, defer ? INSPECT_HEADERS : INSPECT_ALL, NetBufferLists, chains, counts);
+        ndisReleaseNetRules(&epoch_reader);
+        ndisDeferQueue(pFilter, TRUE, SendFlags, defer, chains, counts);
+        nbl_pass_ptrbeg = chains[INSPECT_PASS];
+        NumberOfPassedLists = counts[INSPECT_PASS];
+        nbl_drop_ptrbeg = chains[INSPECT_DROP];
+        NumberOfDroppedLists = counts[INSPECT_DROP];
+
+        if (nbl_drop_ptrbeg) {
+            for (CurrNbl = nbl_drop_ptrbeg; CurrNbl != NULL; CurrNbl = NET_BUFFER_LIST_NEXT_NBL(CurrNbl)) {
+                NET_BUFFER_LIST_STATUS(CurrNbl) = NDIS_STATUS_SUCCESS;     // silently dropped
+            }
+            if (pFilter->TrackSends) {
+                FILTER_ACQUIRE_LOCK(&pFilter->Lock, DispatchLevel);
+                pFilter->OutstandingSends -= NumberOfDroppedLists;
+                FILTER_LOG_SEND_REF(2, pFilter, nbl_drop_ptrbeg, pFilter->OutstandingSends);
+                FILTER_RELEASE_LOCK(&pFilter->Lock, DispatchLevel);
+            }
+            NdisFSendNetBufferListsComplete(pFilter->FilterHandle, nbl_drop_ptrbeg,
+                DispatchLevel ? NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL : 0);
+        }
+        if (nbl_pass_ptrbeg) {
+            NdisFSendNetBufferLists(pFilter->FilterHandle, nbl_pass_ptrbeg, PortNumber, SendFlags);
+        }
+
+        /// My--
 
 
     } while (bFalse);
@@ -434,6 +460,7 @@ FilterCancelSendNetBufferLists(
 */
 {
     PMS_FILTER  pFilter = (PMS_FILTER)FilterModuleContext;
+    ndisDeferCancelSends(pFilter, CancelId);
     NdisFCancelSendNetBufferLists(pFilter->FilterHandle, CancelId);
 }
 
@@ -0,0 +1,118 @@
+#pragma once
+//
+// Types and allocation helpers for the packet-path modules that are also
+// built in user mode (see ..\FilterNetworkBench). Kernel builds get the real
+// definitions from <ndis.h>; NETFLT_USER_MODE builds get plain C stand-ins.
+//
+
+#ifdef NETFLT_USER_MODE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef VOID
+#define VOID void
+#endif
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+typedef uint8_t         UCHAR, *PUCHAR;
+typedef uint8_t         BOOLEAN, *PBOOLEAN;
+typedef char            CHAR, *PCHAR;
+typedef uint16_t        USHORT, UINT16, *PUSHORT, *PUINT16;
+typedef uint32_t        ULONG, UINT32, *PULONG, *PUINT32;
+typedef int32_t         LONG;
+typedef uint64_t        ULONG64, ULONGLONG, UINT64;
+typedef int64_t         LONG64;
+typedef size_t          SIZE_T;
+typedef uintptr_t       ULONG_PTR;
+typedef void*           PVOID;
+typedef LONG            NDIS_STATUS;
+
+#define FORCEINLINE                 inline __attribute__((always_inline))
+#define DECLSPEC_CACHEALIGN         __attribute__((aligned(64)))
+#define FIELD_OFFSET(_Type, _Field) offsetof(_Type, _Field)
+#define UNREFERENCED_PARAMETER(P)   ((void)(P))
+#define C_ASSERT(e)                 _Static_assert(e, #e)
+
+#define NETFLT_ALLOC(_Size, _Tag)   malloc(_Size)
+#define NETFLT_FREE(_Ptr, _Tag)     free(_Ptr)
+
+#define RtlZeroMemory(_Dst, _Len)           memset((_Dst), 0, (_Len))
+#define RtlCopyMemory(_Dst, _Src, _Len)     memcpy((_Dst), (_Src), (_Len))
+
+#define InterlockedExchange64(_Target, _Value)          __atomic_exchange_n((_Target), (_Value), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(_Target)                 __atomic_add_fetch((_Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(_Target, _Value)         __atomic_fetch_add((_Target), (_Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(_Target, _Value)     __atomic_exchange_n((_Target), (_Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(_Target, _Value)            __atomic_exchange_n((_Target), (_Value), __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(_Target, _Value, _Comperand) __sync_val_compare_and_swap((_Target), (_Comperand), (_Value))
+#define ReadULong64Acquire(_Source)                     __atomic_load_n((_Source), __ATOMIC_ACQUIRE)
+#define WriteULong64Release(_Target, _Value)            __atomic_store_n((_Target), (_Value), __ATOMIC_RELEASE)
+#define KeMemoryBarrier()                               __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define YieldProcessor()                                ((void)0)
+#define NETFLT_PREFETCH(_Ptr)                           __builtin_prefetch((_Ptr))
+
+// The user-mode build is single threaded and runs as "processor 0"
+typedef UCHAR   KIRQL;
+#define NETFLT_CPU_COUNT()              1
+#define NETFLT_CPU_INDEX()              0
+#define NETFLT_RAISE_IRQL(_OldIrql)     (*(_OldIrql) = 0)
+#define NETFLT_LOWER_IRQL(_OldIrql)     UNREFERENCED_PARAMETER(_OldIrql)
+
+// System time in 100 ns units since 1601, as KeQuerySystemTime gives it
+static inline VOID netfltSystemTime(ULONG64* time) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *time = ((ULONG64)ts.tv_sec + 11644473600ULL) * 10000000ULL + (ULONG64)ts.tv_nsec / 100;
+}
+#define NETFLT_SYSTEM_TIME(_Time)       netfltSystemTime(_Time)
+
+static inline ULONG netfltLowestBit(ULONG mask) {
+    return (ULONG)__builtin_ctz(mask);
+}
+
+// SSSE3 code paths are compiled for x64 and picked at run time
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NETFLT_SSSE3
+#define NETFLT_SSSE3_TARGET             __attribute__((target("ssse3")))
+#define NETFLT_HAS_SSSE3()              __builtin_cpu_supports("ssse3")
+#endif
+
+#else
+
+#pragma warning(disable:4201)  //nonstandard extension used : nameless struct/union
+#include <ndis.h>
+
+#define NETFLT_ALLOC(_Size, _Tag)   ExAllocatePoolWithTag(NonPagedPool, (_Size), (_Tag))
+#define NETFLT_FREE(_Ptr, _Tag)     ExFreePoolWithTag((_Ptr), (_Tag))
+#define NETFLT_PREFETCH(_Ptr)       PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, (_Ptr))
+
+#define NETFLT_CPU_COUNT()              KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS)
+#define NETFLT_CPU_INDEX()              KeGetCurrentProcessorNumberEx(NULL)
+#define NETFLT_RAISE_IRQL(_OldIrql)     KeRaiseIrql(DISPATCH_LEVEL, (_OldIrql))
+#define NETFLT_LOWER_IRQL(_OldIrql)     KeLowerIrql(_OldIrql)
+#define NETFLT_SYSTEM_TIME(_Time)       KeQuerySystemTime((PLARGE_INTEGER)(_Time))
+
+static FORCEINLINE ULONG netfltLowestBit(ULONG mask) {
+    ULONG index;
+    _BitScanForward(&index, mask);
+    return index;
+}
+
+#if defined(_M_AMD64)
+#include <intrin.h>
+#define NETFLT_SSSE3
+#define NETFLT_SSSE3_TARGET
+#define NETFLT_HAS_SSSE3()              ExIsProcessorFeaturePresent(PF_SSSE3_INSTRUCTIONS_AVAILABLE)
+#endif
+
+#endif // NETFLT_USER_MODE
+
+#define NETFLT_CACHE_LINE   64
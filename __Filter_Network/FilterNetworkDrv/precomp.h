@@ -1,7 +1,31 @@
+#ifdef NETFLT_USER_MODE
+// User-mode builds of the packet path (..\FilterNetworkBench) get the few
+// NDIS buffer types and calls it uses from a shim instead of the driver
+#include "portable.h"
+#include "ndis_shim.h"
+#else
 #pragma warning(disable:4201)  //nonstandard extension used : nameless struct/union
 #include <ndis.h>
 #include "filteruser.h"
 #include "flt_dbg.h"
 #include "filter.h"
-#include "tcp_ip.h"
+#endif
+#include "epoch.h"
 #include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "content.h"
+#include "reputation.h"
+#include "dns.h"
+#include "vm.h"
+#include "ruleimage.h"
+#include "flowcache.h"
+#include "stream.h"
+#include "ratelimit.h"
+#include "alert.h"
+#include "meter.h"
+#include "batch.h"
+#include "tcp_ip.h"
+#ifndef NETFLT_USER_MODE
+#include "defer.h"
+#endif
@@ -0,0 +1,268 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+#include "ratelimit.h"
+
+#define RATE_ROW_BITS           10
+C_ASSERT((1 << RATE_ROW_BITS) == NET_RATE_WIDTH);
+C_ASSERT(NET_RATE_ROWS * RATE_ROW_BITS <= 64);
+
+static PNET_RATE_TABLE  ndisRateTables = NULL;
+static PVOID            ndisRateTablesRaw = NULL;
+static ULONG            ndisRateCpuCount = 0;
+
+BOOLEAN ndisRateInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = count * sizeof(NET_RATE_TABLE) + NETFLT_CACHE_LINE;
+
+    ndisRateTablesRaw = NETFLT_ALLOC(size, NET_RATE_TAG);
+    if (ndisRateTablesRaw == NULL) { return FALSE; }
+    RtlZeroMemory(ndisRateTablesRaw, size);
+
+    ndisRateTables = (PNET_RATE_TABLE)(((ULONG_PTR)ndisRateTablesRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+    ndisRateCpuCount = count;
+    return TRUE;
+}
+
+VOID ndisRateCleanup() {
+    if (ndisRateTablesRaw != NULL) { NETFLT_FREE(ndisRateTablesRaw, NET_RATE_TAG); }
+    ndisRateTablesRaw = NULL;
+    ndisRateTables = NULL;
+    ndisRateCpuCount = 0;
+}
+
+PNET_RATE_TABLE ndisRateCurrent() {
+    if (ndisRateTables == NULL) { return NULL; }
+    return &ndisRateTables[NETFLT_CPU_INDEX()];
+}
+
+static UINT64 rateLoad64(const UCHAR* bytes) {
+    UINT64 value = 0;
+    for (ULONG i = 0; i < 8; i++) { value = (value << 8) | bytes[i]; }
+    return value;
+}
+
+BOOLEAN ndisRateSource(const UCHAR* frame, ULONG length, PNET_LPM6_ADDRESS source) {
+    UINT16 ether_type;
+    ULONG ip = ndisFrameNetworkOffset(frame, length, &ether_type);
+
+    if (ether_type == 0x0800 && ip + 16 <= length) {
+        const UCHAR* address = frame + ip + 12;
+        source->hi = 0;
+        source->lo = 0x0000FFFF00000000ULL | ((ULONG)address[0] << 24) | ((ULONG)address[1] << 16) | ((ULONG)address[2] << 8) | address[3];
+        return TRUE;
+    }
+    if (ether_type == 0x86DD && ip + 24 <= length) {
+        source->hi = rateLoad64(frame + ip + 8);
+        source->lo = rateLoad64(frame + ip + 16);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// NET_RATE_ROWS counter indexes of RATE_ROW_BITS each
+static UINT64 rateHash(const NET_LPM6_ADDRESS* source) {
+    UINT64 h = source->hi ^ (source->lo * 0x9E3779B97F4A7C15ULL);
+    h = (h ^ (h >> 29)) * 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 32);
+}
+
+static VOID rateTopFloor(PNET_RATE_TABLE table) {
+    ULONG64 floor = ~0ULL;
+    if (table->top_count < NET_RATE_TOP) {
+        table->top_floor = 0;
+        return;
+    }
+    for (ULONG i = 0; i < NET_RATE_TOP; i++) {
+        if (table->top[i].packets < floor) { floor = table->top[i].packets; }
+    }
+    table->top_floor = floor;
+}
+
+// An entry changing hands is bracketed by top_sequence for the readers in
+// ndisRateQueryTop; a new estimate of the same source is one store
+static VOID rateTopSet(PNET_RATE_TABLE table, ULONG index, const NET_LPM6_ADDRESS* source, ULONG64 packets) {
+    table->top_sequence++;
+    KeMemoryBarrier();
+    table->top[index].address = *source;
+    table->top[index].packets = packets;
+    KeMemoryBarrier();
+    table->top_sequence++;
+}
+
+static VOID rateTopUpdate(PNET_RATE_TABLE table, const NET_LPM6_ADDRESS* source, ULONG64 packets) {
+    ULONG lowest = 0;
+
+    for (ULONG i = 0; i < table->top_count; i++) {
+        PNET_RATE_SOURCE entry = &table->top[i];
+        if (entry->address.lo == source->lo && entry->address.hi == source->hi) {
+            BOOLEAN was_floor = (BOOLEAN)(entry->packets == table->top_floor);
+            entry->packets = packets;
+            if (was_floor) { rateTopFloor(table); }
+            return;
+        }
+        if (entry->packets < table->top[lowest].packets) { lowest = i; }
+    }
+    if (table->top_count < NET_RATE_TOP) {
+        rateTopSet(table, table->top_count++, source, packets);
+    } else {
+        rateTopSet(table, lowest, source, packets);
+    }
+    rateTopFloor(table);
+}
+
+// Halves the counts once per window gone by, here on the processor that
+// owns them; the top list keeps the sources still above 0
+static VOID rateDecay(PNET_RATE_TABLE table, ULONG64 now) {
+    ULONG64 windows = (now - table->window) / NET_RATE_WINDOW;
+    ULONG shift = (windows < 32) ? (ULONG)windows : 32;
+    ULONG* counts = &table->counts[0][0];
+
+    table->window = now;
+    for (ULONG i = 0; i < NET_RATE_ROWS * NET_RATE_WIDTH; i++) {
+        counts[i] = (shift < 32) ? counts[i] >> shift : 0;
+    }
+    for (ULONG i = 0; i < table->top_count; ) {
+        ULONG64 packets = table->top[i].packets >> shift;
+        if (packets != 0) {
+            table->top[i++].packets = packets;
+            continue;
+        }
+        table->top_count--;
+        if (i != table->top_count) {
+            rateTopSet(table, i, &table->top[table->top_count].address, table->top[table->top_count].packets);
+        }
+    }
+    rateTopFloor(table);
+}
+
+VOID ndisRateCount(PNET_RATE_TABLE table, const NET_LPM6_ADDRESS* source, ULONG64 now) {
+    UINT64 h = rateHash(source);
+    ULONG* cells[NET_RATE_ROWS];
+    ULONG estimate = 0xFFFFFFFF;
+
+    if (now >= table->window + NET_RATE_WINDOW) { rateDecay(table, now); }
+    table->packets++;
+
+    for (ULONG row = 0; row < NET_RATE_ROWS; row++) {
+        cells[row] = &table->counts[row][(h >> (row * RATE_ROW_BITS)) & (NET_RATE_WIDTH - 1)];
+        if (*cells[row] < estimate) { estimate = *cells[row]; }
+    }
+    if (estimate == 0xFFFFFFFF) { return; }
+    estimate++;
+    // Which counters sit at the minimum is as good as random: a store of
+    // every one of them costs less than a mispredicted branch per row
+    for (ULONG row = 0; row < NET_RATE_ROWS; row++) {
+        ULONG cell = *cells[row];
+        *cells[row] = (cell < estimate) ? estimate : cell;
+    }
+
+    if (estimate > table->top_floor) { rateTopUpdate(table, source, estimate); }
+}
+
+BOOLEAN ndisRateAdmit(PNET_RATE_TABLE table, const NET_LPM6_ADDRESS* source, ULONG64 now,
+    ULONG rate_limit, ULONG rate_burst) {
+    UINT64 h = rateHash(source);
+    ULONG64* cells[NET_RATE_ROWS];
+    ULONG64 arrival = ~0ULL;
+
+    if (rate_limit == 0) { rate_limit = NET_RATE_DEFAULT_LIMIT; }
+    if (rate_burst == 0) { rate_burst = NET_RATE_DEFAULT_BURST; }
+    ULONG64 interval = 10000000ULL / rate_limit;
+    ULONG64 tolerance = interval * (rate_burst - 1);
+
+    // A bucket's theoretical arrival time runs interval ahead per token
+    // taken; one in the past is full
+    for (ULONG row = 0; row < NET_RATE_ROWS; row++) {
+        cells[row] = &table->buckets[row][(h >> (row * RATE_ROW_BITS)) & (NET_RATE_WIDTH - 1)];
+        ULONG64 cell = (*cells[row] > now) ? *cells[row] : now;
+        if (cell < arrival) { arrival = cell; }
+    }
+    if (arrival - now > tolerance) {
+        table->limited++;
+        return FALSE;
+    }
+    arrival += interval;
+    for (ULONG row = 0; row < NET_RATE_ROWS; row++) {
+        ULONG64 cell = *cells[row];
+        *cells[row] = (cell < arrival) ? arrival : cell;
+    }
+    table->admitted++;
+    return TRUE;
+}
+
+ULONG ndisRateQueryTop(PNET_RATE_SOURCE sources, ULONG max_sources) {
+    ULONG merged = 0;
+    if (ndisRateTables == NULL || max_sources == 0) { return 0; }
+
+    SIZE_T size = (SIZE_T)ndisRateCpuCount * NET_RATE_TOP * sizeof(NET_RATE_SOURCE);
+    PNET_RATE_SOURCE all = (PNET_RATE_SOURCE)NETFLT_ALLOC(size, NET_RATE_TAG);
+    if (all == NULL) { return 0; }
+
+    for (ULONG cpu = 0; cpu < ndisRateCpuCount; cpu++) {
+        PNET_RATE_TABLE table = &ndisRateTables[cpu];
+        NET_RATE_SOURCE top[NET_RATE_TOP];
+        ULONG count, sequence;
+
+        // Copied while no entry changes hands; the owner never waits
+        do {
+            while ((sequence = table->top_sequence) & 1) { YieldProcessor(); }
+            KeMemoryBarrier();
+            count = (table->top_count < NET_RATE_TOP) ? table->top_count : NET_RATE_TOP;
+            RtlCopyMemory(top, table->top, count * sizeof(NET_RATE_SOURCE));
+            KeMemoryBarrier();
+        } while (table->top_sequence != sequence);
+
+        // A source seen on several processors adds up
+        for (ULONG i = 0; i < count; i++) {
+            ULONG j;
+            for (j = 0; j < merged; j++) {
+                if (all[j].address.hi == top[i].address.hi && all[j].address.lo == top[i].address.lo) { break; }
+            }
+            if (j == merged) {
+                all[merged++] = top[i];
+            } else {
+                all[j].packets += top[i].packets;
+            }
+        }
+    }
+
+    // Heaviest first
+    for (ULONG i = 1; i < merged; i++) {
+        NET_RATE_SOURCE entry = all[i];
+        ULONG j = i;
+        while (j > 0 && all[j - 1].packets < entry.packets) {
+            all[j] = all[j - 1];
+            j--;
+        }
+        all[j] = entry;
+    }
+    if (merged > max_sources) { merged = max_sources; }
+    RtlCopyMemory(sources, all, merged * sizeof(NET_RATE_SOURCE));
+    NETFLT_FREE(all, NET_RATE_TAG);
+    return merged;
+}
+
+VOID ndisRateQueryStat(PNET_RATE_STAT stat) {
+    RtlZeroMemory(stat, sizeof(NET_RATE_STAT));
+    stat->cpus = ndisRateCpuCount;
+
+    // Counters are written only by their own processor, as in the flow cache
+    for (ULONG cpu = 0; cpu < ndisRateCpuCount; cpu++) {
+        stat->packets += ndisRateTables[cpu].packets;
+        stat->admitted += ndisRateTables[cpu].admitted;
+        stat->limited += ndisRateTables[cpu].limited;
+    }
+}
+
+VOID ndisRateClearStat() {
+    for (ULONG cpu = 0; cpu < ndisRateCpuCount; cpu++) {
+        ndisRateTables[cpu].packets = 0;
+        ndisRateTables[cpu].admitted = 0;
+        ndisRateTables[cpu].limited = 0;
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+//
+// Per-processor heavy-hitter detection and per-source rate limiting.
+//
+// Every IP frame is counted against its source address in a count-min
+// sketch: NET_RATE_ROWS rows of NET_RATE_WIDTH counters, one counter per
+// row picked by a hash of the address. A source's count is the smallest of
+// its counters; collisions only ever add to a counter, so the estimate is
+// never below the true count. Only the counters at the minimum are raised
+// (conservative update), which keeps light sources that share a counter
+// with a heavy one close to their own count. Counts are halved every
+// NET_RATE_WINDOW, so they follow recent traffic. The NET_RATE_TOP sources
+// with the highest estimates are kept next to the sketch and reported
+// through IOCTL_FILTER_QUERY_TOP_SOURCES.
+//
+// Frames matching a rule whose action is NET_RULE_ACTION_RATE_LIMIT go
+// through a second sketch of the same shape whose cells are token buckets,
+// kept as theoretical arrival times (GCRA): a source may send rate_limit
+// packets per second in bursts of rate_burst, both from the rule image.
+// A frame conforms when the fullest of its source's buckets still has a
+// token; a conforming frame takes one from each of them that would
+// otherwise run ahead of it. Like the counts, a bucket only drains faster
+// for a collision, so a source over its rate is always held to it, and a
+// scan or flood from a handful of sources is absorbed without a rule per
+// source. Dropped frames take no token.
+//
+// Either update costs NET_RATE_ROWS cache lines, one per row, plus the
+// top list when the source is among the heaviest. Every processor owns its
+// table and only touches it from inside an epoch section (at
+// DISPATCH_LEVEL), like the flow cache; with RSS the frames of one source
+// spread over the processors its flows hash to, so the limit holds per
+// processor. Neither sketch depends on the rules, so both outlive reloads.
+//
+
+#define NET_RATE_TAG            '1taR'
+#define NET_RATE_ROWS           4
+#define NET_RATE_WIDTH          1024        // counters per row, power of two
+#define NET_RATE_TOP            16          // heaviest sources kept per processor
+#define NET_RATE_WINDOW         10000000    // 100 ns units: counts halve every second
+
+// Used when the rule image leaves them 0
+#define NET_RATE_DEFAULT_LIMIT  1000        // packets per second per source
+#define NET_RATE_DEFAULT_BURST  100         // packets
+
+typedef struct _NET_RATE_SOURCE {
+    NET_LPM6_ADDRESS    address;    // IPv4: ::ffff:a.b.c.d
+    ULONG64             packets;    // estimate, decayed
+} NET_RATE_SOURCE, * PNET_RATE_SOURCE;
+
+typedef struct DECLSPEC_CACHEALIGN _NET_RATE_TABLE {
+    ULONG64             packets;    // frames counted
+    ULONG64             admitted;   // rate limited frames within their rate
+    ULONG64             limited;    // rate limited frames dropped
+    ULONG64             window;     // interrupt time the counts were last halved
+    volatile ULONG      top_sequence;   // odd while an entry of top changes hands
+    ULONG               top_count;
+    ULONG64             top_floor;  // smallest estimate in a full top list
+    NET_RATE_SOURCE     top[NET_RATE_TOP];
+    ULONG               counts[NET_RATE_ROWS][NET_RATE_WIDTH];
+    ULONG64             buckets[NET_RATE_ROWS][NET_RATE_WIDTH];
+} NET_RATE_TABLE, * PNET_RATE_TABLE;
+
+typedef struct _NET_RATE_STAT {
+    ULONG64 packets;
+    ULONG64 admitted;
+    ULONG64 limited;
+    ULONG   cpus;
+} NET_RATE_STAT, * PNET_RATE_STAT;
+
+// A failed init leaves counting off and lets every rate limited frame
+// through
+BOOLEAN ndisRateInit();
+VOID ndisRateCleanup();
+
+// The calling processor's table; NULL if counting is off
+PNET_RATE_TABLE ndisRateCurrent();
+
+// Source address of the first length bytes of an Ethernet frame; FALSE
+// when it is not IPv4 or IPv6 or the address is not within length
+BOOLEAN ndisRateSource(const UCHAR* frame, ULONG length, PNET_LPM6_ADDRESS source);
+
+// Counts one frame from source at interrupt time now
+VOID ndisRateCount(PNET_RATE_TABLE table, const NET_LPM6_ADDRESS* source, ULONG64 now);
+
+// TRUE if a frame from source at interrupt time now is within rate_limit
+// packets per second in bursts of rate_burst (0 - the defaults)
+BOOLEAN ndisRateAdmit(PNET_RATE_TABLE table, const NET_LPM6_ADDRESS* source, ULONG64 now,
+    ULONG rate_limit, ULONG rate_burst);
+
+// Merges the top lists of all processors into up to max_sources entries,
+// heaviest first. Returns the number written. PASSIVE_LEVEL.
+ULONG ndisRateQueryTop(PNET_RATE_SOURCE sources, ULONG max_sources);
+
+VOID ndisRateQueryStat(PNET_RATE_STAT stat);
+VOID ndisRateClearStat();
@@ -0,0 +1,421 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+#include "reputation.h"
+
+#define NET_REPUTATION_MAX_SIZE (256u << 20)
+#define REP_SEEDS           16      // seeds tried per filter size
+#define REP_ROUNDS          8       // filter sizes tried, an eighth larger each
+
+static ULONG repAlign(ULONG offset) {
+    return (offset + 7) & ~(ULONG)7;
+}
+
+static UINT64 repLoad64(const UCHAR* bytes) {
+    UINT64 value = 0;
+    for (ULONG i = 0; i < 8; i++) { value = (value << 8) | bytes[i]; }
+    return value;
+}
+
+static FORCEINLINE UINT64 repHash(UINT64 hi, UINT64 lo, UINT64 seed) {
+    UINT64 h = ((lo ^ seed) * 0x9E3779B97F4A7C15ULL) ^ hi;
+    h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDULL;
+    h = (h ^ (h >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 33);
+}
+
+static FORCEINLINE UINT64 repHash4(UINT32 address, UINT64 seed) {
+    return repHash(0, 0x0000FFFF00000000ULL | address, seed);
+}
+
+static FORCEINLINE UCHAR repFingerprint(UINT64 hash) {
+    return (UCHAR)(hash ^ (hash >> 32));
+}
+
+// The three slots of hash, one per segment. The high half of hash times
+// value (below 2^32) picks the first segment without a 128-bit multiply.
+static FORCEINLINE VOID repSlots(ULONG segment_length, ULONG segment_count_length, UINT64 hash, PULONG slots) {
+    ULONG mask = segment_length - 1;
+    ULONG h0 = (ULONG)((((hash >> 32) * segment_count_length) + (((hash & 0xFFFFFFFF) * segment_count_length) >> 32)) >> 32);
+    slots[0] = h0;
+    slots[1] = (h0 + segment_length) ^ ((ULONG)(hash >> 18) & mask);
+    slots[2] = (h0 + 2 * segment_length) ^ ((ULONG)hash & mask);
+}
+
+static FORCEINLINE BOOLEAN repFiltered(const NET_REPUTATION* reputation, UINT64 hash) {
+    const UCHAR* fingerprints = (const UCHAR*)reputation + reputation->fingerprint_offset;
+    ULONG slots[3];
+    repSlots(reputation->segment_length, reputation->segment_count_length, hash, slots);
+    return (BOOLEAN)((fingerprints[slots[0]] ^ fingerprints[slots[1]] ^ fingerprints[slots[2]]) == repFingerprint(hash));
+}
+
+VOID ndisFreeReputation(PNET_REPUTATION reputation) {
+    if (reputation != NULL) { NETFLT_FREE(reputation, NET_REPUTATION_TAG); }
+}
+
+//
+// Builder
+//
+
+typedef struct _NET_REPUTATION_BUILD {
+    UINT64* hashes;                 // per address
+    UINT64* peeled;                 // hashes in peeling order
+    PUCHAR  peeled_slot;            // which of its slots each was peeled from
+    PUCHAR  counts;                 // per slot: addresses << 2, XOR of their slot numbers
+    UINT64* xors;                   // per slot: XOR of their hashes
+    PULONG  queue;                  // slots holding one address
+    PUCHAR  fingerprints;
+} NET_REPUTATION_BUILD, * PNET_REPUTATION_BUILD;
+
+static VOID repFreeBuild(PNET_REPUTATION_BUILD build) {
+    if (build->hashes != NULL) { NETFLT_FREE(build->hashes, NET_REPUTATION_TAG); }
+    if (build->peeled != NULL) { NETFLT_FREE(build->peeled, NET_REPUTATION_TAG); }
+    if (build->peeled_slot != NULL) { NETFLT_FREE(build->peeled_slot, NET_REPUTATION_TAG); }
+    if (build->counts != NULL) { NETFLT_FREE(build->counts, NET_REPUTATION_TAG); }
+    if (build->xors != NULL) { NETFLT_FREE(build->xors, NET_REPUTATION_TAG); }
+    if (build->queue != NULL) { NETFLT_FREE(build->queue, NET_REPUTATION_TAG); }
+    if (build->fingerprints != NULL) { NETFLT_FREE(build->fingerprints, NET_REPUTATION_TAG); }
+}
+
+// Binary fuse filter shape for count addresses (Graf and Lemire): segments
+// of 2^floor(log3.33(count) + 2.25) slots, and 1.125 slots per address
+// from a million addresses up, more below. Every round adds an eighth.
+// Integer only, as the kernel build has no floating point to spare.
+static VOID repShape(ULONG count, ULONG round, PULONG segment_length, PULONG segment_count) {
+    UINT64 power = 10000, target = (UINT64)count * 13509;   // 3.33^0.25 = 1.3509
+    ULONG exponent = 0;
+    while (power * 333 / 100 <= target) {
+        power = power * 333 / 100;
+        exponent++;
+    }
+    *segment_length = (exponent + 2 < 18) ? 1u << (exponent + 2) : NET_REPUTATION_MAX_SEGMENT;
+
+    // log2(count) in sixteenths: 0.875 + 0.25 * log(10^6) / log(count)
+    ULONG log16 = 16;
+    if (count >= 2) {
+        ULONG bits = 0;
+        while ((count >> (bits + 1)) != 0) { bits++; }
+        log16 = 16 * bits + (ULONG)((((UINT64)count << 4) >> bits) & 15);
+    }
+    ULONG factor = 896 + 256 * 319 / log16;                 // per 1024
+    if (factor < 1152) { factor = 1152; }
+    UINT64 capacity = (UINT64)count * factor / 1024 + (UINT64)round * (count / 8 + *segment_length);
+
+    ULONG segments = (ULONG)((capacity + *segment_length - 1) / *segment_length);
+    *segment_count = (segments <= 2) ? 1 : segments - 2;
+}
+
+// Peels the addresses off the slots one at a time, each from a slot it has
+// to itself, then fills the fingerprints in the reverse order so that every
+// address finds its own. FALSE when some are left: another seed is needed.
+static BOOLEAN repPeel(PNET_REPUTATION_BUILD build, ULONG count, ULONG segment_length, ULONG segment_count_length, ULONG slot_count) {
+    ULONG queued = 0, peeled = 0;
+    ULONG slots[3];
+
+    RtlZeroMemory(build->counts, slot_count);
+    RtlZeroMemory(build->xors, (SIZE_T)slot_count * sizeof(UINT64));
+    for (ULONG i = 0; i < count; i++) {
+        repSlots(segment_length, segment_count_length, build->hashes[i], slots);
+        for (ULONG j = 0; j < 3; j++) {
+            if (build->counts[slots[j]] >= 0xFC) { return FALSE; }
+            build->counts[slots[j]] = (UCHAR)((build->counts[slots[j]] + 4) ^ j);
+            build->xors[slots[j]] ^= build->hashes[i];
+        }
+    }
+    for (ULONG slot = 0; slot < slot_count; slot++) {
+        if ((build->counts[slot] >> 2) == 1) { build->queue[queued++] = slot; }
+    }
+
+    while (queued != 0) {
+        ULONG slot = build->queue[--queued];
+        if ((build->counts[slot] >> 2) != 1) { continue; }
+        UINT64 hash = build->xors[slot];
+        ULONG found = build->counts[slot] & 3;
+        build->peeled[peeled] = hash;
+        build->peeled_slot[peeled] = (UCHAR)found;
+        peeled++;
+
+        repSlots(segment_length, segment_count_length, hash, slots);
+        for (ULONG j = 0; j < 3; j++) {
+            if (j == found) { continue; }
+            build->counts[slots[j]] = (UCHAR)((build->counts[slots[j]] - 4) ^ j);
+            build->xors[slots[j]] ^= hash;
+            if ((build->counts[slots[j]] >> 2) == 1) { build->queue[queued++] = slots[j]; }
+        }
+        build->counts[slot] = 0;
+    }
+    if (peeled != count) { return FALSE; }
+
+    RtlZeroMemory(build->fingerprints, slot_count);
+    for (ULONG i = peeled; i-- > 0; ) {
+        UINT64 hash = build->peeled[i];
+        repSlots(segment_length, segment_count_length, hash, slots);
+        ULONG own = slots[build->peeled_slot[i]];
+        build->fingerprints[own] = 0;
+        build->fingerprints[own] = (UCHAR)(repFingerprint(hash) ^ build->fingerprints[slots[0]] ^
+            build->fingerprints[slots[1]] ^ build->fingerprints[slots[2]]);
+    }
+    return TRUE;
+}
+
+// Distinct IPv4 addresses, sorted, back into addresses4
+static ULONG repUnique4(UINT32* addresses4, ULONG count4) {
+    ULONG distinct = 0;
+    if (count4 == 0) { return 0; }
+    UINT64* sorted = (UINT64*)NETFLT_ALLOC((SIZE_T)count4 * sizeof(UINT64), NET_REPUTATION_TAG);
+    if (sorted == NULL) { return ~0u; }
+    for (ULONG i = 0; i < count4; i++) { sorted[i] = addresses4[i]; }
+    ndisSortUint64(sorted, count4);
+    for (ULONG i = 0; i < count4; i++) {
+        if (distinct == 0 || (UINT32)sorted[i] != addresses4[distinct - 1]) { addresses4[distinct++] = (UINT32)sorted[i]; }
+    }
+    NETFLT_FREE(sorted, NET_REPUTATION_TAG);
+    return distinct;
+}
+
+// Indexes of the distinct IPv6 addresses, found among those sharing the
+// top 32 bits of their hash
+static PULONG repUnique6(const NET_LPM6_ADDRESS* addresses6, ULONG count6, PULONG distinct) {
+    *distinct = 0;
+    PULONG unique = (PULONG)NETFLT_ALLOC(((SIZE_T)count6 + 1) * sizeof(ULONG), NET_REPUTATION_TAG);
+    UINT64* keys = (UINT64*)NETFLT_ALLOC(((SIZE_T)count6 + 1) * sizeof(UINT64), NET_REPUTATION_TAG);
+    if (unique == NULL || keys == NULL) {
+        if (unique != NULL) { NETFLT_FREE(unique, NET_REPUTATION_TAG); }
+        if (keys != NULL) { NETFLT_FREE(keys, NET_REPUTATION_TAG); }
+        return NULL;
+    }
+    for (ULONG i = 0; i < count6; i++) {
+        keys[i] = (repHash(addresses6[i].hi, addresses6[i].lo, 0) & 0xFFFFFFFF00000000ULL) | i;
+    }
+    ndisSortUint64(keys, count6);
+    for (ULONG i = 0, group = 0; i < count6; i++) {
+        if ((keys[i] >> 32) != (keys[group] >> 32)) { group = i; }
+        const NET_LPM6_ADDRESS* address = &addresses6[(ULONG)keys[i]];
+        ULONG j;
+        for (j = group; j < i; j++) {
+            const NET_LPM6_ADDRESS* other = &addresses6[(ULONG)keys[j]];
+            if (other->hi == address->hi && other->lo == address->lo) { break; }
+        }
+        if (j == i) { unique[(*distinct)++] = (ULONG)keys[i]; }
+    }
+    NETFLT_FREE(keys, NET_REPUTATION_TAG);
+    return unique;
+}
+
+PNET_REPUTATION ndisBuildReputation(UINT32* addresses4, ULONG count4, const NET_LPM6_ADDRESS* addresses6, ULONG count6) {
+    NET_REPUTATION_BUILD build;
+    PNET_REPUTATION reputation = NULL;
+    PULONG unique6 = NULL;
+    ULONG segment_length = 0, segment_count = 0;
+    UINT64 seed = 0x5EED0F8EB7A710A5ULL;
+    BOOLEAN built = FALSE;
+
+    RtlZeroMemory(&build, sizeof(build));
+    if (count4 > NET_REPUTATION_MAX || count6 > NET_REPUTATION_MAX) { return NULL; }
+    count4 = repUnique4(addresses4, count4);
+    if (count4 == ~0u) { return NULL; }
+    if (count6 != 0 && (unique6 = repUnique6(addresses6, count6, &count6)) == NULL) { return NULL; }
+    ULONG count = count4 + count6;
+
+    build.hashes = (UINT64*)NETFLT_ALLOC(((SIZE_T)count + 1) * sizeof(UINT64), NET_REPUTATION_TAG);
+    build.peeled = (UINT64*)NETFLT_ALLOC(((SIZE_T)count + 1) * sizeof(UINT64), NET_REPUTATION_TAG);
+    build.peeled_slot = (PUCHAR)NETFLT_ALLOC((SIZE_T)count + 1, NET_REPUTATION_TAG);
+    if (build.hashes == NULL || build.peeled == NULL || build.peeled_slot == NULL) { goto done; }
+
+    for (ULONG round = 0; round < REP_ROUNDS && !built; round++) {
+        repShape(count, round, &segment_length, &segment_count);
+        ULONG slot_count = (segment_count + 2) * segment_length;
+
+        if (build.counts != NULL) { NETFLT_FREE(build.counts, NET_REPUTATION_TAG); }
+        if (build.xors != NULL) { NETFLT_FREE(build.xors, NET_REPUTATION_TAG); }
+        if (build.queue != NULL) { NETFLT_FREE(build.queue, NET_REPUTATION_TAG); }
+        if (build.fingerprints != NULL) { NETFLT_FREE(build.fingerprints, NET_REPUTATION_TAG); }
+        build.counts = (PUCHAR)NETFLT_ALLOC(slot_count, NET_REPUTATION_TAG);
+        build.xors = (UINT64*)NETFLT_ALLOC((SIZE_T)slot_count * sizeof(UINT64), NET_REPUTATION_TAG);
+        build.queue = (PULONG)NETFLT_ALLOC((SIZE_T)slot_count * sizeof(ULONG), NET_REPUTATION_TAG);
+        build.fingerprints = (PUCHAR)NETFLT_ALLOC(slot_count, NET_REPUTATION_TAG);
+        if (build.counts == NULL || build.xors == NULL || build.queue == NULL || build.fingerprints == NULL) { goto done; }
+
+        for (ULONG attempt = 0; attempt < REP_SEEDS && !built; attempt++) {
+            seed = repHash(seed, round, attempt);
+            for (ULONG i = 0; i < count4; i++) { build.hashes[i] = repHash4(addresses4[i], seed); }
+            for (ULONG i = 0; i < count6; i++) {
+                const NET_LPM6_ADDRESS* address = &addresses6[unique6[i]];
+                build.hashes[count4 + i] = repHash(address->hi, address->lo, seed);
+            }
+            built = repPeel(&build, count, segment_length, segment_count * segment_length, slot_count);
+        }
+    }
+    if (!built) { goto done; }
+
+    // About two IPv6 addresses to a bucket
+    ULONG bucket_bits6 = 0;
+    while (bucket_bits6 < 24 && (2u << bucket_bits6) < count6) { bucket_bits6++; }
+    ULONG slot_count = (segment_count + 2) * segment_length;
+    ULONG fingerprint_offset = sizeof(NET_REPUTATION);
+    ULONG root4_offset = (count4 != 0) ? repAlign(fingerprint_offset + slot_count) : 0;
+    ULONG low4_offset = (count4 != 0) ? root4_offset + (NET_REPUTATION_ROOT + 1) * sizeof(ULONG) : 0;
+    ULONG end = (count4 != 0) ? low4_offset + count4 * sizeof(USHORT) : fingerprint_offset + slot_count;
+    ULONG root6_offset = (count6 != 0) ? repAlign(end) : 0;
+    ULONG address6_offset = (count6 != 0) ? repAlign(root6_offset + ((1u << bucket_bits6) + 1) * sizeof(ULONG)) : 0;
+    UINT64 size = (count6 != 0) ? address6_offset + (UINT64)count6 * sizeof(NET_LPM6_ADDRESS) : end;
+    if (size > NET_REPUTATION_MAX_SIZE) { goto done; }
+
+    reputation = (PNET_REPUTATION)NETFLT_ALLOC((SIZE_T)size, NET_REPUTATION_TAG);
+    if (reputation == NULL) { goto done; }
+    RtlZeroMemory(reputation, (SIZE_T)size);
+    reputation->size = (ULONG)size;
+    reputation->count4 = count4;
+    reputation->count6 = count6;
+    reputation->bucket_bits6 = bucket_bits6;
+    reputation->seed = seed;
+    reputation->segment_length = segment_length;
+    reputation->segment_count_length = segment_count * segment_length;
+    reputation->fingerprint_count = slot_count;
+    reputation->fingerprint_offset = fingerprint_offset;
+    reputation->root4_offset = root4_offset;
+    reputation->low4_offset = low4_offset;
+    reputation->root6_offset = root6_offset;
+    reputation->address6_offset = address6_offset;
+    RtlCopyMemory((PUCHAR)reputation + fingerprint_offset, build.fingerprints, slot_count);
+
+    if (count4 != 0) {
+        // addresses4 is sorted: the root is where each /16 starts
+        PULONG root = (PULONG)((PUCHAR)reputation + root4_offset);
+        PUSHORT low = (PUSHORT)((PUCHAR)reputation + low4_offset);
+        ULONG next = 0;
+        for (ULONG bucket = 0; bucket <= NET_REPUTATION_ROOT; bucket++) {
+            while (next < count4 && (addresses4[next] >> 16) < bucket) { next++; }
+            root[bucket] = next;
+        }
+        for (ULONG i = 0; i < count4; i++) { low[i] = (USHORT)addresses4[i]; }
+    }
+    if (count6 != 0) {
+        // Counted, then placed: root[b + 1] ends up as the end of bucket b
+        PULONG root = (PULONG)((PUCHAR)reputation + root6_offset);
+        PNET_LPM6_ADDRESS stored = (PNET_LPM6_ADDRESS)((PUCHAR)reputation + address6_offset);
+        ULONG shift = 64 - bucket_bits6;
+        for (ULONG i = 0; i < count6; i++) {
+            UINT64 hash = build.hashes[count4 + i];
+            root[(bucket_bits6 != 0) ? (ULONG)(hash >> shift) + 1 : 1]++;
+        }
+        for (ULONG bucket = 1; bucket <= (1u << bucket_bits6); bucket++) { root[bucket] += root[bucket - 1]; }
+        for (ULONG i = 0; i < count6; i++) {
+            UINT64 hash = build.hashes[count4 + i];
+            ULONG bucket = (bucket_bits6 != 0) ? (ULONG)(hash >> shift) : 0;
+            stored[root[bucket]++] = addresses6[unique6[i]];
+        }
+        for (ULONG bucket = 1u << bucket_bits6; bucket > 0; bucket--) { root[bucket] = root[bucket - 1]; }
+        root[0] = 0;
+    }
+
+done:
+    repFreeBuild(&build);
+    if (unique6 != NULL) { NETFLT_FREE(unique6, NET_REPUTATION_TAG); }
+    return reputation;
+}
+
+static BOOLEAN repValidateRoot(const NET_REPUTATION* reputation, ULONG offset, ULONG buckets, ULONG count) {
+    if ((offset & 3) != 0 || offset < sizeof(NET_REPUTATION) || offset + ((UINT64)buckets + 1) * sizeof(ULONG) > reputation->size) {
+        return FALSE;
+    }
+    const ULONG* root = (const ULONG*)((const UCHAR*)reputation + offset);
+    if (root[0] != 0 || root[buckets] != count) { return FALSE; }
+    for (ULONG bucket = 0; bucket < buckets; bucket++) {
+        if (root[bucket] > root[bucket + 1]) { return FALSE; }
+    }
+    return TRUE;
+}
+
+BOOLEAN ndisValidateReputation(const NET_REPUTATION* reputation, ULONG size) {
+    if (size < sizeof(NET_REPUTATION) || reputation->size != size || size > NET_REPUTATION_MAX_SIZE) { return FALSE; }
+    ULONG segment_length = reputation->segment_length;
+    if (segment_length == 0 || (segment_length & (segment_length - 1)) != 0 || segment_length > NET_REPUTATION_MAX_SEGMENT ||
+        reputation->segment_count_length == 0 || (reputation->segment_count_length & (segment_length - 1)) != 0 ||
+        reputation->fingerprint_count != (UINT64)reputation->segment_count_length + 2 * segment_length) {
+        return FALSE;
+    }
+    if (reputation->fingerprint_offset < sizeof(NET_REPUTATION) ||
+        (UINT64)reputation->fingerprint_offset + reputation->fingerprint_count > size) {
+        return FALSE;
+    }
+    if (reputation->count4 > NET_REPUTATION_MAX || reputation->count6 > NET_REPUTATION_MAX || reputation->bucket_bits6 > 24) {
+        return FALSE;
+    }
+
+    if (reputation->count4 != 0 || reputation->root4_offset != 0) {
+        if (!repValidateRoot(reputation, reputation->root4_offset, NET_REPUTATION_ROOT, reputation->count4) ||
+            (reputation->low4_offset & 1) != 0 || reputation->low4_offset < sizeof(NET_REPUTATION) ||
+            reputation->low4_offset + (UINT64)reputation->count4 * sizeof(USHORT) > size) {
+            return FALSE;
+        }
+    }
+    if (reputation->count6 != 0 || reputation->root6_offset != 0) {
+        if (!repValidateRoot(reputation, reputation->root6_offset, 1u << reputation->bucket_bits6, reputation->count6) ||
+            (reputation->address6_offset & 7) != 0 || reputation->address6_offset < sizeof(NET_REPUTATION) ||
+            reputation->address6_offset + (UINT64)reputation->count6 * sizeof(NET_LPM6_ADDRESS) > size) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+//
+// Lookup
+//
+
+BOOLEAN ndisReputationContains4(const NET_REPUTATION* reputation, UINT32 address) {
+    if (reputation->root4_offset == 0 || !repFiltered(reputation, repHash4(address, reputation->seed))) { return FALSE; }
+
+    const ULONG* root = (const ULONG*)((const UCHAR*)reputation + reputation->root4_offset);
+    const USHORT* low = (const USHORT*)((const UCHAR*)reputation + reputation->low4_offset);
+    ULONG first = root[address >> 16], last = root[(address >> 16) + 1];
+    USHORT target = (USHORT)address;
+    while (first < last) {
+        ULONG middle = first + (last - first) / 2;
+        if (low[middle] < target) { first = middle + 1; } else { last = middle; }
+    }
+    return (BOOLEAN)(first < root[(address >> 16) + 1] && low[first] == target);
+}
+
+BOOLEAN ndisReputationContains6(const NET_REPUTATION* reputation, const NET_LPM6_ADDRESS* address) {
+    if (reputation->root6_offset == 0) { return FALSE; }
+    UINT64 hash = repHash(address->hi, address->lo, reputation->seed);
+    if (!repFiltered(reputation, hash)) { return FALSE; }
+
+    const ULONG* root = (const ULONG*)((const UCHAR*)reputation + reputation->root6_offset);
+    const NET_LPM6_ADDRESS* stored = (const NET_LPM6_ADDRESS*)((const UCHAR*)reputation + reputation->address6_offset);
+    ULONG bucket = (reputation->bucket_bits6 != 0) ? (ULONG)(hash >> (64 - reputation->bucket_bits6)) : 0;
+    for (ULONG i = root[bucket]; i < root[bucket + 1]; i++) {
+        if (stored[i].hi == address->hi && stored[i].lo == address->lo) { return TRUE; }
+    }
+    return FALSE;
+}
+
+ULONG ndisReputationFrame(const NET_REPUTATION* reputation, const UCHAR* frame, ULONG length) {
+    UINT16 ether_type;
+    ULONG ip = ndisFrameNetworkOffset(frame, length, &ether_type);
+
+    if (ether_type == 0x0800 && ip + 20 <= length) {
+        const UCHAR* source = frame + ip + 12;
+        const UCHAR* destination = frame + ip + 16;
+        if (ndisReputationContains4(reputation,
+            ((UINT32)source[0] << 24) | ((UINT32)source[1] << 16) | ((UINT32)source[2] << 8) | source[3])) {
+            return NET_REPUTATION_SOURCE;
+        }
+        if (ndisReputationContains4(reputation,
+            ((UINT32)destination[0] << 24) | ((UINT32)destination[1] << 16) | ((UINT32)destination[2] << 8) | destination[3])) {
+            return NET_REPUTATION_DESTINATION;
+        }
+    } else if (ether_type == 0x86DD && ip + 40 <= length) {
+        NET_LPM6_ADDRESS source = { repLoad64(frame + ip + 8), repLoad64(frame + ip + 16) };
+        NET_LPM6_ADDRESS destination = { repLoad64(frame + ip + 24), repLoad64(frame + ip + 32) };
+        if (ndisReputationContains6(reputation, &source)) { return NET_REPUTATION_SOURCE; }
+        if (ndisReputationContains6(reputation, &destination)) { return NET_REPUTATION_DESTINATION; }
+    }
+    return NET_CLS_NO_MATCH;
+}
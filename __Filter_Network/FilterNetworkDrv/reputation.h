@@ -0,0 +1,68 @@
+#pragma once
+//
+// IP reputation set: millions of blocklisted IPv4 and IPv6 addresses from
+// threat-intel feeds, checked against the source and the destination of
+// every IP frame before the rules.
+//
+// Rules cost far too much per entry for this, so the set is a separate,
+// immutable structure built offline (..\FilterNetworkCompiler, -r) and
+// shipped inside the rule image. A lookup hashes the address once (IPv4 as
+// ::ffff:a.b.c.d) and runs it through a binary fuse filter: an array of
+// 8-bit fingerprints in which every address owns three slots, one in each
+// of three consecutive segments, whose XOR is its fingerprint. Three
+// independent loads close to each other reject nearly every address that
+// is not in the set; 1 in 256 gets through. Those, and the addresses that
+// are in the set, are confirmed exactly:
+//
+//  - IPv4 addresses are bucketed by their top 16 bits: a root of 65537
+//    offsets and the low 16 bits of each address, sorted within its bucket
+//    and binary searched;
+//  - IPv6 addresses are bucketed by the top bits of the same hash, about
+//    two to a bucket, and stored whole.
+//
+// That is about 1.13 bytes of filter per address plus 2 bytes per IPv4
+// address (and 256 KiB of root) or 18 bytes per IPv6 address, against the
+// 100 or so of a rule. The blob holds no pointers; ndisValidateReputation
+// checks every offset and bucket of one read from an image.
+//
+
+#define NET_REPUTATION_TAG          '1peR'
+#define NET_REPUTATION_MAX          (1u << 24)      // addresses per family
+#define NET_REPUTATION_ROOT         (1u << 16)      // IPv4 buckets
+#define NET_REPUTATION_MAX_SEGMENT  (1u << 18)
+
+// Returned by ndisReputationFrame
+#define NET_REPUTATION_SOURCE       0
+#define NET_REPUTATION_DESTINATION  1
+
+typedef struct _NET_REPUTATION {
+    ULONG   size;                   // bytes, everything below included
+    ULONG   count4;                 // IPv4 addresses
+    ULONG   count6;                 // IPv6 addresses
+    ULONG   bucket_bits6;           // log2 of the IPv6 bucket count
+    UINT64  seed;                   // of the address hash
+    ULONG   segment_length;         // fingerprints per segment, power of two
+    ULONG   segment_count_length;   // segment_length * (segments - 2)
+    ULONG   fingerprint_count;      // segment_length * segments
+    ULONG   fingerprint_offset;     // UCHAR[fingerprint_count]
+    ULONG   root4_offset;           // ULONG[NET_REPUTATION_ROOT + 1], 0 - no IPv4
+    ULONG   low4_offset;            // USHORT[count4]
+    ULONG   root6_offset;           // ULONG[(1 << bucket_bits6) + 1], 0 - no IPv6
+    ULONG   address6_offset;        // NET_LPM6_ADDRESS[count6], 8-byte aligned
+} NET_REPUTATION, * PNET_REPUTATION;
+
+// Builds the set of count4 IPv4 addresses (host byte order) and count6
+// IPv6 ones; duplicates are dropped. Sorts addresses4 in place. The result
+// is one NETFLT_ALLOC block; NULL when out of memory or over the limits
+// above.
+PNET_REPUTATION ndisBuildReputation(UINT32* addresses4, ULONG count4, const NET_LPM6_ADDRESS* addresses6, ULONG count6);
+VOID ndisFreeReputation(PNET_REPUTATION reputation);
+BOOLEAN ndisValidateReputation(const NET_REPUTATION* reputation, ULONG size);
+
+BOOLEAN ndisReputationContains4(const NET_REPUTATION* reputation, UINT32 address);
+BOOLEAN ndisReputationContains6(const NET_REPUTATION* reputation, const NET_LPM6_ADDRESS* address);
+
+// Checks the source, then the destination of the first length bytes of an
+// Ethernet frame. Returns NET_REPUTATION_SOURCE or _DESTINATION for the
+// address found in the set, or NET_CLS_NO_MATCH.
+ULONG ndisReputationFrame(const NET_REPUTATION* reputation, const UCHAR* frame, ULONG length);
@@ -0,0 +1,175 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "content.h"
+#include "reputation.h"
+#include "dns.h"
+#include "vm.h"
+#include "ruleimage.h"
+
+#define IMG_CHECKSUM_START      FIELD_OFFSET(NET_RULE_IMAGE, rule_count)
+
+static ULONG imgAlign(ULONG offset) {
+    return (offset + NET_RULE_IMAGE_ALIGN - 1) & ~(ULONG)(NET_RULE_IMAGE_ALIGN - 1);
+}
+
+ULONG ndisRuleImageChecksum(const UCHAR* data, ULONG length) {
+    // CRC-32 (IEEE 802.3, reflected). The table is rebuilt on the stack for
+    // every call: 1 KiB of stack and 2K shifts against images of megabytes.
+    ULONG table[256];
+    for (ULONG i = 0; i < 256; i++) {
+        ULONG c = i;
+        for (ULONG k = 0; k < 8; k++) { c = (c >> 1) ^ ((c & 1) ? 0xEDB88320 : 0); }
+        table[i] = c;
+    }
+
+    ULONG crc = 0xFFFFFFFF;
+    for (ULONG i = 0; i < length; i++) { crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xFF]; }
+    return ~crc;
+}
+
+ULONG ndisRuleImageSize(ULONG rule_count, const NET_CLASSIFIER* cls, const NET_CONTENT* content, const NET_REPUTATION* reputation,
+    const NET_DOMAINS* domains, const NET_VM_PROGRAMS* programs) {
+    UINT64 size = sizeof(NET_RULE_IMAGE) + (UINT64)rule_count * NET_RULE_RECORD_SIZE;
+    if (size > NET_RULE_IMAGE_MAX_SIZE) { return 0; }
+    if (cls != NULL) { size = imgAlign((ULONG)size) + (UINT64)cls->size; }
+    if (size > NET_RULE_IMAGE_MAX_SIZE) { return 0; }
+    if (content != NULL) { size = imgAlign((ULONG)size) + (UINT64)content->size; }
+    if (size > NET_RULE_IMAGE_MAX_SIZE) { return 0; }
+    if (reputation != NULL) { size = imgAlign((ULONG)size) + (UINT64)reputation->size; }
+    if (size > NET_RULE_IMAGE_MAX_SIZE) { return 0; }
+    if (domains != NULL) { size = imgAlign((ULONG)size) + (UINT64)domains->size; }
+    if (size > NET_RULE_IMAGE_MAX_SIZE) { return 0; }
+    if (programs != NULL) { size = imgAlign((ULONG)size) + (UINT64)programs->size; }
+    return (size > NET_RULE_IMAGE_MAX_SIZE) ? 0 : (ULONG)size;
+}
+
+VOID ndisRuleImageWrite(PNET_RULE_IMAGE image, ULONG size, const NET_RULES* rules, const NET_CLASSIFIER* cls, const NET_CONTENT* content,
+    const NET_REPUTATION* reputation, const NET_DOMAINS* domains, const NET_VM_PROGRAMS* programs, ULONG rate_limit, ULONG rate_burst,
+    ULONG defer) {
+    RtlZeroMemory(image, size);
+    image->magic = NET_RULE_IMAGE_MAGIC;
+    image->version = NET_RULE_IMAGE_VERSION;
+    image->header_size = sizeof(NET_RULE_IMAGE);
+    image->size = size;
+    image->record_size = NET_RULE_RECORD_SIZE;
+    image->rules_offset = sizeof(NET_RULE_IMAGE);
+    image->rate_limit = rate_limit;
+    image->rate_burst = rate_burst;
+    image->defer = defer;
+
+    PUCHAR record = (PUCHAR)image + image->rules_offset;
+    for (const NET_RULES* rule_ptr = rules; rule_ptr != NULL; rule_ptr = rule_ptr->_next) {
+        RtlCopyMemory(record, rule_ptr, NET_RULE_RECORD_SIZE);
+        record += NET_RULE_RECORD_SIZE;
+        image->rule_count++;
+    }
+
+    if (cls != NULL) {
+        image->classifier_offset = imgAlign((ULONG)(record - (PUCHAR)image));
+        image->classifier_size = cls->size;
+        RtlCopyMemory((PUCHAR)image + image->classifier_offset, cls, cls->size);
+        record = (PUCHAR)image + image->classifier_offset + cls->size;
+    }
+    if (content != NULL) {
+        image->content_offset = imgAlign((ULONG)(record - (PUCHAR)image));
+        RtlCopyMemory((PUCHAR)image + image->content_offset, content, content->size);
+        record = (PUCHAR)image + image->content_offset + content->size;
+    }
+    if (reputation != NULL) {
+        image->reputation_offset = imgAlign((ULONG)(record - (PUCHAR)image));
+        RtlCopyMemory((PUCHAR)image + image->reputation_offset, reputation, reputation->size);
+        record = (PUCHAR)image + image->reputation_offset + reputation->size;
+    }
+    if (domains != NULL) {
+        image->domains_offset = imgAlign((ULONG)(record - (PUCHAR)image));
+        RtlCopyMemory((PUCHAR)image + image->domains_offset, domains, domains->size);
+        record = (PUCHAR)image + image->domains_offset + domains->size;
+    }
+    if (programs != NULL) {
+        image->programs_offset = imgAlign((ULONG)(record - (PUCHAR)image));
+        RtlCopyMemory((PUCHAR)image + image->programs_offset, programs, programs->size);
+    }
+    image->checksum = ndisRuleImageChecksum((const UCHAR*)image + IMG_CHECKSUM_START, size - IMG_CHECKSUM_START);
+}
+
+BOOLEAN ndisRuleImageValidate(const NET_RULE_IMAGE* image, ULONG size) {
+    // Header first: nothing past it is trusted before the checksum matches
+    if (((ULONG_PTR)image & (NET_RULE_IMAGE_ALIGN - 1)) != 0 || size < sizeof(NET_RULE_IMAGE) ||
+        size > NET_RULE_IMAGE_MAX_SIZE) {
+        return FALSE;
+    }
+    if (image->magic != NET_RULE_IMAGE_MAGIC || image->version != NET_RULE_IMAGE_VERSION ||
+        image->header_size != sizeof(NET_RULE_IMAGE) || image->size != size) {
+        return FALSE;
+    }
+    if (image->checksum != ndisRuleImageChecksum((const UCHAR*)image + IMG_CHECKSUM_START, size - IMG_CHECKSUM_START)) {
+        return FALSE;
+    }
+
+    if ((image->defer & ~(NET_RULE_DEFER_DEPTH | NET_RULE_DEFER_CLOSED)) != 0) {
+        return FALSE;
+    }
+    if (image->record_size != NET_RULE_RECORD_SIZE || image->rules_offset < sizeof(NET_RULE_IMAGE) ||
+        image->rules_offset + (UINT64)image->rule_count * NET_RULE_RECORD_SIZE > size) {
+        return FALSE;
+    }
+    if (image->content_offset != 0) {
+        if (image->content_offset < sizeof(NET_RULE_IMAGE) ||
+            (image->content_offset & (NET_RULE_IMAGE_ALIGN - 1)) != 0 ||
+            (UINT64)image->content_offset + sizeof(NET_CONTENT) > size) {
+            return FALSE;
+        }
+        const NET_CONTENT* content = ndisRuleImageContent(image);
+        if ((UINT64)image->content_offset + content->size > size || !ndisValidateContent(content, content->size)) {
+            return FALSE;
+        }
+    }
+    if (image->reputation_offset != 0) {
+        if (image->reputation_offset < sizeof(NET_RULE_IMAGE) ||
+            (image->reputation_offset & (NET_RULE_IMAGE_ALIGN - 1)) != 0 ||
+            (UINT64)image->reputation_offset + sizeof(NET_REPUTATION) > size) {
+            return FALSE;
+        }
+        const NET_REPUTATION* reputation = ndisRuleImageReputation(image);
+        if ((UINT64)image->reputation_offset + reputation->size > size || !ndisValidateReputation(reputation, reputation->size)) {
+            return FALSE;
+        }
+    }
+    if (image->domains_offset != 0) {
+        if (image->domains_offset < sizeof(NET_RULE_IMAGE) ||
+            (image->domains_offset & (NET_RULE_IMAGE_ALIGN - 1)) != 0 ||
+            (UINT64)image->domains_offset + sizeof(NET_DOMAINS) > size) {
+            return FALSE;
+        }
+        const NET_DOMAINS* domains = ndisRuleImageDomains(image);
+        if ((UINT64)image->domains_offset + domains->size > size || !ndisValidateDomains(domains, domains->size)) {
+            return FALSE;
+        }
+    }
+    if (image->programs_offset != 0) {
+        if (image->programs_offset < sizeof(NET_RULE_IMAGE) ||
+            (image->programs_offset & (NET_RULE_IMAGE_ALIGN - 1)) != 0 ||
+            (UINT64)image->programs_offset + sizeof(NET_VM_PROGRAMS) > size) {
+            return FALSE;
+        }
+        const NET_VM_PROGRAMS* programs = ndisRuleImageVmPrograms(image);
+        if ((UINT64)image->programs_offset + programs->size > size || !ndisValidateVmPrograms(programs, programs->size)) {
+            return FALSE;
+        }
+    }
+    if (image->rule_count == 0) { return (BOOLEAN)(image->classifier_offset == 0); }
+
+    if (image->classifier_offset < sizeof(NET_RULE_IMAGE) ||
+        (image->classifier_offset & (NET_RULE_IMAGE_ALIGN - 1)) != 0 ||
+        (UINT64)image->classifier_offset + image->classifier_size > size) {
+        return FALSE;
+    }
+    const NET_CLASSIFIER* cls = ndisRuleImageClassifier(image);
+    if (image->classifier_size < FIELD_OFFSET(NET_CLASSIFIER, tuples) || cls->rule_count != image->rule_count) {
+        return FALSE;
+    }
+    return ndisValidateNetClassifier(cls, image->classifier_size);
+}
@@ -0,0 +1,124 @@
+#pragma once
+//
+// Binary rule image: the rule records, the classifier compiled from them,
+// the content automaton (content.h), the IP reputation set (reputation.h),
+// the domain set (dns.h) and the filter programs (vm.h), in one flat
+// little-endian blob.
+//
+// Images are produced offline by ..\FilterNetworkCompiler, which links the
+// same classifier.c and lpm.c as the driver, so loading one costs a copy
+// and a validation pass instead of a compile. The classifier tables are
+// stored exactly as ndisCompileNetRules lays them out: any change to
+// NET_CLASSIFIER, NET_CLS_*, NET_LPM, NET_LPM6, NET_CONTENT,
+// NET_REPUTATION, NET_DOMAINS or NET_VM_* has to bump
+// NET_RULE_IMAGE_VERSION, and the C_ASSERTs below catch the layouts
+// drifting between compilers.
+//
+//      NET_RULE_IMAGE      header
+//      records             rule_count * NET_RULE_RECORD_SIZE, in rule order
+//      NET_CLASSIFIER      at classifier_offset, 8-byte aligned
+//      NET_CONTENT         at content_offset, 8-byte aligned, if any
+//      NET_REPUTATION      at reputation_offset, 8-byte aligned, if any
+//      NET_DOMAINS         at domains_offset, 8-byte aligned, if any
+//      NET_VM_PROGRAMS     at programs_offset, 8-byte aligned, if any
+//
+// The header also carries the rate of NET_RULE_ACTION_RATE_LIMIT rules
+// and how deep the queues of deferred payload inspection are (defer.h).
+//
+// The checksum is a CRC-32 of every byte after the checksum field. It
+// catches truncated and damaged files; ndisRuleImageValidate also checks
+// every offset the packet path follows, so a well-formed but hostile image
+// cannot make the classifier read outside it.
+//
+
+#define NET_RULE_IMAGE_MAGIC        0x4952464E      // "NFRI"
+#define NET_RULE_IMAGE_VERSION      8
+#define NET_RULE_IMAGE_ALIGN        8
+#define NET_RULE_IMAGE_MAX_SIZE     (256u << 20)
+
+// NET_RULE_IMAGE.defer
+#define NET_RULE_DEFER_DEPTH        0x00FFFFFF      // NBLs queued per processor, 0 - payloads are inspected inline
+#define NET_RULE_DEFER_CLOSED       0x80000000      // NBLs a full queue has no room for are dropped, else passed
+
+typedef struct _NET_RULE_IMAGE {
+    ULONG   magic;
+    USHORT  version;
+    USHORT  header_size;            // sizeof(NET_RULE_IMAGE)
+    ULONG   size;                   // whole image, header included
+    ULONG   checksum;               // CRC-32 of bytes [FIELD_OFFSET(rule_count), size)
+    ULONG   rule_count;
+    ULONG   record_size;            // NET_RULE_RECORD_SIZE
+    ULONG   rules_offset;
+    ULONG   classifier_offset;      // 0 - no rules
+    ULONG   classifier_size;
+    ULONG   content_offset;         // 0 - no content rules; the size is NET_CONTENT.size
+    ULONG   rate_limit;             // packets per second per source under NET_RULE_ACTION_RATE_LIMIT, 0 - default
+    ULONG   rate_burst;             // packets, 0 - default (ratelimit.h)
+    ULONG   reputation_offset;      // 0 - no reputation set; the size is NET_REPUTATION.size
+    ULONG   domains_offset;         // 0 - no domain set; the size is NET_DOMAINS.size
+    ULONG   programs_offset;        // 0 - no filter programs; the size is NET_VM_PROGRAMS.size
+    ULONG   defer;                  // NET_RULE_DEFER_*, 0 - no deferred inspection
+} NET_RULE_IMAGE, * PNET_RULE_IMAGE;
+
+C_ASSERT(sizeof(NET_RULE_IMAGE) == 64);
+C_ASSERT(sizeof(NET_CLS_KEY) == 16);
+C_ASSERT(sizeof(NET_CLS_SLOT) == 20);
+C_ASSERT(sizeof(NET_CLS_TUPLE) == 20);
+C_ASSERT(sizeof(NET_CLS_PREFIX6) == 8);
+C_ASSERT(sizeof(NET_CLS_CHECK) == 24);
+C_ASSERT(sizeof(NET_CLS_WIDE) == 44);
+C_ASSERT(FIELD_OFFSET(NET_CLASSIFIER, tuples) == 128);
+C_ASSERT(FIELD_OFFSET(NET_LPM, chunks) == 8 + 4 * NET_LPM_ROOT_SIZE);
+C_ASSERT(FIELD_OFFSET(NET_LPM6, chunks) == 16 + 4 * NET_LPM_ROOT_SIZE);
+C_ASSERT(sizeof(NET_LPM6_HOST) == 24);
+C_ASSERT(sizeof(NET_CONTENT_RULE) == 20);
+C_ASSERT(FIELD_OFFSET(NET_CONTENT, classes) == 64);
+C_ASSERT(sizeof(NET_CONTENT) == 64 + 256 + NET_CONTENT_PREFIX * (16 + 16 + 256));
+C_ASSERT(sizeof(NET_REPUTATION) == 56);
+C_ASSERT(sizeof(NET_DOMAINS) == 32);
+C_ASSERT(sizeof(NET_VM_PROGRAMS) == 24);
+C_ASSERT(sizeof(NET_VM_PROGRAM) == 16);
+C_ASSERT(sizeof(NET_VM_INSN) == 8);
+
+ULONG ndisRuleImageChecksum(const UCHAR* data, ULONG length);
+
+// Bytes needed for an image of rule_count rules compiled to cls (NULL when
+// there are no rules), content rules compiled to content, a reputation set,
+// a domain set and filter programs (each NULL when there are none), 0 -
+// over NET_RULE_IMAGE_MAX_SIZE
+ULONG ndisRuleImageSize(ULONG rule_count, const NET_CLASSIFIER* cls, const NET_CONTENT* content, const NET_REPUTATION* reputation,
+    const NET_DOMAINS* domains, const NET_VM_PROGRAMS* programs);
+// Fills size bytes at image (NET_RULE_IMAGE_ALIGN aligned) from the rule
+// list, its classifier, the content automaton, the reputation set, the
+// domain set, the filter programs, the rate of rate limited sources and
+// the deferral settings and seals it with the checksum
+VOID ndisRuleImageWrite(PNET_RULE_IMAGE image, ULONG size, const NET_RULES* rules, const NET_CLASSIFIER* cls, const NET_CONTENT* content,
+    const NET_REPUTATION* reputation, const NET_DOMAINS* domains, const NET_VM_PROGRAMS* programs, ULONG rate_limit, ULONG rate_burst,
+    ULONG defer);
+// image must be NET_RULE_IMAGE_ALIGN aligned and hold size readable bytes
+BOOLEAN ndisRuleImageValidate(const NET_RULE_IMAGE* image, ULONG size);
+
+static FORCEINLINE const NET_CLASSIFIER* ndisRuleImageClassifier(const NET_RULE_IMAGE* image) {
+    return (image->classifier_offset != 0) ? (const NET_CLASSIFIER*)((const UCHAR*)image + image->classifier_offset) : NULL;
+}
+
+static FORCEINLINE const NET_CONTENT* ndisRuleImageContent(const NET_RULE_IMAGE* image) {
+    return (image->content_offset != 0) ? (const NET_CONTENT*)((const UCHAR*)image + image->content_offset) : NULL;
+}
+
+static FORCEINLINE const NET_REPUTATION* ndisRuleImageReputation(const NET_RULE_IMAGE* image) {
+    return (image->reputation_offset != 0) ? (const NET_REPUTATION*)((const UCHAR*)image + image->reputation_offset) : NULL;
+}
+
+static FORCEINLINE const NET_DOMAINS* ndisRuleImageDomains(const NET_RULE_IMAGE* image) {
+    return (image->domains_offset != 0) ? (const NET_DOMAINS*)((const UCHAR*)image + image->domains_offset) : NULL;
+}
+
+static FORCEINLINE const NET_VM_PROGRAMS* ndisRuleImageVmPrograms(const NET_RULE_IMAGE* image) {
+    return (image->programs_offset != 0) ? (const NET_VM_PROGRAMS*)((const UCHAR*)image + image->programs_offset) : NULL;
+}
+
+// The leading NET_RULE_RECORD_SIZE bytes of a NET_RULES, without the links
+static FORCEINLINE const UCHAR* ndisRuleImageRecord(const NET_RULE_IMAGE* image, ULONG index) {
+    return (const UCHAR*)image + image->rules_offset + index * NET_RULE_RECORD_SIZE;
+}
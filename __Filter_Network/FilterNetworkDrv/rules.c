@@ -1,23 +1,151 @@
 #include "precomp.h"
 
-PNET_RULES __ndisNetRules = NULL;
+PNET_RULE_SET volatile __ndisNetRuleSet = NULL;
 
-VOID ndisReadCfg() {
+static KMUTEX       ndisNetRulesUpdateLock;    // KMUTEX keeps us at PASSIVE_LEVEL for ZwReadFile
+static ULONG64      ndisNetRulesGeneration = 0;
+static LIST_ENTRY   ndisNetRulesOverlays;      // MS_FILTERs with an overlay, by RuleOverlayLink, under ndisNetRulesUpdateLock
+
+NDIS_STATUS ndisInitNetRules() {
+    DbgPrint("### ndisInitNetRules\n");
+    KeInitializeMutex(&ndisNetRulesUpdateLock, 0);
+    InitializeListHead(&ndisNetRulesOverlays);
+    if (!ndisEpochInit()) {
+        DbgPrint("### ndisInitNetRules: ndisEpochInit failed\n");
+        return NDIS_STATUS_RESOURCES;
+    }
+    if (!ndisFlowCacheInit()) {
+        DbgPrint("### ndisInitNetRules: ndisFlowCacheInit failed\n");
+        ndisEpochCleanup();
+        return NDIS_STATUS_RESOURCES;
+    }
+    if (!ndisAlertInit()) {
+        DbgPrint("### ndisInitNetRules: ndisAlertInit failed\n");
+        ndisFlowCacheCleanup();
+        ndisEpochCleanup();
+        return NDIS_STATUS_RESOURCES;
+    }
+    if (!inspect_init()) {
+        DbgPrint("### ndisInitNetRules: inspect_init failed\n");
+        ndisAlertCleanup();
+        ndisFlowCacheCleanup();
+        ndisEpochCleanup();
+        return NDIS_STATUS_RESOURCES;
+    }
+    ndisContentInit(TRUE);
+    if (!ndisStreamInit()) {
+        // Content rules still run, one segment at a time
+        DbgPrint("### ndisInitNetRules: ndisStreamInit failed, TCP streams are not tracked\n");
+    }
+    if (!ndisRateInit()) {
+        // Rate limited frames all pass; other rules are not affected
+        DbgPrint("### ndisInitNetRules: ndisRateInit failed, sources are not counted\n");
+    }
+    if (!ndisDnsInit()) {
+        // Domain sets are loaded but never block anything
+        DbgPrint("### ndisInitNetRules: ndisDnsInit failed, DNS responses are not parsed\n");
+    }
+    if (!ndisMeterInit()) {
+        // Rules are not affected; IOCTL_FILTER_READ_FLOWS never completes
+        DbgPrint("### ndisInitNetRules: ndisMeterInit failed, flows are not metered\n");
+    }
+    if (!ndisDeferInit()) {
+        // An image that asks for deferral gets its payloads inspected inline
+        DbgPrint("### ndisInitNetRules: ndisDeferInit failed, payloads are inspected inline\n");
+    }
+    // A missing or bad configuration leaves the filter running without rules
+    ndisUpdateNetRules(NULL, 0);
+    return NDIS_STATUS_SUCCESS;
+}
+
+VOID ndisCleanupNetRules() {
+    DbgPrint("### ndisCleanupNetRules\n");
+    ndisDeferCleanup();             // workers still inspect under the set
+    KeWaitForSingleObject(&ndisNetRulesUpdateLock, Executive, KernelMode, FALSE, NULL);
+    ndisPublishNetRules(NULL);      // reclaims the last set
+    KeReleaseMutex(&ndisNetRulesUpdateLock, FALSE);
+    ndisMeterCleanup();
+    ndisDnsCleanup();
+    ndisRateCleanup();
+    ndisStreamCleanup();
+    inspect_cleanup();
+    ndisAlertCleanup();
+    ndisFlowCacheCleanup();
+    ndisEpochCleanup();
+}
+
+static PNET_RULE_SET rulesAllocSet(ULONG image_size) {
+    if (image_size > NET_RULE_IMAGE_MAX_SIZE) { return NULL; }
+    PNET_RULE_SET rule_set = (PNET_RULE_SET)ExAllocatePoolWithTag(NonPagedPool, NET_RULE_SET_HEADER + image_size, NET_RULE_SET_TAG);
+    if (rule_set != NULL) {
+        rule_set->generation = 0;
+        rule_set->image = (PNET_RULE_IMAGE)((PUCHAR)rule_set + NET_RULE_SET_HEADER);
+        rule_set->classifier = NULL;
+        rule_set->content = NULL;
+        rule_set->reputation = NULL;
+        rule_set->domains = NULL;
+        rule_set->programs = NULL;
+        rule_set->base = NULL;
+        rule_set->references = 0;
+        rule_set->retired = NULL;
+    }
+    return rule_set;
+}
+
+// Drops one holder of rule_set, which no reader can reach through it any
+// more; the last one frees the set and drops its hold on the base
+static VOID rulesReleaseSet(PNET_RULE_SET rule_set) {
+    while (rule_set != NULL && --rule_set->references == 0) {
+        PNET_RULE_SET base = rule_set->base;
+        ExFreePoolWithTag(rule_set, NET_RULE_SET_TAG);
+        rule_set = base;
+    }
+}
+
+static BOOLEAN rulesIsImage(const UCHAR* data, ULONG length) {
+    return (BOOLEAN)(length >= sizeof(ULONG) && ((const NET_RULE_IMAGE*)data)->magic == NET_RULE_IMAGE_MAGIC);
+}
+
+static VOID rulesBindImage(PNET_RULE_SET rule_set) {
+    rule_set->classifier = ndisRuleImageClassifier(rule_set->image);
+    rule_set->content = ndisRuleImageContent(rule_set->image);
+    rule_set->reputation = ndisRuleImageReputation(rule_set->image);
+    rule_set->domains = ndisRuleImageDomains(rule_set->image);
+    rule_set->programs = ndisRuleImageVmPrograms(rule_set->image);
+}
+
+// The image has been copied or read into rule_set: check it in place
+static NDIS_STATUS rulesOpenImage(PNET_RULE_SET rule_set, ULONG length) {
+    if (!ndisRuleImageValidate(rule_set->image, length)) {
+        DbgPrint("### rulesOpenImage: bad rule image (%u bytes)\n", length);
+        return NDIS_STATUS_INVALID_DATA;
+    }
+    rulesBindImage(rule_set);
+    DbgPrint("### rulesOpenImage: %u rules, %u content rules, %u + %u reputation addresses, %u domains, %u programs, %u bytes\n",
+        rule_set->image->rule_count, (rule_set->content != NULL) ? rule_set->content->rule_count : 0,
+        (rule_set->reputation != NULL) ? rule_set->reputation->count4 : 0,
+        (rule_set->reputation != NULL) ? rule_set->reputation->count6 : 0,
+        (rule_set->domains != NULL) ? rule_set->domains->count : 0,
+        (rule_set->programs != NULL) ? rule_set->programs->program_count : 0, length);
+    return NDIS_STATUS_SUCCESS;
+}
+
+NDIS_STATUS ndisReadCfg(PNET_RULE_SET* rule_set) {
     UNICODE_STRING     uniName;
     OBJECT_ATTRIBUTES  objAttr;
 
     DbgPrint("### ndisReadCfg\n");
+    *rule_set = NULL;
 
-    RtlInitUnicodeString(&uniName, L"\\DosDevices\\E:\\bugav_networkfilter.txt");  // or L"\\SystemRoot\\example.txt"
+    RtlInitUnicodeString(&uniName, NET_RULE_CONFIG_PATH);
     InitializeObjectAttributes(&objAttr, &uniName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
 
     HANDLE   handle;
     NTSTATUS ntstatus;
     IO_STATUS_BLOCK    ioStatusBlock;
-    UCHAR     buffer[BUFF_SIZE];
+    FILE_STANDARD_INFORMATION fileInfo;
     LARGE_INTEGER      byteOffset;
-    
-    RtlZeroMemory(buffer, BUFF_SIZE);
+    NDIS_STATUS        status = NDIS_STATUS_SUCCESS;
 
     ntstatus = ZwCreateFile(&handle,
         GENERIC_READ,
@@ -28,67 +156,105 @@ VOID ndisReadCfg() {
         FILE_OPEN,
         FILE_SYNCHRONOUS_IO_NONALERT,
         NULL, 0);
+    if (!NT_SUCCESS(ntstatus)) { return NDIS_STATUS_SUCCESS; }     // no configuration, no rules
 
-    if (NT_SUCCESS(ntstatus)) {
-        byteOffset.LowPart = byteOffset.HighPart = 0;
-        ntstatus = ZwReadFile(handle, NULL, NULL, NULL, &ioStatusBlock,
-            buffer, BUFF_SIZE, &byteOffset, NULL);
-        if (NT_SUCCESS(ntstatus)) {
-            buffer[BUFF_SIZE - 1] = '\0';
-            ndisParseCfg(buffer);
-        }
+    // Read the whole file straight into the set it will become when it is
+    // an image; a record file is compiled into a second set
+    ntstatus = ZwQueryInformationFile(handle, &ioStatusBlock, &fileInfo, sizeof(fileInfo), FileStandardInformation);
+    if (!NT_SUCCESS(ntstatus) || fileInfo.EndOfFile.QuadPart > NET_RULE_IMAGE_MAX_SIZE) {
+        DbgPrint("### ndisReadCfg: cannot size the configuration file\n");
         ZwClose(handle);
+        return NDIS_STATUS_INVALID_DATA;
     }
+    ULONG length = (ULONG)fileInfo.EndOfFile.QuadPart;
+    PNET_RULE_SET file_set = rulesAllocSet(length);
+    if (file_set == NULL) {
+        ZwClose(handle);
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    byteOffset.QuadPart = 0;
+    ntstatus = (length != 0) ? ZwReadFile(handle, NULL, NULL, NULL, &ioStatusBlock,
+        file_set->image, length, &byteOffset, NULL) : STATUS_SUCCESS;
+    ZwClose(handle);
+    if (!NT_SUCCESS(ntstatus) || ioStatusBlock.Information != length) {
+        ExFreePoolWithTag(file_set, NET_RULE_SET_TAG);
+        return NDIS_STATUS_FAILURE;
+    }
+
+    if (rulesIsImage((PUCHAR)file_set->image, length)) {
+        status = rulesOpenImage(file_set, length);
+        if (status == NDIS_STATUS_SUCCESS) {
+            *rule_set = file_set;
+            return status;
+        }
+    } else {
+        status = ndisParseCfg((PUCHAR)file_set->image, length, rule_set);
+    }
+    ExFreePoolWithTag(file_set, NET_RULE_SET_TAG);
+    return status;
 }
 
-VOID ndisParseCfg(PUCHAR cfg_buff) {
+NDIS_STATUS ndisParseCfg(const UCHAR* cfg_buff, ULONG length, PNET_RULE_SET* rule_set) {
+    // Records as written by BUGAV, compiled here. The rules are staged in
+    // one array only as long as the compile takes.
     DbgPrint("### ndisParseCfg\n");
-    if (cfg_buff[0] == '\0') { return; }
-    CHAR     line[BUFF_SIZE];
-    RtlZeroMemory(line, BUFF_SIZE);
-    PNET_RULES cfg_ptr = (PNET_RULES)cfg_buff;
-    UCHAR stop = 0xff;
-    _dump_bytes(cfg_buff, 17);
-    for (size_t i = 0; i < BUFF_SIZE;) {
-        _dump_bytes((PUCHAR)&(cfg_buff[i]), 1);
-        DbgPrint("### i= %d\n", i);
-        if (cfg_buff[i] == stop) { return; }
-        ndisPushNetRules(cfg_ptr);
-        i += sizeof(NET_RULES) - 2 * sizeof(struct _NET_RULES*);
-        cfg_ptr += i;
-    }
-    
-    ndisDumpNetRules();
-}
-
-VOID ndisPushNetRules(PNET_RULES newrule) {
-    DbgPrint("### ndisPushNetRules\n");
-    PNET_RULES flist_ptr = __ndisNetRules;
-    if (__ndisNetRules == NULL) {
-        __ndisNetRules = (PNET_RULES)ExAllocatePoolWithTag(NonPagedPool, sizeof(NET_RULES), '1geR');
-        if (__ndisNetRules != NULL) {
-            RtlCopyMemory(__ndisNetRules, newrule, sizeof(NET_RULES)-2*sizeof(struct _NET_RULES*));
-            __ndisNetRules->_next = NULL;
-            __ndisNetRules->_prev = NULL;
-            _dump_bytes((PUCHAR)__ndisNetRules, sizeof(NET_RULES));
-            return;
-        }
+    ULONG rule_count = ndisRuleRecordCount(cfg_buff, length);
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+
+    *rule_set = NULL;
+    if (rule_count == NET_RULE_RECORDS_BAD) {
+        DbgPrint("### ndisParseCfg: %u bytes are not %u-byte rule records, ignored\n", length, NET_RULE_RECORD_SIZE);
+        return NDIS_STATUS_INVALID_DATA;
     }
-    while (flist_ptr->_next != NULL) { flist_ptr = flist_ptr->_next; }
-    flist_ptr->_next = (PNET_RULES)ExAllocatePoolWithTag(NonPagedPool, sizeof(NET_RULES), '1geR');
-    if (flist_ptr->_next != NULL) {
-        RtlCopyMemory(flist_ptr->_next, newrule, sizeof(NET_RULES) - 2 * sizeof(struct _NET_RULES*));
-        flist_ptr->_next->_next = NULL;
-        flist_ptr->_next->_prev = flist_ptr;
-        _dump_bytes((PUCHAR)flist_ptr->_next, sizeof(NET_RULES));
-        return;
+    if (rule_count == 0) { return NDIS_STATUS_SUCCESS; }
+
+    PNET_RULES rules = (PNET_RULES)ExAllocatePoolWithTag(NonPagedPool, rule_count * sizeof(NET_RULES), '1geR');
+    if (rules == NULL) { return NDIS_STATUS_RESOURCES; }
+    for (ULONG i = 0; i < rule_count; i++) {
+        RtlCopyMemory(&rules[i], &cfg_buff[i * NET_RULE_RECORD_SIZE], NET_RULE_RECORD_SIZE);
+        rules[i]._next = (i + 1 < rule_count) ? &rules[i + 1] : NULL;
+        rules[i]._prev = (i > 0) ? &rules[i - 1] : NULL;
+    }
+
+    PNET_CLASSIFIER cls = ndisCompileNetRules(rules);
+    ULONG size = ndisRuleImageSize(rule_count, cls, NULL, NULL, NULL, NULL);
+    if (cls == NULL || size == 0 || (*rule_set = rulesAllocSet(size)) == NULL) {
+        DbgPrint("### ndisParseCfg: cannot compile %u rules\n", rule_count);
+        status = NDIS_STATUS_RESOURCES;
+    } else {
+        ndisRuleImageWrite((*rule_set)->image, size, rules, cls, NULL, NULL, NULL, NULL, 0, 0, 0);
+        (*rule_set)->classifier = ndisRuleImageClassifier((*rule_set)->image);
+        ndisDumpNetRules(*rule_set);
     }
+
+    ndisFreeNetClassifier(cls);
+    ExFreePoolWithTag(rules, '1geR');
+    return status;
 }
 
-VOID ndisDumpNetRules() {
-    DbgPrint("### ndisDumpNetRules\n");
-    PNET_RULES flist_ptr = __ndisNetRules;
-    while (flist_ptr != NULL) {
+NDIS_STATUS ndisLoadNetRules(const UCHAR* data, ULONG length, PNET_RULE_SET* rule_set) {
+    DbgPrint("### ndisLoadNetRules: %u bytes\n", length);
+    *rule_set = NULL;
+    if (!rulesIsImage(data, length)) { return ndisParseCfg(data, length, rule_set); }
+
+    PNET_RULE_SET new_set = rulesAllocSet(length);
+    if (new_set == NULL) { return NDIS_STATUS_RESOURCES; }
+    RtlCopyMemory(new_set->image, data, length);
+    NDIS_STATUS status = rulesOpenImage(new_set, length);
+    if (status != NDIS_STATUS_SUCCESS) {
+        ExFreePoolWithTag(new_set, NET_RULE_SET_TAG);
+        return status;
+    }
+    *rule_set = new_set;
+    return status;
+}
+
+VOID ndisDumpNetRules(const NET_RULE_SET* rule_set) {
+    DbgPrint("### ndisDumpNetRules: %u rules\n", rule_set->image->rule_count);
+    for (ULONG i = 0; i < rule_set->image->rule_count && i < NET_RULE_DUMP_MAX; i++) {
+        // A record is the head of a NET_RULES; the links are never touched
+        PNET_RULES flist_ptr = (PNET_RULES)ndisRuleImageRecord(rule_set->image, i);
         DbgPrint("\taction: ");             _dump_bytes(&flist_ptr->action, 1);
         DbgPrint("\tether_type: ");         _dump_bytes(flist_ptr->ether_type, 2);
         DbgPrint("\tip_next_protocol: ");   _dump_bytes(flist_ptr->ip_next_protocol, 1);
@@ -96,26 +262,144 @@ VOID ndisDumpNetRules() {
         DbgPrint("\tdestination_ip: ");     _dump_bytes(flist_ptr->destination_ip, 4);
         DbgPrint("\tsource_port: ");        _dump_bytes(flist_ptr->source_port, 2);
         DbgPrint("\tdestination_port: ");   _dump_bytes(flist_ptr->destination_port, 2);
-        flist_ptr = flist_ptr->_next;
+        DbgPrint("\tsource_prefix_len: ");      _dump_bytes(flist_ptr->source_prefix_len, 1);
+        DbgPrint("\tdestination_prefix_len: "); _dump_bytes(flist_ptr->destination_prefix_len, 1);
+        DbgPrint("\tsource_port_last: ");       _dump_bytes(flist_ptr->source_port_last, 2);
+        DbgPrint("\tdestination_port_last: ");  _dump_bytes(flist_ptr->destination_port_last, 2);
+        DbgPrint("\tsource_ip6: ");             _dump_bytes(flist_ptr->source_ip6, 16);
+        DbgPrint("\tdestination_ip6: ");        _dump_bytes(flist_ptr->destination_ip6, 16);
     }
 }
 
-VOID ndisDestroyNetRules() {
-    DbgPrint("### ndisDestroyNetRules\n");
-    PNET_RULES flist_ptr = __ndisNetRules;
+// An overlay of the same image over base, or NULL when out of memory.
+// Images are immutable once published, so the copy needs no validation.
+static PNET_RULE_SET rulesRebaseOverlay(const NET_RULE_SET* overlay, PNET_RULE_SET base) {
+    PNET_RULE_SET rebased = rulesAllocSet(overlay->image->size);
+    if (rebased == NULL) { return NULL; }
+    RtlCopyMemory(rebased->image, overlay->image, overlay->image->size);
+    rulesBindImage(rebased);
+    rebased->generation = ++ndisNetRulesGeneration;
+    rebased->references = 1;
+    rebased->base = base;
+    if (base != NULL) { base->references++; }
+    return rebased;
+}
+
+VOID ndisPublishNetRules(PNET_RULE_SET new_set) {
+    // Swaps new_set (NULL - no rules) in, moves every overlay over to it and
+    // reclaims what they all held before. Runs at PASSIVE_LEVEL with
+    // ndisNetRulesUpdateLock held.
+    DbgPrint("### ndisPublishNetRules\n");
+    PNET_RULE_SET retired = NULL;
+    if (new_set != NULL) {
+        new_set->generation = ++ndisNetRulesGeneration;
+        new_set->references = 1;
+    }
+
+    PNET_RULE_SET old_set = (PNET_RULE_SET)InterlockedExchangePointer((PVOID volatile*)&__ndisNetRuleSet, new_set);
 
-    if (flist_ptr == NULL) { return; }
-    while (flist_ptr->_next != NULL) { flist_ptr = flist_ptr->_next; }
-    while (flist_ptr->_prev != NULL) {
-        flist_ptr = flist_ptr->_prev;
-        ExFreePoolWithTag(flist_ptr->_next, '1geR');
+    for (PLIST_ENTRY link = ndisNetRulesOverlays.Flink; link != &ndisNetRulesOverlays; link = link->Flink) {
+        PMS_FILTER filter = CONTAINING_RECORD(link, MS_FILTER, RuleOverlayLink);
+        PNET_RULE_SET overlay = filter->RuleOverlay;
+        PNET_RULE_SET rebased = rulesRebaseOverlay(overlay, new_set);
+        if (rebased == NULL) {
+            // The overlay keeps its base alive and running until its next update
+            DbgPrint("### ndisPublishNetRules: cannot rebase the overlay of %wZ\n", &filter->FilterModuleName);
+            continue;
+        }
+        InterlockedExchangePointer((PVOID volatile*)&filter->RuleOverlay, rebased);
+        overlay->retired = retired;
+        retired = overlay;
+    }
+    if (old_set == NULL && retired == NULL) { return; }
+
+    // One grace period for the old base and every overlay over it
+    ndisEpochSynchronize();
+
+    rulesReleaseSet(old_set);
+    while (retired != NULL) {
+        PNET_RULE_SET next = retired->retired;
+        rulesReleaseSet(retired);
+        retired = next;
     }
-    ExFreePoolWithTag(flist_ptr, '1geR');
-    __ndisNetRules = NULL;
 }
 
-VOID ndisUpdateNetRules() {
+NDIS_STATUS ndisUpdateNetRules(const UCHAR* data, ULONG length) {
+    // data holds a rule image or BUGAV records; length 0 - read NET_RULE_CONFIG_PATH.
+    // On failure the current rules stay in place.
     DbgPrint("### ndisUpdateNetRules\n");
-    ndisDestroyNetRules();
-    ndisReadCfg();
-}
\ No newline at end of file
+    PNET_RULE_SET new_set;
+    NDIS_STATUS status;
+
+    KeWaitForSingleObject(&ndisNetRulesUpdateLock, Executive, KernelMode, FALSE, NULL);
+    status = (length == 0) ? ndisReadCfg(&new_set) : ndisLoadNetRules(data, length, &new_set);
+    if (status == NDIS_STATUS_SUCCESS) { ndisPublishNetRules(new_set); }
+    KeReleaseMutex(&ndisNetRulesUpdateLock, FALSE);
+    return status;
+}
+
+static VOID rulesPublishOverlay(PMS_FILTER filter, PNET_RULE_SET overlay) {
+    // Swaps overlay (NULL - none) in for filter over the current base and
+    // reclaims the one it had. Runs with ndisNetRulesUpdateLock held.
+    if (overlay != NULL) {
+        overlay->generation = ++ndisNetRulesGeneration;
+        overlay->references = 1;
+        overlay->base = __ndisNetRuleSet;
+        if (overlay->base != NULL) { overlay->base->references++; }
+    }
+
+    PNET_RULE_SET old_overlay = (PNET_RULE_SET)InterlockedExchangePointer((PVOID volatile*)&filter->RuleOverlay, overlay);
+    if (overlay != NULL && old_overlay == NULL) {
+        InsertTailList(&ndisNetRulesOverlays, &filter->RuleOverlayLink);
+    } else if (overlay == NULL && old_overlay != NULL) {
+        RemoveEntryList(&filter->RuleOverlayLink);
+    }
+    if (old_overlay == NULL) { return; }
+
+    ndisEpochSynchronize();
+    rulesReleaseSet(old_overlay);
+}
+
+NDIS_STATUS ndisUpdateInstanceRules(const UCHAR* name, ULONG name_length, const UCHAR* data, ULONG length) {
+    DbgPrint("### ndisUpdateInstanceRules: %u bytes\n", length);
+    PNET_RULE_SET overlay = NULL;
+    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+
+    if (name_length == 0) { return NDIS_STATUS_INVALID_PARAMETER; }
+
+    // An instance found here stays allocated until we let go of the lock:
+    // FilterDetach takes it to drop the overlay before freeing the instance
+    KeWaitForSingleObject(&ndisNetRulesUpdateLock, Executive, KernelMode, FALSE, NULL);
+    PMS_FILTER filter = filterFindFilterModule((PUCHAR)name, name_length);
+    if (filter == NULL) {
+        status = NDIS_STATUS_ADAPTER_NOT_FOUND;
+    } else if (length != 0) {
+        status = ndisLoadNetRules(data, length, &overlay);
+    }
+    if (status == NDIS_STATUS_SUCCESS && overlay != NULL && overlay->domains != NULL) {
+        // The block cache is driver-wide, so a domain set would block the
+        // names it lists on every adapter
+        DbgPrint("### ndisUpdateInstanceRules: an overlay cannot carry a domain set\n");
+        ExFreePoolWithTag(overlay, NET_RULE_SET_TAG);
+        status = NDIS_STATUS_NOT_SUPPORTED;
+    }
+    if (status == NDIS_STATUS_SUCCESS) { rulesPublishOverlay(filter, overlay); }
+    KeReleaseMutex(&ndisNetRulesUpdateLock, FALSE);
+    return status;
+}
+
+VOID ndisReleaseInstanceRules(PMS_FILTER filter) {
+    KeWaitForSingleObject(&ndisNetRulesUpdateLock, Executive, KernelMode, FALSE, NULL);
+    rulesPublishOverlay(filter, NULL);
+    KeReleaseMutex(&ndisNetRulesUpdateLock, FALSE);
+}
+
+PNET_RULE_SET ndisAcquireNetRules(PNETFLT_EPOCH_READER reader, PMS_FILTER filter) {
+    ndisEpochEnter(reader);
+    PNET_RULE_SET overlay = filter->RuleOverlay;
+    return (overlay != NULL) ? overlay : __ndisNetRuleSet;
+}
+
+VOID ndisReleaseNetRules(PNETFLT_EPOCH_READER reader) {
+    ndisEpochLeave(reader);
+}
@@ -1,24 +1,121 @@
 #pragma once
-#define  BUFF_SIZE 512
 
 typedef struct _NET_RULES {
-    UCHAR action;                   // 0x0 - alert, 0x1 - drop
+    UCHAR action;                   // NET_RULE_ACTION_*
     UCHAR ether_type[2];            // 0x08, 0x00 - ip, 0x08, 0x06 - arp
     UCHAR ip_next_protocol[1];      // 0x01 - ICMP, 0x02 - IGMP, 0x11 - UDP, 0x06 - TCP 0x0 - ignore
     UCHAR source_ip[4];
     UCHAR destination_ip[4];
     UCHAR source_port[2];
     UCHAR destination_port[2];
+    UCHAR source_prefix_len[1];         // 1..32 - source_ip is a CIDR prefix, 0 - exact (or ignore if source_ip is 0)
+    UCHAR destination_prefix_len[1];
+    UCHAR source_port_last[2];          // != 0 - inclusive range source_port..source_port_last
+    UCHAR destination_port_last[2];
+    UCHAR source_ip6[16];               // != 0 - IPv6 rule, source_ip/destination_ip are ignored
+    UCHAR destination_ip6[16];          // and the prefix lengths go up to 128
 
     struct _NET_RULES* _next;
     struct _NET_RULES* _prev;
 } NET_RULES, * PNET_RULES;
 
-extern PNET_RULES          __ndisNetRules;
+// NET_RULES.action, as BUGAV writes it. A frame matching a rule is dropped
+// and alerted whatever the action, except under NET_RULE_ACTION_RATE_LIMIT,
+// which drops it only when its source is over the rate set in the rule
+// image (ratelimit.h)
+#define NET_RULE_ACTION_IGNORE      0x00
+#define NET_RULE_ACTION_ALERT       0x01
+#define NET_RULE_ACTION_DROP        0x02
+#define NET_RULE_ACTION_RATE_LIMIT  0x03
+
+// Bytes per rule in the configuration file: every field above _next, packed
+#define NET_RULE_RECORD_SIZE    54
+#define NET_RULE_RECORDS_BAD    0xFFFFFFFF
+
+// Number of BUGAV records in length bytes of data, or NET_RULE_RECORDS_BAD
+// when they cannot be records of this size: the length is not a whole
+// number of them, plus the 0xff BUGAV ends them with, or a record has an
+// unknown action or a prefix longer than its address. The record carries
+// no version and has grown from 16 bytes, so this is what keeps a file
+// written by an older BUGAV from being read as rules, every one of which
+// drops what it matches.
+static FORCEINLINE ULONG ndisRuleRecordCount(const UCHAR* data, ULONG length) {
+    ULONG count = length / NET_RULE_RECORD_SIZE;
+    ULONG rest = length % NET_RULE_RECORD_SIZE;
+    if (rest > 1 || (rest == 1 && data[length - 1] != 0xff)) { return NET_RULE_RECORDS_BAD; }
+    for (ULONG i = 0; i < count; i++) {
+        const NET_RULES* record = (const NET_RULES*)(data + i * NET_RULE_RECORD_SIZE);
+        UCHAR prefix_max = 32;
+        for (ULONG b = 0; b < 16; b++) {
+            if ((record->source_ip6[b] | record->destination_ip6[b]) != 0) { prefix_max = 128; }
+        }
+        if (record->action > NET_RULE_ACTION_RATE_LIMIT || record->source_prefix_len[0] > prefix_max ||
+            record->destination_prefix_len[0] > prefix_max) {
+            return NET_RULE_RECORDS_BAD;
+        }
+    }
+    return count;
+}
+
+//
+// Immutable snapshot of the rules used by the packet path. A reload builds
+// a new set, swaps __ndisNetRuleSet and frees the old set once every reader
+// that could still see it has left its epoch section (see epoch.h).
+//
+// A set is one allocation: this header followed by the rule image
+// (ruleimage.h) it was loaded from, which holds the rule records, the
+// classifier, the content automaton, the IP reputation set, the domain set
+// and the filter programs.
+//
+// A filter instance may run an overlay instead (IOCTL_FILTER_UPDATE_INSTANCE_CONFIG):
+// a set of its own whose base is the set in __ndisNetRuleSet. A frame goes
+// through the whole overlay first, and through the base only when nothing
+// in the overlay matched it, so every adapter shares one copy of the base
+// image. The base counts the holders that can hand it to a reader,
+// __ndisNetRuleSet and the overlays over it, and is freed with the last
+// one. A reload of the base rebuilds every overlay over the new set.
+//
+typedef struct _NET_RULE_SET {
+    ULONG64                 generation;
+    struct _NET_RULE_IMAGE* image;
+    const struct _NET_CLASSIFIER* classifier;   // inside image, NULL - no rules
+    const struct _NET_CONTENT* content;         // inside image, NULL - no content rules
+    const struct _NET_REPUTATION* reputation;   // inside image, NULL - no reputation set
+    const struct _NET_DOMAINS* domains;         // inside image, NULL - no domain set
+    const struct _NET_VM_PROGRAMS* programs;    // inside image, NULL - no filter programs
+    struct _NET_RULE_SET*   base;               // overlay: the shared set after it, referenced; NULL - none
+    LONG                    references;         // holders, changed with ndisNetRulesUpdateLock held
+    struct _NET_RULE_SET*   retired;            // next set waiting for ndisEpochSynchronize, writer only
+} NET_RULE_SET, * PNET_RULE_SET;
+
+#define NET_RULE_SET_TAG    '2geR'
+#define NET_RULE_SET_HEADER ((sizeof(NET_RULE_SET) + 15) & ~(SIZE_T)15)
+
+// Configuration file read at start-up and by an empty IOCTL_FILTER_UPDATE_CONFIG:
+// a rule image, or the NET_RULE_RECORD_SIZE-byte records written by BUGAV
+// (ended by a 0xff byte or the end of the file, see ndisRuleRecordCount)
+#define NET_RULE_CONFIG_PATH    L"\\DosDevices\\E:\\bugav_networkfilter.txt"
+#define NET_RULE_DUMP_MAX       16
+
+extern PNET_RULE_SET volatile __ndisNetRuleSet;
+
+struct _MS_FILTER;
  
-VOID ndisReadCfg();
-VOID ndisParseCfg(PUCHAR cfg_buff);
-VOID ndisPushNetRules(PNET_RULES newrule);
-VOID ndisDumpNetRules();
-VOID ndisDestroyNetRules();
-VOID ndisUpdateNetRules();
+NDIS_STATUS ndisInitNetRules();
+VOID ndisCleanupNetRules();
+NDIS_STATUS ndisReadCfg(PNET_RULE_SET* rule_set);
+NDIS_STATUS ndisParseCfg(const UCHAR* cfg_buff, ULONG length, PNET_RULE_SET* rule_set);
+NDIS_STATUS ndisLoadNetRules(const UCHAR* data, ULONG length, PNET_RULE_SET* rule_set);
+VOID ndisDumpNetRules(const NET_RULE_SET* rule_set);
+VOID ndisPublishNetRules(PNET_RULE_SET new_set);
+NDIS_STATUS ndisUpdateNetRules(const UCHAR* data, ULONG length);
+// Replaces the overlay of the filter instance named by name_length bytes of
+// name, as for IOCTL_FILTER_RESTART_ONE_INSTANCE, with a rule image (or
+// BUGAV records); length 0 - removes it, the instance runs the base set again
+NDIS_STATUS ndisUpdateInstanceRules(const UCHAR* name, ULONG name_length, const UCHAR* data, ULONG length);
+// FilterDetach: drops the overlay of an instance already off FilterModuleList
+VOID ndisReleaseInstanceRules(struct _MS_FILTER* filter);
+
+// The overlay of filter, or the base set when it has none
+PNET_RULE_SET ndisAcquireNetRules(PNETFLT_EPOCH_READER reader, struct _MS_FILTER* filter);
+VOID ndisReleaseNetRules(PNETFLT_EPOCH_READER reader);
@@ -0,0 +1,224 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "stream.h"
+
+C_ASSERT(sizeof(NET_STREAM_ENTRY) == 64);
+
+static PNET_STREAM_TABLE    ndisStreamTables = NULL;
+static PVOID                ndisStreamTablesRaw = NULL;
+static PVOID                ndisStreamSlab = NULL;
+static ULONG                ndisStreamCpuCount = 0;
+
+BOOLEAN ndisStreamInit() {
+    ULONG count = NETFLT_CPU_COUNT();
+    SIZE_T size = count * sizeof(NET_STREAM_TABLE) + NETFLT_CACHE_LINE;
+
+    // The largest power of two of entries, with their buckets, that fits
+    // a processor's share
+    ULONG capacity = 1;
+    while ((SIZE_T)capacity * 2 * (sizeof(NET_STREAM_ENTRY) + sizeof(ULONG)) * count <= NET_STREAM_MEMORY) { capacity *= 2; }
+    SIZE_T slab_size = (SIZE_T)capacity * (sizeof(NET_STREAM_ENTRY) + sizeof(ULONG)) * count;
+
+    ndisStreamTablesRaw = NETFLT_ALLOC(size, NET_STREAM_TAG);
+    ndisStreamSlab = NETFLT_ALLOC(slab_size, NET_STREAM_TAG);
+    if (ndisStreamTablesRaw == NULL || ndisStreamSlab == NULL) {
+        ndisStreamCleanup();
+        return FALSE;
+    }
+    RtlZeroMemory(ndisStreamTablesRaw, size);
+    ndisStreamTables = (PNET_STREAM_TABLE)(((ULONG_PTR)ndisStreamTablesRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+
+    // Entries of every processor first, then the buckets, so that entries
+    // stay 64-byte aligned
+    PNET_STREAM_ENTRY entries = (PNET_STREAM_ENTRY)ndisStreamSlab;
+    PULONG buckets = (PULONG)(entries + (SIZE_T)capacity * count);
+    for (ULONG cpu = 0; cpu < count; cpu++) {
+        PNET_STREAM_TABLE table = &ndisStreamTables[cpu];
+        table->capacity = capacity;
+        table->entries = entries + (SIZE_T)capacity * cpu;
+        table->buckets = buckets + (SIZE_T)capacity * cpu;
+        table->lru_head = NET_STREAM_NIL;
+        table->lru_tail = NET_STREAM_NIL;
+        for (ULONG i = 0; i < capacity; i++) {
+            RtlZeroMemory(&table->entries[i], sizeof(NET_STREAM_ENTRY));
+            table->entries[i].hash_next = (i + 1 < capacity) ? i + 1 : NET_STREAM_NIL;
+            table->buckets[i] = NET_STREAM_NIL;
+        }
+        table->free = 0;
+    }
+    ndisStreamCpuCount = count;
+    return TRUE;
+}
+
+VOID ndisStreamCleanup() {
+    if (ndisStreamTablesRaw != NULL) { NETFLT_FREE(ndisStreamTablesRaw, NET_STREAM_TAG); }
+    if (ndisStreamSlab != NULL) { NETFLT_FREE(ndisStreamSlab, NET_STREAM_TAG); }
+    ndisStreamTablesRaw = NULL;
+    ndisStreamSlab = NULL;
+    ndisStreamTables = NULL;
+    ndisStreamCpuCount = 0;
+}
+
+PNET_STREAM_TABLE ndisStreamCurrent() {
+    if (ndisStreamTables == NULL) { return NULL; }
+    return &ndisStreamTables[NETFLT_CPU_INDEX()];
+}
+
+static ULONG streamHash(const NET_LPM6_ADDRESS* source, const NET_LPM6_ADDRESS* destination, UINT16 source_port, UINT16 destination_port) {
+    UINT64 h = source->hi ^ (source->lo * 0x9E3779B97F4A7C15ULL);
+    h = (h ^ destination->hi) * 0xC2B2AE3D27D4EB4FULL;
+    h = (h ^ destination->lo ^ ((UINT64)source_port << 16) ^ destination_port) * 0x9E3779B97F4A7C15ULL;
+    return (ULONG)(h >> 32);
+}
+
+static VOID streamLruUnlink(PNET_STREAM_TABLE table, ULONG index) {
+    PNET_STREAM_ENTRY entry = &table->entries[index];
+    if (entry->lru_prev != NET_STREAM_NIL) { table->entries[entry->lru_prev].lru_next = entry->lru_next; } else { table->lru_head = entry->lru_next; }
+    if (entry->lru_next != NET_STREAM_NIL) { table->entries[entry->lru_next].lru_prev = entry->lru_prev; } else { table->lru_tail = entry->lru_prev; }
+}
+
+static VOID streamLruPush(PNET_STREAM_TABLE table, ULONG index) {
+    PNET_STREAM_ENTRY entry = &table->entries[index];
+    entry->lru_prev = NET_STREAM_NIL;
+    entry->lru_next = table->lru_head;
+    if (table->lru_head != NET_STREAM_NIL) { table->entries[table->lru_head].lru_prev = index; } else { table->lru_tail = index; }
+    table->lru_head = index;
+}
+
+// Takes an entry out of its bucket and the LRU list and frees it
+static VOID streamRelease(PNET_STREAM_TABLE table, ULONG index) {
+    PNET_STREAM_ENTRY entry = &table->entries[index];
+    PULONG link = &table->buckets[streamHash(&entry->source, &entry->destination, entry->source_port, entry->destination_port) & (table->capacity - 1)];
+
+    while (*link != index) { link = &table->entries[*link].hash_next; }
+    *link = entry->hash_next;
+    streamLruUnlink(table, index);
+    entry->generation = 0;
+    entry->hash_next = table->free;
+    table->free = index;
+}
+
+PNET_STREAM_ENTRY ndisStreamBegin(PNET_STREAM_TABLE table, ULONG generation, const NET_CLS_KEY* key,
+    const NET_LPM6_ADDRESS* addresses, ULONG sequence, ULONG length, UCHAR tcp_flags, PULONG skip) {
+    NET_LPM6_ADDRESS source, destination;
+
+    *skip = 0;
+    if (key->shape & NET_CLS_SHAPE_IP6) {
+        source = addresses[0];
+        destination = addresses[1];
+    } else {
+        source.hi = 0;
+        source.lo = 0x0000FFFF00000000ULL | key->source_ip;
+        destination.hi = 0;
+        destination.lo = 0x0000FFFF00000000ULL | key->destination_ip;
+    }
+
+    // 0 marks a free entry
+    if (generation == 0) { generation = 1; }
+
+    ULONG bucket = streamHash(&source, &destination, key->source_port, key->destination_port) & (table->capacity - 1);
+    ULONG index = table->buckets[bucket];
+    while (index != NET_STREAM_NIL) {
+        PNET_STREAM_ENTRY entry = &table->entries[index];
+        ULONG next = entry->hash_next;
+        if (entry->generation != generation) {
+            // Left over from an older rule set
+            streamRelease(table, index);
+        } else if (entry->source_port == key->source_port && entry->destination_port == key->destination_port &&
+            entry->source.hi == source.hi && entry->source.lo == source.lo &&
+            entry->destination.hi == destination.hi && entry->destination.lo == destination.lo) {
+            break;
+        }
+        index = next;
+    }
+
+    if (index != NET_STREAM_NIL) {
+        PNET_STREAM_ENTRY entry = &table->entries[index];
+        LONG ahead = (LONG)(sequence - entry->next_sequence);
+
+        if (length == 0) {
+            if (tcp_flags & (NET_STREAM_TCP_FIN | NET_STREAM_TCP_RST)) { streamRelease(table, index); }
+            return NULL;
+        }
+        if (ahead < 0 && (ULONG)-ahead >= length) {
+            // Wholly behind: a retransmission, scanned on its own
+            return NULL;
+        }
+        if (ahead > 0) {
+            table->gaps++;
+            entry->state = 0;
+        } else {
+            table->hits++;
+            *skip = (ULONG)-ahead;
+        }
+        if (index != table->lru_head) {
+            streamLruUnlink(table, index);
+            streamLruPush(table, index);
+        }
+        return entry;
+    }
+
+    if (length == 0) { return NULL; }
+    table->misses++;
+    if (table->free != NET_STREAM_NIL) {
+        index = table->free;
+        table->free = table->entries[index].hash_next;
+    } else {
+        index = table->lru_tail;
+        if (table->entries[index].generation == generation) { table->evictions++; }
+        streamRelease(table, index);
+        table->free = table->entries[index].hash_next;
+    }
+
+    PNET_STREAM_ENTRY entry = &table->entries[index];
+    entry->source = source;
+    entry->destination = destination;
+    entry->source_port = key->source_port;
+    entry->destination_port = key->destination_port;
+    entry->generation = generation;
+    entry->next_sequence = sequence;
+    entry->state = 0;
+    entry->scanned = 0;
+    entry->hash_next = table->buckets[bucket];
+    table->buckets[bucket] = index;
+    streamLruPush(table, index);
+    return entry;
+}
+
+VOID ndisStreamEnd(PNET_STREAM_TABLE table, PNET_STREAM_ENTRY entry, ULONG state, ULONG next_sequence,
+    ULONG scanned, UCHAR tcp_flags) {
+    if (tcp_flags & (NET_STREAM_TCP_FIN | NET_STREAM_TCP_RST)) {
+        streamRelease(table, (ULONG)(entry - table->entries));
+        return;
+    }
+    entry->state = state;
+    entry->next_sequence = next_sequence;
+    entry->scanned += scanned;
+}
+
+VOID ndisStreamQueryStat(PNET_STREAM_STAT stat) {
+    RtlZeroMemory(stat, sizeof(NET_STREAM_STAT));
+    stat->cpus = ndisStreamCpuCount;
+    if (ndisStreamTables == NULL) { return; }
+    stat->entries = ndisStreamTables[0].capacity;
+
+    // Counters are written only by their own processor, as in the flow cache
+    for (ULONG cpu = 0; cpu < ndisStreamCpuCount; cpu++) {
+        stat->hits += ndisStreamTables[cpu].hits;
+        stat->misses += ndisStreamTables[cpu].misses;
+        stat->gaps += ndisStreamTables[cpu].gaps;
+        stat->evictions += ndisStreamTables[cpu].evictions;
+    }
+}
+
+VOID ndisStreamClearStat() {
+    for (ULONG cpu = 0; cpu < ndisStreamCpuCount; cpu++) {
+        ndisStreamTables[cpu].hits = 0;
+        ndisStreamTables[cpu].misses = 0;
+        ndisStreamTables[cpu].gaps = 0;
+        ndisStreamTables[cpu].evictions = 0;
+    }
+}
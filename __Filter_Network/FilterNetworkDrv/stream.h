@@ -0,0 +1,103 @@
+#pragma once
+//
+// Per-processor TCP stream state for content rules (content.h).
+//
+// A pattern split over two segments is found by carrying the content
+// automaton over from one segment of a stream to the next. The automaton
+// state is all that has to be kept: it stands for the last bytes that may
+// still begin a match (at most the longest pattern less one), so a stream
+// costs one NET_STREAM_ENTRY whatever the patterns are.
+//
+// A segment continues its stream when it starts at the next expected
+// sequence number; a retransmission that overlaps it continues after the
+// bytes already scanned. A segment past a gap (loss or reordering) starts
+// the automaton afresh, and one wholly behind is scanned on its own,
+// leaving the stream alone. FIN and RST end the stream. The content depth
+// counts stream bytes, so a stream is not scanned past it. Tracking is
+// turned on per rule image (NET_CONTENT_F_STREAM).
+//
+// Entries come from a fixed slab carved out at start-up: NET_STREAM_MEMORY
+// bytes in all, split evenly between the processors. Every processor owns
+// its table and only touches it from inside an epoch section (at
+// DISPATCH_LEVEL), like the flow cache. Only segments that carry payload
+// create an entry, and a full table recycles its least recently used one,
+// so a SYN flood costs nothing and a flood of new streams only evicts.
+// A stream whose segments reach several processors is tracked on each of
+// them separately, which at worst loses the continuation.
+//
+// Entries are stamped with the rule set generation: an automaton state is
+// meaningless under another rule set, so an older entry is never used.
+//
+
+#define NET_STREAM_TAG          '1rtS'
+#define NET_STREAM_MEMORY       (8 << 20)   // entries and hash buckets of all processors
+#define NET_STREAM_NIL          0xFFFFFFFF
+
+// TCP header flags the tracker looks at
+#define NET_STREAM_TCP_FIN      0x01
+#define NET_STREAM_TCP_RST      0x04
+
+typedef struct _NET_STREAM_ENTRY {
+    NET_LPM6_ADDRESS source;        // IPv4: ::ffff:a.b.c.d
+    NET_LPM6_ADDRESS destination;
+    UINT16  source_port;
+    UINT16  destination_port;
+    ULONG   generation;             // low bits of NET_RULE_SET.generation, 0 - free
+    ULONG   next_sequence;          // of the first byte not seen yet
+    ULONG   state;                  // content automaton
+    ULONG   scanned;                // stream bytes scanned
+    ULONG   hash_next;              // in its bucket, or in the free list
+    ULONG   lru_prev;               // towards the most recently used
+    ULONG   lru_next;
+} NET_STREAM_ENTRY, * PNET_STREAM_ENTRY;
+
+typedef struct DECLSPEC_CACHEALIGN _NET_STREAM_TABLE {
+    ULONG64             hits;       // segments that continued a stream
+    ULONG64             misses;     // segments that started one
+    ULONG64             gaps;       // segments past a gap
+    ULONG64             evictions;  // live streams recycled for new ones
+    ULONG               capacity;   // entries, power of two
+    ULONG               free;       // free list through hash_next
+    ULONG               lru_head;   // most recently used
+    ULONG               lru_tail;
+    PULONG              buckets;    // capacity entry indexes
+    PNET_STREAM_ENTRY   entries;
+} NET_STREAM_TABLE, * PNET_STREAM_TABLE;
+
+typedef struct _NET_STREAM_STAT {
+    ULONG64 hits;
+    ULONG64 misses;
+    ULONG64 gaps;
+    ULONG64 evictions;
+    ULONG   entries;                // capacity of one processor's table
+    ULONG   cpus;
+} NET_STREAM_STAT, * PNET_STREAM_STAT;
+
+// A failed init leaves stream tracking off: every segment is scanned on
+// its own, as without NET_CONTENT_F_STREAM
+BOOLEAN ndisStreamInit();
+VOID ndisStreamCleanup();
+
+// The calling processor's table; NULL if tracking is off
+PNET_STREAM_TABLE ndisStreamCurrent();
+
+// Looks up the stream of a TCP segment whose payload starts at sequence
+// and holds length bytes; addresses as from ndisFrameToKey. Returns the
+// entry the scan continues, starting in entry->state with the first *skip
+// payload bytes left out (already scanned), or NULL when the segment is to
+// be scanned on its own. A segment with payload that starts a stream gets a
+// fresh entry. One without payload never does, and only ends its stream on
+// FIN or RST.
+PNET_STREAM_ENTRY ndisStreamBegin(PNET_STREAM_TABLE table, ULONG generation, const NET_CLS_KEY* key,
+    const NET_LPM6_ADDRESS* addresses, ULONG sequence, ULONG length, UCHAR tcp_flags, PULONG skip);
+
+// The segment was scanned without a match: the stream goes on from state,
+// with next_sequence the next byte expected and scanned more bytes counted
+// against the depth. FIN or RST in tcp_flags end it. After a match the
+// entry is left as it was: the segment is dropped and never reaches the
+// peer, so its retransmission must find the same state.
+VOID ndisStreamEnd(PNET_STREAM_TABLE table, PNET_STREAM_ENTRY entry, ULONG state, ULONG next_sequence,
+    ULONG scanned, UCHAR tcp_flags);
+
+VOID ndisStreamQueryStat(PNET_STREAM_STAT stat);
+VOID ndisStreamClearStat();
@@ -1,5 +1,49 @@
 #include "precomp.h"
 
+// Header copies per batch for frames whose headers straddle MDLs
+#define INSPECT_COPY_SLOTS  8
+
+// Arrays of one inspect_chain call and the stages under it, per processor.
+// Every caller holds the rules in an epoch section, at DISPATCH_LEVEL, so
+// nothing else on the processor can get in between; keeping them off the
+// stack spares the receive DPC, which runs under the rest of the network
+// stack, a few KB. Each function has fields of its own, as they nest.
+typedef struct DECLSPEC_CACHEALIGN _INSPECT_SCRATCH {
+    PNET_BUFFER_LIST    nbls[NET_BATCH_MAX];            // inspect_chain
+    UCHAR               verdicts[NET_BATCH_MAX];
+    NET_BATCH_FRAME     frames[NET_BATCH_MAX];          // inspect_batch
+    PNET_BUFFER         nbs[NET_BATCH_MAX];
+    UCHAR               owners[NET_BATCH_MAX];
+    UCHAR               copies[INSPECT_COPY_SLOTS][NET_BATCH_HDR_MAX];
+    ULONG               rules[NET_BATCH_MAX];           // inspect_flush
+    ULONG               base_rules[NET_BATCH_MAX];
+    UCHAR               header[NET_BATCH_HDR_MAX + 16]; // inspect_content
+    UCHAR               window[NET_VM_WINDOW];          // inspect_programs
+    UCHAR               dns[NET_BATCH_HDR_MAX + NET_DNS_MESSAGE_MAX];   // inspect_dns
+} INSPECT_SCRATCH, * PINSPECT_SCRATCH;
+
+static PINSPECT_SCRATCH     inspectScratch = NULL;
+static PVOID                inspectScratchRaw = NULL;
+
+BOOLEAN inspect_init() {
+    SIZE_T size = NETFLT_CPU_COUNT() * sizeof(INSPECT_SCRATCH) + NETFLT_CACHE_LINE;
+
+    inspectScratchRaw = NETFLT_ALLOC(size, INSPECT_TAG);
+    if (inspectScratchRaw == NULL) { return FALSE; }
+    inspectScratch = (PINSPECT_SCRATCH)(((ULONG_PTR)inspectScratchRaw + NETFLT_CACHE_LINE - 1) & ~(ULONG_PTR)(NETFLT_CACHE_LINE - 1));
+    return TRUE;
+}
+
+VOID inspect_cleanup() {
+    if (inspectScratchRaw != NULL) { NETFLT_FREE(inspectScratchRaw, INSPECT_TAG); }
+    inspectScratchRaw = NULL;
+    inspectScratch = NULL;
+}
+
+static FORCEINLINE PINSPECT_SCRATCH inspect_scratch() {
+    return &inspectScratch[NETFLT_CPU_INDEX()];
+}
+
 void _dump_bytes(PUCHAR buf, size_t buf_len) {
     size_t i = 0;
     for (i = 0; i < buf_len; ++i) {
@@ -23,128 +67,567 @@ PIPV4_HDR get_ipv4hdr(PUCHAR frame) {
     return hdr;
 }
 
+PIPV6_HDR get_ipv6hdr(PUCHAR frame) {
+    PIPV6_HDR hdr = (PIPV6_HDR)frame;
+    return hdr;
+}
+
 PTCP_HDR get_tcphdr(PUCHAR frame) {
     PTCP_HDR hdr = (PTCP_HDR)frame;
     return hdr;
 }
 
-FLT_NETWORK_DATA parse_frame(PUCHAR frame) {
+PUDP_HDR get_udphdr(PUCHAR frame) {
+    PUDP_HDR hdr = (PUDP_HDR)frame;
+    return hdr;
+}
+
+FLT_NETWORK_DATA parse_frame(PUCHAR frame, ULONG length) {
     FLT_NETWORK_DATA net_data = { 0 };
-    PUCHAR frame_ptr = frame;
-    net_data.eth_hdr = get_etherhdr(frame_ptr);
-    frame_ptr += sizeof(ETHRENET_HDR);
-
-    UCHAR   __ethertype_ip[2] = {0x08, 0x00};
-    UCHAR   __ethertype_arp[2] = { 0x08, 0x06 };
-    if (memcmp(net_data.eth_hdr->type, __ethertype_ip, 2)==0) {
-        net_data.ipv4_hdr = get_ipv4hdr(frame_ptr);
-        frame_ptr += sizeof(IPV4_HDR);
-    } else if (memcmp(net_data.eth_hdr->type, __ethertype_arp, 2)==0) {
-        net_data.arp_hdr = get_arphdr(frame_ptr);
-        frame_ptr += sizeof(ARP_HDR);
+    NET_CLS_KEY key;
+    NET_LPM6_ADDRESS addresses[2];
+
+    net_data.length = length;
+    if (length < sizeof(ETHRENET_HDR)) { return net_data; }
+    net_data.eth_hdr = get_etherhdr(frame);
+
+    // Same parse as the classifier: key.shape says which headers are there
+    // and end is just past the ports
+    ULONG end = ndisFrameToKey(frame, length, &key, addresses);
+    UINT16 ether_type;
+    ULONG offset = ndisFrameNetworkOffset(frame, length, &ether_type);
+    PUCHAR frame_ptr = frame + offset;
+
+    if (ether_type == 0x0806) {
+        if (offset + sizeof(ARP_HDR) <= length) { net_data.arp_hdr = get_arphdr(frame_ptr); }
         return net_data;
     }
+    if (key.shape & NET_CLS_SHAPE_IP) { net_data.ipv4_hdr = get_ipv4hdr(frame_ptr); }
+    if (key.shape & NET_CLS_SHAPE_IP6) { net_data.ipv6_hdr = get_ipv6hdr(frame_ptr); }
+    if (!(key.shape & NET_CLS_SHAPE_L4)) { return net_data; }
 
-    net_data.tcp_hdr = get_tcphdr(frame_ptr);
-
+    frame_ptr = frame + end - NET_BATCH_PORTS_LEN;
+    if (key.protocol == 6 && end - NET_BATCH_PORTS_LEN + sizeof(TCP_HDR) <= length) {
+        net_data.tcp_hdr = get_tcphdr(frame_ptr);
+    } else if (key.protocol == 17 && end - NET_BATCH_PORTS_LEN + sizeof(UDP_HDR) <= length) {
+        net_data.udp_hdr = get_udphdr(frame_ptr);
+    }
     return net_data;
 }
 
-BOOLEAN inspect_list(PNET_BUFFER_LIST nbl_ptr) {
-   
-    PNET_BUFFER nb_ptr = NET_BUFFER_LIST_FIRST_NB(nbl_ptr);
-    
-    while (nb_ptr != NULL) {
-    
-        PMDL nb_curmdl = NET_BUFFER_CURRENT_MDL(nb_ptr);
-        PVOID net_dataptr = MmGetMdlVirtualAddress(nb_curmdl);
-        FLT_NETWORK_DATA frame_data = parse_frame((PUCHAR)net_dataptr);
-
-        DbgPrint("NDIS: \tinspect_packet\n");
-        
-        BOOLEAN drop = inspect_packet(&frame_data);
-        if (drop == TRUE) {
-            DbgPrint("### MATCH!!! --> Drop it!++++++++++++++\n");
-            ULONG nb_data_length = NET_BUFFER_DATA_LENGTH(nb_ptr);
-            _dump_bytes((PUCHAR)net_dataptr, nb_data_length);
-            dump_packet(&frame_data);
-            DbgPrint("### MATCH!!! --> Drop it!--------------\n");
-            return TRUE;
-        } else {
+// Points frame at the first bytes of nb without copying when they are
+// contiguous. When the first MDL ends inside the headers, only the header
+// bytes are copied to copy (NET_BATCH_HDR_MAX bytes). Returns TRUE if copy
+// was used. Payload bytes are never read.
+static BOOLEAN inspect_frame(PNET_BUFFER nb_ptr, PNET_BATCH_FRAME frame, PUCHAR copy) {
+    ULONG want = min(NET_BUFFER_DATA_LENGTH(nb_ptr), NET_BATCH_HDR_MAX);
+    PUCHAR data = (want != 0) ? (PUCHAR)NdisGetDataBuffer(nb_ptr, want, NULL, 1, 0) : copy;
+
+    frame->data = data;
+    frame->length = want;
+    if (data != NULL) { return FALSE; }
+
+    // The current MDL is shorter than want: maybe the headers still fit
+    PMDL mdl = NET_BUFFER_CURRENT_MDL(nb_ptr);
+    ULONG mdl_offset = NET_BUFFER_CURRENT_MDL_OFFSET(nb_ptr);
+    PUCHAR va = (PUCHAR)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+    if (va == NULL) {
+        // Unreadable: classified as an empty frame
+        frame->data = copy;
+        frame->length = 0;
+        return FALSE;
+    }
+    frame->data = va + mdl_offset;
+    frame->length = min(MmGetMdlByteCount(mdl) - mdl_offset, want);
+
+    NET_CLS_KEY key;
+    NET_LPM6_ADDRESS addresses[2];
+    ULONG needed = min(ndisFrameToKey(frame->data, frame->length, &key, addresses), want);
+    if (needed <= frame->length) { return FALSE; }
+
+    // A parse only asks for the next header it cannot see yet (the IP
+    // header, then the ports or an IPv6 extension header), so copy again
+    // until the key is complete
+    do {
+        data = (PUCHAR)NdisGetDataBuffer(nb_ptr, needed, copy, 1, 0);
+        if (data == NULL) { return FALSE; }
+        frame->data = data;
+        frame->length = needed;
+        needed = min(ndisFrameToKey(data, needed, &key, addresses), want);
+    } while (needed > frame->length);
+    return (BOOLEAN)(data == copy);
+}
+
+// Offset of the TCP, UDP or SCTP payload in the first length bytes of
+// frame, whose key ends at end (ndisFrameToKey); 0 when it is not known
+static ULONG inspect_payload_offset(const UCHAR* frame, ULONG length, const NET_CLS_KEY* key, ULONG end) {
+    ULONG l4 = end - NET_BATCH_PORTS_LEN;
+
+    switch (key->protocol) {
+    case 6:
+        if (l4 + 12 >= length || (frame[l4 + 12] >> 4) < 5) { return 0; }
+        return l4 + (ULONG)(frame[l4 + 12] >> 4) * 4;
+    case 17:
+        return l4 + 8;
+    case 132:
+        return l4 + 12;
+    default:
+        return 0;
+    }
+}
+
+// End of the IP datagram in a frame of total bytes, of which length are
+// at frame: Ethernet pads short frames and the padding is no payload. A
+// length field of 0 (jumbogram, large send offload) leaves total.
+static ULONG inspect_datagram_end(const UCHAR* frame, ULONG length, const NET_CLS_KEY* key, ULONG total) {
+    UINT16 ether_type;
+    ULONG ip = ndisFrameNetworkOffset(frame, length, &ether_type);
+    ULONG datagram = 0;
+
+    if ((key->shape & NET_CLS_SHAPE_IP) && ip + 4 <= length) {
+        datagram = ((ULONG)frame[ip + 2] << 8) | frame[ip + 3];
+    } else if ((key->shape & NET_CLS_SHAPE_IP6) && ip + 6 <= length) {
+        datagram = ((ULONG)frame[ip + 4] << 8) | frame[ip + 5];
+        if (datagram != 0) { datagram += NET_BATCH_IPV6_LEN; }
+    }
+    return (datagram != 0 && ip + datagram < total) ? ip + datagram : total;
+}
+
+// The content scan of one payload, continuing its TCP stream when the
+// rule set tracks streams (stream.h)
+typedef struct _INSPECT_SCAN {
+    PNET_STREAM_TABLE   streams;
+    PNET_STREAM_ENTRY   stream;     // NULL - the payload is scanned on its own
+    ULONG               state;      // content automaton
+    ULONG               skip;       // payload bytes left out, seen before
+    ULONG               count;      // payload bytes to scan after them
+    ULONG               next_sequence;
+    UCHAR               tcp_flags;
+} INSPECT_SCAN, * PINSPECT_SCAN;
+
+// tcp is the first 14 bytes of the TCP header, NULL for other protocols
+static VOID inspect_scan_begin(const NET_RULE_SET* rule_set, const NET_CLS_KEY* key, const NET_LPM6_ADDRESS* addresses,
+    const UCHAR* tcp, ULONG length, PINSPECT_SCAN scan) {
+    const NET_CONTENT* content = rule_set->content;
+    ULONG seen = 0;
+
+    RtlZeroMemory(scan, sizeof(INSPECT_SCAN));
+    scan->count = length;
+    if (tcp != NULL && (content->flags & NET_CONTENT_F_STREAM) && (scan->streams = ndisStreamCurrent()) != NULL) {
+        ULONG sequence = ((ULONG)tcp[4] << 24) | ((ULONG)tcp[5] << 16) | ((ULONG)tcp[6] << 8) | tcp[7];
+        scan->tcp_flags = tcp[13];
+        scan->next_sequence = sequence + length;
+        scan->stream = ndisStreamBegin(scan->streams, (ULONG)rule_set->generation, key, addresses, sequence, length,
+            scan->tcp_flags, &scan->skip);
+        if (scan->stream != NULL) {
+            scan->state = scan->stream->state;
+            scan->count = length - scan->skip;
+            seen = scan->stream->scanned;
         }
-        nb_ptr = NET_BUFFER_NEXT_NB(nb_ptr);
     }
-    return FALSE;
+
+    // The depth counts stream bytes when there is a stream
+    if (content->depth != 0) {
+        ULONG left = (seen < content->depth) ? content->depth - seen : 0;
+        if (scan->count > left) { scan->count = left; }
+    }
+}
+
+static VOID inspect_scan_end(PINSPECT_SCAN scan, BOOLEAN matched) {
+    if (scan->stream != NULL && !matched) {
+        ndisStreamEnd(scan->streams, scan->stream, scan->state, scan->next_sequence, scan->count, scan->tcp_flags);
+    }
 }
 
-BOOLEAN inspect_packet(PFLT_NETWORK_DATA packet_data) {
-    BOOLEAN match = FALSE;  // TRUE - drop, FALSE - forward
-    PNET_RULES rule_ptr = __ndisNetRules;
-    while (rule_ptr != NULL) {
-        match = TRUE;
+// Second stage for a frame no header rule matched: the content rules over
+// its payload, read in place MDL by MDL up to the content depth
+static ULONG inspect_content(const NET_RULE_SET* rule_set, PNET_BUFFER nb_ptr, const NET_BATCH_FRAME* frame) {
+    NET_CLS_KEY key;
+    NET_LPM6_ADDRESS addresses[2];
+    INSPECT_SCAN scan;
+    PUCHAR header = inspect_scratch()->header;
+    const UCHAR* data = frame->data;
+    ULONG length = frame->length;
 
-        //UCHAR ether_type[2];
-        if (*((UINT16*)rule_ptr->ether_type) == 0) { DbgPrint("ignore ethertype\n"); /*ignore*/ }
-        else if (memcmp(packet_data->eth_hdr->type, rule_ptr->ether_type, 2) != 0) { 
-            match = FALSE; 
-            rule_ptr = rule_ptr->_next;
-            continue; 
+    ULONG end = ndisFrameToKey(data, length, &key, addresses);
+    if (!(key.shape & NET_CLS_SHAPE_L4)) { return NET_CLS_NO_MATCH; }
+
+    // A header copy ends at the ports; the TCP data offset, sequence number
+    // and flags are a few bytes on
+    if (key.protocol == 6 && end - NET_BATCH_PORTS_LEN + 14 > length) {
+        length = end - NET_BATCH_PORTS_LEN + 14;
+        data = (const UCHAR*)NdisGetDataBuffer(nb_ptr, length, header, 1, 0);
+        if (data == NULL) { return NET_CLS_NO_MATCH; }
+    }
+    ULONG offset = inspect_payload_offset(data, length, &key, end);
+    ULONG total = inspect_datagram_end(data, length, &key, NET_BUFFER_DATA_LENGTH(nb_ptr));
+    if (offset == 0 || offset > total) { return NET_CLS_NO_MATCH; }
+
+    inspect_scan_begin(rule_set, &key, addresses, (key.protocol == 6) ? data + end - NET_BATCH_PORTS_LEN : NULL,
+        total - offset, &scan);
+    ULONG remaining = scan.count;
+    ULONG rule = NET_CLS_NO_MATCH;
+    offset += scan.skip + NET_BUFFER_CURRENT_MDL_OFFSET(nb_ptr);
+    for (PMDL mdl = NET_BUFFER_CURRENT_MDL(nb_ptr); mdl != NULL && remaining != 0; mdl = NDIS_MDL_LINKAGE(mdl)) {
+        ULONG count = MmGetMdlByteCount(mdl);
+        if (offset >= count) {
+            offset -= count;
+            continue;
         }
-        
-        //UCHAR ip_next_protocol[1];
-        if (packet_data->ipv4_hdr != NULL) {
-
-            if (*((UCHAR*)rule_ptr->ip_next_protocol) == 0) { DbgPrint("ignore ipnext\n"); /*ignore*/ }
-            else if (memcmp(packet_data->ipv4_hdr->protocol, rule_ptr->ip_next_protocol, 1) != 0) {
-                match = FALSE;
-                rule_ptr = rule_ptr->_next;
-                continue;
-            }
-        
-            //UCHAR source_ip[4];
-            if (*((UINT32*)rule_ptr->source_ip) == 0) { DbgPrint("ignore srcip\n"); /*ignore*/ }
-            else if (memcmp(packet_data->ipv4_hdr->source_ip, rule_ptr->source_ip, 4) != 0) {
-                match = FALSE;
-                rule_ptr = rule_ptr->_next;
-                continue;
-            }
-        
-            //UCHAR destination_ip[4];
-            if (*((UINT32*)rule_ptr->destination_ip) == 0) { DbgPrint("ignore dstip\n"); /*ignore*/ }
-            else if (memcmp(packet_data->ipv4_hdr->destination_ip, rule_ptr->destination_ip, 4) != 0) {
-                match = FALSE;
-                rule_ptr = rule_ptr->_next;
-                continue;
-            }
+        PUCHAR va = (PUCHAR)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+        if (va == NULL) { break; }
+
+        ULONG chunk = min(count - offset, remaining);
+        rule = ndisContentScan(rule_set->content, &scan.state, &key, va + offset, chunk);
+        if (rule != NET_CLS_NO_MATCH) { break; }
+        remaining -= chunk;
+        offset = 0;
+    }
+    inspect_scan_end(&scan, (BOOLEAN)(rule != NET_CLS_NO_MATCH));
+    return rule;
+}
+
+// Last stage for a frame nothing else matched: the filter programs over
+// its first NET_VM_WINDOW bytes, copied when the header copy holds fewer
+static ULONG inspect_programs(const NET_RULE_SET* rule_set, PNET_BUFFER nb_ptr, const NET_BATCH_FRAME* frame) {
+    PUCHAR window = inspect_scratch()->window;
+    const UCHAR* data = frame->data;
+    ULONG total = NET_BUFFER_DATA_LENGTH(nb_ptr);
+    ULONG length = min(total, NET_VM_WINDOW);
+
+    if (frame->length < length) {
+        data = (const UCHAR*)NdisGetDataBuffer(nb_ptr, length, window, 1, 0);
+        if (data == NULL) { return NET_CLS_NO_MATCH; }
+    }
+    return ndisVmFrame(rule_set->programs, data, length, total);
+}
+
+// Action of a matched rule, content rule or filter program; sets without an
+// image (the benches' derived rules) only drop
+static UCHAR inspect_action(const NET_RULE_SET* rule_set, ULONG rule, USHORT flags) {
+    if (flags & NET_ALERT_F_CONTENT) { return ndisContentRule(rule_set->content, rule)->action; }
+    if (flags & NET_ALERT_F_PROGRAM) { return ndisVmProgram(rule_set->programs, rule)->action; }
+    return (rule_set->image != NULL) ? ndisRuleImageRecord(rule_set->image, rule)[0] : NET_RULE_ACTION_DROP;
+}
+
+// A match of a rate limit rule only holds for a frame whose source is over
+// its rate; frames without a counted source pass, as with counting off
+static ULONG inspect_rate(const NET_RULE_SET* rule_set, ULONG rule, PUSHORT flags, PNET_RATE_TABLE rates,
+    const NET_LPM6_ADDRESS* source, ULONG64 now) {
+    if (rule == NET_CLS_NO_MATCH || inspect_action(rule_set, rule, *flags) != NET_RULE_ACTION_RATE_LIMIT) { return rule; }
+    if (source == NULL || ndisRateAdmit(rates, source, now, rule_set->image->rate_limit, rule_set->image->rate_burst)) {
+        return NET_CLS_NO_MATCH;
+    }
+    *flags |= NET_ALERT_F_RATE;
+    return rule;
+}
+
+// Reads a UDP datagram from port 53 as a DNS response for the domain set
+// (dns.h). frame holds the first length bytes of nb_ptr, or the whole frame
+// when nb_ptr is NULL. Only the first NET_DNS_MESSAGE_MAX bytes are read,
+// copied when they straddle MDLs.
+static VOID inspect_dns(const NET_RULE_SET* rule_set, PNET_BUFFER nb_ptr, const UCHAR* frame, ULONG length, ULONG64 now) {
+    NET_CLS_KEY key;
+    NET_LPM6_ADDRESS addresses[2];
+
+    ULONG end = ndisFrameToKey(frame, length, &key, addresses);
+    if (!(key.shape & NET_CLS_SHAPE_L4) || key.protocol != 17 || key.source_port != NET_DNS_PORT) { return; }
+    ULONG offset = inspect_payload_offset(frame, length, &key, end);
+    ULONG total = inspect_datagram_end(frame, length, &key, (nb_ptr != NULL) ? NET_BUFFER_DATA_LENGTH(nb_ptr) : length);
+    if (offset >= total || offset > NET_BATCH_HDR_MAX) { return; }
+    if (total - offset > NET_DNS_MESSAGE_MAX) { total = offset + NET_DNS_MESSAGE_MAX; }
+    if (nb_ptr != NULL) {
+        frame = (const UCHAR*)NdisGetDataBuffer(nb_ptr, total, inspect_scratch()->dns, 1, 0);
+        if (frame == NULL) { return; }
+    }
+    ndisDnsResponse(rule_set->domains, frame + offset, total - offset, now);
+}
+
+// The header stages of one set for a frame, rule being what the set's
+// classifier said about it. A listed address, or one resolved for a blocked
+// domain, overrides whatever the rules say about the frame. Responses that
+// get past both are parsed in frame order, so they block the frames after
+// them in the same batch.
+static ULONG inspect_headers(const NET_RULE_SET* rule_set, ULONG rule, PNET_BUFFER nb_ptr, const NET_BATCH_FRAME* frame,
+    PNET_RATE_TABLE rates, const NET_LPM6_ADDRESS* source, ULONG64 now, PUSHORT flags) {
+    ULONG listed = (rule_set->reputation != NULL) ?
+        ndisReputationFrame(rule_set->reputation, frame->data, frame->length) : NET_CLS_NO_MATCH;
+    if (listed != NET_CLS_NO_MATCH) {
+        *flags = NET_ALERT_F_REPUTATION;
+        return listed;
+    }
+    if (rule_set->domains != NULL) {
+        listed = ndisDnsCacheFrame(frame->data, frame->length, now);
+        if (listed != NET_CLS_NO_MATCH) {
+            *flags = NET_ALERT_F_DOMAIN;
+            return listed;
+        }
+        inspect_dns(rule_set, nb_ptr, frame->data, frame->length, now);
+    }
+    *flags = 0;
+    return inspect_rate(rule_set, rule, flags, rates, source, now);
+}
+
+// The payload stages of one set for a frame its header stages let through
+static ULONG inspect_payload(const NET_RULE_SET* rule_set, PNET_BUFFER nb_ptr, const NET_BATCH_FRAME* frame,
+    PNET_RATE_TABLE rates, const NET_LPM6_ADDRESS* source, ULONG64 now, PUSHORT flags) {
+    ULONG rule = NET_CLS_NO_MATCH;
+    if (rule_set->content != NULL) {
+        *flags = NET_ALERT_F_CONTENT;
+        rule = inspect_rate(rule_set, inspect_content(rule_set, nb_ptr, frame), flags, rates, source, now);
+    }
+    if (rule == NET_CLS_NO_MATCH && rule_set->programs != NULL) {
+        *flags = NET_ALERT_F_PROGRAM;
+        rule = inspect_rate(rule_set, inspect_programs(rule_set, nb_ptr, frame), flags, rates, source, now);
+    }
+    return rule;
+}
+
+// One frame through the stages mode runs of one set. The payload of a frame
+// whose NBL is dropped already is not read.
+static ULONG inspect_set(const NET_RULE_SET* rule_set, ULONG mode, ULONG rule, PNET_BUFFER nb_ptr, const NET_BATCH_FRAME* frame,
+    BOOLEAN dropped, PNET_RATE_TABLE rates, const NET_LPM6_ADDRESS* source, ULONG64 now, PUSHORT flags) {
+    if (mode != INSPECT_PAYLOAD) {
+        rule = inspect_headers(rule_set, rule, nb_ptr, frame, rates, source, now, flags);
+        if (rule != NET_CLS_NO_MATCH || mode == INSPECT_HEADERS) { return rule; }
+    }
+    return dropped ? NET_CLS_NO_MATCH : inspect_payload(rule_set, nb_ptr, frame, rates, source, now, flags);
+}
+
+// Whether a set has payload stages
+static BOOLEAN inspect_deep(const NET_RULE_SET* rule_set) {
+    return (BOOLEAN)(rule_set->content != NULL || rule_set->programs != NULL);
+}
+
+static VOID inspect_classify(const NET_RULE_SET* rule_set, PNET_FLOW_CACHE flows, const NET_BATCH_FRAME* frames, ULONG frame_count,
+    PULONG rules) {
+    if (rule_set->classifier != NULL) {
+        ndisClassifyBatch(rule_set->classifier, flows, (ULONG)rule_set->generation, frames, frame_count, rules);
+    } else {
+        for (ULONG i = 0; i < frame_count; i++) { rules[i] = NET_CLS_NO_MATCH; }
+    }
+}
+
+static VOID inspect_flush(PNET_RULE_SET rule_set, ULONG mode, const NET_BATCH_FRAME* frames, PNET_BUFFER* nbs, const UCHAR* owners,
+    ULONG frame_count, PUCHAR verdicts) {
+    PULONG rules = inspect_scratch()->rules;
+    PULONG base_rules = inspect_scratch()->base_rules;
+    const NET_RULE_SET* base = rule_set->base;
+    PNET_RATE_TABLE rates = ndisRateCurrent();
+    PNET_METER_TABLE meters = (mode != INSPECT_PAYLOAD) ? ndisMeterCurrent() : NULL;
+    ULONG64 now = (rates != NULL || meters != NULL || rule_set->domains != NULL || (base != NULL && base->domains != NULL)) ?
+        KeQueryInterruptTime() : 0;
+    BOOLEAN defer = (BOOLEAN)(mode == INSPECT_HEADERS && (inspect_deep(rule_set) || (base != NULL && inspect_deep(base))));
+    ULONG base_mode = mode;
+    if (base != NULL && mode != INSPECT_ALL && inspect_deep(rule_set)) {
+        // All of the base goes after the payload stages of the overlay;
+        // INSPECT_VERDICTS - not run yet
+        base_mode = (mode == INSPECT_PAYLOAD) ? INSPECT_ALL : INSPECT_VERDICTS;
+    }
+
+    // Called inside an epoch section, so this processor's flow cache, rate
+    // table, flow meter and alert ring are ours. The cache holds the
+    // verdicts of one generation per flow, and it goes to the base: an
+    // overlay is a few rules of one adapter, classified directly. Its
+    // frames all go through the base classifier too, which keeps that batch
+    // whole.
+    if (mode == INSPECT_PAYLOAD) {
+        for (ULONG i = 0; i < frame_count; i++) { rules[i] = NET_CLS_NO_MATCH; }
+    } else if (base == NULL) {
+        inspect_classify(rule_set, ndisFlowCacheCurrent(), frames, frame_count, rules);
+    } else {
+        inspect_classify(rule_set, NULL, frames, frame_count, rules);
+    }
+    if (meters != NULL) { ndisMeterExpire(meters, now, NET_METER_EXPIRE_BATCH); }
+    if (base != NULL && base_mode == INSPECT_PAYLOAD) {
+        for (ULONG i = 0; i < frame_count; i++) { base_rules[i] = NET_CLS_NO_MATCH; }
+    } else if (base != NULL && base_mode != INSPECT_VERDICTS) {
+        inspect_classify(base, ndisFlowCacheCurrent(), frames, frame_count, base_rules);
+    }
+    for (ULONG i = 0; i < frame_count; i++) {
+        NET_LPM6_ADDRESS address;
+        const NET_LPM6_ADDRESS* source = NULL;
+        const NET_RULE_SET* matched = rule_set;
+        BOOLEAN dropped = (BOOLEAN)(verdicts[owners[i]] == INSPECT_DROP);
+        USHORT flags = 0;
+        if (mode == INSPECT_PAYLOAD && dropped) { continue; }
+        if (meters != NULL) { ndisMeterFrame(meters, frames[i].data, frames[i].length, NET_BUFFER_DATA_LENGTH(nbs[i]), now); }
+        if (rates != NULL && ndisRateSource(frames[i].data, frames[i].length, &address)) {
+            source = &address;
+            if (mode != INSPECT_PAYLOAD) { ndisRateCount(rates, source, now); }
         }
-        
-        if (packet_data->tcp_hdr != NULL) {
-
-            //UCHAR source_port[2];
-            if (*((UINT16*)rule_ptr->source_port) == 0) { DbgPrint("ignore srcport\n"); /*ignore*/ }
-            else if (memcmp(packet_data->tcp_hdr->source_port, rule_ptr->source_port, 2) != 0) {
-                match = FALSE;
-                rule_ptr = rule_ptr->_next;
-                continue;
+        ULONG rule = inspect_set(rule_set, mode, rules[i], nbs[i], &frames[i], dropped, rates, source, now, &flags);
+        if (base != NULL) {
+            if (rule != NET_CLS_NO_MATCH) {
+                flags |= NET_ALERT_F_OVERLAY;
+            } else if (base_mode != INSPECT_VERDICTS) {
+                matched = base;
+                rule = inspect_set(base, base_mode, base_rules[i], nbs[i], &frames[i], dropped, rates, source, now, &flags);
             }
-        
-            //UCHAR destination_port[2];
-            if (*((UINT16*)rule_ptr->destination_port) == 0) { DbgPrint("ignore dstport\n"); /*ignore*/ }
-            else if (memcmp(packet_data->tcp_hdr->destination_port, rule_ptr->destination_port, 2) != 0) {
-                match = FALSE;
-                rule_ptr = rule_ptr->_next;
-                continue;
+        }
+        if (rule != NET_CLS_NO_MATCH) {
+            ndisAlertRecord(rule, flags, (ULONG)matched->generation, frames[i].data, frames[i].length,
+                NET_BUFFER_DATA_LENGTH(nbs[i]));
+            verdicts[owners[i]] = INSPECT_DROP;
+        } else if (defer && verdicts[owners[i]] == INSPECT_PASS) {
+            verdicts[owners[i]] = INSPECT_DEFER;
+        }
+    }
+}
+
+static BOOLEAN inspect_empty(const NET_RULE_SET* rule_set, ULONG mode) {
+    if (mode == INSPECT_PAYLOAD) { return (BOOLEAN)!inspect_deep(rule_set); }
+    return (BOOLEAN)(rule_set->classifier == NULL && rule_set->content == NULL && rule_set->reputation == NULL &&
+        rule_set->domains == NULL && rule_set->programs == NULL);
+}
+
+ULONG inspect_batch(PNET_RULE_SET rule_set, ULONG mode, PNET_BUFFER_LIST nbl_chain, PNET_BUFFER_LIST* nbls, PUCHAR verdicts) {
+    // An NBL is dropped when any of its NBs matches, as before. NBs of one
+    // NBL may be split across several classifier batches.
+    PINSPECT_SCRATCH scratch = inspect_scratch();
+    PNET_BATCH_FRAME frames = scratch->frames;
+    PNET_BUFFER*    nbs = scratch->nbs;
+    PUCHAR          owners = scratch->owners;
+    ULONG           frame_count = 0;
+    ULONG           copy_count = 0;
+    ULONG           nbl_count = 0;
+    BOOLEAN         inspect = (BOOLEAN)(rule_set != NULL &&
+        (!inspect_empty(rule_set, mode) || (rule_set->base != NULL && !inspect_empty(rule_set->base, mode)) ||
+        (mode != INSPECT_PAYLOAD && ndisMeterCurrent() != NULL)));
+
+    for (PNET_BUFFER_LIST nbl_ptr = nbl_chain; nbl_ptr != NULL && nbl_count < NET_BATCH_MAX; nbl_ptr = NET_BUFFER_LIST_NEXT_NBL(nbl_ptr)) {
+        nbls[nbl_count] = nbl_ptr;
+        verdicts[nbl_count] = INSPECT_PASS;
+
+        if (inspect) {
+            for (PNET_BUFFER nb_ptr = NET_BUFFER_LIST_FIRST_NB(nbl_ptr); nb_ptr != NULL; nb_ptr = NET_BUFFER_NEXT_NB(nb_ptr)) {
+                // A batch ends when it is full or out of header copies
+                if (frame_count == NET_BATCH_MAX || copy_count == INSPECT_COPY_SLOTS) {
+                    inspect_flush(rule_set, mode, frames, nbs, owners, frame_count, verdicts);
+                    frame_count = 0;
+                    copy_count = 0;
+                }
+                if (inspect_frame(nb_ptr, &frames[frame_count], scratch->copies[copy_count])) { copy_count++; }
+                nbs[frame_count] = nb_ptr;
+                owners[frame_count] = (UCHAR)nbl_count;
+                frame_count++;
             }
         }
-        break;
+        nbl_count++;
+    }
+
+    if (frame_count != 0) {
+        inspect_flush(rule_set, mode, frames, nbs, owners, frame_count, verdicts);
+    }
+    return nbl_count;
+}
+
+VOID inspect_chain(PNET_RULE_SET rule_set, ULONG mode, PNET_BUFFER_LIST nbl_chain, PNET_BUFFER_LIST* chains, PULONG counts) {
+    PNET_BUFFER_LIST*   nbls = inspect_scratch()->nbls;
+    PUCHAR              verdicts = inspect_scratch()->verdicts;
+    PNET_BUFFER_LIST*   tails[INSPECT_VERDICTS];
+
+    for (ULONG v = 0; v < INSPECT_VERDICTS; v++) {
+        tails[v] = &chains[v];
+        counts[v] = 0;
+    }
+
+    while (nbl_chain != NULL) {
+        ULONG nbl_count = inspect_batch(rule_set, mode, nbl_chain, nbls, verdicts);
+        nbl_chain = NET_BUFFER_LIST_NEXT_NBL(nbls[nbl_count - 1]);
+
+        for (ULONG i = 0; i < nbl_count; i++) {
+            *tails[verdicts[i]] = nbls[i];
+            tails[verdicts[i]] = &NET_BUFFER_LIST_NEXT_NBL(nbls[i]);
+            counts[verdicts[i]]++;
+        }
     }
-        
-    return match;
+
+    for (ULONG v = 0; v < INSPECT_VERDICTS; v++) { *tails[v] = NULL; }
+}
+
+// inspect_content for a whole frame of length bytes at frame
+static ULONG inspect_packet_content(const NET_RULE_SET* rule_set, const UCHAR* frame, ULONG length, const NET_CLS_KEY* key,
+    const NET_LPM6_ADDRESS* addresses, ULONG end) {
+    INSPECT_SCAN scan;
+    ULONG offset = inspect_payload_offset(frame, length, key, end);
+    ULONG total = inspect_datagram_end(frame, length, key, length);
+    if (offset == 0 || offset > total) { return NET_CLS_NO_MATCH; }
+    const UCHAR* tcp = frame + end - NET_BATCH_PORTS_LEN;
+    if (key->protocol == 6 && tcp + 14 > frame + length) { return NET_CLS_NO_MATCH; }
+
+    inspect_scan_begin(rule_set, key, addresses, (key->protocol == 6) ? tcp : NULL, total - offset, &scan);
+    ULONG rule = (scan.count != 0) ?
+        ndisContentScan(rule_set->content, &scan.state, key, frame + offset + scan.skip, scan.count) : NET_CLS_NO_MATCH;
+    inspect_scan_end(&scan, (BOOLEAN)(rule != NET_CLS_NO_MATCH));
+    return rule;
+}
+
+// inspect_set for a whole frame; TRUE - drop
+static BOOLEAN inspect_packet_set(const NET_RULE_SET* rule_set, const UCHAR* frame, ULONG length, const NET_CLS_KEY* key,
+    const NET_LPM6_ADDRESS* addresses, ULONG end, PNET_RATE_TABLE rates, const NET_LPM6_ADDRESS* source, ULONG64 now) {
+    USHORT flags = 0;
+    if (rule_set->reputation != NULL && ndisReputationFrame(rule_set->reputation, frame, length) != NET_CLS_NO_MATCH) {
+        return TRUE;
+    }
+    if (rule_set->domains != NULL) {
+        if (ndisDnsCacheFrame(frame, length, now) != NET_CLS_NO_MATCH) { return TRUE; }
+        inspect_dns(rule_set, NULL, frame, length, now);
+    }
+    if (rule_set->classifier != NULL) {
+        NET_CLS_KEY resolved = *key;
+        if (key->shape & NET_CLS_SHAPE_IP6) { ndisClsResolve6(rule_set->classifier, &resolved, addresses); }
+        if (inspect_rate(rule_set, ndisClassify(rule_set->classifier, &resolved), &flags, rates, source, now) != NET_CLS_NO_MATCH) {
+            return TRUE;
+        }
+    }
+    if (rule_set->content != NULL && (key->shape & NET_CLS_SHAPE_L4)) {
+        flags = NET_ALERT_F_CONTENT;
+        if (inspect_rate(rule_set, inspect_packet_content(rule_set, frame, length, key, addresses, end),
+            &flags, rates, source, now) != NET_CLS_NO_MATCH) {
+            return TRUE;
+        }
+    }
+    if (rule_set->programs == NULL) { return FALSE; }
+    flags = NET_ALERT_F_PROGRAM;
+    return (BOOLEAN)(inspect_rate(rule_set, ndisVmFrame(rule_set->programs, frame, length, length),
+        &flags, rates, source, now) != NET_CLS_NO_MATCH);
+}
+
+BOOLEAN inspect_packet(PNET_RULE_SET rule_set, PFLT_NETWORK_DATA packet_data) {
+    // TRUE - drop, FALSE - forward
+    if (rule_set == NULL) { return FALSE; }
+
+    NET_CLS_KEY key;
+    NET_LPM6_ADDRESS addresses[2];
+    NET_LPM6_ADDRESS address;
+    const NET_LPM6_ADDRESS* source = NULL;
+    const UCHAR* frame = (const UCHAR*)packet_data->eth_hdr;
+    const NET_RULE_SET* base = rule_set->base;
+    PNET_RATE_TABLE rates = ndisRateCurrent();
+    PNET_METER_TABLE meters = ndisMeterCurrent();
+    ULONG64 now = 0;
+    if (rates != NULL || meters != NULL || rule_set->domains != NULL || (base != NULL && base->domains != NULL)) { now = KeQueryInterruptTime(); }
+    if (meters != NULL) {
+        ndisMeterExpire(meters, now, NET_METER_EXPIRE_BATCH);
+        ndisMeterFrame(meters, frame, packet_data->length, packet_data->length, now);
+    }
+    if (rates != NULL && ndisRateSource(frame, packet_data->length, &address)) {
+        source = &address;
+        ndisRateCount(rates, source, now);
+    }
+
+    ULONG end = ndisFrameToKey(frame, packet_data->length, &key, addresses);
+    if (inspect_packet_set(rule_set, frame, packet_data->length, &key, addresses, end, rates, source, now)) { return TRUE; }
+    return (BOOLEAN)(base != NULL && inspect_packet_set(base, frame, packet_data->length, &key, addresses, end, rates, source, now));
 }
 
 VOID dump_packet(PFLT_NETWORK_DATA packet_data) {
+    if (packet_data->eth_hdr == NULL) { return; }
     ETHER_HDR_DUMP(packet_data->eth_hdr);
     if (packet_data->arp_hdr != NULL) { ARP_HDR_DUMP(packet_data->arp_hdr); }
     if (packet_data->ipv4_hdr != NULL) { IPV4_HDR_DUMP(packet_data->ipv4_hdr); }
+    if (packet_data->ipv6_hdr != NULL) { IPV6_HDR_DUMP(packet_data->ipv6_hdr); }
     if (packet_data->tcp_hdr != NULL) { TCP_HDR_DUMP(packet_data->tcp_hdr); }
+    if (packet_data->udp_hdr != NULL) { UDP_HDR_DUMP(packet_data->udp_hdr); }
 }
\ No newline at end of file
@@ -63,6 +63,24 @@ typedef struct _IPV4_HDR {
 
 PIPV4_HDR get_ipv4hdr(PUCHAR frame);
 
+typedef struct _IPV6_HDR {
+    UCHAR   version_class_flow[4];
+    UCHAR   payload_len[2];
+    UCHAR   next_header[1];
+    UCHAR   hop_limit[1];
+    UCHAR   source_ip[16];
+    UCHAR   destination_ip[16];
+}IPV6_HDR, * PIPV6_HDR;
+#define IPV6_HDR_DUMP(ip)   DbgPrint("\nIPV6: ");    \
+                            DbgPrint("\tversion_class_flow: ");   _dump_bytes(ip->version_class_flow,4);\
+                            DbgPrint("\tpayload_len: ");          _dump_bytes(ip->payload_len,2       );\
+                            DbgPrint("\tnext_header: ");          _dump_bytes(ip->next_header,1       );\
+                            DbgPrint("\thop_limit: ");            _dump_bytes(ip->hop_limit,1         );\
+                            DbgPrint("\tsource_ip: ");            _dump_bytes(ip->source_ip,16        );\
+                            DbgPrint("\tdestination_ip: ");       _dump_bytes(ip->destination_ip,16   );
+
+PIPV6_HDR get_ipv6hdr(PUCHAR frame);
+
 typedef struct _TCP_HDR {
     UCHAR   source_port[2];
     UCHAR   destination_port[2];
@@ -85,17 +103,72 @@ typedef struct _TCP_HDR {
 
 PTCP_HDR get_tcphdr(PUCHAR frame);
 
+typedef struct _UDP_HDR {
+    UCHAR   source_port[2];
+    UCHAR   destination_port[2];
+    UCHAR   length[2];
+    UCHAR   checksum[2];
+}UDP_HDR, * PUDP_HDR;
+#define UDP_HDR_DUMP(udp)   DbgPrint("\nUDP: ");    \
+                            DbgPrint("\tsource_port: ");_dump_bytes(udp->source_port,2      );\
+                            DbgPrint("\tdestination_port: ");_dump_bytes(udp->destination_port,2 );\
+                            DbgPrint("\tlength: ");_dump_bytes(udp->length,2           );\
+                            DbgPrint("\tchecksum: ");_dump_bytes(udp->checksum,2         );
+
+PUDP_HDR get_udphdr(PUCHAR frame);
+
 typedef struct _FLT_NETWORK_DATA {
     PETHRENET_HDR eth_hdr;
+    ULONG length;               // contiguous bytes at eth_hdr
     PARP_HDR arp_hdr;
     PIPV4_HDR ipv4_hdr;
+    PIPV6_HDR ipv6_hdr;
     PTCP_HDR tcp_hdr;
+    PUDP_HDR udp_hdr;
 }FLT_NETWORK_DATA, * PFLT_NETWORK_DATA;
 
-FLT_NETWORK_DATA parse_frame(PUCHAR frame);
+// Every header pointer is NULL unless the whole header lies within length
+// bytes of frame. VLAN tags, IPv4 options and IPv6 extension headers are
+// skipped.
+FLT_NETWORK_DATA parse_frame(PUCHAR frame, ULONG length);
+
+// What inspect_batch and inspect_chain run. The header stages are the
+// reputation set, the domain set and the header rules; the payload stages
+// are the content rules and the filter programs, which read past the
+// headers and cost the most. INSPECT_HEADERS is the fast path of deferred
+// inspection (defer.h): a frame the header stages let through is deferred
+// when a payload stage is still to see it, and INSPECT_PAYLOAD later runs
+// only those stages over it. Sources are counted and flows metered
+// (meter.h) by the header stages, with or without rules to run.
+// An overlay with payload stages defers all of the base, which has to run
+// after them. Split that way, an NBL gets the verdict INSPECT_ALL gives
+// it, except that a rate limit content rule reads the rate of the source
+// when the payload is inspected.
+#define INSPECT_ALL         0
+#define INSPECT_HEADERS     1
+#define INSPECT_PAYLOAD     2
+
+// Verdicts, per NBL
+#define INSPECT_PASS        0
+#define INSPECT_DROP        1
+#define INSPECT_DEFER       2       // INSPECT_HEADERS only
+#define INSPECT_VERDICTS    3
+
+#define INSPECT_TAG         '1snI'
+
+// Per-processor arrays of inspect_batch and inspect_chain, which run only
+// once this has succeeded
+BOOLEAN inspect_init();
+VOID inspect_cleanup();
 
-BOOLEAN inspect_list(PNET_BUFFER_LIST nbl_ptr);
-BOOLEAN inspect_packet(PFLT_NETWORK_DATA packet_data);
+// Classifies up to NET_BATCH_MAX NBLs from the head of nbl_chain, filling
+// nbls[] and verdicts[] in chain order. The chain is not modified.
+ULONG inspect_batch(PNET_RULE_SET rule_set, ULONG mode, PNET_BUFFER_LIST nbl_chain, PNET_BUFFER_LIST* nbls, PUCHAR verdicts);
+// Splits a whole chain into one NULL-terminated chain per verdict, chains
+// and counts being indexed by INSPECT_PASS, INSPECT_DROP and INSPECT_DEFER
+// and the original order kept within each.
+VOID inspect_chain(PNET_RULE_SET rule_set, ULONG mode, PNET_BUFFER_LIST nbl_chain, PNET_BUFFER_LIST* chains, PULONG counts);
+BOOLEAN inspect_packet(PNET_RULE_SET rule_set, PFLT_NETWORK_DATA packet_data);
 VOID dump_packet(PFLT_NETWORK_DATA packet_data);
 
 
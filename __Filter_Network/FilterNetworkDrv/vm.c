@@ -0,0 +1,396 @@
+#include "portable.h"
+#include "epoch.h"
+#include "rules.h"
+#include "lpm.h"
+#include "classifier.h"
+#include "flowcache.h"
+#include "batch.h"
+#include "vm.h"
+
+C_ASSERT(sizeof(NET_VM_INSN) == 8);
+C_ASSERT(sizeof(NET_VM_PROGRAM) == 16);
+C_ASSERT(sizeof(NET_VM_PROGRAMS) == 24);
+C_ASSERT(NET_VM_MAX_COST < 0x10000);
+
+static ULONG vmAlign(ULONG offset) {
+    return (offset + 7) & ~(ULONG)7;
+}
+
+static FORCEINLINE const NET_VM_INSN* vmInsns(const NET_VM_PROGRAMS* programs) {
+    return (const NET_VM_INSN*)((const UCHAR*)programs + programs->insns_offset);
+}
+
+// Opcodes that take their operand from src when NET_VM_X is set
+static BOOLEAN vmTakesX(UCHAR op) {
+    return (BOOLEAN)(op == NET_VM_RET || (op >= NET_VM_MOV && op <= NET_VM_RSH) || (op >= NET_VM_JEQ && op <= NET_VM_JSET));
+}
+
+// Opcodes that write dst
+static BOOLEAN vmWrites(UCHAR op) {
+    return (BOOLEAN)((op >= NET_VM_LDB && op <= NET_VM_NEG) || op == NET_VM_NEXT);
+}
+
+// One instruction on its own: opcode, registers and operands in range,
+// jumps within the count instructions
+static ULONG vmVerifyInsn(const NET_VM_INSN* insn, ULONG pc, ULONG count) {
+    UCHAR op = insn->opcode & ~NET_VM_X;
+
+    if (op >= NET_VM_OPCODES || ((insn->opcode & NET_VM_X) && !vmTakesX(op))) { return NET_VM_E_OPCODE; }
+    if (op != NET_VM_RET && op != NET_VM_JA && insn->dst >= NET_VM_REGISTERS) { return NET_VM_E_REGISTER; }
+    if ((insn->opcode & NET_VM_X) && insn->src >= NET_VM_REGISTERS) { return NET_VM_E_REGISTER; }
+
+    switch (op) {
+    case NET_VM_LDB:
+    case NET_VM_LDH:
+    case NET_VM_LDW:
+        if (insn->src != NET_VM_NONE && insn->src >= NET_VM_REGISTERS) { return NET_VM_E_REGISTER; }
+        if (insn->jump >= NET_VM_BASES || insn->imm > NET_VM_WINDOW) { return NET_VM_E_OPERAND; }
+        break;
+    case NET_VM_LEN:
+        if (insn->jump >= NET_VM_BASES) { return NET_VM_E_OPERAND; }
+        break;
+    case NET_VM_META:
+        if (insn->imm >= NET_VM_META_COUNT) { return NET_VM_E_OPERAND; }
+        break;
+    case NET_VM_DIV:
+    case NET_VM_MOD:
+        if (!(insn->opcode & NET_VM_X) && insn->imm == 0) { return NET_VM_E_DIVIDE; }
+        break;
+    case NET_VM_LSH:
+    case NET_VM_RSH:
+        if (!(insn->opcode & NET_VM_X) && insn->imm >= 32) { return NET_VM_E_OPERAND; }
+        break;
+    case NET_VM_JA:
+        if ((UINT64)pc + 1 + insn->imm >= count) { return NET_VM_E_JUMP; }
+        break;
+    case NET_VM_NEXT:
+        if (insn->imm == 0 || insn->imm > NET_VM_LOOP_MAX || insn->jump == 0 || insn->jump > pc) { return NET_VM_E_LOOP; }
+        break;
+    default:
+        if (op >= NET_VM_JEQ && op <= NET_VM_JSET && pc + 1 + insn->jump >= count) { return NET_VM_E_JUMP; }
+        break;
+    }
+    return NET_VM_OK;
+}
+
+ULONG ndisVmVerify(const NET_VM_INSN* code, ULONG count, PULONG cost, PULONG error_pc) {
+    UINT64 total = 0;
+    ULONG pc;
+
+    *error_pc = 0;
+    if (count == 0 || count > NET_VM_MAX_INSNS) { return NET_VM_E_LENGTH; }
+
+    for (pc = 0; pc < count; pc++) {
+        ULONG error = vmVerifyInsn(&code[pc], pc, count);
+        if (error != NET_VM_OK) {
+            *error_pc = pc;
+            return error;
+        }
+    }
+    if ((code[count - 1].opcode & ~NET_VM_X) != NET_VM_RET) {
+        *error_pc = count - 1;
+        return NET_VM_E_END;
+    }
+
+    // Loops: each body [pc - jump, pc) leaves its register alone and lies
+    // inside or outside of every loop closed before it. Quadratic, but
+    // programs are short and verified once per load.
+    for (pc = 0; pc < count; pc++) {
+        if (code[pc].opcode != NET_VM_NEXT) { continue; }
+        ULONG start = pc - code[pc].jump;
+        for (ULONG i = start; i < pc; i++) {
+            if (vmWrites(code[i].opcode & ~NET_VM_X) && code[i].dst == code[pc].dst) {
+                *error_pc = i;
+                return NET_VM_E_LOOP_REGISTER;
+            }
+            if (code[i].opcode == NET_VM_NEXT && i - code[i].jump < start) {
+                *error_pc = pc;
+                return NET_VM_E_LOOP;
+            }
+        }
+    }
+
+    // Cost: every instruction as many times as the loops around it allow
+    for (pc = 0; pc < count; pc++) {
+        UINT64 times = 1;
+        for (ULONG i = pc; i < count && times <= NET_VM_MAX_COST; i++) {
+            if (code[i].opcode == NET_VM_NEXT && i - code[i].jump <= pc) { times *= code[i].imm; }
+        }
+        total += times;
+        if (total > NET_VM_MAX_COST) {
+            *error_pc = pc;
+            return NET_VM_E_COST;
+        }
+    }
+    *cost = (ULONG)total;
+    return NET_VM_OK;
+}
+
+VOID ndisVmFrameContext(const UCHAR* frame, ULONG length, ULONG frame_length, PNET_VM_CONTEXT context) {
+    NET_CLS_KEY key;
+    NET_LPM6_ADDRESS addresses[2];
+    ULONG i;
+
+    context->data = frame;
+    context->length = (length < NET_VM_WINDOW) ? length : NET_VM_WINDOW;
+    for (i = 0; i < NET_VM_BASES; i++) { context->base[i] = NET_VM_NO_BASE; }
+    for (i = 0; i < NET_VM_META_COUNT; i++) { context->meta[i] = 0; }
+    length = context->length;
+
+    ULONG end = ndisFrameToKey(frame, length, &key, addresses);
+    context->base[NET_VM_BASE_FRAME] = 0;
+    context->meta[NET_VM_META_ETHER_TYPE] = key.ether_type;
+    context->meta[NET_VM_META_LENGTH] = frame_length;
+    if (!(key.shape & (NET_CLS_SHAPE_IP | NET_CLS_SHAPE_IP6))) { return; }
+
+    UINT16 ether_type;
+    ULONG ip = ndisFrameNetworkOffset(frame, length, &ether_type);
+    context->base[NET_VM_BASE_NETWORK] = ip;
+    context->meta[NET_VM_META_PROTOCOL] = key.protocol;
+    if (!(key.shape & NET_CLS_SHAPE_L4) || end > length) { return; }
+
+    ULONG l4 = end - NET_BATCH_PORTS_LEN;
+    context->base[NET_VM_BASE_TRANSPORT] = l4;
+    context->meta[NET_VM_META_SOURCE_PORT] = key.source_port;
+    context->meta[NET_VM_META_DEST_PORT] = key.destination_port;
+
+    ULONG payload;
+    switch (key.protocol) {
+    case 6:
+        if (l4 + 12 >= length || (frame[l4 + 12] >> 4) < 5) { return; }
+        payload = l4 + (ULONG)(frame[l4 + 12] >> 4) * 4;
+        break;
+    case 17:
+        payload = l4 + 8;
+        break;
+    default:
+        payload = l4 + 12;
+        break;
+    }
+
+    // The payload ends with the datagram, not with the Ethernet padding
+    ULONG datagram = 0;
+    if (key.shape & NET_CLS_SHAPE_IP) {
+        datagram = ((ULONG)frame[ip + 2] << 8) | frame[ip + 3];
+    } else if ((datagram = ((ULONG)frame[ip + 4] << 8) | frame[ip + 5]) != 0) {
+        datagram += NET_BATCH_IPV6_LEN;
+    }
+    ULONG total = (datagram != 0 && ip + datagram < frame_length) ? ip + datagram : frame_length;
+    if (payload > total) { return; }
+    context->base[NET_VM_BASE_PAYLOAD] = payload;
+    context->meta[NET_VM_META_PAYLOAD] = total - payload;
+}
+
+// Loads return 0 from the whole program when out of the window, hence the
+// out parameter
+static FORCEINLINE BOOLEAN vmLoad(const NET_VM_CONTEXT* context, const NET_VM_INSN* insn, const ULONG* r, ULONG width, PULONG value) {
+    ULONG base = context->base[insn->jump];
+    UINT64 at = (UINT64)base + insn->imm + ((insn->src != NET_VM_NONE) ? r[insn->src] : 0);
+    const UCHAR* p;
+
+    if (base == NET_VM_NO_BASE || at + width > context->length) { return FALSE; }
+    p = context->data + at;
+    switch (width) {
+    case 1:
+        *value = p[0];
+        break;
+    case 2:
+        *value = ((ULONG)p[0] << 8) | p[1];
+        break;
+    default:
+        *value = ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+        break;
+    }
+    return TRUE;
+}
+
+ULONG ndisVmRun(const NET_VM_INSN* code, const NET_VM_CONTEXT* context) {
+    ULONG r[NET_VM_REGISTERS] = { 0 };
+
+    // A verified program ends with NET_VM_RET and jumps within itself, so
+    // pc needs no check
+    for (const NET_VM_INSN* insn = code; ; insn++) {
+        ULONG operand = (insn->opcode & NET_VM_X) ? r[insn->src] : insn->imm;
+        ULONG base;
+
+        switch (insn->opcode & ~NET_VM_X) {
+        case NET_VM_RET:
+            return operand;
+        case NET_VM_LDB:
+            if (!vmLoad(context, insn, r, 1, &r[insn->dst])) { return 0; }
+            break;
+        case NET_VM_LDH:
+            if (!vmLoad(context, insn, r, 2, &r[insn->dst])) { return 0; }
+            break;
+        case NET_VM_LDW:
+            if (!vmLoad(context, insn, r, 4, &r[insn->dst])) { return 0; }
+            break;
+        case NET_VM_LEN:
+            base = context->base[insn->jump];
+            r[insn->dst] = (base == NET_VM_NO_BASE || base > context->length) ? 0 : context->length - base;
+            break;
+        case NET_VM_META:
+            r[insn->dst] = context->meta[insn->imm];
+            break;
+        case NET_VM_MOV:
+            r[insn->dst] = operand;
+            break;
+        case NET_VM_ADD:
+            r[insn->dst] += operand;
+            break;
+        case NET_VM_SUB:
+            r[insn->dst] -= operand;
+            break;
+        case NET_VM_MUL:
+            r[insn->dst] *= operand;
+            break;
+        case NET_VM_DIV:
+            if (operand == 0) { return 0; }
+            r[insn->dst] /= operand;
+            break;
+        case NET_VM_MOD:
+            if (operand == 0) { return 0; }
+            r[insn->dst] %= operand;
+            break;
+        case NET_VM_AND:
+            r[insn->dst] &= operand;
+            break;
+        case NET_VM_OR:
+            r[insn->dst] |= operand;
+            break;
+        case NET_VM_XOR:
+            r[insn->dst] ^= operand;
+            break;
+        case NET_VM_LSH:
+            r[insn->dst] <<= (operand & 31);
+            break;
+        case NET_VM_RSH:
+            r[insn->dst] >>= (operand & 31);
+            break;
+        case NET_VM_NEG:
+            r[insn->dst] = 0 - r[insn->dst];
+            break;
+        case NET_VM_JA:
+            insn += insn->imm;
+            break;
+        case NET_VM_JEQ:
+            if (r[insn->dst] == operand) { insn += insn->jump; }
+            break;
+        case NET_VM_JNE:
+            if (r[insn->dst] != operand) { insn += insn->jump; }
+            break;
+        case NET_VM_JGT:
+            if (r[insn->dst] > operand) { insn += insn->jump; }
+            break;
+        case NET_VM_JGE:
+            if (r[insn->dst] >= operand) { insn += insn->jump; }
+            break;
+        case NET_VM_JLT:
+            if (r[insn->dst] < operand) { insn += insn->jump; }
+            break;
+        case NET_VM_JLE:
+            if (r[insn->dst] <= operand) { insn += insn->jump; }
+            break;
+        case NET_VM_JSET:
+            if (r[insn->dst] & operand) { insn += insn->jump; }
+            break;
+        default:    // NET_VM_NEXT
+            if (r[insn->dst] < insn->imm - 1) {
+                r[insn->dst]++;
+                insn -= (ULONG)insn->jump + 1;
+            }
+            break;
+        }
+    }
+}
+
+PNET_VM_PROGRAMS ndisBuildVmPrograms(const NET_VM_PROGRAM* programs, ULONG program_count, const NET_VM_INSN* code, ULONG insn_count) {
+    ULONG total = 0;
+    ULONG i;
+
+    if (program_count > NET_VM_MAX_PROGRAMS || insn_count > NET_VM_MAX_PROGRAMS * NET_VM_MAX_INSNS) { return NULL; }
+    for (i = 0; i < program_count; i++) {
+        ULONG cost, error_pc;
+        if (programs[i].action > NET_RULE_ACTION_RATE_LIMIT || programs[i].first > insn_count ||
+            programs[i].count > insn_count - programs[i].first ||
+            ndisVmVerify(code + programs[i].first, programs[i].count, &cost, &error_pc) != NET_VM_OK) {
+            return NULL;
+        }
+        total += cost;
+    }
+
+    ULONG insns_offset = vmAlign(sizeof(NET_VM_PROGRAMS) + program_count * sizeof(NET_VM_PROGRAM));
+    ULONG size = insns_offset + insn_count * sizeof(NET_VM_INSN);
+    PNET_VM_PROGRAMS blob = (PNET_VM_PROGRAMS)NETFLT_ALLOC(size, NET_VM_TAG);
+    if (blob == NULL) { return NULL; }
+    RtlZeroMemory(blob, size);
+
+    blob->size = size;
+    blob->program_count = program_count;
+    blob->insn_count = insn_count;
+    blob->cost = total;
+    blob->programs_offset = sizeof(NET_VM_PROGRAMS);
+    blob->insns_offset = insns_offset;
+
+    PNET_VM_PROGRAM out = (PNET_VM_PROGRAM)((PUCHAR)blob + blob->programs_offset);
+    for (i = 0; i < program_count; i++) {
+        ULONG error_pc;
+        out[i].action = programs[i].action;
+        out[i].first = programs[i].first;
+        out[i].count = programs[i].count;
+        ndisVmVerify(code + programs[i].first, programs[i].count, &out[i].cost, &error_pc);
+    }
+    if (insn_count != 0) { RtlCopyMemory((PUCHAR)blob + insns_offset, code, insn_count * sizeof(NET_VM_INSN)); }
+    return blob;
+}
+
+VOID ndisFreeVmPrograms(PNET_VM_PROGRAMS programs) {
+    if (programs != NULL) {
+        NETFLT_FREE(programs, NET_VM_TAG);
+    }
+}
+
+BOOLEAN ndisValidateVmPrograms(const NET_VM_PROGRAMS* programs, ULONG size) {
+    UINT64 total = 0;
+
+    if (size < sizeof(NET_VM_PROGRAMS) || programs->size != size) { return FALSE; }
+    if (programs->program_count > NET_VM_MAX_PROGRAMS || programs->insn_count > NET_VM_MAX_PROGRAMS * NET_VM_MAX_INSNS) {
+        return FALSE;
+    }
+    if (programs->programs_offset < sizeof(NET_VM_PROGRAMS) || (programs->programs_offset & 3) != 0 ||
+        programs->programs_offset > size ||
+        (size - programs->programs_offset) / sizeof(NET_VM_PROGRAM) < programs->program_count) {
+        return FALSE;
+    }
+    if (programs->insns_offset < sizeof(NET_VM_PROGRAMS) || (programs->insns_offset & 7) != 0 ||
+        programs->insns_offset > size ||
+        (size - programs->insns_offset) / sizeof(NET_VM_INSN) < programs->insn_count) {
+        return FALSE;
+    }
+
+    // Every program verified again: the interpreter trusts them
+    for (ULONG i = 0; i < programs->program_count; i++) {
+        const NET_VM_PROGRAM* program = ndisVmProgram(programs, i);
+        ULONG cost, error_pc;
+        if (program->action > NET_RULE_ACTION_RATE_LIMIT || program->first > programs->insn_count ||
+            program->count > programs->insn_count - program->first ||
+            ndisVmVerify(vmInsns(programs) + program->first, program->count, &cost, &error_pc) != NET_VM_OK ||
+            cost != program->cost) {
+            return FALSE;
+        }
+        total += cost;
+    }
+    return (BOOLEAN)(total == programs->cost);
+}
+
+ULONG ndisVmFrame(const NET_VM_PROGRAMS* programs, const UCHAR* frame, ULONG length, ULONG frame_length) {
+    NET_VM_CONTEXT context;
+
+    if (programs->program_count == 0) { return NET_CLS_NO_MATCH; }
+    ndisVmFrameContext(frame, length, frame_length, &context);
+    for (ULONG i = 0; i < programs->program_count; i++) {
+        const NET_VM_PROGRAM* program = ndisVmProgram(programs, i);
+        if (ndisVmRun(vmInsns(programs) + program->first, &context) != 0) { return i; }
+    }
+    return NET_CLS_NO_MATCH;
+}
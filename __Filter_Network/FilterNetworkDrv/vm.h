@@ -0,0 +1,166 @@
+#pragma once
+//
+// Filter programs: a small register machine for matches that neither the
+// header rules nor the content rules can express, shipped in the rule
+// image instead of as new driver code.
+//
+// A program has NET_VM_REGISTERS 32-bit registers, all 0 on entry, and
+// reads the first NET_VM_WINDOW bytes of the frame through four bases: the
+// frame, the network header, the transport header and the payload (both
+// only for TCP, UDP and SCTP, and not in later fragments). Loads
+// are big-endian; a load outside the window or from a base the frame does
+// not have ends the program with 0. It returns a value, and any value but
+// 0 is a match. Instructions are 8 bytes:
+//
+//      opcode  NET_VM_* | NET_VM_X when the operand is src instead of imm
+//      dst     register written or compared
+//      src     operand register; for loads the index register or NET_VM_NONE
+//      jump    forward offset of conditional jumps, back offset of NET_VM_NEXT,
+//              base of loads and NET_VM_LEN
+//      imm     operand; offset of loads; NET_VM_JA's offset; NET_VM_NEXT's count
+//
+// Jumps only go forward, except NET_VM_NEXT, which closes a counted loop:
+// while dst is below imm - 1 (imm at most NET_VM_LOOP_MAX) it adds 1 to dst
+// and jumps back over the jump instructions before it, so a loop counting
+// from 0 runs imm times and one starting anywhere else fewer. No
+// instruction in the body may write dst, and loops nest properly, so a
+// body runs at most imm times each time its enclosing loop comes round. ndisVmVerify checks all
+// of that and computes a program's cost: the most instructions it can
+// execute on any frame. The compiler (..\FilterNetworkCompiler, -p)
+// verifies programs as it assembles them, and the driver verifies them
+// again when it loads an image, so the interpreter itself checks nothing
+// but division by 0 and the bounds of its loads.
+//
+// The programs of an image run after the content rules, on the frames
+// nothing else matched, first to last; the first match decides the
+// frame's action and leaves an alert with NET_ALERT_F_PROGRAM.
+//
+
+#define NET_VM_TAG              '1grP'
+#define NET_VM_REGISTERS        8
+#define NET_VM_WINDOW           512         // frame bytes a program can read
+#define NET_VM_MAX_INSNS        1024        // per program
+#define NET_VM_MAX_COST         8192        // instructions executed, per program
+#define NET_VM_MAX_PROGRAMS     64
+#define NET_VM_LOOP_MAX         1024        // iterations of one loop
+#define NET_VM_NONE             0xFF        // no index register
+
+// NET_VM_INSN.opcode
+#define NET_VM_RET              0x00        // return imm (X: src)
+#define NET_VM_LDB              0x01        // dst = byte at base + index + imm
+#define NET_VM_LDH              0x02        // 16 bits
+#define NET_VM_LDW              0x03        // 32 bits
+#define NET_VM_LEN              0x04        // dst = window bytes from base on, 0 - no base
+#define NET_VM_META             0x05        // dst = frame field imm (NET_VM_META_*)
+#define NET_VM_MOV              0x06        // dst = operand
+#define NET_VM_ADD              0x07
+#define NET_VM_SUB              0x08
+#define NET_VM_MUL              0x09
+#define NET_VM_DIV              0x0A        // by 0 returns 0
+#define NET_VM_MOD              0x0B
+#define NET_VM_AND              0x0C
+#define NET_VM_OR               0x0D
+#define NET_VM_XOR              0x0E
+#define NET_VM_LSH              0x0F        // by operand & 31
+#define NET_VM_RSH              0x10
+#define NET_VM_NEG              0x11        // dst = -dst
+#define NET_VM_JA               0x12        // skip imm instructions
+#define NET_VM_JEQ              0x13        // skip jump instructions when dst == operand
+#define NET_VM_JNE              0x14
+#define NET_VM_JGT              0x15        // unsigned
+#define NET_VM_JGE              0x16
+#define NET_VM_JLT              0x17
+#define NET_VM_JLE              0x18
+#define NET_VM_JSET             0x19        // dst & operand
+#define NET_VM_NEXT             0x1A        // loop: if dst < imm - 1, dst += 1 and back jump instructions
+#define NET_VM_OPCODES          0x1B
+#define NET_VM_X                0x80
+
+// Load bases
+#define NET_VM_BASE_FRAME       0
+#define NET_VM_BASE_NETWORK     1
+#define NET_VM_BASE_TRANSPORT   2
+#define NET_VM_BASE_PAYLOAD     3
+#define NET_VM_BASES            4
+#define NET_VM_NO_BASE          0xFFFFFFFF
+
+// NET_VM_META fields
+#define NET_VM_META_ETHER_TYPE  0
+#define NET_VM_META_PROTOCOL    1           // 0 - not IP
+#define NET_VM_META_SOURCE_PORT 2           // 0 - no ports
+#define NET_VM_META_DEST_PORT   3
+#define NET_VM_META_LENGTH      4           // of the whole frame
+#define NET_VM_META_PAYLOAD     5           // payload bytes of the datagram, window or not
+#define NET_VM_META_COUNT       6
+
+// ndisVmVerify results
+#define NET_VM_OK               0
+#define NET_VM_E_LENGTH         1           // no instructions, or too many
+#define NET_VM_E_OPCODE         2
+#define NET_VM_E_REGISTER       3
+#define NET_VM_E_OPERAND        4           // base, meta field, shift or load offset out of range
+#define NET_VM_E_DIVIDE         5           // by a constant 0
+#define NET_VM_E_JUMP           6           // past the end
+#define NET_VM_E_LOOP           7           // count, back offset or nesting
+#define NET_VM_E_LOOP_REGISTER  8           // the body writes the loop's register
+#define NET_VM_E_END            9           // last instruction is not NET_VM_RET
+#define NET_VM_E_COST           10          // over NET_VM_MAX_COST
+
+typedef struct _NET_VM_INSN {
+    UCHAR   opcode;
+    UCHAR   dst;
+    UCHAR   src;
+    UCHAR   jump;
+    ULONG   imm;
+} NET_VM_INSN, * PNET_VM_INSN;
+
+// What a program sees of a frame
+typedef struct _NET_VM_CONTEXT {
+    const UCHAR*    data;
+    ULONG           length;                     // bytes at data, at most NET_VM_WINDOW
+    ULONG           base[NET_VM_BASES];         // offsets into data, NET_VM_NO_BASE - absent
+    ULONG           meta[NET_VM_META_COUNT];
+} NET_VM_CONTEXT, * PNET_VM_CONTEXT;
+
+typedef struct _NET_VM_PROGRAM {
+    UCHAR   action;                 // as NET_RULES.action
+    UCHAR   reserved[3];
+    ULONG   first;                  // instruction index in NET_VM_PROGRAMS
+    ULONG   count;
+    ULONG   cost;                   // from ndisVmVerify
+} NET_VM_PROGRAM, * PNET_VM_PROGRAM;
+
+typedef struct _NET_VM_PROGRAMS {
+    ULONG   size;                   // bytes, everything below included
+    ULONG   program_count;
+    ULONG   insn_count;
+    ULONG   cost;                   // of running every program
+    ULONG   programs_offset;        // NET_VM_PROGRAM[program_count]
+    ULONG   insns_offset;           // NET_VM_INSN[insn_count], 8-byte aligned
+} NET_VM_PROGRAMS, * PNET_VM_PROGRAMS;
+
+// NET_VM_OK, or the first problem found and the index of the instruction
+// in *error_pc. *cost is set for a valid program.
+ULONG ndisVmVerify(const NET_VM_INSN* code, ULONG count, PULONG cost, PULONG error_pc);
+
+// The context of the first length bytes of a frame of frame_length bytes
+// (length at most NET_VM_WINDOW)
+VOID ndisVmFrameContext(const UCHAR* frame, ULONG length, ULONG frame_length, PNET_VM_CONTEXT context);
+
+ULONG ndisVmRun(const NET_VM_INSN* code, const NET_VM_CONTEXT* context);
+
+// Packs program_count programs (first and count into code) into one
+// NETFLT_ALLOC block, verifying each; NULL when one does not verify, when
+// over NET_VM_MAX_PROGRAMS or out of memory.
+PNET_VM_PROGRAMS ndisBuildVmPrograms(const NET_VM_PROGRAM* programs, ULONG program_count, const NET_VM_INSN* code, ULONG insn_count);
+VOID ndisFreeVmPrograms(PNET_VM_PROGRAMS programs);
+BOOLEAN ndisValidateVmPrograms(const NET_VM_PROGRAMS* programs, ULONG size);
+
+static FORCEINLINE const NET_VM_PROGRAM* ndisVmProgram(const NET_VM_PROGRAMS* programs, ULONG index) {
+    return (const NET_VM_PROGRAM*)((const UCHAR*)programs + programs->programs_offset) + index;
+}
+
+// Index of the first program matching the first length bytes of a frame
+// of frame_length bytes, or NET_CLS_NO_MATCH. Reads at most NET_VM_WINDOW
+// bytes.
+ULONG ndisVmFrame(const NET_VM_PROGRAMS* programs, const UCHAR* frame, ULONG length, ULONG frame_length);
@@ -21,3 +21,7 @@ VOID FilterNetworkWrap::WRAP_FilterNetworkDrv_RestartAllInstances() { ptr_Filter
 VOID FilterNetworkWrap::WRAP_FilterNetworkDrv_RestartOneInstance() { ptr_FilterNetworkCtrl->FilterNetworkDrv_RestartOneInstance(); }
 
 VOID FilterNetworkWrap::WRAP_FilterNetworkDrv_EnumerateAllInstances() { ptr_FilterNetworkCtrl->FilterNetworkDrv_EnumerateAllInstances(); }
+
+VOID FilterNetworkWrap::WRAP_FilterNetworkDrv_QueryAllStat() { ptr_FilterNetworkCtrl->FilterNetworkDrv_QueryAllStat(); }
+
+VOID FilterNetworkWrap::WRAP_FilterNetworkDrv_ClearAllStat() { ptr_FilterNetworkCtrl->FilterNetworkDrv_ClearAllStat(); }
@@ -21,4 +21,6 @@ public:
     VOID WRAP_FilterNetworkDrv_RestartAllInstances();
     VOID WRAP_FilterNetworkDrv_RestartOneInstance();
     VOID WRAP_FilterNetworkDrv_EnumerateAllInstances();
+    VOID WRAP_FilterNetworkDrv_QueryAllStat();
+    VOID WRAP_FilterNetworkDrv_ClearAllStat();
 };